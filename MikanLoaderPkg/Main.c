@@ -1,4 +1,5 @@
 #include <Guid/FileInfo.h>
+#include <Library/BaseLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/MemoryAllocationLib.h>
 #include <Library/PrintLib.h>
@@ -10,6 +11,7 @@
 #include <Protocol/SimpleFileSystem.h>
 #include <Uefi.h>
 
+#include "../kernel/boot_timing.hpp"
 #include "../kernel/frame_buffer_config.hpp"
 #include "../kernel/memory_map.hpp"
 #include "elf.h"
@@ -170,29 +172,53 @@ void Halt(void) {
 }
 
 // すべてのLOADセグメントを1つのかたまりとみなし、その先頭と末尾を求める
-void CalcLoadAddressRange(Elf64_Ehdr* ehdr, UINT64* first, UINT64* last) {
-    Elf64_Phdr* phdr = (Elf64_Phdr*)((UINT64)ehdr + ehdr->e_phoff);
+void CalcLoadAddressRange(const Elf64_Phdr* phdr, Elf64_Half phnum, UINT64* first, UINT64* last) {
     *first = MAX_UINT64;
     *last = 0;
-    for (Elf64_Half i = 0; i < ehdr->e_phnum; i++) {
+    for (Elf64_Half i = 0; i < phnum; i++) {
         if (phdr[i].p_type != PT_LOAD) continue;
         *first = MIN(*first, phdr[i].p_vaddr);
         *last = MAX(*last, phdr[i].p_vaddr + phdr[i].p_memsz);
     }
 }
 
-// LOADセグメントを最終目的地へコピー
-void CopyLoadSegments(Elf64_Ehdr* ehdr) {
-    Elf64_Phdr* phdr = (Elf64_Phdr*)((UINT64)ehdr + ehdr->e_phoff);
-    for (Elf64_Half i = 0; i < ehdr->e_phnum; i++) {
+/// ファイルのoffsetバイト目からsizeバイトをbufferに読み込む
+EFI_STATUS ReadFileAt(EFI_FILE_PROTOCOL* file, UINT64 offset, UINTN size, VOID* buffer) {
+    EFI_STATUS status = file->SetPosition(file, offset);
+    if (EFI_ERROR(status)) {
+        return status;
+    }
+    // Read()は一度に全部を読むとは限らないので、読み終わるまで繰り返す
+    UINT8* p = (UINT8*)buffer;
+    while (size > 0) {
+        UINTN read_bytes = size;
+        status = file->Read(file, &read_bytes, p);
+        if (EFI_ERROR(status)) {
+            return status;
+        }
+        if (read_bytes == 0) { // ファイルの終わり
+            return EFI_END_OF_FILE;
+        }
+        p += read_bytes;
+        size -= read_bytes;
+    }
+    return EFI_SUCCESS;
+}
+
+// LOADセグメントをファイルから最終目的地へ直接読み込み、ファイルにない部分（.bss）は0で埋める
+EFI_STATUS LoadSegments(EFI_FILE_PROTOCOL* file, const Elf64_Phdr* phdr, Elf64_Half phnum) {
+    for (Elf64_Half i = 0; i < phnum; i++) {
         if (phdr[i].p_type != PT_LOAD) continue;
 
-        UINT64 segm_in_file = (UINT64)ehdr + phdr[i].p_offset;
-        CopyMem((VOID*)phdr[i].p_vaddr, (VOID*)segm_in_file, phdr[i].p_filesz);
+        EFI_STATUS status = ReadFileAt(file, phdr[i].p_offset, phdr[i].p_filesz, (VOID*)phdr[i].p_vaddr);
+        if (EFI_ERROR(status)) {
+            return status;
+        }
 
         UINTN remain_bytes = phdr[i].p_memsz - phdr[i].p_filesz;
         SetMem((VOID*)(phdr[i].p_vaddr + phdr[i].p_filesz), remain_bytes, 0);
     }
+    return EFI_SUCCESS;
 }
 
 /// ファイル内容をbufferに読み込む
@@ -262,6 +288,10 @@ EFI_STATUS ReadBlocks(EFI_BLOCK_IO_PROTOCOL* block_io, UINT32 media_id, UINTN re
 }
 
 EFI_STATUS EFIAPI UefiMain(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_table) {
+    // 各段階が終わったときのTSC（カーネルのbootprofコマンドで表示する）
+    struct BootLoaderTiming loader_timing = {{0}};
+    loader_timing.tsc[kLoaderStart] = AsmReadTsc();
+
     // メモリマップ取得
     CHAR8 memmap_buf[4096 * 4]; // 16KiB
     struct MemoryMap memmap = {sizeof(memmap_buf), memmap_buf, 0, 0, 0, 0};
@@ -302,6 +332,8 @@ EFI_STATUS EFIAPI UefiMain(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_tab
         }
     }
 
+    loader_timing.tsc[kLoaderMemoryMap] = AsmReadTsc();
+
     EFI_GRAPHICS_OUTPUT_PROTOCOL* gop;
     status = OpenGOP(image_handle, &gop);
     if (EFI_ERROR(status)) {
@@ -322,17 +354,29 @@ EFI_STATUS EFIAPI UefiMain(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_tab
         Halt();
     }
 
-    // カーネルファイルを一時領域に読み込み
-    VOID* kernel_buffer;
-    status = ReadFile(kernel_file, &kernel_buffer);
+    // ELFヘッダとプログラムヘッダだけを読み込む（ファイル全体を一時領域に読み込むことはしない）
+    Elf64_Ehdr kernel_ehdr;
+    status = ReadFileAt(kernel_file, 0, sizeof(kernel_ehdr), &kernel_ehdr);
     if (EFI_ERROR(status)) {
-        Print(L"error: %r", status);
+        Print(L"failed to read kernel ELF header: %r\n", status);
+        Halt();
+    }
+    Elf64_Phdr kernel_phdr[16];
+    if (kernel_ehdr.e_phentsize != sizeof(Elf64_Phdr) ||
+        kernel_ehdr.e_phnum > sizeof(kernel_phdr) / sizeof(kernel_phdr[0])) {
+        Print(L"unsupported program headers: %u x %u bytes\n",
+              kernel_ehdr.e_phnum, kernel_ehdr.e_phentsize);
+        Halt();
+    }
+    status = ReadFileAt(kernel_file, kernel_ehdr.e_phoff,
+                        sizeof(Elf64_Phdr) * kernel_ehdr.e_phnum, kernel_phdr);
+    if (EFI_ERROR(status)) {
+        Print(L"failed to read program headers: %r\n", status);
         Halt();
     }
 
-    Elf64_Ehdr* kernel_ehdr = (Elf64_Ehdr*)kernel_buffer;
     UINT64 kernel_first_addr, kernel_last_addr;
-    CalcLoadAddressRange(kernel_ehdr, &kernel_first_addr, &kernel_last_addr);
+    CalcLoadAddressRange(kernel_phdr, kernel_ehdr.e_phnum, &kernel_first_addr, &kernel_last_addr);
 
     // カーネルファイルをコピーする領域を確保
     // 単位をバイトからページ（4KiB(0x1000) / page）に変換
@@ -343,18 +387,21 @@ EFI_STATUS EFIAPI UefiMain(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_tab
         Print(L"failed to allocate pages: %r\n", status);
         Halt();
     }
-    // 一時領域から最終目的地（ld.lldの--image-baseで指定されたアドレス）へコピー
-    CopyLoadSegments(kernel_ehdr);
-    Print(L"Kernel: 0x%0lx - 0x%0xlx\n", kernel_first_addr, kernel_last_addr);
-    status = gBS->FreePool(kernel_buffer);
+    // ファイルから最終目的地（ld.lldの--image-baseで指定されたアドレス）へ直接読み込む
+    status = LoadSegments(kernel_file, kernel_phdr, kernel_ehdr.e_phnum);
     if (EFI_ERROR(status)) {
-        Print(L"failed to free pool: %r\n", status);
+        Print(L"failed to load kernel segments: %r\n", status);
         Halt();
     }
+    Print(L"Kernel: 0x%0lx - 0x%0xlx\n", kernel_first_addr, kernel_last_addr);
+    kernel_file->Close(kernel_file);
+    loader_timing.tsc[kLoaderKernel] = AsmReadTsc();
 
     // カーネルにファイルシステムを構築するため、ボリュームイメージをメモリに読み込む
     // ボリュームイメージ : ブロックデバイスの中身を記録したデータ
     VOID* volume_image;
+    // 読み込んだバイト数。カーネルはこれがボリュームより小さければ、残りをブロックデバイスから読む
+    UINTN volume_bytes;
     EFI_FILE_PROTOCOL* volume_file;
     status = root_dir->Open(
         root_dir,
@@ -369,6 +416,8 @@ EFI_STATUS EFIAPI UefiMain(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_tab
             Print(L"failed to read volume file: %r", status);
             Halt();
         }
+        // ファイル全体を読み込んだ
+        volume_bytes = MAX_UINTN;
     } else {
         // fat_diskがなければ起動メディア全体を読み込む
         // UEFI BIOSのBlock I/O Protocolを利用する
@@ -382,8 +431,8 @@ EFI_STATUS EFIAPI UefiMain(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_tab
         // ブロックデバイスの情報
         // ブロックデバイス : データ領域が固定の大きさを持つブロックに分割されている記憶装置（SSD, USBなど）
         EFI_BLOCK_IO_MEDIA* media = block_io->Media;
-        UINTN volume_bytes = (UINTN)media->BlockSize * (media->LastBlock + 1);
-        // 上限は32MiB
+        volume_bytes = (UINTN)media->BlockSize * (media->LastBlock + 1);
+        // 上限は32MiB（残りはカーネルがブロックデバイスから読む）
         if (volume_bytes > 32 * 1024 * 1024) {
             volume_bytes = 32 * 1024 * 1024;
         }
@@ -399,6 +448,8 @@ EFI_STATUS EFIAPI UefiMain(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_tab
         }
     }
 
+    loader_timing.tsc[kLoaderVolume] = AsmReadTsc();
+
     // ブートサービス停止
     status = gBS->ExitBootServices(image_handle, memmap.map_key);
     if (EFI_ERROR(status)) {
@@ -413,6 +464,7 @@ EFI_STATUS EFIAPI UefiMain(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_tab
             Halt();
         }
     }
+    loader_timing.tsc[kLoaderExitBootServices] = AsmReadTsc();
 
     // 画面情報
     struct FrameBufferConfig frame_buffer_config = {
@@ -444,14 +496,16 @@ EFI_STATUS EFIAPI UefiMain(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE* system_tab
     }
 
     // カーネル起動
-    UINT64 entry_addr = *(UINT64*)(kernel_first_addr + 24);
+    UINT64 entry_addr = kernel_ehdr.e_entry;
     // エントリーポイントをC言語の関数として解釈させる
     typedef void EntryPointType(const struct FrameBufferConfig*,
                                 const struct MemoryMap*,
                                 const VOID*,
-                                VOID*);
+                                VOID*,
+                                UINTN,
+                                const struct BootLoaderTiming*);
     EntryPointType* entry_point = (EntryPointType*)entry_addr;
-    entry_point(&frame_buffer_config, &memmap, acpi_table, volume_image);
+    entry_point(&frame_buffer_config, &memmap, acpi_table, volume_image, volume_bytes, &loader_timing);
 
     // エントリーポイント呼び出しが上手くいけば、以下は実行されないはず
     Print(L"All done\n");
@@ -82,6 +82,9 @@ extern "C" void main(int argc, char** arv) {
     int ball_dir = 0; // degree
     int ball_dx = 0, ball_dy = 0;
 
+    // フレームごとにタイムアウトする周期タイマ
+    SyscallCreatePeriodicTimer(TIMER_UNIT_USEC, 1, 1000000 / kFrameRate);
+
     while (true) { // main loop
         // 画面全体をクリア
         SyscallWinFillRectangle(layer_id | LAYER_NO_REDRAW, 4, 24, kCanvasWidth, kCanvasHeight, 0);
@@ -95,15 +98,6 @@ extern "C" void main(int argc, char** arv) {
         }
         SyscallWinRedraw(layer_id);
 
-        static unsigned long prev_timeout = 0;
-        if (prev_timeout == 0) {
-            const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, 1000 / kFrameRate);
-            prev_timeout = timeout.value;
-        } else {
-            prev_timeout += 1000 / kFrameRate;
-            SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout);
-        }
-
         AppEvent events[1];
         while (true) { // event loop
             SyscallReadEvent(events, 1);
@@ -1,5 +1,8 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+
+#include "../syscall.h"
 
 extern "C" void main(int argc, char** argv) {
     if (argc < 3) {
@@ -7,26 +10,11 @@ extern "C" void main(int argc, char** argv) {
         exit(1);
     }
 
-    FILE* fp_src = fopen(argv[1], "r");
-    if (fp_src == nullptr) {
-        printf("failed to open for read: %s\n", argv[1]);
-        exit(1);
-    }
-
-    FILE* fp_dest = fopen(argv[2], "w");
-    if (fp_dest == nullptr) {
-        printf("failed to open for write: %s\n", argv[2]);
+    // 読み書きを繰り返さず、カーネルの中でクラスタごとにコピーしてもらう
+    SyscallResult res = SyscallCopyFile(argv[1], argv[2]);
+    if (res.error) {
+        printf("failed to copy %s to %s: %s\n", argv[1], argv[2], strerror(res.error));
         exit(1);
     }
-
-    char buf[256];
-    size_t bytes;
-    while ((bytes = fread(buf, 1, sizeof(buf), fp_src)) > 0) {
-        const size_t written = fwrite(buf, 1, bytes, fp_dest);
-        if (bytes != written) {
-            printf("failed to write to %s\n", argv[2]);
-            exit(1);
-        }
-    }
     exit(0);
 }
@@ -182,23 +182,26 @@ void DrawSurface(uint64_t layer_id, int sur) {
     }
 }
 
+// 前のフレームの区切りからms後まで眠り、終了を求められていたら true を返す
+// 眠るのにタイマのイベントを使わないので、他のイベントを取りこぼさない。イベントは溜まっている分だけ調べる
 bool Sleep(unsigned long ms) {
-    static unsigned long prev_timeout = 0;
-    if (prev_timeout == 0) {
-        const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, ms);
-        prev_timeout = timeout.value;
-    } else {
-        prev_timeout += ms;
-        SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout);
+    static uint64_t next_ns = 0;
+    const uint64_t now = ReadTimeNs();
+    // 描画が間に合わなかったら、遅れを取り戻そうとせずに今から数え直す
+    if (next_ns < now) {
+        next_ns = now;
     }
-
-    AppEvent events[1];
-    while (true) {
-        SyscallReadEvent(events, 1);
-        if (events[0].type == AppEvent::kTimerTimeout) {
-            return false;
-        } else if (events[0].type == AppEvent::kQuit) {
-            return true;
+    next_ns += ms * 1000000;
+    SyscallSleep(next_ns - now);
+
+    while (SyscallWait(nullptr, 0, 0).value & WAIT_READY_EVENT) {
+        AppEvent events[8];
+        auto [n, err] = SyscallReadEvent(events, 8);
+        for (size_t i = 0; i < n; ++i) {
+            if (events[i].type == AppEvent::kQuit) {
+                return true;
+            }
         }
     }
+    return false;
 }
@@ -43,5 +43,11 @@ extern "C" void main(int argc, char** argv) {
         }
     }
     printf("the number of '%c' (0x%02x) = %lu\n", ch, ch, num);
+
+    PageFaultStat stat;
+    if (res = SyscallGetFaultStat(&stat, 0); !res.error) {
+        printf("page faults: demand %lu, avoided %lu, %lu cycles\n",
+               stat.demand_faults, stat.faults_avoided, stat.cycles);
+    }
     exit(0);
 }
@@ -0,0 +1,176 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "../syscall.h"
+
+/// Usage: gbench [<workload>...]
+///
+/// 描画とシステムコールの決まった量の処理を実行し、1つの処理あたりの時間を測る
+/// 結果は1行に1つずつ「bench名前 ops=回数 ns=合計 ns_per_op=... ops_per_sec=...」の形で標準出力に書く
+/// 時刻は時刻のページ（ReadTimeNs）から読むので、計測そのものにはシステムコールを使わない
+
+namespace {
+    constexpr int kWidth = 400, kHeight = 300;
+    /// ウィンドウの中身の左上
+    constexpr int kLeft = 4, kTop = 24;
+    /// WinBatchで一度に渡す描画命令の数
+    constexpr int kBatchSize = 64;
+
+    uint64_t g_layer_id;
+
+    /// 短い乱数列（計測のたびに同じ座標を使う）
+    uint32_t g_rand_state = 1;
+    int Rand(int n) {
+        g_rand_state = g_rand_state * 1103515245 + 12345;
+        return (g_rand_state >> 16) % n;
+    }
+
+    void FillSmall(int i) {
+        SyscallWinFillRectangle(g_layer_id | LAYER_NO_REDRAW, kLeft + Rand(kWidth - 8), kTop + Rand(kHeight - 8),
+                                8, 8, i * 0x010203);
+    }
+
+    void FillMedium(int i) {
+        SyscallWinFillRectangle(g_layer_id | LAYER_NO_REDRAW, kLeft + Rand(kWidth - 64), kTop + Rand(kHeight - 64),
+                                64, 64, i * 0x010203);
+    }
+
+    void FillFull(int i) {
+        SyscallWinFillRectangle(g_layer_id | LAYER_NO_REDRAW, kLeft, kTop, kWidth, kHeight, i * 0x010203);
+    }
+
+    void Line(int i) {
+        SyscallWinDrawLine(g_layer_id | LAYER_NO_REDRAW, kLeft + Rand(kWidth), kTop + Rand(kHeight),
+                           kLeft + Rand(kWidth), kTop + Rand(kHeight), i * 0x030201);
+    }
+
+    void TextAscii(int i) {
+        SyscallWinWriteString(g_layer_id | LAYER_NO_REDRAW, kLeft + Rand(kWidth - 200), kTop + Rand(kHeight - 16),
+                              0x000000, "The quick brown fox jumps");
+    }
+
+    void TextUnicode(int i) {
+        SyscallWinWriteString(g_layer_id | LAYER_NO_REDRAW, kLeft + Rand(kWidth - 200), kTop + Rand(kHeight - 16),
+                              0x000000, "みかんの皮をむいて食べた。");
+    }
+
+    void Redraw(int i) {
+        SyscallWinRedraw(g_layer_id);
+    }
+
+    /// WinBatchと比べるための、1つずつ呼ぶ16x16の塗りつぶし
+    void FillUnbatched(int i) {
+        SyscallWinFillRectangle(g_layer_id | LAYER_NO_REDRAW, kLeft + Rand(kWidth - 16), kTop + Rand(kHeight - 16),
+                                16, 16, i * 0x010203);
+    }
+
+    /// kBatchSize個の16x16の塗りつぶしを1回のWinBatchで描く（1回でkBatchSize個の処理と数える）
+    void FillBatched(int i) {
+        WinCommand cmds[kBatchSize];
+        for (int j = 0; j < kBatchSize; j++) {
+            cmds[j] = {WIN_CMD_FILL, static_cast<uint32_t>((i + j) * 0x010203),
+                       kLeft + Rand(kWidth - 16), kTop + Rand(kHeight - 16), 16, 16, nullptr};
+        }
+        SyscallWinBatch(g_layer_id | LAYER_NO_REDRAW, cmds, kBatchSize);
+    }
+
+    /// 何もしないに近いシステムコールの往復
+    void NullSyscall(int i) {
+        SyscallGetCurrentTick();
+    }
+
+    /// すぐにタイムアウトするタイマを作り、そのイベントを受け取るまで
+    /// イベントは次のタイマ割り込みで届くので、タイマの刻みの分だけ長くなる
+    void TimerEvent(int i) {
+        SyscallCreateTimer(TIMER_ONESHOT_REL | TIMER_UNIT_USEC, 1, 0);
+        AppEvent events[1];
+        while (true) {
+            auto [n, err] = SyscallReadEvent(events, 1);
+            if (err) {
+                fprintf(stderr, "ReadEvent failed: %s\n", strerror(err));
+                exit(1);
+            }
+            if (n > 0 && events[0].type == AppEvent::kTimerTimeout) {
+                return;
+            }
+            if (n > 0 && events[0].type == AppEvent::kQuit) {
+                SyscallCloseWindow(g_layer_id);
+                exit(0);
+            }
+        }
+    }
+
+    struct Workload {
+        const char* name;
+        void (*func)(int i);
+        /// funcを呼ぶ回数
+        int iterations;
+        /// 1回のfuncで行う処理の数
+        int ops_per_call;
+    };
+
+    const Workload kWorkloads[] = {
+        {"fill_8x8", FillSmall, 20000, 1},
+        {"fill_64x64", FillMedium, 10000, 1},
+        {"fill_full", FillFull, 500, 1},
+        {"line", Line, 10000, 1},
+        {"text_ascii", TextAscii, 5000, 1},
+        {"text_unicode", TextUnicode, 5000, 1},
+        {"redraw_full", Redraw, 500, 1},
+        {"fill_16x16_unbatched", FillUnbatched, 10000, 1},
+        {"fill_16x16_batched", FillBatched, 10000 / kBatchSize, kBatchSize},
+        {"null_syscall", NullSyscall, 100000, 1},
+        {"timer_event", TimerEvent, 200, 1},
+    };
+
+    bool Selected(const char* name, int argc, char** argv) {
+        if (argc <= 1) {
+            return true;
+        }
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], name) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Run(const Workload& w) {
+        // 1回目は遅くなりがち（ページの割り当てやキャッシュ）なので、少しだけ空回しする
+        for (int i = 0; i < w.iterations / 100 + 1; i++) {
+            w.func(i);
+        }
+
+        g_rand_state = 1;
+        const uint64_t start = ReadTimeNs();
+        for (int i = 0; i < w.iterations; i++) {
+            w.func(i);
+        }
+        const uint64_t elapsed = ReadTimeNs() - start;
+
+        const uint64_t ops = static_cast<uint64_t>(w.iterations) * w.ops_per_call;
+        const uint64_t ns = elapsed > 0 ? elapsed : 1;
+        printf("bench %s ops=%lu ns=%lu ns_per_op=%lu ops_per_sec=%lu\n",
+               w.name, ops, elapsed, ns / ops, ops * 1000000000 / ns);
+    }
+} // namespace
+
+extern "C" void main(int argc, char** argv) {
+    auto [layer_id, err] = SyscallOpenWindow(kWidth + 8, kHeight + 28, 10, 10, "gbench");
+    if (err) {
+        fprintf(stderr, "%s\n", strerror(err));
+        exit(1);
+    }
+    g_layer_id = layer_id;
+    SyscallWinFillRectangle(g_layer_id, kLeft, kTop, kWidth, kHeight, 0xffffff);
+
+    for (const auto& w : kWorkloads) {
+        if (Selected(w.name, argc, argv)) {
+            Run(w);
+        }
+    }
+
+    SyscallCloseWindow(g_layer_id);
+    exit(0);
+}
@@ -1,6 +1,288 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <emmintrin.h>
+#include <fcntl.h>
 #include <regex>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "../syscall.h"
+
+namespace {
+    /// 正規表現の特別な文字（ECMAScript）
+    bool IsMeta(char c) {
+        return strchr("^$\\.*+?()[]{}|", c) != nullptr;
+    }
+
+    /// パターンにマッチする行が必ず含む文字列のうち、最も長いものを探す（見つからなければ空）
+    /// 選択（|）を含むパターンは諦める。グループや文字クラスの中は見ない
+    std::string RequiredLiteral(const char* pattern, bool* pure_literal) {
+        *pure_literal = true;
+        for (const char* p = pattern; *p; ++p) {
+            if (IsMeta(*p)) {
+                *pure_literal = false;
+            }
+            if (*p == '|') {
+                return "";
+            }
+        }
+        if (*pure_literal) {
+            return pattern;
+        }
+
+        std::string best, run;
+        auto cut = [&]() {
+            if (run.length() > best.length()) {
+                best = run;
+            }
+            run.clear();
+        };
+        for (const char* p = pattern; *p; ++p) {
+            const char c = *p;
+            if (c == '\\') {
+                // \. などは文字そのもの。\d や \b などは文字列の一部にしない
+                if (p[1] && !isalnum(static_cast<unsigned char>(p[1]))) {
+                    run += *++p;
+                } else {
+                    cut();
+                    if (p[1]) {
+                        ++p;
+                    }
+                }
+            } else if (c == '*' || c == '?' || c == '{') {
+                // 直前の1文字は現れないかもしれない
+                if (!run.empty()) {
+                    run.pop_back();
+                }
+                cut();
+                if (c == '{') {
+                    while (p[1] && *p != '}') {
+                        ++p;
+                    }
+                }
+            } else if (c == '[') {
+                cut();
+                // 文字クラスは入れ子にならない。先頭の ] は文字として扱われる
+                ++p;
+                if (*p == '^') {
+                    ++p;
+                }
+                if (*p == ']') {
+                    ++p;
+                }
+                while (*p && *p != ']') {
+                    if (*p == '\\' && p[1]) {
+                        ++p;
+                    }
+                    ++p;
+                }
+                if (*p == '\0') {
+                    break;
+                }
+            } else if (c == '(') {
+                cut();
+                int depth = 0;
+                for (; *p; ++p) {
+                    if (*p == '\\' && p[1]) {
+                        ++p;
+                    } else if (*p == '[') {
+                        // グループの中の文字クラスにある括弧は数えない
+                        while (p[1] && p[1] != ']') {
+                            ++p;
+                        }
+                    } else if (*p == '(') {
+                        ++depth;
+                    } else if (*p == ')' && --depth == 0) {
+                        break;
+                    }
+                }
+                if (*p == '\0') {
+                    break;
+                }
+            } else if (IsMeta(c)) { // . ^ $ + ) ] }
+                cut();
+            } else {
+                run += c;
+            }
+        }
+        cut();
+        return best;
+    }
+
+    /// [p, end) からcを探す。SSE2で16バイトずつ比べる
+    const char* FindByte(const char* p, const char* end, char c) {
+        const __m128i needle = _mm_set1_epi8(c);
+        while (end - p >= 16) {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+            if (mask) {
+                return p + __builtin_ctz(mask);
+            }
+            p += 16;
+        }
+        for (; p < end; ++p) {
+            if (*p == c) {
+                return p;
+            }
+        }
+        return nullptr;
+    }
+
+    /// [p, end) からliteralを探す。先頭の文字で候補を絞ってから比べる
+    const char* FindLiteral(const char* p, const char* end, const std::string& literal) {
+        const size_t len = literal.length();
+        while (static_cast<size_t>(end - p) >= len) {
+            p = FindByte(p, end - len + 1, literal[0]);
+            if (p == nullptr) {
+                return nullptr;
+            }
+            if (memcmp(p + 1, literal.data() + 1, len - 1) == 0) {
+                return p;
+            }
+            ++p;
+        }
+        return nullptr;
+    }
+
+    /// マッチした行をIoVecに貯め、SyscallWriteVでまとめて書き込む
+    /// 入力のバッファを指すだけなのでコピーしない。連続する行は1つにつなげる
+    class Output {
+    public:
+        void Add(const char* p, size_t len) {
+            if (num_iovs_ > 0) {
+                IoVec& last = iovs_[num_iovs_ - 1];
+                if (static_cast<const char*>(last.base) + last.len == p) {
+                    last.len += len;
+                    return;
+                }
+            }
+            if (num_iovs_ == kMaxIovs) {
+                Flush();
+            }
+            iovs_[num_iovs_++] = {const_cast<char*>(p), len};
+        }
+
+        void Flush() {
+            size_t i = 0;
+            while (i < num_iovs_) {
+                SyscallResult res = SyscallWriteV(1, &iovs_[i], num_iovs_ - i);
+                if (res.error) {
+                    exit(1);
+                }
+                // 途中までしか書けなければ、残りから続ける
+                size_t written = res.value;
+                while (i < num_iovs_ && written >= iovs_[i].len) {
+                    written -= iovs_[i].len;
+                    ++i;
+                }
+                if (i < num_iovs_) {
+                    iovs_[i].base = static_cast<char*>(iovs_[i].base) + written;
+                    iovs_[i].len -= written;
+                }
+            }
+            num_iovs_ = 0;
+        }
+
+    private:
+        static const size_t kMaxIovs = 256;
+        IoVec iovs_[kMaxIovs];
+        size_t num_iovs_ = 0;
+    };
+
+    const char* MapInput(const char* path, size_t* size) {
+        SyscallResult res = SyscallOpenFile(path, O_RDONLY);
+        if (res.error) {
+            fprintf(stderr, "failed to open: %s\n", path);
+            exit(1);
+        }
+        res = SyscallMapFile(res.value, size, 0);
+        if (res.error) {
+            fprintf(stderr, "%s: %s\n", strerror(res.error), path);
+            exit(1);
+        }
+        SyscallMapAdvise(reinterpret_cast<void*>(res.value), *size, MAP_ADVICE_SEQUENTIAL);
+        return reinterpret_cast<const char*>(res.value);
+    }
+
+    /// コンパイルしたパターンと、マッチする行が必ず含む文字列
+    struct Matcher {
+        std::regex pattern;
+        std::string literal;
+        /// パターンに特別な文字がない（literalを含めばマッチ）
+        bool pure_literal;
+    };
+
+    /// [data, end) の行のうちマッチするものをoutに加える
+    void MatchLines(const Matcher& m, const char* data, const char* end, Output& out) {
+        const char* line = data;
+        while (line < end) {
+            if (!m.literal.empty()) {
+                // 必ず含まれる文字列がなければ、それより後ろの行はマッチしない
+                const char* hit = FindLiteral(line, end, m.literal);
+                if (hit == nullptr) {
+                    return;
+                }
+                // 見つかった位置を含む行の先頭まで戻る
+                const char* head = hit;
+                while (head > line && head[-1] != '\n') {
+                    --head;
+                }
+                line = head;
+            }
+            const char* nl = static_cast<const char*>(memchr(line, '\n', end - line));
+            const char* line_end = nl ? nl + 1 : end;
+            const char* text_end = nl ? nl : end;
+            if (m.pure_literal || std::regex_search(line, text_end, m.pattern)) {
+                out.Add(line, line_end - line);
+            }
+            line = line_end;
+        }
+    }
+
+    /// 標準入力はマップできないので、大きく読んでは行の切れ目までを調べる
+    void MatchStream(const Matcher& m, int fd, Output& out) {
+        std::vector<char> buf(65536);
+        size_t size = 0;
+        while (true) {
+            if (size == buf.size()) { // 1行がバッファに収まらない
+                buf.resize(buf.size() * 2);
+            }
+            const ssize_t n = read(fd, buf.data() + size, buf.size() - size);
+            if (n < 0) {
+                fprintf(stderr, "failed to read stdin: %s\n", strerror(errno));
+                exit(1);
+            }
+            if (n == 0) {
+                break;
+            }
+            size += n;
+
+            const char* last_nl = nullptr;
+            for (size_t i = size; i > 0; --i) {
+                if (buf[i - 1] == '\n') {
+                    last_nl = &buf[i - 1];
+                    break;
+                }
+            }
+            if (last_nl) {
+                const size_t done = last_nl + 1 - buf.data();
+                MatchLines(m, buf.data(), buf.data() + done, out);
+                // 出力はbufを指しているので、書き込んでから詰める
+                out.Flush();
+                memmove(buf.data(), buf.data() + done, size - done);
+                size -= done;
+            }
+        }
+        MatchLines(m, buf.data(), buf.data() + size, out);
+        out.Flush();
+    }
+} // namespace
 
 extern "C" void main(int argc, char** argv) {
     if (argc < 2) {
@@ -8,19 +290,19 @@ extern "C" void main(int argc, char** argv) {
         exit(1);
     }
 
-    std::regex pattern(argv[1]);
-    FILE* fp = stdin;
-    if (argc >= 3 && (fp = fopen(argv[2], "r")) == nullptr) {
-        fprintf(stderr, "failed to open: %s\n", argv[2]);
-        exit(1);
-    }
+    // パターンは一度だけコンパイルし、すべての行で使い回す
+    static Matcher m;
+    m.pattern = std::regex(argv[1]);
+    m.literal = RequiredLiteral(argv[1], &m.pure_literal);
 
-    char line[256];
-    while (fgets(line, sizeof(line), fp)) {
-        std::cmatch match;
-        if (std::regex_search(line, match, pattern)) {
-            printf("%s", line);
-        }
+    static Output out;
+    if (argc >= 3) {
+        size_t size;
+        const char* data = MapInput(argv[2], &size);
+        MatchLines(m, data, data + size, out);
+        out.Flush();
+    } else {
+        MatchStream(m, 0, out);
     }
 
     exit(0);
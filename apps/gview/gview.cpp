@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -25,6 +27,8 @@ std::tuple<int, uint8_t*, size_t> MapFile(const char* filepath) {
         fprintf(stderr, "%s\n", strerror(res.error));
         exit(1);
     }
+    // 画像のデコードではファイル全体を読むので、まとめて読み込んでおく
+    SyscallMapAdvise(reinterpret_cast<void*>(res.value), filesize, MAP_ADVICE_WILLNEED);
 
     return {fd, reinterpret_cast<uint8_t*>(res.value), filesize};
 }
@@ -43,57 +47,137 @@ void WaitEvent() {
     }
 }
 
-uint32_t GetColorRGB(unsigned char* image_data) {
-    return static_cast<uint32_t>(image_data[0]) << 16 | // R
-           static_cast<uint32_t>(image_data[1]) << 8 |  // G
-           static_cast<uint32_t>(image_data[2]);        // B
+/// stbiの1ピクセルのバイト数に対応する、SyscallWinBlitの形式
+int ImageFormat(int bytes_per_pixel) {
+    switch (bytes_per_pixel) {
+    case 1: return WIN_IMAGE_GRAY8;
+    case 3: return WIN_IMAGE_RGB888;
+    default: return WIN_IMAGE_RGBA8888;
+    }
 }
 
-uint32_t GetColorGray(unsigned char* image_data) {
-    const uint32_t gray = image_data[0];
-    return gray << 16 | gray << 8 | gray;
+/// 縮小せずに表示する画像の大きさの上限。これを超える画像は収まるまで整数分の1に縮める
+const int kMaxAutoWidth = 1024, kMaxAutoHeight = 720;
+/// 一度にウィンドウへ書き込むタイルの行数。書くたびに再描画するので、大きな画像でも上から順に見えてくる
+const int kTileRows = 64;
+
+int AutoScale(int width, int height) {
+    int scale = 1;
+    while (width / scale > kMaxAutoWidth || height / scale > kMaxAutoHeight) {
+        ++scale;
+    }
+    return scale;
+}
+
+/// src（src_w x src_hピクセル）のscale x scaleの升目を平均して、dstの行[y0, y1)を作る
+void Downscale(const uint8_t* src, int src_w, int bytes_per_pixel, int scale,
+               uint8_t* dst, int dst_w, int y0, int y1) {
+    const size_t src_stride = static_cast<size_t>(src_w) * bytes_per_pixel;
+    const size_t dst_stride = static_cast<size_t>(dst_w) * bytes_per_pixel;
+    const int area = scale * scale;
+    for (int y = y0; y < y1; ++y) {
+        uint8_t* out = dst + y * dst_stride;
+        for (int x = 0; x < dst_w; ++x) {
+            for (int c = 0; c < bytes_per_pixel; ++c) {
+                int sum = 0;
+                for (int dy = 0; dy < scale; ++dy) {
+                    const uint8_t* in = src + (static_cast<size_t>(y) * scale + dy) * src_stride +
+                                        static_cast<size_t>(x) * scale * bytes_per_pixel + c;
+                    for (int dx = 0; dx < scale; ++dx) {
+                        sum += in[dx * bytes_per_pixel];
+                    }
+                }
+                out[x * bytes_per_pixel + c] = sum / area;
+            }
+        }
+    }
+}
+
+void PrintUsage(const char* name) {
+    fprintf(stderr, "Usage: %s [-s <scale>] <file>\n", name);
+    fprintf(stderr, "  -s <scale>  show the image at 1/<scale> size (default: fit to %dx%d)\n",
+            kMaxAutoWidth, kMaxAutoHeight);
 }
 
 extern "C" void main(int argc, char** argv) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <file>\n", argv[0]);
+    int scale = 0; // 0なら画像の大きさから決める
+    int argi = 1;
+    if (argi + 1 < argc && strcmp(argv[argi], "-s") == 0) {
+        scale = atoi(argv[argi + 1]);
+        if (scale <= 0) {
+            PrintUsage(argv[0]);
+            exit(1);
+        }
+        argi += 2;
+    }
+    if (argi >= argc) {
+        PrintUsage(argv[0]);
         exit(1);
     }
 
     int width, height, bytes_per_pixel;
-    const char* filepath = argv[1];
+    const char* filepath = argv[argi];
     const auto [fd, content, filesize] = MapFile(filepath);
 
-    unsigned char* image_data = stbi_load_from_memory(content, filesize, &width, &height, &bytes_per_pixel, 0);
-    if (image_data == nullptr) {
+    // 灰色と不透明度の2バイトには対応する形式がないので、灰色だけにして読む
+    int comp = 0;
+    if (!stbi_info_from_memory(content, filesize, &width, &height, &comp)) {
         fprintf(stderr, "failed to load image: %s\n", stbi_failure_reason());
         exit(1);
     }
-
-    fprintf(stderr, "%dx%d, %d bytes/pixel\n", width, height, bytes_per_pixel);
-    auto get_color = GetColorRGB;
-    if (bytes_per_pixel <= 2) {
-        get_color = GetColorGray;
+    comp = comp == 2 ? 1 : 0;
+    if (scale == 0) {
+        scale = AutoScale(width, height);
     }
+    const int view_w = std::max(width / scale, 1);
+    const int view_h = std::max(height / scale, 1);
 
-    const char* last_slash = strchr(filepath, '/');
+    // デコードには時間がかかるので、先にウィンドウを出しておく
+    const char* last_slash = strrchr(filepath, '/');
     const char* filename = last_slash ? &last_slash[1] : filepath;
-    SyscallResult window = SyscallOpenWindow(8 + width, 28 + height, 10, 10, filename);
+    SyscallResult window = SyscallOpenWindow(8 + view_w, 28 + view_h, 10, 10, filename);
     if (window.error) {
         fprintf(stderr, "%s\n", strerror(window.error));
         exit(1);
     }
     const uint64_t layer_id = window.value;
+    SyscallWinFillRectangle(layer_id, 4, 24, view_w, view_h, 0x808080);
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            uint32_t c = get_color(&image_data[bytes_per_pixel * (y * width + x)]);
-            SyscallWinFillRectangle(layer_id | LAYER_NO_REDRAW,
-                                    4 + x, 24 + y, 1, 1, c);
+    unsigned char* image_data = stbi_load_from_memory(content, filesize, &width, &height, &bytes_per_pixel, comp);
+    if (image_data == nullptr) {
+        fprintf(stderr, "failed to load image: %s\n", stbi_failure_reason());
+        SyscallCloseWindow(layer_id);
+        exit(1);
+    }
+    if (comp != 0) {
+        bytes_per_pixel = comp;
+    }
+    fprintf(stderr, "%dx%d, %d bytes/pixel, 1/%d\n", width, height, bytes_per_pixel, scale);
+
+    // 縮めるときは縮めた画像だけを残し、元の画像のメモリはすぐに返す
+    uint8_t* view = image_data;
+    if (scale > 1) {
+        view = static_cast<uint8_t*>(malloc(static_cast<size_t>(view_w) * view_h * bytes_per_pixel));
+        if (view == nullptr) {
+            fprintf(stderr, "%s\n", strerror(ENOMEM));
+            SyscallCloseWindow(layer_id);
+            exit(1);
         }
     }
-
-    SyscallWinRedraw(layer_id);
+    const size_t stride = static_cast<size_t>(view_w) * bytes_per_pixel;
+    const int format = ImageFormat(bytes_per_pixel);
+    for (int y = 0; y < view_h; y += kTileRows) {
+        const int rows = std::min(kTileRows, view_h - y);
+        if (scale > 1) {
+            Downscale(image_data, width, bytes_per_pixel, scale, view, view_w, y, y + rows);
+        }
+        SyscallWinBlit(layer_id | LAYER_NO_REDRAW, 4, 24 + y, view_w, rows,
+                       view + y * stride, stride, format);
+        SyscallWinRedraw(layer_id);
+    }
+    if (scale > 1) {
+        stbi_image_free(image_data);
+    }
     WaitEvent();
 
     SyscallCloseWindow(layer_id);
@@ -29,13 +29,17 @@ extern "C" void main(int argc, char** argv) {
         exit(err_openwin);
     }
 
+    // 全部の直線を1回のシステムコールで引き、再描画も1回で済ませる
+    WinCommand cmds[2 * (90 / 5 + 1)];
+    int num_cmds = 0;
     const int x0 = 4, y0 = 24, x1 = 4 + kRadius + 10, y1 = 24 + kRadius;
     for (int deg = 0; deg <= 90; deg += 5) {
         const int x = kRadius * cos(M_PI * deg / 180.0);
         const int y = kRadius * sin(M_PI * deg / 180.0);
-        SyscallWinDrawLine(layer_id, x0, y0, x0 + x, y0 + y, Color(deg));
-        SyscallWinDrawLine(layer_id, x1, y1, x1 + x, y1 - y, Color(deg));
+        cmds[num_cmds++] = {WIN_CMD_LINE, Color(deg), x0, y0, x0 + x, y0 + y, nullptr};
+        cmds[num_cmds++] = {WIN_CMD_LINE, Color(deg), x1, y1, x1 + x, y1 - y, nullptr};
     }
+    SyscallWinBatch(layer_id, cmds, num_cmds);
 
     exit(0);
 }
\ No newline at end of file
@@ -0,0 +1,376 @@
+/// アプリ用のメモリアロケータ（newlibのmallocの代わりにリンクされる）
+///
+/// 小さいブロック（kMaxSmallSize以下）は大きさの区分ごとに分け、区分ごとの空きリストから出し入れする
+/// 空きリストが空なら、まとめて確保したアリーナから区分の大きさで切り出す
+/// アリーナはSyscallDemandPagesでkArenaPages単位で確保する（ページの実体は触ったときに割り当てられる）
+/// 大きいブロックはページ単位の領域にし、解放したらSyscallReleasePagesで物理フレームをOSに返す
+/// 仮想アドレスの範囲は手元に残し、次に大きいブロックを確保するときに使い回す
+/// 同じアプリのスレッドは交互に動き、どこででも切り替わるので、g_heapはfutexを使ったロックで守る
+/// newlibのerrnoやstdioの状態（_impure_ptr）はスレッドの間で共有されるので、このロックでは守れない
+
+#include <errno.h>
+#include <reent.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "syscall.h"
+
+#define PAGE_SIZE 4096
+
+/// ブロックの直前に置くヘッダ（16バイトにして、ブロックを16バイト境界に揃える）
+struct ChunkHeader {
+    uint32_t kind;   // kKind*
+    uint32_t offset; // kKindAlignedなら、元のブロックの先頭からこのヘッダまでのバイト数
+    uint64_t size;   // kKindSmallなら区分の番号、kKindLargeなら領域のページ数
+};
+
+enum {
+    kKindSmall = 0x534d4c31,   // "SML1"
+    kKindLarge = 0x4c524731,   // "LRG1"
+    kKindAligned = 0x414c4e31, // "ALN1"
+};
+
+/// 区分ごとのブロックの大きさ（ヘッダを含まない）。隣との比は高々1.5倍
+static const size_t kSizeClasses[] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024,
+    1536, 2048, 3072, 4096, 6144, 8192, 12288, 16384, 24576, 32768,
+};
+#define NUM_SIZE_CLASSES (sizeof(kSizeClasses) / sizeof(kSizeClasses[0]))
+static const size_t kMaxSmallSize = 32768;
+/// アリーナを一度に確保するページ数（256KiB）
+static const size_t kArenaPages = 64;
+/// 空きリストが空のとき、一度に切り出すブロックの数の上限
+static const int kRefillBatch = 16;
+
+struct FreeBlock {
+    struct FreeBlock* next;
+};
+
+/// 大きいブロックを解放した後の仮想アドレス範囲
+struct FreeRegion {
+    uint64_t addr;
+    size_t num_pages;
+};
+#define MAX_FREE_REGIONS 64
+
+static struct {
+    struct FreeBlock* free_lists[NUM_SIZE_CLASSES];
+    /// アリーナのまだ切り出していない範囲
+    uint64_t arena_cur, arena_end;
+    struct FreeRegion free_regions[MAX_FREE_REGIONS];
+    int num_free_regions;
+} g_heap;
+
+/// g_heapを守るロック。0 : 空き、1 : 取られている、2 : 取られていて、眠って待つスレッドがいるかもしれない
+static uint32_t g_heap_lock;
+
+static void LockHeap(void) {
+    uint32_t c = 0;
+    if (__atomic_compare_exchange_n(&g_heap_lock, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    // 待つスレッドがいることを示してから眠る。起きたら取り直す
+    if (c != 2) {
+        c = __atomic_exchange_n(&g_heap_lock, 2, __ATOMIC_ACQUIRE);
+    }
+    while (c != 0) {
+        SyscallFutexWait(&g_heap_lock, 2);
+        c = __atomic_exchange_n(&g_heap_lock, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void UnlockHeap(void) {
+    if (__atomic_exchange_n(&g_heap_lock, 0, __ATOMIC_RELEASE) == 2) {
+        SyscallFutexWake(&g_heap_lock, 1);
+    }
+}
+
+static int SizeClassOf(size_t size) {
+    for (int i = 0; i < NUM_SIZE_CLASSES; ++i) {
+        if (size <= kSizeClasses[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static uint64_t DemandPages(size_t num_pages) {
+    struct SyscallResult res = SyscallDemandPages(num_pages, 0);
+    if (res.error) {
+        return 0;
+    }
+    return res.value;
+}
+
+/// 区分classの空きリストに、アリーナから何個かまとめて切り出して補充する
+static int RefillSmall(int class) {
+    const size_t stride = sizeof(struct ChunkHeader) + kSizeClasses[class];
+    if (g_heap.arena_end - g_heap.arena_cur < stride) {
+        // 残り（1ブロックに満たない）は捨てる。触っていないページは物理フレームを使わない
+        const uint64_t arena = DemandPages(kArenaPages);
+        if (arena == 0) {
+            return -1;
+        }
+        g_heap.arena_cur = arena;
+        g_heap.arena_end = arena + kArenaPages * PAGE_SIZE;
+    }
+
+    // 大きい区分ほど少なく切り出す（一度も使わない分が増えないように）
+    int n = (int)((g_heap.arena_end - g_heap.arena_cur) / stride);
+    const int batch = kSizeClasses[class] >= 4096 ? 1 : kRefillBatch;
+    if (n > batch) {
+        n = batch;
+    }
+    for (int i = 0; i < n; ++i) {
+        struct ChunkHeader* header = (struct ChunkHeader*)g_heap.arena_cur;
+        g_heap.arena_cur += stride;
+        header->kind = kKindSmall;
+        header->offset = 0;
+        header->size = class;
+        struct FreeBlock* block = (struct FreeBlock*)(header + 1);
+        block->next = g_heap.free_lists[class];
+        g_heap.free_lists[class] = block;
+    }
+    return 0;
+}
+
+static void* AllocateSmall(int class) {
+    if (g_heap.free_lists[class] == NULL && RefillSmall(class) < 0) {
+        return NULL;
+    }
+    struct FreeBlock* block = g_heap.free_lists[class];
+    g_heap.free_lists[class] = block->next;
+    return block;
+}
+
+/// ページ単位の領域を確保する。解放済みの範囲に収まればそれを使う（中身は0になっている）
+static void* AllocateLarge(size_t size) {
+    const size_t num_pages = (sizeof(struct ChunkHeader) + size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (num_pages == 0 || num_pages > (SIZE_MAX / PAGE_SIZE)) {
+        return NULL;
+    }
+
+    uint64_t addr = 0;
+    int best = -1;
+    for (int i = 0; i < g_heap.num_free_regions; ++i) {
+        const size_t pages = g_heap.free_regions[i].num_pages;
+        if (pages >= num_pages && (best < 0 || pages < g_heap.free_regions[best].num_pages)) {
+            best = i;
+        }
+    }
+    if (best >= 0) {
+        struct FreeRegion* region = &g_heap.free_regions[best];
+        addr = region->addr;
+        region->addr += num_pages * PAGE_SIZE;
+        region->num_pages -= num_pages;
+        if (region->num_pages == 0) {
+            *region = g_heap.free_regions[--g_heap.num_free_regions];
+        }
+    } else {
+        addr = DemandPages(num_pages);
+        if (addr == 0) {
+            return NULL;
+        }
+    }
+
+    struct ChunkHeader* header = (struct ChunkHeader*)addr;
+    header->kind = kKindLarge;
+    header->offset = 0;
+    header->size = num_pages;
+    return header + 1;
+}
+
+/// 大きいブロックの物理フレームをOSに返し、仮想アドレス範囲を覚えておく
+static void FreeLarge(struct ChunkHeader* header) {
+    const uint64_t addr = (uint64_t)header;
+    const size_t num_pages = header->size;
+    SyscallReleasePages((void*)addr, num_pages * PAGE_SIZE);
+
+    // 隣り合う範囲があればつなげる
+    for (int i = 0; i < g_heap.num_free_regions; ++i) {
+        struct FreeRegion* region = &g_heap.free_regions[i];
+        if (region->addr + region->num_pages * PAGE_SIZE == addr) {
+            region->num_pages += num_pages;
+            return;
+        }
+        if (addr + num_pages * PAGE_SIZE == region->addr) {
+            region->addr = addr;
+            region->num_pages += num_pages;
+            return;
+        }
+    }
+    if (g_heap.num_free_regions < MAX_FREE_REGIONS) {
+        g_heap.free_regions[g_heap.num_free_regions++] = (struct FreeRegion){addr, num_pages};
+    }
+    // 覚えきれない範囲は使い回さない（物理フレームは返してある）
+}
+
+static struct ChunkHeader* HeaderOf(void* ptr) {
+    struct ChunkHeader* header = (struct ChunkHeader*)ptr - 1;
+    if (header->kind == kKindAligned) {
+        header = (struct ChunkHeader*)((uint8_t*)header - header->offset) - 1;
+    }
+    return header;
+}
+
+/// ptrのブロックに書き込めるバイト数
+static size_t UsableSize(void* ptr) {
+    struct ChunkHeader* aligned = (struct ChunkHeader*)ptr - 1;
+    struct ChunkHeader* header = HeaderOf(ptr);
+    size_t size = header->kind == kKindSmall
+                      ? kSizeClasses[header->size]
+                      : header->size * PAGE_SIZE - sizeof(struct ChunkHeader);
+    if (aligned != header) {
+        size -= aligned->offset + sizeof(struct ChunkHeader);
+    }
+    return size;
+}
+
+void* malloc(size_t size) {
+    if (size == 0) {
+        size = 1;
+    }
+    void* p;
+    LockHeap();
+    if (size <= kMaxSmallSize) {
+        p = AllocateSmall(SizeClassOf(size));
+    } else {
+        p = AllocateLarge(size);
+    }
+    UnlockHeap();
+    if (p == NULL) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void free(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    struct ChunkHeader* header = HeaderOf(ptr);
+    LockHeap();
+    if (header->kind == kKindLarge) {
+        FreeLarge(header);
+    } else {
+        struct FreeBlock* block = (struct FreeBlock*)(header + 1);
+        block->next = g_heap.free_lists[header->size];
+        g_heap.free_lists[header->size] = block;
+    }
+    UnlockHeap();
+}
+
+void* calloc(size_t n, size_t size) {
+    if (size != 0 && n > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    const size_t bytes = n * size;
+    void* p = malloc(bytes);
+    // 大きいブロックは触っていないページか返したページなので、すでに0
+    if (p && HeaderOf(p)->kind == kKindSmall) {
+        memset(p, 0, bytes);
+    }
+    return p;
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    const size_t usable = UsableSize(ptr);
+    // 同じ区分に収まるか、大きいブロックで縮めるだけなら、そのまま使う
+    if (size <= usable) {
+        struct ChunkHeader* header = HeaderOf(ptr);
+        if (header->kind == kKindLarge || SizeClassOf(size) == (int)header->size) {
+            return ptr;
+        }
+    }
+
+    void* p = malloc(size);
+    if (p == NULL) {
+        return NULL;
+    }
+    memcpy(p, ptr, usable < size ? usable : size);
+    free(ptr);
+    return p;
+}
+
+void* memalign(size_t alignment, size_t size) {
+    if (alignment <= sizeof(struct ChunkHeader)) {
+        return malloc(size);
+    }
+    if (alignment & (alignment - 1)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    // アラインしたブロックの前に、元のブロックを指すヘッダを置く場所も取る
+    uint8_t* base = malloc(size + alignment + sizeof(struct ChunkHeader));
+    if (base == NULL) {
+        return NULL;
+    }
+    uint8_t* aligned = (uint8_t*)(((uintptr_t)base + sizeof(struct ChunkHeader) + alignment - 1) &
+                                  ~(uintptr_t)(alignment - 1));
+    struct ChunkHeader* header = (struct ChunkHeader*)aligned - 1;
+    header->kind = kKindAligned;
+    header->offset = (uint32_t)((uint8_t*)header - base);
+    header->size = 0;
+    return aligned;
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1))) {
+        return EINVAL;
+    }
+    void* p = memalign(alignment, size);
+    if (p == NULL) {
+        return ENOMEM;
+    }
+    *memptr = p;
+    return 0;
+}
+
+size_t malloc_usable_size(void* ptr) {
+    return ptr ? UsableSize(ptr) : 0;
+}
+
+// newlibの内部でヒープを触る処理が取るロック。malloc()などと同じロックを使わせる
+// 取ったままmalloc()などを呼ぶと止まるが、malloc()などを置き換えているので、newlibの中にそういう呼び出しは残っていない
+void __malloc_lock(struct _reent* r) {
+    LockHeap();
+}
+
+void __malloc_unlock(struct _reent* r) {
+    UnlockHeap();
+}
+
+// newlibの内部（stdioなど）は再入可能版を呼ぶので、同じものを使わせる
+void* _malloc_r(struct _reent* r, size_t size) {
+    return malloc(size);
+}
+
+void _free_r(struct _reent* r, void* ptr) {
+    free(ptr);
+}
+
+void* _calloc_r(struct _reent* r, size_t n, size_t size) {
+    return calloc(n, size);
+}
+
+void* _realloc_r(struct _reent* r, void* ptr, size_t size) {
+    return realloc(ptr, size);
+}
+
+void* _memalign_r(struct _reent* r, size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+size_t _malloc_usable_size_r(struct _reent* r, void* ptr) {
+    return malloc_usable_size(ptr);
+}
@@ -17,11 +17,14 @@ extern "C" void main(int argc, char** argv) {
     }
 
     char* p = reinterpret_cast<char*>(res.value);
+    // 先頭から順に読むので、常に先読みさせる
+    SyscallMapAdvise(p, file_size, MAP_ADVICE_SEQUENTIAL);
 
     for (size_t i = 0; i < file_size; ++i) {
         printf("%c", p[i]);
     }
     printf("\nread from mapped file (%lu bytes)\n", file_size);
+    SyscallUnmap(p, file_size);
 
     exit(0);
 }
@@ -1,8 +1,8 @@
+#include <cctype>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <string>
-#include <vector>
+#include <fcntl.h>
 
 #include "../syscall.h"
 
@@ -26,6 +26,60 @@ AppEvent WaitKey() {
     }
 }
 
+/// 標準入力が読めるようになるまで待つ。待っている間に終了を指示されたら終了する
+void WaitInput() {
+    WaitFd fds[1] = {{0, 0}};
+    while (true) {
+        auto [ready, err] = SyscallWait(fds, 1, WAIT_INFINITE);
+        if (err) {
+            fprintf(stderr, "Wait failed: %s\n", strerror(err));
+            exit(1);
+        }
+        if (ready & WAIT_READY_FD) {
+            return;
+        }
+
+        AppEvent events[1];
+        if (auto [n, err] = SyscallReadEvent(events, 1); n > 0 && events[0].type == AppEvent::kQuit) {
+            exit(0);
+        }
+    }
+}
+
+/// ファイルはメモリマップし、行をコピーせずにページごとに書き出す
+void PageMapped(const char* path, int page_size) {
+    SyscallResult res = SyscallOpenFile(path, O_RDONLY);
+    if (res.error) {
+        fprintf(stderr, "failed to open '%s'\n", path);
+        exit(1);
+    }
+    size_t size;
+    res = SyscallMapFile(res.value, &size, 0);
+    if (res.error) {
+        fprintf(stderr, "%s: %s\n", strerror(res.error), path);
+        exit(1);
+    }
+    SyscallMapAdvise(reinterpret_cast<void*>(res.value), size, MAP_ADVICE_SEQUENTIAL);
+    const char* data = reinterpret_cast<const char*>(res.value);
+
+    size_t offset = 0;
+    while (offset < size) {
+        // 1ページ分の行の終わりを探し、まとめて書く
+        size_t end = offset;
+        for (int i = 0; i < page_size && end < size; i++) {
+            const void* lf = memchr(data + end, '\n', size - end);
+            end = lf ? static_cast<const char*>(lf) - data + 1 : size;
+        }
+        fwrite(data + offset, 1, end - offset, stdout);
+        offset = end;
+        if (offset < size) {
+            fflush(stdout);
+            fputs("---more---\n", stderr);
+            WaitKey();
+        }
+    }
+}
+
 extern "C" void main(int argc, char** argv) {
     int page_size = 10;
     int arg_file = 1;
@@ -34,27 +88,30 @@ extern "C" void main(int argc, char** argv) {
         arg_file++;
     }
 
-    FILE* fp = stdin;
     if (argc > arg_file) {
-        fp = fopen(argv[arg_file], "r");
-        if (fp == nullptr) {
-            fprintf(stderr, "failed to open '%s'\n", argv[arg_file]);
-            exit(1);
-        }
+        PageMapped(argv[arg_file], page_size);
+        exit(0);
     }
 
-    std::vector<std::string> lines{};
-    char line[256];
-    while (fgets(line, sizeof(line), fp)) {
-        lines.emplace_back(line);
-    }
+    // 読めるか確かめてから読むので、溜め込まずに読んだ分だけを受け取る
+    setvbuf(stdin, nullptr, _IONBF, 0);
 
-    for (int i = 0; i < lines.size(); i++) {
-        if (i > 0 && (i % page_size) == 0) {
+    // 届いた行から順に表示し、読み終えた行は覚えておかない
+    char line[256];
+    int num_lines = 0;
+    while (true) {
+        // 送信元が遅くても、Ctrl + Q で止められる
+        WaitInput();
+        if (!fgets(line, sizeof(line), stdin)) {
+            break;
+        }
+        if (num_lines > 0 && (num_lines % page_size) == 0) {
+            fflush(stdout);
             fputs("---more---\n", stderr);
             WaitKey();
         }
-        fputs(lines[i].c_str(), stdout);
+        fputs(line, stdout);
+        num_lines++;
     }
     exit(0);
 }
@@ -2,7 +2,10 @@
 #include <signal.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/times.h>
 #include <sys/types.h>
 
 #include "syscall.h"
@@ -17,6 +20,14 @@ int fstat(int fd, struct stat* buf) {
     return -1;
 }
 
+/// 起動からの時間（実時間時計がないので、1970年ではなくOSの起動を起点とする）
+int gettimeofday(struct timeval* tv, void* tz) {
+    const uint64_t ns = ReadTimeNs();
+    tv->tv_sec = ns / 1000000000;
+    tv->tv_usec = ns % 1000000000 / 1000;
+    return 0;
+}
+
 pid_t getpid(void) {
     return 0;
 }
@@ -32,7 +43,11 @@ int kill(pid_t pid, int sig) {
 }
 
 off_t lseek(int fd, off_t offset, int whence) {
-    errno = EBADF;
+    struct SyscallResult res = SyscallSeek(fd, offset, whence);
+    if (res.error == 0) {
+        return res.value;
+    }
+    errno = res.error;
     return -1;
 }
 
@@ -45,16 +60,14 @@ int open(const char* path, int flags) {
     return -1;
 }
 
-/// アラインメントされたメモリ領域を確保
-int posix_memalign(void** memptr, size_t alignment, size_t size) {
-    void* p = malloc(size + alignment - 1);
-    if (!p) {
-        return ENOMEM;
-    }
-
-    uintptr_t addr = (uintptr_t)p;
-    *memptr = (void*)((addr + alignment - 1) & ~(uintptr_t)(alignment - 1));
-    return 0;
+/// clock()から呼ばれる。CPU時間は測っていないので、起動からの時間をCLOCKS_PER_SEC単位で返す
+clock_t times(struct tms* buf) {
+    const clock_t t = ReadCurrentTick() * CLOCKS_PER_SEC / TimerFreq();
+    buf->tms_utime = t;
+    buf->tms_stime = 0;
+    buf->tms_cutime = 0;
+    buf->tms_cstime = 0;
+    return t;
 }
 
 ssize_t read(int fd, void* buf, size_t count) {
@@ -86,11 +99,16 @@ caddr_t sbrk(int incr) {
 
     const uint64_t prev_break = program_break;
     program_break += incr;
+    if (incr < 0) {
+        // 新しいプログラムブレークより後ろのページはもう使わないので、物理フレームをOSに返す
+        // 仮想アドレス範囲は確保したままなので、再び伸ばしたときはそのまま使える
+        SyscallReleasePages((void*)program_break, dpage_end - program_break);
+    }
     return (caddr_t)prev_break;
 }
 
 ssize_t write(int fd, const void* buf, size_t count) {
-    struct SyscallResult res = SyscallPutString(fd, (uint64_t)buf, count);
+    struct SyscallResult res = SyscallWriteFile(fd, buf, count);
     if (res.error == 0) {
         return res.value;
     }
@@ -98,6 +116,15 @@ ssize_t write(int fd, const void* buf, size_t count) {
     return -1;
 }
 
+int fsync(int fd) {
+    struct SyscallResult res = SyscallSync();
+    if (res.error == 0) {
+        return 0;
+    }
+    errno = res.error;
+    return -1;
+}
+
 void _exit(int status) {
     SyscallExit(status);
 }
\ No newline at end of file
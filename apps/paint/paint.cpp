@@ -16,15 +16,19 @@ extern "C" void main(int argc, char** argv) {
         exit(err_openwin);
     }
 
+    // マウスの移動はイベントが多いので、システムコールを呼ばずに取り出せるリングで受け取る
+    auto [ring_addr, err_ring] = SyscallEventRingSetup(256, 0);
+    if (err_ring) {
+        printf("EventRingSetup failed: %s\n", strerror(err_ring));
+        exit(err_ring);
+    }
+    auto ring = reinterpret_cast<EventRingHeader*>(ring_addr);
+
     AppEvent events[1];
     // 左ボタンがクリックされている : true
     bool press = false;
     while (true) {
-        auto [n, err] = SyscallReadEvent(events, 1);
-        if (err) {
-            printf("ReadEvent failed: %s\n", strerror(err));
-            break;
-        }
+        EventRingWait(ring, &events[0]);
 
         if (events[0].type == AppEvent::kQuit) {
             break;
@@ -1,38 +1,205 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
-#include <string>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
 #include <vector>
 
-extern "C" void main(int argc, char** argv) {
-    FILE* fp = stdin;
-    if (argc >= 2) {
-        fp = fopen(argv[1], "r");
-        if (fp == nullptr) {
-            fprintf(stderr, "failed to open '%s'\n", argv[1]);
+#include "../syscall.h"
+
+namespace {
+    /// 1行（改行を含む）。先頭8バイトをビッグエンディアンで詰めたprefixで大半の比較を済ませる
+    struct Line {
+        uint64_t prefix;
+        const char* data;
+        size_t len;
+    };
+
+    uint64_t MakePrefix(const char* p, size_t len) {
+        uint64_t prefix = 0;
+        for (size_t i = 0; i < 8; ++i) {
+            prefix <<= 8;
+            if (i < len) {
+                prefix |= static_cast<uint8_t>(p[i]);
+            }
+        }
+        return prefix;
+    }
+
+    /// prefixが等しい行どうしを、9バイト目以降で比べる（バイトは符号なしとして比べる）
+    bool LessAfterPrefix(const Line& a, const Line& b) {
+        const size_t n = std::min(a.len, b.len);
+        if (n > 8) {
+            if (int c = memcmp(a.data + 8, b.data + 8, n - 8)) {
+                return c < 0;
+            }
+        }
+        return a.len < b.len;
+    }
+
+    /// ファイルをメモリマップする。開けなければ終了する
+    const char* MapInput(const char* path, size_t* size) {
+        SyscallResult res = SyscallOpenFile(path, O_RDONLY);
+        if (res.error) {
+            fprintf(stderr, "%s: %s\n", strerror(res.error), path);
+            exit(1);
+        }
+        const int fd = res.value;
+        res = SyscallMapFile(fd, size, 0);
+        if (res.error) {
+            fprintf(stderr, "%s: %s\n", strerror(res.error), path);
             exit(1);
         }
+        // 行の切り出しで先頭から末尾まで一度に読む
+        SyscallMapAdvise(reinterpret_cast<void*>(res.value), *size, MAP_ADVICE_SEQUENTIAL);
+        return reinterpret_cast<const char*>(res.value);
+    }
+
+    /// 標準入力（パイプなど）はマップできないので、大きく読み込んで1つのバッファにまとめる
+    std::vector<char> ReadAll(int fd) {
+        std::vector<char> buf;
+        size_t size = 0;
+        while (true) {
+            if (buf.size() - size < 16384) {
+                buf.resize(std::max<size_t>(65536, buf.size() * 2));
+            }
+            const ssize_t n = read(fd, buf.data() + size, buf.size() - size);
+            if (n < 0) {
+                fprintf(stderr, "failed to read stdin: %s\n", strerror(errno));
+                exit(1);
+            }
+            if (n == 0) {
+                break;
+            }
+            size += n;
+        }
+        buf.resize(size);
+        return buf;
+    }
+
+    /// 改行ごとに区切った行の索引を作る（最後の行は改行がなくてもよい）
+    std::vector<Line> BuildIndex(const char* data, size_t size) {
+        std::vector<Line> lines;
+        size_t begin = 0;
+        while (begin < size) {
+            const void* nl = memchr(data + begin, '\n', size - begin);
+            const size_t end = nl ? static_cast<const char*>(nl) - data + 1 : size;
+            lines.push_back({MakePrefix(data + begin, end - begin), data + begin, end - begin});
+            begin = end;
+        }
+        return lines;
     }
 
-    std::vector<std::string> lines;
-    char line[1024];
-    while ((fgets(line, sizeof(line), fp))) {
-        lines.push_back(line);
+    /// prefixで基数ソート（LSD、1パス8ビット）してから、prefixが等しい範囲だけを比較ソートする
+    void SortLines(std::vector<Line>& lines) {
+        const size_t n = lines.size();
+        if (n < 64) {
+            std::sort(lines.begin(), lines.end(), [](const Line& a, const Line& b) {
+                return a.prefix != b.prefix ? a.prefix < b.prefix : LessAfterPrefix(a, b);
+            });
+            return;
+        }
+
+        std::vector<Line> tmp(n);
+        Line* src = lines.data();
+        Line* dst = tmp.data();
+        for (int shift = 0; shift < 64; shift += 8) {
+            size_t count[256] = {};
+            for (size_t i = 0; i < n; ++i) {
+                count[(src[i].prefix >> shift) & 0xff]++;
+            }
+            // この桁がすべて同じなら並べ替えるまでもない（短い行ばかりのときに下位の桁で多い）
+            if (count[(src[0].prefix >> shift) & 0xff] == n) {
+                continue;
+            }
+            size_t pos = 0;
+            for (auto& c : count) {
+                const size_t k = c;
+                c = pos;
+                pos += k;
+            }
+            for (size_t i = 0; i < n; ++i) {
+                dst[count[(src[i].prefix >> shift) & 0xff]++] = src[i];
+            }
+            std::swap(src, dst);
+        }
+        if (src != lines.data()) {
+            std::copy(src, src + n, lines.data());
+        }
+
+        for (size_t begin = 0; begin < n;) {
+            size_t end = begin + 1;
+            while (end < n && lines[end].prefix == lines[begin].prefix) {
+                ++end;
+            }
+            if (end - begin > 1) {
+                std::sort(lines.begin() + begin, lines.begin() + end, LessAfterPrefix);
+            }
+            begin = end;
+        }
     }
 
-    auto comp = [](const std::string& a, const std::string& b) {
-        for (int i = 0; i < std::min(a.length(), b.length()); i++) {
-            if (a[i] < b[i]) {
-                return true;
-            } else if (a[i] > b[i]) {
-                return false;
+    /// 出力をまとめて大きく書き込む
+    class Output {
+    public:
+        void Write(const char* p, size_t len) {
+            if (len >= sizeof(buf_)) {
+                Flush();
+                WriteAll(p, len);
+                return;
+            }
+            if (used_ + len > sizeof(buf_)) {
+                Flush();
+            }
+            memcpy(buf_ + used_, p, len);
+            used_ += len;
+        }
+
+        void Flush() {
+            WriteAll(buf_, used_);
+            used_ = 0;
+        }
+
+    private:
+        static void WriteAll(const char* p, size_t len) {
+            while (len > 0) {
+                const ssize_t n = write(1, p, len);
+                if (n <= 0) {
+                    exit(1);
+                }
+                p += n;
+                len -= n;
             }
         }
-        return a.length() < b.length();
+
+        char buf_[65536];
+        size_t used_ = 0;
     };
+} // namespace
+
+extern "C" void main(int argc, char** argv) {
+    const char* data;
+    size_t size;
+    std::vector<char> stdin_buf;
+    if (argc >= 2) {
+        data = MapInput(argv[1], &size);
+    } else {
+        stdin_buf = ReadAll(0);
+        data = stdin_buf.data();
+        size = stdin_buf.size();
+    }
+
+    auto lines = BuildIndex(data, size);
+    SortLines(lines);
 
-    std::sort(lines.begin(), lines.end(), comp);
-    for (auto& line : lines) {
-        printf("%s", line.c_str());
+    // スタックに置くには大きいバッファを持つ
+    static Output out;
+    for (const auto& line : lines) {
+        out.Write(line.data, line.len);
     }
+    out.Flush();
     exit(0);
 }
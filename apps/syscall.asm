@@ -29,3 +29,39 @@ define_syscall OpenFile, 0x8000000c
 define_syscall ReadFile, 0x8000000d
 define_syscall DemandPages, 0x8000000e
 define_syscall MapFile, 0x8000000f
+define_syscall MapAdvise, 0x80000010
+define_syscall Unmap, 0x80000011
+define_syscall ReleasePages, 0x80000012
+define_syscall GetFaultStat, 0x80000013
+define_syscall CreatePeriodicTimer, 0x80000014
+define_syscall CancelTimer, 0x80000015
+define_syscall CreateShm, 0x80000016
+define_syscall MapShm, 0x80000017
+define_syscall Wait, 0x80000018
+define_syscall AsyncSetup, 0x80000019
+define_syscall AsyncEnter, 0x8000001a
+define_syscall GetTimeNs, 0x8000001b
+define_syscall WinBatch, 0x8000001c
+define_syscall GetSyscallStat, 0x8000001d
+define_syscall WriteFile, 0x8000001e
+define_syscall ReadV, 0x8000001f
+define_syscall WriteV, 0x80000020
+define_syscall Seek, 0x80000021
+define_syscall PRead, 0x80000022
+define_syscall Sync, 0x80000023
+define_syscall WinSetAlpha, 0x80000024
+define_syscall WinPresent, 0x80000025
+define_syscall WinBlitPacked, 0x80000026
+define_syscall CopyFile, 0x80000027
+define_syscall GetTaskStat, 0x80000028
+define_syscall Sleep, 0x80000029
+define_syscall WinFence, 0x8000002a
+define_syscall CreateThreadAt, 0x8000002b
+define_syscall JoinThread, 0x8000002c
+define_syscall FutexWait, 0x8000002d
+define_syscall FutexWake, 0x8000002e
+define_syscall Spawn, 0x8000002f
+define_syscall WaitTask, 0x80000030
+define_syscall WinScrollPacked, 0x80000031
+define_syscall EventRingSetup, 0x80000032
+define_syscall GetIdleStat, 0x80000033
@@ -27,20 +27,314 @@ struct SyscallResult SyscallOpenWindow(int w, int h, int x, int y, const char* t
 struct SyscallResult SyscallWinWriteString(uint64_t layer_id_flags, int x, int y, uint32_t color, const char* s);
 struct SyscallResult SyscallWinFillRectangle(uint64_t layer_id_flags, int x, int y, int w, int h, uint32_t color);
 struct SyscallResult SyscallGetCurrentTick();
+// 起動してからのナノ秒数（単調増加）
+struct SyscallResult SyscallGetTimeNs();
+
+/// カーネルが読み込み専用でマップする時刻のページ（kernel/timer.hppと同じ並び）
+struct TimePage {
+  uint64_t tsc_base;
+  uint64_t tsc_per_tick;
+  // 1秒あたりのtick数
+  uint64_t timer_freq;
+  // 最後にタイマ割り込みを処理したときのtick
+  uint64_t tick;
+  // 1秒あたりのTSCのカウント数
+  uint64_t tsc_freq;
+};
+#define TIME_PAGE_ADDR 0xfffffffffffee000ul
+// SyscallGetCurrentTickと同じ値を、システムコールを呼ばずに求める
+static inline uint64_t ReadCurrentTick(void) {
+  const struct TimePage* tp = (const struct TimePage*)TIME_PAGE_ADDR;
+  return (__builtin_ia32_rdtsc() - tp->tsc_base) / tp->tsc_per_tick;
+}
+static inline uint64_t TimerFreq(void) {
+  return ((const struct TimePage*)TIME_PAGE_ADDR)->timer_freq;
+}
+// SyscallGetTimeNsと同じ値を、システムコールを呼ばずに求める
+static inline uint64_t ReadTimeNs(void) {
+  const struct TimePage* tp = (const struct TimePage*)TIME_PAGE_ADDR;
+  const unsigned __int128 elapsed = __builtin_ia32_rdtsc() - tp->tsc_base;
+  return (uint64_t)(elapsed * 1000000000 / tp->tsc_freq);
+}
 struct SyscallResult SyscallWinRedraw(uint64_t layer_id_flags);
 struct SyscallResult SyscallWinDrawLine(uint64_t layer_id_flags, int x0, int y0, int x1, int y1, uint32_t color);
 struct SyscallResult SyscallCloseWindow(uint64_t layer_id_flags);
 struct SyscallResult SyscallReadEvent(struct AppEvent* events, size_t len);
 
+#define WIN_CMD_FILL   0
+#define WIN_CMD_LINE   1
+#define WIN_CMD_STRING 2
+#define WIN_CMD_BLIT   3
+/// SyscallWinBatchに渡す描画命令（kernel/syscall.cppと同じ並び）
+struct WinCommand {
+  uint32_t type;
+  uint32_t color;
+  // FILL, BLIT : 左上とサイズ、LINE : 始点(x, y)と終点(w, h)、STRING : 左上
+  int x, y, w, h;
+  // STRING : 文字列、BLIT : w * h 個の色（0xRRGGBB）
+  const void* data;
+};
+// 描画命令をまとめて実行し、実行した命令の数を返す。再描画はLAYER_NO_REDRAWがなければ最後に1回だけ
+struct SyscallResult SyscallWinBatch(uint64_t layer_id_flags, const struct WinCommand* cmds, size_t num_cmds);
+// ウィンドウ全体の不透明度alpha（0〜255、255で不透明）を設定する
+// WIN_ALPHA_PER_PIXELなら、以降のWIN_CMD_BLITの色の上位8ビットを透明度（0で不透明、0xffで透明）として重ねる
+#define WIN_ALPHA_PER_PIXEL 1
+struct SyscallResult SyscallWinSetAlpha(uint64_t layer_id_flags, int alpha, int flags);
+// 初回はウィンドウを2面にし、以降の描画は裏の面に行う。2回目からは裏の面を表の面と入れ替えて再描画する
+// 描画のたびの再描画も起きなくなるので、描き終えたらこれを呼ぶ。画面に出るのを待つ必要はない
+// WIN_PRESENT_DISCARDなら、入れ替えた後の裏の面に前の絵を写さない（毎回全体を描き直すアプリ向け）
+#define WIN_PRESENT_DISCARD 1
+struct SyscallResult SyscallWinPresent(uint64_t layer_id_flags, int flags);
+// それまでの描画が画面に出るまで待ち、それを描いたフレームの番号を返す（描画のシステムコール自体は待たない）
+// フレームの番号は画面を描き直すたびに1つ進むので、前回の値との差で描き直しの回数がわかる
+struct SyscallResult SyscallWinFence(uint64_t layer_id_flags);
+
+// SyscallWinBlitに渡す画像のピクセル形式（kernel/frame_buffer.hppのImageFormatと同じ値）
+#define WIN_IMAGE_ARGB8888 0  // 4バイトの0xTTRRGGBB（TTは透明度。WIN_ALPHA_PER_PIXELのときだけ使う）
+#define WIN_IMAGE_RGB888   1  // R, G, Bの順の3バイト
+#define WIN_IMAGE_RGBA8888 2  // R, G, B, A（不透明度）の順の4バイト
+#define WIN_IMAGE_GRAY8    3  // 1バイトの明るさ
+struct SyscallResult SyscallWinBlitPacked(uint64_t layer_id_flags, uint64_t pos, uint64_t size,
+                                          const void* image, size_t stride, int format);
+// (x, y)を左上に、w x hの画像（1行strideバイト）をウィンドウに書く。形式の変換はカーネルが行う
+// 引数が6つに収まらないので、座標と大きさは2つずつ詰めて渡す
+static inline struct SyscallResult SyscallWinBlit(uint64_t layer_id_flags, int x, int y, int w, int h,
+                                                  const void* image, size_t stride, int format) {
+  return SyscallWinBlitPacked(layer_id_flags,
+                              (uint32_t)x | ((uint64_t)(uint32_t)y << 32),
+                              (uint32_t)w | ((uint64_t)(uint32_t)h << 32),
+                              image, stride, format);
+}
+
+/// kernel/syscall.cppのWinRectと同じ並び
+struct WinRect {
+  int x, y, w, h;
+};
+struct SyscallResult SyscallWinScrollPacked(uint64_t layer_id_flags, uint64_t pos, uint64_t size,
+                                            int dx, int dy, struct WinRect* exposed);
+// (x, y)を左上とするw x hの領域の中身を、その場で(dx, dy)だけずらす（右、下が正）。領域から出た分は捨てる
+// 空いた部分（最大2つ）をexposed[0]〜に入れ、その数を返す。アプリはそこだけを描き直せばよい
+static inline struct SyscallResult SyscallWinScroll(uint64_t layer_id_flags, int x, int y, int w, int h,
+                                                    int dx, int dy, struct WinRect exposed[2]) {
+  return SyscallWinScrollPacked(layer_id_flags,
+                                (uint32_t)x | ((uint64_t)(uint32_t)y << 32),
+                                (uint32_t)w | ((uint64_t)(uint32_t)h << 32),
+                                dx, dy, exposed);
+}
+
 #define TIMER_ONESHOT_REL 1
 #define TIMER_ONESHOT_ABS 0
-struct SyscallResult SyscallCreateTimer(unsigned int type, int timer_value, unsigned long timeout_ms);
+// TIMER_ONESHOT_*と組み合わせると、timeoutと戻り値の単位がマイクロ秒になる
+#define TIMER_UNIT_USEC 2
+// SyscallCreateTimerがタイムアウト時刻の代わりに、SyscallCancelTimerに渡すハンドルを返す
+#define TIMER_RETURN_HANDLE 4
+struct SyscallResult SyscallCreateTimer(unsigned int type, int timer_value, unsigned long timeout);
+// 今からperiodごとにタイムアウトするタイマを作り、ハンドルを返す（typeはTIMER_UNIT_USECのみ有効）
+struct SyscallResult SyscallCreatePeriodicTimer(unsigned int type, int timer_value, unsigned long period);
+struct SyscallResult SyscallCancelTimer(uint64_t handle);
+// ns後まで眠る。イベントの通知を使わないので、溜まっているイベントはそのまま残る（イベントが届いても起きない）
+struct SyscallResult SyscallSleep(uint64_t ns);
 
 struct SyscallResult SyscallOpenFile(const char* path, int flags);
 struct SyscallResult SyscallReadFile(int fd, void* buf, size_t count);
+// 書き込むバイト数に上限はない
+struct SyscallResult SyscallWriteFile(int fd, const void* buf, size_t count);
+
+/// kernel/syscall.cppのIoVecと同じ並び
+struct IoVec {
+  void* base;
+  size_t len;
+};
+#define IOV_MAX_ENTRIES 1024
+// iovsの各バッファに順に読み込む（書き込む）。途中で要求より少なくしか読めなければ、そこで止める
+struct SyscallResult SyscallReadV(int fd, const struct IoVec* iovs, size_t num_iovs);
+struct SyscallResult SyscallWriteV(int fd, const struct IoVec* iovs, size_t num_iovs);
+// 読み込み位置を変え、変えた後の位置を返す（whenceはSEEK_SET, SEEK_CUR, SEEK_END）
+// 読み込み位置を持たないファイル（パイプ、ターミナル）ではESPIPE
+struct SyscallResult SyscallSeek(int fd, int64_t offset, int whence);
+// 読み込み位置を変えずに、ファイル先頭からoffsetの位置から読む
+struct SyscallResult SyscallPRead(int fd, void* buf, size_t count, size_t offset);
+// ファイルへの書き込みは後でまとめてディスクに書き戻される。今すぐすべて書き戻す
+struct SyscallResult SyscallSync();
+// ファイルをコピーし、コピーしたバイト数を返す（destがなければ作る）。中身はカーネルの中でコピーする
+struct SyscallResult SyscallCopyFile(const char* src, const char* dest);
 struct SyscallResult SyscallDemandPages(size_t num_pages, int flags);
 struct SyscallResult SyscallMapFile(int fd, size_t* file_size, int flags);
 
+#define MAP_ADVICE_NORMAL     0
+#define MAP_ADVICE_SEQUENTIAL 1
+#define MAP_ADVICE_RANDOM     2
+#define MAP_ADVICE_WILLNEED   3
+struct SyscallResult SyscallMapAdvise(void* addr, size_t len, int advice);
+struct SyscallResult SyscallUnmap(void* addr, size_t len);
+struct SyscallResult SyscallReleasePages(void* addr, size_t len);
+
+/// kernel/paging.hppのPageFaultStatと同じ並び
+struct PageFaultStat {
+  uint64_t demand_faults;
+  uint64_t file_faults;
+  uint64_t image_faults;
+  uint64_t cow_faults;
+  uint64_t fatal_faults;
+  uint64_t cycles;
+  uint64_t faults_avoided;
+  uint64_t zero_page_maps;
+};
+/// global : 0ならアプリ自身、それ以外ならシステム全体の統計
+struct SyscallResult SyscallGetFaultStat(struct PageFaultStat* stat, int global);
+
+#define SYSCALL_HIST_BUCKETS 16
+/// kernel/syscall.hppのSyscallStatと同じ並び
+/// histはTSCカウントの分布（区間0は128未満、区間iは[2^(i+6), 2^(i+7))）
+struct SyscallStat {
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t cycles;
+  uint64_t hist[SYSCALL_HIST_BUCKETS];
+};
+/// stats[n]に0x80000000+n番のシステムコールの統計を書き込み、システムコールの数を返す
+/// カーネルのterminalで sysstat on を実行している間だけ数える
+struct SyscallResult SyscallGetSyscallStat(struct SyscallStat* stats, size_t len, int global);
+
+/// kernel/task.hppのTaskStatと同じ並び（時間はTSCのカウント）
+struct TaskStat {
+  uint64_t id;
+  uint64_t run_cycles;
+  // 実行可能になってから実際に実行されるまで待った時間
+  uint64_t wait_cycles;
+  uint64_t switches;
+  // 自分から眠るか終了した回数と、実行を奪われた回数
+  uint64_t voluntary;
+  uint64_t involuntary;
+  int32_t level;
+  int32_t cpu;
+  uint32_t running;
+  uint32_t reserved;
+  // 実行中のアプリのファイル名（アプリでなければ空）
+  char name[16];
+};
+/// 生存しているタスクの情報を最大len個書き込み、タスクの数を返す
+struct SyscallResult SyscallGetTaskStat(struct TaskStat* stats, size_t len);
+
+/// kernel/idle.hppのIdleStatと同じ並び（時間はTSCのカウント）
+struct IdleStat {
+  // アイドルループで休んでいた時間と、休んだ回数
+  uint64_t idle_cycles;
+  uint64_t entries;
+  // MWAITで休んだ回数と、他のCPUコアからの呼び鈴で起きた回数
+  uint64_t mwait_entries;
+  uint64_t doorbell_wakeups;
+};
+/// CPUコアごとのアイドル時間の統計を最大len個書き込み、CPUコアの数を返す
+struct SyscallResult SyscallGetIdleStat(struct IdleStat* stats, size_t len);
+
+// 共有メモリを作ってマップし、そのアドレスを返す。*idに他のタスクがSyscallMapShmに渡すIDが入る
+// SyscallUnmapでマップを解除し、どのタスクからもマップされなくなったら解放される
+struct SyscallResult SyscallCreateShm(size_t bytes, uint64_t* id, int flags);
+// 共有メモリをマップし、そのアドレスを返す。*bytesに共有メモリの大きさが入る
+struct SyscallResult SyscallMapShm(uint64_t id, size_t* bytes, int flags);
+
+struct WaitFd {
+  int fd;
+  // 読めるなら1が入る
+  int ready;
+};
+#define WAIT_INFINITE    (~0ul)
+#define WAIT_READY_FD    1
+#define WAIT_READY_EVENT 2
+// fdsのどれかが読めるか、SyscallReadEventで読めるイベントが届くまで、最大timeout_ms待つ
+// 戻り値はWAIT_READY_*の組み合わせ（タイムアウトなら0）
+struct SyscallResult SyscallWait(struct WaitFd* fds, size_t num_fds, unsigned long timeout_ms);
+
+// 非同期リングに積む要求の種類（システムコール番号。syscall.asmと同じ値）
+#define SYSNO_PUT_STRING         0x80000001
+#define SYSNO_WIN_WRITE_STRING   0x80000004
+#define SYSNO_WIN_FILL_RECTANGLE 0x80000005
+#define SYSNO_WIN_REDRAW         0x80000007
+#define SYSNO_WIN_DRAW_LINE      0x80000008
+#define SYSNO_CREATE_TIMER       0x8000000b
+#define SYSNO_READ_FILE          0x8000000d
+#define SYSNO_WIN_BATCH          0x8000001c
+#define SYSNO_WRITE_FILE         0x8000001e
+
+/// 非同期リングの先頭（kernel/async_ring.hppと同じ並び）
+/// 受付リングはアプリがsq_tailを、完了リングはアプリがcq_headを進める
+struct AsyncRingHeader {
+  uint32_t sq_head, sq_tail, sq_entries, sq_offset;
+  uint32_t cq_head, cq_tail, cq_entries, cq_offset;
+};
+struct AsyncSubmission {
+  uint64_t op;
+  uint64_t args[6];
+  uint64_t user_data;
+};
+struct AsyncCompletion {
+  uint64_t user_data;
+  uint64_t value;
+  int64_t error;
+  uint64_t reserved;
+};
+// entries個の要求を積める非同期リングを作ってマップし、先頭のAsyncRingHeaderのアドレスを返す
+// *fdにSyscallAsyncEnterに渡すファイルディスクリプタが入る
+struct SyscallResult SyscallAsyncSetup(size_t entries, int* fd, int flags);
+// 受付リングに積んだ要求を最大to_submit個処理し、処理した数を返す。結果は完了リングに積まれる
+struct SyscallResult SyscallAsyncEnter(int fd, size_t to_submit);
+
+/// イベントリングの先頭（kernel/event_ring.hppと同じ並び）。AppEventの配列がoffsetバイト目から続く
+/// カーネルがtailを、アプリがheadを進める
+struct EventRingHeader {
+  uint32_t head, tail, entries, offset;
+};
+// entries個のイベントを積めるリングを作ってマップし、先頭のEventRingHeaderのアドレスを返す
+// 以降、ウィンドウやタイマのイベントはSyscallReadEventではなくこのリングに届く
+struct SyscallResult SyscallEventRingSetup(size_t entries, int flags);
+
+// リングからイベントを1つ取り出す。なければ0を返す（システムコールは呼ばない）
+static inline int EventRingPop(struct EventRingHeader* ring, struct AppEvent* event) {
+  const uint32_t head = ring->head;
+  if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  const struct AppEvent* events = (const struct AppEvent*)((const char*)ring + ring->offset);
+  *event = events[head & (ring->entries - 1)];
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+// イベントを1つ取り出す。リングが空のときだけSyscallWaitで届くのを待つ
+static inline void EventRingWait(struct EventRingHeader* ring, struct AppEvent* event) {
+  while (!EventRingPop(ring, event)) {
+    SyscallWait(NULL, 0, WAIT_INFINITE);
+  }
+}
+
+// スレッド : 同じアドレス空間で動く別のタスク。ファイルディスクリプタやメモリは共有し、スタックだけを別に持つ
+// スレッドの中でexitするとそのスレッドだけが終わる。アプリは待っていないスレッドがすべて終わってから終わる
+// いまはアプリを起動したタスクと同じCPUコアで動かすので、同時にではなく交互に動く
+// ripから、rdi, rsiを引数にして実行を始めるスレッドを作り、そのIDを返す（ふつうはSyscallCreateThreadを使う）
+struct SyscallResult SyscallCreateThreadAt(uint64_t rip, uint64_t rdi, uint64_t rsi);
+static inline void ThreadStart(int (*f)(void*), void* arg) {
+  SyscallExit(f(arg));
+}
+// f(arg)を実行するスレッドを作る。fの戻り値がスレッドの終了コードになる
+static inline struct SyscallResult SyscallCreateThread(int (*f)(void*), void* arg) {
+  return SyscallCreateThreadAt((uint64_t)ThreadStart, (uint64_t)f, (uint64_t)arg);
+}
+// スレッドが終わるまで待ち、その終了コードを返す。1つのスレッドを待てるのは1回だけ
+struct SyscallResult SyscallJoinThread(uint64_t thread_id);
+// *addrがexpectedと等しければ、同じaddrでSyscallFutexWakeが呼ばれるまで眠る（等しくなければEAGAIN）
+// ほかの理由で起きることもあるので、戻ったら値を確かめ直す
+struct SyscallResult SyscallFutexWait(uint32_t* addr, uint32_t expected);
+// addrで眠っているスレッドを最大count個起こし、起こした数を返す
+struct SyscallResult SyscallFutexWake(uint32_t* addr, size_t count);
+
+// pathのアプリを別のタスク（別のアドレス空間）で起動し、そのタスクのIDを返す。終わるのは待たない
+// argvはNULLで終わる引数の配列（argv[0]はアプリの名前。NULLならpathだけ）。引数に空白は含められない
+// fdsは起動するアプリの標準入力、標準出力、標準エラー出力にするファイルディスクリプタ3つ（NULLなら0, 1, 2）
+struct SyscallResult SyscallSpawn(const char* path, const char* const* argv, const int* fds);
+// SyscallSpawnで起動したアプリが終わるまで待ち、その終了コードを返す。1つのタスクを待てるのは1回だけ
+struct SyscallResult SyscallWaitTask(uint64_t task_id);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
\ No newline at end of file
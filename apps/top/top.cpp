@@ -0,0 +1,180 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include "../syscall.h"
+
+namespace {
+    const int kRows = 20;
+    const int kColumns = 66;
+    /// 表示を更新する間隔
+    const unsigned long kIntervalMs = 1000;
+
+    /// 前回からの差分にした1タスクぶんの行
+    struct Row {
+        TaskStat stat;
+        /// 前回からの実行時間（千分率、CPUコア1つぶんが1000）
+        uint64_t cpu_permille;
+        uint64_t switches, voluntary, involuntary;
+        uint64_t wait_us;
+    };
+
+    std::vector<TaskStat> Sample() {
+        std::vector<TaskStat> stats(64);
+        while (true) {
+            auto [n, err] = SyscallGetTaskStat(stats.data(), stats.size());
+            if (err) {
+                fprintf(stderr, "failed to get task stats: %s\n", strerror(err));
+                exit(1);
+            }
+            if (n <= stats.size()) {
+                stats.resize(n);
+                return stats;
+            }
+            stats.resize(n + 16);
+        }
+    }
+
+    /// prevからcurまでの差分を、実行時間の長い順に並べる（prevにないタスクは生まれてからの値）
+    std::vector<Row> Diff(const std::map<uint64_t, TaskStat>& prev, const std::vector<TaskStat>& cur,
+                          uint64_t elapsed_tsc) {
+        const uint64_t tsc_per_us = ((const TimePage*)TIME_PAGE_ADDR)->tsc_freq / 1000000;
+        std::vector<Row> rows;
+        for (const auto& s : cur) {
+            TaskStat base{};
+            if (auto it = prev.find(s.id); it != prev.end()) {
+                base = it->second;
+            }
+            const uint64_t run = s.run_cycles - base.run_cycles;
+            rows.push_back({s, elapsed_tsc ? run * 1000 / elapsed_tsc : 0,
+                            s.switches - base.switches, s.voluntary - base.voluntary,
+                            s.involuntary - base.involuntary,
+                            (s.wait_cycles - base.wait_cycles) / std::max<uint64_t>(tsc_per_us, 1)});
+        }
+        std::stable_sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) {
+            return a.cpu_permille != b.cpu_permille ? a.cpu_permille > b.cpu_permille : a.stat.id < b.stat.id;
+        });
+        return rows;
+    }
+
+    std::vector<IdleStat> SampleIdle() {
+        std::vector<IdleStat> stats(8);
+        while (true) {
+            auto [n, err] = SyscallGetIdleStat(stats.data(), stats.size());
+            if (err) {
+                fprintf(stderr, "failed to get idle stats: %s\n", strerror(err));
+                exit(1);
+            }
+            if (n <= stats.size()) {
+                stats.resize(n);
+                return stats;
+            }
+            stats.resize(n);
+        }
+    }
+
+    /// prevからcurまでに、CPUコアごとに休んでいた時間の割合を1行にまとめる（ex. IDLE  0: 97.3%  1:100.0%）
+    void FormatIdle(char* buf, size_t len, const std::vector<IdleStat>& prev, const std::vector<IdleStat>& cur,
+                    uint64_t elapsed_tsc) {
+        int n = snprintf(buf, len, "IDLE");
+        for (size_t cpu = 0; cpu < cur.size() && n < static_cast<int>(len); ++cpu) {
+            const uint64_t base = cpu < prev.size() ? prev[cpu].idle_cycles : 0;
+            const uint64_t idle = cur[cpu].idle_cycles - base;
+            const uint64_t permille = elapsed_tsc ? std::min<uint64_t>(idle * 1000 / elapsed_tsc, 1000) : 0;
+            n += snprintf(buf + n, len - n, " %2lu:%3lu.%lu%%", cpu, permille / 10, permille % 10);
+        }
+    }
+
+    const char* kHeader = "    ID NAME          CPU%      SW     VOL   INVOL  WAIT ms LV  C";
+
+    void FormatRow(char* buf, size_t len, const Row& r) {
+        snprintf(buf, len, "%6lu %-12s %3lu.%lu %7lu %7lu %7lu %4lu.%03lu %2d %2d",
+                 r.stat.id, r.stat.name[0] ? r.stat.name : "-",
+                 r.cpu_permille / 10, r.cpu_permille % 10, r.switches, r.voluntary, r.involuntary,
+                 r.wait_us / 1000, r.wait_us % 1000, r.stat.level, r.stat.cpu);
+    }
+
+    void Draw(uint64_t layer_id, const std::vector<Row>& rows, const char* idle) {
+        const uint64_t id = layer_id | LAYER_NO_REDRAW;
+        SyscallWinFillRectangle(id, 4, 24, 8 * kColumns, 16 * (kRows + 2), 0x000000);
+        SyscallWinWriteString(id, 4, 24, 0xffff00, kHeader);
+        char line[128];
+        for (int i = 0; i < kRows && i < static_cast<int>(rows.size()); ++i) {
+            FormatRow(line, sizeof(line), rows[i]);
+            SyscallWinWriteString(id, 4, 24 + 16 * (i + 1), rows[i].stat.running ? 0xffffff : 0x808080, line);
+        }
+        SyscallWinWriteString(id, 4, 24 + 16 * (kRows + 1), 0x00ffff, idle);
+        SyscallWinRedraw(layer_id);
+    }
+
+    std::map<uint64_t, TaskStat> ToMap(const std::vector<TaskStat>& stats) {
+        std::map<uint64_t, TaskStat> m;
+        for (const auto& s : stats) {
+            m[s.id] = s;
+        }
+        return m;
+    }
+
+    /// 1回だけ測って標準出力に書き出す（ex. top -b > tasks.txt）
+    void RunBatch() {
+        auto prev = ToMap(Sample());
+        const auto prev_idle = SampleIdle();
+        const uint64_t start = __builtin_ia32_rdtsc();
+        SyscallWait(nullptr, 0, kIntervalMs);
+        const uint64_t elapsed = __builtin_ia32_rdtsc() - start;
+        const auto rows = Diff(prev, Sample(), elapsed);
+
+        printf("%s\n", kHeader);
+        char line[128];
+        for (const auto& r : rows) {
+            FormatRow(line, sizeof(line), r);
+            printf("%s\n", line);
+        }
+        FormatIdle(line, sizeof(line), prev_idle, SampleIdle(), elapsed);
+        printf("%s\n", line);
+    }
+} // namespace
+
+extern "C" void main(int argc, char** argv) {
+    if (argc >= 2 && strcmp(argv[1], "-b") == 0) {
+        RunBatch();
+        exit(0);
+    }
+
+    auto [layer_id, err_openwin] = SyscallOpenWindow(8 * kColumns + 8, 16 * (kRows + 2) + 28, 10, 10, "top");
+    if (err_openwin) {
+        exit(err_openwin);
+    }
+
+    auto prev = ToMap(Sample());
+    auto prev_idle = SampleIdle();
+    uint64_t prev_tsc = __builtin_ia32_rdtsc();
+    SyscallCreatePeriodicTimer(0, 1, kIntervalMs);
+
+    AppEvent events[1];
+    while (true) {
+        SyscallReadEvent(events, 1);
+        if (events[0].type == AppEvent::kQuit) {
+            break;
+        } else if (events[0].type == AppEvent::kKeyPush && events[0].arg.keypush.press &&
+                   events[0].arg.keypush.ascii == 'q') {
+            break;
+        } else if (events[0].type == AppEvent::kTimerTimeout) {
+            const auto cur = Sample();
+            const auto cur_idle = SampleIdle();
+            const uint64_t now = __builtin_ia32_rdtsc();
+            char idle[128];
+            FormatIdle(idle, sizeof(idle), prev_idle, cur_idle, now - prev_tsc);
+            Draw(layer_id, Diff(prev, cur, now - prev_tsc), idle);
+            prev = ToMap(cur);
+            prev_idle = cur_idle;
+            prev_tsc = now;
+        }
+    }
+
+    SyscallCloseWindow(layer_id);
+    exit(0);
+}
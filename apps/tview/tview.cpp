@@ -46,31 +46,83 @@ uint64_t OpenTextWindow(int w, int h, const char* title) {
     return layer_id;
 }
 
-using LinesType = std::vector<std::pair<const char*, size_t>>;
+/// 行頭のオフセットの粗い索引。kStride行ごとに1つだけ覚えるので、大きなファイルでもメモリは少なくて済む
+/// アプリにはスレッドがないので、キー入力を待っている間に少しずつ作る
+class LineIndex {
+public:
+    static const size_t kStride = 256;
+    /// 一度のStepで調べるバイト数
+    static const size_t kStepBytes = 256 * 1024;
+
+    LineIndex(const char* data, size_t size) : data_{data}, size_{size} {
+        checkpoints_.push_back(0);
+    }
 
-// ファイル内容を行ごとにつめたコンテナを返す
-LinesType FindLines(const char* p, size_t len) {
-    LinesType lines;
-    const char* end = p + len;
+    bool Done() const { return scanned_ == size_; }
+    size_t Scanned() const { return scanned_; }
 
-    auto next_lf = [end](const char* s) {
-        while (s < end && *s != '\n') {
-            s++;
+    /// 続きをkStepBytesだけ調べる
+    void Step() {
+        const char* p = data_ + scanned_;
+        const char* end = data_ + std::min(size_, scanned_ + kStepBytes);
+        while (p < end) {
+            const char* lf = static_cast<const char*>(memchr(p, '\n', end - p));
+            if (lf == nullptr) {
+                break;
+            }
+            p = lf + 1;
+            if (++num_lf_ % kStride == 0) {
+                checkpoints_.push_back(p - data_);
+            }
         }
-        return s;
-    };
+        scanned_ = end - data_;
+    }
 
-    const char* lf = next_lf(p);
-    while (lf < end) {
-        lines.push_back({p, lf - p});
-        p = lf + 1;
-        lf = next_lf(p);
+    /// 行の数（Doneになってから使う）。最後の行は改行がなくてもよい
+    size_t NumLines() const {
+        return num_lf_ + (size_ > 0 && data_[size_ - 1] != '\n' ? 1 : 0);
     }
-    if (p < end) {
-        lines.push_back({p, end - p});
+
+    /// 行頭offsetが何行目（0始まり）か。まだ索引ができていなければ-1
+    long LineOf(size_t offset) const {
+        if (offset > scanned_) {
+            return -1;
+        }
+        const size_t k = std::upper_bound(checkpoints_.begin(), checkpoints_.end(), offset) - checkpoints_.begin() - 1;
+        size_t line = k * kStride;
+        for (const char* p = data_ + checkpoints_[k]; p < data_ + offset; ++line) {
+            p = static_cast<const char*>(memchr(p, '\n', data_ + offset - p));
+            if (p == nullptr) {
+                break;
+            }
+            ++p;
+        }
+        return line;
     }
 
-    return lines;
+private:
+    const char* data_;
+    size_t size_;
+    std::vector<size_t> checkpoints_;
+    size_t scanned_ = 0;
+    size_t num_lf_ = 0;
+};
+
+/// offsetを行頭とする行の次の行頭（なければsize）
+size_t NextLine(const char* data, size_t size, size_t offset) {
+    const void* lf = memchr(data + offset, '\n', size - offset);
+    return lf ? static_cast<const char*>(lf) - data + 1 : size;
+}
+
+/// offsetの前の行の行頭。offsetがsizeなら最後の行の行頭
+size_t PrevLine(const char* data, size_t offset) {
+    if (offset > 0 && data[offset - 1] == '\n') {
+        --offset;
+    }
+    while (offset > 0 && data[offset - 1] != '\n') {
+        --offset;
+    }
+    return offset;
 }
 
 int CountUTF8Size(uint8_t c) {
@@ -92,7 +144,7 @@ void CopyUTF8String(char* dst, size_t dst_size,
     int x = 0;
     const auto src_end = src + src_size;
     const auto dst_end = dst + dst_size;
-    while (*src) {
+    while (src < src_end && *src != '\n') {
         if (*src == '\t') {
             // tab幅
             int spaces = tab - (x % tab);
@@ -127,30 +179,69 @@ void CopyUTF8String(char* dst, size_t dst_size,
     *dst = '\0';
 }
 
-void DrawLines(const LinesType& lines, int start_line,
-               uint64_t layer_id, int w, int h, int tab) {
+/// 行頭topから1画面分の行と、最下行の位置の表示を書く。書き終えてから1回だけ再描画する
+/// movedは前回の表示から進んだ行数（負なら戻った行数）。画面の中での移動なら、中身をずらして空いた行だけを書く
+void DrawPage(const char* data, size_t size, const LineIndex& index, size_t top, int moved,
+              uint64_t layer_id, int w, int h, int tab) {
     char buf[1024];
-    SyscallWinFillRectangle(layer_id, 4, 24, 8 * w, 16 * h, 0xffffff);
-
-    // 1行ずつ書き込み
-    for (int i = 0; i < h; i++) {
-        int line_index = start_line + i;
-        if (line_index < 0 || lines.size() <= line_index) {
-            continue;
+    const uint64_t id = layer_id | LAYER_NO_REDRAW;
+
+    int first = 0, last = h;
+    if (moved == 0) {
+        first = last = 0;
+    } else if (std::abs(moved) < h) {
+        WinRect exposed[2];
+        if (auto [n, err] = SyscallWinScroll(id, 4, 24, 8 * w, 16 * h, 0, -16 * moved, exposed); !err) {
+            first = moved > 0 ? h - moved : 0;
+            last = moved > 0 ? h : -moved;
         }
+    }
+    SyscallWinFillRectangle(id, 4, 24 + 16 * first, 8 * w, 16 * (last - first), 0xffffff);
+
+    // 書き直す行だけを書く
+    size_t offset = top;
+    for (int i = 0; i < first && offset < size; i++) {
+        offset = NextLine(data, size, offset);
+    }
+    for (int i = first; i < last && offset < size; i++) {
+        const size_t next = NextLine(data, size, offset);
+        CopyUTF8String(buf, sizeof(buf), data + offset, next - offset, w, tab);
+        SyscallWinWriteString(id, 4, 24 + 16 * i, 0x000000, buf);
+        offset = next;
+    }
 
-        const auto [line, line_len] = lines[line_index];
-        CopyUTF8String(buf, sizeof(buf), line, line_len, w, tab);
-        SyscallWinWriteString(layer_id, 4, 24 + 16 * i, 0x000000, buf);
+    const long line = index.LineOf(top);
+    if (line < 0) {
+        snprintf(buf, sizeof(buf), "line ? (%d%%)", static_cast<int>(100 * top / std::max<size_t>(size, 1)));
+    } else if (index.Done()) {
+        snprintf(buf, sizeof(buf), "line %ld/%zu", line + 1, index.NumLines());
+    } else {
+        snprintf(buf, sizeof(buf), "line %ld/? (indexing %d%%)", line + 1,
+                 static_cast<int>(100 * index.Scanned() / size));
     }
+    SyscallWinFillRectangle(id, 4, 24 + 16 * h, 8 * w, 16, 0xdddddd);
+    SyscallWinWriteString(id, 4, 24 + 16 * h, 0x000000, buf);
+    SyscallWinRedraw(layer_id);
 }
 
+/// キー入力を待つ。待っている間に索引を作り進める
 // return
 // 1: kQuit -> true
 // 2: keycode
-std::tuple<bool, int> WaitEvent() {
+std::tuple<bool, int> WaitEvent(LineIndex& index) {
     AppEvent events[1];
     while (true) {
+        if (!index.Done()) {
+            // イベントが届いていなければ、索引の続きを作ってからもう一度見る
+            auto [ready, err] = SyscallWait(nullptr, 0, 0);
+            if (!err && (ready & WAIT_READY_EVENT) == 0) {
+                index.Step();
+                if (index.Done()) {
+                    return {false, 0}; // 行の数を表示し直す
+                }
+                continue;
+            }
+        }
         auto [n, err] = SyscallReadEvent(events, 1);
         if (err) {
             fprintf(stderr, "ReadEvent failed: %s\n", strerror(err));
@@ -167,18 +258,33 @@ std::tuple<bool, int> WaitEvent() {
 }
 
 // return: kQuit -> true
-bool UpdateStartLine(int* start_line, int height, size_t num_lines) {
+// movedには進んだ行数（戻ったなら負）を入れる。Home、Endのように飛んだときはheightにして全体を書き直させる
+bool UpdateTop(size_t* top, int* moved, const char* data, size_t size, LineIndex& index, int height) {
+    // 最後のページの行頭。ファイルの後ろから数えるので、索引がなくてもすぐに求まる
+    size_t last_top = size;
+    for (int i = 0; i < height && last_top > 0; i++) {
+        last_top = PrevLine(data, last_top);
+    }
+
+    *moved = 0;
     while (true) {
-        const auto [quit, keycode] = WaitEvent();
+        const auto [quit, keycode] = WaitEvent(index);
         if (quit) {
             return quit;
         }
-        if (num_lines < height) {
-            continue;
-        }
 
         int diff;
         switch (keycode) {
+        case 74: // Home
+            diff = 0;
+            *top = 0;
+            *moved = height;
+            break;
+        case 77: // End
+            diff = 0;
+            *top = last_top;
+            *moved = height;
+            break;
         case 75: // PageUp
             diff = -height / 2;
             break;
@@ -192,18 +298,17 @@ bool UpdateStartLine(int* start_line, int height, size_t num_lines) {
             diff = -1;
             break;
         default:
-            continue;
+            // 索引の進み具合を書き直す
+            return false;
         }
 
-        if ((diff < 0 && *start_line == 0) || (diff > 0 && *start_line == num_lines - height)) { // 文頭 or 文末
-            continue;
+        for (; diff > 0 && *top < last_top; diff--) {
+            *top = NextLine(data, size, *top);
+            ++*moved;
         }
-
-        *start_line += diff;
-        if (*start_line < 0) {
-            *start_line = 0;
-        } else if (*start_line > num_lines - height) {
-            *start_line = num_lines - height;
+        for (; diff < 0 && *top > 0; diff++) {
+            *top = PrevLine(data, *top);
+            --*moved;
         }
         return false;
     }
@@ -242,15 +347,16 @@ extern "C" void main(int argc, char** argv) {
 
     const char* last_slash = strchr(filepath, '/');
     const char* filename = last_slash ? &last_slash[1] : filepath;
-    const auto layer_id = OpenTextWindow(width, height, filename);
-
-    const auto lines = FindLines(content, filesize);
+    // 最下行に位置を表示する
+    const auto layer_id = OpenTextWindow(width, height + 1, filename);
 
-    int start_line = 0;
+    LineIndex index{content, filesize};
+    size_t top = 0;
+    int moved = height; // 最初は全体を書く
     // メインループ
     while (true) {
-        DrawLines(lines, start_line, layer_id, width, height, tab);
-        if (UpdateStartLine(&start_line, height, lines.size())) {
+        DrawPage(content, filesize, index, top, moved, layer_id, width, height, tab);
+        if (UpdateTop(&top, &moved, content, filesize, index, height)) {
             break;
         }
     }
@@ -72,6 +72,8 @@ namespace acpi {
     }
 
     const FADT* g_fadt;
+    const MADT* g_madt;
+    const MCFG* g_mcfg;
 
     void Initialize(const RSDP& rsdp) {
         if (!rsdp.IsValid()) {
@@ -85,13 +87,18 @@ namespace acpi {
             exit(1);
         }
 
-        // XSDTが持つアドレス配列からFADTを検索
+        // XSDTが持つアドレス配列からFADT、MADT、MCFGを検索
         g_fadt = nullptr;
+        g_madt = nullptr;
+        g_mcfg = nullptr;
         for (int i = 0; i < xsdt.Count(); i++) {
             const auto& entry = xsdt[i];
-            if (entry.IsValid("FACP")) { // FACP is the signature of FADT
+            if (g_fadt == nullptr && entry.IsValid("FACP")) { // FACP is the signature of FADT
                 g_fadt = reinterpret_cast<const FADT*>(&entry);
-                break;
+            } else if (g_madt == nullptr && entry.IsValid("APIC")) { // APIC is the signature of MADT
+                g_madt = reinterpret_cast<const MADT*>(&entry);
+            } else if (g_mcfg == nullptr && entry.IsValid("MCFG")) {
+                g_mcfg = reinterpret_cast<const MCFG*>(&entry);
             }
         }
 
@@ -73,7 +73,73 @@ namespace acpi {
         char reserved3[276 - 116];
     } __attribute__((packed));
 
+    /// MADT : Multiple APIC Description Table
+    /// CPUコアごとのLocal APICなど、割り込みコントローラーの一覧を記載しているテーブル
+    /// ヘッダの後ろに、種類と長さで始まる可変長のエントリが並ぶ
+    struct MADT {
+        DescriptionHeader header;
+
+        uint32_t lapic_address;
+        uint32_t flags;
+    } __attribute__((packed));
+
+    /// MADTのエントリ（種類0 : Processor Local APIC）
+    struct MADTLocalAPIC {
+        uint8_t type;
+        uint8_t length;
+        uint8_t acpi_processor_id;
+        uint8_t apic_id;
+        /// bit0 : 有効
+        uint32_t flags;
+    } __attribute__((packed));
+
+    /// MADTのエントリ（種類1 : I/O APIC）
+    struct MADTIOAPIC {
+        uint8_t type;
+        uint8_t length;
+        uint8_t ioapic_id;
+        uint8_t reserved;
+        /// レジスタの物理アドレス
+        uint32_t address;
+        /// このI/O APICの0番の入力に対応するGSI（Global System Interrupt）
+        uint32_t gsi_base;
+    } __attribute__((packed));
+
+    /// MADTのエントリ（種類2 : Interrupt Source Override）
+    /// ISAのIRQがI/O APICの同じ番号の入力につながっていない場合や、極性・トリガモードが既定と違う場合に載る
+    struct MADTInterruptSourceOverride {
+        uint8_t type;
+        uint8_t length;
+        /// 0 : ISA
+        uint8_t bus;
+        /// ISAのIRQ番号
+        uint8_t source;
+        uint32_t gsi;
+        /// bit0-1 : 極性（0 : バスの既定、1 : High、3 : Low）、bit2-3 : トリガモード（0 : バスの既定、1 : エッジ、3 : レベル）
+        uint16_t flags;
+    } __attribute__((packed));
+
+    /// MCFG : PCI Express memory mapped configuration space base address Description Table
+    /// PCIのコンフィグレーション空間をメモリにマップした領域（ECAM）の一覧
+    struct MCFG {
+        DescriptionHeader header;
+        uint64_t reserved;
+    } __attribute__((packed));
+
+    /// MCFGのエントリ。バスbのデバイスdのファンクションfの空間は base + (b - start_bus) << 20 | d << 15 | f << 12
+    struct MCFGEntry {
+        uint64_t base_address;
+        uint16_t segment_group;
+        uint8_t start_bus;
+        uint8_t end_bus;
+        uint32_t reserved;
+    } __attribute__((packed));
+
     extern const FADT* g_fadt;
+    /// 見つからなければnullptr
+    extern const MADT* g_madt;
+    /// 見つからなければnullptr（I/Oポートでコンフィグレーション空間を読む）
+    extern const MCFG* g_mcfg;
     /// ACPI PMタイマの周波数 : 3.579545MHz
     /// 24ビットカウンタなら約4.7秒で1周して0になる
     const int kPMTimerFreq = 3579545;
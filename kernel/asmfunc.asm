@@ -19,6 +19,32 @@ IoIn32:
     in eax, dx
     ret
 
+global IoOut16  ; void IoOut16(uint16_t addr, uint16_t data);
+IoOut16:
+    mov dx, di    ; dx = addr
+    mov ax, si    ; ax = data
+    out dx, ax
+    ret
+
+global IoIn16  ; uint16_t IoIn16(uint16_t addr);
+IoIn16:
+    mov dx, di    ; dx = addr
+    in ax, dx
+    ret
+
+global IoOut8  ; void IoOut8(uint16_t addr, uint8_t data);
+IoOut8:
+    mov dx, di    ; dx = addr
+    mov ax, si    ; al = data
+    out dx, al
+    ret
+
+global IoIn8  ; uint8_t IoIn8(uint16_t addr);
+IoIn8:
+    mov dx, di    ; dx = addr
+    in al, dx
+    ret
+
 global GetCS  ; uint16_t GetCS(void);
 GetCS:
     xor eax, eax  ; also clears upper 32 bits of rax
@@ -98,6 +124,37 @@ GetCR3:
     mov rax, cr3
     ret
 
+global GetCR4  ; uint64_t GetCR4();
+GetCR4:
+    mov rax, cr4
+    ret
+
+global SetCR4  ; void SetCR4(uint64_t value);
+SetCR4:
+    mov cr4, rdi
+    ret
+
+global ReadTSC  ; uint64_t ReadTSC();
+ReadTSC:
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global ReadCPUID  ; void ReadCPUID(uint32_t eax, uint32_t ecx, uint32_t* regs);
+ReadCPUID:
+    push rbx  ; rbx は callee-saved
+    mov r8, rdx
+    mov eax, edi
+    mov ecx, esi
+    cpuid
+    mov [r8], eax
+    mov [r8 + 4], ebx
+    mov [r8 + 8], ecx
+    mov [r8 + 12], edx
+    pop rbx
+    ret
+
 extern g_kernel_main_stack
 extern KernelMainNewStack
 
@@ -112,8 +169,28 @@ KernelMain:
     hlt
     jmp .fin
 
+; rdiの指すTaskContextから汎用レジスタを復帰する（rdiは最後に上書きする）
+%macro RESTORE_GENERAL_REGISTERS 0
+    mov rax, [rdi + 0x40]
+    mov rbx, [rdi + 0x48]
+    mov rcx, [rdi + 0x50]
+    mov rdx, [rdi + 0x58]
+    mov rsi, [rdi + 0x68]
+    mov rbp, [rdi + 0x78]
+    mov r8,  [rdi + 0x80]
+    mov r9,  [rdi + 0x88]
+    mov r10, [rdi + 0x90]
+    mov r11, [rdi + 0x98]
+    mov r12, [rdi + 0xa0]
+    mov r13, [rdi + 0xa8]
+    mov r14, [rdi + 0xb0]
+    mov r15, [rdi + 0xb8]
+    mov rdi, [rdi + 0x60]
+%endmacro
+
 ; 現在実行中のコンテキストを第2引数（RSI）が指すメモリ領域に保存し、
 ; 第1引数（RDI）が指すメモリ領域からCPUのレジスタを復帰
+extern g_cr3_noflush
 global SwitchContext
 SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
     mov [rsi + 0x40], rax
@@ -137,6 +214,12 @@ SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
     mov [rsi + 0xb8], r15
 
     mov rax, cr3
+    ; PCIDが有効なら、復帰時にTLBを破棄しないようにbit63を立てておく
+    ; PCID 0は複数のアドレス空間で共有しうるので、復帰のたびに破棄させる
+    test eax, 0xfff
+    jz .save_cr3
+    or rax, [g_cr3_noflush]
+.save_cr3:
     mov [rsi + 0x00], rax  ; CR3
     mov rax, [rsp]
     mov [rsi + 0x08], rax  ; RIP
@@ -152,45 +235,60 @@ SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
     mov dx, gs
     mov [rsi + 0x38], rdx
 
-    fxsave [rsi + 0xc0]
+    ; FPUのレジスタは、次にFPUを使ったタスクの#NMで保存する（fpu.cpp）
     ; fall through to RestoreContext
 
 global RestoreContext
 RestoreContext:  ; void RestoreContext(void* task_context);
-    ; iret 用のスタックフレーム
-    push qword [rdi + 0x28] ; SS
-    push qword [rdi + 0x70] ; RSP
-    push qword [rdi + 0x10] ; RFLAGS
-    push qword [rdi + 0x20] ; CS
-    push qword [rdi + 0x08] ; RIP
-
-    ; コンテキストの復帰
-    fxrstor [rdi + 0xc0]
-
+    ; アドレス空間が変わらなければCR3を書き換えない（カーネルのタスク同士、同じアプリのスレッド同士）
+    ; bit63（TLBを破棄しない）はCR3を読んでも見えないので、外して比べる
     mov rax, [rdi + 0x00]
+    mov rcx, rax
+    btr rcx, 63
+    mov rdx, cr3
+    cmp rcx, rdx
+    je .cr3_done
     mov cr3, rax
+.cr3_done:
+    ; セグメントレジスタも、値が変わるときだけ読み込む
     mov rax, [rdi + 0x30]
+    mov dx, fs
+    cmp ax, dx
+    je .fs_done
     mov fs, ax
+.fs_done:
     mov rax, [rdi + 0x38]
+    mov dx, gs
+    cmp ax, dx
+    je .gs_done
     mov gs, ax
+.gs_done:
 
-    mov rax, [rdi + 0x40]
-    mov rbx, [rdi + 0x48]
-    mov rcx, [rdi + 0x50]
-    mov rdx, [rdi + 0x58]
-    mov rsi, [rdi + 0x68]
-    mov rbp, [rdi + 0x78]
-    mov r8,  [rdi + 0x80]
-    mov r9,  [rdi + 0x88]
-    mov r10, [rdi + 0x90]
-    mov r11, [rdi + 0x98]
-    mov r12, [rdi + 0xa0]
-    mov r13, [rdi + 0xa8]
-    mov r14, [rdi + 0xb0]
-    mov r15, [rdi + 0xb8]
-
-    mov rdi, [rdi + 0x60]
+    ; CSとSSが今と同じ（カーネルのタスク同士）なら、iretを使わずにスタックを切り替えてretで戻る
+    ; 保存したCSとSSは上位のビットが不定なので、下位16ビットだけを比べる
+    mov ax, cs
+    cmp ax, [rdi + 0x20]
+    jne .iret
+    mov ax, ss
+    cmp ax, [rdi + 0x28]
+    jne .iret
+
+    ; カーネルはレッドゾーンを使わないので、切り替え先のスタックのRSPより下に積んでよい
+    mov rsp, [rdi + 0x70]
+    push qword [rdi + 0x08] ; RIP
+    push qword [rdi + 0x10] ; RFLAGS
+    RESTORE_GENERAL_REGISTERS
+    popfq
+    ret
 
+.iret:
+    ; iret 用のスタックフレーム
+    push qword [rdi + 0x28] ; SS
+    push qword [rdi + 0x70] ; RSP
+    push qword [rdi + 0x10] ; RFLAGS
+    push qword [rdi + 0x20] ; CS
+    push qword [rdi + 0x08] ; RIP
+    RESTORE_GENERAL_REGISTERS
     o64 iret
 
 global CallApp
@@ -221,8 +319,7 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     mov rbp, rsp
 
     ; スタック上に TaskContext 型の構造を構築する
-    sub rsp, 512
-    fxsave [rsp]
+    ; FPUのレジスタは遅延切り替えするので保存しない（ハンドラ内でもFPUを使えば#NMで保存される）
     push r15
     push r14
     push r13
@@ -243,6 +340,10 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     mov ax, fs
     mov bx, gs
     mov rcx, cr3
+    test ecx, 0xfff  ; PCID 0ならbit63を立てない（SwitchContextと同じ）
+    jz .save_cr3
+    or rcx, [g_cr3_noflush]
+.save_cr3:
 
     push rbx                 ; GS
     push rax                 ; FS
@@ -272,12 +373,82 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     pop r13
     pop r14
     pop r15
-    fxrstor [rsp]
 
     mov rsp, rbp
     pop rbp
     iretq
 
+extern LazyFPUSwitch
+extern g_fpu_save_mode
+; FPUSwitchAreas LazyFPUSwitch();
+
+global IntHandlerDeviceNotAvailable
+IntHandlerDeviceNotAvailable:  ; void IntHandlerDeviceNotAvailable();
+    ; 割り込まれたコードのcaller-savedレジスタを退避（割り込みフレームと合わせてRSPは16byte境界になる）
+    push rax
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push r8
+    push r9
+    push r10
+    push r11
+
+    clts
+    call LazyFPUSwitch  ; RAX : 保存先, RDX : 復帰元
+    mov rsi, rax
+    mov rdi, rdx
+    ; XSAVE / XRSTORで扱う状態のビットマップ（XCR0で有効なものすべて）
+    mov eax, 0xffffffff
+    mov edx, 0xffffffff
+    mov ecx, [g_fpu_save_mode]
+
+    test rsi, rsi
+    jz .restore
+    cmp ecx, 2
+    je .xsaveopt
+    cmp ecx, 1
+    je .xsave
+    fxsave64 [rsi]
+    jmp .restore
+.xsaveopt:
+    xsaveopt64 [rsi]
+    jmp .restore
+.xsave:
+    xsave64 [rsi]
+
+.restore:
+    test rdi, rdi
+    jz .done
+    test ecx, ecx
+    jnz .xrstor
+    fxrstor64 [rdi]
+    jmp .done
+.xrstor:
+    xrstor64 [rdi]
+
+.done:
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rax
+    iretq
+
+global SetXCR0
+SetXCR0:  ; void SetXCR0(uint64_t value);
+    mov rax, rdi
+    mov rdx, rdi
+    shr rdx, 32
+    xor ecx, ecx  ; XCR0
+    xsetbv
+    ret
+
 global LoadTR
 LoadTR:  ; void LoadTR(uint16_t sel);
     ltr di
@@ -293,7 +464,16 @@ WriteMSR:  ; void WriteMSR(uint32_t msr, uint64_t value);
     wrmsr
     ret
 
+global ReadMSR
+ReadMSR:  ; uint64_t ReadMSR(uint32_t msr);
+    mov ecx, edi
+    rdmsr
+    shl rdx, 32
+    or rax, rdx
+    ret
+
 extern GetCurrentTaskOSStackPointer
+extern ExitAppIfRequested
 extern g_syscall_table
 global SyscallEntry
 SyscallEntry:  ; void SyscallEntry(void);
@@ -330,6 +510,13 @@ SyscallEntry:  ; void SyscallEntry(void);
     ; rbx, r12-r15 は callee-saved なので呼び出し側で保存しない
     ; rax は戻り値用なので呼び出し側で保存しない
 
+    ; 強制終了を求められたスレッドは、アプリに戻らずに終わる（戻り値のrax, rdxを保存しておく）
+    push rax
+    push rdx
+    call ExitAppIfRequested
+    pop rdx
+    pop rax
+
     mov rsp, rbp
 
     pop rsi  ; システムコール番号を復帰
@@ -378,3 +565,84 @@ global InvalidateTLB  ; void InvalidateTLB(uint64_t addr);
 InvalidateTLB:
     invlpg [rdi]
     ret
+
+global InvalidatePCID  ; void InvalidatePCID(uint64_t pcid);
+InvalidatePCID:
+    ; INVPCID記述子 : PCID（下位12bit）, 線形アドレス
+    push qword 0
+    push rdi
+    mov rax, 1  ; タイプ1 : 指定PCIDのグローバルでないエントリをすべて破棄
+    invpcid rax, [rsp]
+    add rsp, 16
+    ret
+
+; APの起動用コード
+; InitializeSMP()がkAPTrampolineAddr（0x8000）にコピーし、そのページ番号をSIPIで通知する
+; リアルモードで動き出したAPをプロテクトモード、ロングモードへと移行させ、APMain(cpu)を呼ぶ
+; 末尾のAPTrampolineParamsはコピー後にInitializeSMP()が書き込む（smp.cppのAPBootParams）
+%define AP_TRAMPOLINE_ADDR 0x8000
+%define TRAMPOLINE_ADDR(label) (AP_TRAMPOLINE_ADDR + (label - APTrampolineBegin))
+
+global APTrampolineBegin
+global APTrampolineParams
+global APTrampolineEnd
+
+bits 16
+APTrampolineBegin:
+    cli
+    xor ax, ax
+    mov ds, ax
+    o32 lgdt [TRAMPOLINE_ADDR(APTrampolineGDTR)]
+    mov eax, cr0
+    or eax, 1  ; PE
+    mov cr0, eax
+    jmp dword 0x08:TRAMPOLINE_ADDR(APTrampoline32)
+
+bits 32
+APTrampoline32:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    mov eax, cr4
+    or eax, 1 << 5  ; PAE
+    mov cr4, eax
+    mov eax, [TRAMPOLINE_ADDR(APTrampolineParams) + 0x08]  ; CR3（OSカーネル用のPML4）
+    mov cr3, eax
+    mov ecx, 0xc0000080  ; IA32_EFER
+    rdmsr
+    or eax, 1 << 8  ; LME
+    wrmsr
+    ; BSPと同じCR0（PG, WP=0など）にしてページングを有効化する
+    mov eax, [TRAMPOLINE_ADDR(APTrampolineParams) + 0x00]
+    mov cr0, eax
+    jmp 0x18:TRAMPOLINE_ADDR(APTrampoline64)
+
+bits 64
+APTrampoline64:
+    ; PCIDEなどはロングモードに入ってからでないと立てられない
+    mov rax, [TRAMPOLINE_ADDR(APTrampolineParams) + 0x10]
+    mov cr4, rax
+    mov rsp, [TRAMPOLINE_ADDR(APTrampolineParams) + 0x18]
+    mov edi, [TRAMPOLINE_ADDR(APTrampolineParams) + 0x28]
+    mov rax, [TRAMPOLINE_ADDR(APTrampolineParams) + 0x20]
+    call rax  ; APMain(cpu)
+.fin:
+    hlt
+    jmp .fin
+
+align 8
+APTrampolineGDT:
+    dq 0
+    dq 0x00cf9a000000ffff  ; 0x08 : 32bitコードセグメント
+    dq 0x00cf92000000ffff  ; 0x10 : データセグメント
+    dq 0x00af9a000000ffff  ; 0x18 : 64bitコードセグメント
+APTrampolineGDTR:
+    dw 8 * 4 - 1
+    dd TRAMPOLINE_ADDR(APTrampolineGDT)
+
+align 8
+APTrampolineParams:  ; CR0, CR3, CR4, スタックの末尾, APMainのアドレス, CPU番号
+    times 6 dq 0
+APTrampolineEnd:
@@ -5,6 +5,10 @@
 extern "C" {
 void IoOut32(uint16_t addr, uint32_t data);
 uint32_t IoIn32(uint16_t addr);
+void IoOut16(uint16_t addr, uint16_t data);
+uint16_t IoIn16(uint16_t addr);
+void IoOut8(uint16_t addr, uint8_t data);
+uint8_t IoIn8(uint16_t addr);
 uint16_t GetCS(void);
 /// Interrupt Descriptor TableをCPUに登録
 void LoadIDT(uint16_t limit, uint64_t offset);
@@ -22,19 +26,32 @@ uint64_t GetCR2();
 /// 再設定することで別のページング構造に切り替えることも可能
 void SetCR3(uint64_t value);
 uint64_t GetCR3();
+uint64_t GetCR4();
+void SetCR4(uint64_t value);
+/// タイムスタンプカウンタ（CPUのクロックごとに増える）を読む
+uint64_t ReadTSC();
+/// CPUID命令を実行し、regsに eax, ebx, ecx, edx の順で結果を格納する
+void ReadCPUID(uint32_t eax, uint32_t ecx, uint32_t* regs);
 /// コンテキストを切り替える
 void SwitchContext(void* next_ctx, void* current_ctx);
 /// コンテキストを復帰
 void RestoreContext(void* ctx);
 /// 指定アプリを指定の環境で呼び出す
-int CallApp(int argc, char** argv, uint16_t ss, uint64_t rip, uint64_t rsp, uint64_t* os_stack_ptr);
+/// argc, argvはそのままアプリのrdi, rsiになる（スレッドでは任意の64bitの値を渡す）
+int CallApp(int64_t argc, char** argv, uint16_t ss, uint64_t rip, uint64_t rsp, uint64_t* os_stack_ptr);
 /// LAPICタイマ用割り込みハンドラ
 void IntHandlerLAPICTimer();
+/// #NM（CR0.TSが立った状態でのFPU命令）のハンドラ。FPUの状態を遅延切り替えする
+void IntHandlerDeviceNotAvailable();
+/// XCR0（XSAVEで扱う状態の集合）を設定
+void SetXCR0(uint64_t value);
 /// TRレジスタを設定
 void LoadTR(uint16_t sel);
 /// 指定のモデル固有レジスタに値を設定
 /// モデル固有レジスタ : MSR, Model Specific Register
 void WriteMSR(uint32_t msr, uint64_t value);
+/// 指定のモデル固有レジスタの値を読む
+uint64_t ReadMSR(uint32_t msr);
 /// syscallでコールされるOS側の関数
 void SyscallEntry(void);
 /// アプリを強制終了させる
@@ -46,4 +63,11 @@ void ExitApp(uint64_t rsp, int32_t ret_val);
 /// CPUに内蔵されている、仮想アドレスを物理アドレスに変換する処理を高速化する装置
 /// 一度解決した仮想アドレスを登録するので、階層ページング構造をたどる処理をスキップできる
 void InvalidateTLB(uint64_t addr);
+/// 指定PCIDのTLBエントリ（グローバルページを除く）を無効化する。INVPCIDに対応したCPUでのみ使える
+void InvalidatePCID(uint64_t pcid);
+/// APの起動用コード（InitializeSMP()が低位の物理アドレスにコピーして使う）
+/// APTrampolineParams : 起動に必要なパラメータを書き込む位置
+extern uint8_t APTrampolineBegin[];
+extern uint8_t APTrampolineParams[];
+extern uint8_t APTrampolineEnd[];
 }
@@ -0,0 +1,35 @@
+#include "async_ring.hpp"
+
+AsyncRingDescriptor::AsyncRingDescriptor(SharedMemory* shm)
+    : shm_{AttachSharedMemory(shm->id)},
+      sq_entries_{Header().sq_entries},
+      cq_entries_{Header().cq_entries} {}
+
+AsyncRingDescriptor::~AsyncRingDescriptor() {
+    DetachSharedMemory(shm_);
+}
+
+WithError<SharedMemory*> CreateAsyncRing(size_t sq_entries) {
+    if (sq_entries == 0 || sq_entries > kAsyncRingMaxEntries) {
+        return {nullptr, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+    size_t entries = 1;
+    while (entries < sq_entries) {
+        entries <<= 1;
+    }
+
+    // 完了を刈り取るのが遅れても受け付けを止めずに済むよう、完了リングは2倍にしておく
+    const size_t cq_offset = sizeof(AsyncRingHeader) + entries * sizeof(AsyncSubmission);
+    const size_t bytes = cq_offset + 2 * entries * sizeof(AsyncCompletion);
+    auto [shm, err] = CreateSharedMemory((bytes + 4095) / 4096);
+    if (err) {
+        return {nullptr, err};
+    }
+
+    auto& h = *reinterpret_cast<AsyncRingHeader*>(shm->frames);
+    h.sq_entries = entries;
+    h.sq_offset = sizeof(AsyncRingHeader);
+    h.cq_entries = 2 * entries;
+    h.cq_offset = cq_offset;
+    return {shm, MAKE_ERROR(Error::kSuccess)};
+}
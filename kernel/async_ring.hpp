@@ -0,0 +1,97 @@
+/// 非同期システムコールのリング
+/// アプリと共有するメモリに受付リングと完了リングを置き、溜めた要求を1回のシステムコールでまとめて処理する
+/// 要求は通常のシステムコールと同じ番号と引数で、処理はSyscallAsyncEnterを呼んだタスク自身が行う
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+#include "file.hpp"
+#include "shm.hpp"
+
+/// 共有メモリの先頭に置く（apps/syscall.hのAsyncRingHeaderと同じ並び）
+/// headは取り出す側、tailは積む側だけが進める
+struct AsyncRingHeader {
+    uint32_t sq_head, sq_tail, sq_entries, sq_offset;
+    uint32_t cq_head, cq_tail, cq_entries, cq_offset;
+};
+
+/// 受付リングの要素（apps/syscall.hのAsyncSubmissionと同じ並び）
+struct AsyncSubmission {
+    /// システムコール番号
+    uint64_t op;
+    uint64_t args[6];
+    /// 完了リングにそのまま返す値
+    uint64_t user_data;
+};
+
+/// 完了リングの要素（apps/syscall.hのAsyncCompletionと同じ並び）
+struct AsyncCompletion {
+    uint64_t user_data;
+    uint64_t value;
+    int64_t error;
+    uint64_t reserved;
+};
+
+/// 受付リングの最大要素数（2の冪）。完了リングはこの2倍
+const size_t kAsyncRingMaxEntries = 4096;
+
+/// アプリからはファイルディスクリプタとして見え、閉じられる（アプリが終了する）まで共有メモリを持っておく
+class AsyncRingDescriptor : public IFileDescriptor {
+public:
+    /// CreateAsyncRing()で作った直後の（まだアプリが触っていない）共有メモリを渡す。shmのマップ数を1つ持つ
+    explicit AsyncRingDescriptor(SharedMemory* shm);
+    ~AsyncRingDescriptor() override;
+    size_t Read(void* buf, size_t len) override { return 0; }
+    size_t Write(const void* buf, size_t len) override { return 0; }
+    size_t Size() const override { return 0; }
+    size_t Load(void* buf, size_t len, size_t offset) override { return 0; }
+    AsyncRingDescriptor* AsyncRing() override { return this; }
+
+    /// 受付リングから最大max個の要求を取り出してfuncで処理し、結果を完了リングに積む。処理した数を返す
+    /// 完了リングが満杯になったら、残りはアプリが完了を刈り取ってからの次の呼び出しで処理する
+    template <class F>
+    size_t Process(size_t max, F func) {
+        auto& h = Header();
+        const uint32_t sq_tail = __atomic_load_n(&h.sq_tail, __ATOMIC_ACQUIRE);
+
+        size_t n = 0;
+        while (n < max && sq_head_ != sq_tail) {
+            const uint32_t cq_head = __atomic_load_n(&h.cq_head, __ATOMIC_ACQUIRE);
+            if (cq_tail_ - cq_head >= cq_entries_) {
+                break;
+            }
+            // アプリが書き換えても影響しないよう、先に手元にコピーする
+            const AsyncSubmission sqe = Submissions()[sq_head_ & (sq_entries_ - 1)];
+            sq_head_++;
+            const auto [value, error] = func(sqe);
+            Completions()[cq_tail_ & (cq_entries_ - 1)] = {sqe.user_data, value, error, 0};
+            cq_tail_++;
+            __atomic_store_n(&h.sq_head, sq_head_, __ATOMIC_RELEASE);
+            __atomic_store_n(&h.cq_tail, cq_tail_, __ATOMIC_RELEASE);
+            n++;
+        }
+        return n;
+    }
+
+private:
+    AsyncRingHeader& Header() { return *reinterpret_cast<AsyncRingHeader*>(shm_->frames); }
+    AsyncSubmission* Submissions() {
+        return reinterpret_cast<AsyncSubmission*>(shm_->frames + sizeof(AsyncRingHeader));
+    }
+    AsyncCompletion* Completions() {
+        return reinterpret_cast<AsyncCompletion*>(
+            shm_->frames + sizeof(AsyncRingHeader) + sq_entries_ * sizeof(AsyncSubmission));
+    }
+
+    SharedMemory* shm_;
+    /// ヘッダの値はアプリが書き換えられるので、カーネルは自分で覚えている値を使う
+    const size_t sq_entries_, cq_entries_;
+    uint32_t sq_head_{0}, cq_tail_{0};
+};
+
+/// sq_entries個（2の冪に切り上げ）の受付リングを収めた共有メモリを作り、ヘッダを初期化する
+/// 作った時点でマップ数は1（作ったタスクが続けてマップする）
+WithError<SharedMemory*> CreateAsyncRing(size_t sq_entries);
@@ -0,0 +1,265 @@
+#include "block.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include "fat.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "spinlock.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+#include "virtio_blk.hpp"
+
+namespace {
+    /// ブートボリュームを読むブロックデバイス（ブートローダが全体を読み込んでいれば nullptr）
+    BlockDevice* g_boot_device = nullptr;
+    size_t g_boot_volume_bytes = 0;
+
+    /// 読み込んだページ（kBootVolumeBaseからのページ番号順）
+    struct VolumePage {
+        uint8_t* frame;
+        /// 書き換えられてから、まだ書き戻していない
+        bool dirty;
+    };
+    std::map<uint64_t, VolumePage>* g_volume_pages;
+    size_t g_num_dirty_pages = 0;
+    /// g_volume_pagesとその中身を保護する（ブロックデバイスとのやり取りの間は持たない）
+    SpinLock g_boot_volume_lock;
+
+    /// 書き戻す間隔（5秒）
+    const unsigned long kFlushIntervalTicks = kTimerFreq * 5;
+
+    /// ボリューム全体のバイト数（BPBに書かれた値）
+    size_t VolumeBytes(const fat::BPB& bpb) {
+        const size_t sectors = bpb.total_sectors_16 ? bpb.total_sectors_16 : bpb.total_sectors_32;
+        return sectors * bpb.bytes_per_sector;
+    }
+
+    /// デバイスの先頭のブロックがpreloadedの先頭と同じ（preloadedがなければFAT32のブートセクタ） -> true
+    bool HoldsBootVolume(BlockDevice& dev, const void* preloaded) {
+        if (dev.BlockSize() > kBytesPerFrame) {
+            return false;
+        }
+        auto [frame, err] = g_memory_manager->Allocate(1);
+        if (err) {
+            return false;
+        }
+        auto sector = reinterpret_cast<uint8_t*>(frame.Frame());
+        bool match = false;
+        if (!dev.Read(0, sector, 1)) {
+            if (preloaded) {
+                match = memcmp(sector, preloaded, dev.BlockSize()) == 0;
+            } else {
+                const auto& bpb = *reinterpret_cast<const fat::BPB*>(sector);
+                match = sector[510] == 0x55 && sector[511] == 0xaa &&
+                        memcmp(bpb.fs_type, "FAT32", 5) == 0;
+            }
+        }
+        g_memory_manager->Free(frame, 1);
+        return match;
+    }
+} // namespace
+
+void* InitializeBootVolume(void* preloaded, size_t preloaded_bytes) {
+    if (preloaded && preloaded_bytes >= VolumeBytes(*reinterpret_cast<fat::BPB*>(preloaded))) {
+        return preloaded;
+    }
+
+    g_boot_device = virtio::FindBlockDevice([preloaded](BlockDevice& dev) {
+        return HoldsBootVolume(dev, preloaded);
+    });
+    if (g_boot_device == nullptr) {
+        Log(kWarn, "no block device holds the boot volume. using %lu preloaded bytes\n",
+            preloaded_bytes);
+        return preloaded;
+    }
+
+    g_boot_volume_bytes = g_boot_device->NumBlocks() * g_boot_device->BlockSize();
+    g_volume_pages = new std::map<uint64_t, VolumePage>;
+    Log(kInfo, "boot volume: %lu bytes on a block device\n", g_boot_volume_bytes);
+    RegisterBlockDevice(g_boot_device, "virtio-blk (boot)");
+    return reinterpret_cast<void*>(kBootVolumeBase);
+}
+
+bool IsBootVolumeAddress(uint64_t addr) {
+    return g_boot_device && kBootVolumeBase <= addr && addr < kBootVolumeBase + g_boot_volume_bytes;
+}
+
+Error LoadBootVolumePage(uint64_t addr) {
+    const uint64_t page = addr & ~0xfffull;
+    auto [frame, err] = g_memory_manager->Allocate(1);
+    if (err) {
+        return err;
+    }
+    auto p = reinterpret_cast<uint8_t*>(frame.Frame());
+
+    // ボリュームの末尾を越える部分は0で埋める
+    const size_t block_size = g_boot_device->BlockSize();
+    const uint64_t lba = (page - kBootVolumeBase) / block_size;
+    const size_t num_blocks = std::min<uint64_t>(kBytesPerFrame / block_size,
+                                                 g_boot_device->NumBlocks() - lba);
+    memset(p + num_blocks * block_size, 0, kBytesPerFrame - num_blocks * block_size);
+
+    SpinLockGuard lock{g_boot_volume_lock};
+    if (auto read_err = g_boot_device->Read(lba, p, num_blocks)) {
+        g_memory_manager->Free(frame, 1);
+        return read_err;
+    }
+    auto map_err = MapKernelFrame(LinearAddress4Level{page}, p);
+    if (map_err) {
+        g_memory_manager->Free(frame, 1);
+        // 他のCPUが先に読み込んでいた
+        if (map_err.Cause() == Error::kAlreadyAllocated) {
+            return MAKE_ERROR(Error::kSuccess);
+        }
+        return map_err;
+    }
+    g_volume_pages->insert({(page - kBootVolumeBase) / kBytesPerFrame, VolumePage{p, false}});
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void MarkBootVolumeDirty(const void* addr, size_t len) {
+    const auto begin = reinterpret_cast<uint64_t>(addr);
+    if (len == 0 || !IsBootVolumeAddress(begin)) {
+        return;
+    }
+
+    SpinLockGuard lock{g_boot_volume_lock};
+    const uint64_t first = (begin - kBootVolumeBase) / kBytesPerFrame;
+    const uint64_t last = (begin + len - 1 - kBootVolumeBase) / kBytesPerFrame;
+    for (auto it = g_volume_pages->lower_bound(first);
+         it != g_volume_pages->end() && it->first <= last; ++it) {
+        if (!it->second.dirty) {
+            it->second.dirty = true;
+            g_num_dirty_pages++;
+        }
+    }
+}
+
+Error SyncBootVolume() {
+    if (g_boot_device == nullptr) {
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    const size_t block_size = g_boot_device->BlockSize();
+    const size_t blocks_per_page = kBytesPerFrame / block_size;
+    const size_t max_batch = std::max<size_t>(g_boot_device->MaxScatter(), 1);
+    std::vector<const void*> frames;
+    frames.reserve(max_batch);
+
+    Error result = MAKE_ERROR(Error::kSuccess);
+    uint64_t next = 0;
+    while (true) {
+        // ページ番号が連続する書き換えられたページを、まとめて1回の要求で書き戻す
+        // 書き戻している間に書き換えられたら、印が付き直して次の回に書き戻される
+        uint64_t first = 0;
+        frames.clear();
+        {
+            SpinLockGuard lock{g_boot_volume_lock};
+            auto it = g_volume_pages->lower_bound(next);
+            while (it != g_volume_pages->end() && !it->second.dirty) {
+                ++it;
+            }
+            if (it == g_volume_pages->end()) {
+                break;
+            }
+            first = it->first;
+            for (; it != g_volume_pages->end() && it->second.dirty && frames.size() < max_batch &&
+                   it->first == first + frames.size();
+                 ++it) {
+                it->second.dirty = false;
+                g_num_dirty_pages--;
+                frames.push_back(it->second.frame);
+            }
+        }
+        next = first + frames.size();
+
+        // ボリュームの末尾にかかるページは、ボリュームの中の分だけ書く
+        const uint64_t lba = first * blocks_per_page;
+        const uint64_t end_lba = std::min<uint64_t>(lba + frames.size() * blocks_per_page,
+                                                    g_boot_device->NumBlocks());
+        const size_t full_pages = (end_lba - lba) / blocks_per_page;
+        Error err = MAKE_ERROR(Error::kSuccess);
+        if (full_pages > 0) {
+            err = g_boot_device->WriteScatter(lba, frames.data(), full_pages, blocks_per_page);
+        }
+        if (!err && full_pages < frames.size()) {
+            err = g_boot_device->Write(lba + full_pages * blocks_per_page, frames[full_pages],
+                                       end_lba - lba - full_pages * blocks_per_page);
+        }
+        if (err) {
+            Log(kWarn, "failed to write back the boot volume at lba %lu: %s\n", lba, err.Name());
+            MarkBootVolumeDirty(reinterpret_cast<void*>(kBootVolumeBase + first * kBytesPerFrame),
+                                frames.size() * kBytesPerFrame);
+            result = err;
+        }
+    }
+    return result;
+}
+
+size_t BootVolumeDirtyPages() {
+    SpinLockGuard lock{g_boot_volume_lock};
+    return g_num_dirty_pages;
+}
+
+namespace {
+    void TaskBootVolumeFlusher(uint64_t task_id, int64_t data) {
+        Task& task = g_task_manager->CurrentTask();
+        g_timer_manager->AddTimer(
+            Timer{g_timer_manager->CurrentTick() + kFlushIntervalTicks, 0, task_id, kFlushIntervalTicks});
+        while (true) {
+            const auto msg = task.WaitMessage();
+            if (msg.type == Message::kTimerTimeout && BootVolumeDirtyPages() > 0) {
+                SyncBootVolume();
+            }
+        }
+    }
+} // namespace
+
+void StartBootVolumeFlusher() {
+    if (g_boot_device == nullptr) {
+        return;
+    }
+    // 書き戻しは急がないので、最低の優先度で動かす
+    auto& task = g_task_manager->NewTask().InitContext(TaskBootVolumeFlusher, 0);
+    g_task_manager->Wakeup(&task, 0);
+}
+
+namespace {
+    struct RegisteredDevice {
+        BlockDevice* dev;
+        const char* name;
+    };
+    std::vector<RegisteredDevice>* g_block_devices;
+    SpinLock g_block_devices_lock;
+} // namespace
+
+void RegisterBlockDevice(BlockDevice* dev, const char* name) {
+    SpinLockGuard lock{g_block_devices_lock};
+    if (g_block_devices == nullptr) {
+        g_block_devices = new std::vector<RegisteredDevice>;
+    }
+    g_block_devices->push_back({dev, name});
+    Log(kInfo, "block device %lu (%s): %lu blocks of %lu bytes\n",
+        g_block_devices->size() - 1, name, dev->NumBlocks(), dev->BlockSize());
+}
+
+size_t NumBlockDevices() {
+    SpinLockGuard lock{g_block_devices_lock};
+    return g_block_devices ? g_block_devices->size() : 0;
+}
+
+BlockDevice* BlockDeviceAt(size_t i, const char** name) {
+    SpinLockGuard lock{g_block_devices_lock};
+    if (g_block_devices == nullptr || i >= g_block_devices->size()) {
+        return nullptr;
+    }
+    if (name) {
+        *name = (*g_block_devices)[i].name;
+    }
+    return (*g_block_devices)[i].dev;
+}
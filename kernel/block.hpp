@@ -0,0 +1,54 @@
+/// ブロックデバイス : 固定長のブロック（セクタ）単位で読み書きする記憶装置
+/// ブートボリュームをブロックデバイスから必要な分だけ読み込み、仮想アドレス上に並べて見せる
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+
+class BlockDevice {
+public:
+    virtual ~BlockDevice() = default;
+    /// lbaから num_blocks ブロック読み込む。bufは物理アドレス（=仮想アドレス）が連続していること
+    virtual Error Read(uint64_t lba, void* buf, size_t num_blocks) = 0;
+    virtual Error Write(uint64_t lba, const void* buf, size_t num_blocks) = 0;
+    /// lbaから、num_bufs個のバッファ（それぞれ blocks_per_buf ブロック）を順に1回の要求で書き込む
+    virtual Error WriteScatter(uint64_t lba, const void* const* bufs, size_t num_bufs,
+                               size_t blocks_per_buf) = 0;
+    /// WriteScatter()に一度に渡せるバッファの数
+    virtual size_t MaxScatter() const = 0;
+    virtual size_t BlockSize() const = 0;
+    virtual uint64_t NumBlocks() const = 0;
+};
+
+/// ブートボリュームを用意し、fat::Initialize()に渡すアドレスを返す
+/// preloaded : ブートローダが読み込んだボリュームの先頭（なければ nullptr）、preloaded_bytes : その大きさ
+/// 全体が読み込まれていればそれをそのまま使う。そうでなければ、同じボリュームを持つブロックデバイスを探して
+/// kBootVolumeBase 以降から読めるようにする（ボリュームはデバイスの先頭にあること）
+/// どちらもできなければ、読み込まれた分だけで続ける
+/// PCIデバイスの列挙が済んでから呼ぶ
+void* InitializeBootVolume(void* preloaded, size_t preloaded_bytes);
+
+/// addrがブロックデバイスから読むブートボリュームの範囲内 -> true
+bool IsBootVolumeAddress(uint64_t addr);
+/// addrを含むページをブロックデバイスから読み込んでマップする（ページフォルトから呼ばれる）
+Error LoadBootVolumePage(uint64_t addr);
+
+/// ボリュームのaddrからlenバイトを書き換えたことを記録する
+/// 書き換えたページはすぐには書き戻さず、フラッシュ用のタスクかSyncBootVolume()がまとめて書き戻す
+/// ブロックデバイスから読んでいないボリュームなら何もしない
+void MarkBootVolumeDirty(const void* addr, size_t len);
+/// 書き換えたページをすべてブロックデバイスに書き戻す
+Error SyncBootVolume();
+/// 書き戻していないページのページ数
+size_t BootVolumeDirtyPages();
+/// 定期的に書き戻すタスクを起動する（タスク管理とタイマの初期化後に呼ぶ）
+void StartBootVolumeFlusher();
+
+/// 起動後に見つかったブロックデバイス（USBメモリなど）を登録する。登録したものは解放しない
+void RegisterBlockDevice(BlockDevice* dev, const char* name);
+/// 登録されたブロックデバイスの数と、i番目のもの（なければ nullptr）
+size_t NumBlockDevices();
+BlockDevice* BlockDeviceAt(size_t i, const char** name = nullptr);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+/// ブートローダの各段階が終わったときのTSCの添字
+enum BootLoaderPhase {
+    kLoaderStart,            // UefiMain()に入った
+    kLoaderMemoryMap,        // メモリマップを取得し保存した
+    kLoaderKernel,           // カーネルを読み込み配置した
+    kLoaderVolume,           // ボリュームイメージを読み込んだ
+    kLoaderExitBootServices, // ブートサービスを停止した
+    kNumLoaderPhases,
+};
+
+/// ブートローダがカーネルに渡す、各段階のTSC（カーネルは起動直後にコピーする）
+struct BootLoaderTiming {
+    uint64_t tsc[kNumLoaderPhases];
+};
@@ -0,0 +1,90 @@
+#include "bootjob.hpp"
+
+#include <array>
+
+#include "asmfunc.h"
+#include "sync.hpp"
+#include "task.hpp"
+
+namespace {
+    struct BootJobState {
+        const char* name{nullptr};
+        BootJobFunc* func{nullptr};
+        /// 1 << BootJobの値 の和
+        unsigned int deps{0};
+        bool done{false};
+        SpinLock lock{};
+        WaitQueue waiters{};
+        uint64_t start_tsc{0}, run_tsc{0}, end_tsc{0};
+    };
+
+    std::array<BootJobState, kNumBootJobs> g_boot_jobs{};
+
+    void TaskBootJob(uint64_t task_id, int64_t data) {
+        auto& job = g_boot_jobs[data];
+        for (int i = 0; i < kNumBootJobs; ++i) {
+            if (job.deps & (1u << i)) {
+                WaitBootJob(static_cast<BootJob>(i));
+            }
+        }
+
+        job.run_tsc = ReadTSC();
+        job.func();
+        job.end_tsc = ReadTSC();
+        {
+            SpinLockGuard guard{job.lock};
+            __atomic_store_n(&job.done, true, __ATOMIC_RELEASE);
+            job.waiters.WakeAll();
+        }
+        g_task_manager->Finish(0);
+    }
+} // namespace
+
+void StartBootJob(BootJob job, const char* name, BootJobFunc* func,
+                  std::initializer_list<BootJob> deps) {
+    const int index = static_cast<int>(job);
+    auto& state = g_boot_jobs[index];
+    {
+        SpinLockGuard guard{state.lock};
+        state.name = name;
+        state.func = func;
+        for (auto dep : deps) {
+            state.deps |= 1u << static_cast<int>(dep);
+        }
+        state.start_tsc = ReadTSC();
+    }
+    g_task_manager->NewTask()
+        .InitContext(TaskBootJob, index)
+        .Wakeup();
+}
+
+void WaitBootJob(BootJob job) {
+    auto& state = g_boot_jobs[static_cast<int>(job)];
+    SpinLockGuard guard{state.lock};
+    if (state.name == nullptr) {
+        return;
+    }
+    while (!state.done) {
+        state.waiters.Wait(state.lock);
+    }
+}
+
+bool BootJobDone(BootJob job) {
+    return __atomic_load_n(&g_boot_jobs[static_cast<int>(job)].done, __ATOMIC_ACQUIRE);
+}
+
+BootJobStat GetBootJobStat(BootJob job) {
+    auto& state = g_boot_jobs[static_cast<int>(job)];
+    SpinLockGuard guard{state.lock};
+    BootJobStat stat{state.name, state.done, 0, 0};
+    if (state.name == nullptr) {
+        return stat;
+    }
+    if (state.run_tsc) {
+        stat.wait_cycles = state.run_tsc - state.start_tsc;
+    }
+    if (state.done) {
+        stat.run_cycles = state.end_tsc - state.run_tsc;
+    }
+    return stat;
+}
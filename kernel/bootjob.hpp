@@ -0,0 +1,35 @@
+/// 起動時の初期化のうち、互いに依存しないものを別々のタスクで進める
+/// デスクトップは先に表示して入力を受け付け、遅いデバイスの初期化はその裏で終わらせる
+
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+
+/// 裏で進める初期化の種類
+enum class BootJob {
+    kVolume, // ブートボリュームとFATファイルシステム
+    kFont,   // 日本語フォント（ファイルから読むのでkVolumeの後）
+    kUSB,    // xHCI、ポートの列挙、キーボードとマウス
+};
+const int kNumBootJobs = 3;
+
+using BootJobFunc = void();
+
+/// funcを新しいタスクで実行する。depsの初期化がすべて終わってから始める
+/// タスクの機能を初期化した後に、1つのジョブにつき1回だけ呼ぶ
+void StartBootJob(BootJob job, const char* name, BootJobFunc* func,
+                  std::initializer_list<BootJob> deps = {});
+/// jobが終わるまで実行中のタスクを眠らせる。始めていないジョブは待たない
+void WaitBootJob(BootJob job);
+/// jobが終わっている : true
+bool BootJobDone(BootJob job);
+
+struct BootJobStat {
+    const char* name;    // StartBootJob()していなければnullptr
+    bool done;
+    uint64_t wait_cycles; // 依存する初期化を待っていたTSCのカウント
+    uint64_t run_cycles;  // funcの実行にかかったTSCのカウント（終わっていなければ0）
+};
+
+BootJobStat GetBootJobStat(BootJob job);
@@ -0,0 +1,82 @@
+#include "bootprof.hpp"
+
+#include <array>
+
+#include "asmfunc.h"
+
+namespace {
+    /// ブートローダの段階i - 1からiまでの名前
+    const char* const kLoaderPhaseNames[kNumLoaderPhases] = {
+        nullptr, "loader: memmap", "loader: kernel", "loader: volume", "loader: exit bs",
+    };
+
+    struct BootMark {
+        const char* name;
+        uint64_t tsc;
+    };
+
+    BootLoaderTiming g_loader_timing{};
+    /// KernelMainNewStack()に入ったときのTSC
+    uint64_t g_entry_tsc = 0;
+    /// 各段階の始まり。最後の要素は FinishBootProfile() の分（nameはnullptr）
+    std::array<BootMark, 32> g_marks;
+    size_t g_num_marks = 0;
+    bool g_finished = false;
+
+    /// ブートローダが記録を渡してきた（古いブートローダなら全部0）
+    bool HasLoaderTiming() {
+        return g_loader_timing.tsc[kLoaderStart] != 0 &&
+               g_loader_timing.tsc[kLoaderExitBootServices] >= g_loader_timing.tsc[kLoaderStart];
+    }
+} // namespace
+
+void StartBootProfile(const BootLoaderTiming& loader_timing) {
+    g_entry_tsc = ReadTSC();
+    g_loader_timing = loader_timing;
+    g_num_marks = 0;
+    g_finished = false;
+}
+
+void BootPhase(const char* name) {
+    // 最後の1つは FinishBootProfile() のために残しておく
+    if (g_finished || g_num_marks + 1 >= g_marks.size()) {
+        return;
+    }
+    g_marks[g_num_marks++] = {name, ReadTSC()};
+}
+
+void FinishBootProfile() {
+    if (g_finished) {
+        return;
+    }
+    g_marks[g_num_marks++] = {nullptr, ReadTSC()};
+    g_finished = true;
+}
+
+size_t GetBootProfile(BootPhaseRecord* records, size_t max_records) {
+    size_t n = 0;
+    auto add = [&](const char* name, uint64_t begin, uint64_t end) {
+        if (n < max_records) {
+            records[n++] = {name, end - begin};
+        }
+    };
+
+    if (HasLoaderTiming()) {
+        for (int i = 0; i + 1 < kNumLoaderPhases; ++i) {
+            add(kLoaderPhaseNames[i + 1], g_loader_timing.tsc[i], g_loader_timing.tsc[i + 1]);
+        }
+        add("loader->kernel", g_loader_timing.tsc[kLoaderExitBootServices], g_entry_tsc);
+    }
+    for (size_t i = 0; i + 1 < g_num_marks; ++i) {
+        add(g_marks[i].name, g_marks[i].tsc, g_marks[i + 1].tsc);
+    }
+    return n;
+}
+
+uint64_t BootProfileTotalCycles() {
+    if (g_num_marks == 0) {
+        return 0;
+    }
+    const uint64_t begin = HasLoaderTiming() ? g_loader_timing.tsc[kLoaderStart] : g_entry_tsc;
+    return g_marks[g_num_marks - 1].tsc - begin;
+}
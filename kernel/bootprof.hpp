@@ -0,0 +1,26 @@
+/// 起動にかかった時間を段階ごとに記録する
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "boot_timing.hpp"
+
+/// ブートローダが記録したTSCを受け取り、カーネルの記録を始める。KernelMainNewStack()の最初に呼ぶ
+void StartBootProfile(const BootLoaderTiming& loader_timing);
+/// 起動の段階nameが始まったときのTSCを記録する（前の段階はここで終わる）。nameは静的な文字列
+void BootPhase(const char* name);
+/// 最後の段階を終える（以降のBootPhase()は無視する）
+void FinishBootProfile();
+
+struct BootPhaseRecord {
+    const char* name;
+    uint64_t cycles; // この段階にかかったTSCのカウント
+};
+
+/// ブートローダとカーネルの各段階の所要時間をrecordsに書き、書いた数を返す
+/// ブートサービスの停止からKernelMainNewStack()に入るまでは "loader->kernel" とする
+size_t GetBootProfile(BootPhaseRecord* records, size_t max_records);
+/// UefiMain()に入ってからFinishBootProfile()までのTSCのカウント（ブートローダの記録がなければカーネルに入ってから）
+uint64_t BootProfileTotalCycles();
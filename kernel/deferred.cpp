@@ -0,0 +1,139 @@
+#include "deferred.hpp"
+
+#include <algorithm>
+#include <array>
+
+#include "asmfunc.h"
+#include "spinlock.hpp"
+#include "task.hpp"
+
+namespace {
+    struct WorkQueue {
+        SpinLock lock{};
+        DeferredWork* head{nullptr};
+        DeferredWork* tail{nullptr};
+        /// ワーカタスクのID（StartDeferredWorkers()を呼ぶまでは0）
+        uint64_t task_id{0};
+        DeferredQueueStat stat{};
+    };
+
+    std::array<WorkQueue, kNumWorkPriorities> g_work_queues{};
+
+    /// 積まれたことのある処理のリスト
+    SpinLock g_registry_lock{};
+    DeferredWork* g_registry{nullptr};
+
+    void TaskDeferredWorker(uint64_t task_id, int64_t data) {
+        auto& queue = g_work_queues[data];
+        Task& task = g_task_manager->CurrentTask();
+        std::array<Message, 8> msgs;
+
+        while (true) {
+            // 並んでいるものをまとめて取り出してから、ロックを持たずに実行する
+            DeferredWork* batch;
+            {
+                SpinLockGuard lock{queue.lock};
+                batch = queue.head;
+                queue.head = queue.tail = nullptr;
+            }
+            if (batch == nullptr) {
+                // 起こすためのメッセージの中身は見ない
+                task.WaitMessages(msgs.data(), msgs.size());
+                continue;
+            }
+
+            uint64_t runs = 0, cycles = 0;
+            while (batch) {
+                DeferredWork* work = batch;
+                batch = work->next;
+                work->next = nullptr;
+                // 実行中に積まれたら、もう一度実行する
+                __atomic_store_n(&work->queued, false, __ATOMIC_RELEASE);
+
+                const uint64_t start = ReadTSC();
+                const uint64_t latency = start - work->queued_tsc;
+                work->func(work->arg);
+                const uint64_t elapsed = ReadTSC() - start;
+
+                work->latency_cycles += latency;
+                work->max_latency_cycles = std::max(work->max_latency_cycles, latency);
+                work->runs++;
+                work->cycles += elapsed;
+                work->max_cycles = std::max(work->max_cycles, elapsed);
+                runs++;
+                cycles += elapsed;
+            }
+
+            SpinLockGuard lock{queue.lock};
+            queue.stat.batches++;
+            queue.stat.runs += runs;
+            queue.stat.cycles += cycles;
+            queue.stat.max_batch = std::max(queue.stat.max_batch, runs);
+        }
+    }
+} // namespace
+
+bool ScheduleWork(DeferredWork& work) {
+    __atomic_fetch_add(&work.requests, 1, __ATOMIC_RELAXED);
+    if (__atomic_exchange_n(&work.queued, true, __ATOMIC_ACQ_REL)) {
+        return false;
+    }
+    // キューに並べる前に書くので、ワーカタスクは必ずこの値を読む
+    work.queued_tsc = ReadTSC();
+
+    if (!__atomic_load_n(&work.registered, __ATOMIC_ACQUIRE)) {
+        SpinLockGuard lock{g_registry_lock};
+        if (!work.registered) {
+            work.registry_next = g_registry;
+            g_registry = &work;
+            __atomic_store_n(&work.registered, true, __ATOMIC_RELEASE);
+        }
+    }
+
+    auto& queue = g_work_queues[static_cast<int>(work.priority)];
+    bool was_empty;
+    uint64_t task_id;
+    {
+        SpinLockGuard lock{queue.lock};
+        was_empty = queue.head == nullptr;
+        if (was_empty) {
+            queue.head = &work;
+        } else {
+            queue.tail->next = &work;
+        }
+        queue.tail = &work;
+        task_id = queue.task_id;
+    }
+    // 空でなければ、ワーカタスクはすでに起こされている
+    if (was_empty && task_id != 0) {
+        g_task_manager->SendMessage(task_id, Message{Message::kDeferredWork});
+    }
+    return true;
+}
+
+void StartDeferredWorkers() {
+    for (int i = 0; i < kNumWorkPriorities; i++) {
+        Task& task = g_task_manager->NewTask().InitContext(TaskDeferredWorker, i);
+        {
+            SpinLockGuard lock{g_work_queues[i].lock};
+            g_work_queues[i].task_id = task.ID();
+        }
+        // kHigh をメインタスクと同じ最高の優先度にする
+        g_task_manager->Wakeup(&task, TaskManager::kMaxLevel - i);
+    }
+}
+
+DeferredQueueStat GetDeferredQueueStat(WorkPriority priority) {
+    auto& queue = g_work_queues[static_cast<int>(priority)];
+    SpinLockGuard lock{queue.lock};
+    return queue.stat;
+}
+
+size_t GetDeferredWorkStats(DeferredWork* out, size_t len) {
+    SpinLockGuard lock{g_registry_lock};
+    size_t n = 0;
+    for (auto work = g_registry; work && n < len; work = work->registry_next) {
+        out[n++] = *work;
+    }
+    return n;
+}
@@ -0,0 +1,60 @@
+/// 割り込みハンドラから後回しにする処理（ボトムハーフ）
+/// 割り込みハンドラはDeferredWorkを積むだけにし、時間のかかる処理は優先度ごとのワーカタスクが割り込みを許可したまま行う
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/// ワーカタスクの優先度。それぞれタスクの優先度 3、2、1 で動く
+enum class WorkPriority {
+    kHigh,
+    kNormal,
+    kLow,
+};
+const int kNumWorkPriorities = 3;
+
+/// 後回しにする処理1つ。使う側が静的に置いておくので、積むときにメモリを確保しない
+/// 実行を待っている間に何度積んでも1回の実行にまとまる
+struct DeferredWork {
+    const char* name;
+    void (*func)(uint64_t arg);
+    uint64_t arg;
+    WorkPriority priority;
+
+    // 以下はdeferred.cppが管理する
+    /// キューに並んでいる（実行が始まると下ろす）
+    bool queued{false};
+    DeferredWork* next{nullptr};
+    /// GetDeferredWorkStats()で列挙するための、積まれたことのある処理のリスト
+    bool registered{false};
+    DeferredWork* registry_next{nullptr};
+
+    /// 積まれた回数（まとまったものも数える）、実行した回数、実行にかかったTSCのサイクル数
+    uint64_t requests{0}, runs{0}, cycles{0}, max_cycles{0};
+    /// 積まれてから実行が始まるまでのTSCのサイクル数（割り込みから処理までの遅れ）
+    uint64_t latency_cycles{0}, max_latency_cycles{0};
+    /// 最後にキューに並べた時刻（TSC）
+    uint64_t queued_tsc{0};
+};
+
+/// workを積み、ワーカタスクを起こす。割り込みハンドラから呼んでよい
+/// すでに積まれていれば何もせず false
+/// StartDeferredWorkers()より前に積んだものは、ワーカタスクが起動してから実行する
+bool ScheduleWork(DeferredWork& work);
+
+/// 優先度ごとのワーカタスクを起動する
+void StartDeferredWorkers();
+
+/// 優先度ごとのキューの統計
+struct DeferredQueueStat {
+    /// ワーカタスクがキューを空にした回数、実行した処理の数、1回で実行した最大の数
+    uint64_t batches, runs, max_batch;
+    /// 実行にかかったTSCのサイクル数
+    uint64_t cycles;
+};
+
+DeferredQueueStat GetDeferredQueueStat(WorkPriority priority);
+
+/// 処理ごとの統計を最大len個outに書き、書いた数を返す
+size_t GetDeferredWorkStats(DeferredWork* out, size_t len);
@@ -35,6 +35,10 @@ public:
         kIsDirectory,
         kNoSuchEntry,
         kFreeTypeError,
+        kMemoryLimitExceeded,
+        kNoSuchTimer,
+        kExitRequested,
+        kNotSMPSafe,
         kLastOfCode, // この列挙子は常に最後に配置する
     };
 
@@ -69,6 +73,10 @@ private:
         "kIsDirectory",
         "kNoSuchEntry",
         "kFreeTypeError",
+        "kMemoryLimitExceeded",
+        "kNoSuchTimer",
+        "kExitRequested",
+        "kNotSMPSafe",
     };
     static_assert(Error::Code::kLastOfCode == code_names_.size());
 
@@ -0,0 +1,96 @@
+#include "event_ring.hpp"
+
+#include "keyboard.hpp"
+
+std::optional<AppEvent> ToAppEvent(const Message& msg) {
+    AppEvent e{};
+    switch (msg.type) {
+    case Message::kKeyPush:
+        // Ctrl + Q で終了
+        if (msg.arg.keyboard.keycode == 20 /* Q key */
+            && msg.arg.keyboard.modifier & (kLControlBitMask | kRControlBitMask)) {
+            e.type = AppEvent::kQuit;
+        } else {
+            e.type = AppEvent::kKeyPush;
+            e.arg.keypush.modifier = msg.arg.keyboard.modifier;
+            e.arg.keypush.keycode = msg.arg.keyboard.keycode;
+            e.arg.keypush.ascii = msg.arg.keyboard.ascii;
+            e.arg.keypush.press = msg.arg.keyboard.press;
+        }
+        return e;
+    case Message::kMouseMove:
+        e.type = AppEvent::kMouseMove;
+        e.arg.mouse_move.x = msg.arg.mouse_move.x;
+        e.arg.mouse_move.y = msg.arg.mouse_move.y;
+        e.arg.mouse_move.dx = msg.arg.mouse_move.dx;
+        e.arg.mouse_move.dy = msg.arg.mouse_move.dy;
+        e.arg.mouse_move.buttons = msg.arg.mouse_move.buttons;
+        return e;
+    case Message::kMouseButton:
+        e.type = AppEvent::kMouseButton;
+        e.arg.mouse_button.x = msg.arg.mouse_button.x;
+        e.arg.mouse_button.y = msg.arg.mouse_button.y;
+        e.arg.mouse_button.press = msg.arg.mouse_button.press;
+        e.arg.mouse_button.button = msg.arg.mouse_button.button;
+        return e;
+    case Message::kTimerTimeout:
+        // アプリが生成したタイマーかを識別
+        if (msg.arg.timer.value >= 0) {
+            return std::nullopt;
+        }
+        e.type = AppEvent::kTimerTimeout;
+        e.arg.timer.timeout = msg.arg.timer.timeout;
+        e.arg.timer.value = -msg.arg.timer.value;
+        return e;
+    case Message::kWindowClose:
+        e.type = AppEvent::kQuit;
+        return e;
+    default:
+        return std::nullopt;
+    }
+}
+
+EventRing::EventRing(SharedMemory* shm)
+    : shm_{AttachSharedMemory(shm->id)},
+      entries_{Header().entries} {}
+
+EventRing::~EventRing() {
+    DetachSharedMemory(shm_);
+}
+
+bool EventRing::Push(const AppEvent& event) {
+    auto& h = Header();
+    const uint32_t head = __atomic_load_n(&h.head, __ATOMIC_ACQUIRE);
+    if (tail_ - head >= entries_) {
+        return false;
+    }
+    Events()[tail_ & (entries_ - 1)] = event;
+    tail_++;
+    __atomic_store_n(&h.tail, tail_, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool EventRing::Ready() {
+    return __atomic_load_n(&Header().head, __ATOMIC_ACQUIRE) != tail_;
+}
+
+WithError<SharedMemory*> CreateEventRing(size_t entries) {
+    if (entries == 0 || entries > kEventRingMaxEntries) {
+        return {nullptr, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+    size_t n = 1;
+    while (n < entries) {
+        n <<= 1;
+    }
+
+    const size_t bytes = sizeof(EventRingHeader) + n * sizeof(AppEvent);
+    auto [shm, err] = CreateSharedMemory((bytes + 4095) / 4096);
+    if (err) {
+        return {nullptr, err};
+    }
+
+    auto& h = *reinterpret_cast<EventRingHeader*>(shm->frames);
+    h.entries = n;
+    h.offset = sizeof(EventRingHeader);
+    return {shm, MAKE_ERROR(Error::kSuccess)};
+}
@@ -0,0 +1,54 @@
+/// アプリのイベントリング
+/// アプリと共有するメモリにAppEventのリングを置き、アプリ宛てのメッセージは届いた時点でカーネルが変換して積む
+/// アプリはシステムコールなしに取り出し、リングが空のときだけSyscallWaitで待つ
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#include "app_event.hpp"
+#include "error.hpp"
+#include "message.hpp"
+#include "shm.hpp"
+
+/// 共有メモリの先頭に置く（apps/syscall.hのEventRingHeaderと同じ並び）
+/// headはアプリだけが、tailはカーネルだけが進める
+struct EventRingHeader {
+    uint32_t head, tail, entries, offset;
+};
+
+/// リングの最大要素数（2の冪）
+const size_t kEventRingMaxEntries = 4096;
+
+/// msgをアプリに渡すイベントに変換する。アプリに渡さないメッセージならstd::nullopt
+/// Ctrl + Qはキー入力ではなくkQuitになる
+std::optional<AppEvent> ToAppEvent(const Message& msg);
+
+class EventRing {
+public:
+    /// CreateEventRing()で作った直後の（まだアプリが触っていない）共有メモリを渡す。shmのマップ数を1つ持つ
+    explicit EventRing(SharedMemory* shm);
+    ~EventRing();
+    EventRing(const EventRing&) = delete;
+    EventRing& operator=(const EventRing&) = delete;
+
+    /// eventを積む。アプリが取り出すのが遅れて満杯ならfalse
+    bool Push(const AppEvent& event);
+    /// アプリがまだ取り出していないイベントがあればtrue
+    bool Ready();
+
+private:
+    EventRingHeader& Header() { return *reinterpret_cast<EventRingHeader*>(shm_->frames); }
+    AppEvent* Events() { return reinterpret_cast<AppEvent*>(shm_->frames + sizeof(EventRingHeader)); }
+
+    SharedMemory* shm_;
+    /// ヘッダの値はアプリが書き換えられるので、カーネルは自分で覚えている値を使う
+    const size_t entries_;
+    uint32_t tail_{0};
+};
+
+/// entries個（2の冪に切り上げ）のイベントを収めた共有メモリを作り、ヘッダを初期化する
+/// 作った時点でマップ数は1（作ったタスクが続けてマップする）
+WithError<SharedMemory*> CreateEventRing(size_t entries);
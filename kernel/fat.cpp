@@ -1,10 +1,14 @@
 #include "fat.hpp"
 
 #include <algorithm>
+#include <array>
 #include <cctype>
 #include <cstring>
 #include <utility>
 
+#include "block.hpp"
+#include "page_cache.hpp"
+
 namespace {
     /// 指定パスを '/' で区切った最初の要素をpath_elemにコピー
     /// 指定パスの次の要素を返す
@@ -26,10 +30,165 @@ namespace {
 namespace fat {
     BPB* g_boot_volume_image;
     unsigned long g_bytes_per_cluster;
+    std::function<void (DirectoryEntry& entry)> g_file_written_observer;
+
+    namespace {
+        /// クラスタチェーンを伸ばすたびに増やす。FileDescriptorはこれを見て索引を作り直す
+        /// 0は「索引を作っていない」を表すので1から始める
+        uint64_t g_cluster_chain_generation = 1;
+
+        /// ディレクトリエントリのキャッシュ : (ディレクトリの開始クラスタ, 8+3形式の名前) -> エントリ
+        /// 見つからなかったことも覚えておく（entry == nullptr）
+        struct DentryCacheEntry {
+            unsigned long dir_cluster; // 0なら未使用
+            unsigned char name83[11];
+            DirectoryEntry* entry;
+        };
+        /// 2の冪。同じ位置に入る別のキーは上書きする
+        const size_t kDentryCacheSize = 256;
+        std::array<DentryCacheEntry, kDentryCacheSize> g_dentry_cache{};
+        SpinLock g_dentry_lock;
+        /// 捨てるたびに増やす。探している間に捨てられたら、探した結果は記録しない
+        uint64_t g_dentry_generation = 0;
+
+        /// ファイル名を、大文字にして空白で埋めたディレクトリエントリと同じ形にする
+        void ToName83(const char* name, unsigned char* name83) {
+            memset(name83, 0x20, 11);
+            int i = 0, i83 = 0;
+            for (; name[i] != 0 && i83 < 11; i++, i83++) {
+                if (name[i] == '.') {
+                    i83 = 7;
+                    continue;
+                }
+                // 大文字変換
+                name83[i83] = toupper(name[i]);
+            }
+        }
+
+        size_t DentryCacheIndex(unsigned long dir_cluster, const unsigned char* name83) {
+            // FNV-1a
+            uint64_t h = 0xcbf29ce484222325 ^ dir_cluster;
+            for (int i = 0; i < 11; i++) {
+                h = (h ^ name83[i]) * 0x100000001b3;
+            }
+            return h & (kDentryCacheSize - 1);
+        }
+
+        /// 1つのディレクトリからname83のエントリを探す（キャッシュを見ない）
+        DirectoryEntry* ScanDirectory(unsigned long dir_cluster, const unsigned char* name83) {
+            while (dir_cluster != kEndOfClusterchain) {
+                auto dir = GetSectorByCluster<DirectoryEntry>(dir_cluster);
+                for (int i = 0; i < g_bytes_per_cluster / sizeof(DirectoryEntry); i++) {
+                    if (dir[i].name[0] == 0x00) {
+                        return nullptr;
+                    } else if (memcmp(dir[i].name, name83, 11) == 0) {
+                        return &dir[i];
+                    }
+                }
+                // ディレクトリが複数クラスタにまたがっていても対応できるようにしている
+                dir_cluster = NextCluster(dir_cluster);
+            }
+            return nullptr;
+        }
+
+        /// 1つのディレクトリからnameのエントリを探す。見つからなければnullptr
+        DirectoryEntry* LookupEntry(unsigned long dir_cluster, const char* name) {
+            unsigned char name83[11];
+            ToName83(name, name83);
+            auto& cached = g_dentry_cache[DentryCacheIndex(dir_cluster, name83)];
+            uint64_t generation;
+            {
+                SpinLockGuard lock{g_dentry_lock};
+                if (cached.dir_cluster == dir_cluster && memcmp(cached.name83, name83, 11) == 0) {
+                    return cached.entry;
+                }
+                generation = g_dentry_generation;
+            }
+
+            auto entry = ScanDirectory(dir_cluster, name83);
+            SpinLockGuard lock{g_dentry_lock};
+            if (generation != g_dentry_generation) {
+                return entry;
+            }
+            cached.dir_cluster = dir_cluster;
+            memcpy(cached.name83, name83, 11);
+            cached.entry = entry;
+            return entry;
+        }
+
+        /// ディレクトリにエントリが増えたら、見つからなかったという記録が古くなるので全部捨てる
+        void InvalidateDentryCache() {
+            SpinLockGuard lock{g_dentry_lock};
+            g_dentry_cache.fill({});
+            g_dentry_generation++;
+        }
+
+        /// 空きクラスタのビットマップ（1 : 空き）。起動時にFATを1回だけ走査して作る
+        std::vector<uint64_t> g_free_clusters;
+        /// 有効なクラスタ番号は [2, g_num_clusters)
+        unsigned long g_num_clusters = 2;
+        /// 次に空きを探し始めるクラスタ番号（next-fit）
+        unsigned long g_next_free_cluster = 2;
+        SpinLock g_cluster_alloc_lock;
+
+        bool ClusterIsFree(unsigned long cluster) {
+            return (g_free_clusters[cluster / 64] >> (cluster % 64)) & 1;
+        }
+
+        void BuildFreeClusterBitmap() {
+            const auto& bpb = *g_boot_volume_image;
+            const unsigned long data_sectors =
+                bpb.total_sectors_32 - bpb.reserved_sector_count - bpb.num_fats * bpb.fat_size_32;
+            const unsigned long fat_entries = bpb.fat_size_32 * bpb.bytes_per_sector / sizeof(uint32_t);
+            g_num_clusters = std::min(data_sectors / bpb.sectors_per_cluster + 2, fat_entries);
+
+            g_free_clusters.assign((g_num_clusters + 63) / 64, 0);
+            const uint32_t* fat = GetFAT();
+            for (unsigned long c = 2; c < g_num_clusters; c++) {
+                if ((fat[c] & 0x0ffffffful) == 0) {
+                    g_free_clusters[c / 64] |= 1ull << (c % 64);
+                }
+            }
+        }
+
+        /// 空きクラスタを1つ取り、FATに終端を書き込んで返す。空きがなければ0
+        /// hintが空いていればそれを使うので、直前に取ったクラスタの次を渡すと連続した区間になりやすい
+        unsigned long AllocateCluster(unsigned long hint) {
+            SpinLockGuard lock{g_cluster_alloc_lock};
+            unsigned long found = 0;
+            if (2 <= hint && hint < g_num_clusters && ClusterIsFree(hint)) {
+                found = hint;
+            } else {
+                // g_next_free_clusterから64クラスタずつ調べ、末尾まで行ったら先頭に戻る
+                const size_t num_words = g_free_clusters.size();
+                const size_t start_word = g_next_free_cluster / 64;
+                for (size_t i = 0; i <= num_words && found == 0; i++) {
+                    const size_t w = (start_word + i) % num_words;
+                    uint64_t bits = g_free_clusters[w];
+                    if (i == 0) { // 探し始めのワードは、g_next_free_clusterより前のビットを見ない
+                        bits &= ~0ull << (g_next_free_cluster % 64);
+                    }
+                    if (bits) {
+                        found = w * 64 + __builtin_ctzll(bits);
+                    }
+                }
+            }
+            if (found == 0) {
+                return 0;
+            }
+
+            g_free_clusters[found / 64] &= ~(1ull << (found % 64));
+            g_next_free_cluster = found + 1 < g_num_clusters ? found + 1 : 2;
+            GetFAT()[found] = kEndOfClusterchain;
+            MarkBootVolumeDirty(&GetFAT()[found], sizeof(uint32_t));
+            return found;
+        }
+    } // namespace
 
     void Initialize(void* volume_iamge) {
         g_boot_volume_image = reinterpret_cast<BPB*>(volume_iamge);
         g_bytes_per_cluster = static_cast<unsigned long>(g_boot_volume_image->bytes_per_sector) * g_boot_volume_image->sectors_per_cluster;
+        BuildFreeClusterBitmap();
     }
 
     uintptr_t GetClusterAddr(unsigned long cluster) {
@@ -88,48 +247,22 @@ namespace fat {
         // path_elemにコピーされた文字列がパスの末尾かどうか
         const bool path_last = next_path == nullptr || next_path[0] == '\0';
 
-        while (directory_cluster != kEndOfClusterchain) {
-            auto dir = GetSectorByCluster<DirectoryEntry>(directory_cluster);
-            // path_elemと一致する名前のエントリを探索
-            for (int i = 0; i < g_bytes_per_cluster / sizeof(DirectoryEntry); i++) {
-                if (dir[i].name[0] == 0x00) {
-                    goto not_found;
-                } else if (!NameIsEqual(dir[i], path_elem)) {
-                    continue;
-                }
-
-                // path_elemと一致するエントリをみつけた
-
-                if (dir[i].attr == Attribute::kDirectory && !path_last) { // 1段潜る
-                    return FindFile(next_path, dir[i].FirstCluster());
-                } else {
-                    // dir[i]がディレクトリではないか、パスの末尾に来たので探索をやめる
-                    return {&dir[i], post_slash};
-                }
-            }
-
-            // ディレクトリが複数クラスタにまたがっていても対応できるようにしている
-            directory_cluster = NextCluster(directory_cluster);
+        // path_elemと一致する名前のエントリを探索
+        auto entry = LookupEntry(directory_cluster, path_elem);
+        if (entry == nullptr) {
+            return {nullptr, post_slash};
         }
 
-    not_found:
-        return {nullptr, post_slash};
+        if (entry->attr == Attribute::kDirectory && !path_last) { // 1段潜る
+            return FindFile(next_path, entry->FirstCluster());
+        }
+        // entryがディレクトリではないか、パスの末尾に来たので探索をやめる
+        return {entry, post_slash};
     }
 
     bool NameIsEqual(const DirectoryEntry& entry, const char* name) {
         unsigned char name83[11];
-        memset(name83, 0x20, sizeof(name83));
-
-        int i = 0, i83 = 0;
-        for (; name[i] != 0 && i83 < sizeof(name83); i++, i83++) {
-            if (name[i] == '.') {
-                i83 = 7;
-                continue;
-            }
-            // 大文字変換
-            name83[i83] = toupper(name[i]);
-        }
-
+        ToName83(name, name83);
         return memcmp(entry.name, name83, sizeof(name83)) == 0;
     }
 
@@ -149,28 +282,28 @@ namespace fat {
     }
 
     unsigned long ExtendCluster(unsigned long eoc_cluster, size_t n) {
+        __atomic_fetch_add(&g_cluster_chain_generation, 1, __ATOMIC_RELAXED);
         uint32_t* fat = GetFAT();
         while (!IsEndOfClusterchain(fat[eoc_cluster])) {
             eoc_cluster = fat[eoc_cluster];
         }
 
-        size_t num_allocated = 0;
         auto current = eoc_cluster;
-
-        for (unsigned long candidate = 2; num_allocated < n; candidate++) {
-            if (fat[candidate] != 0) { // candidate cluster is not free
-                continue;
+        for (size_t i = 0; i < n; i++) {
+            // 末尾のすぐ後ろが空いていれば、それを使ってチェーンを連続させる
+            const auto next = AllocateCluster(current + 1);
+            if (next == 0) { // ボリュームが一杯
+                break;
             }
-
-            fat[current] = candidate;
-            current = candidate;
-            num_allocated++;
+            fat[current] = next;
+            MarkBootVolumeDirty(&fat[current], sizeof(uint32_t));
+            current = next;
         }
-        fat[current] = kEndOfClusterchain;
         return current;
     }
 
     DirectoryEntry* AllocateEntry(unsigned long dir_cluster) {
+        InvalidateDentryCache();
         while (true) {
             auto dir = GetSectorByCluster<DirectoryEntry>(dir_cluster);
             for (int i = 0; i < g_bytes_per_cluster / sizeof(DirectoryEntry); i++) {
@@ -191,6 +324,7 @@ namespace fat {
         dir_cluster = ExtendCluster(dir_cluster, 1);
         auto dir = GetSectorByCluster<DirectoryEntry>(dir_cluster);
         memset(dir, 0, g_bytes_per_cluster);
+        MarkBootVolumeDirty(dir, g_bytes_per_cluster);
         return &dir[0];
     }
 
@@ -244,17 +378,18 @@ namespace fat {
         }
         fat::SetFileName(*dir, filename);
         dir->file_size = 0;
+        MarkBootVolumeDirty(dir, sizeof(DirectoryEntry));
+        // 消されたファイルのエントリを再利用したかもしれない
+        if (g_file_written_observer) {
+            g_file_written_observer(*dir);
+        }
         return {dir, MAKE_ERROR(Error::kSuccess)};
     }
 
     unsigned long AllocateClusterChain(size_t n) {
-        uint32_t* fat = GetFAT();
-        unsigned long first_cluster;
-        for (first_cluster = 2;; first_cluster++) {
-            if (fat[first_cluster] == 0) { // 未使用クラスタを発見
-                fat[first_cluster] = kEndOfClusterchain;
-                break;
-            }
+        const unsigned long first_cluster = AllocateCluster(0);
+        if (first_cluster == 0) {
+            return 0;
         }
 
         if (n > 1) {
@@ -263,38 +398,234 @@ namespace fat {
         return first_cluster;
     }
 
+    namespace {
+        /// clusterから始まるチェーンのクラスタ数（最大でmax_count個まで数える）と、最後に数えたクラスタ
+        std::pair<size_t, unsigned long> CountClusters(unsigned long cluster, size_t max_count) {
+            size_t count = 1;
+            while (count < max_count) {
+                const auto next = NextCluster(cluster);
+                if (next == kEndOfClusterchain) {
+                    break;
+                }
+                cluster = next;
+                ++count;
+            }
+            return {count, cluster};
+        }
+
+        /// srcとdestのチェーンがどちらも連続している、先頭からのクラスタ数（max_count個まで）
+        size_t ContiguousRun(unsigned long src, unsigned long dest, size_t max_count) {
+            size_t run = 1;
+            while (run < max_count &&
+                   NextCluster(src + run - 1) == src + run &&
+                   NextCluster(dest + run - 1) == dest + run) {
+                ++run;
+            }
+            return run;
+        }
+    } // namespace
+
+    WithError<size_t> CopyFile(DirectoryEntry& dest, DirectoryEntry& src) {
+        if (&dest == &src) {
+            return {src.file_size, MAKE_ERROR(Error::kSuccess)};
+        }
+        if (src.attr == Attribute::kDirectory || dest.attr == Attribute::kDirectory) {
+            return {0, MAKE_ERROR(Error::kIsDirectory)};
+        }
+
+        const size_t size = src.file_size;
+        const size_t num_clusters = (size + g_bytes_per_cluster - 1) / g_bytes_per_cluster;
+        if (num_clusters > 0) {
+            if (dest.FirstCluster() == 0) {
+                const auto first = AllocateClusterChain(num_clusters);
+                if (first == 0) {
+                    return {0, MAKE_ERROR(Error::kNoEnoughMemory)};
+                }
+                dest.first_cluster_low = first & 0xffff;
+                dest.first_cluster_high = (first >> 16) & 0xffff;
+            }
+            // 既存のチェーン（ボリュームが一杯で確保しきれなかったものも）が短ければ伸ばす
+            auto [count, last] = CountClusters(dest.FirstCluster(), num_clusters);
+            if (count < num_clusters) {
+                ExtendCluster(last, num_clusters - count);
+                count = CountClusters(dest.FirstCluster(), num_clusters).first;
+            }
+            if (count < num_clusters) {
+                MarkBootVolumeDirty(&dest, sizeof(dest));
+                return {0, MAKE_ERROR(Error::kNoEnoughMemory)};
+            }
+        }
+
+        unsigned long src_cluster = src.FirstCluster();
+        unsigned long dest_cluster = dest.FirstCluster();
+        size_t offset = 0;
+        while (offset < size) {
+            const size_t remain_clusters = (size - offset + g_bytes_per_cluster - 1) / g_bytes_per_cluster;
+            const size_t run = ContiguousRun(src_cluster, dest_cluster, remain_clusters);
+            const size_t bytes = std::min(run * g_bytes_per_cluster, size - offset);
+
+            // 連続するクラスタはボリューム上でも連続している
+            uint8_t* dest_sec = GetSectorByCluster<uint8_t>(dest_cluster);
+            memcpy(dest_sec, GetSectorByCluster<uint8_t>(src_cluster), bytes);
+            MarkBootVolumeDirty(dest_sec, bytes);
+            UpdatePageCache(dest.FirstCluster(), offset, dest_sec, bytes);
+            offset += bytes;
+
+            src_cluster = NextCluster(src_cluster + run - 1);
+            dest_cluster = NextCluster(dest_cluster + run - 1);
+        }
+
+        dest.file_size = size;
+        MarkBootVolumeDirty(&dest, sizeof(dest));
+        if (g_file_written_observer) {
+            g_file_written_observer(dest);
+        }
+        return {size, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    namespace {
+        /// 先読みするページ数の上限（128KiB）
+        const size_t kMaxReadAheadPages = 32;
+    } // namespace
+
     FileDescriptor::FileDescriptor(DirectoryEntry& fat_entry) : fat_entry_{fat_entry} {
     }
 
     size_t FileDescriptor::Read(void* buf, size_t len) {
-        if (rd_cluster_ == 0) {
-            rd_cluster_ = fat_entry_.FirstCluster();
+        const size_t n = ReadAt(buf, len, rd_off_);
+        rd_off_ += n;
+        ReadAhead();
+        return n;
+    }
+
+    std::pair<const uint8_t*, size_t> FileDescriptor::PeekRead() {
+        if (rd_off_ >= fat_entry_.file_size) {
+            return {reinterpret_cast<const uint8_t*>(""), 0};
+        }
+        auto [page, err] = GetPageCache(*this, rd_off_ / 4096, false);
+        if (err) {
+            return {nullptr, 0};
         }
+        const size_t page_off = rd_off_ % 4096;
+        return {&page[page_off], std::min(4096 - page_off, fat_entry_.file_size - rd_off_)};
+    }
 
+    void FileDescriptor::ConsumeRead(size_t len) {
+        rd_off_ = std::min(rd_off_ + len, static_cast<size_t>(fat_entry_.file_size));
+        ReadAhead();
+    }
+
+    void FileDescriptor::ReadAhead() {
+        const size_t page = rd_off_ / 4096;
+        if (page != ra_last_page_ && page != ra_last_page_ + 1) { // 飛んだので、先読みをやめる
+            ra_window_ = 0;
+            ra_end_page_ = 0;
+        } else if (page != ra_last_page_) {
+            ra_window_ = std::clamp<size_t>(ra_window_ * 2, 1, kMaxReadAheadPages);
+        }
+        ra_last_page_ = page;
+        // 先読み済みの範囲の半分まで読み進めたら、次の分を読んでおく
+        if (ra_window_ == 0 || page + ra_window_ / 2 < ra_end_page_) {
+            return;
+        }
+
+        const size_t file_pages = (fat_entry_.file_size + 4095) / 4096;
+        const size_t end = std::min(page + 1 + ra_window_, file_pages);
+        for (size_t p = std::max(ra_end_page_, page + 1); p < end; p++) {
+            if (GetPageCache(*this, p, false).error) {
+                break;
+            }
+        }
+        ra_end_page_ = end;
+    }
+
+    WithError<size_t> FileDescriptor::Seek(int64_t offset, int whence) {
+        int64_t base;
+        switch (whence) {
+        case 0: base = 0; break;
+        case 1: base = rd_off_; break;
+        case 2: base = fat_entry_.file_size; break;
+        default: return {rd_off_, MAKE_ERROR(Error::kIndexOutOfRange)};
+        }
+        const int64_t new_off = base + offset;
+        if (new_off < 0 || new_off > static_cast<int64_t>(fat_entry_.file_size)) {
+            return {rd_off_, MAKE_ERROR(Error::kIndexOutOfRange)};
+        }
+        rd_off_ = new_off;
+        return {rd_off_, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    WithError<size_t> FileDescriptor::PRead(void* buf, size_t len, size_t offset) {
+        return {ReadAt(buf, len, offset), MAKE_ERROR(Error::kSuccess)};
+    }
+
+    size_t FileDescriptor::ReadAt(void* buf, size_t len, size_t offset) {
+        if (offset >= fat_entry_.file_size) {
+            return 0;
+        }
         uint8_t* buf8 = reinterpret_cast<uint8_t*>(buf);
-        len = std::min(len, fat_entry_.file_size - rd_off_);
+        len = std::min(len, fat_entry_.file_size - offset);
 
+        // ページキャッシュから読む。mmapされたページと同じフレームを共有する
         size_t total = 0;
         while (total < len) {
-            uint8_t* sec = GetSectorByCluster<uint8_t>(rd_cluster_);
-            size_t n = std::min(len - total, g_bytes_per_cluster - rd_cluster_off_);
-            memcpy(&buf8[total], &sec[rd_cluster_off_], n);
+            auto [page, err] = GetPageCache(*this, offset / 4096, false);
+            if (err) { // キャッシュできなければボリュームから直接読む
+                total += Load(&buf8[total], len - total, offset);
+                break;
+            }
+
+            const size_t page_off = offset % 4096;
+            const size_t n = std::min(len - total, 4096 - page_off);
+            memcpy(&buf8[total], &page[page_off], n);
             total += n;
+            offset += n;
+        }
+        return total;
+    }
 
-            rd_cluster_off_ += n;
-            // クラスタをまたがるファイルに対応
-            if (rd_cluster_off_ == g_bytes_per_cluster) {
-                rd_cluster_ = NextCluster(rd_cluster_);
-                rd_cluster_off_ = 0;
-            }
+    unsigned long FileDescriptor::ClusterAt(size_t index) {
+        SpinLockGuard lock{lookup_lock_};
+        if (extents_first_ != fat_entry_.FirstCluster() ||
+            extents_generation_ != __atomic_load_n(&g_cluster_chain_generation, __ATOMIC_RELAXED)) {
+            BuildClusterIndex();
         }
 
-        // rd_off_はメソッド呼び出し前よりlenバイトだけ進む
-        rd_off_ += total;
-        return total;
+        // index以下で最後に始まる区間を探す
+        auto it = std::upper_bound(extents_.begin(), extents_.end(), index,
+                                   [](size_t i, const ClusterExtent& e) { return i < e.index; });
+        if (it == extents_.begin()) {
+            return kEndOfClusterchain;
+        }
+        --it;
+        if (index - it->index >= it->count) {
+            return kEndOfClusterchain;
+        }
+        return it->cluster + (index - it->index);
+    }
+
+    void FileDescriptor::BuildClusterIndex() {
+        extents_first_ = fat_entry_.FirstCluster();
+        extents_generation_ = __atomic_load_n(&g_cluster_chain_generation, __ATOMIC_RELAXED);
+        extents_.clear();
+
+        size_t index = 0;
+        for (unsigned long cluster = extents_first_;
+             cluster != 0 && cluster != kEndOfClusterchain;
+             cluster = NextCluster(cluster), index++) {
+            if (!extents_.empty()) {
+                auto& last = extents_.back();
+                if (last.cluster + last.count == cluster) { // 直前の区間に続いている
+                    last.count++;
+                    continue;
+                }
+            }
+            extents_.push_back({index, cluster, 1});
+        }
     }
 
     size_t FileDescriptor::Write(const void* buf, size_t len) {
+        const size_t wr_off_before = wr_off_;
         // 指定バイト数を書き込むのに必要なクラスタ数を算出
         auto num_cluster = [](size_t bytes) {
             // 切り上げ
@@ -306,6 +637,9 @@ namespace fat {
                 wr_cluster_ = fat_entry_.FirstCluster();
             } else { // 新規作成されたばかりの空ファイル
                 wr_cluster_ = AllocateClusterChain(num_cluster(len));
+                if (wr_cluster_ == 0) { // ボリュームが一杯
+                    return 0;
+                }
                 fat_entry_.first_cluster_low = wr_cluster_ & 0xffff;
                 fat_entry_.first_cluster_high = (wr_cluster_ >> 16) & 0xffff;
             }
@@ -319,7 +653,11 @@ namespace fat {
                 const auto next_cluster = NextCluster(wr_cluster_);
                 if (next_cluster == kEndOfClusterchain) { // 末尾クラスタに到達した場合
                     // 空きクラスタを増やす
-                    wr_cluster_ = ExtendCluster(wr_cluster_, num_cluster(len - total));
+                    const auto extended = ExtendCluster(wr_cluster_, num_cluster(len - total));
+                    if (extended == wr_cluster_) { // ボリュームが一杯なので、書けた分だけで終える
+                        break;
+                    }
+                    wr_cluster_ = NextCluster(wr_cluster_);
                 } else {
                     wr_cluster_ = next_cluster;
                 }
@@ -327,8 +665,9 @@ namespace fat {
             }
 
             uint8_t* sec = GetSectorByCluster<uint8_t>(wr_cluster_);
-            size_t n = std::min(len, g_bytes_per_cluster - wr_cluster_off_);
+            size_t n = std::min(len - total, g_bytes_per_cluster - wr_cluster_off_);
             memcpy(&sec[wr_cluster_off_], &buf8[total], n);
+            MarkBootVolumeDirty(&sec[wr_cluster_off_], n);
             total += n;
 
             wr_cluster_off_ += n;
@@ -336,21 +675,39 @@ namespace fat {
 
         wr_off_ += total;
         fat_entry_.file_size = wr_off_;
+        MarkBootVolumeDirty(&fat_entry_, sizeof(fat_entry_));
+        // 書き込んだ内容をキャッシュ済みのページにも反映
+        UpdatePageCache(FileID(), wr_off_before, buf, total);
+        if (g_file_written_observer) {
+            g_file_written_observer(fat_entry_);
+        }
         return total;
     }
 
     size_t FileDescriptor::Load(void* buf, size_t len, size_t offset) {
-        FileDescriptor fd{fat_entry_};
-        fd.rd_off_ = offset;
-
-        unsigned long cluster = fat_entry_.FirstCluster();
-        while (offset >= g_bytes_per_cluster) {
-            offset -= g_bytes_per_cluster;
-            cluster = NextCluster(cluster);
+        if (offset >= fat_entry_.file_size) {
+            return 0;
         }
+        uint8_t* buf8 = reinterpret_cast<uint8_t*>(buf);
+        len = std::min(len, fat_entry_.file_size - offset);
+
+        unsigned long cluster = ClusterAt(offset / g_bytes_per_cluster);
+        size_t cluster_off = offset % g_bytes_per_cluster;
 
-        fd.rd_cluster_ = cluster;
-        fd.rd_cluster_off_ = offset;
-        return fd.Read(buf, len);
+        size_t total = 0;
+        while (total < len) {
+            uint8_t* sec = GetSectorByCluster<uint8_t>(cluster);
+            size_t n = std::min(len - total, g_bytes_per_cluster - cluster_off);
+            memcpy(&buf8[total], &sec[cluster_off], n);
+            total += n;
+
+            cluster_off += n;
+            // クラスタをまたがるファイルに対応
+            if (cluster_off == g_bytes_per_cluster) {
+                cluster = NextCluster(cluster);
+                cluster_off = 0;
+            }
+        }
+        return total;
     }
 } // namespace fat
@@ -5,9 +5,12 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <vector>
 
 #include "error.hpp"
 #include "file.hpp"
+#include "spinlock.hpp"
 
 namespace fat {
     /// パーティション : ブロックデバイスを複数に分割した1つの領域
@@ -83,6 +86,9 @@ namespace fat {
     extern BPB* g_boot_volume_image;
     /// バイト数 / クラスタ
     extern unsigned long g_bytes_per_cluster;
+    /// ファイルが作成されたときや書き込まれたときに、そのディレクトリエントリを渡して呼ばれる
+    /// ファイルの中身から作ったキャッシュ（ロード済みアプリなど）を捨てるのに使う
+    extern std::function<void (DirectoryEntry& entry)> g_file_written_observer;
 
     void Initialize(void* volume_iamge);
 
@@ -158,6 +164,12 @@ namespace fat {
     /// return : 構築したチェーンの先頭クラスタ番号
     unsigned long AllocateClusterChain(size_t n);
 
+    /// srcの内容をdestにコピーする（destの元の内容は上書きし、大きさはsrcと同じにする）
+    /// destにクラスタがなければ、必要な数を1回のAllocateClusterChain()でまとめて確保する
+    /// 連続するクラスタの区間ごとに、ボリューム上で直接コピーする
+    /// return : コピーしたバイト数
+    WithError<size_t> CopyFile(DirectoryEntry& dest, DirectoryEntry& src);
+
     /// 各タスクがアクセスするファイルをOSカーネルが識別するための識別子、整数
     /// この型ではFAT上のファイルを扱う
     class FileDescriptor : public IFileDescriptor {
@@ -169,23 +181,51 @@ namespace fat {
         size_t Write(const void* buf, size_t len) override;
         /// ファイルサイズ
         size_t Size() const override { return fat_entry_.file_size; }
-        /// 指定位置からファイルを読む
+        /// 指定位置からファイルを読む（ページキャッシュを経由せず、ボリュームから直接読む）
         size_t Load(void* buf, size_t len, size_t offset) override;
+        /// 先頭クラスタ番号をページキャッシュでの識別子とする
+        unsigned long FileID() const override { return fat_entry_.FirstCluster(); }
+        /// 読み込み位置を変える（書き込み位置は変わらない）。ファイル末尾より後ろには動かせない
+        WithError<size_t> Seek(int64_t offset, int whence) override;
+        WithError<size_t> PRead(void* buf, size_t len, size_t offset) override;
+        /// 読み込み位置を含むページキャッシュのページのうち、読み込み位置から先を返す
+        std::pair<const uint8_t*, size_t> PeekRead() override;
+        void ConsumeRead(size_t len) override;
 
     private:
+        /// offsetからページキャッシュ経由で読む
+        size_t ReadAt(void* buf, size_t len, size_t offset);
+        /// 順番に読まれているなら、読み込み位置より先のページをページキャッシュに読んでおく
+        void ReadAhead();
+        /// ファイル先頭からindex番目のクラスタ番号（チェーンより後ろなら kEndOfClusterchain）
+        /// 初回にクラスタチェーンをたどって連続区間の索引を作り、以降は二分探索で引く
+        unsigned long ClusterAt(size_t index);
+        /// クラスタチェーンをたどってextents_を作り直す（lookup_lock_を取ってから呼ぶ）
+        void BuildClusterIndex();
+
         /// ファイルへの参照
         DirectoryEntry& fat_entry_;
         /// ファイル先頭からの読み込みオフセット（byte単位）
         size_t rd_off_ = 0;
-        /// rd_off_が指す位置に対応するクラスタ番号
-        unsigned long rd_cluster_ = 0;
-        /// 読み込み時のクラスタ先頭からのオフセット（byte単位）
-        size_t rd_cluster_off_ = 0;
         /// ファイル先頭からの書き込みオフセット（byte単位）
         size_t wr_off_ = 0;
+        /// 先読み : 前回読み終えたページ、先読み済みのページの末尾（このページは含まない）、先読みするページ数
+        /// 同じページか次のページから読まれ続ける限り、先読みするページ数を倍にしていく
+        size_t ra_last_page_ = 0, ra_end_page_ = 0, ra_window_ = 0;
         /// wr_off_が指す位置に対応するクラスタ番号
         unsigned long wr_cluster_ = 0;
         /// 書き込み時のクラスタ先頭からのオフセット（byte単位）
         size_t wr_cluster_off_ = 0;
+        /// クラスタ番号が連続している区間 : ファイル先頭からindex番目のクラスタから、clusterから始まるcount個
+        struct ClusterExtent {
+            size_t index;
+            unsigned long cluster;
+            size_t count;
+        };
+        /// ClusterAt()の索引。先頭クラスタかクラスタチェーンの世代が変わったら作り直す
+        SpinLock lookup_lock_;
+        std::vector<ClusterExtent> extents_;
+        unsigned long extents_first_ = 0;
+        uint64_t extents_generation_ = 0;
     };
 } // namespace fat
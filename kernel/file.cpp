@@ -1,6 +1,8 @@
 #include "file.hpp"
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 
 size_t PrintToFD(IFileDescriptor& fd, const char* format, ...) {
     va_list ap;
@@ -17,6 +19,28 @@ size_t PrintToFD(IFileDescriptor& fd, const char* format, ...) {
 
 size_t ReadDelim(IFileDescriptor& fd, char delim, char* buf, size_t len) {
     size_t i = 0;
+    // 読み込み位置の先をそのまま覗けるファイルなら、区切り文字をまとめて探してコピーする
+    while (i < len - 1) {
+        const auto [data, avail] = fd.PeekRead();
+        if (data == nullptr) {
+            break;
+        }
+        const size_t n = std::min(avail, len - 1 - i);
+        if (n == 0) {
+            buf[i] = '\0';
+            return i;
+        }
+        const auto found = reinterpret_cast<const uint8_t*>(memchr(data, delim, n));
+        const size_t m = found ? found - data + 1 : n;
+        memcpy(&buf[i], data, m);
+        fd.ConsumeRead(m);
+        i += m;
+        if (found) {
+            buf[i] = '\0';
+            return i;
+        }
+    }
+
     for (; i < len - 1; i++) {
         if (fd.Read(&buf[i], 1) == 0) {
             break;
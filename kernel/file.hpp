@@ -1,9 +1,13 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
+#include <utility>
 
 #include "error.hpp"
 
+class AsyncRingDescriptor;
+
 /// 文字列（orバイト列）を扱える何か
 class IFileDescriptor {
 public:
@@ -14,6 +18,37 @@ public:
 
     /// Load() reads file content without changing internal offset
     virtual size_t Load(void* buf, size_t len, size_t offset) = 0;
+
+    /// ページキャッシュでファイルを識別するための値。0ならキャッシュしない
+    virtual unsigned long FileID() const { return 0; }
+
+    /// Read()が書き込み先のアプリのメモリを自分で準備する（PrepareUserWriteを呼ぶ）-> true
+    virtual bool PreparesUserWrite() const { return false; }
+    /// アプリのメモリへのRead()。準備できずに1バイトも読めなかったときはエラーを返す（0だとファイル末尾と区別できない）
+    /// PreparesUserWrite()がfalseのファイルは、呼び出し側が準備してから呼ぶ
+    virtual WithError<size_t> ReadUser(void* buf, size_t len) { return {Read(buf, len), MAKE_ERROR(Error::kSuccess)}; }
+
+    /// 待たずにRead()できる -> true
+    /// falseを返したときは、読めるようになった時点でtask_idのタスクにMessage::kFileReadyを1回だけ送る
+    virtual bool PollRead(uint64_t task_id) { return true; }
+
+    /// 非同期システムコールのリングならそれ自身を返す（RTTIを使わないので型はこれで見分ける）
+    virtual AsyncRingDescriptor* AsyncRing() { return nullptr; }
+
+    /// 読み込み位置を変え、変えた後の位置を返す（whence : 0なら先頭、1なら現在位置、2なら末尾から）
+    /// 位置を持たないファイル（パイプ、ターミナルなど）は kNotImplemented
+    virtual WithError<size_t> Seek(int64_t offset, int whence) {
+        return {0, MAKE_ERROR(Error::kNotImplemented)};
+    }
+    /// 読み込み位置から先の、コピーせずに読めるデータ（Read()と同じ内容）を返す
+    /// 長さ0ならファイル末尾。このような領域を持たないファイルは {nullptr, 0}
+    virtual std::pair<const uint8_t*, size_t> PeekRead() { return {nullptr, 0}; }
+    /// PeekRead()で見たデータのうち、先頭lenバイトを読んだことにする
+    virtual void ConsumeRead(size_t len) {}
+    /// 読み込み位置を変えずに、指定位置から読む。位置を持たないファイルは kNotImplemented
+    virtual WithError<size_t> PRead(void* buf, size_t len, size_t offset) {
+        return {0, MAKE_ERROR(Error::kNotImplemented)};
+    }
 };
 
 /// 指定ファイルディスクリプタに文字列を書き込む
@@ -1,11 +1,16 @@
 #include "font.hpp"
 
+#include <cstddef>
 #include <cstdlib>
+#include <cstring>
+#include <immintrin.h>
+#include <map>
 #include <vector>
 
 #include "fat.hpp"
 
 #include "logger.hpp"
+#include "sync.hpp"
 
 // objcopyで決められた変数名
 extern const uint8_t _binary_hankaku_bin_start;
@@ -24,8 +29,60 @@ namespace {
 
     /// FreeTypeライブラリ
     FT_Library g_ft_library;
-    /// ttfファイルのデータをここに読み込む
-    std::vector<uint8_t>* g_nihongo_buf;
+    /// ttfファイルのディレクトリエントリ（InitializeFont()で探す）。中身はコピーせず、ボリュームから読む
+    fat::DirectoryEntry* g_nihongo_entry = nullptr;
+    /// クラスタが飛び飛びのときに、ページキャッシュ経由でttfファイルを読むストリーム
+    fat::FileDescriptor* g_nihongo_fd = nullptr;
+    FT_StreamRec g_nihongo_stream;
+
+    /// 最初の非ASCII文字を描くときに作り、ずっと使い続けるフェース
+    FT_Face g_ft_face = nullptr;
+    /// フェースを作れなかった（作り直しは試みない）
+    bool g_ft_face_failed = false;
+
+    /// 描き終えた字形（1ピクセル1ビット、上の行から並べたもの）
+    struct Glyph {
+        /// フォントに字形がなかった
+        bool missing;
+        /// 文字の左上から字形の左上までの位置
+        Vector2D<int> offset;
+        Vector2D<int> size;
+        int pitch;
+        std::vector<uint8_t> bits;
+        /// 最後に参照された時点のg_glyph_clock
+        uint64_t last_used;
+    };
+
+    /// コードポイントをキーとするグリフキャッシュ
+    std::map<char32_t, Glyph>* g_glyph_cache = nullptr;
+    uint64_t g_glyph_clock = 0;
+    /// FreeTypeのフェースとグリフキャッシュを保護する。字形を描く間も持つので眠るミューテックスにする
+    Mutex g_font_mutex;
+
+    /// FreeTypeのストリームの読み込み関数。countが0なら位置を変えるだけで、成功なら0を返す
+    unsigned long ReadNihongo(FT_Stream stream, unsigned long offset, unsigned char* buffer,
+                              unsigned long count) {
+        if (count == 0) {
+            return offset <= stream->size ? 0 : 1;
+        }
+        auto [n, err] = g_nihongo_fd->PRead(buffer, count, offset);
+        return err ? 0 : n;
+    }
+
+    /// entryのクラスタがボリューム上で連続していれば、その先頭のアドレス
+    const uint8_t* ContiguousFileAddr(fat::DirectoryEntry& entry) {
+        const unsigned long first = entry.FirstCluster();
+        const size_t num_clusters = (entry.file_size + fat::g_bytes_per_cluster - 1) / fat::g_bytes_per_cluster;
+        unsigned long cluster = first;
+        for (size_t i = 1; i < num_clusters; i++) {
+            const auto next = fat::NextCluster(cluster);
+            if (next != cluster + 1) {
+                return nullptr;
+            }
+            cluster = next;
+        }
+        return fat::GetSectorByCluster<const uint8_t>(first);
+    }
 
     ///  指定した文字の字形を読み込む
     Error RenderUnicode(char32_t c, FT_Face face) {
@@ -41,6 +98,60 @@ namespace {
 
         return MAKE_ERROR(Error::kSuccess);
     }
+
+    /// 最も長く参照されていない字形を追い出す
+    void EvictOneGlyph() {
+        auto victim = g_glyph_cache->begin();
+        for (auto it = g_glyph_cache->begin(); it != g_glyph_cache->end(); ++it) {
+            if (it->second.last_used < victim->second.last_used) {
+                victim = it;
+            }
+        }
+        if (victim != g_glyph_cache->end()) {
+            g_glyph_cache->erase(victim);
+        }
+    }
+
+    /// cの字形を描いてキャッシュに入れる。g_font_mutexを持って呼ぶ
+    Glyph& LoadGlyph(char32_t c) {
+        if (g_glyph_cache->size() >= kGlyphCacheSize) {
+            EvictOneGlyph();
+        }
+        Glyph& glyph = (*g_glyph_cache)[c];
+        glyph.missing = true;
+        if (RenderUnicode(c, g_ft_face)) {
+            return glyph;
+        }
+
+        const FT_Bitmap& bitmap = g_ft_face->glyph->bitmap;
+        const int baseline = (g_ft_face->height + g_ft_face->descender) *
+                             g_ft_face->size->metrics.y_ppem / g_ft_face->units_per_EM;
+        glyph.missing = false;
+        glyph.offset = {g_ft_face->glyph->bitmap_left, baseline - g_ft_face->glyph->bitmap_top};
+        glyph.size = {static_cast<int>(bitmap.width), static_cast<int>(bitmap.rows)};
+        // FT_LOAD_TARGET_MONOで描画したので1ピクセル1ビット。pitchが負なら下の行からメモリに並んでいる
+        glyph.pitch = bitmap.pitch < 0 ? -bitmap.pitch : bitmap.pitch;
+        glyph.bits.resize(glyph.pitch * glyph.size.y);
+        for (int y = 0; y < glyph.size.y; y++) {
+            const int src_row = bitmap.pitch < 0 ? glyph.size.y - 1 - y : y;
+            memcpy(&glyph.bits[glyph.pitch * y], bitmap.buffer + glyph.pitch * src_row, glyph.pitch);
+        }
+        return glyph;
+    }
+
+    /// フェースがなければ作る。g_font_mutexを持って呼ぶ
+    bool PrepareFace() {
+        if (g_ft_face == nullptr && !g_ft_face_failed) {
+            auto [face, err] = NewFTFace();
+            if (err) {
+                Log(kError, "failed to open /nihongo.ttf\n");
+                g_ft_face_failed = true;
+            } else {
+                g_ft_face = face;
+            }
+        }
+        return g_ft_face != nullptr;
+    }
 } // namespace
 
 void WriteAscii(PixelWriter& writer, Vector2D<int> pos, char c, const PixelColor& color) {
@@ -49,13 +160,8 @@ void WriteAscii(PixelWriter& writer, Vector2D<int> pos, char c, const PixelColor
         return;
     }
 
-    for (int dy = 0; dy < 16; dy++) {
-        for (int dx = 0; dx < 8; dx++) {
-            if ((font[dy] << dx) & 0x80u) {
-                writer.Write(pos + Vector2D<int>{dx, dy}, color);
-            }
-        }
-    }
+    // 1行1バイト、8x16ピクセル
+    writer.WriteGlyphMask(pos, font, 1, {8, 16}, color);
 }
 
 void WriteString(PixelWriter& writer, Vector2D<int> pos, const char* s, const PixelColor& color) {
@@ -110,14 +216,49 @@ std::pair<char32_t, int> ConvertUTF8to32(const char* u8) {
     }
 }
 
+size_t CountPrintableAscii(const char* s, size_t len) {
+    // 符号付きで比べると、0x80以上（負）と0x20未満の両方が「0x20より小さい」になる
+    const auto space = _mm_set1_epi8(0x20);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        if (const int mask = _mm_movemask_epi8(_mm_cmplt_epi8(v, space))) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    for (; i < len; i++) {
+        if (static_cast<signed char>(s[i]) < 0x20) {
+            break;
+        }
+    }
+    return i;
+}
+
 bool IsHankaku(char32_t c) {
     return c <= 0x7f;
 }
 
 WithError<FT_Face> NewFTFace() {
     FT_Face face;
-    if (int err = FT_New_Memory_Face(g_ft_library, g_nihongo_buf->data(), g_nihongo_buf->size(), 0, &face)) {
-        return {face, MAKE_ERROR(Error::kFreeTypeError)};
+    const size_t size = g_nihongo_entry->file_size;
+    if (auto addr = ContiguousFileAddr(*g_nihongo_entry)) {
+        // ボリュームをそのまま渡す。ブロックデバイスから読むボリュームなら、FreeTypeが触れたページだけが読み込まれる
+        if (int err = FT_New_Memory_Face(g_ft_library, addr, size, 0, &face)) {
+            return {face, MAKE_ERROR(Error::kFreeTypeError)};
+        }
+    } else {
+        if (g_nihongo_fd == nullptr) {
+            g_nihongo_fd = new fat::FileDescriptor{*g_nihongo_entry};
+            g_nihongo_stream = {};
+            g_nihongo_stream.size = size;
+            g_nihongo_stream.read = ReadNihongo;
+        }
+        FT_Open_Args args{};
+        args.flags = FT_OPEN_STREAM;
+        args.stream = &g_nihongo_stream;
+        if (int err = FT_Open_Face(g_ft_library, &args, 0, &face)) {
+            return {face, MAKE_ERROR(Error::kFreeTypeError)};
+        }
     }
     if (int err = FT_Set_Pixel_Sizes(face, 16, 16)) {
         return {face, MAKE_ERROR(Error::kFreeTypeError)};
@@ -131,40 +272,28 @@ Error WriteUnicode(PixelWriter& writer, Vector2D<int> pos, char32_t c, const Pix
         return MAKE_ERROR(Error::kSuccess);
     }
 
-    auto [face, err] = NewFTFace();
-    if (err) {
+    MutexGuard lock{g_font_mutex};
+    if (g_glyph_cache == nullptr) {
+        // フォントはまだ裏で読み込んでいる（InitializeFont()が終わっていない）
         WriteAscii(writer, pos, '?', color);
         WriteAscii(writer, pos + Vector2D<int>{8, 0}, '?', color);
-        return err;
+        return MAKE_ERROR(Error::kFreeTypeError);
     }
-    if (auto err = RenderUnicode(c, face)) {
-        // フェースオブジェクト破棄
-        FT_Done_Face(face);
+    auto it = g_glyph_cache->find(c);
+    if (it == g_glyph_cache->end() && !PrepareFace()) {
         WriteAscii(writer, pos, '?', color);
         WriteAscii(writer, pos + Vector2D<int>{8, 0}, '?', color);
-        return err;
+        return MAKE_ERROR(Error::kFreeTypeError);
     }
-
-    FT_Bitmap& bitmap = face->glyph->bitmap;
-    const int baseline = (face->height + face->descender) * face->size->metrics.y_ppem / face->units_per_EM;
-    const auto glyph_topleft = pos + Vector2D<int>{face->glyph->bitmap_left, baseline - face->glyph->bitmap_top};
-
-    for (int dy = 0; dy < bitmap.rows; dy++) {
-        unsigned char* q = &bitmap.buffer[bitmap.pitch * dy];
-        if (bitmap.pitch < 0) {
-            q -= bitmap.pitch * bitmap.rows;
-        }
-
-        for (int dx = 0; dx < bitmap.width; dx++) {
-            const bool b = q[dx >> 3] & (0x80 >> (dx & 0x7));
-            if (b) {
-                writer.Write(glyph_topleft + Vector2D<int>{dx, dy}, color);
-            }
-        }
+    Glyph& glyph = it != g_glyph_cache->end() ? it->second : LoadGlyph(c);
+    glyph.last_used = ++g_glyph_clock;
+    if (glyph.missing) {
+        WriteAscii(writer, pos, '?', color);
+        WriteAscii(writer, pos + Vector2D<int>{8, 0}, '?', color);
+        return MAKE_ERROR(Error::kFreeTypeError);
     }
 
-    // フェースオブジェクト破棄
-    FT_Done_Face(face);
+    writer.WriteGlyphMask(pos + glyph.offset, glyph.bits.data(), glyph.pitch, glyph.size, color);
     return MAKE_ERROR(Error::kSuccess);
 }
 
@@ -174,14 +303,13 @@ void InitializeFont() {
     }
 
     auto [entry, pos_slash] = fat::FindFile("/nihongo.ttf");
-    if (entry == nullptr || pos_slash) {
+    if (entry == nullptr || pos_slash || entry->file_size == 0) {
         exit(1);
     }
+    g_nihongo_entry = entry;
 
-    const size_t size = entry->file_size;
-    g_nihongo_buf = new std::vector<uint8_t>(size);
-    if (LoadFile(g_nihongo_buf->data(), size, *entry) != size) {
-        delete g_nihongo_buf;
-        exit(1);
-    }
+    // フェースは最初の非ASCII文字を描くときにPrepareFace()で作る
+    // これが設定されるまで、WriteUnicode()は非ASCII文字の字形を作らない
+    MutexGuard lock{g_font_mutex};
+    g_glyph_cache = new std::map<char32_t, Glyph>;
 }
@@ -25,11 +25,18 @@ void WriteString(PixelWriter& writer, Vector2D<int> pos, const char* s, const Pi
 int CountUTF8Size(uint8_t c);
 /// UTF-9文字列から1文字取り出す
 std::pair<char32_t, int> ConvertUTF8to32(const char* u8);
+/// s[0, len)の先頭から続く、そのまま1桁に描けるASCII文字（0x20〜0x7f）のバイト数
+/// 制御文字（改行やNUL）か非ASCII文字（UTF-8の多バイト文字）のところで止まる。16バイトずつSSE2で調べる
+size_t CountPrintableAscii(const char* s, size_t len);
 bool IsHankaku(char32_t c);
-/// フェーズオブジェクト（字形）の準備
+/// フェーズオブジェクト（字形）の準備。InitializeFont()で見つけたttfファイルを、ヒープにコピーせずに開く
 WithError<FT_Face> NewFTFace();
+/// グリフキャッシュに保持する最大の文字数
+const size_t kGlyphCacheSize = 512;
 /// 与えられたコードポイントに対応する文字を描画
+/// 非ASCII文字の字形は、起動時に作ったフェースで一度だけ描いてグリフキャッシュに保持する
 Error WriteUnicode(PixelWriter& writer, Vector2D<int> pos, char32_t c, const PixelColor& color);
 
-/// 日本語フォントを初期化
+/// 日本語フォントを初期化（起動時は別のタスクで呼ぶ。終わるまでWriteUnicode()は非ASCII文字を"??"で描く）
+/// ttfファイルを探すだけで、フェースは最初に非ASCII文字を描くときに作る
 void InitializeFont();
@@ -0,0 +1,156 @@
+#include "fpu.hpp"
+
+#include <array>
+#include <cstring>
+
+#include "asmfunc.h"
+#include "smp.hpp"
+#include "task.hpp"
+
+/// asmfunc.asmのIntHandlerDeviceNotAvailableが参照する、状態の保存に使う命令
+/// 0 : FXSAVE / FXRSTOR, 1 : XSAVE / XRSTOR, 2 : XSAVEOPT / XRSTOR
+extern "C" int g_fpu_save_mode = 0;
+
+namespace {
+    const uint64_t kCR0MonitorCoprocessor = 1u << 1;
+    const uint64_t kCR0Emulation = 1u << 2;
+    const uint64_t kCR0TaskSwitched = 1u << 3;
+    const uint64_t kCR4OSFXSR = 1u << 9;
+    const uint64_t kCR4OSXMMEXCPT = 1u << 10;
+    const uint64_t kCR4OSXSAVE = 1u << 18;
+    /// XCR0 : XSAVEで保存する状態（bit0 : x87, bit1 : SSE, bit2 : AVX）
+    const uint64_t kXCR0X87 = 1u << 0;
+    const uint64_t kXCR0SSE = 1u << 1;
+    const uint64_t kXCR0AVX = 1u << 2;
+
+    size_t g_fpu_state_size = 512; // FXSAVEの保存領域
+    uint64_t g_xcr0 = 0;
+
+    /// CPUコアごとのFPUの持ち主
+    /// owner : FPUのレジスタに状態が残っているタスク
+    /// current : 実行中のタスク
+    /// ts : CR0.TSを立てているか（書き換えが要らないときにCR0に触らないため）
+    struct CPUFPU {
+        Task* owner;
+        Task* current;
+        bool ts;
+    };
+    std::array<CPUFPU, kMaxCPUs> g_cpu_fpus{};
+
+    void SetTaskSwitched(CPUFPU& fpu, bool ts) {
+        if (fpu.ts == ts) {
+            return;
+        }
+        const auto cr0 = GetCR0();
+        SetCR0(ts ? (cr0 | kCR0TaskSwitched) : (cr0 & ~kCR0TaskSwitched));
+        fpu.ts = ts;
+    }
+} // namespace
+
+void InitializeFPU() {
+    // EM = 0 : FPUの命令を実行する。MP = 1 : TSが立っていればWAIT命令でも#NMにする
+    SetCR0((GetCR0() | kCR0MonitorCoprocessor) & ~(kCR0Emulation | kCR0TaskSwitched));
+    SetCR4(GetCR4() | kCR4OSFXSR | kCR4OSXMMEXCPT);
+
+    std::array<uint32_t, 4> regs; // eax, ebx, ecx, edx
+    ReadCPUID(1, 0, regs.data());
+    const bool xsave = (regs[2] >> 26) & 1;
+    const bool avx = (regs[2] >> 28) & 1;
+    if (!xsave) {
+        return;
+    }
+
+    SetCR4(GetCR4() | kCR4OSXSAVE);
+    if (g_xcr0 == 0) { // BSP
+        g_xcr0 = kXCR0X87 | kXCR0SSE | (avx ? kXCR0AVX : 0);
+    }
+    SetXCR0(g_xcr0);
+    if (g_fpu_save_mode != 0) { // APはBSPと同じ設定にする
+        return;
+    }
+
+    // EBX : XCR0で有効にした状態を保存するのに必要な大きさ
+    ReadCPUID(0xd, 0, regs.data());
+    g_fpu_state_size = regs[1];
+    // XSAVEOPT : 前回のXRSTORから変更されていない部分の保存を省く
+    ReadCPUID(0xd, 1, regs.data());
+    g_fpu_save_mode = (regs[0] & 1) ? 2 : 1;
+}
+
+bool AVXEnabled() {
+    return g_xcr0 & kXCR0AVX;
+}
+
+size_t FPUStateSize() {
+    return g_fpu_state_size;
+}
+
+void InitializeFPUState(uint8_t* area) {
+    memset(area, 0, g_fpu_state_size);
+    // x87 FPUとMXCSRのすべての例外をマスクする（FNINIT直後と同じ値）
+    *reinterpret_cast<uint16_t*>(&area[0]) = 0x037f;
+    *reinterpret_cast<uint32_t*>(&area[24]) = 0x1f80;
+    // XSAVEの場合、ヘッダ（offset 512）のXSTATE_BVが0の状態はXRSTORで初期値になる
+}
+
+void StartFPUTask(Task* task) {
+    auto& fpu = g_cpu_fpus[CurrentCPU()];
+    fpu.owner = task;
+    fpu.current = task;
+    fpu.ts = false;
+}
+
+void SwitchFPUTask(Task* next) {
+    auto& fpu = g_cpu_fpus[CurrentCPU()];
+    fpu.current = next;
+    SetTaskSwitched(fpu, next != __atomic_load_n(&fpu.owner, __ATOMIC_RELAXED));
+}
+
+void ProtectFPUFromInterrupt() {
+    auto& fpu = g_cpu_fpus[CurrentCPU()];
+    if (fpu.current == nullptr) { // タスクの初期化前
+        return;
+    }
+    SetTaskSwitched(fpu, true);
+}
+
+void ResumeFPUTask() {
+    auto& fpu = g_cpu_fpus[CurrentCPU()];
+    SetTaskSwitched(fpu, fpu.current != fpu.owner);
+}
+
+void ReleaseFPU(Task* task) {
+    auto& fpu = g_cpu_fpus[CurrentCPU()];
+    if (fpu.owner == task) {
+        __atomic_store_n(&fpu.owner, nullptr, __ATOMIC_RELAXED);
+    }
+}
+
+bool IsFPUOwner(int cpu, const Task* task) {
+    return __atomic_load_n(&g_cpu_fpus[cpu].owner, __ATOMIC_RELAXED) == task;
+}
+
+/// save : 前の持ち主の保存先（なければnullptr）
+/// restore : 実行中のタスクの保存先（切り替え不要ならnullptr）
+struct FPUSwitchAreas {
+    uint8_t* save;
+    uint8_t* restore;
+};
+
+/// IntHandlerDeviceNotAvailableから、CR0.TSを下ろした直後に呼ばれる（RAX, RDXで2つのポインタを返す）
+/// 前の持ち主の状態をまだ保存していないので、ここではSSEのレジスタを使うような処理をしないこと
+extern "C" FPUSwitchAreas LazyFPUSwitch() {
+    auto& fpu = g_cpu_fpus[CurrentCPU()];
+    fpu.ts = false;
+    Task* owner = fpu.owner;
+    if (fpu.current == nullptr) {
+        return {nullptr, nullptr};
+    } else if (owner == fpu.current) {
+        // 割り込みハンドラが、実行中のタスクの状態が残ったFPUを使おうとした
+        // タスクの状態を保存して持ち主から外し、タスクが次に使うときに復帰させる
+        __atomic_store_n(&fpu.owner, nullptr, __ATOMIC_RELAXED);
+        return {owner->FPUArea(), nullptr};
+    }
+    __atomic_store_n(&fpu.owner, fpu.current, __ATOMIC_RELAXED);
+    return {owner ? owner->FPUArea() : nullptr, fpu.current->FPUArea()};
+}
@@ -0,0 +1,36 @@
+/// FPU（x87, SSE, AVX）のレジスタの遅延切り替え
+/// タスク切り替えのたびにFPUのレジスタを保存・復帰するのではなく、切り替え先がFPUの持ち主でなければCR0.TSを立てておく
+/// そのタスクが初めてFPUの命令を実行したとき（#NM : デバイス使用不可例外）に、前の持ち主の状態を保存して自分の状態を復帰する
+/// FPUを使わないタスク（ほとんどのカーネルタスク）との切り替えでは、保存も復帰も起こらない
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+class Task;
+
+/// 実行中のCPUコアのFPUを設定する。XSAVEがあればAVXの状態も保存できるようにする
+/// BSPではタスクを作る前に（保存領域の大きさがここで決まる）、APでは起動直後に呼ぶ
+void InitializeFPU();
+/// AVXのレジスタを保存するようにした（カーネルでAVXの命令を使ってよい） -> true
+bool AVXEnabled();
+/// タスクごとのFPUの状態の保存領域の大きさ（64byte境界に置くこと）
+size_t FPUStateSize();
+/// 保存領域を、FPUを初めて使うタスク向けの初期状態にする
+void InitializeFPUState(uint8_t* area);
+
+/// 実行中のCPUコアで今動いているタスクを、FPUの持ち主とする（各CPUコアの最初のタスク用）
+void StartFPUTask(Task* task);
+/// 実行中のCPUコアでnextに切り替える直前に呼ぶ。nextがFPUの持ち主でなければCR0.TSを立てる
+/// この後、切り替えるまでにFPUの命令を使わないこと
+void SwitchFPUTask(Task* next);
+/// タイマ割り込みのハンドラの先頭で呼び、ハンドラ内でFPUを使ったら割り込まれたタスクの状態を保存させる
+/// （asmから呼ばれる普通の関数なので、コンパイラはSSEのレジスタを保存してくれない）
+void ProtectFPUFromInterrupt();
+/// タスクを切り替えずにハンドラから戻る前に呼び、CR0.TSを実行中のタスクに合わせて戻す
+void ResumeFPUTask();
+/// 終了するタスクがFPUの持ち主なら、その状態を捨てる（保存先がなくなるので）
+void ReleaseFPU(Task* task);
+/// cpuのFPUのレジスタにtaskの状態が残っているか（残っているタスクは他のCPUコアに移せない）
+bool IsFPUOwner(int cpu, const Task* task);
@@ -1,44 +1,183 @@
 #include "frame_buffer.hpp"
 
+#include <utility>
+
+#include "pixel_ops.hpp"
+#include "surface_pool.hpp"
+
+/// ピクセル形式ごとに生成した行単位の処理。Initailize()で形式に合うものを選ぶので、描画のたびに形式で分岐しない
+struct FrameBufferKernels {
+    /// 1行ずつ処理する範囲（ピッチはバイト数）
+    struct Rows {
+        uint8_t* dst;
+        size_t dst_pitch;
+        const uint8_t* src;
+        size_t src_pitch;
+        Vector2D<int> size;
+    };
+
+    int bytes_per_pixel;
+    /// srcのピクセル形式ごとのコピー
+    void (*copy_from[2])(const Rows& rows);
+    void (*copy_transparent)(const Rows& rows, const PixelColor& transparent);
+    void (*blend)(const Rows& rows, uint8_t alpha, bool per_pixel);
+    void (*write_argb_span)(uint32_t* dst, const uint32_t* pixels, int len);
+    /// ImageFormatごとの画像の書き込み（src_pitchは画像の1行のバイト数）
+    void (*write_image[4])(const Rows& rows, bool keep_alpha);
+    PixelColor (*at)(const uint8_t* p);
+};
+
 namespace {
-    int BytesPerPixel(const PixelFormat& format) {
-        switch (format) {
-        case kPixelRGBResv8BitPerColor:
-            return 4;
-        case kPixelBGRResv8BitPerColor:
-            return 4;
-        default:
-            return -1;
+    using Rows = FrameBufferKernels::Rows;
+
+    template <PixelFormat Dst, PixelFormat Src>
+    void CopyRows(const Rows& rows) {
+        static_assert(PixelFormatTraits<Dst>::kBytesPerPixel == PixelFormatTraits<Src>::kBytesPerPixel);
+        // ピクセル毎ではなく1行毎にコピーしていく
+        auto dst = rows.dst;
+        auto src = rows.src;
+        for (int y = 0; y < rows.size.y; y++, dst += rows.dst_pitch, src += rows.src_pitch) {
+            if constexpr (Dst == Src) {
+                CopyPixels(dst, src, rows.size.x);
+            } else {
+                // 対応している形式はどれも1ピクセル4バイトで、RとBの位置だけが違う
+                ConvertPixels(dst, src, rows.size.x);
+            }
         }
     }
 
-    int BytesPerScanLine(const FrameBufferConfig& config) {
-        return BytesPerPixel(config.pixel_format) * config.pixels_per_scan_line;
+    template <PixelFormat F>
+    void CopyRowsTransparent(const Rows& rows, const PixelColor& transparent) {
+        const uint32_t tc = PixelFormatTraits<F>::ToPixel(transparent);
+        auto dst = rows.dst;
+        auto src = rows.src;
+        for (int y = 0; y < rows.size.y; y++, dst += rows.dst_pitch, src += rows.src_pitch) {
+            CopyPixelsTransparent(dst, src, tc, rows.size.x);
+        }
     }
 
-    uint8_t* FrameAddrAt(Vector2D<int> pos, const FrameBufferConfig& config) {
-        return config.frame_buffer + BytesPerPixel(config.pixel_format) * (config.pixels_per_scan_line * pos.y + pos.x);
+    template <PixelFormat F>
+    void BlendRows(const Rows& rows, uint8_t alpha, bool per_pixel) {
+        auto dst = rows.dst;
+        auto src = rows.src;
+        for (int y = 0; y < rows.size.y; y++, dst += rows.dst_pitch, src += rows.src_pitch) {
+            BlendPixels(dst, src, alpha, per_pixel, rows.size.x);
+        }
+    }
+
+    template <PixelFormat F>
+    void WriteARGBSpanTo(uint32_t* dst, const uint32_t* pixels, int len) {
+        for (int i = 0; i < len; i++) {
+            const uint32_t c = pixels[i];
+            dst[i] = PixelFormatTraits<F>::ToPixel(ToColor(c)) | (c & 0xff000000u);
+        }
+    }
+
+    template <PixelFormat F, ImageFormat I>
+    void WriteImageRows(const Rows& rows, bool keep_alpha) {
+        // 0xRRGGBBはBGR予約8ビットと同じ並び、R, G, Bの順のバイト列はRGB予約8ビットと同じ並び
+        constexpr bool bgr = F == kPixelBGRResv8BitPerColor;
+        const size_t n = rows.size.x;
+        auto dst = rows.dst;
+        auto src = rows.src;
+        for (int y = 0; y < rows.size.y; y++, dst += rows.dst_pitch, src += rows.src_pitch) {
+            if constexpr (I == ImageFormat::kARGB8888) {
+                if constexpr (bgr) {
+                    CopyPixels(dst, src, n);
+                } else {
+                    ConvertPixels(dst, src, n);
+                }
+                if (!keep_alpha) {
+                    auto p = reinterpret_cast<uint32_t*>(dst);
+                    for (size_t i = 0; i < n; i++) {
+                        p[i] &= 0xffffffu;
+                    }
+                }
+            } else if constexpr (I == ImageFormat::kRGB888) {
+                ExpandRGB24(dst, src, bgr, n);
+            } else if constexpr (I == ImageFormat::kRGBA8888) {
+                ConvertRGBA32(dst, src, bgr, keep_alpha, n);
+            } else {
+                ExpandGray8(dst, src, n);
+            }
+        }
+    }
+
+    template <PixelFormat F>
+    PixelColor PixelAt(const uint8_t* p) {
+        return PixelFormatTraits<F>::FromPixel(*reinterpret_cast<const uint32_t*>(p));
+    }
+
+    template <PixelFormat F>
+    constexpr FrameBufferKernels MakeKernels() {
+        return {
+            PixelFormatTraits<F>::kBytesPerPixel,
+            {CopyRows<F, kPixelRGBResv8BitPerColor>, CopyRows<F, kPixelBGRResv8BitPerColor>},
+            CopyRowsTransparent<F>,
+            BlendRows<F>,
+            WriteARGBSpanTo<F>,
+            {WriteImageRows<F, ImageFormat::kARGB8888>, WriteImageRows<F, ImageFormat::kRGB888>,
+             WriteImageRows<F, ImageFormat::kRGBA8888>, WriteImageRows<F, ImageFormat::kGray8>},
+            PixelAt<F>,
+        };
+    }
+
+    /// PixelFormatの値で引く
+    constexpr FrameBufferKernels kKernels[] = {
+        MakeKernels<kPixelRGBResv8BitPerColor>(),
+        MakeKernels<kPixelBGRResv8BitPerColor>(),
+    };
+
+    const FrameBufferKernels* FindKernels(PixelFormat format) {
+        const auto i = static_cast<size_t>(format);
+        return i < sizeof(kKernels) / sizeof(kKernels[0]) ? &kKernels[i] : nullptr;
+    }
+
+    uint8_t* FrameAddrAt(Vector2D<int> pos, const FrameBufferConfig& config, const FrameBufferKernels& kernels) {
+        return config.frame_buffer + kernels.bytes_per_pixel * (config.pixels_per_scan_line * pos.y + pos.x);
+    }
+
+    size_t BytesPerScanLine(const FrameBufferConfig& config, const FrameBufferKernels& kernels) {
+        return static_cast<size_t>(kernels.bytes_per_pixel) * config.pixels_per_scan_line;
     }
 
     Vector2D<int> FrameBufferSize(const FrameBufferConfig& config) {
         return {static_cast<int>(config.horizontal_resolution),
                 static_cast<int>(config.vertical_resolution)};
     }
+
+    /// srcのsrc_areaをdst_posに重ねるときに、両方のフレームバッファに収まる範囲
+    Rows ClipRows(const FrameBufferConfig& dst, const FrameBufferKernels& dst_kernels, Vector2D<int> dst_pos,
+                  const FrameBufferConfig& src, const FrameBufferKernels& src_kernels,
+                  const Rectangle<int>& src_area) {
+        const Rectangle<int> src_area_shifted{dst_pos, src_area.size};
+        const Rectangle<int> src_outline{dst_pos - src_area.pos, FrameBufferSize(src)};
+        const Rectangle<int> dst_outline{{0, 0}, FrameBufferSize(dst)};
+        const auto copy_area = dst_outline & src_outline & src_area_shifted;
+        const auto src_start_pos = copy_area.pos - (dst_pos - src_area.pos);
+        return {FrameAddrAt(copy_area.pos, dst, dst_kernels), BytesPerScanLine(dst, dst_kernels),
+                FrameAddrAt(src_start_pos, src, src_kernels), BytesPerScanLine(src, src_kernels),
+                copy_area.size};
+    }
 } // namespace
 
+FrameBuffer::~FrameBuffer() {
+    ReleaseSurface(std::move(buffer_));
+}
+
 Error FrameBuffer::Initailize(const FrameBufferConfig& config) {
     config_ = config;
 
-    const auto bytes_per_pixel = BytesPerPixel(config_.pixel_format);
-    if (bytes_per_pixel <= 0) {
+    kernels_ = FindKernels(config_.pixel_format);
+    if (kernels_ == nullptr) {
         return MAKE_ERROR(Error::kUnknownPixelFormat);
     }
 
-    if (config_.frame_buffer) {
-        buffer_.resize(0);
-    } else {
-        buffer_.resize(
-            bytes_per_pixel * config_.horizontal_resolution * config_.vertical_resolution);
+    ReleaseSurface(std::move(buffer_));
+    buffer_ = {};
+    if (!config_.frame_buffer) {
+        buffer_ = AcquireSurface(
+            kernels_->bytes_per_pixel * config_.horizontal_resolution * config_.vertical_resolution);
         config_.frame_buffer = buffer_.data();
         config_.pixels_per_scan_line = config_.horizontal_resolution;
     }
@@ -58,49 +197,96 @@ Error FrameBuffer::Initailize(const FrameBufferConfig& config) {
 }
 
 Error FrameBuffer::Copy(Vector2D<int> dst_pos, const FrameBuffer& src, const Rectangle<int>& src_area) {
-    if (config_.pixel_format != src.config_.pixel_format) {
+    if (kernels_ == nullptr || src.kernels_ == nullptr) {
+        return MAKE_ERROR(Error::kUnknownPixelFormat);
+    }
+    const auto rows = ClipRows(config_, *kernels_, dst_pos, src.config_, *src.kernels_, src_area);
+    kernels_->copy_from[src.config_.pixel_format](rows);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error FrameBuffer::CopyTransparent(Vector2D<int> dst_pos, const FrameBuffer& src,
+                                   const Rectangle<int>& src_area, const PixelColor& transparent) {
+    if (kernels_ == nullptr || kernels_ != src.kernels_) {
         return MAKE_ERROR(Error::kUnknownPixelFormat);
     }
+    const auto rows = ClipRows(config_, *kernels_, dst_pos, src.config_, *src.kernels_, src_area);
+    kernels_->copy_transparent(rows, transparent);
+    return MAKE_ERROR(Error::kSuccess);
+}
 
-    const auto bytes_per_pixel = BytesPerPixel(config_.pixel_format);
-    if (bytes_per_pixel <= 0) {
+Error FrameBuffer::Blend(Vector2D<int> dst_pos, const FrameBuffer& src, const Rectangle<int>& src_area,
+                         uint8_t alpha, bool per_pixel) {
+    if (kernels_ == nullptr || kernels_ != src.kernels_) {
         return MAKE_ERROR(Error::kUnknownPixelFormat);
     }
+    const auto rows = ClipRows(config_, *kernels_, dst_pos, src.config_, *src.kernels_, src_area);
+    kernels_->blend(rows, alpha, per_pixel);
+    return MAKE_ERROR(Error::kSuccess);
+}
 
-    const Rectangle<int> src_area_shifted{dst_pos, src_area.size};
-    const Rectangle<int> src_outline{dst_pos - src_area.pos, FrameBufferSize(src.config_)};
-    const Rectangle<int> dst_outline{{0, 0}, FrameBufferSize(config_)};
-    const auto copy_area = dst_outline & src_outline & src_area_shifted;
-    const auto src_start_pos = copy_area.pos - (dst_pos - src_area.pos);
+void FrameBuffer::WriteARGBSpan(Vector2D<int> pos, const uint32_t* pixels, int len) {
+    const auto size = FrameBufferSize(config_);
+    if (pos.y < 0 || pos.y >= size.y) {
+        return;
+    }
+    const int x_begin = std::max(pos.x, 0), x_end = std::min(pos.x + len, size.x);
+    if (x_begin >= x_end) {
+        return;
+    }
+    auto p = reinterpret_cast<uint32_t*>(FrameAddrAt({x_begin, pos.y}, config_, *kernels_));
+    kernels_->write_argb_span(p, pixels + (x_begin - pos.x), x_end - x_begin);
+}
 
-    uint8_t* dst_buf = FrameAddrAt(copy_area.pos, config_);
-    const uint8_t* src_buf = FrameAddrAt(src_start_pos, src.config_);
+int BytesPerPixel(ImageFormat format) {
+    switch (format) {
+    case ImageFormat::kARGB8888: return 4;
+    case ImageFormat::kRGB888: return 3;
+    case ImageFormat::kRGBA8888: return 4;
+    case ImageFormat::kGray8: return 1;
+    }
+    return 0;
+}
 
-    // ピクセル毎ではなく1行毎にコピーしていく
-    for (int y = 0; y < copy_area.size.y; y++) {
-        memcpy(dst_buf, src_buf, bytes_per_pixel * copy_area.size.x);
-        dst_buf += BytesPerScanLine(config_);
-        src_buf += BytesPerScanLine(src.config_);
+void FrameBuffer::WriteImage(Vector2D<int> pos, Vector2D<int> size, const void* image, size_t stride,
+                             ImageFormat format, bool keep_alpha) {
+    const auto fb_size = FrameBufferSize(config_);
+    const int x_begin = std::max(pos.x, 0), x_end = std::min(pos.x + size.x, fb_size.x);
+    const int y_begin = std::max(pos.y, 0), y_end = std::min(pos.y + size.y, fb_size.y);
+    if (x_begin >= x_end || y_begin >= y_end || BytesPerPixel(format) == 0) {
+        return;
     }
 
-    return MAKE_ERROR(Error::kSuccess);
+    auto src = reinterpret_cast<const uint8_t*>(image) + (y_begin - pos.y) * stride +
+               (x_begin - pos.x) * BytesPerPixel(format);
+    const Rows rows{FrameAddrAt({x_begin, y_begin}, config_, *kernels_), BytesPerScanLine(config_, *kernels_),
+                    src, stride, {x_end - x_begin, y_end - y_begin}};
+    kernels_->write_image[static_cast<int>(format)](rows, keep_alpha);
 }
 
 void FrameBuffer::Move(Vector2D<int> dst_pos, const Rectangle<int>& src) {
-    const auto bytes_per_pixel = BytesPerPixel(config_.pixel_format);
-    const auto bytes_per_scan_line = BytesPerScanLine(config_);
+    const auto bytes_per_pixel = kernels_->bytes_per_pixel;
+    const auto bytes_per_scan_line = BytesPerScanLine(config_, *kernels_);
 
-    if (dst_pos.y < src.pos.y) { // 上に移動
-        uint8_t* dst_buf = FrameAddrAt(dst_pos, config_);
-        const uint8_t* src_buf = FrameAddrAt(src.pos, config_);
+    if (dst_pos.y == src.pos.y) { // 横に移動。同じ行の中で重なるのでmemmoveを使う
+        uint8_t* dst_buf = FrameAddrAt(dst_pos, config_, *kernels_);
+        const uint8_t* src_buf = FrameAddrAt(src.pos, config_, *kernels_);
+        for (int y = 0; y < src.size.y; y++) {
+            memmove(dst_buf, src_buf, bytes_per_pixel * src.size.x);
+            dst_buf += bytes_per_scan_line;
+            src_buf += bytes_per_scan_line;
+        }
+    } else if (dst_pos.y < src.pos.y) { // 上に移動
+        uint8_t* dst_buf = FrameAddrAt(dst_pos, config_, *kernels_);
+        const uint8_t* src_buf = FrameAddrAt(src.pos, config_, *kernels_);
         for (int y = 0; y < src.size.y; y++) {
             memcpy(dst_buf, src_buf, bytes_per_pixel * src.size.x);
             dst_buf += bytes_per_scan_line;
             src_buf += bytes_per_scan_line;
         }
     } else { // 下に移動
-        uint8_t* dst_buf = FrameAddrAt(dst_pos + Vector2D<int>{0, src.size.y - 1}, config_);
-        const uint8_t* src_buf = FrameAddrAt(src.pos + Vector2D<int>{0, src.size.y - 1}, config_);
+        uint8_t* dst_buf = FrameAddrAt(dst_pos + Vector2D<int>{0, src.size.y - 1}, config_, *kernels_);
+        const uint8_t* src_buf = FrameAddrAt(src.pos + Vector2D<int>{0, src.size.y - 1}, config_, *kernels_);
         for (int y = 0; y < src.size.y; y++) {
             memcpy(dst_buf, src_buf, bytes_per_pixel * src.size.x);
             dst_buf -= bytes_per_scan_line;
@@ -108,3 +294,7 @@ void FrameBuffer::Move(Vector2D<int> dst_pos, const Rectangle<int>& src) {
         }
     }
 }
+
+PixelColor FrameBuffer::At(Vector2D<int> pos) const {
+    return kernels_->at(FrameAddrAt(pos, config_, *kernels_));
+}
@@ -7,20 +7,63 @@
 #include "frame_buffer_config.hpp"
 #include "graphics.hpp"
 
+/// アプリから渡される画像のピクセル形式（apps/syscall.hのWIN_IMAGE_*と同じ値）
+enum class ImageFormat {
+    /// 4バイトの0xTTRRGGBB（TTは透明度。0で不透明）
+    kARGB8888 = 0,
+    /// R, G, Bの順の3バイト
+    kRGB888 = 1,
+    /// R, G, B, A（不透明度。255で不透明）の順の4バイト
+    kRGBA8888 = 2,
+    /// 1バイトの明るさ
+    kGray8 = 3,
+};
+
+/// formatの1ピクセルのバイト数。知らない形式なら0
+int BytesPerPixel(ImageFormat format);
+
+/// ピクセル形式ごとの描画処理の表（frame_buffer.cpp）
+struct FrameBufferKernels;
+
 /// フレームバッファはディスプレイと接続された特殊はメモリ領域
 /// VRAM (Video RAM)
 class FrameBuffer {
 public:
+    FrameBuffer() = default;
+    /// 自分で持っていたピクセルの領域をプールに戻す（surface_pool.hpp）
+    ~FrameBuffer();
+    FrameBuffer(const FrameBuffer&) = delete;
+    FrameBuffer& operator=(const FrameBuffer&) = delete;
+
+    /// config.frame_bufferがnullptrなら、ピクセルの領域をプールから受け取って持つ
     Error Initailize(const FrameBufferConfig& config);
     Error Copy(Vector2D<int> dst_pos, const FrameBuffer& src, const Rectangle<int>& src_area);
+    /// Copyと同じだが、srcの中でtransparentと同じ色のピクセルは書かない
+    /// srcとピクセル形式が違うときはkUnknownPixelFormatを返す
+    Error CopyTransparent(Vector2D<int> dst_pos, const FrameBuffer& src,
+                          const Rectangle<int>& src_area, const PixelColor& transparent);
+    /// Copyと同じだが、srcを不透明度alphaで重ねる（per_pixelならsrcの上位8ビットの透明度も使う。BlendPixels()を参照）
+    /// srcとピクセル形式が違うときはkUnknownPixelFormatを返す
+    Error Blend(Vector2D<int> dst_pos, const FrameBuffer& src, const Rectangle<int>& src_area,
+                uint8_t alpha, bool per_pixel);
+    /// posから右へ0xTTRRGGBB（TTは透明度。0で不透明）の色をlen個、上位8ビットも含めて書く（はみ出す部分は無視する）
+    void WriteARGBSpan(Vector2D<int> pos, const uint32_t* pixels, int len);
+    /// posを左上に、sizeの大きさの画像（1行stride バイト）を変換しながら書く（はみ出す部分は無視する）
+    /// keep_alphaなら透明度をピクセルの上位8ビットに残し、そうでなければ0（不透明）にする
+    void WriteImage(Vector2D<int> pos, Vector2D<int> size, const void* image, size_t stride,
+                    ImageFormat format, bool keep_alpha);
     /// このウィンドウの平面領域内で、矩形領域を移動する
     void Move(Vector2D<int> dst_pos, const Rectangle<int>& src);
+    /// posのピクセルを読み出して色に戻す
+    PixelColor At(Vector2D<int> pos) const;
     FrameBufferWriter& Writer() { return *writer_; };
     const FrameBufferConfig& Config() const { return config_; }
 
 private:
     FrameBufferConfig config_{};
-    /// フレームバッファ本体
+    /// フレームバッファ本体（自分で持つときだけ）
     std::vector<uint8_t> buffer_{};
     std::unique_ptr<FrameBufferWriter> writer_{};
+    /// config_.pixel_formatに合わせてInitailize()で選ぶ
+    const FrameBufferKernels* kernels_{nullptr};
 };
@@ -1,37 +1,172 @@
 #include "graphics.hpp"
 
-void RGBResv8BitPerColorPixelWriter::Write(Vector2D<int> pos, const PixelColor& color) {
-    auto p = PixelAt(pos);
-    p[0] = color.r;
-    p[1] = color.g;
-    p[2] = color.b;
+#include <cstddef>
+#include <cstdlib>
+
+#include "pixel_ops.hpp"
+
+// 予約の8ビットも0にする（ウィンドウのシャドウバッファでは透明度として使うので、他の書き方と揃える）
+template <PixelFormat F>
+void FixedFormatPixelWriter<F>::Write(Vector2D<int> pos, const PixelColor& color) {
+    *reinterpret_cast<uint32_t*>(PixelAt(pos)) = PixelFormatTraits<F>::ToPixel(color);
+}
+
+void PixelWriter::FillSpan(Vector2D<int> pos, int len, const PixelColor& color) {
+    for (int dx = 0; dx < len; dx++) {
+        Write(pos + Vector2D<int>{dx, 0}, color);
+    }
+}
+
+void PixelWriter::WriteSpan(Vector2D<int> pos, const PixelColor* colors, int len) {
+    for (int dx = 0; dx < len; dx++) {
+        Write(pos + Vector2D<int>{dx, 0}, colors[dx]);
+    }
+}
+
+void PixelWriter::FillRectangle(const Vector2D<int>& pos, const Vector2D<int>& size, const PixelColor& color) {
+    for (int dy = 0; dy < size.y; dy++) {
+        FillSpan(pos + Vector2D<int>{0, dy}, size.x, color);
+    }
 }
 
-void BGRResv8BitPerColorPixelWriter::Write(Vector2D<int> pos, const PixelColor& color) {
-    auto p = PixelAt(pos);
-    p[0] = color.b;
-    p[1] = color.g;
-    p[2] = color.r;
+void PixelWriter::BlitRect(Vector2D<int> pos, const PixelColor* src, int src_stride, Vector2D<int> size) {
+    for (int dy = 0; dy < size.y; dy++) {
+        WriteSpan(pos + Vector2D<int>{0, dy}, &src[static_cast<size_t>(dy) * src_stride], size.x);
+    }
+}
+
+void PixelWriter::WriteGlyphMask(Vector2D<int> pos, const uint8_t* mask, int mask_pitch,
+                                 Vector2D<int> size, const PixelColor& color) {
+    // 立っているビットが続く区間ごとにまとめて塗る
+    for (int dy = 0; dy < size.y; dy++) {
+        const uint8_t* row = mask + static_cast<ptrdiff_t>(mask_pitch) * dy;
+        int dx = 0;
+        while (dx < size.x) {
+            if ((row[dx >> 3] & (0x80u >> (dx & 7))) == 0) {
+                dx++;
+                continue;
+            }
+            const int run_start = dx;
+            while (dx < size.x && (row[dx >> 3] & (0x80u >> (dx & 7)))) {
+                dx++;
+            }
+            FillSpan(pos + Vector2D<int>{run_start, dy}, dx - run_start, color);
+        }
+    }
+}
+
+template <PixelFormat F>
+void FixedFormatPixelWriter<F>::FillSpan(Vector2D<int> pos, int len, const PixelColor& color) {
+    FillRectangle(pos, {len, 1}, color);
 }
 
+template <PixelFormat F>
+void FixedFormatPixelWriter<F>::WriteSpan(Vector2D<int> pos, const PixelColor* colors, int len) {
+    if (pos.y < 0 || pos.y >= Height()) {
+        return;
+    }
+    const int x_begin = std::max(pos.x, 0), x_end = std::min(pos.x + len, Width());
+    auto p = reinterpret_cast<uint32_t*>(PixelAt({0, pos.y}));
+    for (int x = x_begin; x < x_end; x++) {
+        p[x] = PixelFormatTraits<F>::ToPixel(colors[x - pos.x]);
+    }
+}
+
+template <PixelFormat F>
+void FixedFormatPixelWriter<F>::FillRectangle(const Vector2D<int>& pos, const Vector2D<int>& size, const PixelColor& color) {
+    const auto start = ElementMax(pos, {0, 0});
+    const auto end = ElementMin(pos + size, Vector2D<int>{Width(), Height()});
+    if (start.x >= end.x || start.y >= end.y) {
+        return;
+    }
+    const auto pixel = PixelFormatTraits<F>::ToPixel(color);
+    for (int y = start.y; y < end.y; y++) {
+        FillPixels(PixelAt({start.x, y}), pixel, end.x - start.x);
+    }
+}
+
+template <PixelFormat F>
+void FixedFormatPixelWriter<F>::WriteGlyphMask(Vector2D<int> pos, const uint8_t* mask, int mask_pitch,
+                                               Vector2D<int> size, const PixelColor& color) {
+    const auto start = ElementMax(pos, {0, 0});
+    const auto end = ElementMin(pos + size, Vector2D<int>{Width(), Height()});
+    if (start.x >= end.x) {
+        return;
+    }
+    const auto pixel = PixelFormatTraits<F>::ToPixel(color);
+    for (int y = start.y; y < end.y; y++) {
+        const uint8_t* row = mask + static_cast<ptrdiff_t>(mask_pitch) * (y - pos.y);
+        // マスクの1バイトを8ピクセル分の選択に広げて、まとめて書く
+        FillPixelsMasked(PixelAt({start.x, y}), row, start.x - pos.x, pixel, end.x - start.x);
+    }
+}
+
+template class FixedFormatPixelWriter<kPixelRGBResv8BitPerColor>;
+template class FixedFormatPixelWriter<kPixelBGRResv8BitPerColor>;
+
 void DrawRectangle(PixelWriter& writer, const Vector2D<int>& pos, const Vector2D<int>& size, const PixelColor& color) {
-    // 上辺と下辺
-    for (int dx = 0; dx < size.x; dx++) {
-        writer.Write(pos + Vector2D<int>{dx, 0}, color);
-        writer.Write(pos + Vector2D<int>{dx, size.y - 1}, color);
+    if (size.x <= 0 || size.y <= 0) {
+        return;
     }
+    // 上辺と下辺
+    writer.FillSpan(pos, size.x, color);
+    writer.FillSpan(pos + Vector2D<int>{0, size.y - 1}, size.x, color);
     // 左辺と右辺
-    for (int dy = 1; dy < size.y; dy++) {
-        writer.Write(pos + Vector2D<int>{0, dy}, color);
-        writer.Write(pos + Vector2D<int>{size.x - 1, dy}, color);
-    }
+    writer.FillRectangle(pos + Vector2D<int>{0, 1}, {1, size.y - 1}, color);
+    writer.FillRectangle(pos + Vector2D<int>{size.x - 1, 1}, {1, size.y - 1}, color);
 }
 
 /// 描画領域塗りつぶし
 void FillRectangle(PixelWriter& writer, const Vector2D<int>& pos, const Vector2D<int>& size, const PixelColor& color) {
-    for (int dy = 0; dy < size.y; dy++) {
-        for (int dx = 0; dx < size.x; dx++) {
-            writer.Write(pos + Vector2D<int>{dx, dy}, color);
+    writer.FillRectangle(pos, size, color);
+}
+
+void DrawLine(PixelWriter& writer, Vector2D<int> p0, Vector2D<int> p1, const PixelColor& color) {
+    // 描画先に全くかからない線は何もしない
+    if (std::max(p0.x, p1.x) < 0 || std::min(p0.x, p1.x) >= writer.Width() ||
+        std::max(p0.y, p1.y) < 0 || std::min(p0.y, p1.y) >= writer.Height()) {
+        return;
+    }
+
+    const int dx = std::abs(p1.x - p0.x), dy = std::abs(p1.y - p0.y);
+    if (dx >= dy) { // 水平に近い線は、x軸に沿って進み、同じ行の点を横に塗る
+        if (p0.x > p1.x) {
+            std::swap(p0, p1);
+        }
+        const int sy = p1.y >= p0.y ? 1 : -1;
+        // 次の点で行が変わるかの判定値（誤差の2 * dx倍）
+        long d = 2L * dy - dx;
+        int y = p0.y, run_start = p0.x;
+        for (int x = p0.x; x <= p1.x; x++) {
+            if (d > 0) {
+                writer.FillSpan({run_start, y}, x - run_start + 1, color);
+                run_start = x + 1;
+                y += sy;
+                d -= 2L * dx;
+            }
+            d += 2L * dy;
+        }
+        if (run_start <= p1.x) {
+            writer.FillSpan({run_start, y}, p1.x - run_start + 1, color);
+        }
+    } else { // 垂直に近い線は、y軸に沿って進み、同じ列の点を縦に塗る
+        if (p0.y > p1.y) {
+            std::swap(p0, p1);
+        }
+        const int sx = p1.x >= p0.x ? 1 : -1;
+        long d = 2L * dx - dy;
+        int x = p0.x, run_start = p0.y;
+        for (int y = p0.y; y <= p1.y; y++) {
+            if (d > 0) {
+                writer.FillRectangle({x, run_start}, {1, y - run_start + 1}, color);
+                run_start = y + 1;
+                x += sx;
+                d -= 2L * dy;
+            }
+            d += 2L * dx;
+        }
+        if (run_start <= p1.y) {
+            writer.FillRectangle({x, run_start}, {1, p1.y - run_start + 1}, color);
         }
     }
 }
@@ -88,12 +88,59 @@ Rectangle<T> operator&(const Rectangle<T>& lhs, const Rectangle<U>& rhs) {
     return {new_pos, new_size};
 }
 
+/// 両方を含む最小の矩形
+template <typename T, typename U>
+Rectangle<T> operator|(const Rectangle<T>& lhs, const Rectangle<U>& rhs) {
+    auto new_pos = ElementMin(lhs.pos, rhs.pos);
+    auto new_end = ElementMax(lhs.pos + lhs.size, rhs.pos + rhs.size);
+    return {new_pos, new_end - new_pos};
+}
+
 class PixelWriter {
 public:
     virtual ~PixelWriter() = default;
     virtual void Write(Vector2D<int> pos, const PixelColor& color) = 0;
     virtual int Width() const = 0;
     virtual int Height() const = 0;
+
+    // 以下はまとまった範囲への書き込み。既定の実装はWrite()を1ピクセルずつ呼ぶので、速く書ける描画先は上書きする
+    /// posから右へlenピクセルをcolorで塗る
+    virtual void FillSpan(Vector2D<int> pos, int len, const PixelColor& color);
+    /// posから右へcolors[0]〜colors[len - 1]を書く
+    virtual void WriteSpan(Vector2D<int> pos, const PixelColor* colors, int len);
+    /// 矩形領域を塗りつぶす
+    virtual void FillRectangle(const Vector2D<int>& pos, const Vector2D<int>& size, const PixelColor& color);
+    /// 1行src_strideピクセルで並んだsrcから、size分の矩形をposに書く
+    virtual void BlitRect(Vector2D<int> pos, const PixelColor* src, int src_stride, Vector2D<int> size);
+    /// 1ピクセル1ビットのマスク（左のピクセルが上位ビット、1行mask_pitchバイト）の立っているピクセルをcolorで書く
+    virtual void WriteGlyphMask(Vector2D<int> pos, const uint8_t* mask, int mask_pitch,
+                                Vector2D<int> size, const PixelColor& color);
+};
+
+/// ピクセル形式ごとの並び。形式をテンプレート引数にした描画処理は、これで変換と幅をコンパイル時に決める
+template <PixelFormat F>
+struct PixelFormatTraits;
+
+template <>
+struct PixelFormatTraits<kPixelRGBResv8BitPerColor> {
+    static constexpr int kBytesPerPixel = 4;
+    static constexpr uint32_t ToPixel(const PixelColor& c) {
+        return c.r | (c.g << 8) | (c.b << 16);
+    }
+    static constexpr PixelColor FromPixel(uint32_t p) {
+        return {static_cast<uint8_t>(p), static_cast<uint8_t>(p >> 8), static_cast<uint8_t>(p >> 16)};
+    }
+};
+
+template <>
+struct PixelFormatTraits<kPixelBGRResv8BitPerColor> {
+    static constexpr int kBytesPerPixel = 4;
+    static constexpr uint32_t ToPixel(const PixelColor& c) {
+        return c.b | (c.g << 8) | (c.r << 16);
+    }
+    static constexpr PixelColor FromPixel(uint32_t p) {
+        return {static_cast<uint8_t>(p >> 16), static_cast<uint8_t>(p >> 8), static_cast<uint8_t>(p)};
+    }
 };
 
 class FrameBufferWriter : public PixelWriter {
@@ -112,22 +159,35 @@ private:
     const FrameBufferConfig& config_;
 };
 
-class RGBResv8BitPerColorPixelWriter : public FrameBufferWriter {
+/// ピクセル形式Fのフレームバッファへの書き込み。仮想呼び出しは1回の描画につき1回で、内側のループは形式ごとに生成される
+/// 画面からはみ出す部分は書かない
+template <PixelFormat F>
+class FixedFormatPixelWriter : public FrameBufferWriter {
 public:
     using FrameBufferWriter::FrameBufferWriter;
     virtual void Write(Vector2D<int> pos, const PixelColor& color) override;
+    virtual void FillSpan(Vector2D<int> pos, int len, const PixelColor& color) override;
+    virtual void WriteSpan(Vector2D<int> pos, const PixelColor* colors, int len) override;
+    virtual void FillRectangle(const Vector2D<int>& pos, const Vector2D<int>& size, const PixelColor& color) override;
+    virtual void WriteGlyphMask(Vector2D<int> pos, const uint8_t* mask, int mask_pitch,
+                                Vector2D<int> size, const PixelColor& color) override;
 };
 
-class BGRResv8BitPerColorPixelWriter : public FrameBufferWriter {
-public:
-    using FrameBufferWriter::FrameBufferWriter;
-    virtual void Write(Vector2D<int> pos, const PixelColor& color) override;
-};
+// 実体はgraphics.cppで対応している形式の分だけ作る
+extern template class FixedFormatPixelWriter<kPixelRGBResv8BitPerColor>;
+extern template class FixedFormatPixelWriter<kPixelBGRResv8BitPerColor>;
+
+using RGBResv8BitPerColorPixelWriter = FixedFormatPixelWriter<kPixelRGBResv8BitPerColor>;
+using BGRResv8BitPerColorPixelWriter = FixedFormatPixelWriter<kPixelBGRResv8BitPerColor>;
 
 void DrawRectangle(PixelWriter& writer, const Vector2D<int>& pos, const Vector2D<int>& size, const PixelColor& color);
 
 void FillRectangle(PixelWriter& writer, const Vector2D<int>& pos, const Vector2D<int>& size, const PixelColor& color);
 
+/// p0からp1まで（両端を含む）の直線を引く
+/// 整数だけで計算するBresenhamのアルゴリズムで点を選び、同じ行（または列）に続く点はまとめて塗る
+void DrawLine(PixelWriter& writer, Vector2D<int> p0, Vector2D<int> p1, const PixelColor& color);
+
 const PixelColor kDesktopBGColor{45, 118, 237};
 const PixelColor kDesktopFGColor{255, 255, 255};
 
@@ -0,0 +1,92 @@
+#include "idle.hpp"
+
+#include <array>
+
+#include "asmfunc.h"
+#include "smp.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace {
+    /// CPUコアごとのアイドルの状態
+    /// MONITORはキャッシュライン単位で書き込みを見張るので、呼び鈴は他の変数と別のラインに置く
+    struct alignas(64) CPUIdle {
+        uint64_t doorbell;
+        alignas(64) bool waiting;
+        IdleStat stat;
+    };
+    std::array<CPUIdle, kMaxCPUs> g_cpu_idles{};
+
+    bool g_mwait = false;
+
+    /// 次の割り込みか呼び鈴まで休む（割り込みを禁止して呼び、戻るときも禁止したまま）
+    void IdleOnce(CPUIdle& idle, int cpu) {
+        const uint64_t bell = __atomic_load_n(&idle.doorbell, __ATOMIC_RELAXED);
+        if (g_mwait) {
+            __atomic_store_n(&idle.waiting, true, __ATOMIC_SEQ_CST);
+            __asm__ volatile("monitor" : : "a"(&idle.doorbell), "c"(0), "d"(0));
+        }
+        // 見張り始める前に積まれたタスクは呼び鈴を鳴らさないので、待機列を確かめ直す
+        if (!g_task_manager->HasRunnable(cpu)) {
+            const uint64_t start = ReadTSC();
+            // STIの直後の1命令までは割り込まれないので、STIとMWAIT（HLT）の間に来た割り込みでも起きられる
+            if (g_mwait) {
+                __asm__ volatile("sti\n\tmwait\n\tcli" : : "a"(0), "c"(0));
+                idle.stat.mwait_entries++;
+            } else {
+                __asm__ volatile("sti\n\thlt\n\tcli");
+            }
+            idle.stat.idle_cycles += ReadTSC() - start;
+            idle.stat.entries++;
+        }
+        if (g_mwait) {
+            __atomic_store_n(&idle.waiting, false, __ATOMIC_RELAXED);
+            if (__atomic_load_n(&idle.doorbell, __ATOMIC_RELAXED) != bell) {
+                idle.stat.doorbell_wakeups++;
+            }
+        }
+    }
+} // namespace
+
+void InitializeIdle() {
+    std::array<uint32_t, 4> regs; // eax, ebx, ecx, edx
+    ReadCPUID(1, 0, regs.data());
+    // ECXのbit3 : MONITOR/MWAIT
+    g_mwait = (regs[2] >> 3) & 1;
+}
+
+bool MWaitAvailable() {
+    return g_mwait;
+}
+
+void RunIdleLoop(unsigned long max_ticks, bool (*work)()) {
+    const int cpu = CurrentCPU();
+    auto& idle = g_cpu_idles[cpu];
+    while (true) {
+        if (work && work()) {
+            continue;
+        }
+        // 次のタイマまでタイマ割り込みを止めて休む
+        __asm__("cli");
+        EnterTicklessIdle(max_ticks);
+        IdleOnce(idle, cpu);
+        ExitTicklessIdle();
+        __asm__("sti");
+        // 呼び鈴で起きたときは、次のタイマ割り込みを待たずに積まれたタスクへ切り替える
+        g_task_manager->PreemptIdle();
+    }
+}
+
+void RingIdleDoorbell(int cpu) {
+    auto& idle = g_cpu_idles[cpu];
+    // 積んだタスクが見えてから、相手が見張っているかを確かめる（IdleOnce()と逆の順）
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (g_mwait && __atomic_load_n(&idle.waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_add(&idle.doorbell, 1, __ATOMIC_RELAXED);
+    }
+}
+
+IdleStat GetIdleStat(int cpu) {
+    // 書くのはそのCPUコアだけなので、ロックは取らない（読む途中で少し進んでいてもよい）
+    return g_cpu_idles[cpu].stat;
+}
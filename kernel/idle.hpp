@@ -0,0 +1,31 @@
+/// CPUコアのアイドル : 実行できるタスクがないときに、次にやることができるまでCPUコアを休ませる
+/// MONITOR/MWAITを使えれば、CPUコアごとの呼び鈴（ドアベル）を見張って休む
+/// 他のCPUコアがタスクを待機列に積んで呼び鈴を鳴らすと、IPIを送らなくてもすぐに起きる
+/// 使えなければ、HLTで次の割り込み（タイマ）まで休む
+
+#pragma once
+
+#include <cstdint>
+
+/// GetIdleStatシステムコールで返すCPUコア1つぶんの情報（apps/syscall.hのIdleStatと同じ並び。時間はTSCのカウント）
+struct IdleStat {
+    /// 休んでいた時間と、休んだ回数
+    uint64_t idle_cycles, entries;
+    /// MWAITで休んだ回数と、そのうち呼び鈴で起きた回数
+    uint64_t mwait_entries, doorbell_wakeups;
+};
+
+/// MONITOR/MWAITを使えるか調べる（タスクやAPより先に、BSPで1回呼ぶ）
+void InitializeIdle();
+bool MWaitAvailable();
+
+/// 実行中のCPUコアのアイドルループ。戻らない
+/// 割り込みか呼び鈴で起きるたびに、待機列にタスクが積まれていればすぐに切り替える
+/// max_ticks : ティックレスアイドルで割り込みを止めておく最大のtick数
+/// work : 休む前に呼ぶ処理（なければnullptr）。trueを返す間は休まずに呼び続ける
+[[noreturn]] void RunIdleLoop(unsigned long max_ticks, bool (*work)() = nullptr);
+
+/// cpuが呼び鈴を見張って休んでいれば起こす（cpuの待機列にタスクを積んだ後に呼ぶ）
+void RingIdleDoorbell(int cpu);
+
+IdleStat GetIdleStat(int cpu);
@@ -1,14 +1,21 @@
 #include "interrupt.hpp"
 
+#include <algorithm>
 #include <csignal>
+#include <utility>
 
 #include "asmfunc.h"
+#include "deferred.hpp"
 #include "font.hpp"
 #include "graphics.hpp"
+#include "layer.hpp"
 #include "paging.hpp"
 #include "segment.hpp"
+#include "spinlock.hpp"
 #include "task.hpp"
 #include "timer.hpp"
+#include "trace.hpp"
+#include "usb/xhci/xhci.hpp"
 
 #include "logger.hpp"
 
@@ -32,13 +39,49 @@ void NotifyEndOfInterrupt() {
 }
 
 namespace {
-    /// xHCI用割り込みハンドラ
-    __attribute__((interrupt)) void IntHandlerXHCI(InterruptFrame* frame) {
-        // メインタスクに通知
-        g_task_manager->SendMessage(kMainTaskID, Message{Message::kInterruptXHCI});
+    /// ベクタごとの統計。複数のCPUコアから同時に更新されるので、アトミックに足す
+    std::array<IRQStat, 256> g_irq_stats{};
+
+    void ProcessXHCIEvents(uint64_t) {
+        // マウスのドライバがレイヤを操作するので持っておく
+        MutexGuard lock{g_layer_mutex};
+        usb::xhci::ProcessEvents();
+    }
+
+    DeferredWork g_xhci_work{"xhci", ProcessXHCIEvents, 0, WorkPriority::kHigh};
+
+    /// AllocateInterruptVector()で割り当てたベクタ
+    struct DynamicVector {
+        const char* name;
+        /// 割り込みハンドラはallocatedを見ずに、これがnullptrでなければ呼ぶ
+        InterruptHandler handler;
+        uint64_t arg;
+        int cpu;
+        bool allocated;
+    };
+    std::array<DynamicVector, kNumDynamicVectors> g_dynamic_vectors{};
+    SpinLock g_dynamic_vectors_lock{};
+
+    /// 割り当て用のベクタの割り込みハンドラ。どのベクタから来たかを知るため、ベクタごとに実体化する
+    template <int Vector>
+    __attribute__((interrupt)) void IntHandlerDynamic(InterruptFrame* frame) {
+        IRQTimer irq_timer{Vector};
+        const auto& entry = g_dynamic_vectors[Vector - kFirstDynamicVector];
+        if (auto handler = __atomic_load_n(&entry.handler, __ATOMIC_ACQUIRE)) {
+            handler(entry.arg);
+        }
         NotifyEndOfInterrupt();
     }
 
+    template <size_t... I>
+    void SetDynamicIDTEntries(std::index_sequence<I...>) {
+        (SetIDTEntry(g_idt[kFirstDynamicVector + I],
+                     MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+                     reinterpret_cast<uint64_t>(IntHandlerDynamic<kFirstDynamicVector + I>),
+                     kKernelCS),
+         ...);
+    }
+
     void PrintHex(uint64_t value, int width, Vector2D<int> pos) {
         for (int i = 0; i < width; i++) {
             int x = (value >> 4 * (width - i - 1)) & 0xfu;
@@ -80,6 +123,7 @@ namespace {
     /// ページフォルトが発生したらデマンドページング
     /// ページフォルトは present=0 のページにアクセスしたり、そのページに対する権限がない場合に発生
     __attribute__((interrupt)) void IntHandlerPF(InterruptFrame* frame, uint64_t error_code) {
+        IRQTimer irq_timer{14};
         // 例外発生原因となったメモリアドレス
         uint64_t cr2 = GetCR2();
         auto err = HandlePageFault(error_code, cr2);
@@ -100,8 +144,9 @@ namespace {
     }
 
 /// CPU例外に対応する割り込みハンドラ群
-#define FaultHandlerWithError(fault_name)                                                                \
+#define FaultHandlerWithError(fault_name, vector)                                                        \
     __attribute__((interrupt)) void IntHandler##fault_name(InterruptFrame* frame, uint64_t error_code) { \
+        RecordIRQEntry(vector);                                                                          \
         KillApp(frame);                                                                                  \
         PrintFrame(frame, "#" #fault_name);                                                              \
         WriteString(*g_screen_writer, {500, 16 * 4}, "ERR", {0, 0, 0});                                  \
@@ -109,33 +154,138 @@ namespace {
         while (true) __asm__("hlt");                                                                     \
     } // namespace
 
-#define FaultHandlerNoError(fault_name)                                             \
+#define FaultHandlerNoError(fault_name, vector)                                     \
     __attribute__((interrupt)) void IntHandler##fault_name(InterruptFrame* frame) { \
+        RecordIRQEntry(vector);                                                     \
         KillApp(frame);                                                             \
         PrintFrame(frame, "#" #fault_name);                                         \
         while (true) __asm__("hlt");                                                \
     }
 
-    FaultHandlerNoError(DE);
-    FaultHandlerNoError(DB);
-    FaultHandlerNoError(BP);
-    FaultHandlerNoError(OF);
-    FaultHandlerNoError(BR);
-    FaultHandlerNoError(UD);
-    FaultHandlerNoError(NM);
-    FaultHandlerWithError(DF);
-    FaultHandlerWithError(TS);
-    FaultHandlerWithError(NP);
-    FaultHandlerWithError(SS);
-    FaultHandlerWithError(GP);
-    // FaultHandlerWithError(PF);
-    FaultHandlerNoError(MF);
-    FaultHandlerWithError(AC);
-    FaultHandlerNoError(MC);
-    FaultHandlerNoError(XM);
-    FaultHandlerNoError(VE);
+    FaultHandlerNoError(DE, 0);
+    FaultHandlerNoError(DB, 1);
+    FaultHandlerNoError(BP, 3);
+    FaultHandlerNoError(OF, 4);
+    FaultHandlerNoError(BR, 5);
+    FaultHandlerNoError(UD, 6);
+    FaultHandlerWithError(DF, 8);
+    FaultHandlerWithError(TS, 10);
+    FaultHandlerWithError(NP, 11);
+    FaultHandlerWithError(SS, 12);
+    FaultHandlerWithError(GP, 13);
+    // FaultHandlerWithError(PF, 14);
+    FaultHandlerNoError(MF, 16);
+    FaultHandlerWithError(AC, 17);
+    FaultHandlerNoError(MC, 18);
+    FaultHandlerNoError(XM, 19);
+    FaultHandlerNoError(VE, 20);
 } // namespace
 
+void OnXHCIInterrupt(uint64_t interrupter) {
+    // イベントの処理はワーカタスクに任せる（処理を待っている要求があれば、その処理でまとめて片付く）
+    // どのインタラプタの割り込みでも、すべてのイベントリングを処理する
+    if (usb::xhci::RequestProcessEvents()) {
+        ScheduleWork(g_xhci_work);
+    }
+}
+
+WithError<uint8_t> AllocateInterruptVector(const char* name, InterruptHandler handler, uint64_t arg, int cpu) {
+    SpinLockGuard lock{g_dynamic_vectors_lock};
+    for (int i = 0; i < kNumDynamicVectors; i++) {
+        auto& entry = g_dynamic_vectors[i];
+        if (entry.allocated) {
+            continue;
+        }
+        entry.name = name;
+        entry.arg = arg;
+        entry.cpu = cpu;
+        entry.allocated = true;
+        // ハンドラは最後に書く（割り込みハンドラはこれを見てから他を読む）
+        __atomic_store_n(&entry.handler, handler, __ATOMIC_RELEASE);
+        return {static_cast<uint8_t>(kFirstDynamicVector + i), MAKE_ERROR(Error::kSuccess)};
+    }
+    return {0, MAKE_ERROR(Error::kFull)};
+}
+
+void FreeInterruptVector(uint8_t vector) {
+    if (vector < kFirstDynamicVector || kFirstDynamicVector + kNumDynamicVectors <= vector) {
+        return;
+    }
+    SpinLockGuard lock{g_dynamic_vectors_lock};
+    auto& entry = g_dynamic_vectors[vector - kFirstDynamicVector];
+    __atomic_store_n(&entry.handler, nullptr, __ATOMIC_RELEASE);
+    entry.allocated = false;
+}
+
+int InterruptVectorCPU(uint8_t vector) {
+    if (vector < kFirstDynamicVector || kFirstDynamicVector + kNumDynamicVectors <= vector) {
+        return 0;
+    }
+    SpinLockGuard lock{g_dynamic_vectors_lock};
+    const auto& entry = g_dynamic_vectors[vector - kFirstDynamicVector];
+    return entry.allocated ? entry.cpu : 0;
+}
+
+uint64_t RecordIRQEntry(int vector) {
+    __atomic_fetch_add(&g_irq_stats[vector].count, 1, __ATOMIC_RELAXED);
+    Trace(TraceEvent::kIRQ, vector);
+    return ReadTSC();
+}
+
+void RecordIRQExit(int vector, uint64_t entry_tsc) {
+    const uint64_t cycles = ReadTSC() - entry_tsc;
+    auto& stat = g_irq_stats[vector];
+    // 128未満は区間0、以降は2倍ごとに次の区間
+    const int bit_width = 64 - __builtin_clzll(cycles | 1);
+    const int bucket = std::clamp(bit_width - 7, 0, kIRQHistBuckets - 1);
+    __atomic_fetch_add(&stat.cycles, cycles, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stat.hist[bucket], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&stat.max_cycles, __ATOMIC_RELAXED);
+    while (cycles > max &&
+           !__atomic_compare_exchange_n(&stat.max_cycles, &max, cycles, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+IRQStat GetIRQStat(int vector) {
+    return g_irq_stats[vector];
+}
+
+void ResetIRQStat() {
+    for (auto& stat : g_irq_stats) {
+        stat = IRQStat{};
+    }
+}
+
+const char* IRQName(int vector) {
+    if (kFirstDynamicVector <= vector && vector < kFirstDynamicVector + kNumDynamicVectors) {
+        SpinLockGuard lock{g_dynamic_vectors_lock};
+        const auto& entry = g_dynamic_vectors[vector - kFirstDynamicVector];
+        return entry.allocated ? entry.name : nullptr;
+    }
+    switch (vector) {
+    case 0: return "#DE";
+    case 1: return "#DB";
+    case 3: return "#BP";
+    case 4: return "#OF";
+    case 5: return "#BR";
+    case 6: return "#UD";
+    case 8: return "#DF";
+    case 10: return "#TS";
+    case 11: return "#NP";
+    case 12: return "#SS";
+    case 13: return "#GP";
+    case 14: return "#PF";
+    case 16: return "#MF";
+    case 17: return "#AC";
+    case 18: return "#MC";
+    case 19: return "#XM";
+    case 20: return "#VE";
+    case InterruptVector::kLAPICTimer: return "timer";
+    default: return nullptr;
+    }
+}
+
 void InitializeInterrupt() {
     auto set_idt_entry = [](int irq, auto handler) {
         SetIDTEntry(g_idt[irq],
@@ -144,7 +294,8 @@ void InitializeInterrupt() {
                     kKernelCS);
     };
     // IDTをCPUに登録
-    set_idt_entry(InterruptVector::kXHCI, IntHandlerXHCI);
+    // デバイスの割り込み用のベクタ。ハンドラはAllocateInterruptVector()で後から登録する
+    SetDynamicIDTEntries(std::make_index_sequence<kNumDynamicVectors>{});
     // タイマ割り込みでISTを使うよう設定する
     SetIDTEntry(g_idt[InterruptVector::kLAPICTimer],
                 MakeIDTAttr(DescriptorType::kInterruptGate,
@@ -165,8 +316,12 @@ void InitializeInterrupt() {
     set_idt_entry(4, IntHandlerOF);
     set_idt_entry(5, IntHandlerBR);
     set_idt_entry(6, IntHandlerUD);
-    set_idt_entry(7, IntHandlerNM);
-    set_idt_entry(8, IntHandlerDF);
+    // デバイス使用不可（FPUの遅延切り替え）
+    set_idt_entry(7, IntHandlerDeviceNotAvailable);
+    SetIDTEntry(g_idt[8],
+                MakeIDTAttr(DescriptorType::kInterruptGate, 0, true, kISTForDoubleFault),
+                reinterpret_cast<uint64_t>(IntHandlerDF),
+                kKernelCS);
     set_idt_entry(10, IntHandlerTS);
     set_idt_entry(11, IntHandlerNP);
     set_idt_entry(12, IntHandlerSS);
@@ -179,5 +334,9 @@ void InitializeInterrupt() {
     set_idt_entry(18, IntHandlerMC);
     set_idt_entry(19, IntHandlerXM);
     set_idt_entry(20, IntHandlerVE);
+    LoadInterruptDescriptorTable();
+}
+
+void LoadInterruptDescriptorTable() {
     LoadIDT(sizeof(g_idt) - 1, reinterpret_cast<uintptr_t>(&g_idt[0]));
 }
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <cstdint>
 #include <deque>
 
+#include "error.hpp"
 #include "message.hpp"
 #include "x86_descriptor.hpp"
 
@@ -37,14 +38,65 @@ struct InterruptDescriptor {
 } __attribute__((packed));
 
 /// 割り込みベクタ番号（割り込み要因番号、割り込みベクトル）
+/// デバイスの割り込みにはAllocateInterruptVector()で割り当てたものを使う
 class InterruptVector {
 public:
     enum Number {
-        kXHCI = 0x40,
         kLAPICTimer = 0x41,
     };
 };
 
+/// AllocateInterruptVector()が割り当てるベクタの範囲 [kFirstDynamicVector, kFirstDynamicVector + kNumDynamicVectors)
+const int kFirstDynamicVector = 0x50;
+const int kNumDynamicVectors = 64;
+
+/// 割り当てたベクタの割り込みで呼ぶ関数。割り込みを禁止したまま呼ばれ、戻った後にEOIが送られる
+using InterruptHandler = void (*)(uint64_t arg);
+
+/// 空いているベクタを割り当て、その割り込みでhandler(arg)が呼ばれるようにする
+/// name : irqstatに出す名前
+/// cpu : 割り込みを受けるCPUコア（smp.hppの番号）。デバイスにはこのCPUコアのLocal APIC IDを宛先に設定する
+/// 空きがなければ kFull
+WithError<uint8_t> AllocateInterruptVector(const char* name, InterruptHandler handler, uint64_t arg, int cpu = 0);
+/// 割り当てたベクタを返す。デバイスからの割り込みは呼び出し側で先に止めておく
+void FreeInterruptVector(uint8_t vector);
+/// ベクタの割り込みを受けるCPUコア（割り当てていなければ0）
+int InterruptVectorCPU(uint8_t vector);
+
+/// xHCの割り込み（arg : インタラプタの番号）。イベントの処理をワーカタスクに積む
+void OnXHCIInterrupt(uint64_t interrupter);
+
+/// スコープ内で割り込みを禁止し、抜けるときに元の状態（RFLAGS.IF）に戻す
+/// 割り込みハンドラ内から呼ばれうる処理では、無条件にstiするわけにいかないのでこちらを使う
+class InterruptGuard {
+public:
+    InterruptGuard() {
+#ifdef HOST_TEST
+        // ホストでのテストはユーザーモードで動き、cliを実行できないので、RFLAGSを控えるだけにする
+        __asm__ volatile("pushfq\n\tpopq %0"
+                         : "=r"(rflags_)
+                         :
+                         : "memory");
+#else
+        __asm__ volatile("pushfq\n\tpopq %0\n\tcli"
+                         : "=r"(rflags_)
+                         :
+                         : "memory");
+#endif
+    }
+    ~InterruptGuard() {
+        __asm__ volatile("pushq %0\n\tpopfq"
+                         :
+                         : "r"(rflags_)
+                         : "memory", "cc");
+    }
+    InterruptGuard(const InterruptGuard&) = delete;
+    InterruptGuard& operator=(const InterruptGuard&) = delete;
+
+private:
+    uint64_t rflags_;
+};
+
 /// 割り込みフレーム
 struct InterruptFrame {
     uint64_t rip;
@@ -77,6 +129,9 @@ constexpr InterruptDescriptorAttribute MakeIDTAttr(
 /// 割り込みハンドラを実行する際、事前に設定しておいたスタックを必ず使うようにする仕組み
 /// ISTはTSSに含まれる
 const int kISTForTimer = 1;
+/// タスクのスタックがガードページにあふれると、例外フレームを積めずにダブルフォルトになる
+/// そのときでも報告できるよう、ダブルフォルトは別のスタックで処理する
+const int kISTForDoubleFault = 2;
 
 void SetIDTEntry(InterruptDescriptor& desc,
                  InterruptDescriptorAttribute attr,
@@ -86,3 +141,43 @@ void SetIDTEntry(InterruptDescriptor& desc,
 void NotifyEndOfInterrupt();
 
 void InitializeInterrupt();
+/// InitializeInterrupt()で構築したIDTをCPUに登録する（AP用）
+void LoadInterruptDescriptorTable();
+
+/// 割り込みハンドラの処理時間の分布の区間数
+/// 区間0は128 TSCカウント未満、区間iは[2^(i+6), 2^(i+7))、最後の区間は上限なし
+const int kIRQHistBuckets = 20;
+
+/// 割り込みベクタ1つぶんの統計
+struct IRQStat {
+    /// ハンドラに入った回数（アプリを強制終了した例外など、戻らなかったものも数える）
+    uint64_t count;
+    /// 入ってから戻るまでにかかったTSCカウントの合計と最大
+    uint64_t cycles, max_cycles;
+    uint64_t hist[kIRQHistBuckets];
+};
+
+/// 割り込みハンドラの入口で呼ぶ。戻り値を出口でRecordIRQExit()に渡す
+/// どちらもSSEのレジスタを使わない（FPUの状態を保存する前に呼んでよい）
+uint64_t RecordIRQEntry(int vector);
+void RecordIRQExit(int vector, uint64_t entry_tsc);
+
+/// スコープに入ってから抜けるまでを記録する
+class IRQTimer {
+public:
+    explicit IRQTimer(int vector) : vector_{vector}, entry_tsc_{RecordIRQEntry(vector)} {}
+    ~IRQTimer() {
+        RecordIRQExit(vector_, entry_tsc_);
+    }
+    IRQTimer(const IRQTimer&) = delete;
+    IRQTimer& operator=(const IRQTimer&) = delete;
+
+private:
+    const int vector_;
+    const uint64_t entry_tsc_;
+};
+
+IRQStat GetIRQStat(int vector);
+void ResetIRQStat();
+/// "xhci"や"#PF"のような名前。統計を取っていないベクタならnullptr
+const char* IRQName(int vector);
@@ -0,0 +1,161 @@
+#include "ioapic.hpp"
+
+#include <array>
+
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "logger.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
+
+namespace {
+    struct IOAPIC {
+        /// IOREGSEL（+0x00）にレジスタ番号を書き、IOWIN（+0x10）で読み書きする
+        volatile uint32_t* regs;
+        uint32_t gsi_base;
+        /// 入力の数
+        uint32_t num_inputs;
+    };
+
+    const int kMaxIOAPICs = 4;
+    std::array<IOAPIC, kMaxIOAPICs> g_ioapics{};
+    int g_num_ioapics = 0;
+
+    /// ISAのIRQからGSIへの対応と、その極性・トリガモード
+    struct ISAOverride {
+        uint32_t gsi;
+        bool level_triggered;
+        bool active_low;
+    };
+    std::array<ISAOverride, 16> g_isa_overrides{};
+
+    /// IOREGSELとIOWINの組を分けて使わないようにする
+    SpinLock g_ioapic_lock{};
+
+    const uint32_t kRegVersion = 0x01;
+    const uint32_t kRegRedirectionTable = 0x10;
+    const uint32_t kRedirectionMask = 1u << 16;
+    const uint32_t kRedirectionLevel = 1u << 15;
+    const uint32_t kRedirectionActiveLow = 1u << 13;
+
+    uint32_t ReadIOAPIC(const IOAPIC& ioapic, uint32_t reg) {
+        ioapic.regs[0] = reg;
+        return ioapic.regs[4];
+    }
+
+    void WriteIOAPIC(const IOAPIC& ioapic, uint32_t reg, uint32_t value) {
+        ioapic.regs[0] = reg;
+        ioapic.regs[4] = value;
+    }
+
+    /// gsiを受け持つI/O APIC。なければnullptr
+    const IOAPIC* FindIOAPIC(uint32_t gsi) {
+        for (int i = 0; i < g_num_ioapics; i++) {
+            const auto& ioapic = g_ioapics[i];
+            if (ioapic.gsi_base <= gsi && gsi < ioapic.gsi_base + ioapic.num_inputs) {
+                return &ioapic;
+            }
+        }
+        return nullptr;
+    }
+
+    void DisablePIC() {
+        // マスタとスレーブのすべての入力をマスクする
+        IoOut8(0xa1, 0xff);
+        IoOut8(0x21, 0xff);
+    }
+} // namespace
+
+void InitializeIOAPIC() {
+    for (uint8_t irq = 0; irq < g_isa_overrides.size(); irq++) {
+        g_isa_overrides[irq] = {irq, false, false};
+    }
+    if (acpi::g_madt == nullptr) {
+        Log(kWarn, "MADT is not found. I/O APIC is not available\n");
+        return;
+    }
+
+    const auto& madt = *acpi::g_madt;
+    auto p = reinterpret_cast<const uint8_t*>(&madt + 1);
+    const auto end = reinterpret_cast<const uint8_t*>(&madt) + madt.header.length;
+    for (; p < end && p[1] > 0; p += p[1]) {
+        if (p[0] == 1) {
+            const auto& entry = *reinterpret_cast<const acpi::MADTIOAPIC*>(p);
+            if (g_num_ioapics == kMaxIOAPICs) {
+                Log(kWarn, "too many I/O APICs. ignoring ID %u\n", entry.ioapic_id);
+                continue;
+            }
+            auto& ioapic = g_ioapics[g_num_ioapics++];
+            ioapic.regs = reinterpret_cast<volatile uint32_t*>(static_cast<uintptr_t>(entry.address));
+            ioapic.gsi_base = entry.gsi_base;
+            ioapic.num_inputs = ((ReadIOAPIC(ioapic, kRegVersion) >> 16) & 0xffu) + 1;
+        } else if (p[0] == 2) {
+            const auto& entry = *reinterpret_cast<const acpi::MADTInterruptSourceOverride*>(p);
+            if (entry.bus != 0 || entry.source >= g_isa_overrides.size()) {
+                continue;
+            }
+            g_isa_overrides[entry.source] = {entry.gsi,
+                                             ((entry.flags >> 2) & 3u) == 3,
+                                             (entry.flags & 3u) == 3};
+        }
+    }
+
+    for (int i = 0; i < g_num_ioapics; i++) {
+        const auto& ioapic = g_ioapics[i];
+        for (uint32_t input = 0; input < ioapic.num_inputs; input++) {
+            WriteIOAPIC(ioapic, kRegRedirectionTable + 2 * input, kRedirectionMask);
+        }
+        Log(kInfo, "I/O APIC: GSI %u-%u\n", ioapic.gsi_base, ioapic.gsi_base + ioapic.num_inputs - 1);
+    }
+    if (g_num_ioapics > 0) {
+        DisablePIC();
+    }
+}
+
+Error RouteGSI(uint32_t gsi, uint8_t vector, int cpu, bool level_triggered, bool active_low) {
+    const IOAPIC* ioapic = FindIOAPIC(gsi);
+    if (ioapic == nullptr) {
+        return MAKE_ERROR(Error::kNoSuchEntry);
+    }
+    if (cpu < 0 || NumCPUs() <= cpu) {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    // 宛先は物理モードのLocal APIC ID、配送モードはFixed
+    uint32_t low = vector;
+    if (level_triggered) {
+        low |= kRedirectionLevel;
+    }
+    if (active_low) {
+        low |= kRedirectionActiveLow;
+    }
+    const uint32_t high = static_cast<uint32_t>(GetCPUInfo(cpu).lapic_id) << 24;
+
+    const uint32_t reg = kRegRedirectionTable + 2 * (gsi - ioapic->gsi_base);
+    SpinLockGuard lock{g_ioapic_lock};
+    // 書き換えの途中で割り込みが来ないよう、マスクしたまま宛先を先に書く
+    WriteIOAPIC(*ioapic, reg, kRedirectionMask);
+    WriteIOAPIC(*ioapic, reg + 1, high);
+    WriteIOAPIC(*ioapic, reg, low);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error RouteISAIRQ(uint8_t irq, uint8_t vector, int cpu) {
+    if (irq >= g_isa_overrides.size()) {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    const auto& o = g_isa_overrides[irq];
+    return RouteGSI(o.gsi, vector, cpu, o.level_triggered, o.active_low);
+}
+
+Error MaskGSI(uint32_t gsi, bool mask) {
+    const IOAPIC* ioapic = FindIOAPIC(gsi);
+    if (ioapic == nullptr) {
+        return MAKE_ERROR(Error::kNoSuchEntry);
+    }
+    const uint32_t reg = kRegRedirectionTable + 2 * (gsi - ioapic->gsi_base);
+    SpinLockGuard lock{g_ioapic_lock};
+    const uint32_t low = ReadIOAPIC(*ioapic, reg);
+    WriteIOAPIC(*ioapic, reg, mask ? (low | kRedirectionMask) : (low & ~kRedirectionMask));
+    return MAKE_ERROR(Error::kSuccess);
+}
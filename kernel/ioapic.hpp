@@ -0,0 +1,20 @@
+/// I/O APIC : MSIを使えない（レガシーな）デバイスの割り込みを、Local APICに届ける割り込みコントローラ
+/// 入力はGSI（Global System Interrupt）の番号で指定する。ISAのIRQはMADTの上書き情報に従ってGSIに直す
+
+#pragma once
+
+#include <cstdint>
+
+#include "error.hpp"
+
+/// MADTからI/O APICを探し、すべての入力をマスクする。8259 PICも止めて、レガシーな割り込みはI/O APICから受ける
+/// MADTがなければ何もしない（Route系はkNoSuchEntryを返す）
+void InitializeIOAPIC();
+
+/// GSIの割り込みを、CPUコアcpu（smp.hppの番号）のvectorに届ける（マスクも外す）
+Error RouteGSI(uint32_t gsi, uint8_t vector, int cpu, bool level_triggered, bool active_low);
+/// ISAのIRQ（0〜15）の割り込みを、CPUコアcpuのvectorに届ける
+/// 極性とトリガモードは、MADTに上書きがなければISAの既定（active high、エッジ）にする
+Error RouteISAIRQ(uint8_t irq, uint8_t vector, int cpu);
+/// GSIの割り込みを止める・再開する
+Error MaskGSI(uint32_t gsi, bool mask);
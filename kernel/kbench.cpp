@@ -0,0 +1,309 @@
+#include "kbench.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <memory>
+
+#include "asmfunc.h"
+#include "graphics.hpp"
+#include "layer.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "smp.hpp"
+#include "sync.hpp"
+#include "task.hpp"
+#include "terminal.hpp"
+#include "timer.hpp"
+
+namespace {
+    /// 1つのベンチマークで測る回数
+    constexpr size_t kSamples = 512;
+    /// パイプで受け渡すバイト数と、1回の読み書きの大きさ
+    constexpr size_t kPipeBytes = 4 * 1024 * 1024;
+    constexpr size_t kPipeChunk = 4096;
+
+    using Samples = std::array<uint64_t, kSamples>;
+
+    KernelBenchResult Summarize(const char* name, Samples& samples, size_t n,
+                                uint64_t total_cycles, uint64_t bytes = 0) {
+        std::sort(samples.begin(), samples.begin() + n);
+        auto at = [&](size_t percent) { return samples[std::min(n - 1, n * percent / 100)]; };
+        return {name, n, samples[0], at(50), at(90), at(99), samples[n - 1], total_cycles, bytes};
+    }
+
+    /// f()をkSamples回測る
+    template <class F>
+    KernelBenchResult Measure(const char* name, F f) {
+        Samples samples;
+        const uint64_t start = ReadTSC();
+        for (size_t i = 0; i < kSamples; ++i) {
+            const uint64_t t = ReadTSC();
+            f();
+            samples[i] = ReadTSC() - t;
+        }
+        return Summarize(name, samples, kSamples, ReadTSC() - start);
+    }
+
+    KernelBenchResult BenchFrameAlloc() {
+        return Measure("frame_alloc", []() {
+            auto [frame, err] = g_memory_manager->Allocate(1);
+            if (!err) {
+                g_memory_manager->Free(frame, 1);
+            }
+        });
+    }
+
+    /// ページフォルトの処理の中身（フレームの割り当て、ページテーブルの設定、初めての書き込み）
+    /// カーネルのページフォルトは直せないので、例外そのものの出入りは含まない
+    KernelBenchResult BenchPageMap() {
+        return Measure("page_map", []() {
+            const LinearAddress4Level addr{kKernelScratchBase};
+            if (!MapKernelPages(addr, 1)) {
+                *reinterpret_cast<volatile uint64_t*>(kKernelScratchBase) = 1;
+                UnmapKernelPages(addr, 1);
+            }
+        });
+    }
+
+    KernelBenchResult BenchMessage() {
+        Task& task = g_task_manager->CurrentTask();
+        return Measure("message", [&task]() {
+            task.SendMessage(Message{Message::kBenchPing});
+            task.ReceiveMessage();
+        });
+    }
+
+    /// 相手のタスクが止まるように指示されている
+    bool g_partner_stop;
+
+    /// 届いたメッセージをdataのタスクに送り返す
+    void TaskPingPartner(uint64_t task_id, int64_t data) {
+        Task& task = g_task_manager->CurrentTask();
+        while (true) {
+            task.WaitMessage();
+            if (__atomic_load_n(&g_partner_stop, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            g_task_manager->SendMessage(data, Message{Message::kBenchPing});
+        }
+        g_task_manager->Finish(0);
+    }
+
+    /// 2つのタスクでメッセージを往復させる（コンテキストスイッチ2回分）
+    KernelBenchResult BenchContextSwitch() {
+        Task& task = g_task_manager->CurrentTask();
+        __atomic_store_n(&g_partner_stop, false, __ATOMIC_RELEASE);
+        Task& partner = g_task_manager->NewTask().InitContext(TaskPingPartner, task.ID()).Wakeup();
+        const uint64_t partner_id = partner.ID();
+
+        auto result = Measure("ctx_switch_rt", [&]() {
+            g_task_manager->SendMessage(partner_id, Message{Message::kBenchPing});
+            task.WaitMessage();
+        });
+
+        __atomic_store_n(&g_partner_stop, true, __ATOMIC_RELEASE);
+        g_task_manager->SendMessage(partner_id, Message{Message::kBenchPing});
+        g_task_manager->WaitFinish(partner_id);
+        return result;
+    }
+
+    /// dataのパイプにkPipeBytes書き込む
+    void TaskPipeWriter(uint64_t task_id, int64_t data) {
+        auto pipe = reinterpret_cast<PipeDescriptor*>(data);
+        static uint8_t buf[kPipeChunk];
+        memset(buf, 0xa5, sizeof(buf));
+        for (size_t written = 0; written < kPipeBytes; written += kPipeChunk) {
+            pipe->Write(buf, sizeof(buf));
+        }
+        pipe->FinishWrite();
+        g_task_manager->Finish(0);
+    }
+
+    /// 別のタスクから書き込まれるパイプを読む。1回の読み出しの時間と、全体のスループットを測る
+    KernelBenchResult BenchPipe() {
+        Task& task = g_task_manager->CurrentTask();
+        auto pipe = std::make_unique<PipeDescriptor>(task);
+        const uint64_t writer_id = g_task_manager->NewTask()
+                                       .InitContext(TaskPipeWriter, reinterpret_cast<int64_t>(pipe.get()))
+                                       .Wakeup()
+                                       .ID();
+
+        auto buf = std::make_unique<uint8_t[]>(kPipeChunk);
+        Samples samples;
+        size_t n = 0;
+        uint64_t bytes = 0;
+        const uint64_t start = ReadTSC();
+        while (true) {
+            const uint64_t t = ReadTSC();
+            const size_t len = pipe->Read(buf.get(), kPipeChunk);
+            if (len == 0) {
+                break;
+            }
+            samples[n++ % kSamples] = ReadTSC() - t;
+            bytes += len;
+        }
+        const uint64_t total = ReadTSC() - start;
+
+        g_task_manager->WaitFinish(writer_id);
+        return Summarize("pipe_read", samples, std::min(n, kSamples), total, bytes);
+    }
+
+    /// 画面全体を合成し直してフレームバッファに書く
+    KernelBenchResult BenchComposite() {
+        const Rectangle<int> screen{{0, 0}, ScreenSize()};
+        return Measure("composite_full", [&screen]() {
+            MutexGuard guard{g_layer_mutex};
+            g_layer_manager->Draw(screen);
+            g_layer_manager->Flush();
+        });
+    }
+
+    /// task_stealで動かすタスクの数の上限と、1つのタスクが計算し続ける時間（msec）
+    /// アイドル中のAPは100msecごとにしか奪いに来ないので、BSPだけで片付かない量にする
+    constexpr size_t kMaxStealWorkers = 16;
+    constexpr uint64_t kStealWorkMS = 50;
+
+    /// task_stealのタスクごとの記録
+    struct StealWorker {
+        uint64_t task_id;
+        /// 起こした時刻と、実行され始めた時刻
+        uint64_t woken, started;
+        /// 実行され始めたCPUコア
+        int cpu;
+        /// 計算を終え、BSPへ戻されるのを待って眠るところ
+        bool parked;
+    };
+    std::array<StealWorker, kMaxStealWorkers> g_steal_workers;
+
+    /// ヒープもレイヤも触らずに計算するだけなので、どのCPUコアで実行してもよい
+    /// Finish()はヒープを触るので、計算を終えたらBSPに移されるのを待って眠る
+    void TaskStealWorker(uint64_t task_id, int64_t data) {
+        auto& worker = g_steal_workers[data];
+        worker.started = ReadTSC();
+        worker.cpu = CurrentCPU();
+        const uint64_t end = worker.started + TSCFrequency() / 1000 * kStealWorkMS;
+        while (ReadTSC() < end) {
+            __asm__("pause");
+        }
+
+        // 起こされてから他のCPUコアに奪われないよう、先に戻しておく
+        g_task_manager->SetAffinity(task_id, 1u << 0);
+        __atomic_store_n(&worker.parked, true, __ATOMIC_RELEASE);
+        g_task_manager->Sleep(task_id);
+        g_task_manager->Finish(0);
+    }
+
+    /// 少なくともticksだけ眠り、BSPの他のタスクに譲る
+    void SleepTicks(unsigned long ticks) {
+        Task& task = g_task_manager->CurrentTask();
+        const unsigned long deadline = g_timer_manager->CurrentTick() + ticks;
+        auto [timer_id, err] = g_timer_manager->AddTimer(Timer::WakeupTimer(deadline, task.ID()));
+        if (err) {
+            return;
+        }
+        while (g_timer_manager->CurrentTick() < deadline) {
+            g_task_manager->SleepIfBefore(&task, deadline);
+        }
+        g_timer_manager->CancelTimer(timer_id);
+    }
+
+    /// すべてのCPUコアで実行してよい計算だけのタスクをBSPに並べ、実行され始めるまでの遅れを測る
+    /// 空いているAPがワークスティーリングで奪えば遅れが縮み、migratedに奪われた数が出る
+    KernelBenchResult BenchSteal() {
+        const size_t n = std::min<size_t>(kMaxStealWorkers, 2 * NumCPUs());
+        const uint32_t all_cpus = NumCPUs() < 32 ? (1u << NumCPUs()) - 1 : ~0u;
+        const uint64_t start = ReadTSC();
+        for (size_t i = 0; i < n; ++i) {
+            auto& worker = g_steal_workers[i];
+            worker = {};
+            Task& task = g_task_manager->NewTask()
+                             .InitContext(TaskStealWorker, i)
+                             .MarkSMPSafe()
+                             .SetAffinity(all_cpus);
+            worker.task_id = task.ID();
+            worker.woken = ReadTSC();
+            task.Wakeup();
+        }
+
+        Samples samples;
+        uint64_t migrated = 0;
+        for (size_t i = 0; i < n; ++i) {
+            auto& worker = g_steal_workers[i];
+            while (!__atomic_load_n(&worker.parked, __ATOMIC_ACQUIRE)) {
+                SleepTicks(1);
+            }
+            samples[i] = worker.started - worker.woken;
+            if (worker.cpu != 0) {
+                migrated++;
+            }
+        }
+        const uint64_t total = ReadTSC() - start;
+
+        // 眠り終えて（元のCPUコアでコンテキストを保存し終えて）から、BSPへ移して起こす
+        // 眠る前に起こしても無視されて、二度と起きなくなる
+        for (size_t i = 0; i < n; ++i) {
+            const uint64_t id = g_steal_workers[i].task_id;
+            Task* task = g_task_manager->FindTask(id);
+            while (task->Running() || !g_task_manager->MoveTask(task, 0)) {
+                SleepTicks(1);
+            }
+            g_task_manager->Wakeup(task);
+            g_task_manager->WaitFinish(id);
+        }
+
+        auto result = Summarize("task_steal", samples, n, total);
+        result.migrated = migrated;
+        return result;
+    }
+
+    struct Bench {
+        const char* name;
+        KernelBenchResult (*func)();
+    };
+
+    const std::array<Bench, 7> kBenches{{
+        {"frame_alloc", BenchFrameAlloc},
+        {"page_map", BenchPageMap},
+        {"message", BenchMessage},
+        {"ctx_switch_rt", BenchContextSwitch},
+        {"pipe_read", BenchPipe},
+        {"composite_full", BenchComposite},
+        {"task_steal", BenchSteal},
+    }};
+
+    struct BenchRequest {
+        const char* name;
+        KernelBenchResult* results;
+        size_t max;
+        size_t num_results;
+    };
+
+    /// メッセージを使うベンチマークがあるので、呼び出し元のタスクとは別のタスクで測る
+    void TaskKernelBench(uint64_t task_id, int64_t data) {
+        auto req = reinterpret_cast<BenchRequest*>(data);
+        for (const auto& bench : kBenches) {
+            if (req->num_results == req->max) {
+                break;
+            }
+            if (req->name == nullptr || strcmp(req->name, bench.name) == 0) {
+                req->results[req->num_results++] = bench.func();
+            }
+        }
+        g_task_manager->Finish(0);
+    }
+} // namespace
+
+size_t RunKernelBench(const char* name, KernelBenchResult* results, size_t max) {
+    BenchRequest req{name, results, max, 0};
+    const uint64_t task_id = g_task_manager->NewTask()
+                                 .InitContext(TaskKernelBench, reinterpret_cast<int64_t>(&req))
+                                 .Wakeup()
+                                 .ID();
+    g_task_manager->WaitFinish(task_id);
+    return req.num_results;
+}
+
+const char* KernelBenchName(size_t i) {
+    return i < kBenches.size() ? kBenches[i].name : nullptr;
+}
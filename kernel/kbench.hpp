@@ -0,0 +1,27 @@
+/// カーネルの中で動かすマイクロベンチマーク（ターミナルのbenchコマンド）
+/// キャッシュしないフレームバッファやTLB、MMIOのように、実機でしか分からないコストを測る
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/// 1つのベンチマークの結果。時間はすべてTSCのカウント
+struct KernelBenchResult {
+    const char* name;
+    /// 測った回数
+    size_t samples;
+    uint64_t min, p50, p90, p99, max;
+    /// 全体にかかった時間
+    uint64_t total_cycles;
+    /// 受け渡したバイト数（スループットを測るものだけ。それ以外は0）
+    uint64_t bytes;
+    /// 他のCPUコアに奪われて実行されたタスク数（タスクの移動を測るものだけ。それ以外は0）
+    uint64_t migrated;
+};
+
+/// nameのベンチマーク（nullptrならすべて）を専用のタスクで実行し、終わるまで待つ
+/// 結果を最大max個resultsに詰め、その数を返す。知らない名前なら0
+size_t RunKernelBench(const char* name, KernelBenchResult* results, size_t max);
+/// ベンチマークの名前を列挙する（i番目がなければnullptr）
+const char* KernelBenchName(size_t i);
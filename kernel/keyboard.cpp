@@ -2,6 +2,7 @@
 
 #include <memory>
 
+#include "layer.hpp"
 #include "task.hpp"
 #include "usb/classdriver/keyboard.hpp"
 
@@ -64,7 +65,12 @@ void InitializeKeyboard() {
         msg.arg.keyboard.keycode = keycode;
         msg.arg.keyboard.ascii = ascii;
         msg.arg.keyboard.press = press;
-        // メインタスクに割り込みを通知
-        g_task_manager->SendMessage(kMainTaskID, msg);
+        // アクティブなウィンドウのタスクに直接届ける。F2（ターミナルの起動）と、
+        // 届け先のないとき（メインタスクのウィンドウなど）はメインタスクが処理する
+        const uint64_t focus = g_active_layer->FocusTask();
+        const bool for_main = press && keycode == 59 /* F2 */;
+        if (focus == 0 || for_main || g_task_manager->SendMessage(focus, msg)) {
+            g_task_manager->SendMessage(kMainTaskID, msg);
+        }
     };
 }
\ No newline at end of file
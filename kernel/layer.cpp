@@ -1,10 +1,13 @@
 #include "layer.hpp"
 
 #include <algorithm>
+#include <array>
 
 #include "console.hpp"
 #include "logger.hpp"
 #include "task.hpp"
+#include "timer.hpp"
+#include "trace.hpp"
 
 namespace {
     template <class T, class U>
@@ -12,10 +15,60 @@ namespace {
         auto it = std::remove_if(c.begin(), c.end(), pred);
         c.erase(it, c.end());
     }
+
+    SlabCache g_layer_cache{"Layer", sizeof(Layer)};
+
+    /// ためておく再描画領域の上限。超えたらすべてを囲む1つの矩形にする
+    const size_t kMaxDamageRects = 16;
+
+    bool IsEmpty(const Rectangle<int>& r) {
+        return r.size.x <= 0 || r.size.y <= 0;
+    }
+
+    /// 面積をもって重なるか（辺が接するだけなら重ならない）
+    bool Overlaps(const Rectangle<int>& a, const Rectangle<int>& b) {
+        return a.pos.x < b.pos.x + b.size.x && b.pos.x < a.pos.x + a.size.x &&
+               a.pos.y < b.pos.y + b.size.y && b.pos.y < a.pos.y + a.size.y;
+    }
+
+    /// レイヤーのウィンドウが不透明で、areaをすべて覆っているか
+    bool CoversOpaquely(const Layer& layer, const Rectangle<int>& area) {
+        const auto window = layer.GetWindow();
+        if (!window || !window->IsOpaque()) {
+            return false;
+        }
+        const auto pos = layer.GetPosition();
+        const auto end = pos + window->Size();
+        const auto area_end = area.pos + area.size;
+        return pos.x <= area.pos.x && pos.y <= area.pos.y &&
+               area_end.x <= end.x && area_end.y <= end.y;
+    }
+
+    /// レイヤーのウィンドウがareaと重なるか
+    bool Intersects(const Layer& layer, const Rectangle<int>& area) {
+        const auto window = layer.GetWindow();
+        return window && Overlaps({layer.GetPosition(), window->Size()}, area);
+    }
 } // namespace
 
 Layer::Layer(unsigned int id) : id_{id} {}
 
+void* Layer::operator new(size_t size) {
+    // スラブを増やせなくても、nullptrを返すとコンストラクタがそこに書き込んでしまうので、ヒープから確保する
+    if (void* p = g_layer_cache.Allocate()) {
+        return p;
+    }
+    return ::operator new(size);
+}
+
+void Layer::operator delete(void* p) {
+    if (g_layer_cache.Owns(p)) {
+        g_layer_cache.Free(p);
+    } else {
+        ::operator delete(p);
+    }
+}
+
 unsigned int Layer::ID() const {
     return id_;
 }
@@ -65,15 +118,26 @@ void LayerManager::SetScreen(FrameBuffer* screen) {
     FrameBufferConfig back_config = screen->Config();
     back_config.frame_buffer = nullptr;
     back_buffer_.Initailize(back_config);
+
+    tile_columns_ = (back_config.horizontal_resolution + kTileSize - 1) / kTileSize;
+    tile_rows_ = (back_config.vertical_resolution + kTileSize - 1) / kTileSize;
+    tiles_.assign(tile_columns_ * tile_rows_, {});
+    for (auto layer : layer_stack_) {
+        layer->indexed_area_ = {};
+        IndexLayer(layer);
+    }
 }
 
 Layer& LayerManager::NewLayer() {
     latest_id_++;
-    return *layers_.emplace_back(new Layer{latest_id_});
+    auto& layer = *layers_.emplace_back(new Layer{latest_id_});
+    layer_map_[latest_id_] = &layer;
+    return layer;
 }
 
 void LayerManager::RemoveLayer(unsigned int id) {
     Hide(id);
+    layer_map_.erase(id);
 
     auto pred = [id](const std::unique_ptr<Layer>& elem) {
         return elem->ID() == id;
@@ -82,10 +146,8 @@ void LayerManager::RemoveLayer(unsigned int id) {
 }
 
 void LayerManager::Draw(const Rectangle<int>& area) const {
-    for (auto layer : layer_stack_) {
-        layer->DrawTo(back_buffer_, area);
-    }
-    screen_->Copy(area.pos, back_buffer_, area);
+    AddDamage(area);
+    FlushIfNotDeferred();
 }
 
 void LayerManager::Draw(unsigned int id) const {
@@ -94,25 +156,134 @@ void LayerManager::Draw(unsigned int id) const {
 }
 
 void LayerManager::Draw(unsigned int id, Rectangle<int> area) const {
-    bool draw = false;
-    Rectangle<int> window_area;
-    for (auto layer : layer_stack_) {
-        // 再描画されたレイヤーより前面のレイヤーはすべて再描画
-        if (layer->ID() == id) {
-            window_area.size = layer->GetWindow()->Size();
-            window_area.pos = layer->GetPosition();
-            if (area.size.x >= 0 || area.size.y >= 0) {
-                // areaはウィンドウの左上を基準とした座標、window_areaはフレームバッファの左上を基準とした座標なので座標系を合わせる
-                area.pos = area.pos + window_area.pos;
-                window_area = window_area & area;
+    auto it = layer_map_.find(id);
+    if (it != layer_map_.end() && it->second->height_ >= 0) {
+        const Layer* layer = it->second;
+        Rectangle<int> window_area{layer->GetPosition(), layer->GetWindow()->Size()};
+        if (area.size.x >= 0 || area.size.y >= 0) {
+            // areaはウィンドウの左上を基準とした座標、window_areaはフレームバッファの左上を基準とした座標なので座標系を合わせる
+            area.pos = area.pos + window_area.pos;
+            window_area = window_area & area;
+        }
+        // 前面のレイヤーも含めて、合成するときにまとめて描く
+        AddDamage(window_area);
+    }
+    FlushIfNotDeferred();
+}
+
+void LayerManager::SetDeferDraw(bool defer) {
+    defer_draw_ = defer;
+    FlushIfNotDeferred();
+}
+
+void LayerManager::Flush() const {
+    for (const auto& area : damage_) {
+        // areaをすべて覆う不透明なレイヤーより下は見えないので描かない
+        size_t first = 0;
+        for (size_t i = layer_stack_.size(); i-- > 0;) {
+            if (CoversOpaquely(*layer_stack_[i], area)) {
+                first = i;
+                break;
+            }
+        }
+        for (size_t i = first; i < layer_stack_.size(); i++) {
+            // カーソルはバックバッファには描かない（カーソルの下の絵として残しておく）
+            if (layer_stack_[i] != cursor_layer_ && Intersects(*layer_stack_[i], area)) {
+                layer_stack_[i]->DrawTo(back_buffer_, area);
             }
-            draw = true;
         }
-        if (draw) {
-            layer->DrawTo(back_buffer_, window_area);
+        CopyToScreen(area);
+    }
+    damage_.clear();
+}
+
+void LayerManager::SetCursorLayer(unsigned int id) {
+    cursor_layer_ = FindLayer(id);
+    // カーソルは毎回の移動で索引を更新しなくて済むよう、索引に入れずに別に調べる
+    UnindexLayer(cursor_layer_);
+    const auto size = cursor_layer_->GetWindow()->Size();
+    FrameBufferConfig config = screen_->Config();
+    config.frame_buffer = nullptr;
+    config.horizontal_resolution = size.x;
+    config.vertical_resolution = size.y;
+    if (auto err = cursor_buffer_.Initailize(config)) {
+        Log(kError, "failed to initialize cursor buffer: %s\n", err.Name());
+        cursor_layer_ = nullptr;
+    }
+}
+
+std::optional<Rectangle<int>> LayerManager::CursorArea() const {
+    if (cursor_layer_ == nullptr || cursor_layer_->height_ < 0) {
+        return std::nullopt;
+    }
+    return Rectangle<int>{cursor_layer_->GetPosition(), cursor_layer_->GetWindow()->Size()};
+}
+
+void LayerManager::CopyToScreen(const Rectangle<int>& area) const {
+    const auto cursor_area = CursorArea();
+    const auto c = cursor_area ? area & *cursor_area : Rectangle<int>{};
+    if (IsEmpty(c)) {
+        screen_->Copy(area.pos, back_buffer_, area);
+        return;
+    }
+
+    // カーソルと重なる部分を除いた上下左右の4つを、バックバッファからそのまま写す
+    // （一度カーソルなしで写してから重ねると、その間カーソルが消えて見える）
+    const auto area_end = area.pos + area.size;
+    const auto c_end = c.pos + c.size;
+    const Rectangle<int> rest[] = {
+        {area.pos, {area.size.x, c.pos.y - area.pos.y}},
+        {{area.pos.x, c_end.y}, {area.size.x, area_end.y - c_end.y}},
+        {{area.pos.x, c.pos.y}, {c.pos.x - area.pos.x, c.size.y}},
+        {{c_end.x, c.pos.y}, {area_end.x - c_end.x, c.size.y}},
+    };
+    for (const auto& r : rest) {
+        if (!IsEmpty(r)) {
+            screen_->Copy(r.pos, back_buffer_, r);
+        }
+    }
+
+    // 重なる部分は、カーソルの下の絵にカーソルを重ねてから写す
+    const auto offset = cursor_area->pos;
+    cursor_buffer_.Copy(c.pos - offset, back_buffer_, c);
+    cursor_layer_->GetWindow()->DrawTo(cursor_buffer_, {0, 0}, {c.pos - offset, c.size});
+    screen_->Copy(c.pos, cursor_buffer_, {c.pos - offset, c.size});
+}
+
+void LayerManager::AddDamage(Rectangle<int> area) const {
+    const auto& config = screen_->Config();
+    const Rectangle<int> screen_area{{0, 0},
+                                     {static_cast<int>(config.horizontal_resolution),
+                                      static_cast<int>(config.vertical_resolution)}};
+    area = area & screen_area;
+    if (IsEmpty(area)) {
+        return;
+    }
+
+    // 重なる領域を取り込んで広がると、別の領域と重なるようになることがあるので、重ならなくなるまで繰り返す
+    for (size_t i = 0; i < damage_.size();) {
+        if (Overlaps(damage_[i], area)) {
+            area = area | damage_[i];
+            damage_.erase(damage_.begin() + i);
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+
+    if (damage_.size() >= kMaxDamageRects) {
+        for (const auto& r : damage_) {
+            area = area | r;
         }
+        damage_.clear();
+    }
+    damage_.push_back(area);
+}
+
+void LayerManager::FlushIfNotDeferred() const {
+    if (!defer_draw_) {
+        Flush();
     }
-    screen_->Copy(window_area.pos, back_buffer_, window_area);
 }
 
 void LayerManager::Move(unsigned int id, Vector2D<int> new_position) {
@@ -120,7 +291,26 @@ void LayerManager::Move(unsigned int id, Vector2D<int> new_position) {
     const auto window_size = layer->GetWindow()->Size();
     const auto old_pos = layer->GetPosition();
     layer->Move(new_position);
-    Draw({old_pos, window_size});
+    if (layer == cursor_layer_) {
+        // 合成は待たずに、元の位置をカーソルの下の絵に戻して新しい位置に描く
+        // 重なっていれば1回で写す
+        const Rectangle<int> old_area{old_pos, window_size}, new_area{new_position, window_size};
+        const auto& config = screen_->Config();
+        const Rectangle<int> screen_area{{0, 0},
+                                         {static_cast<int>(config.horizontal_resolution),
+                                          static_cast<int>(config.vertical_resolution)}};
+        if (Overlaps(old_area, new_area)) {
+            CopyToScreen((old_area | new_area) & screen_area);
+        } else {
+            CopyToScreen(old_area & screen_area);
+            CopyToScreen(new_area & screen_area);
+        }
+        return;
+    }
+    UnindexLayer(layer);
+    IndexLayer(layer);
+    // 移動元と移動先が重なっていれば1回の合成で済む
+    AddDamage({old_pos, window_size});
     Draw(id);
 }
 
@@ -129,7 +319,9 @@ void LayerManager::MoveRelative(unsigned int id, Vector2D<int> pos_diff) {
     const auto window_size = layer->GetWindow()->Size();
     const auto old_pos = layer->GetPosition();
     layer->MoveRelative(pos_diff);
-    Draw({old_pos, window_size});
+    UnindexLayer(layer);
+    IndexLayer(layer);
+    AddDamage({old_pos, window_size});
     Draw(id);
 }
 
@@ -144,31 +336,42 @@ void LayerManager::UpDown(unsigned int id, int new_height) {
     }
 
     auto layer = FindLayer(id);
-    auto old_pos = std::find(layer_stack_.begin(), layer_stack_.end(), layer);
+    UnindexLayer(layer);
+    const int old_height = layer->height_;
     auto new_pos = layer_stack_.begin() + new_height;
 
-    if (old_pos == layer_stack_.end()) {
+    if (old_height < 0) {
         layer_stack_.insert(new_pos, layer);
+        UpdateHeights(new_height);
+        IndexLayer(layer);
         return;
     }
 
     if (new_pos == layer_stack_.end()) {
         new_pos--;
+        new_height--;
     }
-    layer_stack_.erase(old_pos);
-    layer_stack_.insert(new_pos, layer);
+    layer_stack_.erase(layer_stack_.begin() + old_height);
+    layer_stack_.insert(layer_stack_.begin() + new_height, layer);
+    UpdateHeights(std::min(old_height, new_height));
+    // 他のレイヤーどうしの前後は変わらないので、タイルの一覧はこのレイヤーを入れ直すだけで並んだままになる
+    IndexLayer(layer);
 }
 
 void LayerManager::Hide(unsigned int id) {
     auto layer = FindLayer(id);
-    auto pos = std::find(layer_stack_.begin(), layer_stack_.end(), layer);
-    if (pos != layer_stack_.end()) {
-        layer_stack_.erase(pos);
+    if (layer == nullptr || layer->height_ < 0) {
+        return;
     }
+    UnindexLayer(layer);
+    const int height = layer->height_;
+    layer_stack_.erase(layer_stack_.begin() + height);
+    layer->height_ = -1;
+    UpdateHeights(height);
 }
 
 Layer* LayerManager::FindLayerByPosition(Vector2D<int> pos, unsigned int exclude_id) const {
-    auto pred = [pos, exclude_id](Layer* layer) {
+    auto pred = [pos, exclude_id](const Layer* layer) {
         if (layer->ID() == exclude_id) {
             return false;
         }
@@ -183,32 +386,89 @@ Layer* LayerManager::FindLayerByPosition(Vector2D<int> pos, unsigned int exclude
                win_pos.y <= pos.y && pos.y < win_end_pos.y;
     };
 
-    // find back
-    auto it = std::find_if(layer_stack_.rbegin(), layer_stack_.rend(), pred);
-    if (it == layer_stack_.rend()) {
-        return nullptr;
+    if (pos.x < 0 || pos.y < 0 || pos.x >= tile_columns_ * kTileSize || pos.y >= tile_rows_ * kTileSize) {
+        // 画面外は索引にないので、前面から順に調べる
+        auto it = std::find_if(layer_stack_.rbegin(), layer_stack_.rend(), pred);
+        if (it == layer_stack_.rend()) {
+            return nullptr;
+        }
+        return *it;
+    }
+
+    Layer* found = nullptr;
+    for (auto layer : tiles_[(pos.y / kTileSize) * tile_columns_ + pos.x / kTileSize]) {
+        if (pred(layer)) {
+            found = layer;
+            break;
+        }
     }
-    return *it;
+    // 索引にないカーソルの面の方が前面にあればそちらを返す
+    if (cursor_layer_ && cursor_layer_->height_ >= 0 && pred(cursor_layer_) &&
+        (found == nullptr || found->height_ < cursor_layer_->height_)) {
+        found = cursor_layer_;
+    }
+    return found;
 }
 
 Layer* LayerManager::FindLayer(unsigned int id) {
-    auto pred = [id](const std::unique_ptr<Layer>& elem) {
-        return elem->ID() == id;
-    };
-    auto it = std::find_if(layers_.begin(), layers_.end(), pred);
-    if (it == layers_.end()) {
+    auto it = layer_map_.find(id);
+    if (it == layer_map_.end()) {
         return nullptr;
     }
-    return it->get();
+    return it->second;
 }
 
 int LayerManager::GetHeight(unsigned int id) {
-    for (int h = 0; h < layer_stack_.size(); h++) {
-        if (layer_stack_[h]->ID() == id) {
-            return h;
+    auto layer = FindLayer(id);
+    return layer ? layer->height_ : -1;
+}
+
+void LayerManager::UpdateHeights(size_t first) {
+    for (size_t h = first; h < layer_stack_.size(); h++) {
+        layer_stack_[h]->height_ = h;
+    }
+}
+
+void LayerManager::IndexLayer(Layer* layer) {
+    const auto window = layer->GetWindow();
+    if (layer->height_ < 0 || layer == cursor_layer_ || !window || tiles_.empty()) {
+        return;
+    }
+    const Rectangle<int> grid_area{{0, 0}, {tile_columns_ * kTileSize, tile_rows_ * kTileSize}};
+    const auto area = Rectangle<int>{layer->GetPosition(), window->Size()} & grid_area;
+    if (IsEmpty(area)) {
+        return;
+    }
+    layer->indexed_area_ = area;
+
+    const int x_end = (area.pos.x + area.size.x - 1) / kTileSize;
+    const int y_end = (area.pos.y + area.size.y - 1) / kTileSize;
+    for (int ty = area.pos.y / kTileSize; ty <= y_end; ty++) {
+        for (int tx = area.pos.x / kTileSize; tx <= x_end; tx++) {
+            auto& tile = tiles_[ty * tile_columns_ + tx];
+            auto it = std::find_if(tile.begin(), tile.end(), [layer](const Layer* l) {
+                return l->height_ < layer->height_;
+            });
+            tile.insert(it, layer);
+        }
+    }
+}
+
+void LayerManager::UnindexLayer(Layer* layer) {
+    const auto area = layer->indexed_area_;
+    if (IsEmpty(area)) {
+        return;
+    }
+    layer->indexed_area_ = {};
+
+    const int x_end = (area.pos.x + area.size.x - 1) / kTileSize;
+    const int y_end = (area.pos.y + area.size.y - 1) / kTileSize;
+    for (int ty = area.pos.y / kTileSize; ty <= y_end; ty++) {
+        for (int tx = area.pos.x / kTileSize; tx <= x_end; tx++) {
+            auto& tile = tiles_[ty * tile_columns_ + tx];
+            tile.erase(std::find(tile.begin(), tile.end(), layer));
         }
     }
-    return -1;
 }
 
 namespace {
@@ -261,10 +521,20 @@ void ActiveLayer::Activate(unsigned int layer_id) {
         manager_.Draw(active_layer_);
         SendWindowActiveMessage(active_layer_, 1);
     }
+    UpdateFocus();
+}
+
+void ActiveLayer::UpdateFocus() {
+    uint64_t task_id = 0;
+    if (auto it = g_layer_task_map->find(active_layer_); it != g_layer_task_map->end()) {
+        task_id = it->second;
+    }
+    __atomic_store_n(&focus_task_, task_id, __ATOMIC_RELEASE);
 }
 
 ActiveLayer* g_active_layer;
 std::map<unsigned int, uint64_t>* g_layer_task_map;
+Mutex g_layer_mutex;
 
 void InitializeLayer() {
     const auto screen_size = ScreenSize();
@@ -307,6 +577,7 @@ void InitializeLayer() {
 
 void ProcessLayerMessage(const Message& msg) {
     const auto& arg = msg.arg.layer;
+    Trace(TraceEvent::kLayer, static_cast<uint32_t>(arg.op), arg.layer_id);
     switch (arg.op) {
     case LayerOperation::Move:
         g_layer_manager->Move(arg.layer_id, {arg.x, arg.y});
@@ -326,7 +597,155 @@ void ProcessLayerMessage(const Message& msg) {
     }
 }
 
+namespace {
+    bool IsLayerDrawMessage(const Message& msg) {
+        return msg.type == Message::kLayer &&
+               (msg.arg.layer.op == LayerOperation::Draw || msg.arg.layer.op == LayerOperation::DrawArea);
+    }
+
+    /// srcの描画領域をdstに合わせる。どちらかが全体描画なら全体描画にする
+    void MergeLayerDraw(Message& dst, const Message& src) {
+        auto& d = dst.arg.layer;
+        const auto& s = src.arg.layer;
+        if (d.op == LayerOperation::Draw || s.op == LayerOperation::Draw) {
+            d.op = LayerOperation::Draw;
+            return;
+        }
+        const auto area = Rectangle<int>{{d.x, d.y}, {d.w, d.h}} | Rectangle<int>{{s.x, s.y}, {s.w, s.h}};
+        d.x = area.pos.x;
+        d.y = area.pos.y;
+        d.w = area.size.x;
+        d.h = area.size.y;
+    }
+} // namespace
+
+size_t CoalesceLayerMessages(Message* msgs, size_t len) {
+    size_t num_out = 0;
+    for (size_t i = 0; i < len; i++) {
+        const Message& msg = msgs[i];
+        bool merged = false;
+        if (IsLayerDrawMessage(msg)) {
+            // 詰め終えた中から、同じレイヤへの直近の要求を探す
+            for (size_t j = num_out; j-- > 0;) {
+                Message& prev = msgs[j];
+                if (prev.type != Message::kLayer || prev.arg.layer.layer_id != msg.arg.layer.layer_id) {
+                    continue;
+                }
+                if (IsLayerDrawMessage(prev) && prev.src_task == msg.src_task) {
+                    MergeLayerDraw(prev, msg);
+                    merged = true;
+                }
+                break;
+            }
+        }
+        if (!merged) {
+            msgs[num_out++] = msg;
+        }
+    }
+    return num_out;
+}
+
+uint64_t g_compositor_task_id;
+
+namespace {
+    /// 合成タスクのフレームの周期タイマの値
+    const int kCompositorFrameTimer = 1;
+    const unsigned long kCompositorFrameTicks = kTimerFreq / kCompositorFPS;
+
+    /// g_layer_mutexで保護する
+    CompositorStats g_compositor_stats{};
+
+    /// 画面に出したフレームの番号。g_layer_mutexを持ってg_frame_lockで保護する（読むだけならどちらか一方でよい）
+    uint64_t g_presented_frame = 0;
+    SpinLock g_frame_lock;
+    /// g_presented_frameが進むのを待つタスク
+    WaitQueue g_frame_waiters;
+
+    void TaskCompositor(uint64_t task_id, int64_t data) {
+        Task& task = g_task_manager->CurrentTask();
+        g_timer_manager->AddTimer(Timer{g_timer_manager->CurrentTick() + kCompositorFrameTicks,
+                                        kCompositorFrameTimer, task_id, kCompositorFrameTicks});
+
+        std::array<Message, 32> msgs;
+        while (true) {
+            size_t num_msgs = task.WaitMessages(msgs.data(), msgs.size());
+            MutexGuard lock{g_layer_mutex};
+            num_msgs = CoalesceLayerMessages(msgs.data(), num_msgs);
+
+            bool frame = false;
+            for (size_t i = 0; i < num_msgs; i++) {
+                const Message& msg = msgs[i];
+                if (msg.type == Message::kLayer) {
+                    ProcessLayerMessage(msg);
+                } else if (msg.type == Message::kTimerTimeout && msg.arg.timer.value == kCompositorFrameTimer) {
+                    frame = true;
+                }
+            }
+            if (!frame) {
+                continue;
+            }
+
+            if (const auto num_rects = g_layer_manager->NumDamageRects(); num_rects > 0) {
+                const auto start = g_timer_manager->CurrentTick();
+                g_layer_manager->Flush();
+                const auto elapsed = g_timer_manager->CurrentTick() - start;
+
+                auto& stats = g_compositor_stats;
+                stats.frames++;
+                stats.rects += num_rects;
+                stats.total_ticks += elapsed;
+                stats.max_ticks = std::max(stats.max_ticks, elapsed);
+                stats.last_ticks = elapsed;
+
+                SpinLockGuard frame_lock{g_frame_lock};
+                g_presented_frame++;
+                g_frame_waiters.WakeAll();
+            }
+        }
+    }
+} // namespace
+
+void StartCompositor() {
+    {
+        MutexGuard lock{g_layer_mutex};
+        g_layer_manager->SetDeferDraw(true);
+    }
+    g_compositor_task_id = g_task_manager->NewTask()
+                               .InitContext(TaskCompositor, 0)
+                               .Wakeup()
+                               .ID();
+}
+
+Error SendLayerMessage(const Message& msg) {
+    return g_task_manager->SendMessage(g_compositor_task_id ? g_compositor_task_id : kMainTaskID, msg);
+}
+
+CompositorStats GetCompositorStats() {
+    MutexGuard lock{g_layer_mutex};
+    return g_compositor_stats;
+}
+
+uint64_t WaitFramePresented() {
+    uint64_t target;
+    {
+        MutexGuard lock{g_layer_mutex};
+        // 合成タスクがなければ描画はその場で画面に出ている。再描画領域がなければ、描いたものはもう出ている
+        if (g_compositor_task_id == 0 || g_layer_manager->NumDamageRects() == 0) {
+            return g_presented_frame;
+        }
+        // 再描画領域をためた後に始まるフレームは、いま溜まっている領域をすべて描く
+        target = g_presented_frame + 1;
+    }
+
+    SpinLockGuard lock{g_frame_lock};
+    while (g_presented_frame < target) {
+        g_frame_waiters.Wait(g_frame_lock);
+    }
+    return g_presented_frame;
+}
+
 Error CloseLayer(unsigned int layer_id) {
+    MutexGuard lock{g_layer_mutex};
     Layer* layer = g_layer_manager->FindLayer(layer_id);
     if (layer == nullptr) {
         return MAKE_ERROR(Error::kNoSuchEntry);
@@ -335,12 +754,11 @@ Error CloseLayer(unsigned int layer_id) {
     const auto pos = layer->GetPosition();
     const auto size = layer->GetWindow()->Size();
 
-    __asm__("cli");
     g_active_layer->Activate(0);
     g_layer_manager->RemoveLayer(layer_id);
     g_layer_manager->Draw({pos, size});
     g_layer_task_map->erase(layer_id);
-    __asm__("sti");
+    g_active_layer->UpdateFocus();
 
     return MAKE_ERROR(Error::kSuccess);
 }
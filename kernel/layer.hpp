@@ -4,10 +4,14 @@
 
 #include <map>
 #include <memory>
+#include <optional>
+#include <unordered_map>
 #include <vector>
 
 #include "graphics.hpp"
 #include "message.hpp"
+#include "slab.hpp"
+#include "sync.hpp"
 #include "window.hpp"
 
 /// 1つの描画層
@@ -17,6 +21,9 @@ class Layer {
 public:
     /// 指定IDを持つレイヤーを生成
     Layer(unsigned int id = 0);
+    /// Layerはスラブキャッシュから確保する（スラブを増やせなければヒープから）
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
     unsigned int ID() const;
 
     /// 既存のウィンドウはこのレイヤーから外れる
@@ -37,7 +44,14 @@ public:
     void DrawTo(FrameBuffer& screen, const Rectangle<int>& area) const;
 
 private:
+    /// 重ね順と位置の索引はLayerManagerが管理する
+    friend class LayerManager;
+
     unsigned int id_;
+    /// layer_stack_での位置。非表示なら-1
+    int height_{-1};
+    /// 位置の索引に登録した範囲（画面座標）。登録していなければ空
+    Rectangle<int> indexed_area_{};
     /// 原点座標
     Vector2D<int> pos_{};
     std::shared_ptr<Window> window_{};
@@ -63,6 +77,18 @@ public:
     /// 指定レイヤーに設定されているウィンドウの指定描画領域内を描画
     /// area : ウィンドウの左上の基準とした座標
     void Draw(unsigned int id, Rectangle<int> area) const;
+    /// trueの間はDraw系の描画要求を再描画領域としてためるだけにし、Flush()でまとめて描く
+    /// falseに戻すとたまっている分をすぐに描く
+    void SetDeferDraw(bool defer);
+    /// たまっている再描画領域を、重なるものどうしまとめてから1つずつ合成して画面に写す
+    void Flush() const;
+    /// たまっている再描画領域の数
+    size_t NumDamageRects() const { return damage_.size(); }
+
+    /// 指定レイヤーをマウスカーソルの面にする
+    /// カーソルは他のレイヤーと合成せず、合成済みのバックバッファ（カーソルの下の絵）にその都度重ねて画面に写す
+    /// そのため移動は、元の位置をバックバッファから戻して新しい位置に描くだけで済み、合成を待たずにすぐ描く
+    void SetCursorLayer(unsigned int id);
 
     /// 例親ーの位置情報を指定の絶対座標へと更新。再描画。
     void Move(unsigned int id, Vector2D<int> new_position);
@@ -77,6 +103,7 @@ public:
     void Hide(unsigned int id);
 
     /// 指定座標にウィンドウをもつ最前面のレイヤーを取得
+    /// 画面内の座標なら、その座標を含むタイルに重なるレイヤーだけを調べる
     Layer* FindLayerByPosition(Vector2D<int> pos, unsigned int exclude_id) const;
     /// 指定IDのレイヤーを返す
     Layer* FindLayer(unsigned int id);
@@ -84,6 +111,24 @@ public:
     int GetHeight(unsigned int id);
 
 private:
+    /// 再描画領域（画面座標）を追加する。重なる領域とは1つの矩形にまとめる
+    void AddDamage(Rectangle<int> area) const;
+    /// 描画を遅らせていなければ、たまっている再描画領域を描く
+    void FlushIfNotDeferred() const;
+    /// バックバッファのarea（画面座標）を画面に写す。カーソルと重なる部分はカーソルを重ねてから写す
+    void CopyToScreen(const Rectangle<int>& area) const;
+    /// カーソルの面を表示していれば、その画面上の範囲を返す
+    std::optional<Rectangle<int>> CursorArea() const;
+    /// layer_stack_のfirst番目以降のレイヤーの階層を付け直す
+    void UpdateHeights(size_t first);
+    /// 表示中のレイヤーを、ウィンドウと重なる各タイルの一覧に重ね順を保って加える（カーソルの面は除く）
+    void IndexLayer(Layer* layer);
+    /// IndexLayer()で加えたタイルの一覧からレイヤーを除く
+    void UnindexLayer(Layer* layer);
+
+    /// 位置の索引のタイルの一辺（ピクセル）
+    static const int kTileSize = 64;
+
     FrameBuffer* screen_{nullptr};
     /// ダブルバッファリング用
     /// mutable修飾子はconstメソッド内からでも変更可能
@@ -92,7 +137,19 @@ private:
     std::vector<std::unique_ptr<Layer>> layers_{};
     /// 配列の先頭を再背面、末尾を最前面とする。非表示レイヤは含まない
     std::vector<Layer*> layer_stack_{};
+    /// IDからレイヤーを引く
+    std::unordered_map<unsigned int, Layer*> layer_map_{};
+    /// 画面をkTileSize四方に区切ったタイルごとの、ウィンドウが重なるレイヤー（前面のものが先）
+    std::vector<std::vector<Layer*>> tiles_{};
+    int tile_columns_{0}, tile_rows_{0};
     unsigned int latest_id_{0};
+    /// まだ描いていない再描画領域。どの2つも重ならない
+    mutable std::vector<Rectangle<int>> damage_{};
+    bool defer_draw_{false};
+    /// マウスカーソルの面（SetCursorLayer()を参照）
+    Layer* cursor_layer_{nullptr};
+    /// カーソルの下の絵にカーソルを重ねる作業用の領域（カーソルと同じ大きさ）
+    mutable FrameBuffer cursor_buffer_{};
 };
 
 class ActiveLayer {
@@ -103,6 +160,12 @@ public:
     void Activate(unsigned int layer_id);
     /// アクティブ状態のレイヤIDを返す
     unsigned int GetActive() const { return active_layer_; }
+    /// キー入力を直接届けるタスク（アクティブなレイヤのタスク）。0ならメインタスクが振り分ける
+    /// キーボードのドライバからロックなしで読む
+    uint64_t FocusTask() const { return __atomic_load_n(&focus_task_, __ATOMIC_ACQUIRE); }
+    /// アクティブなレイヤとg_layer_task_mapからFocusTask()を決め直す
+    /// Activate()のほか、アクティブなレイヤのg_layer_task_mapを書き換えたら呼ぶ（g_layer_mutexを持って）
+    void UpdateFocus();
 
 private:
     LayerManager& manager_;
@@ -110,17 +173,54 @@ private:
     unsigned int active_layer_{0};
     /// マウスレイヤを本当の最前面とする
     unsigned int mouse_layer_{0};
+    uint64_t focus_task_{0};
 };
 
 extern LayerManager* g_layer_manager;
 extern ActiveLayer* g_active_layer;
 /// レイヤIDとタスクを関連付ける
 extern std::map<unsigned int, uint64_t>* g_layer_task_map;
+/// g_layer_manager、g_active_layer、g_layer_task_mapを操作するタスクが取る
+/// 描画に時間がかかることがあるので、スピンロックではなくスリープするミューテックスにしている
+/// 割り込みハンドラからは触らないこと
+extern Mutex g_layer_mutex;
 
 /// 背景とコンソールをレイヤー上に構築
 void InitializeLayer();
+
+/// 合成タスクが画面を描き直す最大の回数（1秒あたり）
+const int kCompositorFPS = 60;
+/// 合成タスクのID（StartCompositor()を呼ぶまでは0）
+extern uint64_t g_compositor_task_id;
+/// 合成タスクを起動する
+/// 以降のDraw系の要求は再描画領域をためるだけになり、合成タスクがkCompositorFPSの周期でまとめて描く
+/// レイヤ操作要求メッセージ（kLayer）もこのタスクが受け取る。送信元には何も返さない（描き終わりを知りたければWaitFramePresented()）
+void StartCompositor();
+/// レイヤ操作要求メッセージを合成タスク（起動前はメインタスク）に送る
+Error SendLayerMessage(const Message& msg);
+
+/// 合成タスクの統計（時間はtick）
+struct CompositorStats {
+    /// 画面を描き直したフレームの数
+    uint64_t frames;
+    /// 合成した矩形の数
+    uint64_t rects;
+    /// 合成にかかった時間の合計、最大、直近
+    uint64_t total_ticks;
+    unsigned long max_ticks;
+    unsigned long last_ticks;
+};
+/// 合成タスクの統計の複製を返す。g_layer_mutexを持っていないこと
+CompositorStats GetCompositorStats();
+/// 呼び出しまでに要求した描画が画面に出るまで待ち、それを描いたフレームの番号を返す
+/// フレームの番号は、合成タスクが画面を描き直すたびに1つ進む。g_layer_mutexを持っていないこと
+uint64_t WaitFramePresented();
 /// レイヤ操作要求を実際に処理
 void ProcessLayerMessage(const Message& msg);
+/// 溜まっているメッセージのうち、同じタスクから同じレイヤへの描画要求（Draw, DrawArea）を、
+/// 最初のものの位置で1つの描画（領域は和集合）にまとめて詰め、残ったメッセージの数を返す
+/// 間にそのレイヤの移動要求があれば、順序が変わらないようにそこから先はまとめない
+size_t CoalesceLayerMessages(Message* msgs, size_t len);
 
 /// レイヤ操作要求メッセージを生成
 constexpr Message MakeLayerMessage(uint64_t task_id, unsigned int layer_id, LayerOperation op, const Rectangle<int>& area) {
@@ -2,12 +2,43 @@
 
 #include <cstddef>
 #include <cstdio>
+#include <cstring>
 
+#include "asmfunc.h"
 #include "console.hpp"
+#include "layer.hpp"
+#include "task.hpp"
+#include "timer.hpp"
 
 namespace {
     LogLevel g_log_level = kWarn;
-}
+
+    /// リングバッファの件数（2の冪）
+    const uint64_t kNumLogRecords = 256;
+
+    /// seqが0の間は書き込み中。書き終えたら通し番号 + 1を入れる
+    /// 読み出す側は前後でseqを読み、変わっていなければ途中で上書きされていないと分かる
+    struct LogRecord {
+        uint64_t seq;
+        /// 記録した時点ですでにコンソールに描いた（ログ描画タスクを起動する前のログ）
+        bool shown;
+        LogEntry entry;
+    };
+
+    LogRecord g_log_records[kNumLogRecords];
+    /// 次に記録するログの通し番号。記録する側は全員これを取り合うだけで、ロックは取らない
+    uint64_t g_log_next_seq = 0;
+    /// ログ描画タスクを起動した
+    bool g_log_deferred = false;
+
+    /// 次にコンソールに描くログの通し番号。g_log_render_lockで保護する
+    uint64_t g_log_render_seq = 0;
+    SpinLock g_log_render_lock;
+
+    /// ログ描画タスクの周期タイマの値と周期
+    const int kLogRenderTimer = 1;
+    const unsigned long kLogRenderTicks = kTimerFreq / 20;
+} // namespace
 
 extern Console* g_console;
 
@@ -15,7 +46,7 @@ void SetLogLevel(LogLevel level) {
     g_log_level = level;
 }
 
-int Log(LogLevel level, const char* format, ...) {
+int LogPrint(LogLevel level, const char* format, ...) {
     if (level > g_log_level) {
         return 0;
     }
@@ -26,6 +57,125 @@ int Log(LogLevel level, const char* format, ...) {
     int result = vsprintf(s, format, ap);
     va_end(ap);
 
-    g_console->PutString(s);
+    const bool deferred = __atomic_load_n(&g_log_deferred, __ATOMIC_ACQUIRE);
+    const uint64_t seq = __atomic_fetch_add(&g_log_next_seq, 1, __ATOMIC_RELAXED);
+    LogRecord& rec = g_log_records[seq % kNumLogRecords];
+    __atomic_store_n(&rec.seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    rec.shown = !deferred;
+    rec.entry.tsc = ReadTSC();
+    rec.entry.level = level;
+    const size_t len = strlen(s);
+    if (len < kLogTextLen) {
+        memcpy(rec.entry.text, s, len + 1);
+    } else {
+        // 切り詰めても改行で終わるようにする
+        memcpy(rec.entry.text, s, kLogTextLen - 2);
+        rec.entry.text[kLogTextLen - 2] = s[len - 1] == '\n' ? '\n' : s[kLogTextLen - 2];
+        rec.entry.text[kLogTextLen - 1] = '\0';
+    }
+    __atomic_store_n(&rec.seq, seq + 1, __ATOMIC_RELEASE);
+
+    if (!deferred) {
+        g_console->PutString(s);
+    }
     return result;
-}
\ No newline at end of file
+}
+
+namespace {
+    /// ReadLog()の本体。shownには記録した時点でコンソールに描いたかを返す
+    bool ReadRecord(uint64_t& seq, LogEntry& entry, bool& shown, uint64_t* num_lost) {
+        while (true) {
+            const uint64_t next = __atomic_load_n(&g_log_next_seq, __ATOMIC_RELAXED);
+            if (seq >= next) {
+                return false;
+            }
+            if (next - seq > kNumLogRecords) {
+                // リングを一周して上書きされた分は飛ばす
+                if (num_lost) {
+                    *num_lost += next - kNumLogRecords - seq;
+                }
+                seq = next - kNumLogRecords;
+            }
+
+            const LogRecord& rec = g_log_records[seq % kNumLogRecords];
+            const uint64_t before = __atomic_load_n(&rec.seq, __ATOMIC_ACQUIRE);
+            if (before < seq + 1) {
+                // まだ書き込み中
+                return false;
+            }
+            if (before == seq + 1) {
+                memcpy(&entry, &rec.entry, sizeof(entry));
+                shown = rec.shown;
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&rec.seq, __ATOMIC_RELAXED) == before) {
+                    seq++;
+                    return true;
+                }
+            }
+            // 読んでいる間に上書きされた。次のログに進む
+            if (num_lost) {
+                ++*num_lost;
+            }
+            seq++;
+        }
+    }
+} // namespace
+
+bool ReadLog(uint64_t& seq, LogEntry& entry, uint64_t* num_lost) {
+    bool shown;
+    return ReadRecord(seq, entry, shown, num_lost);
+}
+
+uint64_t NumLogs() {
+    return __atomic_load_n(&g_log_next_seq, __ATOMIC_RELAXED);
+}
+
+void FlushLog() {
+    LogEntry entry;
+    while (true) {
+        bool shown;
+        uint64_t num_lost = 0;
+        {
+            // 読み出すところだけ排他し、描くのはロックを離してから
+            SpinLockGuard lock{g_log_render_lock};
+            if (!ReadRecord(g_log_render_seq, entry, shown, &num_lost)) {
+                break;
+            }
+        }
+        if (num_lost > 0) {
+            char s[64];
+            sprintf(s, "(%lu log records lost)\n", num_lost);
+            g_console->PutString(s);
+        }
+        if (!shown) {
+            g_console->PutString(entry.text);
+        }
+    }
+}
+
+namespace {
+    void TaskLogRenderer(uint64_t task_id, int64_t data) {
+        Task& task = g_task_manager->CurrentTask();
+        g_timer_manager->AddTimer(Timer{g_timer_manager->CurrentTick() + kLogRenderTicks,
+                                        kLogRenderTimer, task_id, kLogRenderTicks});
+
+        while (true) {
+            const auto msg = task.WaitMessage();
+            if (msg.type != Message::kTimerTimeout || g_log_render_seq == NumLogs()) {
+                continue;
+            }
+            // コンソールのウィンドウは合成タスクが読むので、描く間はレイヤを止めておく
+            MutexGuard lock{g_layer_mutex};
+            FlushLog();
+        }
+    }
+} // namespace
+
+void StartLogRenderer() {
+    // 描画は急がないので、最低の優先度で動かす
+    auto& task = g_task_manager->NewTask().InitContext(TaskLogRenderer, 0);
+    __atomic_store_n(&g_log_deferred, true, __ATOMIC_RELEASE);
+    g_task_manager->Wakeup(&task, 0);
+}
@@ -1,5 +1,11 @@
 #pragma once
 
+/// apps/syscall.hがCのソースからもインクルードするので，C++でしか書けない宣言は__cplusplusの中に置く．
+#ifdef __cplusplus
+#include <cstddef>
+#include <cstdint>
+#endif
+
 enum LogLevel {
     kError = 3,
     kWarn = 4,
@@ -11,4 +17,53 @@ enum LogLevel {
 /// 以降のLogの呼び出しでは，ここで設定した優先度以上のログのみ記録される．
 void SetLogLevel(enum LogLevel level);
 
-int Log(enum LogLevel level, const char* format, ...);
\ No newline at end of file
+#ifdef __cplusplus
+/// ビルド時に決める，記録しうる最も低い優先度（make LOG_LEVEL_MAX=kInfo のように指定する）．
+/// これより低い優先度のLogの呼び出しはコンパイル時に取り除かれる．
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX kDebug
+#endif
+constexpr LogLevel kLogLevelMax = LOG_LEVEL_MAX;
+
+/// ログをリングバッファに記録する．ロックを取らないので，どのタスクや割り込みハンドラから呼んでもよい．
+/// StartLogRenderer()を呼ぶまではその場でコンソールにも描き，以降の描画はログ描画タスクに任せる．
+/// Logから，優先度がkLogLevelMax以下のときだけ呼ばれる．
+int LogPrint(enum LogLevel level, const char* format, ...);
+
+/// 優先度が定数なら，kLogLevelMaxとの比較はコンパイル時に済み，取り除かれる呼び出しは引数の計算ごと消える．
+/// そのため引数には副作用のある式を書かないこと．SetLogLevelのしきい値との比較は実行時に行う．
+/// apps/syscall.hがextern "C"の中でインクルードするので，テンプレートはC++のリンケージに戻しておく．
+extern "C++" {
+template <class... Args>
+__attribute__((always_inline)) inline int Log(enum LogLevel level, const char* format, Args... args) {
+    if (level > kLogLevelMax) {
+        return 0;
+    }
+    return LogPrint(level, format, args...);
+}
+}
+
+/// 1件のログの最大の長さ（ヌル文字を含む）．これより長いログは切り詰める
+const size_t kLogTextLen = 240;
+
+/// 記録されたログ1件
+struct LogEntry {
+    /// 記録したときのTSCの値
+    uint64_t tsc;
+    LogLevel level;
+    char text[kLogTextLen];
+};
+
+/// 通し番号seq以降で最も古い，まだ残っているログをentryに読み出し，seqを次の番号に進める．
+/// 読み出せるログがなければfalseを返す（seqは変えない）．
+/// 読み出す前に上書きされたログは飛ばすので，飛ばした件数をnum_lostに足す．
+bool ReadLog(uint64_t& seq, LogEntry& entry, uint64_t* num_lost = nullptr);
+/// これまでに記録したログの件数（次に記録するログの通し番号）
+uint64_t NumLogs();
+
+/// コンソールにログを描く，最低の優先度のタスクを起動する．
+void StartLogRenderer();
+/// まだコンソールに描いていないログを，呼び出したタスクでその場で描く．
+/// 直後に止まってしまう致命的なエラーの前に呼ぶ．
+void FlushLog();
+#endif
@@ -9,12 +9,19 @@
 
 #include "acpi.hpp"
 #include "asmfunc.h"
+#include "block.hpp"
+#include "bootjob.hpp"
+#include "bootprof.hpp"
 #include "console.hpp"
+#include "deferred.hpp"
 #include "fat.hpp"
 #include "font.hpp"
+#include "fpu.hpp"
 #include "frame_buffer_config.hpp"
 #include "graphics.hpp"
+#include "idle.hpp"
 #include "interrupt.hpp"
+#include "ioapic.hpp"
 #include "keyboard.hpp"
 #include "layer.hpp"
 #include "logger.hpp"
@@ -22,14 +29,21 @@
 #include "memory_map.hpp"
 #include "message.hpp"
 #include "mouse.hpp"
+#include "page_cache.hpp"
 #include "paging.hpp"
 #include "pci.hpp"
+#include "pmu.hpp"
+#include "pixel_ops.hpp"
 #include "segment.hpp"
+#include "shm.hpp"
+#include "smp.hpp"
+#include "surface_pool.hpp"
 #include "syscall.hpp"
 #include "task.hpp"
 #include "terminal.hpp"
 #include "timer.hpp"
 #include "usb/xhci/xhci.hpp"
+#include "virtio_net.hpp"
 #include "window.hpp"
 
 int printk(const char* format, ...) {
@@ -107,14 +121,75 @@ void InputTextWindow(char input) {
     g_layer_manager->Draw(g_text_window_layer_id);
 }
 
+namespace {
+    /// フレームバッファ全体に1行分のピクセルを書き込む速さ（MB/s）を測る。画面は描き直す必要がある
+    unsigned long MeasureFrameBufferBandwidth() {
+        const auto& config = g_screen_config;
+        std::vector<uint32_t> line(config.horizontal_resolution, 0);
+        const int kRepeat = 4;
+        const auto start = g_timer_manager->CurrentTick();
+        for (int r = 0; r < kRepeat; r++) {
+            for (uint32_t y = 0; y < config.vertical_resolution; y++) {
+                CopyPixels(config.frame_buffer + 4 * config.pixels_per_scan_line * y, line.data(), line.size());
+            }
+        }
+        const auto elapsed = std::max(1ul, g_timer_manager->CurrentTick() - start);
+        const unsigned long bytes = 4ul * kRepeat * line.size() * config.vertical_resolution;
+        // 1tick = 1マイクロ秒なので、バイト数 / tick数がそのままMB/sになる
+        return bytes / elapsed;
+    }
+
+    /// フレームバッファをWrite Combiningでマップし直し、前後の書き込みの速さを記録する
+    void InitializeFrameBufferMapping() {
+        const auto& config = g_screen_config;
+        const size_t bytes = 4ul * config.pixels_per_scan_line * config.vertical_resolution;
+        const auto before = MeasureFrameBufferBandwidth();
+        if (auto err = MapWriteCombining(reinterpret_cast<uint64_t>(config.frame_buffer), bytes)) {
+            Log(kWarn, "frame buffer stays uncached: %s\n", err.Name());
+            return;
+        }
+        const auto after = MeasureFrameBufferBandwidth();
+        Log(kInfo, "frame buffer write-combining: %lu MB/s -> %lu MB/s\n", before, after);
+    }
+
+    /// ブートローダが読み込んだボリュームイメージ（BootJob::kVolumeに渡す）
+    void* g_volume_image;
+    size_t g_volume_bytes;
+
+    /// ブートボリュームを見つけてFATファイルシステムを初期化する
+    void InitializeVolume() {
+        // ブートローダが全体を読み込めなかったボリュームは、ブロックデバイスから必要な分だけ読む
+        fat::Initialize(InitializeBootVolume(g_volume_image, g_volume_bytes));
+        // ブートボリュームへの書き込みを定期的に書き戻す
+        StartBootVolumeFlusher();
+    }
+
+    /// USBデバイス
+    void InitializeUSB() {
+        // xHCIが動き出す前に、キーボードとマウスの通知先を決めておく
+        {
+            MutexGuard lock{g_layer_mutex};
+            InitializeKeyboard();
+            InitializeMouse();
+        }
+        usb::xhci::Initialize();
+    }
+} // namespace
+
 alignas(16) uint8_t g_kernel_main_stack[1024 * 1024];
 
 // ブートローダからフレームバッファの情報とメモリマップを受け取る
 extern "C" void KernelMainNewStack(const FrameBufferConfig& frame_buffer_config,
                                    const MemoryMap& memory_map,
                                    const acpi::RSDP& acpi_table,
-                                   void* volume_image) {
+                                   void* volume_image,
+                                   size_t volume_bytes,
+                                   const BootLoaderTiming& loader_timing) {
+    // 起動の段階ごとの時間（ブートローダの記録はブートローダのスタックにあるので最初にコピーする）
+    StartBootProfile(loader_timing);
+
     // フレームバッファ
+    BootPhase("graphics");
     InitializeGraphics(frame_buffer_config);
     // メモリマネージャーやレイヤーマネージャーを生成する前のデバッグ情報を表示したいので、それらより前にコンソールを生成
     InitializeConsole();
@@ -123,23 +198,28 @@ extern "C" void KernelMainNewStack(const FrameBufferConfig& frame_buffer_config,
     SetLogLevel(kWarn);
 
     // メモリ管理
+    BootPhase("segmentation");
     InitializeSegmentation();
+    BootPhase("paging");
     InitializePaging();
+    BootPhase("memory manager");
     InitializeMemoryManager(memory_map);
+    // 閉じたウィンドウのピクセルの領域を使い回す
+    InitializeSurfacePool();
     InitializeTSS();
     // 割り込み
+    BootPhase("interrupt");
     InitializeInterrupt();
 
-    // FATファイルシステム
-    fat::Initialize(volume_image);
-
-    // フォント
-    InitializeFont();
-
     // デバイス
+    // PCIのコンフィグレーション空間の場所（MCFG）を知るため、ACPIのテーブルを先に読む
+    BootPhase("acpi");
+    acpi::Initialize(acpi_table);
+    BootPhase("pci scan");
     InitializePCI();
 
     // GUIレイヤー
+    BootPhase("layer");
     InitializeLayer();
     InitializeMainWindow();
     InitializeTextWindow();
@@ -147,8 +227,16 @@ extern "C" void KernelMainNewStack(const FrameBufferConfig& frame_buffer_config,
     g_layer_manager->Draw({{0, 0}, ScreenSize()});
 
     // タイマ
-    acpi::Initialize(acpi_table);
+    BootPhase("lapic timer");
     InitializeLAPICTimer();
+    // MSIを使えないデバイスの割り込みの経路（MADTを読むのでACPIの後に）
+    BootPhase("ioapic");
+    InitializeIOAPIC();
+
+    // 速さを測るのにタイマを使うので、タイマの後に。測るときに画面を上書きするので描き直す
+    BootPhase("frame buffer");
+    InitializeFrameBufferMapping();
+    g_layer_manager->Draw({{0, 0}, ScreenSize()});
 
     // テキストボックスのカーソル点滅
     const int kTextboxCursorTimer = 1;
@@ -158,106 +246,126 @@ extern "C" void KernelMainNewStack(const FrameBufferConfig& frame_buffer_config,
     bool textbox_cursor_visible = false;
 
     // システムコール
+    BootPhase("syscall");
     InitializeSyscall();
 
+    // FPUの遅延切り替え（タスクの保存領域の大きさを決めるので、タスクより先に）
+    BootPhase("fpu");
+    InitializeFPU();
+    // 描画で使うSIMD命令を選ぶ（AVXを使えるかはFPUの設定で決まる）
+    InitializePixelOps();
+    // 性能監視カウンタ（perfコマンド）
+    InitializePMU();
+    // アイドルループでMWAITを使えるか（APのアイドルループより先に）
+    InitializeIdle();
     // マルチタスク
+    BootPhase("task");
     InitializeTask();
+    // 他のCPUコアを起動
+    BootPhase("smp");
+    InitializeSMP();
+    // 割り込みハンドラから後回しにした処理を行うタスク
+    StartDeferredWorkers();
     // このタスク（KernelMainStack()）
     Task& main_task = g_task_manager->CurrentTask();
 
-    // USBデバイス
+    // 互いに依存しない遅い初期化は別々のタスクで進め、その間にデスクトップを表示して入力を受け付ける
+    // ファイルを使うもの（ターミナルのコマンドなど）はBootJob::kVolumeを待つ
+    BootPhase("boot jobs");
+    g_volume_image = volume_image;
+    g_volume_bytes = volume_bytes;
+    StartBootJob(BootJob::kVolume, "volume", InitializeVolume);
+    StartBootJob(BootJob::kFont, "font", InitializeFont, {BootJob::kVolume});
     // xHCIは初期化するとすぐに割り込みが発生するので、タスク機能を初期化してからにする
-    usb::xhci::Initialize();
-    InitializeKeyboard();
-    InitializeMouse();
+    StartBootJob(BootJob::kUSB, "usb", InitializeUSB);
 
     // コピーオンライトの仕組みを初期化
-    g_app_loads = new std::map<fat::DirectoryEntry*, AppLoadInfo>;
+    BootPhase("services");
+    InitializeAppLoads();
+    // ファイルのページキャッシュ
+    InitializePageCache();
+    // 終わったアプリのアドレス空間を裏で破棄する
+    StartPageMapReaper();
+    // アプリ間の共有メモリ
+    InitializeSharedMemory();
+    // ネットワークカード（受信の処理はワーカタスクで行うので、その起動の後に）
+    virtio::InitializeNet();
+    // 画面の合成はここからは専用のタスクで行う
+    StartCompositor();
+    // ログのコンソールへの描画も、ここからは専用のタスクで行う
+    StartLogRenderer();
     // ターミナル
     g_task_manager->NewTask()
         .InitContext(TaskTerminal, 0)
         .Wakeup();
+    FinishBootProfile();
 
     char str[128];
+    std::array<Message, 32> msgs;
     // 割り込みイベントループ
     while (true) {
-        // clear interrupt : 割り込みを無効化
-        // データ競合の回避のため（キューの操作中に割り込みさせない）
-        __asm__("cli");
         const auto tick = g_timer_manager->CurrentTick();
-        // set interrupt : 割り込みを有効化
-        __asm__("sti");
-        // 割り込みが発生すると、この次の行から処理を再開
 
         sprintf(str, "%010lu", tick);
-        FillRectangle(*g_main_window->InnerWriter(), {20, 4}, {8 * 10, 16}, {0xc6, 0xc6, 0xc6});
-        WriteString(*g_main_window->InnerWriter(), {20, 4}, str, {0, 0, 0});
-        // カウンタの表示はメインウィンドウだけを再描画
-        g_layer_manager->Draw(g_main_window_layer_id);
-
-        __asm__("cli");
-        auto msg = main_task.ReceiveMessage();
-        if (!msg) {
-            // メインタスクは他タスクより優先度が高いが、割り込みイベントがこない限りは眠らせる
-            main_task.Sleep();
-            __asm__("sti");
-            continue;
+        {
+            MutexGuard lock{g_layer_mutex};
+            FillRectangle(*g_main_window->InnerWriter(), {20, 4}, {8 * 10, 16}, {0xc6, 0xc6, 0xc6});
+            WriteString(*g_main_window->InnerWriter(), {20, 4}, str, {0, 0, 0});
+            // カウンタの表示はメインウィンドウだけを再描画
+            g_layer_manager->Draw(g_main_window_layer_id);
         }
-        __asm__("sti");
-
-        switch (msg->type) {
-        case Message::kInterruptXHCI:
-            usb::xhci::ProcessEvents();
-            break;
-        case Message::kTimerTimeout:
-            // カーソル点滅タイマがタイムアウトした場合
-            if (msg->arg.timer.value == kTextboxCursorTimer) {
-                __asm__("cli");
-                g_timer_manager->AddTimer(Timer{msg->arg.timer.timeout + kTimer05sec, kTextboxCursorTimer, kMainTaskID});
-                __asm__("sti");
-                textbox_cursor_visible = !textbox_cursor_visible;
-                DrawTextCursor(textbox_cursor_visible);
-                g_layer_manager->Draw(g_text_window_layer_id);
-            }
-            break;
-        case Message::kKeyPush:
-            if (auto act = g_active_layer->GetActive(); act == g_text_window_layer_id) {
-                // キーの二重入力を防ぐ
-                if (msg->arg.keyboard.press) {
-                    InputTextWindow(msg->arg.keyboard.ascii);
+
+        // メインタスクは他タスクより優先度が高いが、割り込みイベントがこない限りは眠らせる
+        // 起きたら溜まっているメッセージをまとめて取り出す
+        size_t num_msgs = main_task.WaitMessages(msgs.data(), msgs.size());
+        // マウスやキー入力の処理もレイヤを操作するので、まとめて処理する間はずっと持っておく
+        MutexGuard lock{g_layer_mutex};
+        // 描画要求が立て続けに来ていたら1回の描画にまとめる（描画終了の通知もまとめて1回になる）
+        num_msgs = CoalesceLayerMessages(msgs.data(), num_msgs);
+
+        for (size_t i = 0; i < num_msgs; i++) {
+            const Message* msg = &msgs[i];
+            switch (msg->type) {
+            case Message::kTimerTimeout:
+                // カーソル点滅タイマがタイムアウトした場合
+                if (msg->arg.timer.value == kTextboxCursorTimer) {
+                    g_timer_manager->AddTimer(Timer{msg->arg.timer.timeout + kTimer05sec, kTextboxCursorTimer, kMainTaskID});
+                    textbox_cursor_visible = !textbox_cursor_visible;
+                    DrawTextCursor(textbox_cursor_visible);
+                    g_layer_manager->Draw(g_text_window_layer_id);
                 }
-            } else if (msg->arg.keyboard.press &&
-                       msg->arg.keyboard.keycode == 59 /* F2 */) {
-                g_task_manager->NewTask()
-                    .InitContext(TaskTerminal, 0)
-                    .Wakeup();
-            } else {
-                // アクティブなレイヤIDからタスクを検索し、そのタスクにメッセージを通知
-                __asm__("cli");
-                auto task_it = g_layer_task_map->find(act);
-                __asm__("sti");
-                if (task_it != g_layer_task_map->end()) {
-                    __asm__("cli");
-                    g_task_manager->SendMessage(task_it->second, *msg);
-                    __asm__("sti");
+                break;
+            case Message::kKeyPush:
+                // アクティブなウィンドウのタスクへは、キーボードのドライバが直接届ける。ここに来るのはその残り
+                if (auto act = g_active_layer->GetActive(); act == g_text_window_layer_id) {
+                    // キーの二重入力を防ぐ
+                    if (msg->arg.keyboard.press) {
+                        InputTextWindow(msg->arg.keyboard.ascii);
+                    }
+                } else if (msg->arg.keyboard.press &&
+                           msg->arg.keyboard.keycode == 59 /* F2 */) {
+                    g_task_manager->NewTask()
+                        .InitContext(TaskTerminal, 0)
+                        .Wakeup();
                 } else {
-                    printk("key push no handled: keycode %02x, ascii %02x\n",
-                           msg->arg.keyboard.keycode,
-                           msg->arg.keyboard.ascii);
+                    // アクティブなレイヤIDからタスクを検索し、そのタスクにメッセージを通知
+                    auto task_it = g_layer_task_map->find(act);
+                    if (task_it != g_layer_task_map->end()) {
+                        g_task_manager->SendMessage(task_it->second, *msg);
+                    } else {
+                        printk("key push no handled: keycode %02x, ascii %02x\n",
+                               msg->arg.keyboard.keycode,
+                               msg->arg.keyboard.ascii);
+                    }
                 }
+                break;
+            case Message::kLayer:
+                // 合成タスクを起動する前に届いた要求。再描画領域は合成タスクが描く
+                ProcessLayerMessage(*msg);
+                break;
+            default:
+                Log(kError, "Unknown message type: %d\n", msg->type);
             }
-            break;
-        case Message::kLayer:
-            // 描画中の割り込みは許可しておく
-            // 描画処理は低優先度な割にリソースを食うため、割り込みを禁止すると取りこぼしてしまうから
-            ProcessLayerMessage(*msg);
-            __asm__("cli");
-            // 送信元タスクに描画終了を通知
-            g_task_manager->SendMessage(msg->src_task, Message{Message::kLayerFinish});
-            __asm__("sti");
-            break;
-        default:
-            Log(kError, "Unknown message type: %d\n", msg->type);
         }
     }
 }
@@ -1,21 +1,78 @@
 #include "memory_manager.hpp"
 
+#include <algorithm>
 #include <bitset>
 
+#include "deferred.hpp"
 #include "logger.hpp"
+#include "paging.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
 
 BitmapMemoryManager::BitmapMemoryManager()
-    : alloc_map_{}, range_begin_{FrameID{0}}, range_end_{FrameID{kFrameCount}} {
+    : alloc_map_{}, summary_map_{}, range_begin_{FrameID{0}}, range_end_{FrameID{kFrameCount}},
+      next_fit_{ZoneBegin(MemoryZone::kDMA32), ZoneBegin(MemoryZone::kNormal)},
+      zone_free_frames_{kDMA32EndFrame, kFrameCount - kDMA32EndFrame}, prefer_normal_{false} {
+    summary_map_.fill(~static_cast<MapLineType>(0));
 }
 
-WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames) {
-    size_t start_frame_id = range_begin_.ID();
+WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames, MemoryZone zone) {
+    const auto dma32 = static_cast<int>(MemoryZone::kDMA32);
+    size_t frame_id = kNullFrame.ID();
+    if (zone == MemoryZone::kDMA32) {
+        frame_id = AllocateInZone(num_frames, MemoryZone::kDMA32);
+    } else if (prefer_normal_) {
+        frame_id = AllocateInZone(num_frames, MemoryZone::kNormal);
+        // kNormalが尽きたら、DMA用の予備を残せる範囲でkDMA32から確保する
+        const size_t reserve = DMA32ReserveFrames(ZoneStat(MemoryZone::kDMA32).total_frames);
+        if (frame_id == kNullFrame.ID() && zone_free_frames_[dma32] >= reserve + num_frames) {
+            frame_id = AllocateInZone(num_frames, MemoryZone::kDMA32);
+        }
+    } else { // 4GiB以上のメモリがなければ、アドレスの小さい方から
+        frame_id = AllocateInZone(num_frames, MemoryZone::kDMA32);
+        if (frame_id == kNullFrame.ID()) {
+            frame_id = AllocateInZone(num_frames, MemoryZone::kNormal);
+        }
+    }
+    if (frame_id == kNullFrame.ID()) {
+        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+    return {FrameID{frame_id}, MAKE_ERROR(Error::kSuccess)};
+}
+
+size_t BitmapMemoryManager::AllocateInZone(size_t num_frames, MemoryZone zone) {
+    const size_t begin = ZoneRangeBegin(zone);
+    const size_t end = ZoneRangeEnd(zone);
+    if (zone_free_frames_[static_cast<int>(zone)] < num_frames) {
+        return kNullFrame.ID();
+    }
+
+    if (num_frames == 1) {
+        // 前回割り当てた位置から探し、見つからなければ先頭に戻る
+        auto& next_fit = next_fit_[static_cast<int>(zone)];
+        next_fit = std::clamp(next_fit, begin, end);
+        size_t frame_id = FindFreeFrame(next_fit, end);
+        if (frame_id == end) {
+            frame_id = FindFreeFrame(begin, next_fit);
+            if (frame_id == next_fit) {
+                return kNullFrame.ID();
+            }
+        }
+        SetBit(FrameID{frame_id}, true);
+        next_fit = frame_id + 1;
+        return frame_id;
+    }
+
+    size_t start_frame_id = begin;
     // 線形探索（ファーストフィット）
     while (true) {
+        // 使用中のフレームを読み飛ばす
+        start_frame_id = FindFreeFrame(start_frame_id, end);
+
         size_t i = 0;
         for (; i < num_frames; i++) {
-            if (range_end_.ID() <= start_frame_id + i) {
-                return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+            if (end <= start_frame_id + i) {
+                return kNullFrame.ID();
             }
             if (GetBit(FrameID(start_frame_id + i))) {
                 break;
@@ -24,7 +81,7 @@ WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames) {
 
         if (i == num_frames) { // num_frames分の空き領域を発見
             MarkAllocated(FrameID{start_frame_id}, num_frames);
-            return {FrameID{start_frame_id}, MAKE_ERROR(Error::kSuccess)};
+            return start_frame_id;
         }
 
         // 次のフレームから再探索
@@ -48,6 +105,25 @@ void BitmapMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames)
 void BitmapMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end) {
     range_begin_ = range_begin;
     range_end_ = range_end;
+    prefer_normal_ = range_end.ID() > kDMA32EndFrame;
+    // 範囲が変わったので、ゾーンごとの空きフレーム数を数え直す
+    for (auto zone : {MemoryZone::kDMA32, MemoryZone::kNormal}) {
+        const size_t begin = ZoneRangeBegin(zone);
+        const size_t end = ZoneRangeEnd(zone);
+        size_t free_frames = 0;
+        size_t id = begin;
+        for (; id < end && id % kBitsPerMapLine != 0; id++) {
+            free_frames += !GetBit(FrameID{id});
+        }
+        for (; id + kBitsPerMapLine <= end; id += kBitsPerMapLine) {
+            free_frames += kBitsPerMapLine - std::bitset<kBitsPerMapLine>(alloc_map_[id / kBitsPerMapLine]).count();
+        }
+        for (; id < end; id++) {
+            free_frames += !GetBit(FrameID{id});
+        }
+        zone_free_frames_[static_cast<int>(zone)] = free_frames;
+        next_fit_[static_cast<int>(zone)] = begin;
+    }
 }
 
 MemoryStat BitmapMemoryManager::Stat() const {
@@ -58,6 +134,47 @@ MemoryStat BitmapMemoryManager::Stat() const {
     return {sum, range_end_.ID() - range_begin_.ID()};
 }
 
+MemoryStat BitmapMemoryManager::ZoneStat(MemoryZone zone) const {
+    const size_t total = ZoneRangeEnd(zone) - ZoneRangeBegin(zone);
+    return {total - zone_free_frames_[static_cast<int>(zone)], total};
+}
+
+size_t BitmapMemoryManager::ZoneRangeBegin(MemoryZone zone) const {
+    return std::min(std::max(ZoneBegin(zone), range_begin_.ID()), range_end_.ID());
+}
+
+size_t BitmapMemoryManager::ZoneRangeEnd(MemoryZone zone) const {
+    return std::max(std::min(ZoneEnd(zone), range_end_.ID()), ZoneRangeBegin(zone));
+}
+
+FragmentationStat BitmapMemoryManager::Fragmentation() const {
+    FragmentationStat stat{};
+    auto add_run = [&stat](size_t run) {
+        int order = 0;
+        while (order < kFragmentationOrders - 1 && (run >> (order + 1)) != 0) {
+            order++;
+        }
+        stat.free_blocks[order]++;
+        stat.free_frames += run;
+        stat.largest_free_frames = std::max(stat.largest_free_frames, run);
+    };
+
+    // 連続した空きフレームを1つのブロックとみなす
+    size_t run = 0;
+    for (size_t id = range_begin_.ID(); id < range_end_.ID(); id++) {
+        if (!GetBit(FrameID{id})) {
+            run++;
+        } else if (run > 0) {
+            add_run(run);
+            run = 0;
+        }
+    }
+    if (run > 0) {
+        add_run(run);
+    }
+    return stat;
+}
+
 bool BitmapMemoryManager::GetBit(FrameID frame) const {
     auto line_index = frame.ID() / kBitsPerMapLine;
     auto bit_index = frame.ID() % kBitsPerMapLine;
@@ -69,36 +186,432 @@ void BitmapMemoryManager::SetBit(FrameID frame, bool allocated) {
     auto line_index = frame.ID() / kBitsPerMapLine;
     auto bit_index = frame.ID() % kBitsPerMapLine;
 
+    // 範囲内のフレームの状態が変わったら、ゾーンの空きフレーム数に反映
+    const bool was_allocated = (alloc_map_[line_index] & (static_cast<MapLineType>(1) << bit_index)) != 0;
+    if (was_allocated != allocated && range_begin_.ID() <= frame.ID() && frame.ID() < range_end_.ID()) {
+        auto& free_frames = zone_free_frames_[static_cast<int>(ZoneOf(frame.ID()))];
+        if (allocated) {
+            free_frames--;
+        } else {
+            free_frames++;
+        }
+    }
+
     if (allocated) {
         alloc_map_[line_index] |= (static_cast<MapLineType>(1) << bit_index);
     } else {
         alloc_map_[line_index] &= ~(static_cast<MapLineType>(1) << bit_index);
     }
+
+    // 行が埋まったかどうかをサマリーに反映
+    const auto summary_bit = static_cast<MapLineType>(1) << (line_index % kBitsPerMapLine);
+    if (~alloc_map_[line_index] == 0) {
+        summary_map_[line_index / kBitsPerMapLine] &= ~summary_bit;
+    } else {
+        summary_map_[line_index / kBitsPerMapLine] |= summary_bit;
+    }
+}
+
+size_t BitmapMemoryManager::FindFreeFrame(size_t begin, size_t end) const {
+    if (begin >= end) {
+        return end;
+    }
+
+    // beginを含む行
+    size_t line_index = begin / kBitsPerMapLine;
+    MapLineType free_bits = ~alloc_map_[line_index] &
+                            (~static_cast<MapLineType>(0) << (begin % kBitsPerMapLine));
+    if (free_bits == 0) {
+        // サマリーから空きのある次の行を探す
+        size_t line = line_index + 1;
+        const size_t end_line = (end + kBitsPerMapLine - 1) / kBitsPerMapLine;
+        free_bits = 0;
+        while (line < end_line) {
+            const MapLineType summary = summary_map_[line / kBitsPerMapLine] &
+                                        (~static_cast<MapLineType>(0) << (line % kBitsPerMapLine));
+            if (summary != 0) {
+                line_index = line / kBitsPerMapLine * kBitsPerMapLine + __builtin_ctzl(summary);
+                free_bits = ~alloc_map_[line_index];
+                break;
+            }
+            line = (line / kBitsPerMapLine + 1) * kBitsPerMapLine;
+        }
+        if (free_bits == 0) {
+            return end;
+        }
+    }
+
+    const size_t frame_id = line_index * kBitsPerMapLine + __builtin_ctzl(free_bits);
+    return frame_id < end ? frame_id : end;
+}
+
+BuddyMemoryManager::BuddyMemoryManager()
+    : free_map_{}, summary_{}, search_hint_{}, free_blocks_{}, free_frames_{}, prefer_normal_{false},
+      range_begin_{FrameID{0}}, range_end_{FrameID{kFrameCount}} {
+    for (auto zone : {MemoryZone::kDMA32, MemoryZone::kNormal}) {
+        for (int order = 0; order <= kMaxOrder; order++) {
+            search_hint_[static_cast<int>(zone)][order] =
+                MapOffset(order) + (ZoneBegin(zone) >> order) / kBitsPerMapLine;
+        }
+    }
+    // 最初は全体が最大次数の空きブロック
+    for (size_t frame = 0; frame < kFrameCount; frame += (1ul << kMaxOrder)) {
+        PushBlock(frame, kMaxOrder);
+    }
+}
+
+WithError<FrameID> BuddyMemoryManager::Allocate(size_t num_frames, MemoryZone zone) {
+    int order = 0;
+    while (order <= kMaxOrder && (1ul << order) < num_frames) {
+        order++;
+    }
+    if (order > kMaxOrder) {
+        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    const auto dma32 = static_cast<int>(MemoryZone::kDMA32);
+    size_t frame = kNullFrame.ID();
+    if (zone == MemoryZone::kDMA32) {
+        frame = AllocateBlock(order, MemoryZone::kDMA32);
+    } else if (prefer_normal_) {
+        frame = AllocateBlock(order, MemoryZone::kNormal);
+        // kNormalが尽きたら、DMA用の予備を残せる範囲でkDMA32から確保する
+        const size_t reserve = DMA32ReserveFrames(ZoneStat(MemoryZone::kDMA32).total_frames);
+        if (frame == kNullFrame.ID() && free_frames_[dma32] >= reserve + (1ul << order)) {
+            frame = AllocateBlock(order, MemoryZone::kDMA32);
+        }
+    } else { // 4GiB以上のメモリがなければ、アドレスの小さい方から
+        frame = AllocateBlock(order, MemoryZone::kDMA32);
+        if (frame == kNullFrame.ID()) {
+            frame = AllocateBlock(order, MemoryZone::kNormal);
+        }
+    }
+    if (frame == kNullFrame.ID()) {
+        return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    // 切り上げた分の余りを返却
+    FreeRange(frame + num_frames, frame + (1ul << order));
+    return {FrameID{frame}, MAKE_ERROR(Error::kSuccess)};
+}
+
+size_t BuddyMemoryManager::AllocateBlock(int order, MemoryZone zone) {
+    // 要求を満たす最小の次数から探す
+    int found_order = order;
+    size_t frame = kNullFrame.ID();
+    for (; found_order <= kMaxOrder; found_order++) {
+        frame = FindFreeBlock(found_order, zone);
+        if (frame != kNullFrame.ID()) {
+            break;
+        }
+    }
+    if (frame == kNullFrame.ID()) {
+        return frame;
+    }
+
+    // 大きすぎるブロックは半分に分割し、後半を空きブロックに戻す
+    PopBlock(frame, found_order);
+    while (found_order > order) {
+        found_order--;
+        PushBlock(frame + (1ul << found_order), found_order);
+    }
+    return frame;
+}
+
+Error BuddyMemoryManager::Free(FrameID start_frame, size_t num_frames) {
+    FreeRange(start_frame.ID(), start_frame.ID() + num_frames);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void BuddyMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames) {
+    RemoveRange(start_frame.ID(), start_frame.ID() + num_frames);
+}
+
+void BuddyMemoryManager::SetMemoryRange(FrameID range_begin, FrameID range_end) {
+    RemoveRange(0, range_begin.ID());
+    RemoveRange(range_end.ID(), kFrameCount);
+    range_begin_ = range_begin;
+    range_end_ = range_end;
+    prefer_normal_ = range_end.ID() > kDMA32EndFrame;
+}
+
+MemoryStat BuddyMemoryManager::Stat() const {
+    const size_t total = range_end_.ID() - range_begin_.ID();
+    return {total - free_frames_[0] - free_frames_[1], total};
+}
+
+MemoryStat BuddyMemoryManager::ZoneStat(MemoryZone zone) const {
+    const size_t begin = std::max(ZoneBegin(zone), range_begin_.ID());
+    const size_t end = std::min(ZoneEnd(zone), range_end_.ID());
+    const size_t total = begin < end ? end - begin : 0;
+    return {total - free_frames_[static_cast<int>(zone)], total};
+}
+
+FragmentationStat BuddyMemoryManager::Fragmentation() const {
+    FragmentationStat stat{};
+    for (int order = 0; order <= kMaxOrder; order++) {
+        stat.free_blocks[order] = free_blocks_[0][order] + free_blocks_[1][order];
+        if (stat.free_blocks[order] > 0) {
+            stat.largest_free_frames = 1ul << order;
+        }
+    }
+    stat.free_frames = free_frames_[0] + free_frames_[1];
+    return stat;
+}
+
+bool BuddyMemoryManager::IsFreeBlock(size_t frame, int order) const {
+    const size_t bit = frame >> order;
+    const size_t line = MapOffset(order) + bit / kBitsPerMapLine;
+    return (free_map_[line] & (static_cast<MapLineType>(1) << (bit % kBitsPerMapLine))) != 0;
+}
+
+void BuddyMemoryManager::PushBlock(size_t frame, int order) {
+    const size_t bit = frame >> order;
+    const size_t line = MapOffset(order) + bit / kBitsPerMapLine;
+    free_map_[line] |= static_cast<MapLineType>(1) << (bit % kBitsPerMapLine);
+    summary_[line / kBitsPerMapLine] |= static_cast<MapLineType>(1) << (line % kBitsPerMapLine);
+    const int zone = static_cast<int>(ZoneOf(frame));
+    search_hint_[zone][order] = std::min(search_hint_[zone][order], line);
+    free_blocks_[zone][order]++;
+    free_frames_[zone] += 1ul << order;
+}
+
+void BuddyMemoryManager::PopBlock(size_t frame, int order) {
+    const size_t bit = frame >> order;
+    const size_t line = MapOffset(order) + bit / kBitsPerMapLine;
+    free_map_[line] &= ~(static_cast<MapLineType>(1) << (bit % kBitsPerMapLine));
+    if (free_map_[line] == 0) {
+        summary_[line / kBitsPerMapLine] &= ~(static_cast<MapLineType>(1) << (line % kBitsPerMapLine));
+    }
+    const int zone = static_cast<int>(ZoneOf(frame));
+    free_blocks_[zone][order]--;
+    free_frames_[zone] -= 1ul << order;
+}
+
+size_t BuddyMemoryManager::FindFreeBlock(int order, MemoryZone zone) {
+    const int z = static_cast<int>(zone);
+    if (free_blocks_[z][order] == 0) {
+        return kNullFrame.ID();
+    }
+
+    // ゾーンに入るブロックの番号 : [begin_bit, end_bit)
+    const size_t begin_bit = ZoneBegin(zone) >> order;
+    const size_t end_bit = std::min(ZoneEnd(zone), static_cast<size_t>(kFrameCount)) >> order;
+    const size_t end = MapOffset(order) + (end_bit + kBitsPerMapLine - 1) / kBitsPerMapLine;
+    size_t line = search_hint_[z][order];
+    while (line < end) {
+        const MapLineType bits = summary_[line / kBitsPerMapLine] &
+                                 (~static_cast<MapLineType>(0) << (line % kBitsPerMapLine));
+        if (bits == 0) {
+            line = (line / kBitsPerMapLine + 1) * kBitsPerMapLine;
+            continue;
+        }
+
+        line = line / kBitsPerMapLine * kBitsPerMapLine + __builtin_ctzl(bits);
+        if (line >= end) {
+            break;
+        }
+        // 大きい次数では、1行に両方のゾーンのブロックが入ることがある
+        const size_t line_bit = (line - MapOffset(order)) * kBitsPerMapLine;
+        MapLineType free_bits = free_map_[line];
+        if (line_bit < begin_bit) {
+            free_bits &= ~static_cast<MapLineType>(0) << (begin_bit - line_bit);
+        }
+        if (end_bit < line_bit + kBitsPerMapLine) {
+            free_bits &= (static_cast<MapLineType>(1) << (end_bit - line_bit)) - 1;
+        }
+        if (free_bits == 0) {
+            line++;
+            continue;
+        }
+        search_hint_[z][order] = line;
+        return (line_bit + __builtin_ctzl(free_bits)) << order;
+    }
+    search_hint_[z][order] = end;
+    return kNullFrame.ID();
+}
+
+int BuddyMemoryManager::FindContainingBlock(size_t frame) const {
+    for (int order = 0; order <= kMaxOrder; order++) {
+        if (IsFreeBlock(frame & ~((1ul << order) - 1), order)) {
+            return order;
+        }
+    }
+    return -1;
+}
+
+void BuddyMemoryManager::FreeBlock(size_t frame, int order) {
+    // 二重解放は無視する
+    if (FindContainingBlock(frame) >= 0) {
+        return;
+    }
+
+    while (order < kMaxOrder) {
+        const size_t buddy = frame ^ (1ul << order);
+        if (!IsFreeBlock(buddy, order)) {
+            break;
+        }
+        PopBlock(buddy, order);
+        frame = std::min(frame, buddy);
+        order++;
+    }
+    PushBlock(frame, order);
+}
+
+void BuddyMemoryManager::FreeRange(size_t begin, size_t end) {
+    begin = std::max(begin, range_begin_.ID());
+    end = std::min(end, range_end_.ID());
+    while (begin < end) {
+        int order = 0;
+        while (order < kMaxOrder &&
+               (begin & ((2ul << order) - 1)) == 0 && begin + (2ul << order) <= end) {
+            order++;
+        }
+        FreeBlock(begin, order);
+        begin += 1ul << order;
+    }
+}
+
+void BuddyMemoryManager::RemoveRange(size_t begin, size_t end) {
+    end = std::min(end, static_cast<size_t>(kFrameCount));
+    while (begin < end) {
+        const int order = FindContainingBlock(begin);
+        if (order < 0) { // 使用中
+            begin++;
+            continue;
+        }
+
+        // 空きブロックを取り除き、範囲外にはみ出した部分を戻す
+        const size_t block_begin = begin & ~((1ul << order) - 1);
+        const size_t block_end = block_begin + (1ul << order);
+        PopBlock(block_begin, order);
+        FreeRange(block_begin, begin);
+        FreeRange(end, block_end);
+        begin = block_end;
+    }
 }
 
 extern "C" caddr_t g_program_break, g_program_break_end;
 
 namespace {
-    char g_memory_manager_buf[sizeof(BitmapMemoryManager)];
+    char g_memory_manager_buf[sizeof(MemoryManager)];
+
+    /// ヒープを伸ばすときの最小単位。縮めるときもこれ以上の余りができるまでは保持する
+    const uint64_t kHeapResizeBytes = 256_KiB;
 
-    Error InitializeHeap(BitmapMemoryManager& memory_manager) {
-        // 128MiB
-        const int kHeapFrames = 64 * 512;
-        const auto heap_start = memory_manager.Allocate(kHeapFrames);
-        if (heap_start.error) {
-            return heap_start.error;
+    std::array<MemoryPressureHandler, kMaxMemoryPressureHandlers> g_pressure_handlers;
+    size_t g_num_pressure_handlers = 0;
+
+    void RunMemoryPressureHandlers(uint64_t) {
+        for (size_t i = 0; i < g_num_pressure_handlers; i++) {
+            g_pressure_handlers[i]();
         }
+    }
+
+    DeferredWork g_pressure_work{"memory pressure", RunMemoryPressureHandlers, 0, WorkPriority::kNormal};
 
-        g_program_break = reinterpret_cast<caddr_t>(heap_start.value.ID() * kBytesPerFrame);
-        g_program_break_end = g_program_break + kHeapFrames * kBytesPerFrame;
-        return MAKE_ERROR(Error::kSuccess);
+    /// newlibのmalloc()などを複数のCPUコアから呼べるようにするロック
+    /// realloc()はロックを持ったままmalloc()を呼ぶので、同じCPUコアからは重ねて取れる
+    /// 持っている間は割り込みを禁止するので、持ち主のタスクが他のCPUコアへ移ることはない
+    SpinLock g_malloc_lock;
+    int g_malloc_owner = -1;
+    int g_malloc_depth = 0;
+    /// 最初にロックを取る前のRFLAGS
+    uint64_t g_malloc_rflags;
+    /// ロックを持ったままヒープを伸ばした : true
+    /// メモリ不足を調べるとタスクを起こしに行くので、ロックを解放してから調べる
+    bool g_heap_resized = false;
+
+    void InitializeHeap() {
+        // ヒープは空の状態から始め、sbrkに応じてページをマップする
+        g_program_break = reinterpret_cast<caddr_t>(kKernelHeapBase);
+        g_program_break_end = g_program_break;
     }
 } // namespace
 
-BitmapMemoryManager* g_memory_manager;
+extern "C" int ResizeKernelHeap(caddr_t new_break) {
+    const auto new_break_addr = reinterpret_cast<uint64_t>(new_break);
+    if (new_break_addr < kKernelHeapBase) {
+        return -1;
+    }
+
+    const auto heap_end = reinterpret_cast<uint64_t>(g_program_break_end);
+    const uint64_t new_end = (new_break_addr + kBytesPerFrame - 1) & ~static_cast<uint64_t>(kBytesPerFrame - 1);
+    if (heap_end < new_end) {
+        // 頻繁にマップし直さないよう、まとめて伸ばす
+        const uint64_t grow_end = std::max(new_end, heap_end + kHeapResizeBytes);
+        g_heap_resized = true;
+        if (auto err = MapKernelPages(LinearAddress4Level{heap_end}, (grow_end - heap_end) / kBytesPerFrame)) {
+            return -1;
+        }
+        g_program_break_end = reinterpret_cast<caddr_t>(grow_end);
+    } else if (new_end + kHeapResizeBytes <= heap_end) {
+        // 末尾の使われなくなったページを返却
+        if (auto err = UnmapKernelPages(LinearAddress4Level{new_end}, (heap_end - new_end) / kBytesPerFrame)) {
+            return -1;
+        }
+        g_program_break_end = reinterpret_cast<caddr_t>(new_end);
+    }
+    return 0;
+}
+
+extern "C" void __malloc_lock(struct _reent*) {
+    uint64_t rflags;
+    __asm__ volatile("pushfq\n\tpopq %0\n\tcli"
+                     : "=r"(rflags)
+                     :
+                     : "memory");
+    const int cpu = CurrentCPU();
+    if (__atomic_load_n(&g_malloc_owner, __ATOMIC_RELAXED) == cpu) {
+        g_malloc_depth++;
+        return;
+    }
+    g_malloc_lock.Lock();
+    __atomic_store_n(&g_malloc_owner, cpu, __ATOMIC_RELAXED);
+    g_malloc_depth = 1;
+    g_malloc_rflags = rflags;
+}
+
+extern "C" void __malloc_unlock(struct _reent*) {
+    if (--g_malloc_depth > 0) {
+        return;
+    }
+    const uint64_t rflags = g_malloc_rflags;
+    const bool resized = g_heap_resized;
+    g_heap_resized = false;
+    __atomic_store_n(&g_malloc_owner, -1, __ATOMIC_RELAXED);
+    g_malloc_lock.Unlock();
+
+    if (resized) {
+        CheckMemoryPressure();
+    }
+    __asm__ volatile("pushq %0\n\tpopfq"
+                     :
+                     : "r"(rflags)
+                     : "memory", "cc");
+}
+
+MemoryManager* g_memory_manager;
+
+bool LowOnFrames() {
+    const auto stat = g_memory_manager->Stat();
+    return stat.total_frames - stat.allocated_frames < kLowFrameWatermark;
+}
+
+void AddMemoryPressureHandler(MemoryPressureHandler handler) {
+    if (g_num_pressure_handlers < g_pressure_handlers.size()) {
+        g_pressure_handlers[g_num_pressure_handlers++] = handler;
+    }
+}
+
+void CheckMemoryPressure() {
+    if (g_num_pressure_handlers > 0 && LowOnFrames()) {
+        ScheduleWork(g_pressure_work);
+    }
+}
 
 void InitializeMemoryManager(const MemoryMap& memory_map) {
-    ::g_memory_manager = new (g_memory_manager_buf) BitmapMemoryManager;
+    ::g_memory_manager = new (g_memory_manager_buf) MemoryManager;
 
     // メモリマネージャーにUEFIのメモリマップを伝える
     const auto memory_map_base = reinterpret_cast<uintptr_t>(memory_map.buffer);
@@ -123,10 +636,8 @@ void InitializeMemoryManager(const MemoryMap& memory_map) {
         }
     }
     g_memory_manager->SetMemoryRange(FrameID{1}, FrameID{available_end / kBytesPerFrame});
+    // APの起動用コードを置くページは、他の用途に使われないよう最初に押さえておく
+    g_memory_manager->MarkAllocated(FrameID{kAPTrampolineAddr / kBytesPerFrame}, 1);
 
-    if (auto err = InitializeHeap(*g_memory_manager)) {
-        Log(kError, "failed to allocate pages: %s at %s:%d",
-            err.Name(), err.File(), err.Line());
-        exit(1);
-    }
+    InitializeHeap();
 }
\ No newline at end of file
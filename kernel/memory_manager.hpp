@@ -2,6 +2,7 @@
 /// ページフレーム : 物理アドレス上の固定長の区画
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <limits>
 
@@ -41,12 +42,55 @@ private:
 /// 未定義のページフレーム番号（null番人）
 static const FrameID kNullFrame{std::numeric_limits<size_t>::max()};
 
+/// 物理メモリのゾーン
+/// 32ビットのアドレスしか扱えないデバイス（一部のxHCIなど）のために、4GiB未満を別に管理する
+enum class MemoryZone {
+    /// 4GiB未満。DMAに使うフレームはここから確保する
+    kDMA32,
+    /// 4GiB以上。ここが尽きたときは、DMA32ReserveFrames()を残してkDMA32から確保する
+    /// 4GiB以上のメモリがなければ、ゾーンを分ける前と同じくアドレスの小さい方から確保する
+    kNormal,
+};
+static const int kNumMemoryZones{2};
+/// kDMA32の終わり（4GiB）のフレーム番号
+static const size_t kDMA32EndFrame{4_GiB / kBytesPerFrame};
+/// kNormalの確保がkDMA32に回ってきても、DMA用に残しておくフレーム数の上限
+static const size_t kDMA32Reserve{4_MiB / kBytesPerFrame};
+
+/// kDMA32にdma32_framesフレームあるときに、DMA用に残しておくフレーム数（ゾーンの1/64、最大kDMA32Reserve）
+inline size_t DMA32ReserveFrames(size_t dma32_frames) {
+    return std::min(kDMA32Reserve, dma32_frames / 64);
+}
+
+/// zoneが受け持つフレーム番号の範囲 : [ZoneBegin(zone), ZoneEnd(zone))
+inline size_t ZoneBegin(MemoryZone zone) {
+    return zone == MemoryZone::kDMA32 ? 0 : kDMA32EndFrame;
+}
+inline size_t ZoneEnd(MemoryZone zone) {
+    return zone == MemoryZone::kDMA32 ? kDMA32EndFrame : std::numeric_limits<size_t>::max();
+}
+inline MemoryZone ZoneOf(size_t frame) {
+    return frame < kDMA32EndFrame ? MemoryZone::kDMA32 : MemoryZone::kNormal;
+}
+
 /// メモリ状態（物理フレーム）
 struct MemoryStat {
     size_t allocated_frames;
     size_t total_frames;
 };
 
+/// 断片化状況の集計に用いる次数の数（2^0 ~ 2^(kFragmentationOrders - 1)フレーム）
+static const int kFragmentationOrders{19};
+
+/// 空き領域の断片化状況
+struct FragmentationStat {
+    /// free_blocks[k] : 大きさが[2^k, 2^(k+1))フレームの空きブロック数（最後の要素はそれ以上も含む）
+    std::array<size_t, kFragmentationOrders> free_blocks;
+    size_t free_frames;
+    /// 最大の連続空きブロックのフレーム数
+    size_t largest_free_frames;
+};
+
 /// ビットマップ配列を用いてページフレーム単位でメモリ管理するクラス
 /// 配列alloc_map_の各ビットがページフレームに対応し、0なら空き、1なら使用中
 /// alloc_map_[n]のmビット目が対応する物理アドレスは次の式で求まる
@@ -64,8 +108,9 @@ public:
 
     BitmapMemoryManager();
 
-    /// 要求されたフレーム数の領域を確保して先頭のフレームIDを返す
-    WithError<FrameID> Allocate(size_t num_frames);
+    /// 要求されたフレーム数の領域をzoneから確保して先頭のフレームIDを返す
+    /// kNormalに空きがなければ、DMA32ReserveFrames()を残してkDMA32から確保する
+    WithError<FrameID> Allocate(size_t num_frames, MemoryZone zone = MemoryZone::kNormal);
     Error Free(FrameID start_frame, size_t num_frames);
     // 使用中領域を設定（使用しているのがUEFIなのかこのメモリマネージャーなのかは問わない）
     void MarkAllocated(FrameID start_frame, size_t num_frames);
@@ -76,18 +121,141 @@ public:
 
     /// 現在のメモリ状態
     MemoryStat Stat() const;
+    /// zoneのメモリ状態
+    MemoryStat ZoneStat(MemoryZone zone) const;
+    /// 空き領域の断片化状況
+    FragmentationStat Fragmentation() const;
 
 private:
     /// 1ページフレームを1ビットで表したビットマップ
     std::array<MapLineType, kFrameCount / kBitsPerMapLine> alloc_map_;
+    /// alloc_map_の各行に空きフレームがあるかどうかを1ビットで表したビットマップ（1なら空きあり）
+    std::array<MapLineType, kFrameCount / kBitsPerMapLine / kBitsPerMapLine> summary_map_;
 
     /// このメモリマネージャーで扱うメモリ範囲 : [range_start_, range_end_)
     FrameID range_begin_;
     FrameID range_end_;
+    /// ゾーンごとの、1フレームの割り当てで次に探索を始めるフレーム（ネクストフィット）
+    std::array<size_t, kNumMemoryZones> next_fit_;
+    /// ゾーンごとの、range_内の空きフレーム数
+    std::array<size_t, kNumMemoryZones> zone_free_frames_;
+    /// SetMemoryRange()で4GiB以上のメモリが設定された : true（kNormalの確保を4GiB以上から始める）
+    bool prefer_normal_;
+
+    /// zoneとrange_が重なる範囲 : [ZoneRangeBegin(zone), ZoneRangeEnd(zone))
+    size_t ZoneRangeBegin(MemoryZone zone) const;
+    size_t ZoneRangeEnd(MemoryZone zone) const;
+    /// zoneの中からnum_frames分の空き領域を探して確保する（見つからなければkNullFrame.ID()）
+    size_t AllocateInZone(size_t num_frames, MemoryZone zone);
 
     bool GetBit(FrameID framne) const;
     void SetBit(FrameID frame, bool allocated);
+    /// [begin, end)の範囲で最初の空きフレームを探す（見つからなければend）
+    size_t FindFreeFrame(size_t begin, size_t end) const;
 };
 
-extern BitmapMemoryManager* g_memory_manager;
-void InitializeMemoryManager(const MemoryMap& memory_map);
\ No newline at end of file
+/// バディシステムでページフレームを管理するクラス
+/// 2^kフレーム（次数k）のブロック単位で割り当て、解放時は隣接する相方（バディ）と結合する
+/// 空きブロックは次数ごとのビットマップfree_map_で表し、そのビットマップが非0の行を
+/// summary_で表すことで、空きブロックの探索をワード単位のビット走査で済ませる
+class BuddyMemoryManager {
+public:
+    /// このメモリ管理クラスで扱える最大の物理メモリ量（byte）
+    static const auto kMaxPhysicalMemoryBytes{128_GiB};
+    /// kMaxPhysicalMemoryBytesまでの物理メモリを扱うために必要なページフレーム数
+    static const auto kFrameCount{kMaxPhysicalMemoryBytes / kBytesPerFrame};
+    /// ブロックの最大次数（2^18フレーム = 1GiB）
+    static const int kMaxOrder{kFragmentationOrders - 1};
+
+    /// ビットマップ配列の要素型
+    using MapLineType = unsigned long;
+    static const auto kBitsPerMapLine{8 * sizeof(MapLineType)};
+
+    BuddyMemoryManager();
+
+    /// 要求されたフレーム数の領域をzoneから確保して先頭のフレームIDを返す
+    /// 2のべき乗に切り上げたブロックを確保し、余りのフレームは即座に返却する
+    /// kNormalに空きがなければ、DMA32ReserveFrames()を残してkDMA32から確保する
+    WithError<FrameID> Allocate(size_t num_frames, MemoryZone zone = MemoryZone::kNormal);
+    Error Free(FrameID start_frame, size_t num_frames);
+    void MarkAllocated(FrameID start_frame, size_t num_frames);
+
+    /// このメモリマネージャーで扱うメモリ範囲を設定
+    /// 範囲外のフレームは空きブロックから取り除かれ、以降の割り当て・解放の対象外となる
+    void SetMemoryRange(FrameID range_begin, FrameID range_end);
+
+    /// 現在のメモリ状態
+    MemoryStat Stat() const;
+    /// zoneのメモリ状態
+    MemoryStat ZoneStat(MemoryZone zone) const;
+    /// 空き領域の断片化状況
+    FragmentationStat Fragmentation() const;
+
+private:
+    /// 次数0のビットマップの行数
+    static const auto kOrder0Lines{kFrameCount / kBitsPerMapLine};
+    /// 全次数のビットマップの行数の合計
+    static const auto kFreeMapLines{2 * kOrder0Lines - (kOrder0Lines >> kMaxOrder)};
+
+    /// 次数ごとの空きブロックのビットマップを連結したもの
+    /// 次数kのブロックiが空きなら、MapOffset(k)行目から数えてiビット目が1
+    std::array<MapLineType, kFreeMapLines> free_map_;
+    /// free_map_の各行が非0かどうかを1ビットで表したもの
+    std::array<MapLineType, (kFreeMapLines + kBitsPerMapLine - 1) / kBitsPerMapLine> summary_;
+    /// ゾーン・次数ごとの探索開始行（これより前の行にそのゾーンの空きブロックはない）
+    /// ブロックは最大でも1GiBで、ゾーンの境界（4GiB）をまたがない
+    std::array<std::array<size_t, kMaxOrder + 1>, kNumMemoryZones> search_hint_;
+    /// ゾーン・次数ごとの空きブロック数
+    std::array<std::array<size_t, kMaxOrder + 1>, kNumMemoryZones> free_blocks_;
+    /// ゾーンごとの、range_内の空きフレーム数
+    std::array<size_t, kNumMemoryZones> free_frames_;
+    /// SetMemoryRange()で4GiB以上のメモリが設定された : true（kNormalの確保を4GiB以上から始める）
+    bool prefer_normal_;
+
+    /// このメモリマネージャーで扱うメモリ範囲 : [range_start_, range_end_)
+    FrameID range_begin_;
+    FrameID range_end_;
+
+    static size_t MapOffset(int order) { return 2 * (kOrder0Lines - (kOrder0Lines >> order)); }
+    static size_t MapLines(int order) { return kOrder0Lines >> order; }
+
+    bool IsFreeBlock(size_t frame, int order) const;
+    void PushBlock(size_t frame, int order);
+    void PopBlock(size_t frame, int order);
+    /// zoneの中で空きブロックを探して、その先頭フレームを返す（見つからなければkNullFrame.ID()）
+    size_t FindFreeBlock(int order, MemoryZone zone);
+    /// zoneから次数order以上のブロックを取り出し、orderまで分割して先頭フレームを返す（見つからなければkNullFrame.ID()）
+    size_t AllocateBlock(int order, MemoryZone zone);
+    /// frameを含む空きブロックの次数を返す（frameが使用中なら-1）
+    int FindContainingBlock(size_t frame) const;
+    /// ブロックを解放し、可能な限りバディと結合する
+    void FreeBlock(size_t frame, int order);
+    /// [begin, end)をアラインされたブロックに分解して解放する
+    void FreeRange(size_t begin, size_t end);
+    /// [begin, end)を空きブロックから取り除く
+    void RemoveRange(size_t begin, size_t end);
+};
+
+/// g_memory_managerの実装をビルド時に切り替える（make MEMORY_MANAGER=buddy）
+#ifdef MEMORY_MANAGER_BUDDY
+using MemoryManager = BuddyMemoryManager;
+#else
+using MemoryManager = BitmapMemoryManager;
+#endif
+
+extern MemoryManager* g_memory_manager;
+void InitializeMemoryManager(const MemoryMap& memory_map);
+
+/// 空きフレームがこれを下回ると、メモリが足りなくなったとみなす
+const size_t kLowFrameWatermark{16_MiB / kBytesPerFrame};
+/// 空きフレームがkLowFrameWatermarkを下回っていればtrue
+bool LowOnFrames();
+
+/// メモリが足りなくなったときに呼ぶ関数。溜めておいたメモリを手放す
+using MemoryPressureHandler = void (*)();
+const size_t kMaxMemoryPressureHandlers{8};
+/// handlerを登録する（最大kMaxMemoryPressureHandlers個）
+void AddMemoryPressureHandler(MemoryPressureHandler handler);
+/// 空きフレームが少なければ、登録された関数をワーカタスクで呼ぶ
+/// ヒープを伸ばす途中など、ロックを持っていても呼んでよい
+void CheckMemoryPressure();
@@ -16,16 +16,19 @@ enum class LayerOperation {
 /// 割り込みメッセージ
 struct Message {
     enum Type {
-        kInterruptXHCI,
         kTimerTimeout,
         kKeyPush,
         kLayer,
-        kLayerFinish,
         kMouseMove,
         kMouseButton,
         kWindowActive,
-        kPipe,
         kWindowClose,
+        /// 待っていたファイルが読めるようになった（中身はない。眠っているタスクを起こすためだけに送る）
+        kFileReady,
+        /// 後回しにした処理が積まれた（deferred.hpp。中身はない）
+        kDeferredWork,
+        /// カーネル内のベンチマークのタスク間の往復（kbench.cpp。中身はない）
+        kBenchPing,
     } type;
 
     /// メッセージ送信元のタスクID
@@ -82,12 +85,6 @@ struct Message {
             int activate;
         } window_active;
 
-        /// パイプによる送信データ
-        struct {
-            char data[16];
-            uint8_t len;
-        } pipe;
-
         /// ウィンドウを閉じる
         struct {
             unsigned int layer_id;
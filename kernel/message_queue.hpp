@@ -0,0 +1,106 @@
+/// タスクごとのメッセージキュー
+/// 割り込みハンドラや他のCPUコアからも書き込まれるので、ロックもメモリ確保もせずに追加できる固定長のリングバッファにする
+/// 書き込み側は複数、読み出し側は持ち主のタスクだけ（要素ごとの通し番号で書き込み完了を判定する）
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+
+#include "message.hpp"
+
+class MessageQueue {
+public:
+    /// 溜められるメッセージの最大数（2の冪）
+    static const size_t kCapacity = 256;
+
+    MessageQueue() : cells_{new Cell[kCapacity]} {
+        for (size_t i = 0; i < kCapacity; i++) {
+            cells_[i].seq = i;
+        }
+    }
+
+    /// 満杯なら追加せずに false を返し、捨てた数を数える
+    bool Push(const Message& msg) {
+        size_t pos = __atomic_load_n(&head_, __ATOMIC_RELAXED);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & (kCapacity - 1)];
+            const size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+            const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) { // 空いている。他の書き込み側と取り合う
+                if (__atomic_compare_exchange_n(&head_, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    break;
+                }
+            } else if (diff < 0) { // 1周前の要素がまだ読まれていない
+                __atomic_fetch_add(&dropped_, 1, __ATOMIC_RELAXED);
+                return false;
+            } else { // 他の書き込み側が先に進めた
+                pos = __atomic_load_n(&head_, __ATOMIC_RELAXED);
+            }
+        }
+        cell->msg = msg;
+        // 通し番号を進めて書き込みの完了を読み出し側に知らせる
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    /// 持ち主のタスクだけが呼ぶ
+    std::optional<Message> Pop() {
+        Message msg;
+        if (PopMany(&msg, 1) == 0) {
+            return std::nullopt;
+        }
+        return msg;
+    }
+
+    /// 先頭を取り出さずに返す
+    std::optional<Message> Peek() const {
+        const Cell& cell = cells_[tail_ & (kCapacity - 1)];
+        if (__atomic_load_n(&cell.seq, __ATOMIC_ACQUIRE) != tail_ + 1) {
+            return std::nullopt;
+        }
+        return cell.msg;
+    }
+
+    /// 最大len個をまとめて取り出し、取り出した数を返す
+    /// 書き込み途中の要素があれば、その手前までを返す（書き込み側が終わったときに起こしてくれる）
+    size_t PopMany(Message* msgs, size_t len) {
+        size_t n = 0;
+        for (; n < len; n++) {
+            Cell& cell = cells_[tail_ & (kCapacity - 1)];
+            if (__atomic_load_n(&cell.seq, __ATOMIC_ACQUIRE) != tail_ + 1) {
+                break;
+            }
+            msgs[n] = cell.msg;
+            // 次の周の書き込み側に要素を空ける
+            __atomic_store_n(&cell.seq, tail_ + kCapacity, __ATOMIC_RELEASE);
+            tail_++;
+        }
+        return n;
+    }
+
+    bool Empty() const {
+        return !Peek();
+    }
+
+    /// 満杯で捨てたメッセージの累計
+    size_t Dropped() const {
+        return __atomic_load_n(&dropped_, __ATOMIC_RELAXED);
+    }
+
+private:
+    struct Cell {
+        /// pos番目の要素が書き込み可能ならpos、読み出し可能ならpos + 1
+        size_t seq;
+        Message msg;
+    };
+    std::unique_ptr<Cell[]> cells_;
+    /// 次に書き込む位置（書き込み側が取り合う）
+    size_t head_{0};
+    /// 次に読み出す位置（読み出し側だけが触る）
+    size_t tail_{0};
+    size_t dropped_{0};
+};
@@ -7,6 +7,7 @@
 #include "layer.hpp"
 #include "task.hpp"
 #include "usb/classdriver/mouse.hpp"
+#include "usb/xhci/xhci.hpp"
 
 namespace {
     const char g_mouse_cursor_shape[kMouseCursorHeight][kMouseCursorWidth + 1] = {
@@ -106,24 +107,44 @@ namespace {
 
 void DrawMouseCursor(PixelWriter* pixel_writer, Vector2D<int> position) {
     for (int dy = 0; dy < kMouseCursorHeight; dy++) {
+        PixelColor row[kMouseCursorWidth];
         for (int dx = 0; dx < kMouseCursorWidth; dx++) {
             if (g_mouse_cursor_shape[dy][dx] == '@') {
-                pixel_writer->Write(position + Vector2D<int>{dx, dy}, {0, 0, 0});
+                row[dx] = {0, 0, 0};
             } else if (g_mouse_cursor_shape[dy][dx] == '.') {
-                pixel_writer->Write(position + Vector2D<int>{dx, dy}, {255, 255, 255});
+                row[dx] = {255, 255, 255};
             } else {
-                pixel_writer->Write(position + Vector2D<int>{dx, dy}, kMouseTransparentColor);
+                row[dx] = kMouseTransparentColor;
             }
         }
+        pixel_writer->WriteSpan(position + Vector2D<int>{0, dy}, row, kMouseCursorWidth);
     }
 }
 
 Mouse::Mouse(unsigned int layer_id) : layer_id_{layer_id} {}
 
 void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
+    if (buttons != previous_buttons_) {
+        // クリックやドラッグの始まりの位置がずれないよう、それまでの移動を先に反映する
+        Flush();
+        Apply(buttons, {displacement_x, displacement_y});
+        return;
+    }
+    pending_diff_ = pending_diff_ + Vector2D<int>{displacement_x, displacement_y};
+}
+
+void Mouse::Flush() {
+    if (pending_diff_.x != 0 || pending_diff_.y != 0) {
+        const auto diff = pending_diff_;
+        pending_diff_ = {0, 0};
+        Apply(previous_buttons_, diff);
+    }
+}
+
+void Mouse::Apply(uint8_t buttons, Vector2D<int> displacement) {
     const auto old_pos = position_;
     // マウスの移動範囲を画面内に制限
-    auto new_pos = position_ + Vector2D<int>{displacement_x, displacement_y};
+    auto new_pos = position_ + displacement;
     new_pos = ElementMin(new_pos, ScreenSize() + Vector2D<int>{-1, -1});
     position_ = ElementMax(new_pos, {0, 0});
 
@@ -186,14 +207,22 @@ void InitializeMouse() {
                               .SetWindow(mouse_window)
                               .ID();
 
+    // カーソルは合成せず、移動のたびに画面へ直接描く
+    g_layer_manager->SetCursorLayer(mouse_layer_id);
+
     auto mouse = std::make_shared<Mouse>(mouse_layer_id);
     mouse->SetPosition({200, 200});
     g_layer_manager->UpDown(mouse->LayerID(), std::numeric_limits<int>::max());
+    g_layer_manager->Draw(mouse->LayerID());
 
     // 割り込みイベント登録
     usb::HIDMouseDriver::default_observer = [mouse](uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
         mouse->OnInterrupt(buttons, displacement_x, displacement_y);
     };
+    // 1000Hzのマウスでも、1回のイベント処理で届いた移動は1回の描画とメッセージにまとめる
+    usb::xhci::g_events_processed_observer = [mouse]() {
+        mouse->Flush();
+    };
 
     g_active_layer->SetMouseLayer(mouse_layer_id);
 }
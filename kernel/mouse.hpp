@@ -14,7 +14,10 @@ class Mouse {
 public:
     Mouse(unsigned int layer_id);
     /// 割り込みイベント
+    /// ボタンの状態が変わらない間の移動量は足し合わせておき、Flush()でまとめて1回の移動にする
     void OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t displacement_y);
+    /// 足し合わせてある移動を反映し、アクティブなウィンドウに通知する
+    void Flush();
 
     unsigned int LayerID() const { return layer_id_; }
     void SetPosition(Vector2D<int> pos);
@@ -25,6 +28,11 @@ private:
     Vector2D<int> position_{};
     unsigned int drag_layer_id_{0};
     uint8_t previous_buttons_{0};
+    /// まだ反映していない移動量
+    Vector2D<int> pending_diff_{};
+
+    /// 移動とボタンの状態を1回分反映する
+    void Apply(uint8_t buttons, Vector2D<int> displacement);
 };
 
 void InitializeMouse();
\ No newline at end of file
@@ -4,7 +4,15 @@
 
 #include <cstdint>
 
+static constexpr uint32_t kIA32_TSC_DEADLINE = 0x6e0;
 static constexpr uint32_t kIA32_EFER = 0xc0000080;
 static constexpr uint32_t kIA32_STAR = 0xc0000081;
 static constexpr uint32_t kIA32_LSTAR = 0xc0000082;
 static constexpr uint32_t kIA32_FMASK = 0xc0000084;
+// 性能監視カウンタ（pmu.cpp）
+static constexpr uint32_t kIA32_PMC0 = 0x0c1;
+static constexpr uint32_t kIA32_PERFEVTSEL0 = 0x186;
+static constexpr uint32_t kIA32_FIXED_CTR0 = 0x309; // 完了した命令数
+static constexpr uint32_t kIA32_FIXED_CTR1 = 0x30a; // コアのサイクル数
+static constexpr uint32_t kIA32_FIXED_CTR_CTRL = 0x38d;
+static constexpr uint32_t kIA32_PERF_GLOBAL_CTRL = 0x38f;
@@ -6,14 +6,19 @@ void _exit(void) {
     while (1) __asm__("hlt");
 }
 
-/// program breakとその上限
+/// program breakとその上限（ページがマップされている範囲の末尾）
 caddr_t g_program_break, g_program_break_end;
 
+/// ヒープの末尾がnew_breakを含むようにページをマップ・解放する（memory_manager.cpp）
+/// malloc()などが取るロック（__malloc_lock() / __malloc_unlock()）もmemory_manager.cppにあり、
+/// sbrk()はその中から呼ばれる
+int ResizeKernelHeap(caddr_t new_break);
+
 /// program break を増減
 /// program break : 各プロセスが使えるメモリ領域の末尾アドレス
 /// これを後ろにずらすことで新たなメモリ領域を確保できる
 caddr_t sbrk(int incr) {
-    if (g_program_break == 0 || g_program_break_end <= g_program_break + incr) {
+    if (g_program_break == 0 || ResizeKernelHeap(g_program_break + incr) != 0) {
         errno = ENOMEM;
         return (caddr_t)-1;
     }
@@ -0,0 +1,182 @@
+#include "page_cache.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <utility>
+
+#include "interrupt.hpp"
+#include "memory_manager.hpp"
+
+namespace {
+    /// (ファイルの識別子, ファイル先頭からのページ番号)
+    using PageCacheKey = std::pair<unsigned long, size_t>;
+
+    struct PageCacheEntry {
+        PageCacheKey key;
+        uint8_t* frame;
+        /// アプリにマップされている数。0のページだけ追い出せる
+        size_t map_count;
+        /// 追い出せるページのLRUリストでの前後（マップ中のページはリストにいない）
+        PageCacheEntry* lru_prev;
+        PageCacheEntry* lru_next;
+    };
+
+    std::map<PageCacheKey, PageCacheEntry>* g_page_cache;
+    /// フレームからキーを引くための逆引き（ReleasePageCache用）
+    std::map<const void*, PageCacheKey>* g_page_cache_frames;
+    /// マップされていないページを、参照が古い順に並べたリスト（先頭から追い出す）
+    /// std::mapの要素は消すまで動かないので、要素どうしを直接つなぐ
+    PageCacheEntry* g_lru_head = nullptr;
+    PageCacheEntry* g_lru_tail = nullptr;
+    PageCacheStat g_page_cache_stat{};
+
+    void LRUPushBack(PageCacheEntry& entry) {
+        entry.lru_prev = g_lru_tail;
+        entry.lru_next = nullptr;
+        if (g_lru_tail) {
+            g_lru_tail->lru_next = &entry;
+        } else {
+            g_lru_head = &entry;
+        }
+        g_lru_tail = &entry;
+    }
+
+    void LRURemove(PageCacheEntry& entry) {
+        if (entry.lru_prev) {
+            entry.lru_prev->lru_next = entry.lru_next;
+        } else {
+            g_lru_head = entry.lru_next;
+        }
+        if (entry.lru_next) {
+            entry.lru_next->lru_prev = entry.lru_prev;
+        } else {
+            g_lru_tail = entry.lru_prev;
+        }
+        entry.lru_prev = entry.lru_next = nullptr;
+    }
+
+    /// マップされていないページのうち、最も長く参照されていないものを追い出す
+    bool EvictOnePage() {
+        PageCacheEntry* victim = g_lru_head;
+        if (victim == nullptr) {
+            return false;
+        }
+
+        LRURemove(*victim);
+        const auto frame = victim->frame;
+        g_page_cache_frames->erase(frame);
+        g_page_cache->erase(victim->key);
+        g_memory_manager->Free(FrameID{reinterpret_cast<uintptr_t>(frame) / kBytesPerFrame}, 1);
+        g_page_cache_stat.evictions++;
+        return true;
+    }
+
+    /// キャッシュにあったページを参照する（割り込みを禁止して呼ぶ）
+    uint8_t* UsePage(PageCacheEntry& entry, bool map) {
+        if (entry.map_count > 0) {
+            entry.map_count += map;
+            return entry.frame;
+        }
+        LRURemove(entry);
+        if (map) {
+            entry.map_count = 1;
+            g_page_cache_stat.mapped_pages++;
+        } else {
+            LRUPushBack(entry);
+        }
+        return entry.frame;
+    }
+} // namespace
+
+void InitializePageCache() {
+    g_page_cache = new std::map<PageCacheKey, PageCacheEntry>;
+    g_page_cache_frames = new std::map<const void*, PageCacheKey>;
+}
+
+WithError<uint8_t*> GetPageCache(IFileDescriptor& fd, size_t page_index, bool map) {
+    const auto file_id = fd.FileID();
+    if (file_id == 0) {
+        return {nullptr, MAKE_ERROR(Error::kInvalidFile)};
+    }
+
+    const PageCacheKey key{file_id, page_index};
+    {
+        InterruptGuard guard;
+        if (auto it = g_page_cache->find(key); it != g_page_cache->end()) {
+            g_page_cache_stat.hits++;
+            return {UsePage(it->second, map), MAKE_ERROR(Error::kSuccess)};
+        }
+        g_page_cache_stat.misses++;
+    }
+
+    // フレームの確保とディスクからの読み込みは、割り込みを禁止する区間に入れない
+    // 割り込みが許可されるのは呼び出し元が許可しているとき（システムコール）だけ
+    // ページフォルトの処理（IntHandlerPF）からは割り込みを禁止したまま呼ばれるので、読み込みも禁止したまま行う
+    auto frame = g_memory_manager->Allocate(1);
+    if (frame.error) {
+        return {nullptr, frame.error};
+    }
+    auto p = reinterpret_cast<uint8_t*>(frame.value.Frame());
+    const size_t offset = page_index * kBytesPerFrame;
+    size_t n = 0;
+    if (offset < fd.Size()) {
+        n = fd.Load(p, kBytesPerFrame, offset);
+    }
+    memset(p + n, 0, kBytesPerFrame - n);
+
+    InterruptGuard guard;
+    // 読み込んでいる間に、ほかのタスクが同じページをキャッシュしていたらそちらを使う
+    if (auto it = g_page_cache->find(key); it != g_page_cache->end()) {
+        g_memory_manager->Free(frame.value, 1);
+        return {UsePage(it->second, map), MAKE_ERROR(Error::kSuccess)};
+    }
+    if (g_page_cache->size() >= kPageCacheMaxPages && !EvictOnePage()) {
+        g_memory_manager->Free(frame.value, 1);
+        return {nullptr, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+
+    auto& entry = g_page_cache->insert({key, PageCacheEntry{key, p, 0, nullptr, nullptr}}).first->second;
+    g_page_cache_frames->insert({p, key});
+    LRUPushBack(entry);
+    return {UsePage(entry, map), MAKE_ERROR(Error::kSuccess)};
+}
+
+void ReleasePageCache(const void* frame) {
+    InterruptGuard guard;
+    auto it = g_page_cache_frames->find(frame);
+    if (it == g_page_cache_frames->end()) {
+        return;
+    }
+    auto& entry = (*g_page_cache)[it->second];
+    if (entry.map_count > 0 && --entry.map_count == 0) {
+        g_page_cache_stat.mapped_pages--;
+        // マップが外れたので、追い出せるページの中では最も新しい
+        LRUPushBack(entry);
+    }
+}
+
+void UpdatePageCache(unsigned long file_id, size_t offset, const void* buf, size_t len) {
+    const auto buf8 = reinterpret_cast<const uint8_t*>(buf);
+
+    InterruptGuard guard;
+    const size_t end = offset + len;
+    for (size_t page = offset / kBytesPerFrame; page * kBytesPerFrame < end; page++) {
+        auto it = g_page_cache->find({file_id, page});
+        if (it == g_page_cache->end()) {
+            continue;
+        }
+        const size_t page_begin = page * kBytesPerFrame;
+        const size_t copy_begin = std::max(offset, page_begin);
+        const size_t copy_end = std::min<size_t>(end, page_begin + kBytesPerFrame);
+        memcpy(it->second.frame + (copy_begin - page_begin), buf8 + (copy_begin - offset),
+               copy_end - copy_begin);
+    }
+}
+
+PageCacheStat GetPageCacheStat() {
+    InterruptGuard guard;
+    auto stat = g_page_cache_stat;
+    stat.cached_pages = g_page_cache->size();
+    return stat;
+}
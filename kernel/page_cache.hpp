@@ -0,0 +1,41 @@
+/// ページキャッシュ
+/// ファイル（FATの先頭クラスタで識別）の内容を4KiBページ単位でフレームに保持し、
+/// メモリマップドファイルのページフォルトとファイル読み込みの両方で共有する
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+#include "file.hpp"
+
+/// ページキャッシュに保持する最大ページ（4KiB）数
+const size_t kPageCacheMaxPages = 2048;
+
+/// ページキャッシュの利用状況
+struct PageCacheStat {
+    size_t cached_pages;
+    /// アプリにマップされているページ数
+    size_t mapped_pages;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+};
+
+/// カーネル全体で共有するページキャッシュを初期化
+void InitializePageCache();
+
+/// ファイルのpage_index番目の4KiBページを保持するフレームを得る
+/// キャッシュになければfdから読み込んでキャッシュする。ファイル末尾より後ろは0で埋める
+/// map : アプリにマップする場合はtrue。マップ中のフレームは追い出されない（ReleasePageCacheで手放す）
+/// fd.FileID()が0のファイルはキャッシュできない（kInvalidFile）
+/// キャッシュになければ呼び出し元の割り込みの状態のまま読み込む（ページフォルトの処理からは割り込み禁止のまま）
+WithError<uint8_t*> GetPageCache(IFileDescriptor& fd, size_t page_index, bool map);
+/// GetPageCache(..., true)で得たフレームのマップを解除したことを通知する
+/// ページキャッシュのフレームでなければ何もしない
+void ReleasePageCache(const void* frame);
+/// ファイルへの書き込み内容をキャッシュ済みのページに反映する
+/// offset : ファイル先頭から書き込み位置までのバイト数
+void UpdatePageCache(unsigned long file_id, size_t offset, const void* buf, size_t len);
+PageCacheStat GetPageCacheStat();
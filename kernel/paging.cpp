@@ -1,11 +1,24 @@
 #include "paging.hpp"
 
+#include <algorithm>
 #include <array>
+#include <map>
+#include <vector>
 
 #include "asmfunc.h"
+#include "block.hpp"
+#include "interrupt.hpp"
 #include "logger.hpp"
 #include "memory_manager.hpp"
+#include "page_cache.hpp"
+#include "shm.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
+#include "sync.hpp"
 #include "task.hpp"
+#include "trace.hpp"
+
+extern "C" uint64_t g_cr3_noflush = 0;
 
 namespace {
     const uint64_t kPageSize4K = 4096;
@@ -20,6 +33,64 @@ namespace {
     /// ページディレクトリ（これの要素がページテーブル）
     alignas(kPageSize4K)
         std::array<std::array<uint64_t, 512>, kPageDirectoryCount> g_page_directory;
+    /// カーネルヒープ用のページディレクトリポインタテーブル
+    /// アプリ用のPML4を作る前に用意しておく必要があるので、静的に確保する
+    alignas(kPageSize4K) std::array<uint64_t, 512> g_heap_pdp_table;
+    /// タスクのスタック用のPDPテーブル
+    alignas(kPageSize4K) std::array<uint64_t, 512> g_stack_pdp_table;
+    /// ブートボリューム用のPDPテーブル
+    alignas(kPageSize4K) std::array<uint64_t, 512> g_volume_pdp_table;
+
+    /// Write Combiningにするとき、2MiBページをさらに分けるためのページテーブル（範囲の両端の2つ）
+    alignas(kPageSize4K) std::array<std::array<uint64_t, 512>, 2> g_split_page_tables;
+    size_t g_num_split_page_tables = 0;
+
+    /// PATを使えるか（InitializePAT()で設定）
+    bool g_pat_enabled = false;
+    const uint32_t kIA32PAT = 0x277;
+    /// PA0 WB, PA1 WT, PA2 UC-, PA3 UC, PA4 WC, PA5 WT, PA6 UC-, PA7 UC
+    /// 電源投入時の値からPA4（WB）だけをWC（1）に変えたもの
+    const uint64_t kPATValue = 0x0007040100070406;
+    /// PA4を選ぶビット（PWT = PCD = 0）。4KiBページではbit7、2MiBページではbit12
+    const uint64_t kPATBit4K = 1ull << 7;
+    const uint64_t kPATBit2M = 1ull << 12;
+
+    /// PCID（Process Context Identifier）を使えるか
+    bool g_pcid_enabled = false;
+    /// INVPCID命令を使えるか
+    bool g_invpcid_supported = false;
+    /// PCIDの割り当て状況（bitが1なら使用中）。0はOSカーネル用
+    std::array<uint64_t, kNumPCIDs / 64> g_pcid_bitmap{1};
+
+    /// グローバルページとPCIDを、CPUが対応していれば有効にする
+    void EnableGlobalPagesAndPCID() {
+        std::array<uint32_t, 4> regs; // eax, ebx, ecx, edx
+        ReadCPUID(0, 0, regs.data());
+        const uint32_t max_leaf = regs[0];
+
+        ReadCPUID(1, 0, regs.data());
+        const bool pge = (regs[3] >> 13) & 1;
+        const bool pcid = (regs[2] >> 17) & 1;
+        if (max_leaf >= 7) {
+            ReadCPUID(7, 0, regs.data());
+            g_invpcid_supported = pcid && ((regs[1] >> 10) & 1);
+        }
+
+        uint64_t cr4 = GetCR4();
+        if (pge) {
+            cr4 |= 1ull << 7; // CR4.PGE
+        }
+        if (pcid) {
+            // CR3のPCID（下位12bit）が0のときにしか有効にできない
+            cr4 |= 1ull << 17; // CR4.PCIDE
+        }
+        SetCR4(cr4);
+
+        g_pcid_enabled = pcid;
+        g_cr3_noflush = pcid ? kCR3NoFlush : 0;
+        Log(kInfo, "paging: global pages %s, PCID %s, INVPCID %s\n",
+            pge ? "on" : "off", pcid ? "on" : "off", g_invpcid_supported ? "on" : "off");
+    }
 
     /**
      4階層ページングにおける、仮想アドレスの分割
@@ -41,7 +112,8 @@ void SetupIdentityPageTable() {
     for (int i_pdpt = 0; i_pdpt < g_page_directory.size(); i_pdpt++) {
         g_pdp_table[i_pdpt] = reinterpret_cast<uint64_t>(&g_page_directory[i_pdpt]) | 0x003;
         for (int i_pd = 0; i_pd < 512; i_pd++) {
-            g_page_directory[i_pdpt][i_pd] = i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x083;
+            // OSカーネル用のマッピングは全アドレス空間で共通なので、グローバルページ（bit8）にする
+            g_page_directory[i_pdpt][i_pd] = i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x183;
         }
     }
 
@@ -53,6 +125,75 @@ void SetupIdentityPageTable() {
 
 void InitializePaging() {
     SetupIdentityPageTable();
+    LinearAddress4Level heap_addr{kKernelHeapBase};
+    g_pml4_table[heap_addr.parts.pml4] = reinterpret_cast<uint64_t>(&g_heap_pdp_table[0]) | 0x003;
+    // アプリのPML4は生成時にカーネル部分をコピーするので、スタック用のPDPも先に用意しておく
+    LinearAddress4Level stack_addr{kKernelStackBase};
+    g_pml4_table[stack_addr.parts.pml4] = reinterpret_cast<uint64_t>(&g_stack_pdp_table[0]) | 0x003;
+    LinearAddress4Level volume_addr{kBootVolumeBase};
+    g_pml4_table[volume_addr.parts.pml4] = reinterpret_cast<uint64_t>(&g_volume_pdp_table[0]) | 0x003;
+    EnableGlobalPagesAndPCID();
+    InitializePAT();
+}
+
+void InitializePAT() {
+    std::array<uint32_t, 4> regs; // eax, ebx, ecx, edx
+    ReadCPUID(1, 0, regs.data());
+    if (((regs[3] >> 16) & 1) == 0) { // EDX bit 16 : PAT
+        return;
+    }
+    // これまでPA4を選んでいるページはないので、キャッシュに残る内容は書き換え前後で食い違わない
+    WriteMSR(kIA32PAT, kPATValue);
+    __asm__("wbinvd");
+    g_pat_enabled = true;
+}
+
+Error MapWriteCombining(uint64_t addr, size_t bytes) {
+    if (!g_pat_enabled) {
+        return MAKE_ERROR(Error::kNotImplemented);
+    }
+    const uint64_t begin = addr & ~(kPageSize4K - 1);
+    const uint64_t end = (addr + bytes + kPageSize4K - 1) & ~(kPageSize4K - 1);
+    if (end > kPageDirectoryCount * kPageSize1G) {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    for (uint64_t page2m = begin & ~(kPageSize2M - 1); page2m < end; page2m += kPageSize2M) {
+        auto& pde = g_page_directory[page2m / kPageSize1G][(page2m / kPageSize2M) % 512];
+        const bool huge = pde & 0x80;
+        if (huge && begin <= page2m && page2m + kPageSize2M <= end) {
+            pde |= kPATBit2M;
+            continue;
+        }
+
+        uint64_t* pt;
+        if (huge) {
+            // 一部だけが範囲に入る2MiBページは、同じ属性の4KiBページに分ける
+            if (g_num_split_page_tables >= g_split_page_tables.size()) {
+                return MAKE_ERROR(Error::kFull);
+            }
+            pt = g_split_page_tables[g_num_split_page_tables++].data();
+            for (int i = 0; i < 512; i++) {
+                pt[i] = page2m + i * kPageSize4K | 0x103;
+            }
+            pde = reinterpret_cast<uint64_t>(pt) | 0x003;
+        } else {
+            pt = reinterpret_cast<uint64_t*>(pde & 0x000ffffffffff000);
+        }
+        for (int i = 0; i < 512; i++) {
+            const uint64_t page = page2m + i * kPageSize4K;
+            if (begin <= page && page < end) {
+                pt[i] |= kPATBit4K;
+            }
+        }
+    }
+
+    // グローバルページなのでCR3の再設定では消えない。1ページずつ無効化する
+    for (uint64_t page = begin; page < end; page += kPageSize4K) {
+        InvalidateTLB(page);
+    }
+    __asm__("wbinvd");
+    return MAKE_ERROR(Error::kSuccess);
 }
 
 void ResetCR3() {
@@ -60,14 +201,139 @@ void ResetCR3() {
 }
 
 namespace {
+    /// 0クリア済みフレームのプール（スタックとして使う）
+    std::array<size_t, kZeroedFramePoolSize> g_zeroed_frames{};
+    size_t g_num_zeroed_frames = 0;
+    size_t g_zeroed_pool_hits = 0, g_zeroed_pool_misses = 0;
+
+    /// デマンドページングのフォルト1回で割り当てるページ数
+    size_t g_fault_around_pages = 16;
+
+    /// 再利用を待つページング構造（エントリがすべて0のもの）
+    /// ページング構造の階層（1 : PT ~ 4 : PML4）ごとに分けて持つ
+    struct PageTableCache {
+        std::array<PageMapEntry*, kPageTableCacheSize> tables;
+        size_t num_tables;
+    };
+    std::array<PageTableCache, 5> g_table_caches{};
+    size_t g_table_cache_hits = 0, g_table_cache_misses = 0;
+
+    /// ShareUserPage()で共有されたフレームの参照数（マップしているページ数 + パイプが持っている数）
+    std::map<const void*, size_t>* g_shared_frames = nullptr;
+
+    /// 読み込み専用でマップしていたフレームのマップが外れたことを共有元に伝える
+    /// ShareUserPage()で共有されたフレームなら参照数を減らし、どこからも参照されなくなったら解放する
+    void UnshareFrame(const void* frame) {
+        if (g_shared_frames) {
+            if (auto it = g_shared_frames->find(frame); it != g_shared_frames->end()) {
+                if (--it->second == 0) {
+                    g_shared_frames->erase(it);
+                    g_memory_manager->Free(FrameID{reinterpret_cast<uintptr_t>(frame) / kBytesPerFrame}, 1);
+                }
+                return;
+            }
+        }
+        ReleasePageCache(frame);
+    }
+
+    /// 指定階層のページング構造を生成。キャッシュにあれば0クリアせずに再利用する
+    WithError<PageMapEntry*> NewPageTable(int level) {
+        {
+            InterruptGuard guard;
+            auto& cache = g_table_caches[level];
+            if (cache.num_tables > 0) {
+                g_table_cache_hits++;
+                return {cache.tables[--cache.num_tables], MAKE_ERROR(Error::kSuccess)};
+            }
+            g_table_cache_misses++;
+        }
+        return NewPageMap();
+    }
+
+    /// 不要になったページング構造を返却
+    /// first_index以降のエントリがすべて0で、キャッシュに空きがあれば再利用のために取っておく
+    Error FreePageTable(PageMapEntry* table, int level, int first_index = 0) {
+        bool empty = true;
+        for (int i = first_index; i < 512; i++) {
+            if (table[i].data != 0) {
+                empty = false;
+                break;
+            }
+        }
+
+        if (empty) {
+            InterruptGuard guard;
+            auto& cache = g_table_caches[level];
+            if (cache.num_tables < kPageTableCacheSize) {
+                cache.tables[cache.num_tables++] = table;
+                return MAKE_ERROR(Error::kSuccess);
+            }
+        }
+        return FreePageMap(table);
+    }
+
+    /// 2MiBページに含まれる4KiBページの数
+    const size_t kPagesPer2M = kPageSize2M / kPageSize4K;
+
+    /// 2MiB境界に揃った物理フレームを確保して0クリアする
+    WithError<PageMapEntry*> NewHugePage() {
+        const size_t align_frames = kPageSize2M / kBytesPerFrame;
+        auto [frame, err] = g_memory_manager->Allocate(align_frames);
+        if (err) {
+            return {nullptr, err};
+        }
+
+        // 境界に揃っていなければ、余分に確保して前後の余りを返却する
+        if (frame.ID() % align_frames != 0) {
+            g_memory_manager->Free(frame, align_frames);
+            auto [wide_frame, wide_err] = g_memory_manager->Allocate(2 * align_frames - 1);
+            if (wide_err) {
+                return {nullptr, wide_err};
+            }
+            const size_t begin = (wide_frame.ID() + align_frames - 1) / align_frames * align_frames;
+            g_memory_manager->Free(wide_frame, begin - wide_frame.ID());
+            g_memory_manager->Free(FrameID{begin + align_frames},
+                                   wide_frame.ID() + 2 * align_frames - 1 - (begin + align_frames));
+            frame = FrameID{begin};
+        }
+
+        auto p = reinterpret_cast<PageMapEntry*>(frame.Frame());
+        memset(p, 0, kPageSize2M);
+        return {p, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    /// 2MiBページを、同じ物理フレームを指す512個の4KiBページに分割する
+    /// 書き込み権限は元のページのものを引き継ぐ
+    Error SplitHugePage(PageMapEntry& entry, PageMapAllocCount& alloc) {
+        auto [table, err] = NewPageTable(1);
+        if (err) {
+            return err;
+        }
+        alloc.tables++;
+
+        const auto base = reinterpret_cast<uintptr_t>(entry.Pointer());
+        for (size_t i = 0; i < kPagesPer2M; i++) {
+            table[i].SetPointer(reinterpret_cast<PageMapEntry*>(base + i * kPageSize4K));
+            table[i].bits.present = 1;
+            table[i].bits.user = entry.bits.user;
+            table[i].bits.writable = entry.bits.writable;
+        }
+
+        entry.SetPointer(table);
+        entry.bits.huge_page = 0;
+        entry.bits.writable = 1;
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
     /// 必要に応じて新たなページング構造を生成してエントリに設定
-    WithError<PageMapEntry*> SetNewPageMapIfNotPresent(PageMapEntry& entry) {
+    /// level : entryを含むページング構造の階層。1なら生成するのはページそのもの
+    WithError<PageMapEntry*> SetNewPageMapIfNotPresent(PageMapEntry& entry, int level) {
         // 有効な値が設定済み
         if (entry.bits.present) {
             return {entry.Pointer(), MAKE_ERROR(Error::kSuccess)};
         }
 
-        auto [child_map, err] = NewPageMap();
+        auto [child_map, err] = level == 1 ? NewPageMap() : NewPageTable(level - 1);
         if (err) {
             return {nullptr, err};
         }
@@ -84,16 +350,53 @@ namespace {
     /// addr : LOADセグメントを配置する先頭アドレス
     /// num_4kPages : 4KiBページ単位のセグメントの大きさ
     /// writable : ページへの書き込み権限
+    /// alloc : 確保したフレーム数を足し込む
     /// ret : 未処理のページ数
-    WithError<size_t> SetupPageMap(PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr, size_t num_4kPages, bool writable) {
+    WithError<size_t> SetupPageMap(PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr, size_t num_4kPages, bool writable,
+                                   PageMapAllocCount& alloc) {
         while (num_4kPages > 0) {
             // 仮想アドレスの指定した階層の値
             const auto entry_index = addr.Part(page_map_level);
 
-            auto [child_map, err] = SetNewPageMapIfNotPresent(page_map[entry_index]);
+            if (page_map_level == 2) {
+                auto& entry = page_map[entry_index];
+                // 2MiB境界から512ページ以上を割り当てるなら、ページテーブルを作らずに2MiBページにする
+                if (!entry.bits.present && addr.parts.page == 0 && num_4kPages >= kPagesPer2M) {
+                    auto [huge_frame, err] = NewHugePage();
+                    if (err) {
+                        return {num_4kPages, err};
+                    }
+                    alloc.pages += kPagesPer2M;
+                    entry.SetPointer(huge_frame);
+                    entry.bits.present = 1;
+                    entry.bits.huge_page = 1;
+                    entry.bits.user = 1;
+                    entry.bits.writable = writable;
+                    num_4kPages -= kPagesPer2M;
+                } else if (entry.bits.present && entry.bits.huge_page) { // 設定済みの2MiBページ
+                    entry.bits.writable = writable;
+                    num_4kPages -= std::min<size_t>(num_4kPages, kPagesPer2M - addr.parts.page);
+                }
+
+                if (entry.bits.huge_page) {
+                    if (entry_index == 511) {
+                        break;
+                    }
+                    addr.SetPart(page_map_level, entry_index + 1);
+                    addr.SetPart(1, 0);
+                    continue;
+                }
+            }
+
+            const bool new_map = !page_map[entry_index].bits.present;
+            auto [child_map, err] = SetNewPageMapIfNotPresent(page_map[entry_index], page_map_level);
             if (err) {
                 return {num_4kPages, err};
             }
+            if (new_map) {
+                // 最下層のエントリが指すのはページ、それ以外はページング構造
+                (page_map_level == 1 ? alloc.pages : alloc.tables)++;
+            }
             page_map[entry_index].bits.writable = 1;
             // 権限レベルが最低でも命令フェッチを許可する
             // この関数はアプリ用の階層ページング構造を設定するものなので、OS領域のuserビットは0のまま変更していない
@@ -106,7 +409,7 @@ namespace {
                 num_4kPages--;
             } else {
                 page_map[entry_index].bits.writable = true;
-                auto [num_remain_pages, err] = SetupPageMap(child_map, page_map_level - 1, addr, num_4kPages, writable);
+                auto [num_remain_pages, err] = SetupPageMap(child_map, page_map_level - 1, addr, num_4kPages, writable, alloc);
                 if (err) {
                     return {num_4kPages, err};
                 }
@@ -127,28 +430,63 @@ namespace {
     }
 
     /// 指定階層のページング構造内のエントリをすべて破棄
-    Error CleanPageMap(PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr) {
+    /// budgetを渡すと、ページのエントリをそれだけ外したところで止める（減らした残りを書き戻す）
+    /// 外したエントリは0にしておくので、同じ引数で呼び直せば続きから破棄する
+    Error CleanPageMap(PageMapEntry* page_map, int page_map_level, LinearAddress4Level addr,
+                       size_t* budget = nullptr) {
         for (int i = addr.Part(page_map_level); i < 512; i++) {
             auto entry = page_map[i];
             if (!entry.bits.present) {
                 continue;
             }
+            if (budget && *budget == 0) {
+                return MAKE_ERROR(Error::kSuccess);
+            }
+            if (budget && (page_map_level == 1 || entry.bits.huge_page)) {
+                --*budget;
+            }
+
+            // 2MiBページ
+            if (page_map_level == 2 && entry.bits.huge_page) {
+                if (entry.bits.writable) {
+                    const auto entry_addr = reinterpret_cast<uintptr_t>(entry.Pointer());
+                    if (auto err = g_memory_manager->Free(FrameID{entry_addr / kBytesPerFrame}, kPagesPer2M)) {
+                        return err;
+                    }
+                }
+                page_map[i].data = 0;
+                continue;
+            }
 
             // 深さ優先探索
             if (page_map_level > 1) {
-                if (auto err = CleanPageMap(entry.Pointer(), page_map_level - 1, addr)) {
+                if (auto err = CleanPageMap(entry.Pointer(), page_map_level - 1, addr, budget)) {
                     return err;
                 }
+                // 途中で止めた下位のページング構造は、まだ残しておく
+                if (budget && *budget == 0) {
+                    return MAKE_ERROR(Error::kSuccess);
+                }
             }
 
-            // コピーオンライトでコピーされたページは必ず writable=1 になっている
-            // -> アプリの機械語（.text）や読み込み専用データ（.rodata）が含まれるLOADセグメントが読み込まれたページの物理フレームは解放しない
-            if (entry.bits.writable) {
+            if (page_map_level > 1) {
+                // 下位のページング構造は空になっていれば、キャッシュに返す
+                if (auto err = FreePageTable(entry.Pointer(), page_map_level - 1)) {
+                    return err;
+                }
+            } else if (entry.bits.shared) {
+                // 共有メモリのフレームは、共有メモリがマップされなくなったときに解放される
+            } else if (entry.bits.writable) {
+                // コピーオンライトでコピーされたページは必ず writable=1 になっている
+                // -> アプリの機械語（.text）や読み込み専用データ（.rodata）が含まれるLOADセグメントが読み込まれたページの物理フレームは解放しない
                 const auto entry_addr = reinterpret_cast<uintptr_t>(entry.Pointer());
                 const FrameID map_frame{entry_addr / kBytesPerFrame};
                 if (auto err = g_memory_manager->Free(map_frame, 1)) {
                     return err;
                 }
+            } else {
+                // ページキャッシュやパイプで共有されたフレームなら、マップが外れたことを伝える
+                UnshareFrame(entry.Pointer());
             }
             page_map[i].data = 0;
         }
@@ -157,34 +495,23 @@ namespace {
     }
 
     /// 指定アドレスを含むファイルマッピングを探す
-    const FileMapping* FindFileMapping(const std::vector<FileMapping>& fmaps, uint64_t causal_addr) {
-        for (const FileMapping& m : fmaps) {
-            if (m.vaddr_begin <= causal_addr && causal_addr < m.vaddr_end) {
-                return &m;
-            }
+    FileMapping* FindFileMapping(FileMappings& fmaps, uint64_t causal_addr) {
+        // 開始アドレスがcausal_addr以下で最大のマッピングだけを調べればよい
+        auto it = fmaps.upper_bound(causal_addr);
+        if (it == fmaps.begin()) {
+            return nullptr;
         }
-        return nullptr;
-    }
-
-    /// 指定ページを作成しファイルをコピーする
-    Error PreparePageCache(IFileDescriptor& fd, const FileMapping& m, uint64_t causal_vaddr) {
-        LinearAddress4Level page_vaddr{causal_vaddr};
-        page_vaddr.parts.offset = 0;
-        // 4KiBページ作成
-        if (auto err = SetupPageMaps(page_vaddr, 1)) {
-            return err;
+        --it;
+        if (causal_addr < it->second.vaddr_end) {
+            return &it->second;
         }
-
-        const long file_offset = page_vaddr.value - m.vaddr_begin;
-        void* page_cache = reinterpret_cast<void*>(page_vaddr.value);
-        // ページ（が指すフレーム）にファイルデータをコピー
-        fd.Load(page_cache, 4096, file_offset);
-        return MAKE_ERROR(Error::kSuccess);
+        return nullptr;
     }
 
     /// 物理フレームを書き込み可でマップする
     /// content : 物理フレームを指している
-    Error SetPageContent(PageMapEntry* table, int part, LinearAddress4Level addr, PageMapEntry* content) {
+    Error SetPageContent(PageMapEntry* table, int part, LinearAddress4Level addr, PageMapEntry* content,
+                         PageMapAllocCount& alloc) {
         if (part == 1) {
             const auto i = addr.Part(part);
             table[i].SetPointer(content);
@@ -195,24 +522,324 @@ namespace {
         }
 
         const auto i = addr.Part(part);
-        return SetPageContent(table[i].Pointer(), part - 1, addr, content);
+        if (part == 2 && table[i].bits.huge_page) {
+            if (auto err = SplitHugePage(table[i], alloc)) {
+                return err;
+            }
+        }
+        return SetPageContent(table[i].Pointer(), part - 1, addr, content, alloc);
+    }
+
+    /// OSカーネル用の階層ページング構造から、指定アドレスに対応するページテーブルのエントリを得る
+    /// create : 途中のページング構造がなければ作成する
+    WithError<PageMapEntry*> GetKernelPageEntry(LinearAddress4Level addr, bool create) {
+        auto page_map = reinterpret_cast<PageMapEntry*>(&g_pml4_table[0]);
+        for (int level = 4; level > 1; level--) {
+            auto& entry = page_map[addr.Part(level)];
+            if (!entry.bits.present) {
+                if (!create) {
+                    return {nullptr, MAKE_ERROR(Error::kIndexOutOfRange)};
+                }
+                auto [child_map, err] = SetNewPageMapIfNotPresent(entry, level);
+                if (err) {
+                    return {nullptr, err};
+                }
+                entry.bits.writable = 1;
+            }
+            page_map = entry.Pointer();
+        }
+        return {&page_map[addr.Part(1)], MAKE_ERROR(Error::kSuccess)};
+    }
+
+    /// 現在の階層ページング構造から、指定アドレスを含むページを指すエントリ（PTか2MiBページのPD）を得る
+    /// マップされていなければnullptr
+    PageMapEntry* FindPageEntry(LinearAddress4Level addr) {
+        auto page_map = CR3ToPML4(GetCR3());
+        for (int level = 4; level >= 1; level--) {
+            auto& entry = page_map[addr.Part(level)];
+            if (!entry.bits.present) {
+                return nullptr;
+            }
+            if (level == 1 || (level == 2 && entry.bits.huge_page)) {
+                return &entry;
+            }
+            page_map = entry.Pointer();
+        }
+        return nullptr;
+    }
+
+    bool IsPageMapped(LinearAddress4Level addr) {
+        return FindPageEntry(addr) != nullptr;
+    }
+
+    /// 他と共有するフレームを読み込み専用でマップする
+    /// 書き込まれるとコピーオンライト（CopyOnePage）で専用のフレームに置き換わる
+    /// writable : 共有メモリのフレームとして、書き込み可のまま共有する
+    Error MapSharedFrame(LinearAddress4Level addr, void* frame, PageMapAllocCount& alloc, bool writable = false) {
+        auto page_map = CR3ToPML4(GetCR3());
+        for (int level = 4; level > 1; level--) {
+            auto& entry = page_map[addr.Part(level)];
+            const bool new_map = !entry.bits.present;
+            auto [child_map, err] = SetNewPageMapIfNotPresent(entry, level);
+            if (err) {
+                return err;
+            }
+            if (new_map) {
+                alloc.tables++;
+            }
+            entry.bits.writable = 1;
+            entry.bits.user = 1;
+            page_map = child_map;
+        }
+
+        // writable=0 か shared=1 なので CleanPageMap で解放されることはない
+        auto& entry = page_map[addr.Part(1)];
+        entry.SetPointer(reinterpret_cast<PageMapEntry*>(frame));
+        entry.bits.present = 1;
+        entry.bits.user = 1;
+        entry.bits.writable = writable;
+        entry.bits.shared = writable;
+        return MAKE_ERROR(Error::kSuccess);
     }
 
     /// 4KiBページをコピーして書き込み可でマップする
-    Error CopyOnePage(uint64_t causal_addr) {
+    Error CopyOnePage(uint64_t causal_addr, PageMapAllocCount& alloc) {
         auto [p, err] = NewPageMap();
         if (err) {
             return err;
         }
+        alloc.pages++;
 
         const auto aligned_addr = causal_addr & 0xfffffffffffff000;
         memcpy(p, reinterpret_cast<const void*>(aligned_addr), 4096);
-        return SetPageContent(reinterpret_cast<PageMapEntry*>(GetCR3()), 4, LinearAddress4Level{causal_addr}, p);
+        // コピー元が共有されたフレームなら、もう参照しないことを伝える
+        if (auto entry = FindPageEntry(LinearAddress4Level{causal_addr}); entry && !entry->bits.huge_page) {
+            UnshareFrame(entry->Pointer());
+        }
+        return SetPageContent(CR3ToPML4(GetCR3()), 4, LinearAddress4Level{causal_addr}, p, alloc);
+    }
+
+    /// [addr, addr + 4096 * num_pages) のページのマップを解除する。ページング構造自体は残す
+    /// 書き込み可のページのフレームは解放し、読み込み専用のページは共有元（ページキャッシュなど）に返す
+    /// 2MiBページの一部だけを外すときは分割し、そのページテーブルをallocに足す
+    /// return : 解放したフレーム数
+    WithError<size_t> UnmapPages(uint64_t addr, size_t num_pages, PageMapAllocCount& alloc) {
+        // ページ数が多ければ1ページずつ無効化せず、最後にTLB全体を捨てる
+        const bool flush_all = num_pages > kTLBFlushAllThreshold;
+        size_t freed = 0;
+        for (size_t i = 0; i < num_pages; i++) {
+            const LinearAddress4Level vaddr{addr + 4096 * i};
+            auto entry = FindPageEntry(vaddr);
+            if (entry == nullptr) {
+                continue;
+            }
+            if (entry->bits.huge_page) {
+                if (auto err = SplitHugePage(*entry, alloc)) {
+                    return {freed, err};
+                }
+                entry = FindPageEntry(vaddr);
+            }
+
+            if (entry->bits.shared) {
+                // 共有メモリのフレームは共有メモリ側で解放する
+            } else if (entry->bits.writable) {
+                const FrameID frame{reinterpret_cast<uintptr_t>(entry->Pointer()) / kBytesPerFrame};
+                if (auto err = g_memory_manager->Free(frame, 1)) {
+                    return {freed, err};
+                }
+                freed++;
+            } else {
+                UnshareFrame(entry->Pointer());
+            }
+            entry->data = 0;
+            if (!flush_all) {
+                InvalidateTLB(vaddr.value);
+            }
+        }
+
+        if (flush_all) {
+            if (g_invpcid_supported) {
+                InvalidatePCID(GetCR3() & 0xfff);
+            } else {
+                // CR3の再設定で、グローバルページ以外の（現在のPCIDの）エントリが破棄される
+                SetCR3(GetCR3());
+            }
+        }
+        return {freed, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    /// 解放したフレームをタスクの使用量から差し引く
+    void UnchargeFrames(TaskFrameUsage& usage, size_t& pages, size_t num_frames) {
+        const size_t n = std::min(pages, num_frames);
+        pages -= n;
+        // コピーオンライトで複製されたページも解放している
+        usage.cow_pages -= std::min(usage.cow_pages, num_frames - n);
+    }
+
+    /// 全タスクで共有する、読み込み専用の0クリア済みフレーム
+    PageMapEntry* g_zero_page = nullptr;
+
+    /// 共有ゼロページを読み込み専用でマップする
+    Error MapZeroPage(LinearAddress4Level addr, PageMapAllocCount& alloc) {
+        if (g_zero_page == nullptr) {
+            auto [p, err] = NewPageMap();
+            if (err) {
+                return err;
+            }
+            g_zero_page = p;
+        }
+        return MapSharedFrame(addr, g_zero_page, alloc);
+    }
+
+    /// 指定ページにファイルの内容をマップする
+    /// ページキャッシュに載せられるファイルなら、キャッシュのフレームを読み込み専用で共有する
+    Error PreparePageCache(IFileDescriptor& fd, const FileMapping& m, uint64_t causal_vaddr, PageMapAllocCount& alloc) {
+        LinearAddress4Level page_vaddr{causal_vaddr};
+        page_vaddr.parts.offset = 0;
+        const long file_offset = page_vaddr.value - m.vaddr_begin;
+
+        if (auto [frame, err] = GetPageCache(fd, file_offset / 4096, true); !err) {
+            if (auto err = MapSharedFrame(page_vaddr, frame, alloc)) {
+                ReleasePageCache(frame);
+                return err;
+            }
+            return MAKE_ERROR(Error::kSuccess);
+        }
+
+        // 4KiBページ作成
+        if (auto err = SetupPageMaps(page_vaddr, 1, alloc)) {
+            return err;
+        }
+
+        void* page_cache = reinterpret_cast<void*>(page_vaddr.value);
+        // ページ（が指すフレーム）にファイルデータをコピー
+        fd.Load(page_cache, 4096, file_offset);
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    /// 指定アドレスを含むLOADセグメントを探す
+    const LoadSegment* FindLoadSegment(const std::vector<LoadSegment>& segments, uint64_t causal_addr) {
+        for (const auto& s : segments) {
+            if (s.vaddr <= causal_addr && causal_addr < s.vaddr + s.mem_size) {
+                return &s;
+            }
+        }
+        return nullptr;
+    }
+
+    /// アプリのLOADセグメントのページを用意する
+    /// ファイルの1ページがそのまま対応するページはページキャッシュのフレームを読み込み専用で共有し、
+    /// 書き込まれたらコピーオンライトで複製する。同じアプリを複数起動しても.textや.rodataは1つで済む
+    Error PrepareImagePage(Task& task, uint64_t causal_addr, bool write, PageMapAllocCount& alloc) {
+        const uint64_t page = causal_addr & ~0xfffull;
+        auto& image = *task.ImageFile();
+        const auto& segments = task.LoadSegments();
+
+        for (const auto& s : segments) {
+            if (s.vaddr <= page && page + 4096 <= s.vaddr + s.file_size) {
+                auto [frame, err] = GetPageCache(image, (page - s.vaddr + s.file_offset) / 4096, true);
+                if (err) { // キャッシュできなければ専用のフレームにコピーする
+                    break;
+                }
+                if (auto err = MapSharedFrame(LinearAddress4Level{page}, frame, alloc)) {
+                    ReleasePageCache(frame);
+                    return err;
+                }
+                return MAKE_ERROR(Error::kSuccess);
+            }
+        }
+
+        // ページに含まれるファイル上のデータの範囲
+        auto file_range = [page](const LoadSegment& s) {
+            const uint64_t begin = std::max(page, s.vaddr);
+            const uint64_t end = std::min(page + 4096, s.vaddr + s.file_size);
+            return std::make_pair(begin, end);
+        };
+        const bool has_file_data = std::any_of(segments.begin(), segments.end(), [&](const auto& s) {
+            const auto [begin, end] = file_range(s);
+            return begin < end;
+        });
+        if (!has_file_data && !write) { // .bssだけのページ
+            return MapZeroPage(LinearAddress4Level{page}, alloc);
+        }
+
+        // セグメントの境界や.bssを含むページは、0クリアされた専用のフレームに重なる部分をコピーする
+        if (auto err = SetupPageMaps(LinearAddress4Level{page}, 1, alloc)) {
+            return err;
+        }
+        for (const auto& s : segments) {
+            const auto [begin, end] = file_range(s);
+            if (begin < end) {
+                image.Load(reinterpret_cast<void*>(begin), end - begin, s.file_offset + (begin - s.vaddr));
+            }
+        }
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    /// page_vaddrから最大num_pagesページ分のファイルの内容をマップする（マップ済みのページは飛ばす）
+    /// return : 新たにマップしたページ数
+    WithError<size_t> PrepareFilePages(Task& task, FileMapping& m, uint64_t page_vaddr, size_t num_pages,
+                                       PageMapAllocCount& alloc) {
+        size_t mapped = 0;
+        for (size_t i = 0; i < num_pages; i++) {
+            const uint64_t vaddr = page_vaddr + 4096 * i;
+            if (vaddr >= m.vaddr_end) {
+                break;
+            }
+            if (IsPageMapped(LinearAddress4Level{vaddr})) {
+                continue;
+            }
+            if (auto err = PreparePageCache(*task.Files()[m.fd], m, vaddr, alloc)) {
+                return {mapped, err};
+            }
+            mapped++;
+        }
+        m.next_fault_vaddr = page_vaddr + 4096 * num_pages;
+        return {mapped, MAKE_ERROR(Error::kSuccess)};
     }
 } // namespace
 
-/// 新たなページング構造を生成
+bool RefillZeroedFramePool() {
+    WithError<FrameID> frame{kNullFrame, MAKE_ERROR(Error::kSuccess)};
+    {
+        InterruptGuard guard;
+        if (g_num_zeroed_frames == kZeroedFramePoolSize) {
+            return false;
+        }
+        frame = g_memory_manager->Allocate(1);
+        if (frame.error) {
+            return false;
+        }
+    }
+
+    // 0クリアは割り込みを許可したまま行う
+    memset(frame.value.Frame(), 0, kBytesPerFrame);
+
+    InterruptGuard guard;
+    if (g_num_zeroed_frames == kZeroedFramePoolSize) { // 補充している間に他で満たされた
+        g_memory_manager->Free(frame.value, 1);
+        return false;
+    }
+    g_zeroed_frames[g_num_zeroed_frames++] = frame.value.ID();
+    return true;
+}
+
+ZeroedFramePoolStat GetZeroedFramePoolStat() {
+    InterruptGuard guard;
+    return {g_num_zeroed_frames, g_zeroed_pool_hits, g_zeroed_pool_misses};
+}
+
 WithError<PageMapEntry*> NewPageMap() {
+    {
+        InterruptGuard guard;
+        if (g_num_zeroed_frames > 0) {
+            g_zeroed_pool_hits++;
+            const FrameID frame{g_zeroed_frames[--g_num_zeroed_frames]};
+            return {reinterpret_cast<PageMapEntry*>(frame.Frame()), MAKE_ERROR(Error::kSuccess)};
+        }
+        g_zeroed_pool_misses++;
+    }
+
     auto frame = g_memory_manager->Allocate(1);
     if (frame.error) {
         return {nullptr, frame.error};
@@ -228,23 +855,398 @@ Error FreePageMap(PageMapEntry* table) {
     return g_memory_manager->Free(frame, 1);
 }
 
+WithError<PageMapEntry*> NewAppPML4() {
+    // キャッシュされたPML4は後半部分が0になっている
+    auto [pml4, err] = NewPageTable(4);
+    if (err) {
+        return {nullptr, err};
+    }
+    // OSカーネル用のメモリマッピングは共通なので、前半部分をカーネルのPML4からコピー
+    memcpy(pml4, &g_pml4_table[0], 256 * sizeof(uint64_t));
+    return {pml4, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error FreeAppPML4(PageMapEntry* pml4) {
+    return FreePageTable(pml4, 4, 256);
+}
+
+size_t FaultAroundPages() {
+    return g_fault_around_pages;
+}
+
+void SetFaultAroundPages(size_t pages) {
+    g_fault_around_pages = std::clamp<size_t>(pages, 1, kMaxFaultAroundPages);
+}
+
+Error PrepareUserWrite(uint64_t addr, size_t len) {
+    if (len == 0) {
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    InterruptGuard guard;
+    for (uint64_t page = addr & ~0xfffull; page < addr + len; page += 4096) {
+        auto entry = FindPageEntry(LinearAddress4Level{page});
+        if (entry && !entry->bits.writable) {
+            // アプリ自身が書き込んだ場合と同じくコピーオンライトさせる
+            if (auto err = HandlePageFault(0x7, page)) {
+                return err;
+            }
+        }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+WithError<void*> ShareUserPage(uint64_t addr) {
+    InterruptGuard guard;
+    auto entry = FindPageEntry(LinearAddress4Level{addr});
+    if (addr < kUserAddrBegin || (addr & 0xfff) || entry == nullptr ||
+        entry->bits.huge_page || !entry->bits.user || entry->bits.shared) {
+        return {nullptr, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+
+    void* frame = entry->Pointer();
+    if (!entry->bits.writable) {
+        // 以前に共有したまま書き換えられていないページなら、参照を増やすだけでよい
+        if (g_shared_frames) {
+            if (auto it = g_shared_frames->find(frame); it != g_shared_frames->end()) {
+                it->second++;
+                return {frame, MAKE_ERROR(Error::kSuccess)};
+            }
+        }
+        // ページキャッシュや共有ゼロページのフレームは渡さない
+        return {nullptr, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+
+    if (g_shared_frames == nullptr) {
+        g_shared_frames = new std::map<const void*, size_t>;
+    }
+    // このページと呼び出し元の2つ
+    (*g_shared_frames)[frame] = 2;
+    entry->bits.writable = 0;
+    InvalidateTLB(addr);
+    return {frame, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error MapSharedUserPage(uint64_t addr, void* frame) {
+    InterruptGuard guard;
+    auto entry = FindPageEntry(LinearAddress4Level{addr});
+    if (addr < kUserAddrBegin || (addr & 0xfff) || entry == nullptr ||
+        entry->bits.huge_page || !entry->bits.user || entry->bits.shared) {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    // 元のフレームを手放す。タスクの使用量は、受け取ったフレームの分としてそのまま残す
+    if (entry->bits.writable) {
+        const FrameID old_frame{reinterpret_cast<uintptr_t>(entry->Pointer()) / kBytesPerFrame};
+        if (auto err = g_memory_manager->Free(old_frame, 1)) {
+            return err;
+        }
+    } else {
+        UnshareFrame(entry->Pointer());
+    }
+    entry->SetPointer(reinterpret_cast<PageMapEntry*>(frame));
+    entry->bits.writable = 0;
+    InvalidateTLB(addr);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void ReleaseSharedFrame(const void* frame) {
+    InterruptGuard guard;
+    UnshareFrame(frame);
+}
+
+Error MapReadOnlyPage(uint64_t addr, const void* frame, PageMapAllocCount& alloc) {
+    InterruptGuard guard;
+    return MapSharedFrame(LinearAddress4Level{addr}, const_cast<void*>(frame), alloc);
+}
+
+Error AdviseFileMapping(uint64_t addr, size_t len, MapAdvice advice) {
+    if (addr + len < addr) {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    auto& task = g_task_manager->CurrentTask();
+    uint64_t begin, end;
+    {
+        InterruptGuard guard;
+        auto m = FindFileMapping(task.FileMaps(), addr);
+        if (m == nullptr) {
+            return MAKE_ERROR(Error::kIndexOutOfRange);
+        }
+
+        // 共有メモリは読み込むものがないので、ヒントは受け取るだけ
+        if (advice != MapAdvice::kWillNeed || m->shm) {
+            m->advice = advice;
+            return MAKE_ERROR(Error::kSuccess);
+        }
+        begin = m->vaddr_begin;
+        end = std::min(addr + len, m->vaddr_end);
+    }
+
+    // 指定範囲を先に読み込んでおく。先読みの方針は変えない
+    // フォルト時の先読みと同じページ数ずつ読み込み、その合間は割り込みを許可する
+    uint64_t page_addr = addr & ~0xfffull;
+    while (page_addr < end) {
+        InterruptGuard guard;
+        // 割り込みを許可していた間にマッピングが外されていたら、そこでやめる
+        auto m = FindFileMapping(task.FileMaps(), page_addr);
+        if (m == nullptr || m->vaddr_begin != begin) {
+            break;
+        }
+
+        // ヒントなので、割り当て上限に達したら残りはフォルト時に任せる
+        auto& usage = task.FrameUsage();
+        size_t num_pages = std::min<size_t>(kFilePrefetchPages, (end - page_addr + 4095) / 4096);
+        if (task.FrameLimit() > 0) {
+            if (usage.Total() >= task.FrameLimit()) {
+                break;
+            }
+            num_pages = std::min(num_pages, task.FrameLimit() - usage.Total());
+        }
+
+        const auto next_fault_vaddr = m->next_fault_vaddr;
+        PageMapAllocCount alloc{};
+        auto [mapped, err] = PrepareFilePages(task, *m, page_addr, num_pages, alloc);
+        m->next_fault_vaddr = next_fault_vaddr;
+        usage.page_tables += alloc.tables;
+        usage.file_pages += alloc.pages;
+        if (err) {
+            return err;
+        }
+        page_addr += num_pages * 4096;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error UnmapFileMappings(uint64_t addr, size_t len) {
+    InterruptGuard guard;
+    auto& task = g_task_manager->CurrentTask();
+    auto& fmaps = task.FileMaps();
+    const uint64_t end = addr + len;
+
+    auto it = fmaps.upper_bound(addr);
+    if (it != fmaps.begin() && addr < std::prev(it)->second.vaddr_end) {
+        --it;
+    }
+    while (it != fmaps.end() && it->first < end) {
+        auto& m = it->second;
+        // マッピングと指定範囲が重なる部分のページ
+        const uint64_t unmap_begin = std::max(addr, m.vaddr_begin) & ~0xfffull;
+        const uint64_t unmap_end = std::min(end, m.vaddr_end);
+        PageMapAllocCount alloc{};
+        auto [freed, err] = UnmapPages(unmap_begin, (unmap_end - unmap_begin + 4095) / 4096, alloc);
+        task.FrameUsage().page_tables += alloc.tables;
+        UnchargeFrames(task.FrameUsage(), task.FrameUsage().file_pages, freed);
+        if (err) {
+            return err;
+        }
+
+        if (addr <= m.vaddr_begin && m.vaddr_end <= end) { // マッピング全体が範囲に含まれる
+            // 最も下にあるマッピングなら、その分の仮想アドレス範囲を再利用できる
+            if (m.vaddr_begin == task.FileMapEnd()) {
+                task.SetFileMapEnd(m.vaddr_end);
+            }
+            if (m.shm) {
+                DetachSharedMemory(m.shm);
+            }
+            it = fmaps.erase(it);
+        } else { // 一部だけなら、マッピングは残して次のアクセスで読み直させる
+            ++it;
+        }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error ReleaseDemandPages(uint64_t addr, size_t len) {
+    InterruptGuard guard;
+    auto& task = g_task_manager->CurrentTask();
+    if (addr < task.DPagingBegin() || task.DPagingEnd() < addr + len) {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    // 範囲に完全に含まれるページだけを解放する
+    const uint64_t begin = (addr + 4095) & ~0xfffull;
+    const uint64_t end = (addr + len) & ~0xfffull;
+    if (end <= begin) {
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    PageMapAllocCount alloc{};
+    auto [freed, err] = UnmapPages(begin, (end - begin) / 4096, alloc);
+    task.FrameUsage().page_tables += alloc.tables;
+    UnchargeFrames(task.FrameUsage(), task.FrameUsage().demand_pages, freed);
+    return err;
+}
+
+uint64_t AssignPCID(PageMapEntry* pml4) {
+    const auto cr3 = reinterpret_cast<uint64_t>(pml4);
+    if (!g_pcid_enabled) {
+        return cr3;
+    }
+
+    InterruptGuard guard;
+    for (size_t i = 0; i < g_pcid_bitmap.size(); i++) {
+        if (~g_pcid_bitmap[i] == 0) {
+            continue;
+        }
+        const int bit = __builtin_ctzll(~g_pcid_bitmap[i]);
+        g_pcid_bitmap[i] |= 1ull << bit;
+        return cr3 | (i * 64 + bit);
+    }
+    // PCIDを使い切ったら、OSカーネルと同じPCID 0を使う
+    // PCID 0のCR3はbit63を立てずに保存する（NoFlushCR3()）ので、切り替えのたびにTLBが破棄される
+    return cr3;
+}
+
+void ReleasePCID(uint64_t cr3) {
+    const uint64_t pcid = cr3 & 0xfff;
+    if (!g_pcid_enabled || pcid == 0) {
+        return;
+    }
+
+    InterruptGuard guard;
+    // 次にこのPCIDを使うアドレス空間に古いエントリを見せない
+    // INVPCIDがなくても、AssignPCID後の最初のSetCR3（bit63=0）で破棄される
+    // アプリのCR3を設定するのはBSPだけなので、他のCPUコアのTLBにこのPCIDのエントリは残っていない
+    if (g_invpcid_supported) {
+        InvalidatePCID(pcid);
+    }
+    g_pcid_bitmap[pcid / 64] &= ~(1ull << (pcid % 64));
+}
+
+PageTableCacheStat GetPageTableCacheStat() {
+    InterruptGuard guard;
+    PageTableCacheStat stat{{}, g_table_cache_hits, g_table_cache_misses};
+    for (int level = 1; level <= 4; level++) {
+        stat.cached_tables[level] = g_table_caches[level].num_tables;
+    }
+    return stat;
+}
+
 /// 階層ページング構造の設定。仮想アドレス（ページ）を物理アドレス（フレーム）に割り当てる。
 /// addr : データを配置する先頭アドレス
 /// num_4kPages : 4KiBページ単位のセグメントの大きさ
-Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool writable) {
-    auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
-    return SetupPageMap(pml4_table, 4, addr, num_4kpages, writable).error;
+Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, PageMapAllocCount& alloc, bool writable) {
+    auto pml4_table = CR3ToPML4(GetCR3());
+    return SetupPageMap(pml4_table, 4, addr, num_4kpages, writable, alloc).error;
 }
 
 /// アプリ用のページング構造を破棄（PML4より下層のページング構造を削除）
 Error CleanPageMaps(LinearAddress4Level addr) {
-    auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
+    auto pml4_table = CR3ToPML4(GetCR3());
     return CleanPageMap(pml4_table, 4, addr);
 }
 
+namespace {
+    /// 破棄を待っているアプリのアドレス空間
+    struct DeadAddressSpace {
+        uint64_t cr3;
+        /// まだ解放していないフレームの数（概算）
+        size_t frames;
+    };
+
+    /// 割り込みを禁止したまま一度に外すページのエントリの数
+    const size_t kReapBatchEntries = 256;
+
+    SpinLock g_reap_lock;
+    std::vector<DeadAddressSpace>* g_dead_spaces = nullptr;
+    WaitQueue g_reap_waiters;
+    PageMapReaperStat g_reap_stat{};
+
+    /// cr3のアドレス空間のアプリ用の部分を、kReapBatchEntriesずつ破棄する
+    /// 破棄し終えたらPML4をキャッシュに返し、PCIDを解放する
+    Error ReapAddressSpace(uint64_t cr3) {
+        auto pml4 = CR3ToPML4(cr3);
+        const LinearAddress4Level app_begin{0xffff800000000000};
+        while (true) {
+            size_t budget = kReapBatchEntries;
+            {
+                InterruptGuard guard;
+                if (auto err = CleanPageMap(pml4, 4, app_begin, &budget)) {
+                    return err;
+                }
+            }
+            const size_t reaped = kReapBatchEntries - budget;
+            {
+                SpinLockGuard lock{g_reap_lock};
+                auto& frames = g_dead_spaces->front().frames;
+                frames -= std::min(frames, reaped);
+                g_reap_stat.reaped_entries += reaped;
+            }
+            if (budget > 0) { // 残りがなかった
+                break;
+            }
+        }
+
+        ReleasePCID(cr3);
+        return FreeAppPML4(pml4);
+    }
+
+    void TaskPageMapReaper(uint64_t task_id, int64_t data) {
+        while (true) {
+            uint64_t cr3;
+            {
+                SpinLockGuard lock{g_reap_lock};
+                while (g_dead_spaces->empty()) {
+                    g_reap_waiters.Wait(g_reap_lock);
+                }
+                cr3 = g_dead_spaces->front().cr3;
+            }
+
+            if (auto err = ReapAddressSpace(cr3)) {
+                // 残りのフレームは失われるが、アドレス空間は二度と使われないので先に進む
+                Log(kError, "failed to reap an address space (cr3 %#lx): %s at %s:%d\n",
+                    cr3, err.Name(), err.File(), err.Line());
+            }
+
+            SpinLockGuard lock{g_reap_lock};
+            g_dead_spaces->erase(g_dead_spaces->begin());
+            g_reap_stat.reaped_spaces++;
+        }
+    }
+} // namespace
+
+void ReapAppPML4(uint64_t cr3, size_t frames) {
+    if (g_dead_spaces == nullptr) {
+        // 破棄するタスクがまだいなければ、その場で破棄する
+        auto pml4 = CR3ToPML4(cr3);
+        if (auto err = CleanPageMap(pml4, 4, LinearAddress4Level{0xffff800000000000})) {
+            Log(kError, "failed to clean page maps: %s at %s:%d\n", err.Name(), err.File(), err.Line());
+            return;
+        }
+        ReleasePCID(cr3);
+        FreeAppPML4(pml4);
+        return;
+    }
+
+    SpinLockGuard lock{g_reap_lock};
+    g_dead_spaces->push_back({cr3, frames});
+    g_reap_waiters.WakeAll();
+}
+
+void StartPageMapReaper() {
+    g_dead_spaces = new std::vector<DeadAddressSpace>;
+    // 急がないので、最低の優先度で動かす
+    auto& task = g_task_manager->NewTask().InitContext(TaskPageMapReaper, 0);
+    g_task_manager->Wakeup(&task, 0);
+}
+
+PageMapReaperStat GetPageMapReaperStat() {
+    SpinLockGuard lock{g_reap_lock};
+    auto stat = g_reap_stat;
+    stat.pending_spaces = g_dead_spaces ? g_dead_spaces->size() : 0;
+    stat.pending_frames = 0;
+    if (g_dead_spaces) {
+        for (auto& space : *g_dead_spaces) {
+            stat.pending_frames += space.frames;
+        }
+    }
+    return stat;
+}
+
 /// 階層ページング構造の浅いコピーを行う
 /// PML4, PDP, PD, PTについては新規のテーブルを作成して値をコピーするが、PTが指す物理フレームのコピーは行わない
-Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
+Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start, PageMapAllocCount& alloc) {
     if (part == 1) {
         for (int i = start; i < 512; i++) {
             if (!src[i].bits.present) {
@@ -260,13 +1262,21 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
         if (!src[i].bits.present) {
             continue;
         }
-        auto [table, err] = NewPageMap();
+        // 2MiBページはページテーブルを持たないので、エントリだけを読み込み専用でコピーする
+        if (part == 2 && src[i].bits.huge_page) {
+            dest[i] = src[i];
+            dest[i].bits.writable = 0;
+            continue;
+        }
+
+        auto [table, err] = NewPageTable(part - 1);
         if (err) {
             return err;
         }
+        alloc.tables++;
         dest[i] = src[i];
         dest[i].SetPointer(table);
-        if (auto err = CopyPageMaps(table, src[i].Pointer(), part - 1, 0)) {
+        if (auto err = CopyPageMaps(table, src[i].Pointer(), part - 1, 0, alloc)) {
             return err;
         }
     }
@@ -274,29 +1284,195 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
     return MAKE_ERROR(Error::kSuccess);
 }
 
-Error HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
-    auto& task = g_task_manager->CurrentTask();
-    const bool present = (error_code >> 0) & 1;
-    const bool rw = (error_code >> 1) & 1;
-    const bool user = (error_code >> 2) & 1;
-    if (present && rw && user) { // ページは存在するが読み込み専用なのでユーザーモードの書き込みが失敗
-        // コピーオンライト
-        return CopyOnePage(causal_addr);
-    } else if (present) { // ページは存在するがページレベルの権限違反により例外発生
+Error MapKernelPages(LinearAddress4Level addr, size_t num_4kpages) {
+    for (size_t i = 0; i < num_4kpages; i++, addr.value += kPageSize4K) {
+        auto [entry, err] = GetKernelPageEntry(addr, true);
+        if (err) {
+            return err;
+        }
+        if (entry->bits.present) {
+            continue;
+        }
+
+        auto [frame, alloc_err] = g_memory_manager->Allocate(1);
+        if (alloc_err) {
+            return alloc_err;
+        }
+        entry->SetPointer(reinterpret_cast<PageMapEntry*>(frame.Frame()));
+        entry->bits.writable = 1;
+        entry->bits.global = 1;
+        entry->bits.present = 1;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+Error MapKernelFrame(LinearAddress4Level addr, void* frame) {
+    auto [entry, err] = GetKernelPageEntry(addr, true);
+    if (err) {
+        return err;
+    }
+    if (entry->bits.present) {
         return MAKE_ERROR(Error::kAlreadyAllocated);
     }
+    entry->SetPointer(reinterpret_cast<PageMapEntry*>(frame));
+    entry->bits.writable = 1;
+    entry->bits.global = 1;
+    entry->bits.present = 1;
+    return MAKE_ERROR(Error::kSuccess);
+}
 
-    // デマンドページングの処理
-    if (task.DPagingBegin() <= causal_addr && causal_addr < task.DPagingEnd()) {
-        // ページフォルトの原因となったページに物理フレームを割り当てる
-        return SetupPageMaps(LinearAddress4Level{causal_addr}, 1);
+Error UnmapKernelPages(LinearAddress4Level addr, size_t num_4kpages) {
+    // グローバルページなので、他のCPUコアのTLBにも残っている
+    // 先にすべてのエントリのpresentを落とし、まとめてシュートダウンしてから、エントリに残したアドレスのフレームを返す
+    auto page = addr;
+    for (size_t i = 0; i < num_4kpages; i++, page.value += kPageSize4K) {
+        auto [entry, err] = GetKernelPageEntry(page, false);
+        if (err || !entry->bits.present) {
+            continue;
+        }
+        entry->bits.present = 0;
+    }
+    ShootdownTLB(addr.value, num_4kpages);
+
+    for (size_t i = 0; i < num_4kpages; i++, addr.value += kPageSize4K) {
+        auto [entry, err] = GetKernelPageEntry(addr, false);
+        if (err || entry->data == 0) {
+            continue;
+        }
+        const FrameID frame{reinterpret_cast<uintptr_t>(entry->Pointer()) / kBytesPerFrame};
+        entry->data = 0;
+        if (auto free_err = g_memory_manager->Free(frame, 1)) {
+            return free_err;
+        }
     }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+namespace {
+    /// システム全体のページフォルトの統計
+    PageFaultStat g_fault_stat{};
 
-    // メモリマップドファイルの処理
-    if (auto m = FindFileMapping(task.FileMaps(), causal_addr)) {
-        return PreparePageCache(*task.Files()[m->fd], *m, causal_addr);
+    /// タスクとシステム全体のページフォルトの統計に加算する
+    void CountFault(Task& task, size_t PageFaultStat::*counter, size_t n = 1) {
+        task.FaultStat().*counter += n;
+        g_fault_stat.*counter += n;
     }
 
-    // アプリは事前にアドレス範囲を申告しておくことで、バグによるメモリ枯渇を防ぐ
-    return MAKE_ERROR(Error::kIndexOutOfRange);
+    /// ページフォルトの原因に応じて処理を振り分ける
+    Error ResolvePageFault(Task& task, uint64_t error_code, uint64_t causal_addr) {
+        const bool present = (error_code >> 0) & 1;
+        const bool rw = (error_code >> 1) & 1;
+        const bool user = (error_code >> 2) & 1;
+        if (present && !(rw && user)) { // ページは存在するがページレベルの権限違反により例外発生
+            return MAKE_ERROR(Error::kAlreadyAllocated);
+        }
+
+        // 物理フレームの割り当て上限に達したタスクには、もう割り当てない
+        auto& usage = task.FrameUsage();
+        if (task.FrameLimit() > 0 && usage.Total() >= task.FrameLimit()) {
+            return MAKE_ERROR(Error::kMemoryLimitExceeded);
+        }
+
+        // 処理中に確保したフレーム数を、種類ごとにタスクへ計上する
+        // 確保した関数が数えてallocに足すので、他のCPUコアや割り込みハンドラの確保が混ざらない
+        PageMapAllocCount alloc{};
+        auto account = [&usage, &alloc](size_t& pages, Error err) {
+            usage.page_tables += alloc.tables;
+            pages += alloc.pages;
+            return err;
+        };
+
+        if (present) { // ページは存在するが読み込み専用なのでユーザーモードの書き込みが失敗
+            // コピーオンライト
+            CountFault(task, &PageFaultStat::cow_faults);
+            return account(usage.cow_pages, CopyOnePage(causal_addr, alloc));
+        }
+
+        // デマンドページングの処理
+        if (task.DPagingBegin() <= causal_addr && causal_addr < task.DPagingEnd()) {
+            CountFault(task, &PageFaultStat::demand_faults);
+            // 読み込みだけなら共有ゼロページを見せておき、書き込まれるまでフレームを割り当てない
+            if (!rw) {
+                CountFault(task, &PageFaultStat::zero_page_maps);
+                return account(usage.demand_pages, MapZeroPage(LinearAddress4Level{causal_addr}, alloc));
+            }
+
+            // ページフォルトの原因となったページから後方へまとめて物理フレームを割り当てる
+            // sbrkで確保された領域は先頭から順に触られることが多いので、続くページのフォルトを先回りして潰す
+            // マップ済みのページ（コピーオンライト用の読み込み専用ページなど）に当たったらそこで止める
+            const uint64_t page_addr = causal_addr & ~0xfffull;
+            size_t max_pages = std::min<uint64_t>(g_fault_around_pages,
+                                                  (task.DPagingEnd() - page_addr + 4095) / 4096);
+            if (task.FrameLimit() > 0) {
+                max_pages = std::min(max_pages, task.FrameLimit() - usage.Total());
+            }
+            size_t num_pages = 1;
+            while (num_pages < max_pages &&
+                   !IsPageMapped(LinearAddress4Level{page_addr + 4096 * num_pages})) {
+                num_pages++;
+            }
+
+            const auto err = SetupPageMaps(LinearAddress4Level{page_addr}, num_pages, alloc);
+            if (!err) {
+                CountFault(task, &PageFaultStat::faults_avoided, num_pages - 1);
+            }
+            return account(usage.demand_pages, err);
+        }
+
+        // メモリマップドファイルの処理
+        if (auto m = FindFileMapping(task.FileMaps(), causal_addr)) {
+            CountFault(task, &PageFaultStat::file_faults);
+            if (m->shm) { // 共有メモリのフレームを書き込み可のままマップする
+                const size_t page_index = (causal_addr - m->vaddr_begin) / 4096;
+                auto frame = m->shm->frames + page_index * 4096;
+                return account(usage.file_pages, MapSharedFrame(LinearAddress4Level{causal_addr}, frame, alloc, true));
+            }
+
+            // 直前のフォルトの続きにアクセスしていたら、後続のページを先読みする
+            const uint64_t page_addr = causal_addr & ~0xfffull;
+            const bool sequential = m->advice == MapAdvice::kSequential ||
+                                    (m->advice == MapAdvice::kNormal && page_addr == m->next_fault_vaddr);
+            size_t num_pages = sequential ? kFilePrefetchPages : 1;
+            if (task.FrameLimit() > 0) {
+                num_pages = std::min(num_pages, task.FrameLimit() - usage.Total());
+            }
+
+            auto [mapped, err] = PrepareFilePages(task, *m, page_addr, num_pages, alloc);
+            if (mapped > 1) {
+                CountFault(task, &PageFaultStat::faults_avoided, mapped - 1);
+            }
+            return account(usage.file_pages, err);
+        }
+
+        // 遅延読み込みするアプリのLOADセグメント
+        if (task.ImageFile() && FindLoadSegment(task.LoadSegments(), causal_addr)) {
+            CountFault(task, &PageFaultStat::image_faults);
+            return account(usage.image_pages, PrepareImagePage(task, causal_addr, rw, alloc));
+        }
+
+        // アプリは事前にアドレス範囲を申告しておくことで、バグによるメモリ枯渇を防ぐ
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+} // namespace
+
+Error HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
+    Trace(TraceEvent::kPageFault, error_code, causal_addr);
+    // カーネルがまだ読み込んでいないボリュームに触れた
+    // タスクの初期化より前（fat::Initialize()）にも起きるので、タスクには計上しない
+    if ((error_code & 0x5) == 0 && IsBootVolumeAddress(causal_addr)) {
+        return LoadBootVolumePage(causal_addr);
+    }
+    const uint64_t start = ReadTSC();
+    auto& task = g_task_manager->CurrentTask();
+    auto err = ResolvePageFault(task, error_code, causal_addr);
+    if (err) {
+        CountFault(task, &PageFaultStat::fatal_faults);
+    }
+    CountFault(task, &PageFaultStat::cycles, ReadTSC() - start);
+    return err;
+}
+
+PageFaultStat GetPageFaultStat() {
+    InterruptGuard guard;
+    return g_fault_stat;
 }
@@ -5,6 +5,7 @@
 
 #pragma once
 
+#include <array>
 #include <cstddef>
 #include <cstdint>
 
@@ -16,12 +17,34 @@
 /// kPageDirectoryCount * 1GiBの仮想アドレスがマッピングされることになる
 const size_t kPageDirectoryCount = 64;
 
+/// カーネルヒープを配置する仮想アドレス（PML4の2番目のエントリ）
+/// アイデンティティマッピングされた範囲の外側にあり、物理フレームをページ単位でマップして伸縮させる
+const uint64_t kKernelHeapBase = 0x0000008000000000;
+/// アプリを配置する仮想アドレスの下限（PML4の後半）
+const uint64_t kUserAddrBegin = 0xffff800000000000;
+/// タスクのスタックを配置する仮想アドレス（PML4の3番目のエントリ）
+/// スタックの間には何もマップしないガードページを挟み、あふれたら即座にページフォルトになるようにする
+const uint64_t kKernelStackBase = 0x0000010000000000;
+/// ブートボリュームをブロックデバイスから読むときに、ボリュームを並べる仮想アドレス（PML4の4番目のエントリ）
+/// 初めて触られたページだけをページフォルトで読み込む（一度読んだページは解放しない）
+const uint64_t kBootVolumeBase = 0x0000018000000000;
+/// カーネル内のベンチマーク（kbench.cpp）がページをマップしては外す仮想アドレス（PML4の5番目のエントリ）
+const uint64_t kKernelScratchBase = 0x0000020000000000;
+
 /// 仮想アドレス=物理アドレスとなるようにページテーブルを設定
 /// 最終的にCR3レジスタが正しく設定されたページテーブルを指すようになる
 void SetupIdentityPageTable();
 
 void InitializePaging();
 
+/// PAT（Page Attribute Table）の4番目のエントリ（ページのPATビットだけを立てた組み合わせ）をWrite Combiningにする
+/// PATはCPUごとのMSRなので、APも起動時に呼んで全CPUで同じ設定にする
+void InitializePAT();
+/// アイデンティティマッピングの [addr, addr + bytes) をWrite Combiningにする（フレームバッファ用）
+/// 2MiBページに収まりきらない両端の部分は4KiBページに分け、範囲外のメモリの扱いは変えない
+/// PATに対応していなければ kNotImplemented
+Error MapWriteCombining(uint64_t addr, size_t bytes);
+
 /// CR3がOSカーネル用のPML4を指すように設定
 void ResetCR3();
 
@@ -97,7 +120,9 @@ union PageMapEntry {
         uint64_t dirty : 1;
         uint64_t huge_page : 1;
         uint64_t global : 1;
-        uint64_t : 3;
+        /// 共有メモリのフレーム : 1（書き込み可でもマップを外すときに解放しない）
+        uint64_t shared : 1;
+        uint64_t : 2;
         /// 1つ下位の階層ページング構造の先頭アドレス
         uint64_t addr : 40;
         uint64_t : 12;
@@ -114,11 +139,115 @@ union PageMapEntry {
     }
 };
 
+/// 階層ページング構造を設定する処理が確保した物理フレーム数
+/// 呼び出し元が0で用意して渡し、確保した関数が足し込む。呼び出し元はこれをタスクの使用量に計上する
+struct PageMapAllocCount {
+    /// ページング構造自体
+    size_t tables;
+    /// ページング構造から指されるページ
+    size_t pages;
+};
+
+/// デマンドページングのフォルトアラウンドで一度に割り当てる最大ページ数
+const size_t kMaxFaultAroundPages = 64;
+/// デマンドページングのフォルト1回で、フォルト位置から後方に割り当てるページ数（1なら無効）
+size_t FaultAroundPages();
+/// 1 ~ kMaxFaultAroundPages に丸めて設定する
+void SetFaultAroundPages(size_t pages);
+
+/// 0クリア済みフレームプールの状態
+struct ZeroedFramePoolStat {
+    /// プールに溜まっているフレーム数
+    size_t pooled_frames;
+    /// プールから取り出せた回数
+    size_t hits;
+    /// プールが空で、その場で0クリアした回数
+    size_t misses;
+};
+
+/// 0クリア済みフレームプールに溜めておく最大フレーム数
+const size_t kZeroedFramePoolSize = 128;
+/// 0クリア済みフレームを1つ補充する（アイドルタスクから呼ばれる）
+/// プールが満杯、またはフレームを確保できなかった場合はfalse
+bool RefillZeroedFramePool();
+ZeroedFramePoolStat GetZeroedFramePoolStat();
+
+/// 新たなページング構造（0クリアされたフレーム）を生成
+/// 0クリア済みフレームプールに残りがあれば、そこから取り出す
 WithError<PageMapEntry*> NewPageMap();
 Error FreePageMap(PageMapEntry* table);
-Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool writable = true);
+
+/// CR3のbit63。PCIDが有効なとき、これを立ててCR3を設定するとそのPCIDのTLBエントリが保持される
+const uint64_t kCR3NoFlush = 1ull << 63;
+/// PCIDの数（CR3の下位12bit）
+const size_t kNumPCIDs = 4096;
+/// PCIDが有効ならkCR3NoFlush、そうでなければ0（コンテキスト保存時にCR3へ付け足す）
+extern "C" uint64_t g_cr3_noflush;
+
+/// コンテキストに保存するCR3の値。PCIDが0でなければbit63を立て、復帰時にTLBを保持させる
+/// PCID 0はOSカーネルと、PCIDを使い切ったときのアプリで共有するので、復帰のたびに破棄させる
+inline uint64_t NoFlushCR3(uint64_t cr3) {
+    return (cr3 & 0xfff) ? cr3 | g_cr3_noflush : cr3;
+}
+
+/// CR3の値からPML4の先頭アドレスを取り出す（PCIDやフラグを取り除く）
+inline PageMapEntry* CR3ToPML4(uint64_t cr3) {
+    return reinterpret_cast<PageMapEntry*>(cr3 & 0x000ffffffffff000);
+}
+
+/// アプリ用のPML4にPCIDを割り当て、CR3に設定する値を返す
+/// PCIDが使えなければPML4のアドレスそのもの
+/// 返り値をbit63=0のままCR3に設定すると、再利用されたPCIDに残っていた古いエントリが破棄される
+uint64_t AssignPCID(PageMapEntry* pml4);
+/// AssignPCID()で割り当てたPCIDを返却する
+/// 破棄するのは実行中のCPUコアのTLBだけ。アプリのアドレス空間はBSPでしか使わない（SetupPML4()でBSPに固定する）
+void ReleasePCID(uint64_t cr3);
+
+/// 再利用のために階層ごとに取っておくページング構造の最大数
+const size_t kPageTableCacheSize = 64;
+
+/// ページング構造キャッシュの状態
+struct PageTableCacheStat {
+    /// 階層（1 : PT ~ 4 : PML4）ごとのキャッシュされているページング構造の数
+    std::array<size_t, 5> cached_tables;
+    size_t hits;
+    size_t misses;
+};
+PageTableCacheStat GetPageTableCacheStat();
+
+/// アプリ用のPML4を生成する。前半部分（OSカーネル用）はカーネルのPML4のコピー
+/// 破棄されたPML4がキャッシュにあれば再利用し、前半部分のコピーだけで済ませる
+WithError<PageMapEntry*> NewAppPML4();
+/// NewAppPML4()で生成したPML4を破棄する。後半部分が空ならキャッシュに返す
+Error FreeAppPML4(PageMapEntry* pml4);
+/// 破棄を待っているアプリのアドレス空間の状態
+struct PageMapReaperStat {
+    /// 破棄を待っているアドレス空間の数と、それらがまだ持っているフレームの数（概算）
+    size_t pending_spaces, pending_frames;
+    /// 破棄し終えたアドレス空間の数と、外したページのエントリの数
+    uint64_t reaped_spaces, reaped_entries;
+};
+/// アプリが終わったアドレス空間（cr3）の後半部分を、裏のタスクで少しずつ破棄するよう預ける
+/// frames : アドレス空間が持っているフレームの数（memstatの表示に使う）
+/// CR3は切り替えておくこと。PML4とPCIDは破棄し終えてから解放する
+void ReapAppPML4(uint64_t cr3, size_t frames);
+/// 預かったアドレス空間を破棄するタスクを起動する。それまではReapAppPML4()がその場で破棄する
+void StartPageMapReaper();
+PageMapReaperStat GetPageMapReaperStat();
+
+/// 確保したフレーム数をallocに足す
+Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, PageMapAllocCount& alloc, bool writable = true);
 Error CleanPageMaps(LinearAddress4Level addr);
-Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start);
+Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start, PageMapAllocCount& alloc);
+/// OSカーネル用の階層ページング構造に、新たな物理フレームを割り当てたページを追加する
+/// アプリのページング構造はPML4の前半部分を共有しているので、どのタスクからも見える
+Error MapKernelPages(LinearAddress4Level addr, size_t num_4kpages);
+/// OSカーネル用の階層ページング構造に、指定の物理フレームを1ページだけマップする
+/// 既にマップされていれば kAlreadyAllocated（フレームは呼び出し元が持ったまま）
+Error MapKernelFrame(LinearAddress4Level addr, void* frame);
+/// MapKernelPages()で追加したページを取り除き、物理フレームを解放する
+/// 解放する前に、すべてのCPUコアのTLBからエントリを破棄する（ShootdownTLB()）
+Error UnmapKernelPages(LinearAddress4Level addr, size_t num_4kpages);
 /// デマンドページング : 初めはどのページに対してもフレームを割り当てないでおき、
 /// ページに初めてアクセスされたときにそのページだけフレームを割り当てる
 /// ページフォルトのエラーコードのビット定義 :
@@ -128,3 +257,79 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start);
 /// 2       | U/S   | 0 = スーパーバイザーモードのアクセス、1 = ユーザーモードのアクセス
 /// 3       | RSVD  | 0 = 予約ビットの違反が例外の原因ではない、1 = 予約ビットが1になっている
 Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
+
+/// パイプでのフレームの受け渡し（コピーオンライトの仕組みを使う）
+/// 実行中タスクの addr（4KiB境界）のページを読み込み専用にして、そのフレームを返す
+/// 以降にアプリがこのページへ書き込むと、コピーオンライトで専用のフレームに置き換わる
+/// 返したフレームの参照は呼び出し元が持つ（ReleaseSharedFrameかMapSharedUserPageで手放す）
+/// 書き込み可の4KiBページ（または以前に共有したページ）でなければ kIndexOutOfRange
+WithError<void*> ShareUserPage(uint64_t addr);
+/// ShareUserPage()で得たフレームを、実行中タスクの addr（4KiB境界）のページに読み込み専用でマップする
+/// 成功すればフレームの参照はページに引き継がれ、元々マップされていたフレームは手放される
+/// マップ済みのアプリのページでなければ kIndexOutOfRange（参照は呼び出し元に残る）
+Error MapSharedUserPage(uint64_t addr, void* frame);
+/// ShareUserPage()で得たフレームの参照を手放す。どこからも参照されなくなれば解放する
+void ReleaseSharedFrame(const void* frame);
+/// カーネルが持ち続けるフレームを、実行中タスクの addr（4KiB境界）に読み込み専用でマップする
+/// アプリが終了してもフレームは解放されない。途中のページング構造に確保したフレーム数はallocに足す
+Error MapReadOnlyPage(uint64_t addr, const void* frame, PageMapAllocCount& alloc);
+
+/// メモリマップドファイルへのアクセス方法のヒント
+/// 値はapps/syscall.hのMAP_ADVICE_*と一致させる
+enum class MapAdvice {
+    /// 連続したアクセスを検出したら先読みする
+    kNormal,
+    /// 常に先読みする
+    kSequential,
+    /// 先読みしない
+    kRandom,
+    /// 指定範囲をすぐに読み込む
+    kWillNeed,
+};
+
+/// 連続アクセスを検出したメモリマップドファイルで、フォルト1回あたりに読み込むページ数
+const size_t kFilePrefetchPages = 8;
+
+/// 実行中タスクの、addrを含むメモリマップドファイルにアクセス方法のヒントを与える
+/// MapAdvice::kWillNeedなら [addr, addr + len) をすぐに読み込む（割り当て上限を超える分は読み込まない）
+Error AdviseFileMapping(uint64_t addr, size_t len, MapAdvice advice);
+
+/// 実行中タスクのメモリマップドファイルのうち、[addr, addr + len) と重なる部分のマップを解除する
+/// マッピング全体が範囲に含まれていればマッピングごと削除し、一部だけなら該当ページのみ破棄する
+/// 共有メモリのマッピングも同じように扱い、マッピングごと削除したら共有メモリのマップ数を減らす
+Error UnmapFileMappings(uint64_t addr, size_t len);
+
+/// 実行中タスクのデマンドページング範囲のうち、[addr, addr + len) に完全に含まれるページのフレームを解放する
+/// 範囲は予約されたまま残るので、再びアクセスすると新しいフレームが割り当てられる
+Error ReleaseDemandPages(uint64_t addr, size_t len);
+
+/// ページのマップを解除するとき、これより多くのページをまとめて解除するならTLB全体を破棄する
+const size_t kTLBFlushAllThreshold = 32;
+
+/// ページフォルトの統計（タスクごと、およびシステム全体）
+/// apps/syscall.hのstruct PageFaultStatと同じ並びにする
+struct PageFaultStat {
+    /// デマンドページング範囲でのフォルト数
+    size_t demand_faults;
+    /// メモリマップドファイルでのフォルト数
+    size_t file_faults;
+    /// 遅延読み込みするLOADセグメントでのフォルト数
+    size_t image_faults;
+    /// コピーオンライトでページを複製した回数
+    size_t cow_faults;
+    /// 処理できずアプリの強制終了に至ったフォルト数
+    size_t fatal_faults;
+    /// HandlePageFault()で費やしたTSCのサイクル数
+    uint64_t cycles;
+    /// フォルトアラウンドや先読みで先回りして割り当てたことにより発生しなかったフォルト数
+    size_t faults_avoided;
+    /// 読み込みのみのフォルトで共有ゼロページをマップした回数
+    size_t zero_page_maps;
+};
+/// システム全体のページフォルトの統計
+PageFaultStat GetPageFaultStat();
+
+/// OSがアプリのメモリ領域 [addr, addr + len) に書き込む前に呼ぶ
+/// CR0.WP=0 なのでOSの書き込みではページフォルトが起きず、共有ゼロページやコピーオンライト中のページを
+/// 書き換えてしまう。読み込み専用でマップされているページを事前にコピーしておく
+Error PrepareUserWrite(uint64_t addr, size_t len);
@@ -6,8 +6,14 @@
 
 #include "pci.hpp"
 
+#include <algorithm>
+#include <tuple>
+
+#include "acpi.hpp"
 #include "asmfunc.h"
 #include "logger.hpp"
+#include "paging.hpp"
+#include "smp.hpp"
 
 namespace {
     using namespace pci;
@@ -23,6 +29,68 @@ namespace {
                | shl(bus, 16) | shl(device, 11) | shl(function, 8) | (reg_addr & 0xfcu);
     }
 
+    /// ECAMの領域（MCFGのセグメント0のエントリ）。baseが0ならI/Oポートを使う
+    struct ECAMRegion {
+        uint64_t base;
+        uint8_t start_bus, end_bus;
+    } g_ecam{};
+
+    void SetupECAM() {
+        g_ecam = {};
+        if (acpi::g_mcfg == nullptr) {
+            return;
+        }
+        const auto& mcfg = *acpi::g_mcfg;
+        auto entries = reinterpret_cast<const acpi::MCFGEntry*>(&mcfg + 1);
+        const size_t num_entries = (mcfg.header.length - sizeof(mcfg)) / sizeof(acpi::MCFGEntry);
+        for (size_t i = 0; i < num_entries; ++i) {
+            if (entries[i].segment_group != 0) {
+                continue;
+            }
+            // 恒等写像していない所にあるなら使わない（I/Oポートで読み書きする）
+            const uint64_t end = entries[i].base_address +
+                                 (static_cast<uint64_t>(entries[i].end_bus - entries[i].start_bus + 1) << 20);
+            if (end > kPageDirectoryCount * (1ul << 30)) {
+                Log(kWarn, "PCI: ECAM at %08lx is not mapped\n", entries[i].base_address);
+                return;
+            }
+            g_ecam = {entries[i].base_address, entries[i].start_bus, entries[i].end_bus};
+            Log(kInfo, "PCI: ECAM at %08lx (bus %u-%u)\n",
+                g_ecam.base, g_ecam.start_bus, g_ecam.end_bus);
+            return;
+        }
+    }
+
+    /// ECAMでのレジスタのアドレス。ECAMの範囲外ならnullptr
+    volatile uint32_t* ECAMAddress(uint8_t bus, uint8_t device,
+                                   uint8_t function, uint8_t reg_addr) {
+        if (g_ecam.base == 0 || bus < g_ecam.start_bus || g_ecam.end_bus < bus) {
+            return nullptr;
+        }
+        const uint64_t offset = (static_cast<uint64_t>(bus - g_ecam.start_bus) << 20) |
+                                (static_cast<uint64_t>(device) << 15) |
+                                (static_cast<uint64_t>(function) << 12) | (reg_addr & 0xfcu);
+        return reinterpret_cast<volatile uint32_t*>(g_ecam.base + offset);
+    }
+
+    /// コンフィグレーション空間の32ビットレジスタを読む（ECAMがあれば1回のメモリアクセスで済む）
+    uint32_t ReadConfig(uint8_t bus, uint8_t device, uint8_t function, uint8_t reg_addr) {
+        if (auto p = ECAMAddress(bus, device, function, reg_addr)) {
+            return *p;
+        }
+        WriteAddress(MakeAddress(bus, device, function, reg_addr));
+        return ReadData();
+    }
+
+    void WriteConfig(uint8_t bus, uint8_t device, uint8_t function, uint8_t reg_addr, uint32_t value) {
+        if (auto p = ECAMAddress(bus, device, function, reg_addr)) {
+            *p = value;
+            return;
+        }
+        WriteAddress(MakeAddress(bus, device, function, reg_addr));
+        WriteData(value);
+    }
+
     /** @brief g_devices[g_num_device] に情報を書き込み g_num_device をインクリメントする． */
     Error AddDevice(const Device& device) {
         if (g_num_device == g_devices.size()) {
@@ -43,6 +111,26 @@ namespace {
         auto class_code = ReadClassCode(bus, device, function);
         auto header_type = ReadHeaderType(bus, device, function);
         Device dev{bus, device, function, header_type, class_code};
+        const uint32_t id = ReadConfig(bus, device, function, 0x00);
+        dev.vendor_id = id & 0xffffu;
+        dev.device_id = id >> 16;
+
+        // ステータスレジスタのbit4が立っていればケイパビリティリストがある
+        if ((ReadConfig(bus, device, function, 0x04) >> 16) & 0x10u) {
+            uint8_t cap_addr = ReadConfig(bus, device, function, 0x34) & 0xfcu;
+            // 壊れたリストで回り続けないよう、たどる数に上限を設ける
+            for (int n = 0; cap_addr != 0 && n < 48; ++n) {
+                const uint32_t header = ReadConfig(bus, device, function, cap_addr);
+                if (dev.num_capabilities < kMaxCapabilities) {
+                    dev.capabilities[dev.num_capabilities++] = {
+                        static_cast<uint8_t>(header & 0xffu), cap_addr};
+                }
+                cap_addr = (header >> 8) & 0xfcu;
+            }
+        }
+        // 覚えきれなかったら、探すときにたどり直す
+        dev.capabilities_cached = dev.num_capabilities < kMaxCapabilities;
+
         if (auto err = AddDevice(dev)) {
             return err;
         }
@@ -163,12 +251,59 @@ namespace {
         return MAKE_ERROR(Error::kSuccess);
     }
 
-    /// 指定された MSI レジスタを設定する
+    /// MSI-X テーブルの先頭 num_msgs 個のエントリに、msg_addr と msg_data[i] を設定して有効にする
+    /// テーブルのエントリ数より多く指定した分は無視する
+    Error ConfigureMSIXTable(const Device& dev, uint8_t cap_addr, uint32_t msg_addr,
+                             const uint32_t* msg_data, unsigned int num_msgs) {
+        const uint32_t header = ReadConfReg(dev, cap_addr);
+        const unsigned int table_size = ((header >> 16) & 0x7ffu) + 1;
+        const uint32_t table_offset = ReadConfReg(dev, cap_addr + 4);
+
+        // テーブルは BIR 番目の BAR が指すメモリ空間の中にある
+        const unsigned int bir = table_offset & 0x7u;
+        const uint32_t bar = ReadConfReg(dev, CalcBarAddress(bir));
+        uint64_t bar_addr = bar & ~static_cast<uint64_t>(0xf);
+        if (bar & 4u) {
+            bar_addr |= static_cast<uint64_t>(ReadConfReg(dev, CalcBarAddress(bir + 1))) << 32;
+        }
+        auto table = reinterpret_cast<volatile uint32_t*>(bar_addr + (table_offset & ~0x7u));
+
+        // Function Mask を立てて、書き換えている途中のエントリから割り込みが来ないようにする
+        const uint32_t kEnable = 1u << 31, kFunctionMask = 1u << 30;
+        WriteConfReg(dev, cap_addr, header | kEnable | kFunctionMask);
+        for (unsigned int i = 0; i < table_size; ++i) {
+            auto entry = &table[4 * i];
+            if (i < num_msgs) {
+                entry[0] = msg_addr;
+                entry[1] = 0;
+                entry[2] = msg_data[i];
+                entry[3] = 0; // マスクを外す
+            } else {
+                entry[3] = 1;
+            }
+        }
+        WriteConfReg(dev, cap_addr, (header | kEnable) & ~kFunctionMask);
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    /// 指定された MSI-X レジスタを設定する（1 つ目のエントリだけを使う）
     Error ConfigureMSIXRegister(const Device& dev, uint8_t cap_addr,
                                 uint32_t msg_addr, uint32_t msg_data,
                                 unsigned int num_vector_exponent) {
-        return MAKE_ERROR(Error::kNotImplemented);
+        return ConfigureMSIXTable(dev, cap_addr, msg_addr, &msg_data, 1);
     }
+
+    /// MSI / MSI-X のメッセージのアドレスとデータ
+    std::pair<uint32_t, uint32_t> MakeMSIMessage(uint8_t apic_id, pci::MSITriggerMode trigger_mode,
+                                                 pci::MSIDeliveryMode delivery_mode, uint8_t vector) {
+        uint32_t msg_addr = 0xfee00000u | (apic_id << 12);
+        uint32_t msg_data = (static_cast<uint32_t>(delivery_mode) << 8) | vector;
+        if (trigger_mode == pci::MSITriggerMode::kLevel) {
+            msg_data |= 0xc000;
+        }
+        return {msg_addr, msg_data};
+    }
+
 } // namespace
 
 namespace pci {
@@ -185,23 +320,19 @@ namespace pci {
     }
 
     uint16_t ReadVendorId(uint8_t bus, uint8_t device, uint8_t function) {
-        WriteAddress(MakeAddress(bus, device, function, 0x00));
-        return ReadData() & 0xffffu;
+        return ReadConfig(bus, device, function, 0x00) & 0xffffu;
     }
 
     uint16_t ReadDeviceId(uint8_t bus, uint8_t device, uint8_t function) {
-        WriteAddress(MakeAddress(bus, device, function, 0x00));
-        return ReadData() >> 16;
+        return ReadConfig(bus, device, function, 0x00) >> 16;
     }
 
     uint8_t ReadHeaderType(uint8_t bus, uint8_t device, uint8_t function) {
-        WriteAddress(MakeAddress(bus, device, function, 0x0c));
-        return (ReadData() >> 16) & 0xffu;
+        return (ReadConfig(bus, device, function, 0x0c) >> 16) & 0xffu;
     }
 
     ClassCode ReadClassCode(uint8_t bus, uint8_t device, uint8_t function) {
-        WriteAddress(MakeAddress(bus, device, function, 0x08));
-        auto reg = ReadData();
+        auto reg = ReadConfig(bus, device, function, 0x08);
         ClassCode cc;
         cc.base = (reg >> 24) & 0xffu;
         cc.sub = (reg >> 16) & 0xffu;
@@ -210,8 +341,7 @@ namespace pci {
     }
 
     uint32_t ReadBusNumbers(uint8_t bus, uint8_t device, uint8_t function) {
-        WriteAddress(MakeAddress(bus, device, function, 0x18));
-        return ReadData();
+        return ReadConfig(bus, device, function, 0x18);
     }
 
     bool IsSingleFunctionDevice(uint8_t header_type) {
@@ -220,6 +350,7 @@ namespace pci {
 
     Error ScanAllBus() {
         g_num_device = 0;
+        SetupECAM();
 
         auto header_type = ReadHeaderType(0, 0, 0);
         if (IsSingleFunctionDevice(header_type)) {
@@ -237,14 +368,36 @@ namespace pci {
         return MAKE_ERROR(Error::kSuccess);
     }
 
+    bool UsingECAM() {
+        return g_ecam.base != 0;
+    }
+
+    uint8_t FindCapability(const Device& dev, uint8_t cap_id) {
+        if (dev.capabilities_cached) {
+            for (int i = 0; i < dev.num_capabilities; ++i) {
+                if (dev.capabilities[i].id == cap_id) {
+                    return dev.capabilities[i].addr;
+                }
+            }
+            return 0;
+        }
+        uint8_t cap_addr = ReadConfReg(dev, 0x34) & 0xffu;
+        while (cap_addr != 0) {
+            auto header = ReadCapabilityHeader(dev, cap_addr);
+            if (header.bits.cap_id == cap_id) {
+                return cap_addr;
+            }
+            cap_addr = header.bits.next_ptr;
+        }
+        return 0;
+    }
+
     uint32_t ReadConfReg(const Device& dev, uint8_t reg_addr) {
-        WriteAddress(MakeAddress(dev.bus, dev.device, dev.function, reg_addr));
-        return ReadData();
+        return ReadConfig(dev.bus, dev.device, dev.function, reg_addr);
     }
 
     void WriteConfReg(const Device& dev, uint8_t reg_addr, uint32_t value) {
-        WriteAddress(MakeAddress(dev.bus, dev.device, dev.function, reg_addr));
-        WriteData(value);
+        WriteConfig(dev.bus, dev.device, dev.function, reg_addr, value);
     }
 
     WithError<uint64_t> ReadBar(Device& device, unsigned int bar_index) {
@@ -278,17 +431,8 @@ namespace pci {
     }
 
     Error ConfigureMSI(const Device& device, uint32_t msg_addr, uint32_t msg_data, unsigned int num_vector_exponent) {
-        uint8_t cap_addr = ReadConfReg(device, 0x34) & 0xffu;
-        uint8_t msi_cap_addr = 0, msix_cap_addr = 0;
-        while (cap_addr != 0) {
-            auto header = ReadCapabilityHeader(device, cap_addr);
-            if (header.bits.cap_id == kCapabilityMSI) {
-                msi_cap_addr = cap_addr;
-            } else if (header.bits.cap_id == kCapabilityMSIX) {
-                msix_cap_addr = cap_addr;
-            }
-            cap_addr = header.bits.next_ptr;
-        }
+        const uint8_t msi_cap_addr = FindCapability(device, kCapabilityMSI);
+        const uint8_t msix_cap_addr = FindCapability(device, kCapabilityMSIX);
 
         if (msi_cap_addr) {
             return ConfigureMSIRegister(device, msi_cap_addr, msg_addr, msg_data, num_vector_exponent);
@@ -302,13 +446,88 @@ namespace pci {
         const Device& device, uint8_t apic_id,
         MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
         uint8_t vector, unsigned int num_vector_exponent) {
-        uint32_t msg_addr = 0xfee00000u | (apic_id << 12);
-        uint32_t msg_data = (static_cast<uint32_t>(delivery_mode) << 8) | vector;
-        if (trigger_mode == MSITriggerMode::kLevel) {
-            msg_data |= 0xc000;
-        }
+        const auto [msg_addr, msg_data] = MakeMSIMessage(apic_id, trigger_mode, delivery_mode, vector);
         return ConfigureMSI(device, msg_addr, msg_data, num_vector_exponent);
     }
+
+    WithError<unsigned int> ConfigureMSIXFixedDestination(
+        const Device& device, uint8_t apic_id,
+        MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
+        const uint8_t* vectors, unsigned int num_vectors) {
+        const uint8_t cap_addr = FindCapability(device, kCapabilityMSIX);
+        if (cap_addr == 0) {
+            return {0, MAKE_ERROR(Error::kNoPCIMSI)};
+        }
+        const unsigned int table_size = ((ReadConfReg(device, cap_addr) >> 16) & 0x7ffu) + 1;
+        num_vectors = std::min(num_vectors, table_size);
+
+        uint32_t msg_addr = 0;
+        uint32_t msg_data[kMaxMSIXVectors];
+        num_vectors = std::min(num_vectors, kMaxMSIXVectors);
+        for (unsigned int i = 0; i < num_vectors; ++i) {
+            std::tie(msg_addr, msg_data[i]) = MakeMSIMessage(apic_id, trigger_mode, delivery_mode, vectors[i]);
+        }
+
+        // MSI と MSI-X は同時に有効にしない
+        if (const uint8_t msi_cap_addr = FindCapability(device, kCapabilityMSI)) {
+            auto msi_cap = ReadMSICapability(device, msi_cap_addr);
+            msi_cap.header.bits.msi_enable = 0;
+            WriteMSICapability(device, msi_cap_addr, msi_cap);
+        }
+        if (auto err = ConfigureMSIXTable(device, cap_addr, msg_addr, msg_data, num_vectors)) {
+            return {0, err};
+        }
+        return {num_vectors, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    WithError<DeviceInterrupts> AssignInterrupts(
+        const Device& device, const char* name, InterruptHandler handler,
+        unsigned int num_vectors, int cpu, MSITriggerMode trigger_mode) {
+        DeviceInterrupts irqs{};
+        irqs.cpu = 0 <= cpu && cpu < NumCPUs() ? cpu : 0;
+        const uint8_t apic_id = GetCPUInfo(irqs.cpu).lapic_id;
+
+        // MSI-Xのテーブルより多くは割り当てない。MSIなら1つ
+        unsigned int max_vectors = 1;
+        if (const uint8_t cap_addr = FindCapability(device, kCapabilityMSIX)) {
+            max_vectors = ((ReadConfReg(device, cap_addr) >> 16) & 0x7ffu) + 1;
+        } else if (FindCapability(device, kCapabilityMSI) == 0) {
+            return {irqs, MAKE_ERROR(Error::kNoPCIMSI)};
+        }
+        num_vectors = std::clamp(num_vectors, 1u, std::min(max_vectors, kMaxMSIXVectors));
+
+        auto release_from = [&irqs](unsigned int first, unsigned int last) {
+            for (unsigned int i = first; i < last; ++i) {
+                FreeInterruptVector(irqs.vectors[i]);
+            }
+        };
+        for (unsigned int i = 0; i < num_vectors; ++i) {
+            auto vector = AllocateInterruptVector(name, handler, i, irqs.cpu);
+            if (vector.error) {
+                release_from(0, i);
+                return {irqs, vector.error};
+            }
+            irqs.vectors[i] = vector.value;
+        }
+
+        const auto msix = ConfigureMSIXFixedDestination(
+            device, apic_id, trigger_mode, MSIDeliveryMode::kFixed, irqs.vectors.data(), num_vectors);
+        if (!msix.error) {
+            release_from(msix.value, num_vectors);
+            irqs.num_vectors = msix.value;
+            irqs.msix = true;
+            return {irqs, MAKE_ERROR(Error::kSuccess)};
+        }
+
+        release_from(1, num_vectors);
+        if (auto err = ConfigureMSIFixedDestination(
+                device, apic_id, trigger_mode, MSIDeliveryMode::kFixed, irqs.vectors[0], 0)) {
+            release_from(0, 1);
+            return {irqs, err};
+        }
+        irqs.num_vectors = 1;
+        return {irqs, MAKE_ERROR(Error::kSuccess)};
+    }
 } // namespace pci
 
 void InitializePCI() {
@@ -320,9 +539,9 @@ void InitializePCI() {
 
     for (int i = 0; i < pci::g_num_device; i++) {
         const auto& device = pci::g_devices[i];
-        auto vendor_id = pci::ReadVendorId(device);
-        auto class_code = pci::ReadClassCode(device.bus, device.device, device.function);
-        Log(kDebug, "%d.%d.%d: vend %04x, class %08x, head %02x\n",
-            device.bus, device.device, device.function, vendor_id, class_code, device.header_type);
+        Log(kDebug, "%d.%d.%d: vend %04x, class %02x.%02x.%02x, head %02x\n",
+            device.bus, device.device, device.function, device.vendor_id,
+            device.class_code.base, device.class_code.sub, device.class_code.interface,
+            device.header_type);
     }
 }
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include <cstdint>
 
 #include "error.hpp"
+#include "interrupt.hpp"
 
 namespace pci {
     /// CONFIG_ADDRESSレジスタのIOポートアドレス
@@ -28,12 +29,26 @@ namespace pci {
         }
     };
 
+    /// ScanAllBus()が覚えておくケイパビリティの最大数（デバイスごと）
+    const int kMaxCapabilities = 12;
+
+    /// ケイパビリティのIDと、そのコンフィグレーション空間アドレス
+    struct CapabilityEntry {
+        uint8_t id, addr;
+    };
+
     /// PCIデバイスを操作するための基礎データを格納する
     /// バス番号，デバイス番号，ファンクション番号はデバイスを特定するのに必須．
     /// その他の情報は単に利便性のために加えてある．
     struct Device {
         uint8_t bus, device, function, header_type;
         ClassCode class_code;
+        /// 以下はScanAllBus()が列挙のときに読んでおく（コンフィグレーション空間を読み直さずに済むように）
+        uint16_t vendor_id{0xffffu}, device_id{0xffffu};
+        /// ケイパビリティリストを読んだ : true（falseなら、探すときにコンフィグレーション空間をたどる）
+        bool capabilities_cached{false};
+        uint8_t num_capabilities{0};
+        std::array<CapabilityEntry, kMaxCapabilities> capabilities{};
     };
 
     /// ScanAllBus()により発見されたPCIデバイスの一覧
@@ -52,6 +67,9 @@ namespace pci {
     /// ベンダIDレジスタを読み込む（全ヘッダタイプ共通）
     uint16_t ReadVendorId(uint8_t bus, uint8_t device, uint8_t function);
     inline uint16_t ReadVendorId(const Device& dev) {
+        if (dev.vendor_id != 0xffffu) {
+            return dev.vendor_id;
+        }
         return ReadVendorId(dev.bus, dev.device, dev.function);
     }
     /// デバイスIDレジスタを読み込む（全ヘッダタイプ共通）
@@ -84,8 +102,15 @@ namespace pci {
     /// PCIデバイスをすべて探索しdevicesに格納する
     /// バス0から再帰的にPCIデバイスを探索し，devicesの先頭から詰めて書き込む．
     /// 発見したデバイスの数をnum_devicesに設定する．
+    /// ACPIにMCFGがあれば，以降のコンフィグレーション空間の読み書きはECAM（メモリマップ）で行う．
     Error ScanAllBus();
 
+    /// ECAMでコンフィグレーション空間を読み書きしている : true
+    bool UsingECAM();
+
+    /// cap_idのケイパビリティのアドレス（なければ0）。ScanAllBus()で見つけたデバイスなら覚えておいたものを返す
+    uint8_t FindCapability(const Device& dev, uint8_t cap_id);
+
     constexpr uint8_t CalcBarAddress(unsigned int bar_index) {
         return 0x10 + 4 * bar_index;
     }
@@ -165,6 +190,33 @@ namespace pci {
         const Device& device, uint8_t apic_id,
         MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
         uint8_t vector, unsigned int num_vector_exponent);
+
+    /// ConfigureMSIXFixedDestinationで一度に設定できるベクタの数
+    const unsigned int kMaxMSIXVectors = 8;
+    /// MSI-Xを使い、テーブルのi番目の割り込みをvectors[i]に届くようにする（デバイスごとにベクタを分けられる）
+    /// MSI-Xがなければ kNoPCIMSI を返す。戻り値は設定できたベクタの数（テーブルが小さければnum_vectorsより少ない）
+    WithError<unsigned int> ConfigureMSIXFixedDestination(
+        const Device& device, uint8_t apic_id,
+        MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
+        const uint8_t* vectors, unsigned int num_vectors);
+
+    /// AssignInterrupts()でデバイスに割り当てた割り込み
+    struct DeviceInterrupts {
+        std::array<uint8_t, kMaxMSIXVectors> vectors;
+        unsigned int num_vectors;
+        /// MSI-Xで設定した : true（MSIならベクタは1つだけ）
+        bool msix;
+        /// 割り込みを受けるCPUコア
+        int cpu;
+    };
+
+    /// 最大num_vectors個のベクタを割り当て（AllocateInterruptVector()）、デバイスのi番目の割り込み（MSI-Xのテーブルのi番目）で
+    /// handler(i)が呼ばれるようにする。MSI-Xがなければ、MSIで1つだけ割り当てる。どちらもなければ kNoPCIMSI
+    /// cpu : 割り込みを受けるCPUコア（smp.hppの番号。起動していなければBSP）
+    WithError<DeviceInterrupts> AssignInterrupts(
+        const Device& device, const char* name, InterruptHandler handler,
+        unsigned int num_vectors, int cpu = 0,
+        MSITriggerMode trigger_mode = MSITriggerMode::kLevel);
 } // namespace pci
 
 void InitializePCI();
\ No newline at end of file
@@ -0,0 +1,488 @@
+#include "pixel_ops.hpp"
+
+#include <array>
+#include <cstring>
+#include <immintrin.h>
+
+#include "asmfunc.h"
+#include "fpu.hpp"
+#include "logger.hpp"
+
+namespace {
+    uint32_t SwapRB(uint32_t p) {
+        return (p & 0xff00ff00u) | ((p >> 16) & 0xffu) | ((p & 0xffu) << 16);
+    }
+
+    void CopyPixelsScalar(void* dst, const void* src, size_t num_pixels) {
+        memcpy(dst, src, 4 * num_pixels);
+    }
+
+    void FillPixelsScalar(void* dst, uint32_t pixel, size_t num_pixels) {
+        auto d = reinterpret_cast<uint32_t*>(dst);
+        for (size_t i = 0; i < num_pixels; i++) {
+            d[i] = pixel;
+        }
+    }
+
+    void ConvertPixelsScalar(void* dst, const void* src, size_t num_pixels) {
+        auto d = reinterpret_cast<uint32_t*>(dst);
+        auto s = reinterpret_cast<const uint32_t*>(src);
+        for (size_t i = 0; i < num_pixels; i++) {
+            d[i] = SwapRB(s[i]);
+        }
+    }
+
+    void CopyPixelsTransparentScalar(void* dst, const void* src, uint32_t transparent,
+                                     size_t num_pixels) {
+        auto d = reinterpret_cast<uint32_t*>(dst);
+        auto s = reinterpret_cast<const uint32_t*>(src);
+        transparent &= 0xffffffu;
+        for (size_t i = 0; i < num_pixels; i++) {
+            if ((s[i] & 0xffffffu) != transparent) {
+                d[i] = s[i];
+            }
+        }
+    }
+
+    void FillPixelsMaskedScalar(void* dst, const uint8_t* mask, size_t first_bit, uint32_t pixel,
+                                size_t num_pixels) {
+        auto d = reinterpret_cast<uint32_t*>(dst);
+        for (size_t i = 0; i < num_pixels; i++) {
+            const size_t bit = first_bit + i;
+            if (mask[bit >> 3] & (0x80u >> (bit & 7))) {
+                d[i] = pixel;
+            }
+        }
+    }
+
+    /// 0〜255 * 255の値を255で割って丸める
+    uint32_t Div255(uint32_t x) {
+        x += 128;
+        return (x + (x >> 8)) >> 8;
+    }
+
+    /// 上位8ビットの透明度とalphaから、そのピクセルの不透明度を求める
+    uint32_t PixelAlpha(uint32_t pixel, uint32_t alpha) {
+        return Div255((255 - (pixel >> 24)) * alpha);
+    }
+
+    void BlendPixelsScalar(void* dst, const void* src, uint32_t alpha, bool per_pixel,
+                           size_t num_pixels) {
+        auto d = reinterpret_cast<uint32_t*>(dst);
+        auto s = reinterpret_cast<const uint32_t*>(src);
+        for (size_t i = 0; i < num_pixels; i++) {
+            const uint32_t a = per_pixel ? PixelAlpha(s[i], alpha) : alpha;
+            uint32_t r = 0;
+            for (int shift = 0; shift < 32; shift += 8) {
+                const uint32_t sc = (s[i] >> shift) & 0xffu, dc = (d[i] >> shift) & 0xffu;
+                r |= Div255(sc * a + dc * (255 - a)) << shift;
+            }
+            d[i] = r;
+        }
+    }
+
+    void ExpandRGB24Scalar(void* dst, const uint8_t* src, bool swap_rb, size_t num_pixels) {
+        auto d = reinterpret_cast<uint32_t*>(dst);
+        for (size_t i = 0; i < num_pixels; i++) {
+            const uint32_t p = src[3 * i] | (src[3 * i + 1] << 8) | (src[3 * i + 2] << 16);
+            d[i] = swap_rb ? SwapRB(p) : p;
+        }
+    }
+
+    void ExpandGray8Scalar(void* dst, const uint8_t* src, size_t num_pixels) {
+        auto d = reinterpret_cast<uint32_t*>(dst);
+        for (size_t i = 0; i < num_pixels; i++) {
+            d[i] = src[i] * 0x010101u;
+        }
+    }
+
+    void ConvertRGBA32Scalar(void* dst, const void* src, bool swap_rb, bool keep_alpha,
+                             size_t num_pixels) {
+        auto d = reinterpret_cast<uint32_t*>(dst);
+        auto s = reinterpret_cast<const uint32_t*>(src);
+        for (size_t i = 0; i < num_pixels; i++) {
+            const uint32_t p = swap_rb ? SwapRB(s[i]) : s[i];
+            // 上位8ビットは不透明度を反転した透明度にする
+            d[i] = (p & 0xffffffu) | (keep_alpha ? ~p & 0xff000000u : 0);
+        }
+    }
+
+    /// bitビット目からの8ビットを取り出す（上位ビットが左）。8の倍数でなければ次のバイトも読む
+    uint32_t MaskByteAt(const uint8_t* mask, size_t bit) {
+        const size_t shift = bit & 7;
+        if (shift == 0) {
+            return mask[bit >> 3];
+        }
+        return ((mask[bit >> 3] << shift) | (mask[(bit >> 3) + 1] >> (8 - shift))) & 0xffu;
+    }
+
+    // SSE2はx86-64なら必ず使える。フレームバッファの行はそろっているとは限らないので、境界を問わない命令を使う
+    void CopyPixelsSSE2(void* dst, const void* src, size_t num_pixels) {
+        auto d = reinterpret_cast<uint8_t*>(dst);
+        auto s = reinterpret_cast<const uint8_t*>(src);
+        size_t i = 0;
+        for (; i + 8 <= num_pixels; i += 8) {
+            const auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 4 * i));
+            const auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 4 * i + 16));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + 4 * i), a);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + 4 * i + 16), b);
+        }
+        CopyPixelsScalar(d + 4 * i, s + 4 * i, num_pixels - i);
+    }
+
+    void FillPixelsSSE2(void* dst, uint32_t pixel, size_t num_pixels) {
+        auto d = reinterpret_cast<uint8_t*>(dst);
+        const auto v = _mm_set1_epi32(pixel);
+        size_t i = 0;
+        for (; i + 8 <= num_pixels; i += 8) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + 4 * i), v);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + 4 * i + 16), v);
+        }
+        FillPixelsScalar(d + 4 * i, pixel, num_pixels - i);
+    }
+
+    void ConvertPixelsSSE2(void* dst, const void* src, size_t num_pixels) {
+        auto d = reinterpret_cast<uint8_t*>(dst);
+        auto s = reinterpret_cast<const uint8_t*>(src);
+        const auto keep = _mm_set1_epi32(0xff00ff00u);
+        const auto low = _mm_set1_epi32(0xffu);
+        size_t i = 0;
+        for (; i + 4 <= num_pixels; i += 4) {
+            const auto p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 4 * i));
+            const auto r = _mm_or_si128(
+                _mm_and_si128(p, keep),
+                _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 16), low),
+                             _mm_slli_epi32(_mm_and_si128(p, low), 16)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + 4 * i), r);
+        }
+        ConvertPixelsScalar(d + 4 * i, s + 4 * i, num_pixels - i);
+    }
+
+    void CopyPixelsTransparentSSE2(void* dst, const void* src, uint32_t transparent,
+                                   size_t num_pixels) {
+        auto d = reinterpret_cast<uint8_t*>(dst);
+        auto s = reinterpret_cast<const uint8_t*>(src);
+        const auto color_mask = _mm_set1_epi32(0xffffff);
+        const auto tc = _mm_set1_epi32(transparent & 0xffffffu);
+        size_t i = 0;
+        for (; i + 4 <= num_pixels; i += 4) {
+            const auto sp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 4 * i));
+            const auto dp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(d + 4 * i));
+            // 透過色のピクセルだけ全ビットが立つ
+            const auto is_tc = _mm_cmpeq_epi32(_mm_and_si128(sp, color_mask), tc);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + 4 * i),
+                             _mm_or_si128(_mm_and_si128(is_tc, dp), _mm_andnot_si128(is_tc, sp)));
+        }
+        CopyPixelsTransparentScalar(d + 4 * i, s + 4 * i, transparent, num_pixels - i);
+    }
+
+    void FillPixelsMaskedSSE2(void* dst, const uint8_t* mask, size_t first_bit, uint32_t pixel,
+                              size_t num_pixels) {
+        auto d = reinterpret_cast<uint8_t*>(dst);
+        const auto p = _mm_set1_epi32(pixel);
+        const auto bits_hi = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10);
+        const auto bits_lo = _mm_setr_epi32(0x08, 0x04, 0x02, 0x01);
+        size_t i = 0;
+        for (; i + 8 <= num_pixels; i += 8) {
+            const auto m = _mm_set1_epi32(MaskByteAt(mask, first_bit + i));
+            // ビットが立っているピクセルだけ全ビットが立つ
+            const auto sel_hi = _mm_cmpeq_epi32(_mm_and_si128(m, bits_hi), bits_hi);
+            const auto sel_lo = _mm_cmpeq_epi32(_mm_and_si128(m, bits_lo), bits_lo);
+            auto d_hi = reinterpret_cast<__m128i*>(d + 4 * i);
+            auto d_lo = reinterpret_cast<__m128i*>(d + 4 * i + 16);
+            _mm_storeu_si128(d_hi, _mm_or_si128(_mm_and_si128(sel_hi, p),
+                                                _mm_andnot_si128(sel_hi, _mm_loadu_si128(d_hi))));
+            _mm_storeu_si128(d_lo, _mm_or_si128(_mm_and_si128(sel_lo, p),
+                                                _mm_andnot_si128(sel_lo, _mm_loadu_si128(d_lo))));
+        }
+        FillPixelsMaskedScalar(d + 4 * i, mask, first_bit + i, pixel, num_pixels - i);
+    }
+
+    /// 16ビットの要素ごとに255で割って丸める
+    __m128i Div255SSE2(__m128i x) {
+        x = _mm_add_epi16(x, _mm_set1_epi16(128));
+        return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+    }
+
+    /// 16ビットの要素ごとに (s * a + d * (255 - a)) / 255
+    __m128i Blend16SSE2(__m128i s, __m128i d, __m128i a) {
+        const auto ia = _mm_sub_epi16(_mm_set1_epi16(255), a);
+        return Div255SSE2(_mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, ia)));
+    }
+
+    void BlendPixelsSSE2(void* dst, const void* src, uint32_t alpha, bool per_pixel,
+                         size_t num_pixels) {
+        auto d = reinterpret_cast<uint8_t*>(dst);
+        auto s = reinterpret_cast<const uint8_t*>(src);
+        const auto zero = _mm_setzero_si128();
+        const auto alpha16 = _mm_set1_epi16(alpha);
+        size_t i = 0;
+        for (; i + 4 <= num_pixels; i += 4) {
+            const auto sp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 4 * i));
+            const auto dp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(d + 4 * i));
+            // 1チャネル16ビットに広げ、下位の2ピクセルと上位の2ピクセルに分けて計算する
+            auto a_lo = alpha16, a_hi = alpha16;
+            if (per_pixel) {
+                // 32ビットの要素ごとに不透明度を求め、それぞれのピクセルの4チャネルに配る
+                const auto opacity = _mm_sub_epi32(_mm_set1_epi32(255), _mm_srli_epi32(sp, 24));
+                auto a = Div255SSE2(_mm_mullo_epi16(opacity, _mm_set1_epi32(alpha)));
+                a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+                a_lo = _mm_unpacklo_epi32(a, a);
+                a_hi = _mm_unpackhi_epi32(a, a);
+            }
+            const auto lo = Blend16SSE2(_mm_unpacklo_epi8(sp, zero), _mm_unpacklo_epi8(dp, zero), a_lo);
+            const auto hi = Blend16SSE2(_mm_unpackhi_epi8(sp, zero), _mm_unpackhi_epi8(dp, zero), a_hi);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + 4 * i), _mm_packus_epi16(lo, hi));
+        }
+        BlendPixelsScalar(d + 4 * i, s + 4 * i, alpha, per_pixel, num_pixels - i);
+    }
+
+    void ExpandGray8SSE2(void* dst, const uint8_t* src, size_t num_pixels) {
+        auto d = reinterpret_cast<uint8_t*>(dst);
+        const auto color_mask = _mm_set1_epi32(0xffffff);
+        size_t i = 0;
+        for (; i + 16 <= num_pixels; i += 16) {
+            const auto g = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            // 1バイトを2回、さらに2バイトを2回並べると、1ピクセル4バイトに同じ値が並ぶ
+            const auto g2_lo = _mm_unpacklo_epi8(g, g), g2_hi = _mm_unpackhi_epi8(g, g);
+            const __m128i g4[4] = {_mm_unpacklo_epi16(g2_lo, g2_lo), _mm_unpackhi_epi16(g2_lo, g2_lo),
+                                   _mm_unpacklo_epi16(g2_hi, g2_hi), _mm_unpackhi_epi16(g2_hi, g2_hi)};
+            for (int j = 0; j < 4; j++) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(d + 4 * i + 16 * j),
+                                 _mm_and_si128(g4[j], color_mask));
+            }
+        }
+        ExpandGray8Scalar(d + 4 * i, src + i, num_pixels - i);
+    }
+
+    void ConvertRGBA32SSE2(void* dst, const void* src, bool swap_rb, bool keep_alpha,
+                           size_t num_pixels) {
+        auto d = reinterpret_cast<uint8_t*>(dst);
+        auto s = reinterpret_cast<const uint8_t*>(src);
+        const auto color_mask = _mm_set1_epi32(0xffffff);
+        const auto alpha_mask = _mm_set1_epi32(keep_alpha ? 0xff000000u : 0);
+        const auto keep = _mm_set1_epi32(0x0000ff00u);
+        const auto low = _mm_set1_epi32(0xffu);
+        size_t i = 0;
+        for (; i + 4 <= num_pixels; i += 4) {
+            auto p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 4 * i));
+            const auto alpha = _mm_andnot_si128(p, alpha_mask);
+            if (swap_rb) {
+                p = _mm_or_si128(_mm_and_si128(p, keep),
+                                 _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 16), low),
+                                              _mm_slli_epi32(_mm_and_si128(p, low), 16)));
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + 4 * i),
+                             _mm_or_si128(_mm_and_si128(p, color_mask), alpha));
+        }
+        ConvertRGBA32Scalar(d + 4 * i, s + 4 * i, swap_rb, keep_alpha, num_pixels - i);
+    }
+
+    __attribute__((target("avx2"))) void CopyPixelsAVX2(void* dst, const void* src,
+                                                         size_t num_pixels) {
+        auto d = reinterpret_cast<uint8_t*>(dst);
+        auto s = reinterpret_cast<const uint8_t*>(src);
+        size_t i = 0;
+        for (; i + 16 <= num_pixels; i += 16) {
+            const auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 4 * i));
+            const auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 4 * i + 32));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + 4 * i), a);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + 4 * i + 32), b);
+        }
+        CopyPixelsSSE2(d + 4 * i, s + 4 * i, num_pixels - i);
+    }
+
+    __attribute__((target("avx2"))) void FillPixelsAVX2(void* dst, uint32_t pixel,
+                                                         size_t num_pixels) {
+        auto d = reinterpret_cast<uint8_t*>(dst);
+        const auto v = _mm256_set1_epi32(pixel);
+        size_t i = 0;
+        for (; i + 16 <= num_pixels; i += 16) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + 4 * i), v);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + 4 * i + 32), v);
+        }
+        FillPixelsSSE2(d + 4 * i, pixel, num_pixels - i);
+    }
+
+    __attribute__((target("avx2"))) void ConvertPixelsAVX2(void* dst, const void* src,
+                                                            size_t num_pixels) {
+        auto d = reinterpret_cast<uint8_t*>(dst);
+        auto s = reinterpret_cast<const uint8_t*>(src);
+        // 各ピクセルの中で 0, 1, 2, 3 バイト目を 2, 1, 0, 3 の順に並べ替える
+        const auto shuffle = _mm256_setr_epi8(
+            2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+            2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+        size_t i = 0;
+        for (; i + 8 <= num_pixels; i += 8) {
+            const auto p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 4 * i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + 4 * i),
+                                _mm256_shuffle_epi8(p, shuffle));
+        }
+        ConvertPixelsSSE2(d + 4 * i, s + 4 * i, num_pixels - i);
+    }
+
+    __attribute__((target("avx2"))) void CopyPixelsTransparentAVX2(
+        void* dst, const void* src, uint32_t transparent, size_t num_pixels) {
+        auto d = reinterpret_cast<uint8_t*>(dst);
+        auto s = reinterpret_cast<const uint8_t*>(src);
+        const auto color_mask = _mm256_set1_epi32(0xffffff);
+        const auto tc = _mm256_set1_epi32(transparent & 0xffffffu);
+        size_t i = 0;
+        for (; i + 8 <= num_pixels; i += 8) {
+            const auto sp = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 4 * i));
+            const auto dp = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(d + 4 * i));
+            const auto is_tc = _mm256_cmpeq_epi32(_mm256_and_si256(sp, color_mask), tc);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + 4 * i),
+                                _mm256_blendv_epi8(sp, dp, is_tc));
+        }
+        CopyPixelsTransparentSSE2(d + 4 * i, s + 4 * i, transparent, num_pixels - i);
+    }
+
+    __attribute__((target("avx2"))) void FillPixelsMaskedAVX2(
+        void* dst, const uint8_t* mask, size_t first_bit, uint32_t pixel, size_t num_pixels) {
+        auto d = reinterpret_cast<uint8_t*>(dst);
+        const auto p = _mm256_set1_epi32(pixel);
+        const auto bits = _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+        size_t i = 0;
+        for (; i + 8 <= num_pixels; i += 8) {
+            const auto m = _mm256_set1_epi32(MaskByteAt(mask, first_bit + i));
+            const auto sel = _mm256_cmpeq_epi32(_mm256_and_si256(m, bits), bits);
+            // 立っていないピクセルは読みも書きもしない
+            _mm256_maskstore_epi32(reinterpret_cast<int*>(d + 4 * i), sel, p);
+        }
+        FillPixelsMaskedScalar(d + 4 * i, mask, first_bit + i, pixel, num_pixels - i);
+    }
+
+    __attribute__((target("avx2"))) __m256i Div255AVX2(__m256i x) {
+        x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+        return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+    }
+
+    __attribute__((target("avx2"))) __m256i Blend16AVX2(__m256i s, __m256i d, __m256i a) {
+        const auto ia = _mm256_sub_epi16(_mm256_set1_epi16(255), a);
+        return Div255AVX2(_mm256_add_epi16(_mm256_mullo_epi16(s, a), _mm256_mullo_epi16(d, ia)));
+    }
+
+    __attribute__((target("avx2"))) void BlendPixelsAVX2(
+        void* dst, const void* src, uint32_t alpha, bool per_pixel, size_t num_pixels) {
+        auto d = reinterpret_cast<uint8_t*>(dst);
+        auto s = reinterpret_cast<const uint8_t*>(src);
+        const auto zero = _mm256_setzero_si256();
+        const auto alpha16 = _mm256_set1_epi16(alpha);
+        size_t i = 0;
+        for (; i + 8 <= num_pixels; i += 8) {
+            const auto sp = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 4 * i));
+            const auto dp = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(d + 4 * i));
+            // 広げるのも詰めるのも128ビットの半分ごとなので、不透明度も半分ごとに配ればピクセルと揃う
+            auto a_lo = alpha16, a_hi = alpha16;
+            if (per_pixel) {
+                const auto opacity = _mm256_sub_epi32(_mm256_set1_epi32(255), _mm256_srli_epi32(sp, 24));
+                auto a = Div255AVX2(_mm256_mullo_epi16(opacity, _mm256_set1_epi32(alpha)));
+                a = _mm256_or_si256(a, _mm256_slli_epi32(a, 16));
+                a_lo = _mm256_unpacklo_epi32(a, a);
+                a_hi = _mm256_unpackhi_epi32(a, a);
+            }
+            const auto lo = Blend16AVX2(_mm256_unpacklo_epi8(sp, zero), _mm256_unpacklo_epi8(dp, zero), a_lo);
+            const auto hi = Blend16AVX2(_mm256_unpackhi_epi8(sp, zero), _mm256_unpackhi_epi8(dp, zero), a_hi);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + 4 * i), _mm256_packus_epi16(lo, hi));
+        }
+        BlendPixelsSSE2(d + 4 * i, s + 4 * i, alpha, per_pixel, num_pixels - i);
+    }
+
+    __attribute__((target("avx2"))) void ExpandRGB24AVX2(void* dst, const uint8_t* src, bool swap_rb,
+                                                          size_t num_pixels) {
+        auto d = reinterpret_cast<uint8_t*>(dst);
+        // 12バイトの4ピクセルを、それぞれ4バイト目を0（-1の位置は0になる）にして並べる
+        const auto shuffle = swap_rb ? _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1)
+                                     : _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+        size_t i = 0;
+        // 16バイト読むので、読み出しが最後のピクセルを越えないところまで
+        for (; i + 6 <= num_pixels; i += 4) {
+            const auto p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + 4 * i), _mm_shuffle_epi8(p, shuffle));
+        }
+        ExpandRGB24Scalar(d + 4 * i, src + 3 * i, swap_rb, num_pixels - i);
+    }
+
+    struct PixelOps {
+        const char* name;
+        void (*copy)(void* dst, const void* src, size_t num_pixels);
+        void (*fill)(void* dst, uint32_t pixel, size_t num_pixels);
+        void (*convert)(void* dst, const void* src, size_t num_pixels);
+        void (*copy_transparent)(void* dst, const void* src, uint32_t transparent, size_t num_pixels);
+        void (*fill_masked)(void* dst, const uint8_t* mask, size_t first_bit, uint32_t pixel, size_t num_pixels);
+        void (*blend)(void* dst, const void* src, uint32_t alpha, bool per_pixel, size_t num_pixels);
+        void (*expand_rgb24)(void* dst, const uint8_t* src, bool swap_rb, size_t num_pixels);
+        void (*expand_gray8)(void* dst, const uint8_t* src, size_t num_pixels);
+        void (*convert_rgba32)(void* dst, const void* src, bool swap_rb, bool keep_alpha, size_t num_pixels);
+    };
+
+    // SSE2には1バイト単位の並べ替え（pshufb）がないので、24ビットの展開はAVX2の版だけが速い
+    const PixelOps kScalarOps{"scalar", CopyPixelsScalar, FillPixelsScalar, ConvertPixelsScalar,
+                               CopyPixelsTransparentScalar, FillPixelsMaskedScalar, BlendPixelsScalar,
+                               ExpandRGB24Scalar, ExpandGray8Scalar, ConvertRGBA32Scalar};
+    const PixelOps kSSE2Ops{"sse2", CopyPixelsSSE2, FillPixelsSSE2, ConvertPixelsSSE2,
+                             CopyPixelsTransparentSSE2, FillPixelsMaskedSSE2, BlendPixelsSSE2,
+                             ExpandRGB24Scalar, ExpandGray8SSE2, ConvertRGBA32SSE2};
+    const PixelOps kAVX2Ops{"avx2", CopyPixelsAVX2, FillPixelsAVX2, ConvertPixelsAVX2,
+                             CopyPixelsTransparentAVX2, FillPixelsMaskedAVX2, BlendPixelsAVX2,
+                             ExpandRGB24AVX2, ExpandGray8SSE2, ConvertRGBA32SSE2};
+
+    const PixelOps* g_pixel_ops = &kScalarOps;
+} // namespace
+
+void InitializePixelOps() {
+    std::array<uint32_t, 4> regs; // eax, ebx, ecx, edx
+    ReadCPUID(0, 0, regs.data());
+    const uint32_t max_leaf = regs[0];
+
+    g_pixel_ops = &kSSE2Ops;
+    if (max_leaf >= 7 && AVXEnabled()) {
+        // EBX bit 5 : AVX2
+        ReadCPUID(7, 0, regs.data());
+        if ((regs[1] >> 5) & 1) {
+            g_pixel_ops = &kAVX2Ops;
+        }
+    }
+    Log(kInfo, "pixel ops: %s\n", g_pixel_ops->name);
+}
+
+const char* PixelOpsName() {
+    return g_pixel_ops->name;
+}
+
+void CopyPixels(void* dst, const void* src, size_t num_pixels) {
+    g_pixel_ops->copy(dst, src, num_pixels);
+}
+
+void FillPixels(void* dst, uint32_t pixel, size_t num_pixels) {
+    g_pixel_ops->fill(dst, pixel, num_pixels);
+}
+
+void ConvertPixels(void* dst, const void* src, size_t num_pixels) {
+    g_pixel_ops->convert(dst, src, num_pixels);
+}
+
+void CopyPixelsTransparent(void* dst, const void* src, uint32_t transparent, size_t num_pixels) {
+    g_pixel_ops->copy_transparent(dst, src, transparent, num_pixels);
+}
+
+void FillPixelsMasked(void* dst, const uint8_t* mask, size_t first_bit, uint32_t pixel, size_t num_pixels) {
+    g_pixel_ops->fill_masked(dst, mask, first_bit, pixel, num_pixels);
+}
+
+void BlendPixels(void* dst, const void* src, uint32_t alpha, bool per_pixel, size_t num_pixels) {
+    g_pixel_ops->blend(dst, src, alpha, per_pixel, num_pixels);
+}
+
+void ExpandRGB24(void* dst, const uint8_t* src, bool swap_rb, size_t num_pixels) {
+    g_pixel_ops->expand_rgb24(dst, src, swap_rb, num_pixels);
+}
+
+void ExpandGray8(void* dst, const uint8_t* src, size_t num_pixels) {
+    g_pixel_ops->expand_gray8(dst, src, num_pixels);
+}
+
+void ConvertRGBA32(void* dst, const void* src, bool swap_rb, bool keep_alpha, size_t num_pixels) {
+    g_pixel_ops->convert_rgba32(dst, src, swap_rb, keep_alpha, num_pixels);
+}
@@ -0,0 +1,35 @@
+/// 32ビットピクセルの行に対するコピー、塗りつぶし、ピクセル形式の変換
+/// 起動時にCPUIDを見て、AVX2、SSE2、1ピクセルずつ処理する版のいずれかを選ぶ
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/// 使う版を選ぶ。AVXを使えるかはFPUの設定で決まるので、InitializeFPU()の後に呼ぶ
+/// それまでは1ピクセルずつ処理する版を使う
+void InitializePixelOps();
+/// 選んだ版の名前（"avx2"、"sse2"、"scalar"）
+const char* PixelOpsName();
+
+/// num_pixels個のピクセルをsrcからdstにコピーする（重なっていないこと）
+void CopyPixels(void* dst, const void* src, size_t num_pixels);
+/// dstからnum_pixels個のピクセルをpixelで埋める
+void FillPixels(void* dst, uint32_t pixel, size_t num_pixels);
+/// 1バイト目と3バイト目を入れ替えながらコピーする（RGB予約8ビット <-> BGR予約8ビット）
+void ConvertPixels(void* dst, const void* src, size_t num_pixels);
+/// 下位24ビットがtransparentと等しいピクセルを除いてコピーする（dst側はそのまま残る）
+void CopyPixelsTransparent(void* dst, const void* src, uint32_t transparent, size_t num_pixels);
+/// 1ピクセル1ビットのマスク（上位ビットが左）のfirst_bitビット目から、立っているビットのピクセルだけをpixelにする
+void FillPixelsMasked(void* dst, const uint8_t* mask, size_t first_bit, uint32_t pixel, size_t num_pixels);
+/// srcを不透明度alpha（0〜255）でdstに重ねる。チャネルごとに (src * a + dst * (255 - a)) / 255
+/// per_pixelなら、srcの上位8ビットを透明度（0で不透明、255で透明）とし、その不透明度にalphaを掛けたものをaとする
+void BlendPixels(void* dst, const void* src, uint32_t alpha, bool per_pixel, size_t num_pixels);
+
+// 以下はアプリの画像（バイト列）を1ピクセル4バイトに変換する。出力の上位8ビットは0（keep_alphaを除く）
+/// R, G, Bの3バイトずつのピクセルを、R, G, B, 0の順（swap_rbならB, G, R, 0の順）に並べる
+void ExpandRGB24(void* dst, const uint8_t* src, bool swap_rb, size_t num_pixels);
+/// 1バイトの明るさを、3チャネルとも同じ値のピクセルにする
+void ExpandGray8(void* dst, const uint8_t* src, size_t num_pixels);
+/// R, G, B, Aの4バイトずつのピクセルを変換する。keep_alphaなら上位8ビットを透明度（255 - A）にする
+void ConvertRGBA32(void* dst, const void* src, bool swap_rb, bool keep_alpha, size_t num_pixels);
@@ -0,0 +1,161 @@
+#include "pmu.hpp"
+
+#include <algorithm>
+#include <array>
+
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "msr.hpp"
+#include "task.hpp"
+
+namespace {
+    /// IA32_PERFEVTSELxのビット
+    const uint64_t kEvtSelUsr = 1ul << 16;
+    const uint64_t kEvtSelOS = 1ul << 17;
+    const uint64_t kEvtSelEnable = 1ul << 22;
+
+    /// 汎用カウンタで数えるイベント
+    struct GeneralEvent {
+        PerfEvent event;
+        uint8_t event_select, umask;
+        /// CPUID 0x0AのEBXで「使えない」を示すビット（アーキテクチャ定義でなければ-1）
+        int unavailable_bit;
+    };
+
+    /// カウンタが足りないときは先頭から割り当てる
+    const std::array<GeneralEvent, 5> kGeneralEvents{{
+        {kPerfLLCMisses, 0x2e, 0x41, 4},
+        {kPerfDTLBWalks, 0x08, 0x01, -1}, // DTLB_LOAD_MISSES.MISS_CAUSES_A_WALK（Sandy Bridge以降）
+        {kPerfBranchMisses, 0xc5, 0x00, 6},
+        {kPerfLLCReferences, 0x2e, 0x4f, 3},
+        {kPerfBranches, 0xc4, 0x00, 5},
+    }};
+
+    const std::array<const char*, kNumPerfEvents> kEventNames{
+        "cycles", "instructions", "llc-references", "llc-misses",
+        "branches", "branch-misses", "dtlb-walks",
+    };
+
+    bool g_available = false;
+    /// 汎用カウンタiに割り当てたイベントのIA32_PERFEVTSELxの値と、そのイベント
+    int g_num_general = 0;
+    std::array<uint64_t, 8> g_evtsel{};
+    std::array<PerfEvent, 8> g_general_event{};
+    bool g_supported[kNumPerfEvents] = {};
+
+    void StopCounters() {
+        WriteMSR(kIA32_PERF_GLOBAL_CTRL, 0);
+    }
+
+    /// カウンタを0にして数え始める
+    void StartCounters() {
+        WriteMSR(kIA32_PERF_GLOBAL_CTRL, 0);
+        for (int i = 0; i < g_num_general; ++i) {
+            WriteMSR(kIA32_PERFEVTSEL0 + i, g_evtsel[i]);
+            WriteMSR(kIA32_PMC0 + i, 0);
+        }
+        WriteMSR(kIA32_FIXED_CTR0, 0);
+        WriteMSR(kIA32_FIXED_CTR1, 0);
+        // 固定カウンタ0, 1をOSとアプリの両方で数える
+        WriteMSR(kIA32_FIXED_CTR_CTRL, 0x33);
+        WriteMSR(kIA32_PERF_GLOBAL_CTRL, (3ul << 32) | ((1ul << g_num_general) - 1));
+    }
+
+    /// カウンタを止め、値をcountersに足し込む
+    void AccumulateCounters(PerfCounters* counters) {
+        StopCounters();
+        auto add = [counters](PerfEvent event, uint64_t value) {
+            __atomic_fetch_add(&counters->values[event], value, __ATOMIC_RELAXED);
+        };
+        add(kPerfInstructions, ReadMSR(kIA32_FIXED_CTR0));
+        add(kPerfCycles, ReadMSR(kIA32_FIXED_CTR1));
+        for (int i = 0; i < g_num_general; ++i) {
+            add(g_general_event[i], ReadMSR(kIA32_PMC0 + i));
+        }
+    }
+} // namespace
+
+void InitializePMU() {
+    uint32_t regs[4];
+    ReadCPUID(0, 0, regs);
+    if (regs[0] < 0x0a) {
+        Log(kInfo, "PMU: not supported (max cpuid leaf 0x%x)\n", regs[0]);
+        return;
+    }
+    ReadCPUID(0x0a, 0, regs);
+    const int version = regs[0] & 0xff;
+    const int num_general = (regs[0] >> 8) & 0xff;
+    const int num_fixed = regs[3] & 0x1f;
+    // IA32_PERF_GLOBAL_CTRLと固定カウンタ（命令数とサイクル数）を使う
+    if (version < 2 || num_fixed < 2) {
+        Log(kInfo, "PMU: not supported (version %d, %d fixed counters)\n", version, num_fixed);
+        return;
+    }
+
+    ReadCPUID(1, 0, regs);
+    const int family = (regs[0] >> 8) & 0xf;
+    ReadCPUID(0x0a, 0, regs);
+    const uint32_t unavailable = regs[1];
+
+    g_supported[kPerfCycles] = g_supported[kPerfInstructions] = true;
+    for (const auto& e : kGeneralEvents) {
+        if (g_num_general == std::min<int>(num_general, g_evtsel.size())) {
+            break;
+        }
+        if (e.unavailable_bit >= 0 ? (unavailable >> e.unavailable_bit) & 1 : family != 6) {
+            continue;
+        }
+        g_evtsel[g_num_general] = e.event_select | (e.umask << 8) | kEvtSelUsr | kEvtSelOS | kEvtSelEnable;
+        g_general_event[g_num_general] = e.event;
+        g_num_general++;
+        g_supported[e.event] = true;
+    }
+    g_available = true;
+    Log(kInfo, "PMU: version %d, %d general and %d fixed counters\n", version, num_general, num_fixed);
+}
+
+bool PMUAvailable() {
+    return g_available;
+}
+
+bool PerfEventSupported(PerfEvent event) {
+    return g_supported[event];
+}
+
+const char* PerfEventName(PerfEvent event) {
+    return kEventNames[event];
+}
+
+void StartTaskPerf(PerfCounters* counters) {
+    if (!g_available) {
+        return;
+    }
+    InterruptGuard guard;
+    g_task_manager->CurrentTask().SetPerf(counters);
+    StartCounters();
+}
+
+void StopTaskPerf() {
+    if (!g_available) {
+        return;
+    }
+    InterruptGuard guard;
+    auto& task = g_task_manager->CurrentTask();
+    if (auto counters = task.Perf()) {
+        AccumulateCounters(counters);
+        task.SetPerf(nullptr);
+    }
+}
+
+void SwitchPMUTask(Task* current, Task* next) {
+    if (current == next) {
+        return;
+    }
+    if (current->Perf()) {
+        AccumulateCounters(current->Perf());
+    }
+    if (next->Perf()) {
+        StartCounters();
+    }
+}
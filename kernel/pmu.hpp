@@ -0,0 +1,43 @@
+/// 性能監視カウンタ（PMU : Performance Monitoring Unit）
+/// CPUID 0x0Aで示されるアーキテクチャ定義の性能監視（バージョン2以降）を使い、
+/// 命令数とサイクル数は固定カウンタで、残りは汎用カウンタ（IA32_PERFEVTSELx / IA32_PMCx）で数える
+/// カウンタはタスクごとに仮想化する : 数えるタスク（Task::Perf()がnullptrでない）が動いている間だけ数え、
+/// そのタスクから切り替えるときにカウンタの値をタスクの合計に足し込む
+/// 数えないタスクどうしの切り替えでは何もしない
+
+#pragma once
+
+#include <cstdint>
+
+class Task;
+
+enum PerfEvent {
+    kPerfCycles,       // コアのサイクル数（止まっている間を除く）
+    kPerfInstructions, // 完了した命令数
+    kPerfLLCReferences,
+    kPerfLLCMisses,
+    kPerfBranches,
+    kPerfBranchMisses,
+    kPerfDTLBWalks, // データのTLBミスでページウォークした回数（モデル固有のイベント）
+    kNumPerfEvents,
+};
+
+/// 数えた値の合計。複数のタスク（CPUコア）から足し込まれることがある
+struct PerfCounters {
+    uint64_t values[kNumPerfEvents];
+};
+
+/// CPUIDでPMUを調べる（BSPで1回だけ呼ぶ。カウンタの設定は数え始めるときにそのCPUコアで行う）
+void InitializePMU();
+/// PMUで数えられる -> true
+bool PMUAvailable();
+/// eventを数えられる（CPUが対応していて、空いているカウンタを割り当てた） -> true
+bool PerfEventSupported(PerfEvent event);
+const char* PerfEventName(PerfEvent event);
+
+/// 実行中のタスクの以降の実行を、countersに足し込むようにする
+void StartTaskPerf(PerfCounters* counters);
+/// 実行中のタスクのこれまでの値を足し込み、数えるのをやめる
+void StopTaskPerf();
+/// 実行中のCPUコアでcurrentからnextに切り替える直前に呼ぶ（割り込み禁止で）
+void SwitchPMUTask(Task* current, Task* next);
@@ -0,0 +1,203 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <cxxabi.h>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "../MikanLoaderPkg/elf.h"
+#include "fat.hpp"
+#include "smp.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace {
+    struct ProfileSample {
+        uint64_t rip;
+        uint64_t task_id;
+        /// CPLが3のとき実行中だったアプリの実行可能ファイル（カーネルならnullptr）
+        const fat::DirectoryEntry* image;
+    };
+
+    /// CPUコア1つあたりに記録できる数。あふれた分は数だけ数える
+    const size_t kSamplesPerCPU = 16384;
+
+    struct SampleBuffer {
+        std::unique_ptr<ProfileSample[]> samples;
+        size_t count;
+        size_t dropped;
+    };
+
+    std::array<SampleBuffer, kMaxCPUs> g_buffers{};
+    /// 記録中のタイマ割り込みの間隔（tick）。0なら記録しない
+    unsigned long g_period_ticks = 0;
+
+    /// ELFのシンボル表のうち、関数だけをアドレス順に並べたもの
+    class SymbolTable {
+    public:
+        /// entryのELFファイルのシンボル表を読む。なければ空のまま
+        void Load(fat::DirectoryEntry& entry) {
+            fat::FileDescriptor fd{entry};
+            Elf64_Ehdr ehdr;
+            if (fd.Load(&ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+                memcmp(ehdr.e_ident, "\x7f" "ELF", 4) != 0 || ehdr.e_shentsize != sizeof(Elf64_Shdr)) {
+                return;
+            }
+            std::vector<Elf64_Shdr> shdrs(ehdr.e_shnum);
+            const size_t shdrs_bytes = shdrs.size() * sizeof(Elf64_Shdr);
+            if (fd.Load(shdrs.data(), shdrs_bytes, ehdr.e_shoff) != shdrs_bytes) {
+                return;
+            }
+            for (const auto& shdr : shdrs) {
+                if (shdr.sh_type != SHT_SYMTAB || shdr.sh_link >= shdrs.size()) {
+                    continue;
+                }
+                const auto& strtab = shdrs[shdr.sh_link];
+                std::vector<Elf64_Sym> syms(shdr.sh_size / sizeof(Elf64_Sym));
+                strtab_ = std::make_unique<char[]>(strtab.sh_size + 1);
+                if (fd.Load(syms.data(), syms.size() * sizeof(Elf64_Sym), shdr.sh_offset) != syms.size() * sizeof(Elf64_Sym) ||
+                    fd.Load(strtab_.get(), strtab.sh_size, strtab.sh_offset) != strtab.sh_size) {
+                    return;
+                }
+                strtab_[strtab.sh_size] = '\0';
+                for (const auto& sym : syms) {
+                    if (ELF64_ST_TYPE(sym.st_info) == STT_FUNC && sym.st_value != 0 && sym.st_name < strtab.sh_size) {
+                        funcs_.push_back({sym.st_value, sym.st_size, &strtab_[sym.st_name]});
+                    }
+                }
+                std::sort(funcs_.begin(), funcs_.end(),
+                          [](const Func& a, const Func& b) { return a.addr < b.addr; });
+                return;
+            }
+        }
+
+        /// addrを含む関数の名前（見つからなければnullptr）
+        const char* Find(uint64_t addr) const {
+            auto it = std::upper_bound(funcs_.begin(), funcs_.end(), addr,
+                                       [](uint64_t a, const Func& f) { return a < f.addr; });
+            if (it == funcs_.begin()) {
+                return nullptr;
+            }
+            --it;
+            // 大きさが分からない関数は、次の関数の手前までとみなす
+            if (it->size != 0 && addr >= it->addr + it->size) {
+                return nullptr;
+            }
+            return it->name;
+        }
+
+    private:
+        struct Func {
+            uint64_t addr, size;
+            const char* name;
+        };
+        std::vector<Func> funcs_;
+        std::unique_ptr<char[]> strtab_;
+    };
+
+    /// 集計の単位（どのファイルのどの関数か）
+    struct ProfileKey {
+        const fat::DirectoryEntry* image;
+        const char* func; // 引き当てられなければnullptr
+        bool operator<(const ProfileKey& rhs) const {
+            return image != rhs.image ? image < rhs.image : func < rhs.func;
+        }
+    };
+} // namespace
+
+void StartProfiler(unsigned long period_us) {
+    __atomic_store_n(&g_period_ticks, 0, __ATOMIC_RELEASE);
+    for (auto& buf : g_buffers) {
+        if (!buf.samples) {
+            buf.samples = std::make_unique<ProfileSample[]>(kSamplesPerCPU);
+        }
+        buf.count = buf.dropped = 0;
+    }
+    const unsigned long ticks = period_us * kTimerFreq / 1000000;
+    __atomic_store_n(&g_period_ticks, std::max(ticks, 1ul), __ATOMIC_RELEASE);
+}
+
+void StopProfiler() {
+    __atomic_store_n(&g_period_ticks, 0, __ATOMIC_RELEASE);
+}
+
+unsigned long ProfilePeriodTicks() {
+    return __atomic_load_n(&g_period_ticks, __ATOMIC_RELAXED);
+}
+
+void RecordProfileSample(const TaskContext& ctx) {
+    if (ProfilePeriodTicks() == 0) {
+        return;
+    }
+    // 割り込みは禁止されているので、このCPUコアのバッファに触るのは自分だけ
+    auto& buf = g_buffers[CurrentCPU()];
+    if (buf.count == kSamplesPerCPU) {
+        buf.dropped++;
+        return;
+    }
+    Task& task = g_task_manager->CurrentTask();
+    const bool user = (ctx.cs & 3) == 3;
+    buf.samples[buf.count] = {ctx.rip, task.ID(), user ? task.AppEntry() : nullptr};
+    __atomic_store_n(&buf.count, buf.count + 1, __ATOMIC_RELEASE);
+}
+
+void PrintProfile(IFileDescriptor& out, size_t max_entries) {
+    // 記録の途中で集計すると食い違うので、止めてから数える
+    const unsigned long period = ProfilePeriodTicks();
+    StopProfiler();
+
+    std::map<const fat::DirectoryEntry*, SymbolTable> tables;
+    auto table_of = [&tables](const fat::DirectoryEntry* image) -> SymbolTable& {
+        auto [it, inserted] = tables.try_emplace(image);
+        if (inserted) {
+            // カーネル自身はブートボリュームのkernel.elfから読む
+            auto entry = image ? const_cast<fat::DirectoryEntry*>(image) : fat::FindFile("/kernel.elf").first;
+            if (entry) {
+                it->second.Load(*entry);
+            }
+        }
+        return it->second;
+    };
+
+    std::map<ProfileKey, size_t> counts;
+    size_t total = 0, dropped = 0, kernel = 0;
+    for (const auto& buf : g_buffers) {
+        const size_t n = __atomic_load_n(&buf.count, __ATOMIC_ACQUIRE);
+        for (size_t i = 0; i < n; ++i) {
+            const auto& s = buf.samples[i];
+            counts[{s.image, table_of(s.image).Find(s.rip)}]++;
+            if (s.image == nullptr) {
+                kernel++;
+            }
+        }
+        total += n;
+        dropped += buf.dropped;
+    }
+
+    std::vector<std::pair<ProfileKey, size_t>> sorted(counts.begin(), counts.end());
+    std::sort(sorted.begin(), sorted.end(),
+              [](const auto& a, const auto& b) { return a.second > b.second; });
+
+    PrintToFD(out, "%lu samples (kernel %lu, app %lu), %lu dropped\n", total, kernel, total - kernel, dropped);
+    for (size_t i = 0; i < sorted.size() && i < max_entries; ++i) {
+        const auto& [key, count] = sorted[i];
+        char image_name[13] = "kernel";
+        if (key.image) {
+            fat::FormatName(*key.image, image_name);
+        }
+        // C++の関数名は読める形に戻す（戻せなければそのまま）
+        int status = -1;
+        char* demangled = key.func ? abi::__cxa_demangle(key.func, nullptr, nullptr, &status) : nullptr;
+        const char* func = status == 0 ? demangled : key.func ? key.func : "?";
+        PrintToFD(out, "%5lu.%lu%% %6lu  %-12s %s\n",
+                  count * 100 / total, count * 1000 / total % 10, count, image_name, func);
+        free(demangled);
+    }
+
+    if (period) {
+        __atomic_store_n(&g_period_ticks, period, __ATOMIC_RELEASE);
+    }
+}
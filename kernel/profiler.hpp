@@ -0,0 +1,24 @@
+/// 統計的プロファイラ
+/// 記録している間はタイマ割り込みの間隔を一定以下に抑え、割り込みのたびに割り込まれた場所
+/// （RIP、タスクID、CPL、アプリならその実行可能ファイル）をCPUコアごとのバッファに記録する
+/// 集計するときに、カーネルはkernel.elfの、アプリはFATボリューム上のELFのシンボル表で関数に引き当てる
+/// アイドル中（hlt）に割り込まれたときは記録しない
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "file.hpp"
+
+struct TaskContext;
+
+/// これまでの記録を捨て、period_usマイクロ秒ごとの記録を始める
+void StartProfiler(unsigned long period_us);
+void StopProfiler();
+/// 記録中ならタイマ割り込みを空けてよい最大のtick数、記録中でなければ0
+unsigned long ProfilePeriodTicks();
+/// タイマ割り込みのハンドラから、割り込まれたタスクのコンテキストを渡して呼ぶ
+void RecordProfileSample(const TaskContext& ctx);
+/// 記録を関数ごとに集計し、多い順に最大max_entries個をoutに書く
+void PrintProfile(IFileDescriptor& out, size_t max_entries);
@@ -4,21 +4,23 @@
 #include "interrupt.hpp"
 #include "logger.hpp"
 #include "memory_manager.hpp"
+#include "smp.hpp"
 
 namespace {
     /// GDT : Global Discriptor Table
-    std::array<SegmentDescriptor, 7> g_gdt;
+    std::array<SegmentDescriptor, 5 + 2 * kMaxCPUs> g_gdt;
     /// TSS : task-state segment
     /// タスク情報を保存するための構造体
     /// TSS用のセグメントはGDTの2要素分を消費する
-    std::array<uint32_t, 26> g_tss;
+    /// RSP0やISTのスタックはCPUコアごとに別々でなければならないので、CPUコアの数だけ用意する
+    std::array<std::array<uint32_t, 26>, kMaxCPUs> g_tss;
 
-    static_assert((kTSS >> 3) + 1 < g_gdt.size());
+    static_assert((TSSSelector(kMaxCPUs - 1) >> 3) + 1 < g_gdt.size());
 
     /// TSSを設定
-    void SetTSS(int index, uint64_t value) {
-        g_tss[index] = value & 0xffffffff;
-        g_tss[index + 1] = value >> 32;
+    void SetTSS(int cpu, int index, uint64_t value) {
+        g_tss[cpu][index] = value & 0xffffffff;
+        g_tss[cpu][index + 1] = value >> 32;
     }
 
     uint64_t AllocateStackArea(int num_4kframes) {
@@ -102,19 +104,28 @@ void InitializeSegmentation() {
     SetCSSS(kKernelCS, kKernelSS);
 }
 
-void InitializeTSS() {
+void LoadKernelSegments() {
+    LoadGDT(sizeof(g_gdt) - 1, reinterpret_cast<uintptr_t>(&g_gdt[0]));
+    SetDSAll(kKernelDS);
+    SetCSSS(kKernelCS, kKernelSS);
+}
+
+void InitializeTSS(int cpu) {
     // TSS.RSP0を設定
-    SetTSS(1, AllocateStackArea(8));
+    SetTSS(cpu, 1, AllocateStackArea(8));
     // TSS.IST1を設定
-    SetTSS(7 + 2 * kISTForTimer, AllocateStackArea(8));
+    SetTSS(cpu, 7 + 2 * kISTForTimer, AllocateStackArea(8));
+    // TSS.IST2を設定
+    SetTSS(cpu, 7 + 2 * kISTForDoubleFault, AllocateStackArea(2));
 
-    uint64_t tss_addr = reinterpret_cast<uint64_t>(&g_tss[0]);
-    // GDT[5]にTSSの先頭アドレスを設定
-    SetSystemSegment(g_gdt[kTSS >> 3], DescriptorType::kTSSAvailable, 0, tss_addr & 0xffffffff, sizeof(g_tss) - 1);
-    // GDT[6]にTSSの先頭アドレスを設定
-    g_gdt[(kTSS >> 3) + 1].data = tss_addr >> 32;
+    const uint16_t selector = TSSSelector(cpu);
+    uint64_t tss_addr = reinterpret_cast<uint64_t>(&g_tss[cpu][0]);
+    // GDT[5 + 2 * cpu]にTSSの先頭アドレスを設定
+    SetSystemSegment(g_gdt[selector >> 3], DescriptorType::kTSSAvailable, 0, tss_addr & 0xffffffff, sizeof(g_tss[cpu]) - 1);
+    // GDT[6 + 2 * cpu]にTSSの先頭アドレスを設定
+    g_gdt[(selector >> 3) + 1].data = tss_addr >> 32;
 
     // 割り込みが発生してCPL=3からCPL=0に切り替わる際（権限がアプリレベルからOSレベルに変化）TSSの値を読む必要が出ると、
     // CPUはTRレジスタが指すGDTエントリを参照してTSSを取得するので設定しておく
-    LoadTR(kTSS);
+    LoadTR(selector);
 }
\ No newline at end of file
@@ -62,9 +62,15 @@ const uint16_t kKernelCS = 1 << 3; // GDT[1] : OS用のコードセグメント
 const uint16_t kKernelSS = 2 << 3; // GDT[2] : OS用のスタックセグメント
 // GDT[3] : アプリ用のコードセグメント
 // GDT[4] : アプリ用のスタックセグメント
-const uint16_t kTSS = 5 << 3; // GDT[5] : TSS
+const uint16_t kTSS = 5 << 3; // GDT[5] : TSS（BSP用）
+/// CPUコアcpuのTSS（GDT[5 + 2 * cpu]）
+constexpr uint16_t TSSSelector(int cpu) {
+    return kTSS + ((2 * cpu) << 3);
+}
 
 void SetupSegments();
 void InitializeSegmentation();
-/// TSSを初期化してGDTに設定する
-void InitializeTSS();
\ No newline at end of file
+/// SetupSegments()で構築したGDTを読み込み、セグメントレジスタを設定する（AP用）
+void LoadKernelSegments();
+/// CPUコアcpuのTSSを初期化してGDTに設定する
+void InitializeTSS(int cpu = 0);
\ No newline at end of file
@@ -0,0 +1,56 @@
+#include "shm.hpp"
+
+#include <cstring>
+#include <map>
+
+#include "interrupt.hpp"
+#include "memory_manager.hpp"
+
+namespace {
+    /// IDから共有メモリを引く
+    std::map<uint64_t, SharedMemory*>* g_shms;
+    uint64_t g_next_shm_id = 1;
+} // namespace
+
+void InitializeSharedMemory() {
+    g_shms = new std::map<uint64_t, SharedMemory*>;
+}
+
+WithError<SharedMemory*> CreateSharedMemory(size_t num_pages) {
+    if (num_pages == 0 || num_pages > kShmMaxPages) {
+        return {nullptr, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+
+    InterruptGuard guard;
+    auto frame = g_memory_manager->Allocate(num_pages);
+    if (frame.error) {
+        return {nullptr, frame.error};
+    }
+    auto p = reinterpret_cast<uint8_t*>(frame.value.Frame());
+    memset(p, 0, num_pages * kBytesPerFrame);
+
+    auto shm = new SharedMemory{g_next_shm_id++, p, num_pages, 1};
+    g_shms->insert({shm->id, shm});
+    return {shm, MAKE_ERROR(Error::kSuccess)};
+}
+
+SharedMemory* AttachSharedMemory(uint64_t id) {
+    InterruptGuard guard;
+    auto it = g_shms->find(id);
+    if (it == g_shms->end()) {
+        return nullptr;
+    }
+    it->second->map_count++;
+    return it->second;
+}
+
+void DetachSharedMemory(SharedMemory* shm) {
+    InterruptGuard guard;
+    if (--shm->map_count > 0) {
+        return;
+    }
+    g_shms->erase(shm->id);
+    const FrameID frame{reinterpret_cast<uintptr_t>(shm->frames) / kBytesPerFrame};
+    g_memory_manager->Free(frame, shm->num_pages);
+    delete shm;
+}
@@ -0,0 +1,33 @@
+/// 共有メモリ
+/// 同じ物理フレームを複数のタスクのアドレス空間にマップし、コピーせずにデータを受け渡す
+/// アプリからはファイルマッピングと同じ仮想アドレス範囲に置かれ、ページフォルト時にマップされる
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+
+/// 1つの共有メモリの最大ページ（4KiB）数
+const size_t kShmMaxPages = 4096;
+
+struct SharedMemory {
+    /// アプリが共有メモリを指定するための値（0は使わない）
+    uint64_t id;
+    /// 先頭の物理フレーム（num_pages個連続している）
+    uint8_t* frames;
+    size_t num_pages;
+    /// マップしているマッピングの数。0になったら解放する
+    size_t map_count;
+};
+
+void InitializeSharedMemory();
+
+/// 0クリアされたnum_pagesページの共有メモリを作る
+/// 作った時点でマップ数は1（作ったタスクが続けてマップする）
+WithError<SharedMemory*> CreateSharedMemory(size_t num_pages);
+/// idの共有メモリのマップ数を増やして返す。なければnullptr
+SharedMemory* AttachSharedMemory(uint64_t id);
+/// マップ数を減らし、0になったらフレームごと解放する
+void DetachSharedMemory(SharedMemory* shm);
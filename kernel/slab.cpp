@@ -0,0 +1,132 @@
+#include "slab.hpp"
+
+#include "interrupt.hpp"
+#include "memory_manager.hpp"
+
+namespace {
+    std::array<SlabCache*, kMaxSlabCaches> g_slab_caches{};
+    size_t g_num_slab_caches = 0;
+
+    /// SlabAllocate()で使う大きさごとのキャッシュ（16B ~ 2KiB）
+    SlabCache g_size_caches[] = {
+        {"size-16", 16},
+        {"size-32", 32},
+        {"size-64", 64},
+        {"size-128", 128},
+        {"size-256", 256},
+        {"size-512", 512},
+        {"size-1024", 1024},
+        {"size-2048", 2048},
+    };
+    const size_t kNumSizeCaches = sizeof(g_size_caches) / sizeof(g_size_caches[0]);
+
+    /// bytesを格納できる最小のキャッシュ（なければnullptr）
+    SlabCache* SizeCache(size_t bytes) {
+        size_t cache_bytes = 16;
+        for (size_t i = 0; i < kNumSizeCaches; i++, cache_bytes <<= 1) {
+            if (bytes <= cache_bytes) {
+                return &g_size_caches[i];
+            }
+        }
+        return nullptr;
+    }
+} // namespace
+
+void* SlabCache::Allocate() {
+    InterruptGuard guard;
+    if (free_list_ == nullptr) {
+        misses_++;
+        if (!Grow()) {
+            return nullptr;
+        }
+    } else {
+        hits_++;
+    }
+
+    FreeObject* obj = free_list_;
+    free_list_ = obj->next;
+    in_use_++;
+    return obj;
+}
+
+void SlabCache::Free(void* p) {
+    if (p == nullptr) {
+        return;
+    }
+
+    InterruptGuard guard;
+    auto obj = reinterpret_cast<FreeObject*>(p);
+    obj->next = free_list_;
+    free_list_ = obj;
+    in_use_--;
+}
+
+bool SlabCache::Owns(const void* p) const {
+    InterruptGuard guard;
+    const auto addr = reinterpret_cast<uintptr_t>(p);
+    for (auto slab = slab_list_; slab != nullptr; slab = slab->next) {
+        const auto begin = reinterpret_cast<uintptr_t>(slab);
+        if (begin <= addr && addr < begin + slab->bytes) {
+            return true;
+        }
+    }
+    return false;
+}
+
+SlabStat SlabCache::Stat() const {
+    return {name_, object_size_, slabs_, in_use_, hits_, misses_};
+}
+
+bool SlabCache::Grow() {
+    const size_t slab_bytes = sizeof(SlabHeader) + object_size_ * kMinObjectsPerSlab;
+    const size_t num_frames = (slab_bytes + kBytesPerFrame - 1) / kBytesPerFrame;
+    auto [frame, err] = g_memory_manager->Allocate(num_frames);
+    if (err) {
+        return false;
+    }
+
+    auto slab = reinterpret_cast<SlabHeader*>(frame.Frame());
+    slab->next = slab_list_;
+    slab->bytes = num_frames * kBytesPerFrame;
+    slab_list_ = slab;
+
+    // スラブの後ろから順にフリーリストに積み、先頭から使われるようにする
+    auto base = reinterpret_cast<uint8_t*>(slab + 1);
+    const size_t num_objects = (slab->bytes - sizeof(SlabHeader)) / object_size_;
+    for (size_t i = num_objects; i > 0; i--) {
+        auto obj = reinterpret_cast<FreeObject*>(base + (i - 1) * object_size_);
+        obj->next = free_list_;
+        free_list_ = obj;
+    }
+    slabs_++;
+
+    if (!registered_ && g_num_slab_caches < kMaxSlabCaches) {
+        g_slab_caches[g_num_slab_caches++] = this;
+        registered_ = true;
+    }
+    return true;
+}
+
+void* SlabAllocate(size_t bytes) {
+    if (auto cache = SizeCache(bytes)) {
+        return cache->Allocate();
+    }
+    return ::operator new(bytes);
+}
+
+void SlabFree(void* p, size_t bytes) {
+    if (auto cache = SizeCache(bytes)) {
+        cache->Free(p);
+        return;
+    }
+    ::operator delete(p);
+}
+
+size_t GetSlabStats(SlabStat* stats, size_t len) {
+    InterruptGuard guard;
+    size_t i = 0;
+    for (; i < g_num_slab_caches && i < len; i++) {
+        stats[i] = g_slab_caches[i]->Stat();
+    }
+    return i;
+}
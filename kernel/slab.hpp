@@ -0,0 +1,104 @@
+/// スラブアロケータ
+/// 同じ大きさのオブジェクトを、ページフレーム単位で確保したスラブから切り出して管理する
+/// 解放されたオブジェクトはフリーリストに戻して再利用し、newlibのヒープを経由しない
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+/// スラブキャッシュの統計情報
+struct SlabStat {
+    const char* name;
+    size_t object_size;
+    /// 確保済みのスラブ数
+    size_t slabs;
+    /// 使用中のオブジェクト数
+    size_t in_use;
+    /// フリーリストから割り当てられた回数
+    size_t hits;
+    /// スラブの追加が必要になった回数
+    size_t misses;
+};
+
+/// 1種類の大きさのオブジェクトを管理するキャッシュ
+/// コンストラクタはconstexprなので、グローバル変数として定義しても初期化順序を気にしなくてよい
+class SlabCache {
+public:
+    /// 1つのスラブに最低限詰め込むオブジェクト数
+    static const size_t kMinObjectsPerSlab = 8;
+
+    constexpr SlabCache(const char* name, size_t object_size)
+        : name_{name}, object_size_{(object_size + 15) & ~static_cast<size_t>(15)} {}
+
+    /// オブジェクト1つ分の領域を確保する（コンストラクタは呼ばない）
+    /// 確保できなければnullptr
+    void* Allocate();
+    /// Allocate()で確保した領域を返却する（デストラクタは呼ばない）
+    void Free(void* p);
+    /// pがこのキャッシュのスラブから切り出した領域なら true
+    /// スラブを順にたどるので、Allocate()の失敗時に他から確保したものと見分けるときだけに使う
+    bool Owns(const void* p) const;
+
+    SlabStat Stat() const;
+
+private:
+    struct FreeObject {
+        FreeObject* next;
+    };
+
+    /// スラブの先頭に置き、同じキャッシュのスラブをつなぐ
+    /// オブジェクトを16バイト境界に揃えるため、16バイトにしておく
+    struct SlabHeader {
+        SlabHeader* next;
+        size_t bytes;
+    };
+    static_assert(sizeof(SlabHeader) == 16);
+
+    const char* name_;
+    size_t object_size_;
+    FreeObject* free_list_{nullptr};
+    SlabHeader* slab_list_{nullptr};
+    size_t slabs_{0}, in_use_{0}, hits_{0}, misses_{0};
+    /// 統計情報の一覧に登録済み : true
+    bool registered_{false};
+
+    /// 新たなスラブを確保してフリーリストに繋げる
+    bool Grow();
+};
+
+/// 大きさを指定して領域を確保する
+/// 2のべき乗の大きさごとのキャッシュを利用し、大きすぎる場合はoperator newに任せる
+void* SlabAllocate(size_t bytes);
+/// SlabAllocate()で確保した領域を返却する。bytesは確保時と同じ値を渡す
+void SlabFree(void* p, size_t bytes);
+
+/// スラブキャッシュを利用するSTLコンテナ用のアロケータ
+template <class T>
+class SlabAllocator {
+public:
+    using value_type = T;
+
+    SlabAllocator() = default;
+    template <class U>
+    SlabAllocator(const SlabAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(SlabAllocate(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_t n) {
+        SlabFree(p, n * sizeof(T));
+    }
+};
+
+template <class T, class U>
+bool operator==(const SlabAllocator<T>&, const SlabAllocator<U>&) { return true; }
+template <class T, class U>
+bool operator!=(const SlabAllocator<T>&, const SlabAllocator<U>&) { return false; }
+
+/// 統計情報を取得しているスラブキャッシュの最大数
+static const size_t kMaxSlabCaches = 32;
+/// 利用されたことのあるスラブキャッシュの統計情報をstatsに書き込み、その個数を返す
+size_t GetSlabStats(SlabStat* stats, size_t len);
@@ -0,0 +1,254 @@
+#include "smp.hpp"
+
+#include <array>
+#include <cstring>
+
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "fpu.hpp"
+#include "idle.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "segment.hpp"
+#include "syscall.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace {
+    /// Local APICのレジスタ
+    volatile uint32_t& g_lapic_id = *reinterpret_cast<uint32_t*>(0xfee00020);
+    /// Spurious Interrupt Vector : bit8が1ならLocal APICが有効
+    volatile uint32_t& g_lapic_svr = *reinterpret_cast<uint32_t*>(0xfee000f0);
+    /// Interrupt Command Register : 他のCPUコアへの割り込み（IPI）を送る
+    volatile uint32_t& g_icr_low = *reinterpret_cast<uint32_t*>(0xfee00300);
+    volatile uint32_t& g_icr_high = *reinterpret_cast<uint32_t*>(0xfee00310);
+
+    /// APの起動用コードに渡すパラメータ（asmfunc.asmのAPTrampolineParamsと同じ並び）
+    struct APBootParams {
+        uint64_t cr0, cr3, cr4;
+        uint64_t stack_end;
+        uint64_t entry;
+        uint64_t cpu;
+    };
+
+    /// APの起動直後に使うスタック（その後はそのCPUのアイドルタスクのスタックになる）
+    const int kAPBootStackFrames = 4;
+    /// アイドル中のAPがタスクを奪いに起きる間隔（100msec）
+    const unsigned long kAPIdlePollTicks = kTimerFreq / 10;
+
+    std::array<CPUInfo, kMaxCPUs> g_cpus{};
+    int g_num_cpus = 1;
+
+    /// 処理中のTLBシュートダウン。送る側はg_shootdown_busyを取ってから書き、g_shootdown_pendingが0になるまで変えない
+    struct TLBShootdown {
+        uint64_t addr;
+        size_t pages;
+    };
+    TLBShootdown g_shootdown{};
+    bool g_shootdown_busy = false;
+    /// まだTLBを破棄していないCPUコアのビットマップ（bit n : CPUコアn）
+    uint32_t g_shootdown_pending = 0;
+    /// シュートダウンのIPIのベクタ（InitializeSMP()で割り当てる）
+    uint8_t g_shootdown_vector = 0;
+
+    void InvalidateTLBRange(uint64_t addr, size_t pages) {
+        for (size_t i = 0; i < pages; i++) {
+            InvalidateTLB(addr + i * kBytesPerFrame);
+        }
+    }
+
+    uint8_t ReadLAPICID() {
+        return g_lapic_id >> 24;
+    }
+
+    /// IPIを送り、送信が完了するのを待つ
+    void SendIPI(uint8_t apic_id, uint32_t command) {
+        g_icr_high = static_cast<uint32_t>(apic_id) << 24;
+        g_icr_low = command;
+        // bit12 : Delivery Status（1なら送信中）
+        while (g_icr_low & (1u << 12)) {
+            __builtin_ia32_pause();
+        }
+    }
+
+    /// 指定のAPを起動し、初期化が終わるのを待つ。起動できなかったら false
+    bool StartAP(int cpu, uint8_t apic_id) {
+        auto [stack, err] = g_memory_manager->Allocate(kAPBootStackFrames);
+        if (err) {
+            Log(kError, "failed to allocate AP boot stack: %s\n", err.Name());
+            return false;
+        }
+
+        auto params = reinterpret_cast<APBootParams*>(
+            kAPTrampolineAddr + (APTrampolineParams - APTrampolineBegin));
+        params->stack_end = reinterpret_cast<uint64_t>(stack.Frame()) + kAPBootStackFrames * kBytesPerFrame;
+        params->cpu = cpu;
+
+        // INIT IPI : APを初期化し、SIPIを待つ状態にする
+        SendIPI(apic_id, 0x00004500);
+        acpi::WaitMillisecondes(10);
+        // SIPI（Startup IPI）: ベクタ番号 = 起動用コードのページ番号
+        // 1回目を取りこぼすCPUがあるので2回送る
+        const uint32_t sipi = 0x00004600 | (kAPTrampolineAddr >> 12);
+        for (int i = 0; i < 2; i++) {
+            if (__atomic_load_n(&g_cpus[cpu].started, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            SendIPI(apic_id, sipi);
+            acpi::WaitMillisecondes(1);
+        }
+
+        for (int i = 0; i < 100; i++) {
+            if (__atomic_load_n(&g_cpus[cpu].started, __ATOMIC_ACQUIRE)) {
+                return true;
+            }
+            acpi::WaitMillisecondes(1);
+        }
+        g_memory_manager->Free(stack, kAPBootStackFrames);
+        return false;
+    }
+} // namespace
+
+int NumCPUs() {
+    return g_num_cpus;
+}
+
+int CurrentCPU() {
+    if (g_num_cpus == 1) {
+        return 0;
+    }
+    const uint8_t id = ReadLAPICID();
+    for (int i = 0; i < g_num_cpus; i++) {
+        if (g_cpus[i].lapic_id == id) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+const CPUInfo& GetCPUInfo(int cpu) {
+    return g_cpus[cpu];
+}
+
+void ShootdownTLB(uint64_t addr, size_t pages) {
+    InterruptGuard guard;
+    InvalidateTLBRange(addr, pages);
+    if (g_num_cpus == 1) {
+        return;
+    }
+
+    // 同時に送れるのは1つだけ。待っている間も、自分宛てに届いたものは処理する
+    while (__atomic_test_and_set(&g_shootdown_busy, __ATOMIC_ACQUIRE)) {
+        ServiceTLBShootdown();
+        __builtin_ia32_pause();
+    }
+    const int current = CurrentCPU();
+    g_shootdown = {addr, pages};
+    uint32_t targets = 0;
+    for (int cpu = 0; cpu < g_num_cpus; cpu++) {
+        if (cpu != current && __atomic_load_n(&g_cpus[cpu].started, __ATOMIC_ACQUIRE)) {
+            targets |= 1u << cpu;
+        }
+    }
+    __atomic_store_n(&g_shootdown_pending, targets, __ATOMIC_RELEASE);
+    for (int cpu = 0; cpu < g_num_cpus; cpu++) {
+        if ((targets >> cpu) & 1) {
+            SendIPI(g_cpus[cpu].lapic_id, 0x00004000 | g_shootdown_vector); // Fixed
+        }
+    }
+    while (__atomic_load_n(&g_shootdown_pending, __ATOMIC_ACQUIRE)) {
+        __builtin_ia32_pause();
+    }
+    __atomic_clear(&g_shootdown_busy, __ATOMIC_RELEASE);
+}
+
+void ServiceTLBShootdown() {
+    if (__atomic_load_n(&g_shootdown_pending, __ATOMIC_ACQUIRE) == 0) {
+        return;
+    }
+    const uint32_t bit = 1u << CurrentCPU();
+    // IPIとロック待ちの両方から呼ばれうるので、先に処理した方だけが破棄する
+    if ((__atomic_load_n(&g_shootdown_pending, __ATOMIC_ACQUIRE) & bit) == 0) {
+        return;
+    }
+    InvalidateTLBRange(g_shootdown.addr, g_shootdown.pages);
+    __atomic_fetch_and(&g_shootdown_pending, ~bit, __ATOMIC_RELEASE);
+}
+
+/// APの起動用コードから呼ばれる。BSPはこのAPが初期化を終えるまで割り込みを禁止して待っている
+extern "C" void APMain(uint64_t cpu) {
+    LoadKernelSegments();
+    // フレームバッファのWrite Combiningの設定をBSPとそろえる
+    InitializePAT();
+    InitializeTSS(cpu);
+    LoadInterruptDescriptorTable();
+    InitializeSyscall();
+    InitializeFPU();
+    // INITを受けたLocal APICは無効化されているので有効に戻す
+    g_lapic_svr = g_lapic_svr | 0x100;
+
+    // このコンテキストがこのCPUのアイドルタスクになる
+    g_task_manager->InitializeCPU(cpu);
+    __atomic_store_n(&g_cpus[cpu].started, true, __ATOMIC_RELEASE);
+
+    StartLAPICTimerInterrupt();
+    // 奪えるタスクがないか、ときどき起きて確かめる（起きたときのタイマ割り込みでタスク切替えが走る）
+    RunIdleLoop(kAPIdlePollTicks);
+}
+
+void InitializeSMP() {
+    g_cpus[0] = {ReadLAPICID(), true};
+    auto handler = [](uint64_t) { ServiceTLBShootdown(); };
+    if (auto [vector, err] = AllocateInterruptVector("tlb shootdown", handler, 0); err) {
+        // シュートダウンを送れないとカーネルのページを安全にアンマップできないので、APは起動しない
+        Log(kWarn, "failed to allocate a TLB shootdown vector: %s. running on the BSP only\n", err.Name());
+        return;
+    } else {
+        g_shootdown_vector = vector;
+    }
+    if (acpi::g_madt == nullptr) {
+        Log(kWarn, "MADT is not found. running on the BSP only\n");
+        return;
+    }
+
+    // 起動用コードを1MiB未満にコピーし、BSPと同じ制御レジスタの値を渡す
+    const size_t trampoline_size = APTrampolineEnd - APTrampolineBegin;
+    memcpy(reinterpret_cast<void*>(kAPTrampolineAddr), APTrampolineBegin, trampoline_size);
+    auto params = reinterpret_cast<APBootParams*>(
+        kAPTrampolineAddr + (APTrampolineParams - APTrampolineBegin));
+    params->cr0 = GetCR0();
+    params->cr3 = GetCR3() & ~0xfffull;
+    params->cr4 = GetCR4();
+    params->entry = reinterpret_cast<uint64_t>(APMain);
+
+    // APの初期化はメモリ確保などを伴うので、BSPは割り込みを禁止して1つずつ待つ
+    InterruptGuard guard;
+    const auto& madt = *acpi::g_madt;
+    auto p = reinterpret_cast<const uint8_t*>(&madt + 1);
+    const auto end = reinterpret_cast<const uint8_t*>(&madt) + madt.header.length;
+    for (; p < end && p[1] > 0; p += p[1]) {
+        if (p[0] != 0) { // Processor Local APIC以外は読み飛ばす
+            continue;
+        }
+        const auto& entry = *reinterpret_cast<const acpi::MADTLocalAPIC*>(p);
+        if ((entry.flags & 1) == 0 || entry.apic_id == g_cpus[0].lapic_id) {
+            continue;
+        }
+        if (g_num_cpus == kMaxCPUs) {
+            Log(kWarn, "too many CPUs. ignoring APIC ID %u\n", entry.apic_id);
+            break;
+        }
+
+        // CurrentCPU()がAP自身を見つけられるよう、先に登録しておく
+        const int cpu = g_num_cpus;
+        g_cpus[cpu] = {entry.apic_id, false};
+        g_num_cpus++;
+        if (!StartAP(cpu, entry.apic_id)) {
+            Log(kWarn, "failed to start AP (APIC ID %u)\n", entry.apic_id);
+            g_num_cpus--;
+        }
+    }
+    Log(kInfo, "%d CPUs are running\n", g_num_cpus);
+}
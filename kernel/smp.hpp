@@ -0,0 +1,38 @@
+/// SMP : Symmetric Multiprocessing
+/// BSP（起動時に動いている1つ目のCPUコア）以外のCPUコア（AP）を起動し、CPUコアごとの状態を管理する
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/// 扱うCPUコアの最大数
+const int kMaxCPUs = 16;
+/// APの起動用コードをコピーする物理アドレス
+/// APはリアルモードで起動するので1MiB未満のページ境界でなければならない
+const uint64_t kAPTrampolineAddr = 0x8000;
+
+/// CPUコアごとの情報
+struct CPUInfo {
+    uint8_t lapic_id;
+    /// 初期化を終えてタスクを実行できる : true
+    bool started;
+};
+
+/// 起動しているCPUコアの数
+int NumCPUs();
+/// 実行中のCPUコアの番号（0 : BSP）
+int CurrentCPU();
+const CPUInfo& GetCPUInfo(int cpu);
+
+/// MADTに記載されたAPをINIT-SIPI-SIPIで起動する
+/// タスク、タイマ、システムコールの初期化が済んでから呼ぶ
+void InitializeSMP();
+
+/// すべての起動済みのCPUコアのTLBから[addr, addr + pages * 4KiB)のエントリを破棄する（TLBシュートダウン）
+/// 自分のTLBを破棄し、他のCPUコアにはIPIを送って、破棄し終えるまで待つ
+/// カーネルのページ（グローバルページ）をアンマップしたら、フレームを解放する前に呼ぶ
+void ShootdownTLB(uint64_t addr, size_t pages);
+/// このCPUコア宛てのTLBシュートダウンが届いていれば処理する
+/// 割り込みを禁止してスピンロックを待つ間にも呼び、ロックを持ったままシュートダウンを待つ相手と待ち合わないようにする
+void ServiceTLBShootdown();
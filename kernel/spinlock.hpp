@@ -0,0 +1,46 @@
+/// スピンロック : 複数のCPUから操作されるデータを保護する
+/// 割り込みの禁止（cli）は自分のCPUにしか効かないので、他のCPUとの排他にはこちらを使う
+
+#pragma once
+
+#include "interrupt.hpp"
+#include "smp.hpp"
+
+class SpinLock {
+public:
+    void Lock() {
+        while (__atomic_test_and_set(&locked_, __ATOMIC_ACQUIRE)) {
+            // 解放されるまでは読むだけにして、キャッシュラインの奪い合いを避ける
+            // 持ち主がTLBシュートダウンの完了を待っているかもしれないので、届いていれば処理する
+            while (__atomic_load_n(&locked_, __ATOMIC_RELAXED)) {
+                ServiceTLBShootdown();
+                __builtin_ia32_pause();
+            }
+        }
+    }
+    void Unlock() {
+        __atomic_clear(&locked_, __ATOMIC_RELEASE);
+    }
+
+private:
+    bool locked_{false};
+};
+
+/// スコープ内で割り込みを禁止してロックを取り、抜けるときに解放して割り込みの状態を戻す
+/// ロックを持ったまま割り込みハンドラが同じロックを取りに行くと止まってしまうので、必ず割り込みも禁止する
+class SpinLockGuard {
+public:
+    explicit SpinLockGuard(SpinLock& lock) : lock_{lock} {
+        lock_.Lock();
+    }
+    ~SpinLockGuard() {
+        lock_.Unlock();
+    }
+    SpinLockGuard(const SpinLockGuard&) = delete;
+    SpinLockGuard& operator=(const SpinLockGuard&) = delete;
+
+private:
+    /// lock_より先に構築され、後に破棄される
+    InterruptGuard interrupt_guard_;
+    SpinLock& lock_;
+};
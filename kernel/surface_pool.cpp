@@ -0,0 +1,135 @@
+#include "surface_pool.hpp"
+
+#include <array>
+#include <utility>
+
+#include "memory_manager.hpp"
+#include "spinlock.hpp"
+
+namespace {
+    /// 区分の大きさは、2のべき乗の間を4等分した刻みに切り上げる（余りは最大で25%）
+    /// 区分0は4KiB以下、区分1〜4は(4KiB, 8KiB]、区分5〜8は(8KiB, 16KiB]、……
+    const size_t kMinSurfaceBytes = 4_KiB;
+    /// これより大きい領域は溜めない
+    const size_t kMaxSurfaceBytes = 32_MiB;
+    const size_t kNumClasses = 1 + 4 * (24 - 12 + 1);
+    /// 区分ごとに溜めておく最大の数と、プール全体で溜めておく最大のバイト数
+    const size_t kMaxPerClass = 4;
+    const size_t kMaxPooledBytes = 32_MiB;
+
+    int Log2Ceil(size_t bytes) {
+        return 64 - __builtin_clzl(bytes - 1);
+    }
+
+    /// bytesを区分の大きさに切り上げたもの
+    size_t ClassBytes(size_t bytes) {
+        if (bytes <= kMinSurfaceBytes) {
+            return kMinSurfaceBytes;
+        }
+        const size_t step = size_t{1} << (Log2Ceil(bytes) - 3);
+        return (bytes + step - 1) & ~(step - 1);
+    }
+
+    /// 区分の大きさclass_bytesの番号
+    size_t ClassIndex(size_t class_bytes) {
+        if (class_bytes <= kMinSurfaceBytes) {
+            return 0;
+        }
+        const int k = Log2Ceil(class_bytes) - 1; // 2^k < class_bytes <= 2^(k + 1)
+        return (k - 12) * 4 + (class_bytes >> (k - 2)) - 4;
+    }
+
+    SpinLock g_surface_lock;
+    std::array<std::vector<std::vector<uint8_t>>, kNumClasses>* g_surface_classes;
+    SurfacePoolStat g_surface_stat{};
+} // namespace
+
+void InitializeSurfacePool() {
+    g_surface_classes = new std::array<std::vector<std::vector<uint8_t>>, kNumClasses>;
+    for (auto& buffers : *g_surface_classes) {
+        buffers.reserve(kMaxPerClass);
+    }
+    AddMemoryPressureHandler(TrimSurfacePool);
+}
+
+std::vector<uint8_t> AcquireSurface(size_t bytes) {
+    std::vector<uint8_t> buffer;
+    const size_t class_bytes = ClassBytes(bytes);
+    if (class_bytes <= kMaxSurfaceBytes && g_surface_classes) {
+        SpinLockGuard lock{g_surface_lock};
+        auto& buffers = (*g_surface_classes)[ClassIndex(class_bytes)];
+        if (!buffers.empty()) {
+            buffer = std::move(buffers.back());
+            buffers.pop_back();
+            g_surface_stat.hits++;
+            g_surface_stat.pooled_buffers--;
+            g_surface_stat.pooled_bytes -= buffer.capacity();
+        } else {
+            g_surface_stat.misses++;
+        }
+    }
+
+    // 同じ区分の要求ならどれにでも使えるよう、区分の大きさで確保しておく
+    if (buffer.capacity() == 0) {
+        buffer.reserve(class_bytes);
+    }
+    buffer.resize(bytes); // 前のウィンドウの絵が見えないよう、0で埋める
+    return buffer;
+}
+
+void ReleaseSurface(std::vector<uint8_t>&& buffer) {
+    const size_t bytes = buffer.capacity();
+    if (bytes == 0 || bytes > kMaxSurfaceBytes || ClassBytes(bytes) != bytes ||
+        g_surface_classes == nullptr) {
+        return;
+    }
+
+    // 空きフレームが少なければ溜めない。溜めない領域は、ロックを放してから解放する
+    const bool low_on_frames = LowOnFrames();
+    std::vector<uint8_t> dropped;
+    {
+        SpinLockGuard lock{g_surface_lock};
+        auto& buffers = (*g_surface_classes)[ClassIndex(bytes)];
+        if (low_on_frames || buffers.size() >= kMaxPerClass ||
+            g_surface_stat.pooled_bytes + bytes > kMaxPooledBytes) {
+            g_surface_stat.drops++;
+            dropped = std::move(buffer);
+        } else {
+            buffer.clear();
+            buffers.push_back(std::move(buffer));
+            g_surface_stat.pooled_buffers++;
+            g_surface_stat.pooled_bytes += bytes;
+        }
+    }
+}
+
+void TrimSurfacePool() {
+    if (g_surface_classes == nullptr) {
+        return;
+    }
+    bool trimmed_any = false;
+    for (auto& buffers : *g_surface_classes) {
+        // ロックを持っている間はヒープを触らないよう、取り出すだけにして解放は後で行う
+        std::array<std::vector<uint8_t>, kMaxPerClass> trimmed;
+        {
+            SpinLockGuard lock{g_surface_lock};
+            for (size_t i = 0; !buffers.empty(); i++) {
+                trimmed[i] = std::move(buffers.back());
+                buffers.pop_back();
+                g_surface_stat.pooled_buffers--;
+                g_surface_stat.pooled_bytes -= trimmed[i].capacity();
+                g_surface_stat.trimmed_bytes += trimmed[i].capacity();
+                trimmed_any = true;
+            }
+        }
+    }
+    if (trimmed_any) {
+        SpinLockGuard lock{g_surface_lock};
+        g_surface_stat.trims++;
+    }
+}
+
+SurfacePoolStat GetSurfacePoolStat() {
+    SpinLockGuard lock{g_surface_lock};
+    return g_surface_stat;
+}
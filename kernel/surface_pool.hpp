@@ -0,0 +1,31 @@
+/// ウィンドウの面（FrameBufferが自分で持つピクセルの領域）を使い回すプール
+/// 閉じたウィンドウの領域を大きさの区分ごとに取っておき、次に開くウィンドウに渡す
+/// 空きフレームが少なくなったら、溜めている領域をすべてヒープに返す
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct SurfacePoolStat {
+    /// プールから渡せた回数と、新しく確保した回数
+    uint64_t hits, misses;
+    /// 溜めきれずに、または空きフレームが少なくて捨てた数
+    uint64_t drops;
+    /// 空きフレームが少なくなって手放した回数と、そのバイト数
+    uint64_t trims, trimmed_bytes;
+    /// 溜めている領域の数と、そのバイト数
+    size_t pooled_buffers, pooled_bytes;
+};
+
+/// bytesバイトの領域を返す（中身は0）。同じ区分の領域がプールにあればそれを使う
+std::vector<uint8_t> AcquireSurface(size_t bytes);
+/// 使い終えた領域をプールに戻す（AcquireSurface()で得たもの以外は捨てる）
+void ReleaseSurface(std::vector<uint8_t>&& buffer);
+/// 溜めている領域をすべて手放す
+void TrimSurfacePool();
+SurfacePoolStat GetSurfacePoolStat();
+
+/// メモリが足りなくなったときにプールを空にするよう登録する
+void InitializeSurfacePool();
@@ -0,0 +1,103 @@
+#include "sync.hpp"
+
+#include "task.hpp"
+
+void WaitQueue::Wait(SpinLock& lock) {
+    Task* task = &g_task_manager->CurrentTask();
+    task->wait_next_ = nullptr;
+    task->wait_queue_ = this;
+    if (tail_) {
+        tail_->wait_next_ = task;
+    } else {
+        head_ = task;
+    }
+    tail_ = task;
+
+    g_task_manager->SleepAndUnlock(lock);
+    lock.Lock();
+    // WakeOne()以外の理由で起きたなら、自分で列から外れる
+    if (task->wait_queue_ == this) {
+        Remove(task);
+    }
+}
+
+bool WaitQueue::WakeOne() {
+    Task* task = head_;
+    if (task == nullptr) {
+        return false;
+    }
+    Remove(task);
+    task->Wakeup();
+    return true;
+}
+
+void WaitQueue::WakeAll() {
+    while (WakeOne()) {
+    }
+}
+
+void WaitQueue::Remove(Task* task) {
+    Task* prev = nullptr;
+    for (Task* t = head_; t; prev = t, t = t->wait_next_) {
+        if (t != task) {
+            continue;
+        }
+        if (prev) {
+            prev->wait_next_ = t->wait_next_;
+        } else {
+            head_ = t->wait_next_;
+        }
+        if (tail_ == t) {
+            tail_ = prev;
+        }
+        break;
+    }
+    task->wait_next_ = nullptr;
+    task->wait_queue_ = nullptr;
+}
+
+void Mutex::Lock() {
+    SpinLockGuard guard{lock_};
+    while (locked_) {
+        waiters_.Wait(lock_);
+    }
+    locked_ = true;
+}
+
+bool Mutex::TryLock() {
+    SpinLockGuard guard{lock_};
+    if (locked_) {
+        return false;
+    }
+    locked_ = true;
+    return true;
+}
+
+void Mutex::Unlock() {
+    SpinLockGuard guard{lock_};
+    locked_ = false;
+    waiters_.WakeOne();
+}
+
+void Semaphore::Down() {
+    SpinLockGuard guard{lock_};
+    while (count_ == 0) {
+        waiters_.Wait(lock_);
+    }
+    count_--;
+}
+
+bool Semaphore::TryDown() {
+    SpinLockGuard guard{lock_};
+    if (count_ == 0) {
+        return false;
+    }
+    count_--;
+    return true;
+}
+
+void Semaphore::Up() {
+    SpinLockGuard guard{lock_};
+    count_++;
+    waiters_.WakeOne();
+}
@@ -0,0 +1,78 @@
+/// タスク間の同期 : 待ち行列、ミューテックス、セマフォ
+/// スピンロック（spinlock.hpp）と違い、待つ間はタスクをスリープさせるので、時間のかかる処理の排他に使える
+/// 割り込みハンドラからは待たない操作（WakeOne / WakeAll / Unlock / Up）だけを呼ぶ
+
+#pragma once
+
+#include <cstddef>
+
+#include "spinlock.hpp"
+
+class Task;
+
+/// 条件が成り立つのを待つタスクの列（Taskに埋め込まれたポインタでつなぐ）
+/// 列は、呼び出し側が条件と一緒にスピンロックで保護する
+class WaitQueue {
+public:
+    /// 実行中のタスクを列に並べてスリープする。lockは割り込みを禁止して取っておくこと
+    /// 並べてから眠るまでの間に起こされても取りこぼさない。戻るときにはlockを取り直している
+    /// メッセージの到着など他の理由でも起きるので、呼び出し側は条件を確かめ直すこと
+    void Wait(SpinLock& lock);
+    /// 先頭のタスクを起こす。起こしたら true
+    bool WakeOne();
+    void WakeAll();
+    bool Empty() const { return head_ == nullptr; }
+
+private:
+    void Remove(Task* task);
+
+    Task* head_{nullptr};
+    Task* tail_{nullptr};
+};
+
+/// スリープするミューテックス。取ったタスク以外が解放してはならない
+class Mutex {
+public:
+    void Lock();
+    /// 待たずに取れたら true
+    bool TryLock();
+    void Unlock();
+
+private:
+    SpinLock lock_{};
+    bool locked_{false};
+    WaitQueue waiters_{};
+};
+
+/// スコープ内でミューテックスを取る
+class MutexGuard {
+public:
+    explicit MutexGuard(Mutex& mutex) : mutex_{mutex} {
+        mutex_.Lock();
+    }
+    ~MutexGuard() {
+        mutex_.Unlock();
+    }
+    MutexGuard(const MutexGuard&) = delete;
+    MutexGuard& operator=(const MutexGuard&) = delete;
+
+private:
+    Mutex& mutex_;
+};
+
+/// 計数セマフォ
+class Semaphore {
+public:
+    explicit Semaphore(size_t count = 0) : count_{count} {}
+    /// カウントを1減らす。0なら増えるまで待つ
+    void Down();
+    /// 待たずに減らせたら true
+    bool TryDown();
+    /// カウントを1増やし、待っているタスクがいれば1つ起こす
+    void Up();
+
+private:
+    SpinLock lock_{};
+    size_t count_;
+    WaitQueue waiters_{};
+};
@@ -1,20 +1,32 @@
 #include "syscall.hpp"
 
+#include <algorithm>
 #include <array>
 #include <cerrno>
-#include <cmath>
 #include <cstdint>
 #include <fcntl.h>
+#include <optional>
+#include <utility>
+#include <vector>
 
 #include "app_event.hpp"
+#include "async_ring.hpp"
+#include "event_ring.hpp"
+#include "block.hpp"
 #include "asmfunc.h"
 #include "font.hpp"
+#include "idle.hpp"
 #include "keyboard.hpp"
 #include "logger.hpp"
 #include "msr.hpp"
+#include "paging.hpp"
+#include "shm.hpp"
+#include "smp.hpp"
 #include "task.hpp"
 #include "terminal.hpp"
 #include "timer.hpp"
+#include "trace.hpp"
+#include "virtio_net.hpp"
 
 namespace syscall {
     /// システムコールの戻り値型
@@ -53,29 +65,23 @@ namespace syscall {
         const auto fd = arg1;
         const char* s = reinterpret_cast<const char*>(arg2);
         const auto len = arg3;
-        if (len > 1024) {
-            return {0, E2BIG};
-        }
 
-        __asm__("cli");
         // 現在実行中のタスク -> PutStringをコールしたアプリ、が動作するターミナルタスク
         auto& task = g_task_manager->CurrentTask();
-        __asm__("sti");
 
         // 無効なFD
-        if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
+        auto file = task.File(fd);
+        if (!file) {
             return {0, EBADF};
         }
 
-        return {task.Files()[fd]->Write(s, len), 0};
+        return {file->Write(s, len), 0};
     }
 
     /// アプリ終了
     /// arg1 : 終了時コード
     SYSCALL(Exit) {
-        __asm__("cli");
         auto& task = g_task_manager->CurrentTask();
-        __asm__("sti");
         return {task.OSStackPointer(), static_cast<int>(arg1)};
     }
 
@@ -85,7 +91,7 @@ namespace syscall {
         const auto title = reinterpret_cast<const char*>(arg5);
         const auto win = std::make_shared<TopLevelWindow>(w, h, g_screen_config.pixel_format, title);
 
-        __asm__("cli");
+        MutexGuard lock{g_layer_mutex};
         const auto layer_id = g_layer_manager->NewLayer()
                                   .SetWindow(win)
                                   .SetDraggable(true)
@@ -96,7 +102,7 @@ namespace syscall {
         // アプリのウィンドウに入力したキーがターミナルタスクに送信されるようにする
         const auto task_id = g_task_manager->CurrentTask().ID();
         g_layer_task_map->insert(std::make_pair(layer_id, task_id));
-        __asm__("sti");
+        g_active_layer->UpdateFocus();
 
         return {layer_id, 0};
     }
@@ -109,9 +115,9 @@ namespace syscall {
             const uint32_t layer_flags = layer_id_flags >> 32;
             const unsigned int layer_id = layer_id_flags & 0xffffffff;
 
-            __asm__("cli");
+            // 描画中にウィンドウを閉じられないよう、最後まで持っておく
+            MutexGuard lock{g_layer_mutex};
             auto layer = g_layer_manager->FindLayer(layer_id);
-            __asm__("sti");
             if (layer == nullptr) {
                 return {0, EBADF};
             }
@@ -121,10 +127,9 @@ namespace syscall {
                 return res;
             }
 
-            if ((layer_flags & 1) == 0) {
-                __asm__("cli");
+            // 2面のウィンドウの描画は裏の面に行うので、WinPresentまで画面は変わらない
+            if ((layer_flags & 1) == 0 && !layer->GetWindow()->DoubleBuffered()) {
                 g_layer_manager->Draw(layer_id);
-                __asm__("sti");
             }
 
             return res;
@@ -155,6 +160,11 @@ namespace syscall {
         return {g_timer_manager->CurrentTick(), kTimerFreq};
     }
 
+    /// 起動してからのナノ秒数
+    SYSCALL(GetTimeNs) {
+        return {CurrentTimeNs(), 0};
+    }
+
     /// 指定レイヤを再描画するだけ
     SYSCALL(WinRedraw) {
         return DoWinFunc(
@@ -168,53 +178,65 @@ namespace syscall {
     SYSCALL(WinDrawLine) {
         return DoWinFunc(
             [](Window& win, int x0, int y0, int x1, int y1, uint32_t color) {
-                auto sign = [](int x) {
-                    return (x > 0) ? 1 : (x < 0) ? -1
-                                                 : 0;
-                };
-                // 横、縦の変位
-                // + sign()の補正がないと(x1, y1)を含まないような直線になってしまう
-                const int dx = x1 - x0 + sign(x1 - x0);
-                const int dy = y1 - y0 + sign(y1 - y0);
-
-                // 2点が等しい場合
-                if (dx == 0 && dy == 0) {
-                    win.Writer()->Write({x0, y0}, ToColor(color));
-                    return Result{0, 0};
-                }
+                DrawLine(*win.Writer(), {x0, y0}, {x1, y1}, ToColor(color));
+                return Result{0, 0};
+            },
+            arg1, arg2, arg3, arg4, arg5, arg6);
+    }
 
-                // 切り捨て
-                const auto floord = static_cast<double (*)(double)>(floor);
-                // 切り上げ
-                const auto ceild = static_cast<double (*)(double)>(ceil);
+    namespace {
+        /// apps/syscall.hのWinCommandと同じ並び
+        struct WinCommand {
+            enum Type : uint32_t {
+                kFill,
+                kLine,
+                kString,
+                kBlit,
+            } type;
+            uint32_t color;
+            /// kFill, kBlit : 左上とサイズ、kLine : 始点と終点、kString : 左上（w, hは使わない）
+            int x, y, w, h;
+            /// kString : 文字列、kBlit : w * h 個の色（0xRRGGBB）
+            const void* data;
+        };
 
-                if (abs(dx) >= abs(dy)) { // 傾きが1以下（水平に近い）の場合、x軸に沿って点を描画
-                    if (dx < 0) {
-                        std::swap(x0, x1);
-                        std::swap(y0, y1);
-                    }
-                    const auto roundish = y1 >= y0 ? floord : ceild;
-                    // 傾き
-                    const double m = static_cast<double>(dy) / dx;
-                    for (int x = x0; x <= x1; x++) {
-                        const int y = roundish(m * (x - x0) + y0);
-                        win.Writer()->Write({x, y}, ToColor(color));
-                    }
-                } else { // 傾きが1より大きい（垂直に近い）の場合、y軸に沿って点を描画
-                    if (dy < 0) {
-                        std::swap(x0, x1);
-                        std::swap(y0, y1);
-                    }
-                    const auto roundish = x1 >= x0 ? floord : ceild;
-                    const double m = static_cast<double>(dx) / dy;
-                    for (int y = y0; y <= y1; y++) {
-                        const int x = roundish(m * (y - y0) + x0);
-                        win.Writer()->Write({x, y}, ToColor(color));
+        /// ピクセルの配列を転送する。ウィンドウからはみ出す部分は捨てる
+        /// PerPixelAlpha()のウィンドウには、上位8ビットの透明度も残す
+        void Blit(Window& win, int x, int y, int w, int h, const uint32_t* pixels) {
+            win.WriteImage({x, y}, {w, h}, pixels, static_cast<size_t>(w) * 4, ImageFormat::kARGB8888);
+        }
+    } // namespace
+
+    /// 描画命令の列をまとめて実行する。レイヤの検索と再描画は1回で済む
+    /// arg1 : レイヤIDとフラグ（DoWinFuncを参照）、arg2 : WinCommandの配列、arg3 : 要素数
+    /// 戻り値 : 実行した命令の数（未知の命令があればそこで止めてEINVAL）
+    SYSCALL(WinBatch) {
+        return DoWinFunc(
+            [](Window& win, const WinCommand* cmds, size_t num_cmds) {
+                for (size_t i = 0; i < num_cmds; i++) {
+                    const auto& c = cmds[i];
+                    switch (c.type) {
+                    case WinCommand::kFill:
+                        FillRectangle(*win.Writer(), {c.x, c.y}, {c.w, c.h}, ToColor(c.color));
+                        break;
+                    case WinCommand::kLine:
+                        DrawLine(*win.Writer(), {c.x, c.y}, {c.w, c.h}, ToColor(c.color));
+                        break;
+                    case WinCommand::kString:
+                        WriteString(*win.Writer(), {c.x, c.y}, reinterpret_cast<const char*>(c.data), ToColor(c.color));
+                        break;
+                    case WinCommand::kBlit:
+                        if (c.w > 0 && c.h > 0) {
+                            Blit(win, c.x, c.y, c.w, c.h, reinterpret_cast<const uint32_t*>(c.data));
+                        }
+                        break;
+                    default:
+                        return Result{i, EINVAL};
                     }
                 }
-                return Result{0, 0};
+                return Result{num_cmds, 0};
             },
-            arg1, arg2, arg3, arg4, arg5, arg6);
+            arg1, reinterpret_cast<const WinCommand*>(arg2), static_cast<size_t>(arg3));
     }
 
     /// 指定レイヤのウィンドウを削除
@@ -236,77 +258,52 @@ namespace syscall {
         }
         const auto app_events = reinterpret_cast<AppEvent*>(arg1);
         const size_t len = arg2;
+        if (auto err = PrepareUserWrite(arg1, len * sizeof(AppEvent))) {
+            return {0, EFAULT};
+        }
 
-        __asm__("cli");
         // 実行中のタスク -> ターミナルタスク
         auto& task = g_task_manager->CurrentTask();
-        __asm__("sti");
         size_t i = 0;
 
         while (i < len) {
-            __asm__("cli");
             // アプリに対するキー入力はターミナルタスクのメッセージキューから受け取る
-            auto msg = task.ReceiveMessage();
-            if (!msg && i == 0) {
-                task.Sleep();
-                continue;
+            // 1つ目のイベントは届くまで待ち、2つ目以降は溜まっている分だけ取り出す
+            std::optional<Message> msg;
+            if (i == 0) {
+                // 強制終了を求められたら、何も返さずにシステムコールの出口で終わる
+                while (!(msg = task.ReceiveMessage()) && !task.ExitRequested()) {
+                    g_task_manager->SleepIfNoMessage(&task);
+                }
+            } else {
+                msg = task.ReceiveMessage();
             }
-            __asm__("sti");
-
             if (!msg) {
                 break;
             }
 
-            switch (msg->type) {
-            case Message::kKeyPush:
-                // Ctrl + Q で終了
-                if (msg->arg.keyboard.keycode == 20 /* Q key */
-                    && msg->arg.keyboard.modifier & (kLControlBitMask | kRControlBitMask)) {
-                    app_events[i].type = AppEvent::kQuit;
-                } else {
-                    app_events[i].type = AppEvent::kKeyPush;
-                    app_events[i].arg.keypush.modifier = msg->arg.keyboard.modifier;
-                    app_events[i].arg.keypush.keycode = msg->arg.keyboard.keycode;
-                    app_events[i].arg.keypush.ascii = msg->arg.keyboard.ascii;
-                    app_events[i].arg.keypush.press = msg->arg.keyboard.press;
-                }
-                i++;
-                break;
-            case Message::kMouseMove:
-                // 型変換
-                app_events[i].type = AppEvent::kMouseMove;
-                app_events[i].arg.mouse_move.x = msg->arg.mouse_move.x;
-                app_events[i].arg.mouse_move.y = msg->arg.mouse_move.y;
-                app_events[i].arg.mouse_move.dx = msg->arg.mouse_move.dx;
-                app_events[i].arg.mouse_move.dy = msg->arg.mouse_move.dy;
-                app_events[i].arg.mouse_move.buttons = msg->arg.mouse_move.buttons;
-                i++;
-                break;
-            case Message::kMouseButton:
-                // 型変換
-                app_events[i].type = AppEvent::kMouseButton;
-                app_events[i].arg.mouse_button.x = msg->arg.mouse_button.x;
-                app_events[i].arg.mouse_button.y = msg->arg.mouse_button.y;
-                app_events[i].arg.mouse_button.press = msg->arg.mouse_button.press;
-                app_events[i].arg.mouse_button.button = msg->arg.mouse_button.button;
-                i++;
-                break;
-            case Message::kTimerTimeout:
-                // アプリが生成したタイマーかを識別
-                if (msg->arg.timer.value < 0) {
-                    app_events[i].type = AppEvent::kTimerTimeout;
-                    app_events[i].arg.timer.timeout = msg->arg.timer.timeout;
-                    app_events[i].arg.timer.value = -msg->arg.timer.value;
-                    i++;
+            if (msg->type == Message::kMouseMove) {
+                // 同じボタンの状態での移動が続けて溜まっていれば、移動量を足し合わせて1つのイベントにまとめる
+                while (auto next = task.PeekMessage()) {
+                    if (next->type != Message::kMouseMove ||
+                        next->arg.mouse_move.buttons != msg->arg.mouse_move.buttons) {
+                        break;
+                    }
+                    task.ReceiveMessage();
+                    msg->arg.mouse_move.x = next->arg.mouse_move.x;
+                    msg->arg.mouse_move.y = next->arg.mouse_move.y;
+                    msg->arg.mouse_move.dx += next->arg.mouse_move.dx;
+                    msg->arg.mouse_move.dy += next->arg.mouse_move.dy;
                 }
-                break;
-            case Message::kWindowClose:
-                app_events[i].type = AppEvent::kQuit;
+            }
+
+            // 型変換（イベントリングと共通）
+            if (auto event = ToAppEvent(*msg)) {
+                app_events[i] = *event;
                 i++;
-                break;
-            default:
+            } else if (msg->type != Message::kTimerTimeout && msg->type != Message::kFileReady) {
+                // ターミナルのタイマと、SyscallWaitを起こすためだけのメッセージは黙って捨てる
                 Log(kInfo, "uncaught event type: %u\n", msg->type);
-                break;
             }
         }
 
@@ -314,6 +311,7 @@ namespace syscall {
     }
 
     /// タイマ生成
+    /// 戻り値はタイムアウト時刻。modeのbit2が立っていれば、代わりにCancelTimerに渡すハンドルを返す
     SYSCALL(CreateTimer) {
         const unsigned int mode = arg1;
         const int timer_value = arg2;
@@ -321,36 +319,102 @@ namespace syscall {
             return {0, EINVAL};
         }
 
-        __asm__("cli");
         const uint64_t task_id = g_task_manager->CurrentTask().ID();
-        __asm__("sti");
 
-        unsigned long timeout = arg3 * kTimerFreq / 1000;
+        // bit1が立っていればarg3と戻り値の単位をマイクロ秒とする（立っていなければミリ秒）
+        const unsigned long unit_per_sec = (mode & 2) ? 1000000 : 1000;
+        unsigned long timeout = arg3 * kTimerFreq / unit_per_sec;
         if (mode & 1) { // relative
-                        // 現在時刻を基準としてarg3 msec後にタイムアウト
+                        // 現在時刻を基準としてarg3 msec（usec）後にタイムアウト
             timeout += g_timer_manager->CurrentTick();
         }
 
-        __asm__("cli");
         // 符号を反転しているのはOSとアプリのタイマを区別するため
         // ターミナルタスクにはカーソル点滅タイマの通知が常に送られてくるので、アプリのタイマ値とだぶっても大丈夫なようにしている
-        g_timer_manager->AddTimer(Timer{timeout, -timer_value, task_id});
-        __asm__("sti");
+        auto [timer_id, err] = g_timer_manager->AddTimer(Timer{timeout, -timer_value, task_id});
+        if (err) {
+            return {0, EAGAIN};
+        }
+
+        if (mode & 4) {
+            return {timer_id, 0};
+        }
+        return {timeout * unit_per_sec / kTimerFreq, 0};
+    }
+
+    /// 実行中のタスクを眠らせ、arg1ナノ秒後にタイマで直接起こす
+    /// メッセージキューを経由しないので、届いているイベントはそのまま残る（イベントが届いても眠り続ける）
+    SYSCALL(Sleep) {
+        const uint64_t ns = arg1;
+        if (ns == 0) {
+            return {0, 0};
+        }
+        // 指定より早く起きないよう、tickに切り上げる
+        const uint64_t ns_per_tick = 1000000000 / kTimerFreq;
+        auto& task = g_task_manager->CurrentTask();
+        const unsigned long deadline = g_timer_manager->CurrentTick() + (ns + ns_per_tick - 1) / ns_per_tick;
+        auto [timer_id, err] = g_timer_manager->AddTimer(Timer::WakeupTimer(deadline, task.ID()));
+        if (err) {
+            return {0, EAGAIN};
+        }
+        // メッセージが届くと起こされるので、期限が来るまで眠り直す（強制終了を求められたらやめる）
+        while (g_timer_manager->CurrentTick() < deadline && !task.ExitRequested()) {
+            g_task_manager->SleepIfBefore(&task, deadline);
+        }
+        g_timer_manager->CancelTimer(timer_id);
+        return {0, 0};
+    }
+
+    /// 周期タイマ生成
+    /// arg3 : 周期（msec。arg1のbit1が立っていればusec）。最初のタイムアウトは今から1周期後
+    /// 戻り値はCancelTimerに渡すハンドル。アプリが終了すると自動的に止まる
+    SYSCALL(CreatePeriodicTimer) {
+        const unsigned int mode = arg1;
+        const int timer_value = arg2;
+        const unsigned long unit_per_sec = (mode & 2) ? 1000000 : 1000;
+        const unsigned long period = arg3 * kTimerFreq / unit_per_sec;
+        if (timer_value <= 0 || period == 0) {
+            return {0, EINVAL};
+        }
 
-        return {timeout * 1000 / kTimerFreq, 0};
+        const uint64_t task_id = g_task_manager->CurrentTask().ID();
+        const unsigned long timeout = g_timer_manager->CurrentTick() + period;
+        auto [timer_id, err] = g_timer_manager->AddTimer(Timer{timeout, -timer_value, task_id, period});
+        if (err) {
+            return {0, EAGAIN};
+        }
+        return {timer_id, 0};
+    }
+
+    /// タイマの取り消し
+    /// arg1 : CreateTimer / CreatePeriodicTimerが返したハンドル
+    SYSCALL(CancelTimer) {
+        const uint64_t task_id = g_task_manager->CurrentTask().ID();
+        // 他のタスクのタイマや、ターミナルのカーソル点滅タイマ（値が正）は取り消させない
+        // 調べてから取り消すまでにタイムアウトしてノードが使い回されても、IDの世代が違うので他のタイマは消えない
+        const auto timer = g_timer_manager->FindTimer(arg1);
+        if (!timer || timer->TaskID() != task_id || timer->Value() >= 0) {
+            return {0, EINVAL};
+        }
+        g_timer_manager->CancelTimer(arg1);
+        return {0, 0};
     }
 
     namespace {
-        /// Task::files_の空き要素を返す
-        size_t AllocateFD(Task& task) {
-            const size_t num_files = task.Files().size();
+        /// ファイルディスクリプタの表の空き要素にfileを置き、その番号を返す
+        /// 表はスレッドと共有するので、探してから置くまで割り込みを禁止する
+        size_t AllocateFD(Task& task, std::shared_ptr<IFileDescriptor> file) {
+            InterruptGuard guard;
+            auto& files = task.Files();
+            const size_t num_files = files.size();
             for (size_t i = 0; i < num_files; i++) {
-                if (!task.Files()[i]) {
+                if (!files[i]) {
+                    files[i] = std::move(file);
                     return i;
                 }
             }
 
-            task.Files().emplace_back();
+            files.push_back(std::move(file));
             return num_files;
         }
 
@@ -375,15 +439,21 @@ namespace syscall {
     SYSCALL(OpenFile) {
         const char* path = reinterpret_cast<const char*>(arg1);
         const int flags = arg2;
-        __asm__("cli");
         auto& task = g_task_manager->CurrentTask();
-        __asm__("sti");
 
         // 標準入力に特殊なファイル名を与える
         // アプリ側では fopen("@stdin", "r") で標準入力を取得できる
         if (strcmp(path, "@stdin") == 0) {
             return {0, 0};
         }
+        // fopen("@net", "r+") でネットワークカードの生のフレームを読み書きする
+        if (strcmp(path, "@net") == 0) {
+            if (virtio::g_net_device == nullptr) {
+                return {0, ENODEV};
+            }
+            const size_t fd = AllocateFD(task, std::make_shared<virtio::NetSocket>(*virtio::g_net_device));
+            return {fd, 0};
+        }
 
         auto [file, post_slash] = fat::FindFile(path);
         if (file == nullptr) {
@@ -401,8 +471,7 @@ namespace syscall {
             return {0, ENOENT}; // no entry
         }
 
-        size_t fd = AllocateFD(task);
-        task.Files()[fd] = std::make_unique<fat::FileDescriptor>(*file);
+        const size_t fd = AllocateFD(task, std::allocate_shared<fat::FileDescriptor>(SlabAllocator<fat::FileDescriptor>{}, *file));
         return {fd, 0};
     }
 
@@ -411,15 +480,23 @@ namespace syscall {
         const int fd = arg1;
         void* buf = reinterpret_cast<void*>(arg2);
         size_t count = arg3;
-        __asm__("cli");
         auto& task = g_task_manager->CurrentTask();
-        __asm__("sti");
 
         // 無効なファイルディスクリプタ
-        if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
+        auto file = task.File(fd);
+        if (!file) {
             return {0, EBADF};
         }
-        return {task.Files()[fd]->Read(buf, count), 0};
+        if (!file->PreparesUserWrite()) {
+            if (auto err = PrepareUserWrite(arg2, count)) {
+                return {0, EFAULT};
+            }
+        }
+        auto [n, err] = file->ReadUser(buf, count);
+        if (err) {
+            return {0, EFAULT};
+        }
+        return {n, 0};
     }
 
     /// デマンドページング可能なアドレス範囲を拡大
@@ -427,10 +504,10 @@ namespace syscall {
     SYSCALL(DemandPages) {
         const size_t num_pages = arg1;
         // const int flags = arg2;
-        __asm__("cli");
         auto& task = g_task_manager->CurrentTask();
-        __asm__("sti");
 
+        // スレッドが同時に呼んでも、同じ範囲を返さないように
+        InterruptGuard guard;
         const uint64_t dp_end = task.DPagingEnd();
         // 指定ページ数の分だけ終端を後ろにずらす
         task.SetDPagingEnd(dp_end + 4096 * num_pages);
@@ -443,22 +520,855 @@ namespace syscall {
         const int fd = arg1;
         size_t* file_size = reinterpret_cast<size_t*>(arg2);
         // const int flags = arg3;
-        __asm__("cli");
         auto& task = g_task_manager->CurrentTask();
-        __asm__("sti");
 
         // 無効なファイルディスクリプタ
-        if (fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
+        auto file = task.File(fd);
+        if (!file) {
             return {0, EBADF};
         }
+        if (auto err = PrepareUserWrite(arg2, sizeof(size_t))) {
+            return {0, EFAULT};
+        }
 
-        *file_size = task.Files()[fd]->Size();
+        *file_size = file->Size();
+        InterruptGuard guard;
         const uint64_t vaddr_end = task.FileMapEnd();
         const uint64_t vaddr_begin = (vaddr_end - *file_size) & 0xfffffffffffff000;
         task.SetFileMapEnd(vaddr_begin);
-        task.FileMaps().push_back(FileMapping{fd, vaddr_begin, vaddr_end});
+        task.FileMaps().insert({vaddr_begin, FileMapping{fd, vaddr_begin, vaddr_end}});
         return {vaddr_begin, 0};
     }
+
+    /// メモリマップドファイルへのアクセス方法をOSに伝える
+    SYSCALL(MapAdvise) {
+        const uint64_t addr = arg1;
+        const size_t len = arg2;
+        const auto advice = static_cast<MapAdvice>(arg3);
+        if (advice < MapAdvice::kNormal || MapAdvice::kWillNeed < advice) {
+            return {0, EINVAL};
+        }
+
+        if (auto err = AdviseFileMapping(addr, len, advice)) {
+            return {0, err.Cause() == Error::kIndexOutOfRange ? EINVAL : ENOMEM};
+        }
+        return {0, 0};
+    }
+
+    /// メモリマップドファイルのマップを解除
+    SYSCALL(Unmap) {
+        const uint64_t addr = arg1;
+        const size_t len = arg2;
+        if (addr < 0x8000000000000000) {
+            return {0, EFAULT};
+        }
+
+        if (auto err = UnmapFileMappings(addr, len)) {
+            return {0, EINVAL};
+        }
+        return {0, 0};
+    }
+
+    /// デマンドページングで割り当てられたページのフレームをOSに返す
+    SYSCALL(ReleasePages) {
+        const uint64_t addr = arg1;
+        const size_t len = arg2;
+        if (auto err = ReleaseDemandPages(addr, len)) {
+            return {0, EINVAL};
+        }
+        return {0, 0};
+    }
+
+    /// 共有メモリをメモリマップドファイルの範囲に置く。実際にマップするのはページフォルトが発生してから
+    uint64_t AddShmMapping(Task& task, SharedMemory* shm) {
+        InterruptGuard guard;
+        const uint64_t vaddr_end = task.FileMapEnd();
+        const uint64_t vaddr_begin = vaddr_end - shm->num_pages * 4096;
+        task.SetFileMapEnd(vaddr_begin);
+        task.FileMaps().insert({vaddr_begin, FileMapping{-1, vaddr_begin, vaddr_end, MapAdvice::kNormal, 0, shm}});
+        return vaddr_begin;
+    }
+
+    /// 共有メモリを作り、自身にマップする
+    /// arg1 : バイト数（4KiB単位に切り上げる）、arg2 : 共有メモリのIDの格納先
+    SYSCALL(CreateShm) {
+        const size_t bytes = arg1;
+        uint64_t* id = reinterpret_cast<uint64_t*>(arg2);
+        // const int flags = arg3;
+        if (auto err = PrepareUserWrite(arg2, sizeof(uint64_t))) {
+            return {0, EFAULT};
+        }
+
+        auto [shm, err] = CreateSharedMemory((bytes + 4095) / 4096);
+        if (err) {
+            return {0, err.Cause() == Error::kIndexOutOfRange ? EINVAL : ENOMEM};
+        }
+        *id = shm->id;
+
+        auto& task = g_task_manager->CurrentTask();
+        const uint64_t vaddr = AddShmMapping(task, shm);
+        return {vaddr, 0};
+    }
+
+    /// 他のタスクが作った共有メモリを自身にマップする
+    /// arg1 : 共有メモリのID、arg2 : 共有メモリのバイト数の格納先
+    SYSCALL(MapShm) {
+        const uint64_t id = arg1;
+        size_t* bytes = reinterpret_cast<size_t*>(arg2);
+        // const int flags = arg3;
+        if (auto err = PrepareUserWrite(arg2, sizeof(size_t))) {
+            return {0, EFAULT};
+        }
+
+        auto shm = AttachSharedMemory(id);
+        if (shm == nullptr) {
+            return {0, ENOENT};
+        }
+        *bytes = shm->num_pages * 4096;
+
+        auto& task = g_task_manager->CurrentTask();
+        const uint64_t vaddr = AddShmMapping(task, shm);
+        return {vaddr, 0};
+    }
+
+    /// ページフォルトの統計を取得
+    /// arg2 : 0なら実行中のタスク（アプリ自身）、それ以外ならシステム全体
+    SYSCALL(GetFaultStat) {
+        if (arg1 < 0x8000000000000000) {
+            return {0, EFAULT};
+        }
+        if (auto err = PrepareUserWrite(arg1, sizeof(PageFaultStat))) {
+            return {0, EFAULT};
+        }
+
+        auto stat = g_task_manager->CurrentTask().FaultStat();
+        if (arg2 != 0) {
+            stat = GetPageFaultStat();
+        }
+        *reinterpret_cast<PageFaultStat*>(arg1) = stat;
+        return {0, 0};
+    }
+
+    namespace {
+        /// apps/syscall.hのWaitFdと同じ並び
+        struct WaitFd {
+            int fd;
+            /// 読める : 1
+            int ready;
+        };
+    } // namespace
+
+    /// 複数のファイルとイベントをまとめて待つ
+    /// arg1 : WaitFdの配列（readyに結果が入る）、arg2 : 要素数、arg3 : 待つ上限（msec、0なら待たない、~0なら無期限）
+    /// 戻り値 : bit0 = 読めるファイルがある、bit1 = ReadEventで読めるイベントがある、0 = タイムアウト
+    SYSCALL(Wait) {
+        const auto fds = reinterpret_cast<WaitFd*>(arg1);
+        const size_t num_fds = arg2;
+        const unsigned long timeout_ms = arg3;
+        if (num_fds > 0 && PrepareUserWrite(arg1, num_fds * sizeof(WaitFd))) {
+            return {0, EFAULT};
+        }
+
+        auto& task = g_task_manager->CurrentTask();
+        for (size_t i = 0; i < num_fds; i++) {
+            if (!task.File(fds[i].fd)) {
+                return {0, EBADF};
+            }
+        }
+
+        // 期限が来たら起こしてもらう（値0のタイマは、アプリにもターミナルにも無視される）
+        const bool infinite = timeout_ms == ~0ul;
+        const unsigned long deadline = g_timer_manager->CurrentTick() + timeout_ms * (kTimerFreq / 1000);
+        uint64_t timer_id = 0;
+        if (!infinite && timeout_ms > 0) {
+            auto [id, err] = g_timer_manager->AddTimer(Timer{deadline, 0, task.ID()});
+            if (err) {
+                return {0, EAGAIN};
+            }
+            timer_id = id;
+        }
+
+        uint64_t ready;
+        while (true) {
+            // ReadEventでも捨てられるだけのメッセージは、ここで捨てておく
+            // イベントリングを使っていれば、リングに入り切らなかったメッセージをリングに移す
+            task.RefillEventRing();
+            while (auto msg = task.PeekMessage()) {
+                if (ToAppEvent(*msg)) {
+                    break;
+                }
+                task.ReceiveMessage();
+            }
+
+            ready = 0;
+            for (size_t i = 0; i < num_fds; i++) {
+                fds[i].ready = task.File(fds[i].fd)->PollRead(task.ID());
+                if (fds[i].ready) {
+                    ready |= 1;
+                }
+            }
+            if (task.PeekMessage() || task.EventRingReady()) {
+                ready |= 2;
+            }
+            if (ready != 0 || timeout_ms == 0 || task.ExitRequested() ||
+                (!infinite && g_timer_manager->CurrentTick() >= deadline)) {
+                break;
+            }
+            // ファイルが読めるようになってもメッセージで起こされる
+            g_task_manager->SleepIfNoMessage(&task);
+        }
+
+        if (timer_id != 0) {
+            g_timer_manager->CancelTimer(timer_id);
+        }
+        return {ready, 0};
+    }
+
+    namespace {
+        /// 非同期リングから呼ばれるシステムコール（定義はテーブルの後ろ）
+        Result CallSyscall(const AsyncSubmission& sqe);
+    } // namespace
+
+    /// 非同期システムコールのリングを作り、自身にマップしてそのアドレスを返す
+    /// arg1 : 受付リングの要素数、arg2 : SyscallAsyncEnterに渡すファイルディスクリプタの格納先
+    SYSCALL(AsyncSetup) {
+        const size_t entries = arg1;
+        int* fd = reinterpret_cast<int*>(arg2);
+        // const int flags = arg3;
+        if (auto err = PrepareUserWrite(arg2, sizeof(int))) {
+            return {0, EFAULT};
+        }
+
+        auto [shm, err] = CreateAsyncRing(entries);
+        if (err) {
+            return {0, err.Cause() == Error::kIndexOutOfRange ? EINVAL : ENOMEM};
+        }
+
+        auto& task = g_task_manager->CurrentTask();
+        const size_t ring_fd = AllocateFD(task, std::allocate_shared<AsyncRingDescriptor>(
+                                                    SlabAllocator<AsyncRingDescriptor>{}, shm));
+        *fd = ring_fd;
+        return {AddShmMapping(task, shm), 0};
+    }
+
+    /// アプリ宛てのイベントを積むリングを作り、自身にマップしてそのアドレスを返す
+    /// 以降のイベントはReadEventではなくリングから取り出す。リングが空ならSyscallWaitで待つ
+    /// arg1 : リングの要素数
+    SYSCALL(EventRingSetup) {
+        const size_t entries = arg1;
+        // const int flags = arg2;
+        auto [shm, err] = CreateEventRing(entries);
+        if (err) {
+            return {0, err.Cause() == Error::kIndexOutOfRange ? EINVAL : ENOMEM};
+        }
+
+        auto& task = g_task_manager->CurrentTask();
+        task.SetEventRing(std::make_shared<EventRing>(shm));
+        // ReadEvent用のキューに残っている分もリングに移す
+        task.RefillEventRing();
+        return {AddShmMapping(task, shm), 0};
+    }
+
+    /// 受付リングに積まれた要求を最大arg2個処理し、完了リングに結果を積む
+    /// arg1 : SyscallAsyncSetupで得たファイルディスクリプタ
+    /// 戻り値 : 処理した要求の数
+    SYSCALL(AsyncEnter) {
+        const int fd = arg1;
+        const size_t to_submit = arg2;
+        auto& task = g_task_manager->CurrentTask();
+        auto file = task.File(fd);
+        if (!file) {
+            return {0, EBADF};
+        }
+        auto ring = file->AsyncRing();
+        if (ring == nullptr) {
+            return {0, EBADF};
+        }
+
+        const size_t n = ring->Process(to_submit, [](const AsyncSubmission& sqe) {
+            const auto res = CallSyscall(sqe);
+            return std::pair<uint64_t, int64_t>{res.value, res.error};
+        });
+        return {n, 0};
+    }
+    /// システムコールの統計を取得する
+    /// arg1 : SyscallStatの配列、arg2 : 要素数、arg3 : 0なら実行中のタスク（アプリ自身）、それ以外ならシステム全体
+    /// 戻り値 : システムコールの数（arg2より大きければ、その分は書き込まない）
+    SYSCALL(GetSyscallStat) {
+        const size_t len = std::min(static_cast<size_t>(arg2), kNumSyscalls);
+        if (auto err = PrepareUserWrite(arg1, len * sizeof(SyscallStat))) {
+            return {0, EFAULT};
+        }
+
+        auto stats = reinterpret_cast<SyscallStat*>(arg1);
+        if (arg3 != 0) {
+            const auto global = ::GetSyscallStat();
+            std::copy_n(global.begin(), len, stats);
+        } else if (auto task_stats = g_task_manager->CurrentTask().SyscallStats()) {
+            std::copy_n(task_stats->begin(), len, stats);
+        } else {
+            std::fill_n(stats, len, SyscallStat{});
+        }
+        return {kNumSyscalls, 0};
+    }
+
+    /// ファイルへの書き込み
+    /// arg1 : ファイルディスクリプタ、arg2 : 書き込むデータ、arg3 : バイト数（上限なし）
+    /// 戻り値 : 書き込んだバイト数
+    SYSCALL(WriteFile) {
+        const int fd = arg1;
+        const void* buf = reinterpret_cast<const void*>(arg2);
+        const size_t count = arg3;
+        auto& task = g_task_manager->CurrentTask();
+
+        auto file = task.File(fd);
+        if (!file) {
+            return {0, EBADF};
+        }
+        return {file->Write(buf, count), 0};
+    }
+
+    namespace {
+        /// apps/syscall.hのIoVecと同じ並び
+        struct IoVec {
+            void* base;
+            size_t len;
+        };
+        /// 1回のReadV/WriteVで扱える要素数
+        const size_t kMaxIoVecs = 1024;
+
+        /// ReadV, WriteVの引数を確かめ、ファイルディスクリプタを返す
+        WithError<IFileDescriptor*> GetIoVecFile(int fd, size_t num_iovs) {
+            auto& task = g_task_manager->CurrentTask();
+            auto file = task.File(fd);
+            if (!file) {
+                return {nullptr, MAKE_ERROR(Error::kInvalidFile)};
+            }
+            if (num_iovs > kMaxIoVecs) {
+                return {nullptr, MAKE_ERROR(Error::kIndexOutOfRange)};
+            }
+            return {file.get(), MAKE_ERROR(Error::kSuccess)};
+        }
+    } // namespace
+
+    /// 複数のバッファに順に読み込む
+    /// arg1 : ファイルディスクリプタ、arg2 : IoVecの配列、arg3 : 要素数
+    /// 戻り値 : 読み込んだバイト数の合計（途中で要求より少なくしか読めなければ、そこで止める）
+    SYSCALL(ReadV) {
+        const auto iovs = reinterpret_cast<const IoVec*>(arg2);
+        const size_t num_iovs = arg3;
+        auto [file, err] = GetIoVecFile(arg1, num_iovs);
+        if (err) {
+            return {0, err.Cause() == Error::kInvalidFile ? EBADF : EINVAL};
+        }
+
+        size_t total = 0;
+        for (size_t i = 0; i < num_iovs; i++) {
+            // アプリが書き換えても影響しないよう、先に手元にコピーする
+            const IoVec iov = iovs[i];
+            if (!file->PreparesUserWrite()) {
+                if (auto err = PrepareUserWrite(reinterpret_cast<uint64_t>(iov.base), iov.len)) {
+                    return {total, EFAULT};
+                }
+            }
+            auto [n, read_err] = file->ReadUser(iov.base, iov.len);
+            if (read_err) {
+                return {total, EFAULT};
+            }
+            total += n;
+            if (n < iov.len) {
+                break;
+            }
+        }
+        return {total, 0};
+    }
+
+    /// 複数のバッファから順に書き込む
+    /// arg1 : ファイルディスクリプタ、arg2 : IoVecの配列、arg3 : 要素数
+    /// 戻り値 : 書き込んだバイト数の合計
+    SYSCALL(WriteV) {
+        const auto iovs = reinterpret_cast<const IoVec*>(arg2);
+        const size_t num_iovs = arg3;
+        auto [file, err] = GetIoVecFile(arg1, num_iovs);
+        if (err) {
+            return {0, err.Cause() == Error::kInvalidFile ? EBADF : EINVAL};
+        }
+
+        size_t total = 0;
+        for (size_t i = 0; i < num_iovs; i++) {
+            const IoVec iov = iovs[i];
+            const size_t n = file->Write(iov.base, iov.len);
+            total += n;
+            if (n < iov.len) {
+                break;
+            }
+        }
+        return {total, 0};
+    }
+
+    /// 読み込み位置を変える
+    /// arg1 : ファイルディスクリプタ、arg2 : オフセット、arg3 : 基準（0 : 先頭、1 : 現在位置、2 : 末尾）
+    /// 戻り値 : 変えた後の読み込み位置
+    SYSCALL(Seek) {
+        const int fd = arg1;
+        auto& task = g_task_manager->CurrentTask();
+        auto file = task.File(fd);
+        if (!file) {
+            return {0, EBADF};
+        }
+
+        auto [offset, err] = file->Seek(static_cast<int64_t>(arg2), arg3);
+        if (err) {
+            return {0, err.Cause() == Error::kNotImplemented ? ESPIPE : EINVAL};
+        }
+        return {offset, 0};
+    }
+
+    /// 読み込み位置を変えずに、指定位置から読む
+    /// arg1 : ファイルディスクリプタ、arg2 : 読み込み先、arg3 : バイト数、arg4 : ファイル先頭からの位置
+    SYSCALL(PRead) {
+        const int fd = arg1;
+        auto& task = g_task_manager->CurrentTask();
+        auto file = task.File(fd);
+        if (!file) {
+            return {0, EBADF};
+        }
+        if (auto err = PrepareUserWrite(arg2, arg3)) {
+            return {0, EFAULT};
+        }
+
+        auto [n, err] = file->PRead(reinterpret_cast<void*>(arg2), arg3, arg4);
+        if (err) {
+            return {0, ESPIPE};
+        }
+        return {n, 0};
+    }
+
+    /// ファイルへの書き込みのうち、まだブロックデバイスに書き戻していないものをすべて書き戻す
+    SYSCALL(Sync) {
+        if (auto err = SyncBootVolume()) {
+            return {0, EIO};
+        }
+        return {0, 0};
+    }
+
+    /// ファイルをコピーする。中身はカーネルの中でクラスタの区間ごとにコピーする
+    /// arg1 : コピー元のパス、arg2 : コピー先のパス（なければ作る）
+    /// return : コピーしたバイト数
+    SYSCALL(CopyFile) {
+        const char* src_path = reinterpret_cast<const char*>(arg1);
+        const char* dest_path = reinterpret_cast<const char*>(arg2);
+
+        auto [src, src_post_slash] = fat::FindFile(src_path);
+        if (src == nullptr || (src->attr != fat::Attribute::kDirectory && src_post_slash)) {
+            return {0, ENOENT};
+        }
+        auto [dest, dest_post_slash] = fat::FindFile(dest_path);
+        if (dest == nullptr) {
+            auto [new_file, err] = CreateFile(dest_path);
+            if (err) {
+                return {0, err};
+            }
+            dest = new_file;
+        } else if (dest->attr != fat::Attribute::kDirectory && dest_post_slash) {
+            return {0, ENOENT};
+        }
+
+        auto [bytes, err] = fat::CopyFile(*dest, *src);
+        switch (err.Cause()) {
+        case Error::kSuccess:
+            return {bytes, 0};
+        case Error::kIsDirectory:
+            return {0, EISDIR};
+        case Error::kNoEnoughMemory:
+            return {0, ENOSPC};
+        default:
+            return {0, EIO};
+        }
+    }
+
+    /// 生存しているタスクの実行時間とタスク切り替えの統計を取得する
+    /// arg1 : TaskStatの配列、arg2 : 要素数
+    /// 戻り値 : タスクの数（arg2より大きければ、その分は書き込まない）
+    SYSCALL(GetTaskStat) {
+        // 書き込み先でページフォルトが起きてもよいよう、タスク表のロックを外してから書き込む
+        std::vector<TaskStat> stats;
+        g_task_manager->ForEachTask([&](Task& task) {
+            TaskStat stat{task.ID(), task.SchedStat(), task.Level(), task.CPU(), task.Running(), 0, {}};
+            if (auto entry = task.AppEntry()) {
+                fat::FormatName(*entry, stat.name);
+            }
+            stats.push_back(stat);
+        });
+
+        const size_t len = std::min(static_cast<size_t>(arg2), stats.size());
+        if (auto err = PrepareUserWrite(arg1, len * sizeof(TaskStat))) {
+            return {0, EFAULT};
+        }
+        std::copy_n(stats.begin(), len, reinterpret_cast<TaskStat*>(arg1));
+        return {stats.size(), 0};
+    }
+
+    /// CPUコアごとのアイドル時間の統計を取得する
+    /// arg1 : IdleStatの配列、arg2 : 要素数
+    /// 戻り値 : CPUコアの数（arg2より大きければ、その分は書き込まない）
+    SYSCALL(GetIdleStat) {
+        const size_t num_cpus = NumCPUs();
+        const size_t len = std::min(static_cast<size_t>(arg2), num_cpus);
+        if (auto err = PrepareUserWrite(arg1, len * sizeof(IdleStat))) {
+            return {0, EFAULT};
+        }
+        auto stats = reinterpret_cast<IdleStat*>(arg1);
+        for (size_t cpu = 0; cpu < len; ++cpu) {
+            stats[cpu] = ::GetIdleStat(cpu);
+        }
+        return {num_cpus, 0};
+    }
+
+    /// ウィンドウを半透明にする
+    /// arg1 : レイヤIDとフラグ（DoWinFuncを参照）、arg2 : 不透明度（0〜255、255で不透明）
+    /// arg3 : 1ならピクセルごとの透明度も使う（以降のkBlitで、色の上位8ビットを透明度として残す）
+    SYSCALL(WinSetAlpha) {
+        if (arg2 > 255 || arg3 > 1) {
+            return {0, EINVAL};
+        }
+        return DoWinFunc(
+            [](Window& win, uint8_t alpha, bool per_pixel) {
+                win.SetAlpha(alpha);
+                win.SetPerPixelAlpha(per_pixel);
+                return Result{0, 0};
+            },
+            arg1, static_cast<uint8_t>(arg2), arg3 == 1);
+    }
+
+    /// 初めて呼ぶとウィンドウを2面にし、以降の描画を裏の面に行う。2回目からは描き終えた裏の面を表の面と入れ替える
+    /// 入れ替えはg_layer_mutexを持って行うので、合成からは常に描き終えた絵が見え、アプリは描画の終わりを待たなくてよい
+    /// arg1 : レイヤIDとフラグ（DoWinFuncを参照）、arg2 : 1なら新しい裏の面に前の絵を写さない（毎回全体を描き直す場合）
+    SYSCALL(WinPresent) {
+        const uint32_t layer_flags = arg1 >> 32;
+        const unsigned int layer_id = arg1 & 0xffffffff;
+        if (arg2 > 1) {
+            return {0, EINVAL};
+        }
+
+        MutexGuard lock{g_layer_mutex};
+        auto layer = g_layer_manager->FindLayer(layer_id);
+        if (layer == nullptr) {
+            return {0, EBADF};
+        }
+        auto& win = *layer->GetWindow();
+        if (!win.DoubleBuffered()) {
+            if (auto err = win.EnableDoubleBuffer()) {
+                return {0, ENOMEM};
+            }
+        } else {
+            win.Present(arg2 == 0);
+        }
+
+        if ((layer_flags & 1) == 0) {
+            g_layer_manager->Draw(layer_id);
+        }
+        return {0, 0};
+    }
+
+    /// それまでに要求したウィンドウの描画が画面に出るまで待ち、それを描いたフレームの番号を返す
+    /// 描画のシステムコールは再描画領域をためるだけで合成を待たないので、描き終わりを知りたいアプリだけが呼ぶ
+    /// arg1 : レイヤIDとフラグ（DoWinFuncを参照。フラグは使わない）
+    SYSCALL(WinFence) {
+        const unsigned int layer_id = arg1 & 0xffffffff;
+        {
+            MutexGuard lock{g_layer_mutex};
+            if (g_layer_manager->FindLayer(layer_id) == nullptr) {
+                return {0, EBADF};
+            }
+        }
+        return {WaitFramePresented(), 0};
+    }
+
+    /// アプリの画像をウィンドウに転送する。ピクセル形式の変換はカーネル側でまとめて行う
+    /// arg1 : レイヤIDとフラグ（DoWinFuncを参照）、arg2 : 左上（下位32bitがx、上位32bitがy）
+    /// arg3 : 大きさ（下位32bitが幅、上位32bitが高さ）、arg4 : 画像、arg5 : 1行のバイト数、arg6 : ImageFormat
+    SYSCALL(WinBlit) {
+        const int x = static_cast<int32_t>(arg2 & 0xffffffff), y = static_cast<int32_t>(arg2 >> 32);
+        const int w = static_cast<int32_t>(arg3 & 0xffffffff), h = static_cast<int32_t>(arg3 >> 32);
+        const auto format = static_cast<ImageFormat>(arg6);
+        const int bytes_per_pixel = BytesPerPixel(format);
+        if (bytes_per_pixel == 0 || w < 0 || h < 0 || arg5 < static_cast<uint64_t>(w) * bytes_per_pixel) {
+            return {0, EINVAL};
+        }
+        return DoWinFunc(
+            [x, y, w, h, format](Window& win, const void* image, size_t stride) {
+                win.WriteImage({x, y}, {w, h}, image, stride, format);
+                return Result{0, 0};
+            },
+            arg1, reinterpret_cast<const void*>(arg4), static_cast<size_t>(arg5));
+    }
+
+    namespace {
+        /// apps/syscall.hのWinRectと同じ並び
+        struct WinRect {
+            int x, y, w, h;
+        };
+    } // namespace
+
+    /// ウィンドウの矩形領域の中身をその場でずらし、空いた部分を返す。アプリは空いた部分だけを描けばよい
+    /// arg1 : レイヤIDとフラグ（DoWinFuncを参照）、arg2 : 左上（下位32bitがx、上位32bitがy）
+    /// arg3 : 大きさ（下位32bitが幅、上位32bitが高さ）、arg4, arg5 : ずらす量（右、下が正）
+    /// arg6 : 空いた部分を書き込むWinRectの2要素の配列
+    /// 戻り値 : arg6に書き込んだ矩形の数（0〜2）
+    SYSCALL(WinScroll) {
+        const int x = static_cast<int32_t>(arg2 & 0xffffffff), y = static_cast<int32_t>(arg2 >> 32);
+        const int w = static_cast<int32_t>(arg3 & 0xffffffff), h = static_cast<int32_t>(arg3 >> 32);
+        const int dx = static_cast<int32_t>(arg4), dy = static_cast<int32_t>(arg5);
+        if (w < 0 || h < 0) {
+            return {0, EINVAL};
+        }
+        if (arg6 < 0x8000000000000000 || PrepareUserWrite(arg6, 2 * sizeof(WinRect))) {
+            return {0, EFAULT};
+        }
+        return DoWinFunc(
+            [x, y, w, h, dx, dy](Window& win, WinRect* exposed) {
+                Rectangle<int> rects[2];
+                const int n = win.Scroll({{x, y}, {w, h}}, {dx, dy}, rects);
+                for (int i = 0; i < n; i++) {
+                    exposed[i] = {rects[i].pos.x, rects[i].pos.y, rects[i].size.x, rects[i].size.y};
+                }
+                return Result{static_cast<uint64_t>(n), 0};
+            },
+            arg1, reinterpret_cast<WinRect*>(arg6));
+    }
+
+    namespace {
+        /// スレッドのスタックの大きさ（アプリの最初のスタックと同じ）
+        const size_t kThreadStackBytes = 16 * 4096;
+
+        /// CreateThreadからスレッドのタスクに渡す引数
+        struct AppThreadParams {
+            uint64_t rip, rdi, rsi, stack_top;
+        };
+
+        /// スレッドのタスク。作ったタスクのアドレス空間でアプリの関数を呼び、SyscallExitで戻ってきたら終わる
+        void TaskAppThread(uint64_t task_id, int64_t data) {
+            const auto params = *reinterpret_cast<AppThreadParams*>(data);
+            delete reinterpret_cast<AppThreadParams*>(data);
+
+            auto& task = g_task_manager->CurrentTask();
+            const int ret = CallApp(params.rdi,
+                                    reinterpret_cast<char**>(params.rsi),
+                                    3 << 3 | 3,
+                                    params.rip,
+                                    params.stack_top - 8,
+                                    &task.OSStackPointer());
+
+            g_timer_manager->CancelTimersIf([task_id](const Timer& t) {
+                return t.TaskID() == task_id && t.Value() < 0;
+            });
+            {
+                InterruptGuard guard;
+                task.Space().free_thread_stacks.push_back(params.stack_top);
+            }
+            g_task_manager->Finish(ret);
+        }
+
+        /// スレッドのスタックを用意し、その上端を返す。終わったスレッドのものがあれば使い回す
+        /// メモリマップドファイルの範囲の下端から、ガードページ（マップしない1ページ）を挟んで切り出す
+        WithError<uint64_t> AllocateThreadStack(Task& task) {
+            InterruptGuard guard;
+            auto& stacks = task.Space().free_thread_stacks;
+            if (!stacks.empty()) {
+                const uint64_t top = stacks.back();
+                stacks.pop_back();
+                return {top, MAKE_ERROR(Error::kSuccess)};
+            }
+
+            const uint64_t top = task.FileMapEnd() - 4096;
+            const uint64_t bottom = top - kThreadStackBytes;
+            PageMapAllocCount alloc{};
+            const auto err = SetupPageMaps(LinearAddress4Level{bottom}, kThreadStackBytes / 4096, alloc);
+            task.FrameUsage().image_pages += alloc.pages;
+            task.FrameUsage().page_tables += alloc.tables;
+            if (err) {
+                return {0, err};
+            }
+            task.SetFileMapEnd(bottom);
+            return {top, MAKE_ERROR(Error::kSuccess)};
+        }
+    } // namespace
+
+    /// 実行中のアプリと同じアドレス空間で動くスレッド（タスク）を作り、そのIDを返す
+    /// arg1 : 実行を始めるアドレス、arg2, arg3 : そのときのrdi, rsi
+    /// ファイルディスクリプタやメモリは共有し、スタックだけをスレッドごとに持つ
+    SYSCALL(CreateThread) {
+        if (arg1 < 0xffff800000000000) {
+            return {0, EFAULT};
+        }
+        auto& task = g_task_manager->CurrentTask();
+        auto [stack_top, err] = AllocateThreadStack(task);
+        if (err) {
+            return {0, ENOMEM};
+        }
+
+        auto& thread = g_task_manager->NewTask();
+        thread.InitContext(TaskAppThread, reinterpret_cast<int64_t>(new AppThreadParams{arg1, arg2, arg3, stack_top}))
+            .ShareSpace(task)
+            .SetAffinity(task.Affinity());
+        {
+            InterruptGuard guard;
+            task.Space().threads.push_back(thread.ID());
+        }
+        thread.Wakeup();
+        return {thread.ID(), 0};
+    }
+
+    /// CreateThreadで作ったスレッドが終わるまで待ち、その終了コードを返す
+    /// arg1 : スレッドのID
+    SYSCALL(JoinThread) {
+        const uint64_t thread_id = arg1;
+        auto& task = g_task_manager->CurrentTask();
+        {
+            // 2つのスレッドが同じスレッドを待つことはできない
+            InterruptGuard guard;
+            auto& threads = task.Space().threads;
+            auto it = std::find(threads.begin(), threads.end(), thread_id);
+            if (it == threads.end() || thread_id == task.ID()) {
+                return {0, ESRCH};
+            }
+            threads.erase(it);
+        }
+        const auto [exit_code, err] = g_task_manager->WaitFinish(thread_id);
+        if (err) {
+            // 強制終了を求められた。待たれなくなったスレッドは、アプリを終えたターミナルに待ってもらう
+            InterruptGuard guard;
+            task.Space().threads.push_back(thread_id);
+            return {0, EINTR};
+        }
+        return {static_cast<uint64_t>(exit_code), 0};
+    }
+
+    /// arg1のアドレスの32bitの値がarg2と等しければ、同じアドレスでFutexWakeが呼ばれるまで眠る
+    /// 等しくなければ眠らずにEAGAINを返す。メッセージの到着などでも起きるので、アプリは値を確かめ直すこと
+    SYSCALL(FutexWait) {
+        const uint64_t addr = arg1;
+        if (addr < 0xffff800000000000 || addr % sizeof(uint32_t) != 0) {
+            return {0, EINVAL};
+        }
+        // 割り込みを禁止してから値を読むので、先にページを用意しておく
+        if (auto err = PrepareUserWrite(addr, sizeof(uint32_t))) {
+            return {0, EFAULT};
+        }
+
+        auto& space = g_task_manager->CurrentTask().Space();
+        // 値を確かめてから列に並ぶまでfutex_lockを持つので、その間に値を変えてFutexWakeされても取りこぼさない
+        SpinLockGuard lock{space.futex_lock};
+        if (*reinterpret_cast<const volatile uint32_t*>(addr) != static_cast<uint32_t>(arg2)) {
+            return {0, EAGAIN};
+        }
+        space.futexes[addr].Wait(space.futex_lock);
+        // 起こしたFutexWakeが列を消していることがあるので、ここではもう列に触らない
+        return {0, 0};
+    }
+
+    /// arg1のアドレスでFutexWaitしているタスクを、並んだ順に最大arg2個起こし、起こした数を返す
+    SYSCALL(FutexWake) {
+        auto& space = g_task_manager->CurrentTask().Space();
+        SpinLockGuard lock{space.futex_lock};
+        auto it = space.futexes.find(arg1);
+        if (it == space.futexes.end()) {
+            return {0, 0};
+        }
+        uint64_t woken = 0;
+        while (woken < arg2 && it->second.WakeOne()) {
+            woken++;
+        }
+        if (it->second.Empty()) {
+            space.futexes.erase(it);
+        }
+        return {woken, 0};
+    }
+
+    /// 別のアドレス空間で動くアプリを新しいタスクで起動し、そのタスクのIDを返す（終わるのは待たない）
+    /// arg1 : アプリのパス（/がなければappsディレクトリも探す）、arg2 : nullptrで終わる引数の配列（nullptrならパスだけ）
+    /// arg3 : 起動するアプリの標準入力、標準出力、標準エラー出力にする3つのファイルディスクリプタ（nullptrなら0, 1, 2）
+    /// ELFの読み込みはターミナルと同じくg_app_loadsを使う。引数はターミナルのコマンドラインと同じく空白で区切って渡すので、空白は含められない
+    SYSCALL(Spawn) {
+        const char* path = reinterpret_cast<const char*>(arg1);
+        const auto argv = reinterpret_cast<const char* const*>(arg2);
+        const auto fds = reinterpret_cast<const int*>(arg3);
+        // OS側のメモリ（仮想アドレス空間の前半部）が指定されていたらエラーにする
+        if (fds && arg3 < 0x8000000000000000) {
+            return {0, EFAULT};
+        }
+
+        auto file_entry = FindCommand(path);
+        if (file_entry == nullptr) {
+            return {0, ENOENT};
+        }
+
+        std::string command_line;
+        if (argv == nullptr || argv[0] == nullptr) {
+            command_line = path;
+        }
+        // isspace()にcharをそのまま渡すと、0x80以上のバイトで未定義動作になる
+        auto is_space = [](char c) { return isspace(static_cast<unsigned char>(c)) != 0; };
+        for (size_t i = 0; argv && argv[i]; i++) {
+            const char* arg = argv[i];
+            if (arg[0] == 0 || std::any_of(arg, arg + strlen(arg), is_space)) {
+                return {0, EINVAL};
+            }
+            if (i > 0) {
+                command_line += ' ';
+            }
+            command_line += arg;
+        }
+        if (command_line.length() >= Terminal::kLineMax) {
+            return {0, E2BIG};
+        }
+
+        auto& task = g_task_manager->CurrentTask();
+        std::array<std::shared_ptr<IFileDescriptor>, 3> files;
+        for (int i = 0; i < 3; i++) {
+            files[i] = task.File(fds ? fds[i] : i);
+            if (!files[i]) {
+                return {0, EBADF};
+            }
+        }
+
+        // 画面を出さないターミナルのタスクが、自分のアドレス空間にアプリを読み込んで実行し、終わったら自身も終わる
+        auto term_desc = new TerminalDescriptor{command_line, true, false, files};
+        term_desc->app = file_entry;
+        auto& child = g_task_manager->NewTask();
+        {
+            InterruptGuard guard;
+            task.Space().children.push_back(child.ID());
+        }
+        child.InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc))
+            .Wakeup();
+        return {child.ID(), 0};
+    }
+
+    /// Spawnで起動したアプリが終わるまで待ち、その終了コードを返す
+    /// arg1 : Spawnが返したタスクのID
+    SYSCALL(WaitTask) {
+        const uint64_t task_id = arg1;
+        auto& task = g_task_manager->CurrentTask();
+        {
+            InterruptGuard guard;
+            auto& children = task.Space().children;
+            auto it = std::find(children.begin(), children.end(), task_id);
+            if (it == children.end()) {
+                return {0, ESRCH};
+            }
+            children.erase(it);
+        }
+        const auto [exit_code, err] = g_task_manager->WaitFinish(task_id);
+        if (err) {
+            // 強制終了を求められた。待たなかった子と同じく、終わるのを待たない
+            InterruptGuard guard;
+            task.Space().children.push_back(task_id);
+            return {0, EINTR};
+        }
+        return {static_cast<uint64_t>(exit_code), 0};
+    }
 #undef SYSCALL
 
 } // namespace syscall
@@ -468,7 +1378,7 @@ using SyscallFuncType = syscall::Result(uint64_t, uint64_t, uint64_t, uint64_t,
 
 /// システムコールの（関数ポインタ）テーブル
 /// この添字に0x80000000を足した値をシステムコール番号とする
-extern "C" std::array<SyscallFuncType*, 0x10> g_syscall_table{
+extern "C" std::array<SyscallFuncType*, kNumSyscalls> g_syscall_table{
     /* 0x00 */ syscall::LogString,
     /* 0x01 */ syscall::PutString,
     /* 0x02 */ syscall::Exit,
@@ -485,8 +1395,184 @@ extern "C" std::array<SyscallFuncType*, 0x10> g_syscall_table{
     /* 0x0d */ syscall::ReadFile,
     /* 0x0e */ syscall::DemandPages,
     /* 0x0f */ syscall::MapFile,
+    /* 0x10 */ syscall::MapAdvise,
+    /* 0x11 */ syscall::Unmap,
+    /* 0x12 */ syscall::ReleasePages,
+    /* 0x13 */ syscall::GetFaultStat,
+    /* 0x14 */ syscall::CreatePeriodicTimer,
+    /* 0x15 */ syscall::CancelTimer,
+    /* 0x16 */ syscall::CreateShm,
+    /* 0x17 */ syscall::MapShm,
+    /* 0x18 */ syscall::Wait,
+    /* 0x19 */ syscall::AsyncSetup,
+    /* 0x1a */ syscall::AsyncEnter,
+    /* 0x1b */ syscall::GetTimeNs,
+    /* 0x1c */ syscall::WinBatch,
+    /* 0x1d */ syscall::GetSyscallStat,
+    /* 0x1e */ syscall::WriteFile,
+    /* 0x1f */ syscall::ReadV,
+    /* 0x20 */ syscall::WriteV,
+    /* 0x21 */ syscall::Seek,
+    /* 0x22 */ syscall::PRead,
+    /* 0x23 */ syscall::Sync,
+    /* 0x24 */ syscall::WinSetAlpha,
+    /* 0x25 */ syscall::WinPresent,
+    /* 0x26 */ syscall::WinBlit,
+    /* 0x27 */ syscall::CopyFile,
+    /* 0x28 */ syscall::GetTaskStat,
+    /* 0x29 */ syscall::Sleep,
+    /* 0x2a */ syscall::WinFence,
+    /* 0x2b */ syscall::CreateThread,
+    /* 0x2c */ syscall::JoinThread,
+    /* 0x2d */ syscall::FutexWait,
+    /* 0x2e */ syscall::FutexWake,
+    /* 0x2f */ syscall::Spawn,
+    /* 0x30 */ syscall::WaitTask,
+    /* 0x31 */ syscall::WinScroll,
+    /* 0x32 */ syscall::EventRingSetup,
+    /* 0x33 */ syscall::GetIdleStat,
 };
 
+namespace {
+    const std::array<const char*, kNumSyscalls> kSyscallNames{
+        "LogString", "PutString", "Exit", "OpenWindow",
+        "WinWriteString", "WinFillRectangle", "GetCurrentTick", "WinRedraw",
+        "WinDrawLine", "CloseWindow", "ReadEvent", "CreateTimer",
+        "OpenFile", "ReadFile", "DemandPages", "MapFile",
+        "MapAdvise", "Unmap", "ReleasePages", "GetFaultStat",
+        "CreatePeriodicTimer", "CancelTimer", "CreateShm", "MapShm",
+        "Wait", "AsyncSetup", "AsyncEnter", "GetTimeNs",
+        "WinBatch", "GetSyscallStat", "WriteFile", "ReadV",
+        "WriteV", "Seek", "PRead", "Sync",
+        "WinSetAlpha", "WinPresent", "WinBlit", "CopyFile",
+        "GetTaskStat", "Sleep", "WinFence", "CreateThread",
+        "JoinThread", "FutexWait", "FutexWake", "Spawn",
+        "WaitTask", "WinScroll", "EventRingSetup", "GetIdleStat",
+    };
+
+    /// 統計やトレースを取っている間、本来の関数はこちらに退避しておく
+    std::array<SyscallFuncType*, kNumSyscalls> g_original_syscalls;
+    bool g_original_saved = false;
+    bool g_syscall_stat_enabled = false;
+    bool g_syscall_trace_enabled = false;
+    /// 複数のCPUコアから足し込まれるので、アトミックに更新する
+    SyscallStatTable g_syscall_stat{};
+
+    void AddSyscallStat(SyscallStat& stat, uint64_t cycles, int error, int bucket, bool atomic) {
+        if (atomic) {
+            __atomic_fetch_add(&stat.calls, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&stat.errors, error != 0, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&stat.cycles, cycles, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&stat.hist[bucket], 1, __ATOMIC_RELAXED);
+        } else {
+            stat.calls++;
+            stat.errors += error != 0;
+            stat.cycles += cycles;
+            stat.hist[bucket]++;
+        }
+    }
+
+    /// N番のシステムコールを呼び、処理時間を記録する
+    template <size_t N>
+    syscall::Result CountingSyscall(uint64_t arg1, uint64_t arg2, uint64_t arg3,
+                                    uint64_t arg4, uint64_t arg5, uint64_t arg6) {
+        const uint64_t start = ReadTSC();
+        const auto res = g_original_syscalls[N](arg1, arg2, arg3, arg4, arg5, arg6);
+        const uint64_t cycles = ReadTSC() - start;
+
+        // 128未満は区間0、以降は2倍ごとに次の区間
+        const int bit_width = 64 - __builtin_clzll(cycles | 1);
+        const int bucket = std::clamp(bit_width - 7, 0, kSyscallHistBuckets - 1);
+        AddSyscallStat(g_syscall_stat[N], cycles, res.error, bucket, true);
+        // タスクごとの統計は、そのタスクしか更新しない
+        AddSyscallStat(g_task_manager->CurrentTask().SyscallStatsForUpdate()[N],
+                       cycles, res.error, bucket, false);
+        return res;
+    }
+
+    template <size_t... I>
+    constexpr std::array<SyscallFuncType*, kNumSyscalls> MakeCountingSyscalls(std::index_sequence<I...>) {
+        return {CountingSyscall<I>...};
+    }
+    const auto kCountingSyscalls = MakeCountingSyscalls(std::make_index_sequence<kNumSyscalls>{});
+
+    /// N番のシステムコールの出入りをトレースに記録する（統計も取っていれば、その内側で呼ぶ）
+    template <size_t N>
+    syscall::Result TracingSyscall(uint64_t arg1, uint64_t arg2, uint64_t arg3,
+                                   uint64_t arg4, uint64_t arg5, uint64_t arg6) {
+        Trace(TraceEvent::kSyscallEnter, N, arg1);
+        auto func = g_syscall_stat_enabled ? kCountingSyscalls[N] : g_original_syscalls[N];
+        const auto res = func(arg1, arg2, arg3, arg4, arg5, arg6);
+        Trace(TraceEvent::kSyscallExit, N, (static_cast<uint64_t>(res.error) << 32) | (res.value & 0xffffffffu));
+        return res;
+    }
+
+    template <size_t... I>
+    constexpr std::array<SyscallFuncType*, kNumSyscalls> MakeTracingSyscalls(std::index_sequence<I...>) {
+        return {TracingSyscall<I>...};
+    }
+    const auto kTracingSyscalls = MakeTracingSyscalls(std::make_index_sequence<kNumSyscalls>{});
+
+    /// 統計とトレースの有無に合わせて、システムコールの表を入れ替える
+    void UpdateSyscallTable() {
+        if (!g_original_saved) {
+            g_original_syscalls = g_syscall_table;
+            g_original_saved = true;
+        }
+        if (g_syscall_trace_enabled) {
+            g_syscall_table = kTracingSyscalls;
+        } else if (g_syscall_stat_enabled) {
+            g_syscall_table = kCountingSyscalls;
+        } else {
+            g_syscall_table = g_original_syscalls;
+        }
+    }
+} // namespace
+
+void EnableSyscallStat(bool enable) {
+    InterruptGuard guard;
+    g_syscall_stat_enabled = enable;
+    UpdateSyscallTable();
+}
+
+void EnableSyscallTrace(bool enable) {
+    InterruptGuard guard;
+    g_syscall_trace_enabled = enable;
+    UpdateSyscallTable();
+}
+
+bool SyscallStatEnabled() {
+    return g_syscall_stat_enabled;
+}
+
+SyscallStatTable GetSyscallStat() {
+    return g_syscall_stat;
+}
+
+void ResetSyscallStat() {
+    InterruptGuard guard;
+    g_syscall_stat = {};
+}
+
+const char* SyscallName(size_t index) {
+    return index < kSyscallNames.size() ? kSyscallNames[index] : "?";
+}
+
+namespace syscall {
+    namespace {
+        Result CallSyscall(const AsyncSubmission& sqe) {
+            const uint64_t index = sqe.op - 0x80000000;
+            // アプリを終了させるものと、リングを入れ子に使うものは受け付けない
+            if (sqe.op < 0x80000000 || g_syscall_table.size() <= index ||
+                index == 0x02 || index == 0x19 || index == 0x1a) {
+                return {0, EINVAL};
+            }
+            const auto& a = sqe.args;
+            return g_syscall_table[index](a[0], a[1], a[2], a[3], a[4], a[5]);
+        }
+    } // namespace
+} // namespace syscall
+
 void InitializeSyscall() {
     // syscallを使用可能にする
     WriteMSR(kIA32_EFER, 0x0501u);
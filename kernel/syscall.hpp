@@ -1,3 +1,36 @@
 #pragma once
 
-void InitializeSyscall();
\ No newline at end of file
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+/// システムコールの数（g_syscall_tableの大きさ）
+const size_t kNumSyscalls = 0x34;
+/// 処理時間の分布の区間数
+/// 区間0は128 TSCカウント未満、区間iは[2^(i+6), 2^(i+7))、最後の区間は上限なし
+const int kSyscallHistBuckets = 16;
+
+/// システムコール1種類ぶんの統計（apps/syscall.hのSyscallStatと同じ並び）
+struct SyscallStat {
+    uint64_t calls;
+    /// エラーを返した回数
+    uint64_t errors;
+    /// 処理にかかったTSCカウントの合計
+    uint64_t cycles;
+    uint64_t hist[kSyscallHistBuckets];
+};
+using SyscallStatTable = std::array<SyscallStat, kNumSyscalls>;
+
+void InitializeSyscall();
+
+/// 統計を取るかを切り替える
+/// 取らない間はシステムコールの経路に何も足さない（取る間だけ、数える関数にテーブルを差し替える）
+void EnableSyscallStat(bool enable);
+bool SyscallStatEnabled();
+/// 各システムコールの出入りをトレースに記録するかを切り替える（EnableTrace()から呼ぶ）
+void EnableSyscallTrace(bool enable);
+/// システム全体の統計
+SyscallStatTable GetSyscallStat();
+void ResetSyscallStat();
+/// "ReadFile"のような名前
+const char* SyscallName(size_t index);
@@ -1,27 +1,166 @@
 #include "task.hpp"
 
+#include <csignal>
+
 #include "asmfunc.h"
+#include "event_ring.hpp"
+#include "fpu.hpp"
+#include "idle.hpp"
+#include "pmu.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
 #include "segment.hpp"
 #include "timer.hpp"
+#include "trace.hpp"
 
 namespace {
-    template <class T, class U>
-    void Erase(T& c, const U& value) {
-        auto it = std::remove(c.begin(), c.end(), value);
-        c.erase(it, c.end());
+    /// ティックレスアイドルで割り込みを止めておく最大のtick数
+    const unsigned long kMaxIdleTicks = kTimerFreq;
+    /// 他のCPUコアへ移すタスクは、少なくともこの時間（1msec）は止まっていたものに限る
+    const unsigned long kMinStealIdleTicks = kTimerFreq / 1000;
+
+    void AddSchedLatency(TaskManager::SchedLatencyStat& stat, uint64_t cycles) {
+        stat.count++;
+        stat.total_cycles += cycles;
+        stat.max_cycles = std::max(stat.max_cycles, cycles);
+        const uint64_t us = cycles / std::max<uint64_t>(TSCFrequency() / 1000000, 1);
+        const int bit_width = us ? 64 - __builtin_clzll(us) : 0;
+        stat.hist[std::min(bit_width, TaskManager::kSchedLatencyBuckets - 1)]++;
     }
 
     void TaskIdle(uint64_t task_id, int64_t data) {
-        while (true) __asm__("hlt");
+        // 他にやることがない間に、ページフォルト処理で使う0クリア済みフレームを補充しておく
+        RunIdleLoop(kMaxIdleTicks, RefillZeroedFramePool);
+    }
+
+    SlabCache g_task_cache{"Task", sizeof(Task)};
+
+    /// タスクのスタックが占める仮想アドレス範囲
+    /// begin : スタックの最下位アドレス（直下の1ページがガードページ）
+    struct StackArea {
+        uint64_t begin;
+        size_t pages;
+    };
+
+    SpinLock g_stack_lock;
+    /// 物理フレームを割り当てたまま再利用を待つスタック
+    /// 他のCPUのTLBに残っているかもしれないので、タスクの終了時には外さずにここへ置いておく
+    std::vector<StackArea> g_stack_pool{};
+    /// メモリが足りなくなっても、この数までは残しておく
+    const size_t kStackPoolSize = 8;
+    /// 物理フレームは返したが、仮想アドレス範囲だけ再利用を待つスタック
+    std::vector<StackArea> g_free_stack_areas{};
+    /// スタック用の仮想アドレス空間の未使用部分の先頭
+    uint64_t g_stack_area_end = kKernelStackBase;
+    size_t g_stack_pool_hits = 0, g_stack_pool_misses = 0;
+
+    /// pagesページのスタックを得る。プールに同じ大きさのものがあれば0クリアせずにそのまま使う
+    WithError<uint64_t> AllocateTaskStack(size_t pages) {
+        SpinLockGuard lock{g_stack_lock};
+        for (auto& area : g_stack_pool) {
+            if (area.pages == pages) {
+                const uint64_t begin = area.begin;
+                area = g_stack_pool.back();
+                g_stack_pool.pop_back();
+                g_stack_pool_hits++;
+                return {begin, MAKE_ERROR(Error::kSuccess)};
+            }
+        }
+        g_stack_pool_misses++;
+
+        uint64_t begin = 0;
+        for (auto it = g_free_stack_areas.begin(); it != g_free_stack_areas.end(); ++it) {
+            if (it->pages == pages) {
+                begin = it->begin;
+                g_free_stack_areas.erase(it);
+                break;
+            }
+        }
+        if (begin == 0) {
+            // 先頭の1ページはガードページとしてマップしないでおく
+            begin = g_stack_area_end + kBytesPerFrame;
+            g_stack_area_end = begin + pages * kBytesPerFrame;
+        }
+
+        if (auto err = MapKernelPages(LinearAddress4Level{begin}, pages)) {
+            g_free_stack_areas.push_back({begin, pages});
+            return {0, err};
+        }
+        return {begin, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    /// スタックをプールに返す
+    /// ~Task()からスケジューラのロックを持ったまま呼ばれるので、ここではマップを外さない
+    void FreeTaskStack(uint64_t begin, size_t pages) {
+        SpinLockGuard lock{g_stack_lock};
+        g_stack_pool.push_back({begin, pages});
+    }
+
+    /// メモリが足りなくなったら、プールのスタックをkStackPoolSize個まで減らしてフレームを返す
+    /// UnmapKernelPages()は他のCPUのTLBを消し終わるまで待つので、ロックを持たずに呼ぶ
+    void TrimStackPool() {
+        while (true) {
+            StackArea area;
+            {
+                SpinLockGuard lock{g_stack_lock};
+                if (g_stack_pool.size() <= kStackPoolSize) {
+                    return;
+                }
+                area = g_stack_pool.back();
+                g_stack_pool.pop_back();
+            }
+            if (auto err = UnmapKernelPages(LinearAddress4Level{area.begin}, area.pages)) {
+                Log(kError, "failed to free task stack: %s\n", err.Name());
+            }
+            SpinLockGuard lock{g_stack_lock};
+            g_free_stack_areas.push_back(area);
+        }
     }
 } // namespace
 
-Task::Task(uint64_t id) : id_{id} {}
+Task::Task(uint64_t id, size_t stack_bytes)
+    : id_{id}, stack_bytes_{(stack_bytes + kBytesPerFrame - 1) & ~(kBytesPerFrame - 1)},
+      fpu_buf_{new uint8_t[FPUStateSize() + 63]}, space_{std::make_shared<AppSpace>()} {
+    // XSAVE / XRSTORは64byte境界の保存領域しか扱えない
+    fpu_area_ = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(fpu_buf_.get()) + 63) & ~uintptr_t{63});
+    InitializeFPUState(fpu_area_);
+}
+
+Task::~Task() {
+    if (stack_begin_ != 0) {
+        FreeTaskStack(stack_begin_, stack_bytes_ / kBytesPerFrame);
+    }
+}
+
+void* Task::operator new(size_t size) {
+    // スラブを増やせなくても、nullptrを返すとコンストラクタがそこに書き込んでしまうので、ヒープから確保する
+    if (void* p = g_task_cache.Allocate()) {
+        return p;
+    }
+    return ::operator new(size);
+}
+
+void Task::operator delete(void* p) {
+    if (g_task_cache.Owns(p)) {
+        g_task_cache.Free(p);
+    } else {
+        ::operator delete(p);
+    }
+}
 
 Task& Task::InitContext(TaskFunc* f, int64_t data) {
-    const size_t stack_size = kDefaultStackBytes / sizeof(stack_[0]);
-    stack_.resize(stack_size);
-    uint64_t stack_end = reinterpret_cast<uint64_t>(&stack_[stack_size]);
+    if (stack_begin_ == 0) {
+        auto [begin, err] = AllocateTaskStack(stack_bytes_ / kBytesPerFrame);
+        if (err) {
+            Log(kError, "failed to allocate task stack: %s\n", err.Name());
+            FlushLog();
+            while (true) __asm__("hlt");
+        }
+        stack_begin_ = begin;
+    }
+    uint64_t stack_end = stack_begin_ + stack_bytes_;
 
     memset(&context_, 0, sizeof(context_));
     context_.cr3 = GetCR3();
@@ -35,9 +174,6 @@ Task& Task::InitContext(TaskFunc* f, int64_t data) {
     context_.rdi = id_;
     context_.rsi = data;
 
-    // MXCSRのすべての例外をマスクする
-    *reinterpret_cast<uint32_t*>(&context_.fxsave_area[24]) = 0x1f80;
-
     return *this;
 }
 
@@ -63,116 +199,433 @@ Task& Task::Wakeup() {
     return *this;
 }
 
-void Task::SendMessage(const Message& msg) {
-    msgs_.push_back(msg);
-    Wakeup();
+Error Task::SendMessage(const Message& msg) {
+    bool pushed;
+    {
+        // リングとキューのどちらに積むかを決めてから積むまでを、RefillEventRing()と排他する
+        SpinLockGuard lock{event_lock_};
+        const auto event = event_ring_ ? ToAppEvent(msg) : std::nullopt;
+        if (event && !event_ring_overflow_ && event_ring_->Push(*event)) {
+            pushed = true;
+        } else {
+            event_ring_overflow_ = event_ring_overflow_ || event.has_value();
+            pushed = msgs_.Push(msg);
+        }
+    }
+    // 溢れたときも、溜まっているメッセージを処理させるために起こす
+    // 入力イベントは処理が待たされると操作が重く感じられるので、優先度を上げて起こす
+    if (msg.type == Message::kKeyPush || msg.type == Message::kMouseMove || msg.type == Message::kMouseButton) {
+        g_task_manager->WakeupForInput(this);
+    } else {
+        Wakeup();
+    }
+    return MAKE_ERROR(pushed ? Error::kSuccess : Error::kFull);
 }
 
-std::optional<Message> Task::ReceiveMessage() {
-    if (msgs_.empty()) {
-        return std::nullopt;
+void Task::SetEventRing(std::shared_ptr<EventRing> ring) {
+    SpinLockGuard lock{event_lock_};
+    event_ring_ = std::move(ring);
+    event_ring_overflow_ = false;
+}
+
+void Task::RefillEventRing() {
+    SpinLockGuard lock{event_lock_};
+    if (!event_ring_) {
+        return;
+    }
+    while (auto msg = msgs_.Peek()) {
+        if (auto event = ToAppEvent(*msg)) {
+            if (!event_ring_->Push(*event)) {
+                return;
+            }
+        }
+        msgs_.Pop();
     }
+    event_ring_overflow_ = false;
+}
+
+bool Task::EventRingReady() {
+    SpinLockGuard lock{event_lock_};
+    return event_ring_ && event_ring_->Ready();
+}
+
+std::optional<Message> Task::ReceiveMessage() {
     // メッセージキューからメッセージを取り出す
-    auto msg = msgs_.front();
-    msgs_.pop_front();
-    return msg;
+    return msgs_.Pop();
+}
+
+std::optional<Message> Task::PeekMessage() const {
+    return msgs_.Peek();
+}
+
+size_t Task::ReceiveMessages(Message* msgs, size_t len) {
+    return msgs_.PopMany(msgs, len);
+}
+
+Message Task::WaitMessage() {
+    while (true) {
+        if (auto msg = ReceiveMessage()) {
+            return *msg;
+        }
+        g_task_manager->SleepIfNoMessage(this);
+    }
+}
+
+size_t Task::WaitMessages(Message* msgs, size_t len) {
+    while (true) {
+        if (size_t n = ReceiveMessages(msgs, len)) {
+            return n;
+        }
+        g_task_manager->SleepIfNoMessage(this);
+    }
 }
 
 std::vector<std::shared_ptr<IFileDescriptor>>& Task::Files() {
-    return files_;
+    return space_->files;
+}
+
+std::shared_ptr<IFileDescriptor> Task::File(int fd) {
+    InterruptGuard guard;
+    auto& files = space_->files;
+    if (fd < 0 || files.size() <= static_cast<size_t>(fd)) {
+        return nullptr;
+    }
+    return files[fd];
+}
+
+Task& Task::ShareSpace(Task& other) {
+    space_ = other.space_;
+    app_entry_ = other.app_entry_;
+    context_.cr3 = other.context_.cr3;
+    return *this;
 }
 
 uint64_t Task::DPagingBegin() const {
-    return dpaging_begin_;
+    return space_->dpaging_begin;
 }
 
 void Task::SetDPagingBegin(uint64_t v) {
-    dpaging_begin_ = v;
+    space_->dpaging_begin = v;
 }
 
 uint64_t Task::DPagingEnd() const {
-    return dpaging_end_;
+    return space_->dpaging_end;
 }
 
 void Task::SetDPagingEnd(uint64_t v) {
-    dpaging_end_ = v;
+    space_->dpaging_end = v;
 }
 
 uint64_t Task::FileMapEnd() const {
-    return file_map_end_;
+    return space_->file_map_end;
 }
 
 void Task::SetFileMapEnd(uint64_t v) {
-    file_map_end_ = v;
+    space_->file_map_end = v;
+}
+
+FileMappings& Task::FileMaps() {
+    return space_->file_maps;
+}
+
+std::shared_ptr<IFileDescriptor>& Task::ImageFile() {
+    return space_->image_file;
+}
+
+std::vector<LoadSegment>& Task::LoadSegments() {
+    return space_->load_segments;
+}
+
+TaskFrameUsage& Task::FrameUsage() {
+    return space_->frame_usage;
+}
+
+size_t Task::FrameLimit() const {
+    return space_->frame_limit;
+}
+
+void Task::SetFrameLimit(size_t frames) {
+    space_->frame_limit = frames;
 }
 
-std::vector<FileMapping>& Task::FileMaps() {
-    return file_maps_;
+PageFaultStat& Task::FaultStat() {
+    return fault_stat_;
+}
+
+SyscallStatTable& Task::SyscallStatsForUpdate() {
+    if (!syscall_stats_) {
+        syscall_stats_ = std::make_unique<SyscallStatTable>();
+    }
+    return *syscall_stats_;
+}
+
+void RunQueue::PushFront(Task* task) {
+    task->run_prev_ = nullptr;
+    task->run_next_ = head_;
+    if (head_) {
+        head_->run_prev_ = task;
+    } else {
+        tail_ = task;
+    }
+    head_ = task;
+}
+
+void RunQueue::PushBack(Task* task) {
+    task->run_prev_ = tail_;
+    task->run_next_ = nullptr;
+    if (tail_) {
+        tail_->run_next_ = task;
+    } else {
+        head_ = task;
+    }
+    tail_ = task;
+}
+
+void RunQueue::Remove(Task* task) {
+    if (task->run_prev_) {
+        task->run_prev_->run_next_ = task->run_next_;
+    } else {
+        head_ = task->run_next_;
+    }
+    if (task->run_next_) {
+        task->run_next_->run_prev_ = task->run_prev_;
+    } else {
+        tail_ = task->run_prev_;
+    }
+    task->run_prev_ = task->run_next_ = nullptr;
 }
 
 TaskManager::TaskManager() {
+    auto& cpu = cpus_[0];
     // 最初に突っ込んでおくのは優先度最高のメインタスク
     // idは常に1
     Task& main_task = NewTask()
-                          .SetLevel(current_level_)
+                          .SetLevel(cpu.current_level)
                           .SetRunning(true);
-    running_[current_level_].push_back(&main_task);
+    PushRunQueue(&main_task, cpu.current_level);
+    StartFPUTask(&main_task);
 
     // アイドルタスク
     // すべてのタスクがスリープしてランキューが空になった場合の番兵となる
-    Task& idle = NewTask()
+    // 呼び出しの浅いループだけなので、スタックは小さくてよい
+    Task& idle = NewTask(2 * kBytesPerFrame)
                      .InitContext(TaskIdle, 0)
                      .SetLevel(0) // 最低の優先度
                      .SetRunning(true);
-    running_[0].push_back(&idle);
+    PushRunQueue(&idle, 0);
 }
 
-Task& TaskManager::NewTask() {
-    latest_id_++;
-    return *tasks_.emplace_back(new Task(latest_id_));
+Task& TaskManager::NewTask(size_t stack_bytes) {
+    SpinLockGuard lock{lock_};
+    ReclaimFinishedTask(cpus_[CurrentCPU()]);
+
+    uint32_t slot_index;
+    if (!free_slots_.empty()) {
+        slot_index = free_slots_.back();
+        free_slots_.pop_back();
+    } else {
+        if (slots_.empty()) {
+            slots_.push_back({nullptr, 0}); // スロット0は欠番
+        }
+        if (slots_.size() >= kMaxTaskSlots) {
+            Log(kError, "too many tasks\n");
+            FlushLog();
+            while (true) __asm__("hlt");
+        }
+        slot_index = slots_.size();
+        slots_.push_back({nullptr, 0});
+    }
+
+    auto& slot = slots_[slot_index];
+    const uint64_t id = (slot.generation << kTaskSlotBits) | slot_index;
+    slot.task.reset(new Task(id, stack_bytes));
+    return *slot.task;
+}
+
+void TaskManager::InitializeCPU(int cpu_index) {
+    // スタックはAPの起動用に確保したものをそのまま使う
+    Task& boot_task = NewTask(0);
+
+    SpinLockGuard lock{lock_};
+    boot_task.cpu_ = cpu_index;
+    boot_task.affinity_ = 1u << cpu_index;
+    // APにはまだ他のタスクがいないので、このタスクがアイドルタスクになる
+    boot_task.SetLevel(0).SetRunning(true);
+    cpus_[cpu_index].current_level = 0;
+    PushRunQueue(&boot_task, 0);
+    StartFPUTask(&boot_task);
+}
+
+Task* TaskManager::FindTask(uint64_t id) {
+    SpinLockGuard lock{lock_};
+    return FindTaskLocked(id);
+}
+
+Task* TaskManager::FindTaskLocked(uint64_t id) {
+    const uint64_t slot_index = id & (kMaxTaskSlots - 1);
+    if (slot_index == 0 || slot_index >= slots_.size()) {
+        return nullptr;
+    }
+    const auto& slot = slots_[slot_index];
+    if (!slot.task || slot.generation != (id >> kTaskSlotBits)) {
+        return nullptr;
+    }
+    return slot.task.get();
+}
+
+void TaskManager::ReclaimFinishedTask(CPUQueues& cpu) {
+    if (cpu.finished_task == nullptr) {
+        return;
+    }
+
+    const uint64_t slot_index = cpu.finished_task->ID() & (kMaxTaskSlots - 1);
+    if (cpu.switched_out == cpu.finished_task) {
+        cpu.switched_out = nullptr;
+    }
+    cpu.finished_task = nullptr;
+
+    // スタックはTaskのデストラクタでプールに返る
+    // 世代番号はFinish()で進めてあるので、ここでは空きスロットに戻すだけ
+    slots_[slot_index].task.reset();
+    free_slots_.push_back(slot_index);
 }
 
 void TaskManager::SwitchTask(const TaskContext& current_ctx) {
-    TaskContext& task_ctx = g_task_manager->CurrentTask().Context();
-    memcpy(&task_ctx, &current_ctx, sizeof(TaskContext));
-    Task* current_task = RotateCurrentRunQueue(false);
-    if (&CurrentTask() != current_task) {
-        RestoreContext(&CurrentTask().Context());
+    // タイマ割り込みのハンドラから呼ばれるので、割り込みは禁止されている
+    lock_.Lock();
+    auto& cpu = cpus_[CurrentCPU()];
+    Task* current_task = cpu.running[cpu.current_level].Front();
+    memcpy(&current_task->Context(), &current_ctx, sizeof(TaskContext));
+    if (current_task->Running() && !cpu.preempt_requested) {
+        DemoteIfHog(current_task);
+    }
+    cpu.preempt_requested = false;
+    // 他のCPUコアからスリープさせられたタスクは、ここで待機列から外れる
+    RotateCurrentRunQueue(cpu, !current_task->Running());
+    if (!current_task->Running()) {
+        RestoreBaseLevel(current_task);
+    }
+    Task* next_task = cpu.running[cpu.current_level].Front();
+    StartTimeSlice(time_slices_[cpu.current_level]);
+    if (next_task != current_task) {
+        AccountSwitch(current_task, next_task, !current_task->Running());
+    }
+    lock_.Unlock();
+
+    // 切り替えない場合も、タイマ割り込みのハンドラで立てたCR0.TSを戻す必要がある
+    SwitchFPUTask(next_task);
+    SwitchPMUTask(current_task, next_task);
+    if (next_task != current_task) {
+        Trace(TraceEvent::kSwitch, next_task->ID(), current_task->ID());
+        RestoreContext(&next_task->Context());
     }
 }
 
 void TaskManager::Sleep(Task* task) {
-    if (!task->Running()) {
+    InterruptGuard guard;
+    lock_.Lock();
+    SleepLocked(task);
+}
+
+void TaskManager::SleepLocked(Task* task) {
+    // 強制終了を求められたタスクを眠らせると、アプリに戻って終わるところまでたどり着けない
+    if (!task->Running() || task->exit_requested_) {
+        lock_.Unlock();
         return;
     }
 
     task->SetRunning(false);
+    Trace(TraceEvent::kSleep, task->ID());
+
+    auto& cpu = cpus_[task->cpu_];
+    if (task == cpu.running[cpu.current_level].Front()) {
+        // 他のCPUコアで実行中なら、そのCPUコアの次のタスク切替えで待機列から外れる
+        if (task->cpu_ != CurrentCPU()) {
+            lock_.Unlock();
+            return;
+        }
+
+        // 指定のタスクが現在実行中の場合
+        Task* current_task = RotateCurrentRunQueue(cpu, true);
+        RestoreBaseLevel(current_task);
+        Task* next_task = cpu.running[cpu.current_level].Front();
+        StartTimeSlice(time_slices_[cpu.current_level]);
+        AccountSwitch(current_task, next_task, true);
+        // 割り込みは禁止したままなので、コンテキストを保存し終えるまで他のタスクには切り替わらない
+        lock_.Unlock();
+        SwitchFPUTask(next_task);
+        SwitchPMUTask(current_task, next_task);
+        Trace(TraceEvent::kSwitch, next_task->ID(), current_task->ID());
+        SwitchContext(&next_task->Context(), &current_task->Context());
+        return;
+    }
+
+    RemoveRunQueue(task, task->Level());
+    RestoreBaseLevel(task);
+    // 待機列で待っている間に眠らされたので、ここまでを待ち時間に数えない
+    task->ready_tsc_ = 0;
+    lock_.Unlock();
+}
+
+void TaskManager::SleepAndUnlock(SpinLock& lock) {
+    lock_.Lock();
+    lock.Unlock();
+    SleepLocked(&CurrentTask());
+}
 
-    // 指定のタスクが現在実行中の場合
-    if (task == running_[current_level_].front()) {
-        Task* current_task = RotateCurrentRunQueue(true);
-        SwitchContext(&CurrentTask().Context(), &current_task->Context());
+void TaskManager::SleepIfNoMessage(Task* task) {
+    InterruptGuard guard;
+    lock_.Lock();
+    // リングに積まれたイベントは、積んだ後にWakeup()するのでlock_の中で見ればよい
+    if (!task->msgs_.Empty() || task->EventRingReady()) {
+        lock_.Unlock();
         return;
     }
+    SleepLocked(task);
+}
 
-    Erase(running_[task->Level()], task);
+void TaskManager::SleepIfBefore(Task* task, unsigned long deadline) {
+    InterruptGuard guard;
+    lock_.Lock();
+    // タイマはtickがタイムアウト時刻に達してから起こすので、ここで達していなければまだ起こされていない
+    if (g_timer_manager->CurrentTick() >= deadline) {
+        lock_.Unlock();
+        return;
+    }
+    SleepLocked(task);
 }
 
 Error TaskManager::Sleep(uint64_t id) {
-    auto it = std::find_if(tasks_.begin(),
-                           tasks_.end(),
-                           [id](const auto& t) { return t->ID() == id; });
-    if (it == tasks_.end()) {
+    InterruptGuard guard;
+    lock_.Lock();
+    Task* task = FindTaskLocked(id);
+    if (task == nullptr) {
+        lock_.Unlock();
         return MAKE_ERROR(Error::kNoSuchTask);
     }
 
-    Sleep(it->get());
+    SleepLocked(task);
     return MAKE_ERROR(Error::kSuccess);
 }
 
 void TaskManager::Wakeup(Task* task, int level) {
+    SpinLockGuard lock{lock_};
+    WakeupLocked(task, level);
+}
+
+void TaskManager::WakeupLocked(Task* task, int level) {
+    // 指定された優先度を、以降の一時的な引き上げと引き下げの基準にする
+    if (level >= 0) {
+        task->base_level_ = level;
+    }
+    WakeupAtLevelLocked(task, level);
+}
+
+void TaskManager::WakeupAtLevelLocked(Task* task, int level) {
+    Trace(TraceEvent::kWakeup, task->ID(), level);
     if (task->Running()) {
         ChangeLevelRunning(task, level);
+        PreemptIfHigher(task);
         return;
     }
 
@@ -180,153 +633,508 @@ void TaskManager::Wakeup(Task* task, int level) {
         level = task->Level();
     }
 
-    task->SetLevel(level);
+    // スリープさせられたが、まだ他のCPUコアの待機列から外れていない
+    if (InRunQueue(task)) {
+        task->SetRunning(true);
+        ChangeLevelRunning(task, level);
+        PreemptIfHigher(task);
+        return;
+    }
+
+    // 眠っている間に今のCPUコアがaffinityから外された
+    if (((task->affinity_ >> task->cpu_) & 1) == 0) {
+        MoveTaskLocked(task, __builtin_ctz(task->affinity_));
+    }
+
+    task->SetEffectiveLevel(level);
     task->SetRunning(true);
+    task->ready_tsc_ = ReadTSC();
+    task->woken_ = true;
 
-    running_[level].push_back(task);
-    if (level > current_level_) {
-        level_changed_ = true;
+    PushRunQueue(task, level);
+    auto& cpu = cpus_[task->cpu_];
+    if (level > cpu.current_level) {
+        cpu.level_changed = true;
+    }
+    PreemptIfHigher(task);
+    // 他のCPUコアが休んでいれば、次のタイマ割り込みを待たせずに起こす
+    if (task->cpu_ != CurrentCPU()) {
+        RingIdleDoorbell(task->cpu_);
     }
-    return;
+}
+
+void TaskManager::WakeupForInput(Task* task) {
+    SpinLockGuard lock{lock_};
+    // アイドルタスクとメインタスクの優先度は変えない。メインタスクの優先度までは上げない
+    const int boost_level = task->base_level_ + 1;
+    int level = -1;
+    if (task->base_level_ >= kMinDynamicLevel && boost_level < kMaxLevel && task->Level() < boost_level) {
+        level = boost_level;
+        sched_stat_.boosts++;
+    }
+    task->hog_slices_ = 0;
+    if (!task->Running()) {
+        task->input_wakeup_ = true;
+    }
+    WakeupAtLevelLocked(task, level);
 }
 
 Error TaskManager::Wakeup(uint64_t id, int level) {
-    auto it = std::find_if(tasks_.begin(),
-                           tasks_.end(),
-                           [id](const auto& t) { return t->ID() == id; });
-    if (it == tasks_.end()) {
+    SpinLockGuard lock{lock_};
+    Task* task = FindTaskLocked(id);
+    if (task == nullptr) {
         return MAKE_ERROR(Error::kNoSuchTask);
     }
 
-    Wakeup(it->get(), level);
+    WakeupLocked(task, level);
     return MAKE_ERROR(Error::kSuccess);
 }
 
 Error TaskManager::SendMessage(uint64_t id, const Message& msg) {
-    auto it = std::find_if(tasks_.begin(),
-                           tasks_.end(),
-                           [id](const auto& task) { return task->ID() == id; });
-
-    if (it == tasks_.end()) {
+    Task* task = FindTask(id);
+    if (task == nullptr) {
         return MAKE_ERROR(Error::kNoSuchTask);
     }
 
-    (*it)->SendMessage(msg);
-    return MAKE_ERROR(Error::kSuccess);
+    return task->SendMessage(msg);
+}
+
+void TaskManager::RequestExitThreads(const Task& main) {
+    SpinLockGuard lock{lock_};
+    for (const auto& slot : slots_) {
+        Task* task = slot.task.get();
+        if (task == nullptr || task == &main || !task->space_ || task->space_ != main.space_) {
+            continue;
+        }
+        __atomic_store_n(&task->exit_requested_, true, __ATOMIC_RELEASE);
+        WakeupLocked(task, -1);
+    }
 }
 
 Task& TaskManager::CurrentTask() {
-    return *running_[current_level_].front();
+    // 自分のCPUコアの待機列の先頭は、自分以外が付け替えることはない
+    // 調べている途中で他のCPUコアへ移されないよう、割り込みだけ禁止する
+    InterruptGuard guard;
+    auto& cpu = cpus_[CurrentCPU()];
+    return *cpu.running[cpu.current_level].Front();
 }
 
 void TaskManager::Finish(int exit_code) {
+    // このタスクにはもう戻らないので、割り込みの状態を元に戻す必要はない
+    __asm__("cli");
+    lock_.Lock();
+
+    auto& cpu = cpus_[CurrentCPU()];
     // Finish()をコールしたタスクは実行可能状態ではなくなる
-    Task* current_task = RotateCurrentRunQueue(true);
+    Task* current_task = RotateCurrentRunQueue(cpu, true);
 
-    // 削除する前にidを保存
+    // 前回終了したタスクはもう誰のスタックでもないので、ここで解放できる
+    ReclaimFinishedTask(cpu);
+    // 終了したタスクは次のタスクに切り替わってから解放する
+    // （いま動いているのはこのタスクのスタックの上）
     const auto task_id = current_task->ID();
-    auto it = std::find_if(
-        tasks_.begin(), tasks_.end(),
-        [current_task](const auto& t) {
-            return t.get() == current_task;
-        });
-    tasks_.erase(it);
+    cpu.finished_task = current_task;
+    // 解放を待つ間にこのIDで見つからないよう、世代番号を先に進めておく
+    slots_[task_id & (kMaxTaskSlots - 1)].generation++;
 
     finish_tasks_[task_id] = exit_code;
     // 削除したタスクの終了を待機しているタスクを起こす
     if (auto it = finish_waiter_.find(task_id); it != finish_waiter_.end()) {
         auto waiter = it->second;
         finish_waiter_.erase(it);
-        Wakeup(waiter);
+        WakeupLocked(waiter, -1);
     }
 
     // 次のタスクに実行を移す
-    RestoreContext(&CurrentTask().Context());
+    Task* next_task = cpu.running[cpu.current_level].Front();
+    StartTimeSlice(time_slices_[cpu.current_level]);
+    AccountSwitch(current_task, next_task, true);
+    lock_.Unlock();
+    // 終了したタスクのFPUの状態はもう要らない
+    ReleaseFPU(current_task);
+    SwitchFPUTask(next_task);
+    SwitchPMUTask(current_task, next_task);
+    Trace(TraceEvent::kSwitch, next_task->ID(), current_task->ID());
+    RestoreContext(&next_task->Context());
 }
 
 WithError<int> TaskManager::WaitFinish(uint64_t task_id) {
     int exit_code;
+    InterruptGuard guard;
     // WaitFinish()をコールしたタスク
     Task* current_task = &CurrentTask();
     while (true) { // 指定タスクの終了を待機
+        lock_.Lock();
         if (auto it = finish_tasks_.find(task_id); it != finish_tasks_.end()) {
             exit_code = it->second;
             finish_tasks_.erase(it);
+            lock_.Unlock();
             break;
         }
+        if (current_task->exit_requested_) {
+            if (auto it = finish_waiter_.find(task_id); it != finish_waiter_.end() && it->second == current_task) {
+                finish_waiter_.erase(it);
+            }
+            lock_.Unlock();
+            return {0, MAKE_ERROR(Error::kExitRequested)};
+        }
         finish_waiter_[task_id] = current_task;
-        Sleep(current_task);
+        // 登録からスリープまでlock_を持ち続けるので、その間に終了されても起こし損ねない
+        SleepLocked(current_task);
     }
     return {exit_code, MAKE_ERROR(Error::kSuccess)};
 }
 
+std::optional<int> TaskManager::PollFinish(uint64_t task_id) {
+    SpinLockGuard lock{lock_};
+    auto it = finish_tasks_.find(task_id);
+    if (it == finish_tasks_.end()) {
+        return std::nullopt;
+    }
+    const int exit_code = it->second;
+    finish_tasks_.erase(it);
+    return exit_code;
+}
+
 void TaskManager::ChangeLevelRunning(Task* task, int level) {
     // 実行レベル変更なし
     if (level < 0 || level == task->Level()) {
         return;
     }
 
+    auto& cpu = cpus_[task->cpu_];
     // change level of other task
-    if (task != running_[current_level_].front()) {
-        Erase(running_[task->Level()], task);
-        running_[level].push_back(task);
-        task->SetLevel(level);
-        if (level > current_level_) {
-            level_changed_ = true;
+    if (task != cpu.running[cpu.current_level].Front()) {
+        RemoveRunQueue(task, task->Level());
+        PushRunQueue(task, level);
+        task->SetEffectiveLevel(level);
+        if (level > cpu.current_level) {
+            cpu.level_changed = true;
         }
         return;
     }
 
     // change level myself
-    running_[current_level_].pop_front();
-    running_[level].push_front(task);
-    task->SetLevel(level);
-    if (level >= current_level_) {
-        current_level_ = level;
+    RemoveRunQueue(task, cpu.current_level);
+    PushRunQueue(task, level, true);
+    task->SetEffectiveLevel(level);
+    if (level >= cpu.current_level) {
+        cpu.current_level = level;
+    } else {
+        cpu.current_level = level;
+        cpu.level_changed = true;
+    }
+}
+
+void TaskManager::PushRunQueue(Task* task, int level, bool front) {
+    auto& cpu = cpus_[task->cpu_];
+    if (front) {
+        cpu.running[level].PushFront(task);
     } else {
-        current_level_ = level;
-        level_changed_ = true;
+        cpu.running[level].PushBack(task);
     }
+    cpu.running_levels |= 1u << level;
 }
 
-Task* TaskManager::RotateCurrentRunQueue(bool current_sleep) {
-    auto& level_queue = running_[current_level_];
-    Task* current_task = level_queue.front();
-    level_queue.pop_front();
+void TaskManager::RemoveRunQueue(Task* task, int level) {
+    auto& cpu = cpus_[task->cpu_];
+    cpu.running[level].Remove(task);
+    if (cpu.running[level].Empty()) {
+        cpu.running_levels &= ~(1u << level);
+    }
+}
+
+bool TaskManager::InRunQueue(Task* task) {
+    return task->run_prev_ || task->run_next_ ||
+           cpus_[task->cpu_].running[task->Level()].Front() == task;
+}
+
+Task* TaskManager::RotateCurrentRunQueue(CPUQueues& cpu, bool current_sleep) {
+    Task* current_task = cpu.running[cpu.current_level].Front();
+    MarkContextSaved(cpu);
+    // current_taskから切り替えるなら、RestoreContext()やSwitchContext()が終わるまでそのスタックを使う
+    current_task->last_run_ = g_timer_manager->CurrentTick();
+    current_task->context_saved_ = false;
+    cpu.switched_out = current_task;
+    RemoveRunQueue(current_task, cpu.current_level);
     if (!current_sleep) {
-        level_queue.push_back(current_task);
+        PushRunQueue(current_task, cpu.current_level);
     }
-    if (level_queue.empty()) {
-        level_changed_ = true;
+    if (cpu.running[cpu.current_level].Empty()) {
+        cpu.level_changed = true;
     }
 
     // 実行レベルの見直し
-    if (level_changed_) {
-        level_changed_ = false;
-        // レベルの高い順から走査し、最初の空でない待機列のレベルで抜ける
-        for (int lv = kMaxLevel; lv >= 0; lv--) {
-            if (!running_[lv].empty()) {
-                current_level_ = lv;
-                break;
-            }
+    if (cpu.level_changed) {
+        cpu.level_changed = false;
+        // 空でない待機列のうち最も高いレベル（アイドルタスクがいるので0は常に空でない）
+        cpu.current_level = 31 - __builtin_clz(cpu.running_levels);
+    }
+
+    // 休むくらいなら他のCPUコアの仕事を引き受ける
+    if (cpu.current_level == 0 && NumCPUs() > 1) {
+        if (Task* task = StealTask(&cpu - &cpus_[0])) {
+            cpu.current_level = task->Level();
         }
     }
 
     return current_task;
 }
 
+void TaskManager::AccountSwitch(Task* current, Task* next, bool voluntary) {
+    const uint64_t now = ReadTSC();
+    // 起動時から動いているタスクは、始めた時刻が分からない
+    if (current->switch_in_tsc_ != 0) {
+        current->sched_stat_.run_cycles += now - current->switch_in_tsc_;
+    }
+    if (voluntary) {
+        current->sched_stat_.voluntary++;
+    } else {
+        current->sched_stat_.involuntary++;
+        current->ready_tsc_ = now;
+    }
+
+    next->switch_in_tsc_ = now;
+    next->sched_stat_.switches++;
+    if (next->ready_tsc_ != 0) {
+        next->sched_stat_.wait_cycles += now - next->ready_tsc_;
+        if (next->woken_) {
+            AddSchedLatency(next->input_wakeup_ ? sched_stat_.input : sched_stat_.other, now - next->ready_tsc_);
+        }
+        next->ready_tsc_ = 0;
+    }
+    next->woken_ = next->input_wakeup_ = false;
+}
+
+void TaskManager::PreemptIfHigher(Task* task) {
+    // 他のCPUコアでは、次のタイマ割り込みで優先度の高いタスクに切り替わる
+    if (task->cpu_ != CurrentCPU()) {
+        return;
+    }
+    auto& cpu = cpus_[task->cpu_];
+    if (task->Level() <= cpu.current_level || cpu.preempt_requested) {
+        return;
+    }
+    cpu.preempt_requested = true;
+    sched_stat_.preemptions++;
+    // すぐにタイマ割り込みが起き、割り込まれたタスクは待機列の後ろに回る
+    StartTimeSlice(0);
+}
+
+void TaskManager::DemoteIfHog(Task* task) {
+    const int base = task->base_level_;
+    if (base < kMinDynamicLevel || base >= kMaxLevel) {
+        return;
+    }
+    int level = task->Level();
+    if (level > base) { // 入力イベントで引き上げたタスクは、1回使い切ったら戻す
+        level = base;
+    } else {
+        if (++task->hog_slices_ < kHogSlices) {
+            return;
+        }
+        task->hog_slices_ = 0;
+        if (level <= kMinDynamicLevel) {
+            return;
+        }
+        level--;
+    }
+    sched_stat_.demotions++;
+    ChangeLevelRunning(task, level);
+}
+
+void TaskManager::RestoreBaseLevel(Task* task) {
+    task->hog_slices_ = 0;
+    task->SetEffectiveLevel(task->base_level_);
+}
+
+Task* TaskManager::StealTask(int thief) {
+    const int num_cpus = NumCPUs();
+    // 直前まで動いていたタスクは元のCPUコアのキャッシュが温まっているので、しばらく止まっているものを選ぶ
+    const unsigned long recent = g_timer_manager->CurrentTick() - kMinStealIdleTicks;
+    // アイドルタスク（優先度0）は奪わない
+    for (int level = kMaxLevel; level > 0; level--) {
+        Task* best = nullptr;
+        for (int i = 1; i < num_cpus; i++) {
+            const int victim_index = (thief + i) % num_cpus;
+            auto& victim = cpus_[victim_index];
+            // 実行中のタスク（現在の優先度の待機列の先頭）と、元のCPUコアでコンテキストを保存し終えていないタスクは動かせない
+            // FPUの状態が元のCPUコアのレジスタに残っているタスクも、そこでしか保存できないので動かせない
+            const Task* running = victim.running[victim.current_level].Front();
+            for (Task* t = victim.running[level].Front(); t; t = t->run_next_) {
+                if (t == running || !t->context_saved_ || ((t->affinity_ >> thief) & 1) == 0 ||
+                    t->last_run_ > recent || IsFPUOwner(victim_index, t)) {
+                    continue;
+                }
+                if (best == nullptr || t->last_run_ < best->last_run_) {
+                    best = t;
+                }
+            }
+        }
+        if (best == nullptr) {
+            continue;
+        }
+
+        cpus_[best->cpu_].stolen++;
+        RemoveRunQueue(best, level);
+        best->cpu_ = thief;
+        PushRunQueue(best, level);
+        cpus_[thief].steals++;
+        return best;
+    }
+    return nullptr;
+}
+
+void TaskManager::MarkContextSaved(CPUQueues& cpu) {
+    Task* task = cpu.switched_out;
+    // 切り替えずに同じタスクに戻ったなら、まだそのスタックの上にいる
+    if (task == nullptr || task == cpu.running[cpu.current_level].Front()) {
+        return;
+    }
+    task->context_saved_ = true;
+    cpu.switched_out = nullptr;
+}
+
+bool TaskManager::MoveTask(Task* task, int cpu) {
+    SpinLockGuard lock{lock_};
+    return MoveTaskLocked(task, cpu);
+}
+
+bool TaskManager::MoveTaskLocked(Task* task, int cpu) {
+    if (task->cpu_ == cpu) {
+        return true;
+    }
+    auto& from = cpus_[task->cpu_];
+    if (((task->affinity_ >> cpu) & 1) == 0 || !task->context_saved_ ||
+        task == from.running[from.current_level].Front() || IsFPUOwner(task->cpu_, task)) {
+        return false;
+    }
+
+    if (!InRunQueue(task)) {
+        task->cpu_ = cpu;
+        return true;
+    }
+    const int level = task->Level();
+    RemoveRunQueue(task, level);
+    task->cpu_ = cpu;
+    PushRunQueue(task, level);
+    if (level > cpus_[cpu].current_level) {
+        cpus_[cpu].level_changed = true;
+    }
+    if (cpu != CurrentCPU()) {
+        RingIdleDoorbell(cpu);
+    }
+    return true;
+}
+
+Error TaskManager::SetAffinity(uint64_t id, uint32_t mask) {
+    if (NumCPUs() < 32) {
+        mask &= (1u << NumCPUs()) - 1;
+    }
+    if (mask == 0) {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    SpinLockGuard lock{lock_};
+    Task* task = FindTaskLocked(id);
+    if (task == nullptr) {
+        return MAKE_ERROR(Error::kNoSuchTask);
+    }
+    if (mask != (1u << 0) && !task->smp_safe_) {
+        return MAKE_ERROR(Error::kNotSMPSafe);
+    }
+    task->affinity_ = mask;
+    // 動かせなければ、WakeupAtLevelLocked()で次に起こすときに移す
+    if (((mask >> task->cpu_) & 1) == 0) {
+        MoveTaskLocked(task, __builtin_ctz(mask));
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+unsigned long TaskManager::TimeSlice(int level) {
+    SpinLockGuard lock{lock_};
+    return time_slices_[level];
+}
+
+void TaskManager::SetTimeSlice(int level, unsigned long ticks) {
+    SpinLockGuard lock{lock_};
+    time_slices_[level] = std::max<unsigned long>(ticks, kMinTimeSlice);
+}
+
+TaskManager::CPUStat TaskManager::GetCPUStat(int cpu_index) {
+    SpinLockGuard lock{lock_};
+    const auto& cpu = cpus_[cpu_index];
+    size_t runnable = 0;
+    for (const auto& queue : cpu.running) {
+        for (const Task* t = queue.Front(); t; t = t->run_next_) {
+            runnable++;
+        }
+    }
+    return {runnable, cpu.steals, cpu.stolen};
+}
+
+bool TaskManager::HasOtherRunnable(const CPUQueues& cpu) {
+    const Task* current = cpu.running[cpu.current_level].Front();
+    return (cpu.running_levels & ~(1u << cpu.current_level)) != 0 ||
+           (current && current->run_next_);
+}
+
+bool TaskManager::HasRunnable(int cpu_index) {
+    SpinLockGuard lock{lock_};
+    // アイドルループから休む前に呼ばれる。眠っている間も、切り替えて離れたタスクを他のCPUコアへ移せるようにする
+    if (cpu_index == CurrentCPU()) {
+        MarkContextSaved(cpus_[cpu_index]);
+    }
+    return HasOtherRunnable(cpus_[cpu_index]);
+}
+
+void TaskManager::PreemptIdle() {
+    SpinLockGuard lock{lock_};
+    auto& cpu = cpus_[CurrentCPU()];
+    MarkContextSaved(cpu);
+    if (!HasOtherRunnable(cpu) || cpu.preempt_requested) {
+        return;
+    }
+    cpu.preempt_requested = true;
+    // すぐにタイマ割り込みが起き、アイドルループは待機列の後ろに回る
+    StartTimeSlice(0);
+}
+
+TaskManager::SchedStat TaskManager::GetSchedStat() {
+    SpinLockGuard lock{lock_};
+    return sched_stat_;
+}
+
+void TaskManager::ResetSchedStat() {
+    SpinLockGuard lock{lock_};
+    sched_stat_ = {};
+}
+
 TaskManager* g_task_manager;
 
 void InitializeTask() {
     g_task_manager = new TaskManager;
+    AddMemoryPressureHandler(TrimStackPool);
 
-    // タスク切替え用のタイマ追加
-    __asm__("cli");
-    g_timer_manager->AddTimer(Timer{g_timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue, kMainTaskID});
-    __asm__("sti");
+    // タスク切替えのタイミングはTimerManagerがtickごとに判定する
+}
+
+TaskStackStat GetTaskStackStat() {
+    SpinLockGuard lock{g_stack_lock};
+    return {g_stack_pool.size(), g_stack_pool_hits, g_stack_pool_misses,
+            g_stack_area_end - kKernelStackBase};
 }
 
 /// 現在実行中のタスクのOS用スタックポインタの値を取得
 __attribute__((no_caller_saved_registers)) extern "C" uint64_t GetCurrentTaskOSStackPointer() {
     return g_task_manager->CurrentTask().OSStackPointer();
+}
+
+/// システムコールからアプリに戻る直前に呼ぶ（SyscallEntry）
+/// 強制終了を求められたスレッドなら、アプリに戻らずにCallApp()の次へ抜ける
+extern "C" void ExitAppIfRequested() {
+    auto& task = g_task_manager->CurrentTask();
+    if (task.ExitRequested()) {
+        ExitApp(task.OSStackPointer(), 128 + SIGKILL);
+    }
 }
\ No newline at end of file
@@ -5,14 +5,22 @@
 #include <array>
 #include <cstddef>
 #include <cstdint>
-#include <deque>
 #include <map>
+#include <memory>
 #include <optional>
 #include <vector>
 
 #include "error.hpp"
 #include "fat.hpp"
 #include "message.hpp"
+#include "message_queue.hpp"
+#include "paging.hpp"
+#include "slab.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
+#include "sync.hpp"
+#include "syscall.hpp"
+#include "timer.hpp"
 
 /// コンテキスト : タスクの実行バイナリ、コマンドライン引数、環境変数、スタックメモリ、各レジスタの値など
 /// コンテキストの切替時に値の保存と復帰に必要なレジスタをすべて含む
@@ -21,19 +29,117 @@ struct TaskContext {
     uint64_t cs, ss, fs, gs;                         // offset 0x20
     uint64_t rax, rbx, rcx, rdx, rdi, rsi, rsp, rbp; // offset 0x40
     uint64_t r8, r9, r19, r11, r12, r13, r14, r15;   // offset 0x80
-    std::array<uint8_t, 512> fxsave_area;            // offset 0xc0
+    // FPUのレジスタはTask::FPUArea()に遅延保存する（fpu.hpp）
 } __attribute__((packed));
 
 using TaskFunc = void(uint64_t, int64_t);
 
 class TaskManager;
+struct PerfCounters;
+namespace fat {
+    struct DirectoryEntry;
+}
 
 /// ファイルの内容を仮想アドレス空間の連続した領域にマッピング
+struct SharedMemory;
+class EventRing;
+
+/// メモリマップドファイル（shmがあれば共有メモリ）のマッピング
 struct FileMapping {
-    /// ファイルディスクリプタ
+    /// ファイルディスクリプタ（共有メモリなら-1）
     int fd;
     /// 仮想アドレス範囲
     uint64_t vaddr_begin, vaddr_end;
+    MapAdvice advice{MapAdvice::kNormal};
+    /// 直前のページフォルトで読み込んだ範囲の直後（連続アクセスの検出用）
+    uint64_t next_fault_vaddr{0};
+    /// マップしている共有メモリ（shm.hpp）。ファイルならnullptr
+    SharedMemory* shm{nullptr};
+};
+
+/// ページフォルト時に読み込むアプリのLOADセグメント
+struct LoadSegment {
+    /// メモリ上の範囲 [vaddr, vaddr + mem_size)
+    uint64_t vaddr, mem_size;
+    /// ファイル上の範囲 [file_offset, file_offset + file_size)。mem_sizeに満たない部分（.bss）は0
+    uint64_t file_offset, file_size;
+};
+
+/// タスクのファイルマッピングの集合。マッピング同士は重ならない
+/// 開始アドレスをキーにすることで、ページフォルト時にアドレスを含むマッピングをO(log n)で探せる
+using FileMappings = std::map<uint64_t, FileMapping>;
+
+/// タスクが階層ページング構造を通して割り当てた物理フレーム数
+struct TaskFrameUsage {
+    /// 起動時に割り当てたELF、スタック、コマンドライン引数のページ
+    size_t image_pages;
+    /// デマンドページングで割り当てたページ
+    size_t demand_pages;
+    /// メモリマップドファイルのページキャッシュ
+    size_t file_pages;
+    /// コピーオンライトで複製したページ
+    size_t cow_pages;
+    /// ページング構造自体
+    size_t page_tables;
+
+    size_t Total() const {
+        return image_pages + demand_pages + file_pages + cow_pages + page_tables;
+    }
+};
+
+/// アプリのアドレス空間と、そこで動くスレッド（タスク）が共有する資源
+/// アプリを起動したタスク（ターミナル）が持ち、CreateThreadで作ったタスクは同じものを指す
+/// アドレス空間の操作は割り込みを禁止して排他するので、スレッドは作ったタスクと同じCPUコアだけで動かす
+struct AppSpace {
+    /// ファイルディスクリプタ
+    /// -> 番号が他のアプリとだぶっても大丈夫
+    std::vector<std::shared_ptr<IFileDescriptor>> files{};
+    /// デマンドページングの仮想アドレス範囲
+    uint64_t dpaging_begin{0}, dpaging_end{0};
+    /// メモリマップドファイルに利用される仮想アドレス範囲（スレッドのスタックもここから切り出す）
+    uint64_t file_map_end{0};
+    FileMappings file_maps{};
+    std::shared_ptr<IFileDescriptor> image_file{};
+    std::vector<LoadSegment> load_segments{};
+    TaskFrameUsage frame_usage{};
+    size_t frame_limit{0};
+
+    /// 作ったまま、まだJoinThreadで待っていないスレッドのID
+    std::vector<uint64_t> threads{};
+    /// Spawnで起動し、まだWaitTaskで待っていないアプリのタスクのID（アプリが終わっても待たない）
+    std::vector<uint64_t> children{};
+    /// 終わったスレッドのスタックの上端（次のスレッドで使い回す）
+    std::vector<uint64_t> free_thread_stacks{};
+    /// FutexWaitで待つタスクの列（キーはアプリの仮想アドレス）。futex_lockで保護する
+    std::map<uint64_t, WaitQueue> futexes{};
+    SpinLock futex_lock;
+};
+
+/// タスクの実行時間とタスク切り替えの統計（TSCのカウント）。実行を止めたときにまとめて足し込む
+struct TaskSchedStat {
+    /// 実行していた時間
+    uint64_t run_cycles;
+    /// 実行可能になってから、実際に実行されるまで待機列で待った時間
+    uint64_t wait_cycles;
+    /// 実行を始めた回数
+    uint64_t switches;
+    /// 眠るか終了して、自分から実行を止めた回数
+    uint64_t voluntary;
+    /// タイムスライスの満了や優先度の高いタスクによって、実行を奪われた回数
+    uint64_t involuntary;
+};
+
+/// GetTaskStatシステムコールで返す1タスクぶんの情報（apps/syscall.hのTaskStatと同じ並び）
+struct TaskStat {
+    uint64_t id;
+    TaskSchedStat sched;
+    int32_t level;
+    int32_t cpu;
+    /// 実行可能状態 : 1
+    uint32_t running;
+    uint32_t reserved;
+    /// 実行中のアプリのファイル名（アプリでなければ空）
+    char name[16];
 };
 
 /// タスク : 動作中のプログラム。処理単位。
@@ -44,52 +150,165 @@ public:
     /// 32KiB
     static const size_t kDefaultStackBytes = 8 * 4096;
 
-    Task(uint64_t id);
+    /// stack_bytes : InitContext()で割り当てるスタックの大きさ（4KiB単位に切り上げる）
+    Task(uint64_t id, size_t stack_bytes = kDefaultStackBytes);
+    /// スタックをプールに返す
+    ~Task();
+    /// Taskはスラブキャッシュから確保する（スラブを増やせなければヒープから）
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
     /// f : 実際に実行されるタスク（関数）
     Task& InitContext(TaskFunc* f, int64_t data);
     TaskContext& Context();
+    /// FPUの状態の保存領域（fpu.hpp）
+    uint8_t* FPUArea() { return fpu_area_; }
     uint64_t& OSStackPointer();
     uint64_t ID() const;
     Task& Sleep();
     Task& Wakeup();
     /// イベントメッセージが通知されたら起こす
-    void SendMessage(const Message& msg);
+    /// キューが満杯ならメッセージを捨てて kFull を返す（それでも起こす）
+    Error SendMessage(const Message& msg);
     /// メッセージを取得
     std::optional<Message> ReceiveMessage();
+    /// 次に取得されるメッセージを、取り出さずに返す
+    std::optional<Message> PeekMessage() const;
+    /// 溜まっているメッセージを最大len個まとめて取得し、取得した数を返す
+    size_t ReceiveMessages(Message* msgs, size_t len);
+    /// メッセージが届くまで眠って待ち、取り出す（実行中のタスク自身が呼ぶ）
+    Message WaitMessage();
+    /// メッセージが1つ以上届くまで眠って待ち、最大len個まとめて取得する（実行中のタスク自身が呼ぶ）
+    size_t WaitMessages(Message* msgs, size_t len);
+    /// キューが満杯で捨てたメッセージの累計
+    size_t DroppedMessages() const { return msgs_.Dropped(); }
+    /// アプリ宛てのメッセージを、以降はキューではなくringに変換して積む（nullptrでやめる）
+    void SetEventRing(std::shared_ptr<EventRing> ring);
+    /// リングが満杯でキューに回したメッセージを、空いた分だけリングに移す（実行中のタスク自身が呼ぶ）
+    /// 移し終えたら、アプリ宛てでないメッセージもキューから捨てる
+    void RefillEventRing();
+    /// リングにアプリが取り出していないイベントがあればtrue
+    bool EventRingReady();
     std::vector<std::shared_ptr<IFileDescriptor>>& Files();
+    /// fdが指すファイル（なければ nullptr）。同じ表を使うスレッドが表を伸ばしても壊れないよう、複製を返す
+    std::shared_ptr<IFileDescriptor> File(int fd);
+    /// アプリのアドレス空間と資源（スレッドとは共有する）
+    AppSpace& Space() { return *space_; }
+    /// otherと同じアドレス空間で動くスレッドにする（InitContext()の後に呼ぶ）
+    Task& ShareSpace(Task& other);
     uint64_t DPagingBegin() const;
     void SetDPagingBegin(uint64_t v);
     uint64_t DPagingEnd() const;
     void SetDPagingEnd(uint64_t v);
     uint64_t FileMapEnd() const;
     void SetFileMapEnd(uint64_t v);
-    std::vector<FileMapping>& FileMaps();
+    FileMappings& FileMaps();
+    /// 遅延読み込み中のアプリの実行可能ファイル
+    std::shared_ptr<IFileDescriptor>& ImageFile();
+    std::vector<LoadSegment>& LoadSegments();
+    TaskFrameUsage& FrameUsage();
+    /// ページフォルトで割り当てる物理フレーム数の上限（0なら無制限）
+    size_t FrameLimit() const;
+    void SetFrameLimit(size_t frames);
+    PageFaultStat& FaultStat();
+    /// システムコールの統計。統計を取り始めてから、このタスクがシステムコールを呼んでいなければ nullptr
+    SyscallStatTable* SyscallStats() { return syscall_stats_.get(); }
+    /// 統計の置き場所がなければ作ってから返す
+    SyscallStatTable& SyscallStatsForUpdate();
+
+    /// 実行中のアプリの実行可能ファイル（プロファイラがシンボルを引く）。アプリを実行していなければ nullptr
+    const fat::DirectoryEntry* AppEntry() const { return app_entry_; }
+    void SetAppEntry(const fat::DirectoryEntry* entry) { app_entry_ = entry; }
+    /// 性能監視カウンタの足し込み先（pmu.hpp）。数えていなければ nullptr
+    PerfCounters* Perf() const { return perf_; }
+    void SetPerf(PerfCounters* counters) { perf_ = counters; }
+    const TaskSchedStat& SchedStat() const { return sched_stat_; }
 
     int Level() const { return level_; }
     bool Running() const { return running_; }
+    /// 強制終了を求められた（TaskManager::RequestExitThreads()） : true
+    /// 求められたタスクはもう眠らず、次にシステムコールかタイマ割り込みからアプリに戻るところで終わる
+    bool ExitRequested() const { return __atomic_load_n(&exit_requested_, __ATOMIC_ACQUIRE); }
+    /// このタスクを実行するCPUコア
+    int CPU() const { return cpu_; }
+    /// このタスクを実行してよいCPUコアのビットマップ（bit n : CPUコアn）
+    /// レイヤなど、まだ複数のCPUコアから同時に触れない処理が多いので、既定ではBSPだけ
+    uint32_t Affinity() const { return affinity_; }
+    Task& SetAffinity(uint32_t affinity) {
+        affinity_ = affinity;
+        return *this;
+    }
+    /// 複数のCPUコアから同時に触れない処理を使わない : true
+    /// TaskManager::SetAffinity()は、この印を付けたタスクにしかBSP以外を許さない
+    bool SMPSafe() const { return smp_safe_; }
+    Task& MarkSMPSafe() {
+        smp_safe_ = true;
+        return *this;
+    }
 
 private:
     uint64_t id_;
-    /// スタック領域
-    std::vector<uint64_t> stack_;
+    /// スタック領域（kKernelStackBase以降にマップされる）。0なら未割り当て
+    uint64_t stack_begin_{0};
+    size_t stack_bytes_;
     alignas(16) TaskContext context_;
+    std::unique_ptr<uint8_t[]> fpu_buf_;
+    /// fpu_buf_の中の64byte境界
+    uint8_t* fpu_area_;
     /// OS用スタックポインタ（アプリ終了時からの復帰に必要）
     uint64_t os_stack_pointer_;
     /// 割り込みメッセージキュー
-    std::deque<Message> msgs_;
+    MessageQueue msgs_;
+    /// アプリのイベントリング。event_lock_で守る
+    std::shared_ptr<EventRing> event_ring_;
+    /// リングが満杯でキューに回したアプリ宛てのメッセージがある。順序を保つため、移し終えるまでキューに積む
+    bool event_ring_overflow_{false};
+    SpinLock event_lock_;
     unsigned int level_{kDefaultLevel};
+    /// Wakeup()などで指定された優先度。level_は入力イベントによる引き上げやCPUの使いすぎによる引き下げで一時的に変わる
+    unsigned int base_level_{kDefaultLevel};
+    /// 眠らずに続けてタイムスライスを使い切った回数
+    unsigned int hog_slices_{0};
+    /// 入力イベントで起こされ、まだ実行されていない : true（待ち時間の統計を分ける）
+    bool input_wakeup_{false};
+    /// 眠っていたところを起こされ、まだ実行されていない : true
+    bool woken_{false};
     /// 実行可能状態（待機列に並んでいる） : true
     bool running_{false};
-    /// ファイルディスクリプタをタスク毎に持たせる
-    /// -> 番号が他のタスクとだぶっても大丈夫
-    std::vector<std::shared_ptr<IFileDescriptor>> files_{};
-    /// デマンドページングの仮想アドレス範囲
-    uint64_t dpaging_begin_{0}, dpaging_end_{0};
-    /// メモリマップドファイルに利用される仮想アドレス範囲
-    uint64_t file_map_end_{0};
-    std::vector<FileMapping> file_maps_{};
+    bool exit_requested_{false};
+    int cpu_{0};
+    uint32_t affinity_{1};
+    bool smp_safe_{false};
+    /// 最後に実行を止めた時刻（タイマのtick）。キャッシュが冷めたものから他のCPUコアへ移すのに使う
+    unsigned long last_run_{0};
+    /// 最後に実行を止めたCPUコアで、コンテキスト（とスタックの使用）を保存し終えた : true
+    /// 切り替えた直後はまだ古いスタックの上にいるかもしれないので、そのCPUコアが次にスケジューラに入るまでfalse
+    /// falseの間は他のCPUコアへ移さない
+    bool context_saved_{true};
+    /// ファイルディスクリプタやアドレス空間の範囲。スレッドは作ったタスクと共有する
+    std::shared_ptr<AppSpace> space_;
+    PageFaultStat fault_stat_{};
+    /// 使われるまで作らない（システムコールを呼ばないタスクの方が多いため）
+    std::unique_ptr<SyscallStatTable> syscall_stats_{};
+    PerfCounters* perf_{nullptr};
+    const fat::DirectoryEntry* app_entry_{nullptr};
+    TaskSchedStat sched_stat_{};
+    /// 最後に実行を始めた時刻（TSC）。0なら未計測
+    uint64_t switch_in_tsc_{0};
+    /// 実行可能になって待機列で待ち始めた時刻（TSC）。0なら待っていない
+    uint64_t ready_tsc_{0};
+    /// ランキュー内の前後のタスク（RunQueueが管理する）
+    Task* run_prev_{nullptr};
+    Task* run_next_{nullptr};
+    /// 並んでいる待ち行列と、その中の次のタスク（WaitQueueが管理する）
+    WaitQueue* wait_queue_{nullptr};
+    Task* wait_next_{nullptr};
 
     Task& SetLevel(int level) {
+        level_ = base_level_ = level;
+        return *this;
+    }
+    /// 指定された優先度は変えずに、一時的な優先度だけを変える
+    Task& SetEffectiveLevel(int level) {
         level_ = level;
         return *this;
     }
@@ -99,46 +318,174 @@ private:
     }
 
     friend TaskManager;
+    friend class RunQueue;
+    friend class WaitQueue;
+};
+
+/// Taskに埋め込まれたポインタでつなぐ双方向リスト（侵入型リスト）
+/// 要素の追加・削除でメモリ確保が起きず、どの操作もO(1)
+class RunQueue {
+public:
+    bool Empty() const { return head_ == nullptr; }
+    Task* Front() const { return head_; }
+    void PushFront(Task* task);
+    void PushBack(Task* task);
+    /// taskはこのキューに並んでいること
+    void Remove(Task* task);
+
+private:
+    Task* head_{nullptr};
+    Task* tail_{nullptr};
 };
 
 /// 複数のタスクを管理
+/// ランキューはCPUコアごとに持ち、タスクは割り当てられたCPUコアのランキューにだけ並ぶ
+/// 管理情報はlock_で保護する（割り込みの禁止だけでは他のCPUコアとの排他にならない）
 class TaskManager {
 public:
     static const int kMaxLevel = 3;
     TaskManager();
     /// 待機列には追加しない
-    Task& NewTask();
+    /// stack_bytes : InitContext()で割り当てるスタックの大きさ
+    Task& NewTask(size_t stack_bytes = Task::kDefaultStackBytes);
+    /// 起動したAPの現在のコンテキストを、そのCPUコアのアイドルタスクとして登録する（AP自身が呼ぶ）
+    void InitializeCPU(int cpu);
     /// タスク切替え
     void SwitchTask(const TaskContext& current_ctx);
     /// タスクをスリープ状態にする（待機列から除外）
     void Sleep(Task* task);
     Error Sleep(uint64_t id);
+    /// 実行中のタスクをスリープさせ、lockを解放する（WaitQueueが使う）
+    /// lock_を取ってからlockを解放するので、その間に起こそうとしたタスクは眠り終えるまで待たされ、起こし損ねない
+    void SleepAndUnlock(SpinLock& lock);
+    /// メッセージキューが空なら、taskをスリープさせる
+    /// 送信側はキューに積んでからlock_を取って起こすので、空を確かめてから眠るまでの間に届いても起こし損ねない
+    void SleepIfNoMessage(Task* task);
+    /// 現在時刻（tick）がdeadlineより前なら、taskをスリープさせる（Timer::WakeupTimer()で起こしてもらう）
+    /// 時刻を確かめてから眠るまでlock_を持つので、その間にタイマが起こしても取りこぼさない
+    void SleepIfBefore(Task* task, unsigned long deadline);
     /// タスクを実行可能状態にする（待機列に復帰）
     void Wakeup(Task* task, int level = -1);
     Error Wakeup(uint64_t id, int level = -1);
+    /// キーボードやマウスのイベントを受け取ったタスクを、指定された優先度より1つ上げて起こす
+    /// 引き上げは眠るか、タイムスライスを1回使い切るまで続く
+    void WakeupForInput(Task* task);
     /// 指定のタスクに割り込みメッセージを通知し、待機列に復帰させる
     Error SendMessage(uint64_t id, const Message& msg);
     /// 現在実行中のタスク
     Task& CurrentTask();
+    /// mainとアドレス空間を共有するタスク（スレッド）すべてに強制終了を求め、眠っていれば起こす
+    /// WaitQueueやfutexの列に並んでいたタスクは、起きたところで自分で列から外れる
+    void RequestExitThreads(const Task& main);
     /// 現在実行中のタスクを終了し、finish_tasks_に終了コードを登録
     void Finish(int exit_code);
     /// 指定タスクの終了コードを得る
+    /// 待っている間に強制終了を求められたら、待つのをやめてkExitRequestedを返す
     WithError<int> WaitFinish(uint64_t task_id);
+    /// 指定タスクが終了していれば終了コードを得る（待たない）
+    std::optional<int> PollFinish(uint64_t task_id);
+    /// IDからタスクを引く。存在しない（終了済みの）場合はnullptr
+    Task* FindTask(uint64_t id);
+    /// 指定タスクを実行してよいCPUコアを変える（存在しないCPUコアのビットは無視する）
+    /// 既定のBSPだけから広げてよいのは、MarkSMPSafe()を付けたタスクだけ（付いていなければkNotSMPSafe）
+    /// 今いるCPUコアが外れたら、動かせるならすぐに、実行中なら次に起こされるときに移す
+    Error SetAffinity(uint64_t id, uint32_t mask);
+    /// taskをcpuの待機列に移す。実行中か、前のCPUコアでコンテキストを保存し終えていないか、
+    /// affinityがcpuを許していなければ移さずにfalse
+    bool MoveTask(Task* task, int cpu);
+    /// 生存しているすべてのタスクに対してf(Task&)を呼ぶ（スロット順）
+    template <class F>
+    void ForEachTask(F&& f) {
+        SpinLockGuard lock{lock_};
+        for (const auto& slot : slots_) {
+            if (slot.task) {
+                f(*slot.task);
+            }
+        }
+    }
+
+    /// 優先度ごとのタイムスライス（tick）
+    /// 切り替えたタスクの優先度のタイムスライスが満了したら、同じ優先度の次のタスクに切り替える
+    unsigned long TimeSlice(int level);
+    void SetTimeSlice(int level, unsigned long ticks);
+    /// 短すぎるとタイマ割り込みばかりになるので、これ未満には設定できない（0.5msec）
+    static const unsigned long kMinTimeSlice = kTimerFreq / 2000;
+
+    /// CPUコアごとのスケジューリングの統計
+    struct CPUStat {
+        /// 待機列に並んでいるタスク数（実行中のものを含む）
+        size_t runnable;
+        size_t steals, stolen;
+    };
+    CPUStat GetCPUStat(int cpu);
+    /// cpuの待機列に、実行中のタスク（アイドルループ）のほかに実行できるタスクがあればtrue
+    bool HasRunnable(int cpu);
+    /// 実行中のCPUコアのアイドルループから呼ぶ。他に実行できるタスクがあれば、すぐにタスクを切り替える
+    void PreemptIdle();
+
+    /// 眠らずにこの回数だけ続けてタイムスライスを使い切ったタスクは、優先度を1つ下げる（眠ると元に戻る）
+    static const unsigned int kHogSlices = 4;
+    /// 優先度を引き下げる下限（0はアイドルタスクの優先度）
+    static const int kMinDynamicLevel = 1;
+    static const int kSchedLatencyBuckets = 16;
+    /// 実行可能になってから実際に実行されるまでの遅れの統計
+    /// hist : 区間0は1usec未満、区間iは[2^(i-1), 2^i) usec、最後の区間は上限なし
+    struct SchedLatencyStat {
+        uint64_t count, total_cycles, max_cycles;
+        uint64_t hist[kSchedLatencyBuckets];
+    };
+    struct SchedStat {
+        /// 入力イベントで起こされたタスクと、それ以外
+        SchedLatencyStat input, other;
+        /// 入力イベントで優先度を上げた回数、使いすぎで下げた回数、起こしたタスクのために実行中のタスクを横取りした回数
+        uint64_t boosts, demotions, preemptions;
+    };
+    SchedStat GetSchedStat();
+    void ResetSchedStat();
+
+    /// タスクIDの下位kTaskSlotBitsビットがスロット番号、残りが世代番号
+    static const int kTaskSlotBits = 16;
+    static const size_t kMaxTaskSlots = size_t{1} << kTaskSlotBits;
 
 private:
-    /// タスク一覧
-    std::vector<std::unique_ptr<Task>> tasks_{};
-    /// 最後に生成されたタスクのID
-    /// 1 : メインタスク（KernelMainStack()）
-    uint64_t latest_id_{0};
-    /// 優先度別のタスクの待機列（ランキュー）
-    /// 先頭を現在実行中のタスクとする
-    /// あるタスクより優先度の低いタスクは、そのタスクがスリープするか同じ優先度まで下がらない限り実行されない
-    std::array<std::deque<Task*>, kMaxLevel + 1> running_{};
-    /// 現在実行中のタスクが属する優先度
-    int current_level_{kMaxLevel};
-    /// 次回のタスク切替え時に現在の実行レベルを変更 : true
-    bool level_changed_{false};
+    struct TaskSlot {
+        std::unique_ptr<Task> task;
+        /// スロットが再利用されるたびに増やす。古いIDでの参照を弾くのに使う
+        uint64_t generation;
+    };
+
+    /// CPUコアごとのスケジューリング状態
+    struct CPUQueues {
+        /// 優先度別のタスクの待機列（ランキュー）
+        /// 先頭を現在実行中のタスクとする
+        /// あるタスクより優先度の低いタスクは、そのタスクがスリープするか同じ優先度まで下がらない限り実行されない
+        std::array<RunQueue, kMaxLevel + 1> running{};
+        /// 空でない待機列の優先度のビットマップ（bit n : running[n]が空でない）
+        uint32_t running_levels{0};
+        /// 現在実行中のタスクが属する優先度
+        int current_level{kMaxLevel};
+        /// 次回のタスク切替え時に現在の実行レベルを変更 : true
+        bool level_changed{false};
+        /// 終了したがまだ解放していないタスク
+        /// Finish()はそのタスク自身のスタック上で動くので、その場では解放できない
+        Task* finished_task{nullptr};
+        /// 他のCPUコアから奪ってきたタスク数、奪われたタスク数
+        size_t steals{0}, stolen{0};
+        /// PreemptIfHigher()でタイムスライスを途中で終わらせた（次の切替えは使いすぎに数えない）
+        bool preempt_requested{false};
+        /// 最後に切り替えて離れたタスク。次にこのCPUコアがスケジューラに入ったときにcontext_saved_を立てる
+        Task* switched_out{nullptr};
+    };
+
+    SpinLock lock_{};
+    /// タスク表。IDのスロット番号で添字付けする
+    /// スロット0は使わない（1 : メインタスク（KernelMainStack()）、2 : アイドルタスク）
+    std::vector<TaskSlot> slots_{};
+    /// 空きスロット番号
+    std::vector<uint32_t> free_slots_{};
+    std::array<CPUQueues, kMaxCPUs> cpus_{};
+    std::array<unsigned long, kMaxLevel + 1> time_slices_{
+        kTaskTimerPeriod, kTaskTimerPeriod, kTaskTimerPeriod, kTaskTimerPeriod};
     /// 終了されたタスク一覧
     /// key: ID of a finished task
     /// value: exit code
@@ -147,13 +494,60 @@ private:
     /// key: ID of a finished task
     /// value: a waiter task
     std::map<uint64_t, Task*> finish_waiter_{};
+    SchedStat sched_stat_{};
 
+    /// 以下はlock_を取った状態で呼ぶ
+    Task* FindTaskLocked(uint64_t id);
+    /// 戻るときにlock_を解放する（タスクを切り替える場合は切り替える直前に解放する）
+    void SleepLocked(Task* task);
+    void WakeupLocked(Task* task, int level);
+    /// taskを起こすか、優先度をlevelに変える（level < 0なら変えない）。指定された優先度は変えない
+    void WakeupAtLevelLocked(Task* task, int level);
+    /// 起こしたタスクがいまこのCPUコアで実行中のタスクより優先度が高ければ、すぐ切り替わるようにタイムスライスを終わらせる
+    void PreemptIfHigher(Task* task);
+    /// 実行中のタスクtaskがタイムスライスを使い切ったので、使いすぎなら優先度を下げる（taskはまだ待機列の先頭にいる）
+    void DemoteIfHog(Task* task);
+    /// 眠ったタスクの一時的な優先度を、指定された優先度に戻す（taskは待機列から外れていること）
+    void RestoreBaseLevel(Task* task);
+    /// 指定優先度の待機列に追加・削除し、running_levelsを更新する
+    void PushRunQueue(Task* task, int level, bool front = false);
+    void RemoveRunQueue(Task* task, int level);
+    /// 実行中のタスクのほかに、待機列に並んでいるタスクがある : true
+    static bool HasOtherRunnable(const CPUQueues& cpu);
+    /// taskが自分のCPUコアのいずれかの待機列に並んでいる : true
+    bool InRunQueue(Task* task);
     void ChangeLevelRunning(Task* task, int level);
     /// ランキューの先頭要素を末尾に移動
-    Task* RotateCurrentRunQueue(bool current_sleep);
+    /// 移動後にアイドルタスクしか残らなければ、他のCPUコアからタスクを奪う
+    Task* RotateCurrentRunQueue(CPUQueues& cpu, bool current_sleep);
+    /// currentからnextに切り替える前に、両方の実行時間とタスク切り替えの統計を更新する
+    /// voluntary : currentが眠るか終了する
+    void AccountSwitch(Task* current, Task* next, bool voluntary);
+    /// 他のCPUコアの待機列から、thiefで実行できるタスクを1つ移してくる（ワークスティーリング）
+    /// 優先度の高い待機列から探し、同じ優先度なら最も長く実行されていないものを選ぶ
+    Task* StealTask(int thief);
+    /// このCPUコアはもうcpu.switched_outのスタックの上にいないので、そのコンテキストは保存し終えている
+    /// 実行中のCPUコアのcpuについて、スケジューラかアイドルループから呼ぶ
+    void MarkContextSaved(CPUQueues& cpu);
+    /// MoveTask()の本体。待機列に並んでいれば、移した先の同じ優先度の待機列に並べ直す
+    bool MoveTaskLocked(Task* task, int cpu);
+    /// cpu.finished_taskを解放し、スロットを再利用できるようにする
+    void ReclaimFinishedTask(CPUQueues& cpu);
 };
 
 extern TaskManager* g_task_manager;
 constexpr uint64_t kMainTaskID = 1;
 
 void InitializeTask();
+
+/// スタックプールの利用状況
+struct TaskStackStat {
+    /// 物理フレームを割り当てたまま再利用を待っているスタック
+    size_t pooled_stacks;
+    /// プールから払い出した回数、新たにフレームをマップした回数
+    size_t hits, misses;
+    /// スタック用の仮想アドレス空間の使用量
+    uint64_t area_bytes;
+};
+
+TaskStackStat GetTaskStackStat();
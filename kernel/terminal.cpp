@@ -1,20 +1,47 @@
 #include "terminal.hpp"
 
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
+#include <optional>
 
 #include "../MikanLoaderPkg/elf.h"
 #include "asmfunc.h"
+#include "block.hpp"
+#include "bootjob.hpp"
+#include "bootprof.hpp"
+#include "deferred.hpp"
 #include "font.hpp"
+#include "idle.hpp"
+#include "interrupt.hpp"
+#include "kbench.hpp"
 #include "keyboard.hpp"
 #include "layer.hpp"
 #include "memory_manager.hpp"
+#include "page_cache.hpp"
 #include "paging.hpp"
 #include "pci.hpp"
+#include "pmu.hpp"
+#include "profiler.hpp"
+#include "shm.hpp"
+#include "smp.hpp"
+#include "surface_pool.hpp"
+#include "spinlock.hpp"
+#include "syscall.hpp"
 #include "timer.hpp"
+#include "trace.hpp"
+#include "usb/memory.hpp"
+#include "usb/xhci/xhci.hpp"
 
 #include "logger.hpp"
 
 namespace {
+    /// 新しく作るパイプで、ページ単位の書き込みをフレームの付け替えで受け渡す -> true
+    bool g_pipe_remap = false;
+
+    /// g_app_loadsを保護する（ファイルへの書き込みは他のタスクからも来る）
+    SpinLock g_app_loads_lock;
+
     /// 空白区切りのコマンドライン引数を配列（argbuf）に詰める
     WithError<int> MakeArgVector(char* command, char* first_arg, char** argv, int argv_len, char* argbuf, int argbuf_len) {
         int argc = 0;
@@ -87,7 +114,7 @@ namespace {
 
     /// LOADセグメントを最終目的地にコピー
     /// return : LOADセグメントが配置されたアドレスの末尾
-    WithError<uint64_t> CopyLoadSegments(Elf64_Ehdr* ehdr) {
+    WithError<uint64_t> CopyLoadSegments(Elf64_Ehdr* ehdr, PageMapAllocCount& alloc) {
         auto phdr = GetProgramHeader(ehdr);
         uint64_t last_addr = 0;
         for (int i = 0; i < ehdr->e_phnum; i++) {
@@ -103,7 +130,7 @@ namespace {
 
             // setup pagemaps as readonly (writable = false)
             // -> for copy on write
-            if (auto err = SetupPageMaps(dest_addr, num_4kpages, false)) {
+            if (auto err = SetupPageMaps(dest_addr, num_4kpages, alloc, false)) {
                 return {last_addr, err};
             }
 
@@ -117,7 +144,7 @@ namespace {
 
     /// elfファイルをアプリとして読み込み、実行可能にする
     /// return : elfファイルが配置されているアドレスの末尾
-    WithError<uint64_t> LoadElf(Elf64_Ehdr* ehdr) {
+    WithError<uint64_t> LoadElf(Elf64_Ehdr* ehdr, PageMapAllocCount& alloc) {
         // elfファイルは実行可能か？
         if (ehdr->e_type != ET_EXEC) {
             return {0, MAKE_ERROR(Error::kInvalidFormat)};
@@ -129,33 +156,35 @@ namespace {
             return {0, MAKE_ERROR(Error::kInvalidFormat)};
         }
 
-        return CopyLoadSegments(ehdr);
+        return CopyLoadSegments(ehdr, alloc);
     }
 
     /// 新規の階層ページング構造を生成して有効化
     WithError<PageMapEntry*> SetupPML4(Task& current_task) {
-        auto pml4 = NewPageMap();
+        // OSカーネル用のメモリマッピングだけは共通なので、それに該当する前半部分はコピー済み
+        auto pml4 = NewAppPML4();
         if (pml4.error) {
             return pml4;
         }
 
-        const auto current_pml4 = reinterpret_cast<PageMapEntry*>(GetCR3());
-        // OSカーネル用のメモリマッピングだけは共通なので、それに該当する前半部分をコピー
-        memcpy(pml4.value, current_pml4, 256 * sizeof(uint64_t));
-
-        const auto cr3 = reinterpret_cast<uint64_t>(pml4.value);
+        // アドレス空間ごとにPCIDを割り当て、タスク切り替えのたびにTLBが破棄されないようにする
+        const auto cr3 = AssignPCID(pml4.value);
         SetCR3(cr3);
-        current_task.Context().cr3 = cr3;
+        current_task.Context().cr3 = NoFlushCR3(cr3);
+        // PCIDの返却時に他のCPUコアのTLBを破棄しないので、アプリのアドレス空間はBSPでだけ使う
+        current_task.SetAffinity(1u << 0);
         return pml4;
     }
 
     /// 階層ページング構造の削除
-    Error FreePML4(Task& current_task) {
+    /// カーネルのページング構造に戻るだけにして、中身の破棄は裏のタスクに任せる
+    void FreePML4(Task& current_task) {
         const auto cr3 = current_task.Context().cr3;
         current_task.Context().cr3 = 0;
         ResetCR3();
 
-        return FreePageMap(reinterpret_cast<PageMapEntry*>(cr3));
+        ReapAppPML4(cr3, current_task.FrameUsage().Total());
+        current_task.FrameUsage() = {};
     }
 
     /// 指定ディレクトリの内容を一覧表示
@@ -183,10 +212,57 @@ namespace {
         }
     }
 
+    /// ELFのヘッダだけを読み、LOADセグメントはページフォルト時に読み込めるようapp_loadに記録する
+    /// return : ファイル上とメモリ上でページ内のオフセットが食い違うセグメントがあり、遅延読み込みできなければfalse
+    WithError<bool> ParseLoadSegments(fat::DirectoryEntry& file_entry, AppLoadInfo& app_load) {
+        auto image = std::allocate_shared<fat::FileDescriptor>(SlabAllocator<fat::FileDescriptor>{}, file_entry);
+
+        Elf64_Ehdr ehdr;
+        if (image->Load(&ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+            memcmp(ehdr.e_ident, "\x7f"
+                                 "ELF",
+                   4) != 0) {
+            return {false, MAKE_ERROR(Error::kInvalidFile)};
+        }
+        if (ehdr.e_type != ET_EXEC) {
+            return {false, MAKE_ERROR(Error::kInvalidFormat)};
+        }
+
+        std::vector<Elf64_Phdr> phdrs(ehdr.e_phnum);
+        const size_t phdrs_bytes = sizeof(Elf64_Phdr) * phdrs.size();
+        if (image->Load(phdrs.data(), phdrs_bytes, ehdr.e_phoff) != phdrs_bytes) {
+            return {false, MAKE_ERROR(Error::kInvalidFile)};
+        }
+
+        std::vector<LoadSegment> segments;
+        uint64_t last_addr = 0;
+        for (const auto& phdr : phdrs) {
+            if (phdr.p_type != PT_LOAD) {
+                continue;
+            }
+            // LOADセグメントの仮想アドレスがカノニカルアドレスの後半領域か？
+            if (phdr.p_vaddr < 0xffff800000000000) {
+                return {false, MAKE_ERROR(Error::kInvalidFormat)};
+            }
+            if ((phdr.p_vaddr - phdr.p_offset) % 4096 != 0) {
+                return {false, MAKE_ERROR(Error::kSuccess)};
+            }
+            segments.push_back({phdr.p_vaddr, phdr.p_memsz, phdr.p_offset, phdr.p_filesz});
+            last_addr = std::max(last_addr, phdr.p_vaddr + phdr.p_memsz);
+        }
+
+        app_load.vaddr_end = last_addr;
+        app_load.entry = ehdr.e_entry;
+        app_load.image = image;
+        app_load.segments = std::move(segments);
+        return {true, MAKE_ERROR(Error::kSuccess)};
+    }
+
     /// コピーオンライト
     /// 起動しようとしたアプリが既に起動されたことがあれば、階層ページング構造だけをコピーする
     /// そうでなければELFファイルのデータをメモリにロード
-    WithError<AppLoadInfo> LoadApp(fat::DirectoryEntry& file_entry, Task& task) {
+    /// 確保したフレーム数はallocに足す
+    WithError<AppLoadInfo> LoadApp(fat::DirectoryEntry& file_entry, Task& task, PageMapAllocCount& alloc) {
         PageMapEntry* temp_pml4;
         if (auto [pml4, err] = SetupPML4(task); err) {
             return {{}, err};
@@ -194,15 +270,49 @@ namespace {
             temp_pml4 = pml4;
         }
 
-        /// 起動されたことがある -> ELFファイルデータが既にメモリに読み込まれている
-        if (auto it = g_app_loads->find(&file_entry); it != g_app_loads->end()) {
-            AppLoadInfo app_load = it->second;
+        // 遅延読み込みするアプリのLOADセグメントを登録する。ELFファイルの記述子はタスク間で共有する
+        auto register_segments = [&task](const AppLoadInfo& app_load) {
+            task.ImageFile() = app_load.image;
+            task.LoadSegments() = app_load.segments;
+        };
+
+        /// 起動されたことがある -> ELFファイルのヘッダは解析済みか、データが既にメモリに読み込まれている
+        std::optional<AppLoadInfo> loaded;
+        {
+            SpinLockGuard lock{g_app_loads_lock};
+            if (auto it = g_app_loads->find(&file_entry); it != g_app_loads->end()) {
+                loaded = it->second;
+            }
+        }
+        if (loaded) {
+            AppLoadInfo app_load = std::move(*loaded);
+            if (app_load.image) {
+                register_segments(app_load);
+                app_load.pml4 = temp_pml4;
+                return {app_load, MAKE_ERROR(Error::kSuccess)};
+            }
             // アプリ領域（[256, 511]）をコピー（物理フレームのコピーはしない）
-            auto err = CopyPageMaps(temp_pml4, app_load.pml4, 4, 256);
+            auto err = CopyPageMaps(temp_pml4, app_load.pml4, 4, 256, alloc);
             app_load.pml4 = temp_pml4;
             return {app_load, err};
         }
 
+        // LOADセグメントは実際にアクセスされたときにページキャッシュから読み込む
+        // ページキャッシュのフレームは読み込み専用で共有されるので、同時に起動した同じアプリ同士でも共有される
+        AppLoadInfo lazy_load{0, 0, nullptr};
+        if (auto [parsed, err] = ParseLoadSegments(file_entry, lazy_load); err) {
+            return {{}, err};
+        } else if (parsed) {
+            register_segments(lazy_load);
+            {
+                SpinLockGuard lock{g_app_loads_lock};
+                g_app_loads->insert(std::make_pair(&file_entry, lazy_load));
+            }
+            lazy_load.pml4 = temp_pml4;
+            return {lazy_load, MAKE_ERROR(Error::kSuccess)};
+        }
+
+        // 遅延読み込みできないELFは、全体をメモリに読み込んでおく
         std::vector<uint8_t> file_buf(file_entry.file_size);
         fat::LoadFile(&file_buf[0], file_buf.size(), file_entry);
 
@@ -215,48 +325,84 @@ namespace {
         }
 
         // 実行可能ファイルをロード
-        auto [last_addr, err_load] = LoadElf(elf_header);
+        auto [last_addr, err_load] = LoadElf(elf_header, alloc);
         if (err_load) {
             return {{}, err_load};
         }
 
         AppLoadInfo app_load{last_addr, elf_header->e_entry, temp_pml4};
-        g_app_loads->insert(std::make_pair(&file_entry, app_load));
+        {
+            SpinLockGuard lock{g_app_loads_lock};
+            g_app_loads->insert(std::make_pair(&file_entry, app_load));
+        }
 
         if (auto [pml4, err] = SetupPML4(task); err) {
             return {app_load, err};
         } else {
             app_load.pml4 = pml4;
         }
-        auto err = CopyPageMaps(app_load.pml4, temp_pml4, 4, 256);
+        auto err = CopyPageMaps(app_load.pml4, temp_pml4, 4, 256, alloc);
         return {app_load, err};
     }
 
-    /// アプリをappsディレクトリから探す（擬似的に /apps にパスを通す）
-    fat::DirectoryEntry* FindCommand(const char* command, unsigned long dir_cluster = 0) {
-        // ルート直下を探索
-        auto file_entry = fat::FindFile(command, dir_cluster);
-        if (file_entry.first != nullptr && (file_entry.first->attr == fat::Attribute::kDirectory || file_entry.second)) {
-            return nullptr;
-        } else if (file_entry.first) {
-            return file_entry.first;
+    /// 画面に出さないウィンドウにsを繰り返し書いて、1秒あたりの文字数を返す
+    unsigned long MeasureTextRendering(Window& window, const char* s, int chars_per_line, int repeat) {
+        const int rows = window.Height() / 16;
+        const auto start = g_timer_manager->CurrentTick();
+        for (int r = 0; r < repeat; r++) {
+            for (int y = 0; y < rows; y++) {
+                WriteString(*window.Writer(), {0, 16 * y}, s, {0xff, 0xff, 0xff});
+            }
         }
+        const auto elapsed = std::max(1ul, g_timer_manager->CurrentTick() - start);
+        const unsigned long chars = static_cast<unsigned long>(chars_per_line) * rows * repeat;
+        return chars * kTimerFreq / elapsed;
+    }
 
-        if (dir_cluster != 0 || strchr(command, '/') != nullptr) {
-            return nullptr;
+    /// 2つの描画範囲を合わせる。大きさが0の範囲は無視する
+    Rectangle<int> MergeDrawArea(const Rectangle<int>& a, const Rectangle<int>& b) {
+        if (a.size.x <= 0 || a.size.y <= 0) {
+            return b;
         }
-
-        // /apps を探索
-        auto apps_entry = fat::FindFile("apps");
-        if (apps_entry.first == nullptr || apps_entry.first->attr != fat::Attribute::kDirectory) {
-            return nullptr;
+        if (b.size.x <= 0 || b.size.y <= 0) {
+            return a;
         }
-        return FindCommand(command, apps_entry.first->FirstCluster());
+        return a | b;
     }
 } // namespace
 
+fat::DirectoryEntry* FindCommand(const char* command, unsigned long dir_cluster) {
+    // ルート直下を探索
+    auto file_entry = fat::FindFile(command, dir_cluster);
+    if (file_entry.first != nullptr && (file_entry.first->attr == fat::Attribute::kDirectory || file_entry.second)) {
+        return nullptr;
+    } else if (file_entry.first) {
+        return file_entry.first;
+    }
+
+    if (dir_cluster != 0 || strchr(command, '/') != nullptr) {
+        return nullptr;
+    }
+
+    // /apps を探索
+    auto apps_entry = fat::FindFile("apps");
+    if (apps_entry.first == nullptr || apps_entry.first->attr != fat::Attribute::kDirectory) {
+        return nullptr;
+    }
+    return FindCommand(command, apps_entry.first->FirstCluster());
+}
+
 std::map<fat::DirectoryEntry*, AppLoadInfo>* g_app_loads;
 
+void InitializeAppLoads() {
+    g_app_loads = new std::map<fat::DirectoryEntry*, AppLoadInfo>;
+    fat::g_file_written_observer = [](fat::DirectoryEntry& entry) {
+        // 全体を読み込んだアプリのページング構造は、実行中のアプリがフレームを共有しているかもしれないので解放しない
+        SpinLockGuard lock{g_app_loads_lock};
+        g_app_loads->erase(&entry);
+    };
+}
+
 Terminal::Terminal(Task& task, const TerminalDescriptor* term_desc) : task_{task} {
     if (term_desc) {
         show_window_ = term_desc->show_window;
@@ -267,7 +413,7 @@ Terminal::Terminal(Task& task, const TerminalDescriptor* term_desc) : task_{task
         show_window_ = true;
         for (int i = 0; i < files_.size(); i++) {
             // 標準入出力をターミナルに接続
-            files_[i] = std::make_shared<TerminalFileDescriptor>(*this);
+            files_[i] = std::allocate_shared<TerminalFileDescriptor>(SlabAllocator<TerminalFileDescriptor>{}, *this);
         }
     }
 
@@ -284,6 +430,7 @@ Terminal::Terminal(Task& task, const TerminalDescriptor* term_desc) : task_{task
                         .SetDraggable(true)
                         .ID();
 
+        lines_.resize(kRows + kDefaultScrollback);
         Print(">"); // プロンプト
     }
     cmd_history_.resize(8);
@@ -297,7 +444,8 @@ Rectangle<int> Terminal::BlinkCursor() {
 }
 
 void Terminal::DrawCursor(bool visible) {
-    if (!show_window_) {
+    // 遡って表示している間はカーソルの位置に最新の画面がないので描かない
+    if (!show_window_ || view_offset_ > 0) {
         return;
     }
 
@@ -310,6 +458,16 @@ Rectangle<int> Terminal::InputKey(uint8_t modifier, uint8_t keycode, char ascii)
 
     Rectangle<int> draw_area{CalcCursorPos(), {8 * 2, 16}};
 
+    if (keycode == 0x4b || keycode == 0x4e) { // page up / page down
+        draw_area = MergeDrawArea(draw_area, ScrollView(keycode == 0x4b ? kRows / 2 : -kRows / 2));
+        DrawCursor(true);
+        return draw_area;
+    }
+    // それ以外のキーでは最新の画面に戻る
+    if (view_offset_ > 0) {
+        draw_area = MergeDrawArea(draw_area, ScrollView(-view_offset_));
+    }
+
     if (ascii == '\n') {              // enter key
         linebuf_[linebuf_index_] = 0; // null文字
         // コマンド履歴を更新
@@ -327,6 +485,7 @@ Rectangle<int> Terminal::InputKey(uint8_t modifier, uint8_t keycode, char ascii)
             Scroll1();
         }
         ExecuteLine();
+        ReportFinishedJobs();
         Print(">"); // プロンプト
         draw_area.pos = TopLevelWindow::kTopLeftMargin;
         draw_area.size = window_->InnerSize();
@@ -335,7 +494,7 @@ Rectangle<int> Terminal::InputKey(uint8_t modifier, uint8_t keycode, char ascii)
             // 1文字消してカーソルを左に戻す
             cursor_.x--;
             if (show_window_) {
-                FillRectangle(*window_->Writer(), CalcCursorPos(), {8, 16}, {0, 0, 0});
+                RowAt(cursor_.y)[cursor_.x] = 0;
             }
             draw_area.pos = CalcCursorPos();
 
@@ -348,7 +507,7 @@ Rectangle<int> Terminal::InputKey(uint8_t modifier, uint8_t keycode, char ascii)
             linebuf_[linebuf_index_] = ascii;
             linebuf_index_++;
             if (show_window_) {
-                WriteAscii(*window_->Writer(), CalcCursorPos(), ascii, {255, 255, 255});
+                RowAt(cursor_.y)[cursor_.x] = ascii;
             }
             cursor_.x++;
         }
@@ -358,7 +517,12 @@ Rectangle<int> Terminal::InputKey(uint8_t modifier, uint8_t keycode, char ascii)
         draw_area = HistoryUpDown(1);
     }
 
-    DrawCursor(true);
+    if (show_window_) {
+        // 実行したコマンドの出力もここでまとめて描く
+        draw_area = MergeDrawArea(draw_area, RenderOutput());
+    } else {
+        DrawCursor(true);
+    }
     return draw_area;
 }
 
@@ -366,16 +530,113 @@ Vector2D<int> Terminal::CalcCursorPos() const {
     return TopLevelWindow::kTopLeftMargin + Vector2D<int>{4 + 8 * cursor_.x, 4 + 16 * cursor_.y};
 }
 
+Terminal::Line& Terminal::RowAt(int row) {
+    return lines_[(top_ + row) % lines_.size()];
+}
+
+const Terminal::Line& Terminal::ViewRowAt(int row) const {
+    return lines_[(top_ + lines_.size() - view_offset_ + row) % lines_.size()];
+}
+
 void Terminal::Scroll1() {
-    Rectangle<int> move_src{
-        TopLevelWindow::kTopLeftMargin + Vector2D<int>{4, 4 + 16},
-        {8 * kColumns, 16 * (kRows - 1)}};
-    window_->Move(TopLevelWindow::kTopLeftMargin + Vector2D<int>{4, 4}, move_src);
-    // 最終行を塗りつぶす
-    FillRectangle(*window_->InnerWriter(), {4, 4 + 16 * cursor_.y}, {8 * kColumns, 16}, {0, 0, 0});
+    if (lines_.empty()) {
+        return;
+    }
+    // 最上行はスクロールバックとして残り、最も古い行が新しい最終行になる
+    top_ = (top_ + 1) % lines_.size();
+    RowAt(kRows - 1).fill(0);
+    history_lines_ = std::min(history_lines_ + 1, Scrollback());
+}
+
+Rectangle<int> Terminal::FlushCells() {
+    Vector2D<int> dirty_begin{kColumns, kRows}, dirty_end{0, 0};
+    for (int row = 0; row < kRows; row++) {
+        const Line& line = ViewRowAt(row);
+        Line& shown = displayed_[row];
+        for (int col = 0; col < kColumns; col++) {
+            if (line[col] == shown[col]) {
+                continue;
+            }
+            const bool wide = line[col] != kWideTail && col + 1 < kColumns && line[col + 1] == kWideTail;
+            if (!wide && line[col] <= 0x7f) {
+                // 書き換わったASCII文字（と空白）が続く間は、背景を1回で塗ってフォントのビットマップを直接描く
+                int end = col + 1;
+                while (end < kColumns && line[end] != shown[end] && line[end] <= 0x7f &&
+                       !(end + 1 < kColumns && line[end + 1] == kWideTail)) {
+                    end++;
+                }
+                const auto pos = TopLevelWindow::kTopLeftMargin + Vector2D<int>{4 + 8 * col, 4 + 16 * row};
+                FillRectangle(*window_->Writer(), pos, {8 * (end - col), 16}, {0, 0, 0});
+                for (int i = col; i < end; i++) {
+                    if (line[i] != 0) {
+                        WriteAscii(*window_->Writer(), pos + Vector2D<int>{8 * (i - col), 0}, line[i], {255, 255, 255});
+                    }
+                    shown[i] = line[i];
+                }
+                dirty_begin = ElementMin(dirty_begin, {col, row});
+                dirty_end = ElementMax(dirty_end, {end, row + 1});
+                col = end - 1;
+                continue;
+            }
+            const int width = wide ? 2 : 1;
+            const auto pos = TopLevelWindow::kTopLeftMargin + Vector2D<int>{4 + 8 * col, 4 + 16 * row};
+            FillRectangle(*window_->Writer(), pos, {8 * width, 16}, {0, 0, 0});
+            if (line[col] != 0 && line[col] != kWideTail) {
+                WriteUnicode(*window_->Writer(), pos, line[col], {255, 255, 255});
+            }
+            for (int i = 0; i < width; i++) {
+                shown[col + i] = line[col + i];
+            }
+            dirty_begin = ElementMin(dirty_begin, {col, row});
+            dirty_end = ElementMax(dirty_end, {col + width, row + 1});
+            col += width - 1;
+        }
+    }
+
+    if (dirty_begin.x >= dirty_end.x) {
+        return {{0, 0}, {0, 0}};
+    }
+    return {TopLevelWindow::kTopLeftMargin + Vector2D<int>{4 + 8 * dirty_begin.x, 4 + 16 * dirty_begin.y},
+            {8 * (dirty_end.x - dirty_begin.x), 16 * (dirty_end.y - dirty_begin.y)}};
+}
+
+Rectangle<int> Terminal::ScrollView(int delta) {
+    view_offset_ = std::clamp(view_offset_ + delta, 0, history_lines_);
+    return FlushCells();
+}
+
+void Terminal::SetScrollback(int lines) {
+    if (lines_.empty()) {
+        return;
+    }
+    std::vector<Line> new_lines(kRows + std::max(lines, 0));
+    for (int row = 0; row < kRows; row++) {
+        new_lines[row] = RowAt(row);
+    }
+    lines_ = std::move(new_lines);
+    top_ = 0;
+    history_lines_ = 0;
+    view_offset_ = 0;
 }
 
 void Terminal::ExecuteLine() {
+    // ファイルシステムは起動時に裏で初期化しているので、コマンドを探す前に終わるのを待つ
+    WaitBootJob(BootJob::kVolume);
+
+    // バックグラウンドジョブ : 末尾の&を取り除き、残り（リダイレクトやパイプを含む）を別のタスクで実行して待たない
+    size_t line_len = strlen(&linebuf_[0]);
+    while (line_len > 0 && isspace(linebuf_[line_len - 1])) {
+        line_len--;
+    }
+    if (line_len > 0 && linebuf_[line_len - 1] == '&') {
+        linebuf_[line_len - 1] = 0;
+        const auto task_id = StartHiddenTerminal(&linebuf_[0]);
+        jobs_.push_back({next_job_number_++, task_id, &linebuf_[0]});
+        PrintToFD(*files_[1], "[%d] %lu\n", jobs_.back().number, task_id);
+        last_exit_code_ = 0;
+        return;
+    }
+
     char* command = &linebuf_[0];
     char* first_arg = strchr(&linebuf_[0], ' ');
     char* redir_char = strchr(&linebuf_[0], '>');
@@ -412,31 +673,51 @@ void Terminal::ExecuteLine() {
             return;
         }
         // 標準出力先を指定ファイルに変更
-        files_[1] = std::make_shared<fat::FileDescriptor>(*file);
+        files_[1] = std::allocate_shared<fat::FileDescriptor>(SlabAllocator<fat::FileDescriptor>{}, *file);
     }
 
     std::shared_ptr<PipeDescriptor> pipe_fd;
-    uint64_t subtask_id = 0;
+    std::vector<uint64_t> subtask_ids;
 
     // パイプ処理
+    // |で区切った2段目以降は、それぞれ新しい非表示ターミナルのタスクで同時に実行する（1段目はこのタスクで実行する）
     if (pipe_char) {
-        *pipe_char = 0;
-        char* subcommand = &pipe_char[1]; // パイプ右側のコマンド（受信側）
-        while (isspace(*subcommand)) {
-            subcommand++;
+        std::vector<char*> subcommands; // 2段目以降のコマンド（受信側）
+        for (char* p = pipe_char; p; p = strchr(p, '|')) {
+            *p++ = 0;
+            while (isspace(*p)) {
+                p++;
+            }
+            subcommands.push_back(p);
         }
 
-        auto& subtask = g_task_manager->NewTask();
-        pipe_fd = std::make_shared<PipeDescriptor>(subtask);
-        // 送信先タスクの標準入出力を付け替える
-        auto term_desc = new TerminalDescriptor{subcommand, true, false, {pipe_fd, files_[1], files_[2]}};
-        // 現在のターミナル（送信元）の標準出力をパイプに接続
+        // パイプは受信側のタスクを起こすので、先にすべての段のタスクを作っておく
+        // pipes[i]はi段目（0段目はこのタスク）からi + 1段目へのパイプ
+        std::vector<Task*> subtasks;
+        std::vector<std::shared_ptr<PipeDescriptor>> pipes;
+        for (size_t i = 0; i < subcommands.size(); i++) {
+            subtasks.push_back(&g_task_manager->NewTask());
+            pipes.push_back(std::allocate_shared<PipeDescriptor>(SlabAllocator<PipeDescriptor>{}, *subtasks[i], g_pipe_remap));
+        }
+        for (size_t i = 0; i < subtasks.size(); i++) {
+            // 最後の段の標準出力は、このターミナルの標準出力（リダイレクト先）
+            const bool last = i + 1 == subtasks.size();
+            auto stdout_pipe = last ? nullptr : pipes[i + 1];
+            auto term_desc = new TerminalDescriptor{
+                subcommands[i], true, false,
+                {pipes[i], last ? files_[1] : stdout_pipe, files_[2]},
+                pipes[i], stdout_pipe};
+            subtask_ids.push_back(subtasks[i]->InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc))
+                                      .Wakeup()
+                                      .ID());
+        }
+        // 現在のターミナル（1段目）の標準出力をパイプに接続
+        pipe_fd = pipes[0];
         files_[1] = pipe_fd;
-        subtask_id = subtask.InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc))
-                         .Wakeup()
-                         .ID();
-        // パイプ処理の間は、各種イベントを送信先タスクに通知
-        (*g_layer_task_map)[layer_id_] = subtask_id;
+        // パイプ処理の間は、各種イベントを最後の段に通知（more のように入力を受け付けるのはたいてい最後の段）
+        MutexGuard lock{g_layer_mutex};
+        (*g_layer_task_map)[layer_id_] = subtask_ids.back();
+        g_active_layer->UpdateFocus();
     }
 
     if (strcmp(command, "echo") == 0) {
@@ -450,16 +731,22 @@ void Terminal::ExecuteLine() {
         PrintToFD(*files_[1], "\n");
     } else if (strcmp(command, "clear") == 0) {
         if (show_window_) {
-            FillRectangle(*window_->InnerWriter(), {4, 4}, {8 * kColumns, 16 * kRows}, {0, 0, 0});
+            for (int row = 0; row < kRows; row++) {
+                RowAt(row).fill(0);
+            }
         }
         cursor_.y = 0;
+    } else if (strcmp(command, "scrollback") == 0) { // 遡って見られる行数を表示、または変更する
+        if (first_arg && first_arg[0]) {
+            SetScrollback(atoi(first_arg));
+        }
+        PrintToFD(*files_[1], "scrollback: %d lines\n", Scrollback());
     } else if (strcmp(command, "lspci") == 0) {
         for (int i = 0; i < pci::g_num_device; i++) {
             const auto& device = pci::g_devices[i];
-            auto vendor_id = pci::ReadVendorId(device.bus, device.device, device.function);
             PrintToFD(*files_[1],
                       "%02x:%02x.%d vend=%04x head=%02x class=%02x.%02x.%02x\n",
-                      device.bus, device.device, device.function, vendor_id, device.header_type,
+                      device.bus, device.device, device.function, device.vendor_id, device.header_type,
                       device.class_code.base, device.class_code.sub, device.class_code.interface);
         }
     } else if (strcmp(command, "ls") == 0) {
@@ -499,7 +786,7 @@ void Terminal::ExecuteLine() {
                 PrintToFD(*files_[2], "%s is not a directory\n", name);
                 exit_code = 1;
             } else {
-                fd = std::make_shared<fat::FileDescriptor>(*file_entry);
+                fd = std::allocate_shared<fat::FileDescriptor>(SlabAllocator<fat::FileDescriptor>{}, *file_entry);
             }
         }
         if (fd) { // ファイルが見つかった
@@ -515,12 +802,114 @@ void Terminal::ExecuteLine() {
 
             DrawCursor(true);
         }
+    } else if (strcmp(command, "copy") == 0) { // ex. copy <src> <dest>（アプリを起動せずにカーネルの中でコピーする）
+        char* dest_path = first_arg ? strchr(first_arg, ' ') : nullptr;
+        if (dest_path) {
+            *dest_path++ = '\0';
+        }
+        if (!first_arg || first_arg[0] == '\0' || !dest_path || dest_path[0] == '\0') {
+            PrintToFD(*files_[2], "Usage: copy <src> <dest>\n");
+            exit_code = 1;
+        } else if (auto [src, src_post_slash] = fat::FindFile(first_arg); src == nullptr || src_post_slash) {
+            PrintToFD(*files_[2], "no such file: %s\n", first_arg);
+            exit_code = 1;
+        } else {
+            auto [dest, dest_post_slash] = fat::FindFile(dest_path);
+            Error err = MAKE_ERROR(Error::kSuccess);
+            if (dest == nullptr) {
+                auto [new_file, create_err] = fat::CreateFile(dest_path);
+                dest = new_file;
+                err = create_err;
+            }
+            if (!err) {
+                err = fat::CopyFile(*dest, *src).error;
+            }
+            if (err) {
+                PrintToFD(*files_[2], "failed to copy to %s: %s\n", dest_path, err.Name());
+                exit_code = 1;
+            }
+        }
     } else if (strcmp(command, "noterm") == 0) { // ex. noterm <command line>
         auto term_desc = new TerminalDescriptor{first_arg, true, false, files_};
         // 指定したコマンドラインを、画面非表示の新規ターミナル上で実行させる
         g_task_manager->NewTask()
             .InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc))
             .Wakeup();
+    } else if (strcmp(command, "jobs") == 0) { // バックグラウンドジョブの一覧（終わったものは報告して外す）
+        ReportFinishedJobs();
+        for (const auto& job : jobs_) {
+            PrintToFD(*files_[1], "[%d] %lu Running  %s\n", job.number, job.task_id, job.command_line.c_str());
+        }
+    } else if (strcmp(command, "wait") == 0) { // ex. wait [<job number>]（すべて、または指定したバックグラウンドジョブの終了を待つ）
+        const int number = first_arg && first_arg[0] ? atoi(first_arg[0] == '%' ? &first_arg[1] : first_arg) : 0;
+        auto it = std::find_if(jobs_.begin(), jobs_.end(),
+                               [number](const Job& job) { return job.number == number; });
+        if (number != 0 && it == jobs_.end()) {
+            PrintToFD(*files_[2], "wait: no such job: %s\n", first_arg);
+            exit_code = 1;
+        } else if (number != 0) {
+            exit_code = g_task_manager->WaitFinish(it->task_id).value;
+            jobs_.erase(it);
+        } else {
+            // 終了コードは最後のジョブのもの
+            for (const auto& job : jobs_) {
+                exit_code = g_task_manager->WaitFinish(job.task_id).value;
+            }
+            jobs_.clear();
+        }
+    } else if (strcmp(command, "parallel") == 0) { // ex. parallel [-j <n>] <command> ::: <arg>...（引数ごとにコマンドを別のタスクで同時に実行）
+        exit_code = RunParallel(first_arg);
+    } else if (strcmp(command, "perf") == 0) { // ex. perf <command line>（性能監視カウンタの合計を表示）
+        if (!first_arg || first_arg[0] == '\0') {
+            PrintToFD(*files_[2], "Usage: perf <command line>\n");
+            exit_code = 1;
+        } else if (!PMUAvailable()) {
+            PrintToFD(*files_[2], "perf: performance counters are not available\n");
+            exit_code = 1;
+        } else {
+            std::array<char, 64> name;
+            strncpy(name.data(), first_arg, name.size() - 1);
+            name.back() = '\0';
+
+            // リダイレクトとパイプは処理済みなので、残りのコマンドラインをこのタスクでそのまま実行させる
+            // パイプの右側（別のタスク）は数えない
+            memmove(&linebuf_[0], first_arg, strlen(first_arg) + 1);
+            PerfCounters counters{};
+            uint64_t idle_start = 0;
+            for (int cpu = 0; cpu < NumCPUs(); cpu++) {
+                idle_start += GetIdleStat(cpu).idle_cycles;
+            }
+            const uint64_t start = ReadTSC();
+            StartTaskPerf(&counters);
+            ExecuteLine();
+            StopTaskPerf();
+            const uint64_t elapsed = ReadTSC() - start;
+            uint64_t idle = 0;
+            for (int cpu = 0; cpu < NumCPUs(); cpu++) {
+                idle += GetIdleStat(cpu).idle_cycles;
+            }
+            idle -= idle_start;
+            exit_code = last_exit_code_;
+
+            PrintToFD(*files_[2], "\n Performance counter stats for '%s':\n\n", name.data());
+            for (int i = 0; i < kNumPerfEvents; i++) {
+                const auto event = static_cast<PerfEvent>(i);
+                if (PerfEventSupported(event)) {
+                    PrintToFD(*files_[2], "%16lu  %s\n", counters.values[i], PerfEventName(event));
+                } else {
+                    PrintToFD(*files_[2], "%16s  %s\n", "<not supported>", PerfEventName(event));
+                }
+            }
+            if (const uint64_t cycles = counters.values[kPerfCycles]) {
+                const uint64_t ipc100 = counters.values[kPerfInstructions] * 100 / cycles;
+                PrintToFD(*files_[2], "%13lu.%02lu  insn per cycle\n", ipc100 / 100, ipc100 % 100);
+            }
+            const uint64_t tsc_per_us = std::max<uint64_t>(TSCFrequency() / 1000000, 1);
+            PrintToFD(*files_[2], "%16lu  us elapsed\n", elapsed / tsc_per_us);
+            // 全CPUコアを合わせた、実行中に休んでいた時間の割合
+            const uint64_t idle_permille = elapsed ? idle * 1000 / (elapsed * NumCPUs()) : 0;
+            PrintToFD(*files_[2], "%13lu.%lu%%  cpus idle\n", idle_permille / 10, idle_permille % 10);
+        }
     } else if (strcmp(command, "memstat") == 0) { // メモリ使用量を表示
         const auto p_stat = g_memory_manager->Stat();
 
@@ -530,6 +919,478 @@ void Terminal::ExecuteLine() {
         PrintToFD(*files_[1], "Phys total : %lu frames (%llu MiB)\n",
                   p_stat.total_frames,
                   p_stat.total_frames * kBytesPerFrame / 1024 / 1024);
+        const auto dma32_stat = g_memory_manager->ZoneStat(MemoryZone::kDMA32);
+        const auto normal_stat = g_memory_manager->ZoneStat(MemoryZone::kNormal);
+        PrintToFD(*files_[1], "Zones : DMA32 %llu / %llu MiB, Normal %llu / %llu MiB\n",
+                  dma32_stat.allocated_frames * kBytesPerFrame / 1024 / 1024,
+                  dma32_stat.total_frames * kBytesPerFrame / 1024 / 1024,
+                  normal_stat.allocated_frames * kBytesPerFrame / 1024 / 1024,
+                  normal_stat.total_frames * kBytesPerFrame / 1024 / 1024);
+
+        const auto t_stat = GetPageTableCacheStat();
+        PrintToFD(*files_[1], "Table cache : PT %lu, PD %lu, PDP %lu, PML4 %lu, hits %lu, misses %lu\n",
+                  t_stat.cached_tables[1], t_stat.cached_tables[2], t_stat.cached_tables[3],
+                  t_stat.cached_tables[4], t_stat.hits, t_stat.misses);
+        const auto r_stat = GetPageMapReaperStat();
+        PrintToFD(*files_[1], "Reclaiming  : %lu spaces, ~%lu frames pending, %lu spaces / %lu pages reaped\n",
+                  r_stat.pending_spaces, r_stat.pending_frames, r_stat.reaped_spaces, r_stat.reaped_entries);
+        const auto c_stat = GetPageCacheStat();
+        PrintToFD(*files_[1], "Page cache  : %lu pages (%lu mapped), hits %lu, misses %lu, evictions %lu\n",
+                  c_stat.cached_pages, c_stat.mapped_pages, c_stat.hits, c_stat.misses, c_stat.evictions);
+        const auto z_stat = GetZeroedFramePoolStat();
+        PrintToFD(*files_[1], "Zeroed pool : %lu frames, hits %lu, misses %lu\n",
+                  z_stat.pooled_frames, z_stat.hits, z_stat.misses);
+        const auto s_stat = GetTaskStackStat();
+        PrintToFD(*files_[1], "Task stacks : %lu pooled, hits %lu, misses %lu, area %lu KiB\n",
+                  s_stat.pooled_stacks, s_stat.hits, s_stat.misses, s_stat.area_bytes / 1024);
+        const auto w_stat = GetSurfacePoolStat();
+        PrintToFD(*files_[1], "Surfaces    : %lu pooled (%lu KiB), hits %lu, misses %lu, drops %lu, trims %lu (%lu KiB)\n",
+                  w_stat.pooled_buffers, w_stat.pooled_bytes / 1024, w_stat.hits, w_stat.misses,
+                  w_stat.drops, w_stat.trims, w_stat.trimmed_bytes / 1024);
+        const auto u_stat = usb::GetMemoryStat();
+        PrintToFD(*files_[1], "USB pool    : %lu / %lu KiB, %lu free pages, allocs %lu, frees %lu, failures %lu\n",
+                  u_stat.used_bytes / 1024, u_stat.pool_bytes / 1024, u_stat.free_pages,
+                  u_stat.allocs, u_stat.frees, u_stat.failures);
+
+        // 断片化状況
+        const auto f_stat = g_memory_manager->Fragmentation();
+        const size_t frag_index = f_stat.free_frames == 0
+                                      ? 0
+                                      : (f_stat.free_frames - f_stat.largest_free_frames) * 100 / f_stat.free_frames;
+        PrintToFD(*files_[1], "Largest free : %lu frames, fragmentation %lu%%\n",
+                  f_stat.largest_free_frames, frag_index);
+        PrintToFD(*files_[1], "Free blocks (order:count) :");
+        for (int order = 0; order < kFragmentationOrders; order++) {
+            if (f_stat.free_blocks[order] > 0) {
+                PrintToFD(*files_[1], " %d:%lu", order, f_stat.free_blocks[order]);
+            }
+        }
+        PrintToFD(*files_[1], "\n");
+    } else if (strcmp(command, "taskmem") == 0) { // タスクごとの物理フレーム使用量を表示
+        PrintToFD(*files_[1], "%4s %6s %6s %6s %6s %6s %7s %7s %7s %6s\n",
+                  "id", "image", "demand", "file", "cow", "table", "total", "limit", "avoided", "zero");
+        struct Entry {
+            uint64_t id;
+            TaskFrameUsage usage;
+            size_t limit;
+            PageFaultStat faults;
+        };
+        std::vector<Entry> entries;
+        g_task_manager->ForEachTask([&entries](Task& t) {
+            entries.push_back({t.ID(), t.FrameUsage(), t.FrameLimit(), t.FaultStat()});
+        });
+
+        for (const auto& [id, usage, limit, faults] : entries) {
+            PrintToFD(*files_[1], "%4lu %6lu %6lu %6lu %6lu %6lu %7lu %7lu %7lu %6lu\n",
+                      id, usage.image_pages, usage.demand_pages, usage.file_pages,
+                      usage.cow_pages, usage.page_tables, usage.Total(), limit,
+                      faults.faults_avoided, faults.zero_page_maps);
+        }
+    } else if (strcmp(command, "memlimit") == 0) { // このターミナルで起動するアプリの物理フレーム数の上限を設定
+        if (first_arg) {
+            task_.SetFrameLimit(strtoul(first_arg, nullptr, 0));
+        }
+        PrintToFD(*files_[1], "frame limit : %lu frames%s\n",
+                  task_.FrameLimit(), task_.FrameLimit() == 0 ? " (unlimited)" : "");
+    } else if (strcmp(command, "cpustat") == 0) { // CPUコアごとの待機タスク数とタスクの移動回数を表示
+        PrintToFD(*files_[1], "%4s %7s %8s %8s %8s %10s %8s %8s\n", "cpu", "apic id", "runnable", "steals", "stolen",
+                  "idle ms", "idles", "doorbell");
+        const uint64_t tsc_per_ms = std::max<uint64_t>(TSCFrequency() / 1000, 1);
+        for (int cpu = 0; cpu < NumCPUs(); cpu++) {
+            const auto stat = g_task_manager->GetCPUStat(cpu);
+            const auto idle = GetIdleStat(cpu);
+            PrintToFD(*files_[1], "%4d %7u %8lu %8lu %8lu %10lu %8lu %8lu\n",
+                      cpu, GetCPUInfo(cpu).lapic_id, stat.runnable, stat.steals, stat.stolen,
+                      idle.idle_cycles / tsc_per_ms, idle.entries, idle.doorbell_wakeups);
+        }
+        PrintToFD(*files_[1], "idle wait : %s\n", MWaitAvailable() ? "mwait" : "hlt");
+    } else if (strcmp(command, "affinity") == 0) { // ex. affinity <task id> [<mask>]（タスクを実行してよいCPUコアを表示・変更）
+        // 広げてよいのはヒープやレイヤを触らない計算だけのタスク（他のCPUコアで同時に触ると壊れる）
+        char* mask_arg = nullptr;
+        const uint64_t task_id = first_arg ? strtoul(first_arg, &mask_arg, 0) : 0;
+        while (mask_arg && isspace(*mask_arg)) {
+            mask_arg++;
+        }
+        if (mask_arg == first_arg) {
+            PrintToFD(*files_[2], "usage: affinity <task id> [<mask>]\n");
+            exit_code = 1;
+        } else if (*mask_arg) {
+            if (auto err = g_task_manager->SetAffinity(task_id, strtoul(mask_arg, nullptr, 0))) {
+                PrintToFD(*files_[2], "affinity: %s\n", err.Name());
+                exit_code = 1;
+            }
+        }
+        if (exit_code == 0) {
+            if (Task* task = g_task_manager->FindTask(task_id)) {
+                PrintToFD(*files_[1], "task %lu : cpu %d, affinity 0x%x\n", task_id, task->CPU(), task->Affinity());
+            } else {
+                PrintToFD(*files_[2], "affinity: no such task %lu\n", task_id);
+                exit_code = 1;
+            }
+        }
+    } else if (strcmp(command, "schedstat") == 0) { // 起こされたタスクが実行されるまでの遅れと、優先度の調整の回数を表示（schedstat [reset]）
+        if (first_arg && strcmp(first_arg, "reset") == 0) {
+            g_task_manager->ResetSchedStat();
+        } else {
+            const auto stat = g_task_manager->GetSchedStat();
+            const uint64_t tsc_per_us = std::max<uint64_t>(TSCFrequency() / 1000000, 1);
+            PrintToFD(*files_[1], "boosts %lu, demotions %lu, preemptions %lu\n",
+                      stat.boosts, stat.demotions, stat.preemptions);
+            PrintToFD(*files_[1], "%-6s %8s %10s %10s  histogram (usec: count)\n", "wakeup", "count", "avg usec", "max usec");
+            for (const auto& [name, lat] : {std::pair{"input", &stat.input}, std::pair{"other", &stat.other}}) {
+                PrintToFD(*files_[1], "%-6s %8lu %10lu %10lu ", name, lat->count,
+                          lat->count ? lat->total_cycles / lat->count / tsc_per_us : 0, lat->max_cycles / tsc_per_us);
+                for (int i = 0; i < TaskManager::kSchedLatencyBuckets; ++i) {
+                    if (lat->hist[i] == 0) {
+                        continue;
+                    }
+                    if (i + 1 < TaskManager::kSchedLatencyBuckets) {
+                        PrintToFD(*files_[1], " <%lu:%lu", 1ul << i, lat->hist[i]);
+                    } else { // 最後の区間は上限なし
+                        PrintToFD(*files_[1], " >=%lu:%lu", 1ul << (i - 1), lat->hist[i]);
+                    }
+                }
+                PrintToFD(*files_[1], "\n");
+            }
+        }
+    } else if (strcmp(command, "timeslice") == 0) { // 優先度ごとのタイムスライスを表示・変更（timeslice <level> <usec>）
+        if (first_arg) {
+            char* usec_arg = nullptr;
+            const long level = strtol(first_arg, &usec_arg, 0);
+            while (isspace(*usec_arg)) {
+                usec_arg++;
+            }
+            if (level < 0 || level > TaskManager::kMaxLevel || usec_arg == first_arg || *usec_arg == 0) {
+                PrintToFD(*files_[2], "usage: timeslice [<level> <usec>]\n");
+                exit_code = 1;
+            } else {
+                const unsigned long usec = strtoul(usec_arg, nullptr, 0);
+                g_task_manager->SetTimeSlice(level, usec * kTimerFreq / 1000000);
+            }
+        }
+        PrintToFD(*files_[1], "%5s %10s\n", "level", "usec");
+        for (int level = 0; level <= TaskManager::kMaxLevel; level++) {
+            PrintToFD(*files_[1], "%5d %10lu\n",
+                      level, g_task_manager->TimeSlice(level) * 1000000 / kTimerFreq);
+        }
+    } else if (strcmp(command, "faultstat") == 0) { // ページフォルトの統計を、システム全体とタスクごとに表示
+        PrintToFD(*files_[1], "%4s %7s %7s %7s %7s %5s %8s %12s\n",
+                  "id", "demand", "file", "image", "cow", "fatal", "avoided", "cycles");
+        auto print_stat = [this](const char* id, const PageFaultStat& s) {
+            PrintToFD(*files_[1], "%4s %7lu %7lu %7lu %7lu %5lu %8lu %12lu\n",
+                      id, s.demand_faults, s.file_faults, s.image_faults, s.cow_faults,
+                      s.fatal_faults, s.faults_avoided, s.cycles);
+        };
+        print_stat("all", GetPageFaultStat());
+
+        std::vector<std::pair<uint64_t, PageFaultStat>> entries;
+        g_task_manager->ForEachTask([&entries](Task& t) {
+            entries.push_back({t.ID(), t.FaultStat()});
+        });
+        for (const auto& [id, s] : entries) {
+            char id_str[24];
+            sprintf(id_str, "%lu", id);
+            print_stat(id_str, s);
+        }
+    } else if (strcmp(command, "faultaround") == 0) { // デマンドページングのフォルト1回で割り当てるページ数を設定
+        if (first_arg) {
+            SetFaultAroundPages(strtoul(first_arg, nullptr, 0));
+        }
+        PrintToFD(*files_[1], "fault-around : %lu pages (max %lu)\n",
+                  FaultAroundPages(), kMaxFaultAroundPages);
+    } else if (strcmp(command, "usbimod") == 0) { // xHCの割り込みの最小間隔（ナノ秒）を表示・変更
+        if (first_arg) {
+            usb::xhci::g_controller->SetInterruptModeration(strtoul(first_arg, nullptr, 0));
+        }
+        PrintToFD(*files_[1], "xHC interrupt moderation : %u ns\n",
+                  usb::xhci::g_controller->InterruptModeration());
+    } else if (strcmp(command, "pipemode") == 0) { // パイプの受け渡し方法を設定（copy : 常にコピー、remap : ページ単位の書き込みはフレームを付け替える）
+        if (first_arg) {
+            if (strcmp(first_arg, "copy") == 0) {
+                g_pipe_remap = false;
+            } else if (strcmp(first_arg, "remap") == 0) {
+                g_pipe_remap = true;
+            } else {
+                PrintToFD(*files_[2], "usage: pipemode [copy|remap]\n");
+                exit_code = 1;
+            }
+        }
+        PrintToFD(*files_[1], "pipe mode : %s\n", g_pipe_remap ? "remap" : "copy");
+    } else if (strcmp(command, "slabinfo") == 0) { // スラブキャッシュの利用状況を表示
+        std::array<SlabStat, kMaxSlabCaches> stats;
+        const size_t num_stats = GetSlabStats(stats.data(), stats.size());
+
+        PrintToFD(*files_[1], "%-10s %6s %6s %6s %8s %6s\n",
+                  "name", "size", "slabs", "inuse", "hits", "misses");
+        for (size_t i = 0; i < num_stats; i++) {
+            const auto& stat = stats[i];
+            PrintToFD(*files_[1], "%-10s %6lu %6lu %6lu %8lu %6lu\n",
+                      stat.name, stat.object_size, stat.slabs,
+                      stat.in_use, stat.hits, stat.misses);
+        }
+    } else if (strcmp(command, "lsblk") == 0) { // 登録されたブロックデバイスの一覧
+        PrintToFD(*files_[1], "%3s %-20s %12s %6s\n", "id", "name", "blocks", "bsize");
+        for (size_t i = 0; i < NumBlockDevices(); i++) {
+            const char* name = "";
+            if (auto dev = BlockDeviceAt(i, &name)) {
+                PrintToFD(*files_[1], "%3lu %-20s %12lu %6lu\n",
+                          i, name, dev->NumBlocks(), dev->BlockSize());
+            }
+        }
+    } else if (strcmp(command, "irqstat") == 0) { // 割り込みの回数とハンドラの処理時間を表示（resetで統計を消す）
+        if (first_arg && strcmp(first_arg, "reset") == 0) {
+            ResetIRQStat();
+        } else {
+            const uint64_t tsc_per_us = std::max<uint64_t>(TSCFrequency() / 1000000, 1);
+            PrintToFD(*files_[1], "%-4s %-10s %10s %8s %8s %8s\n",
+                      "vec", "name", "count", "avg(ns)", "p99(ns)", "max(us)");
+            for (int vector = 0; vector < 256; vector++) {
+                const char* name = IRQName(vector);
+                const auto stat = GetIRQStat(vector);
+                if (name == nullptr || stat.count == 0) {
+                    continue;
+                }
+                // 戻ってきた（処理時間を測れた）回数と、その99%が収まる区間の上限（区間bの上限は 2^(b+7) サイクル）
+                uint64_t completed = 0;
+                for (auto n : stat.hist) {
+                    completed += n;
+                }
+                uint64_t count = 0;
+                int bucket = 0;
+                while (bucket < kIRQHistBuckets - 1) {
+                    count += stat.hist[bucket];
+                    if (count * 100 >= completed * 99) {
+                        break;
+                    }
+                    bucket++;
+                }
+                PrintToFD(*files_[1], "0x%02x %-10s %10lu %8lu %8lu %8lu\n",
+                          vector, name, stat.count,
+                          completed ? stat.cycles * 1000 / completed / tsc_per_us : 0,
+                          completed ? (1ul << (bucket + 7)) * 1000 / tsc_per_us : 0,
+                          stat.max_cycles / tsc_per_us);
+            }
+        }
+    } else if (strcmp(command, "workstat") == 0) { // 割り込みハンドラから後回しにした処理の回数と所要時間を表示
+        const uint64_t tsc_per_us = std::max<uint64_t>(TSCFrequency() / 1000000, 1);
+        const char* priority_names[kNumWorkPriorities] = {"high", "normal", "low"};
+        PrintToFD(*files_[1], "%-8s %8s %8s %6s %10s\n",
+                  "queue", "batches", "runs", "max", "total(us)");
+        for (int i = 0; i < kNumWorkPriorities; i++) {
+            const auto stat = GetDeferredQueueStat(static_cast<WorkPriority>(i));
+            PrintToFD(*files_[1], "%-8s %8lu %8lu %6lu %10lu\n",
+                      priority_names[i], stat.batches, stat.runs, stat.max_batch,
+                      stat.cycles / tsc_per_us);
+        }
+
+        std::array<DeferredWork, 16> works;
+        const size_t num_works = GetDeferredWorkStats(works.data(), works.size());
+        PrintToFD(*files_[1], "%-8s %-6s %8s %8s %8s %8s %8s %8s\n",
+                  "work", "queue", "requests", "runs", "avg(us)", "max(us)", "lat(us)", "maxlat");
+        for (size_t i = 0; i < num_works; i++) {
+            const auto& work = works[i];
+            PrintToFD(*files_[1], "%-8s %-6s %8lu %8lu %8lu %8lu %8lu %8lu\n",
+                      work.name, priority_names[static_cast<int>(work.priority)],
+                      work.requests, work.runs,
+                      work.runs ? work.cycles / work.runs / tsc_per_us : 0,
+                      work.max_cycles / tsc_per_us,
+                      work.runs ? work.latency_cycles / work.runs / tsc_per_us : 0,
+                      work.max_latency_cycles / tsc_per_us);
+        }
+    } else if (strcmp(command, "bootprof") == 0) { // 起動の段階ごとの所要時間を表示
+        const uint64_t tsc_per_us = std::max<uint64_t>(TSCFrequency() / 1000000, 1);
+        const uint64_t total = BootProfileTotalCycles();
+        std::array<BootPhaseRecord, 40> records;
+        const size_t num_records = GetBootProfile(records.data(), records.size());
+        PrintToFD(*files_[1], "%-16s %10s %5s\n", "phase", "time(us)", "%");
+        for (size_t i = 0; i < num_records; i++) {
+            PrintToFD(*files_[1], "%-16s %10lu %3lu.%lu\n",
+                      records[i].name, records[i].cycles / tsc_per_us,
+                      total ? records[i].cycles * 100 / total : 0,
+                      total ? records[i].cycles * 1000 / total % 10 : 0);
+        }
+        PrintToFD(*files_[1], "%-16s %10lu\n", "total", total / tsc_per_us);
+        // 裏で進めた初期化（上の段階と並行して動いている）
+        PrintToFD(*files_[1], "%-16s %10s %10s\n", "boot job", "wait(us)", "run(us)");
+        for (int i = 0; i < kNumBootJobs; i++) {
+            const auto stat = GetBootJobStat(static_cast<BootJob>(i));
+            if (stat.name == nullptr) {
+                continue;
+            }
+            if (stat.done) {
+                PrintToFD(*files_[1], "%-16s %10lu %10lu\n",
+                          stat.name, stat.wait_cycles / tsc_per_us, stat.run_cycles / tsc_per_us);
+            } else {
+                PrintToFD(*files_[1], "%-16s %10lu %10s\n",
+                          stat.name, stat.wait_cycles / tsc_per_us, "running");
+            }
+        }
+    } else if (strcmp(command, "bench") == 0) { // ex. bench [<name>]（カーネルの中のマイクロベンチマーク）
+        std::array<KernelBenchResult, 8> results;
+        const char* name = first_arg && first_arg[0] ? first_arg : nullptr;
+        const size_t n = RunKernelBench(name, results.data(), results.size());
+        if (n == 0) {
+            PrintToFD(*files_[2], "no such benchmark: %s\n", first_arg);
+            PrintToFD(*files_[2], "benchmarks:");
+            for (size_t i = 0; KernelBenchName(i); i++) {
+                PrintToFD(*files_[2], " %s", KernelBenchName(i));
+            }
+            PrintToFD(*files_[2], "\n");
+            exit_code = 1;
+        }
+        // TSCのカウントをナノ秒にする
+        const uint64_t tsc_per_us = std::max<uint64_t>(TSCFrequency() / 1000000, 1);
+        auto ns = [tsc_per_us](uint64_t cycles) { return cycles * 1000 / tsc_per_us; };
+        if (n > 0) {
+            PrintToFD(*files_[1], "%-16s %6s %8s %8s %8s %8s %8s (ns)\n",
+                      "bench", "n", "min", "p50", "p90", "p99", "max");
+        }
+        for (size_t i = 0; i < n; i++) {
+            const auto& r = results[i];
+            PrintToFD(*files_[1], "%-16s %6lu %8lu %8lu %8lu %8lu %8lu",
+                      r.name, r.samples, ns(r.min), ns(r.p50), ns(r.p90), ns(r.p99), ns(r.max));
+            if (r.bytes > 0) {
+                const uint64_t us = std::max<uint64_t>(r.total_cycles / tsc_per_us, 1);
+                PrintToFD(*files_[1], " %lu MB/s", r.bytes / us);
+            }
+            if (r.migrated > 0) {
+                PrintToFD(*files_[1], " %lu/%lu stolen", r.migrated, r.samples);
+            }
+            PrintToFD(*files_[1], "\n");
+        }
+    } else if (strcmp(command, "prof") == 0) { // ex. prof start [<period(us)>] | stop | [<entries>]（統計的プロファイラ）
+        char* arg = first_arg ? first_arg : const_cast<char*>("");
+        if (strncmp(arg, "start", 5) == 0) {
+            const unsigned long period_us = arg[5] == ' ' ? strtoul(&arg[6], nullptr, 0) : 0;
+            StartProfiler(period_us ? period_us : 1000);
+        } else if (strcmp(arg, "stop") == 0) {
+            StopProfiler();
+        } else {
+            PrintProfile(*files_[1], arg[0] ? strtoul(arg, nullptr, 0) : 20);
+        }
+    } else if (strcmp(command, "trace") == 0) { // ex. trace start | stop | dump <file>（イベントトレース）
+        char* arg = first_arg ? first_arg : const_cast<char*>("");
+        if (strcmp(arg, "start") == 0) {
+            EnableTrace(true);
+        } else if (strcmp(arg, "stop") == 0) {
+            EnableTrace(false);
+        } else if (strncmp(arg, "dump ", 5) == 0 && arg[5] != '\0') {
+            const char* path = &arg[5];
+            auto [file, post_slash] = fat::FindFile(path);
+            Error err = MAKE_ERROR(Error::kSuccess);
+            if (file == nullptr) {
+                auto [new_file, create_err] = fat::CreateFile(path);
+                file = new_file;
+                err = create_err;
+            } else if (file->attr == fat::Attribute::kDirectory || post_slash) {
+                err = MAKE_ERROR(Error::kIsDirectory);
+            }
+            if (!err) {
+                // 書き込んだところまでがファイルの大きさになるので、既存のファイルは上書きされる
+                fat::FileDescriptor fd{*file};
+                auto [num_records, dump_err] = DumpTrace(fd);
+                err = dump_err;
+                if (!err) {
+                    PrintToFD(*files_[1], "%lu records\n", num_records);
+                }
+            }
+            if (err) {
+                PrintToFD(*files_[2], "failed to dump trace to %s: %s\n", path, err.Name());
+                exit_code = 1;
+            }
+        } else {
+            PrintToFD(*files_[2], "Usage: trace start | stop | dump <file>\n");
+            exit_code = 1;
+        }
+    } else if (strcmp(command, "compstat") == 0) { // 画面の合成の回数と所要時間を表示
+        const auto stats = GetCompositorStats();
+        const auto avg_ticks = stats.frames ? stats.total_ticks / stats.frames : 0;
+        PrintToFD(*files_[1], "frames %lu, rects %lu (max %d fps)\n", stats.frames, stats.rects, kCompositorFPS);
+        PrintToFD(*files_[1], "frame time (usec): avg %lu, max %lu, last %lu\n",
+                  avg_ticks, stats.max_ticks, stats.last_ticks);
+    } else if (strcmp(command, "dmesg") == 0) { // リングバッファに残っているカーネルのログを表示
+        const uint64_t tsc_freq = TSCFrequency();
+        uint64_t seq = 0, num_lost = 0;
+        LogEntry entry;
+        while (ReadLog(seq, entry, &num_lost)) {
+            const char level = entry.level == kError  ? 'E'
+                               : entry.level == kWarn ? 'W'
+                               : entry.level == kInfo ? 'I'
+                                                      : 'D';
+            if (tsc_freq) {
+                const uint64_t usec = entry.tsc / (tsc_freq / 1000000);
+                PrintToFD(*files_[1], "[%5lu.%06lu] %c ", usec / 1000000, usec % 1000000, level);
+            } else {
+                PrintToFD(*files_[1], "[tsc %lu] %c ", entry.tsc, level);
+            }
+            // ログは PrintToFD() のバッファより長いことがあるのでそのまま書く
+            files_[1]->Write(entry.text, strlen(entry.text));
+        }
+        if (num_lost > 0) {
+            PrintToFD(*files_[1], "(%lu older records were overwritten)\n", num_lost);
+        }
+    } else if (strcmp(command, "textbench") == 0) { // 文字の描画の速さ（文字/秒）を測る
+        // ターミナルと同じ80桁25行の大きさで、画面には出さない
+        Window window{8 * 80, 16 * 25, g_screen_config.pixel_format};
+        char ascii[81];
+        for (int i = 0; i < 80; i++) {
+            ascii[i] = '!' + i;
+        }
+        ascii[80] = '\0';
+        // 全角40文字
+        const char* unicode = "いろはにほへとちりぬるをわかよたれそつねならむうゐのおくやまけふこえてあさきゆめ";
+        PrintToFD(*files_[1], "ascii:   %lu chars/s\n", MeasureTextRendering(window, ascii, 80, 50));
+        PrintToFD(*files_[1], "unicode: %lu chars/s\n", MeasureTextRendering(window, unicode, 40, 50));
+    } else if (strcmp(command, "sync") == 0) { // ファイルへの書き込みをディスクに書き戻す
+        if (auto err = SyncBootVolume()) {
+            PrintToFD(*files_[2], "sync: %s\n", err.Name());
+            exit_code = 1;
+        }
+    } else if (strcmp(command, "sysstat") == 0) { // システムコールの回数と処理時間を表示（on|off|reset、タスクIDを指定するとそのタスクの分）
+        if (first_arg && strcmp(first_arg, "on") == 0) {
+            EnableSyscallStat(true);
+        } else if (first_arg && strcmp(first_arg, "off") == 0) {
+            EnableSyscallStat(false);
+        } else if (first_arg && strcmp(first_arg, "reset") == 0) {
+            ResetSyscallStat();
+        } else {
+            SyscallStatTable stats{};
+            if (first_arg) {
+                const uint64_t task_id = strtoul(first_arg, nullptr, 0);
+                g_task_manager->ForEachTask([&stats, task_id](Task& t) {
+                    if (t.ID() == task_id && t.SyscallStats()) {
+                        stats = *t.SyscallStats();
+                    }
+                });
+            } else {
+                stats = GetSyscallStat();
+            }
+
+            const uint64_t tsc_per_us = std::max<uint64_t>(TSCFrequency() / 1000000, 1);
+            PrintToFD(*files_[1], "syscall stat : %s\n", SyscallStatEnabled() ? "on" : "off");
+            PrintToFD(*files_[1], "%-16s %8s %6s %8s %8s\n",
+                      "name", "calls", "errors", "avg(us)", "p99(us)");
+            for (size_t i = 0; i < stats.size(); i++) {
+                const auto& stat = stats[i];
+                if (stat.calls == 0) {
+                    continue;
+                }
+                // 99%の呼び出しが収まる区間の上限（区間bの上限は 2^(b+7) サイクル）
+                uint64_t count = 0;
+                int bucket = 0;
+                while (bucket < kSyscallHistBuckets - 1) {
+                    count += stat.hist[bucket];
+                    if (count * 100 >= stat.calls * 99) {
+                        break;
+                    }
+                    bucket++;
+                }
+                PrintToFD(*files_[1], "%-16s %8lu %6lu %8lu %8lu\n",
+                          SyscallName(i), stat.calls, stat.errors,
+                          stat.cycles / stat.calls / tsc_per_us,
+                          (1ul << (bucket + 7)) / tsc_per_us);
+            }
+        }
     } else if (command[0] != 0) {
         auto file_entry = FindCommand(command);
         if (!file_entry) { // エントリが見つからない
@@ -548,16 +1409,20 @@ void Terminal::ExecuteLine() {
 
     if (pipe_fd) {
         pipe_fd->FinishWrite(); // データ送信の終了を受信側に伝える
-        __asm__("cli");
-        // 送信元タスクが送信先タスクの終了を待機
-        auto [ec, err] = g_task_manager->WaitFinish(subtask_id);
-        // イベント通知先の変更を解除
-        (*g_layer_task_map)[layer_id_] = task_.ID();
-        __asm__("sti");
-        if (err) {
-            Log(kWarn, "failed to wait finish: %s\n", err.Name());
+        // すべての段の終了を待機する。終了コードは最後の段のもの
+        for (const auto subtask_id : subtask_ids) {
+            auto [ec, err] = g_task_manager->WaitFinish(subtask_id);
+            if (err) {
+                Log(kWarn, "failed to wait finish: %s\n", err.Name());
+            }
+            exit_code = ec;
+        }
+        {
+            // イベント通知先の変更を解除
+            MutexGuard lock{g_layer_mutex};
+            (*g_layer_task_map)[layer_id_] = task_.ID();
+            g_active_layer->UpdateFocus();
         }
-        exit_code = ec;
     }
 
     last_exit_code_ = exit_code;
@@ -565,13 +1430,125 @@ void Terminal::ExecuteLine() {
     files_[1] = original_stdout;
 }
 
+uint64_t Terminal::StartHiddenTerminal(const char* command_line) {
+    auto& task = g_task_manager->NewTask();
+    // 書き込み側をすぐに閉じたパイプを、読むとすぐに終わる標準入力にする
+    auto null_stdin = std::allocate_shared<PipeDescriptor>(SlabAllocator<PipeDescriptor>{}, task);
+    null_stdin->FinishWrite();
+    auto term_desc = new TerminalDescriptor{command_line, true, false, {null_stdin, files_[1], files_[2]}, null_stdin};
+    return task.InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc))
+        .Wakeup()
+        .ID();
+}
+
+void Terminal::ReportFinishedJobs() {
+    for (auto it = jobs_.begin(); it != jobs_.end();) {
+        if (auto exit_code = g_task_manager->PollFinish(it->task_id)) {
+            PrintToFD(*files_[1], "[%d] Done (%d)  %s\n", it->number, *exit_code, it->command_line.c_str());
+            it = jobs_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (jobs_.empty()) {
+        next_job_number_ = 1;
+    }
+}
+
+int Terminal::RunParallel(char* args) {
+    // 同時に動かすタスクの数は、指定がなければCPUコアの数
+    unsigned long max_tasks = NumCPUs();
+    if (args && strncmp(args, "-j", 2) == 0) {
+        max_tasks = strtoul(&args[2], &args, 0);
+        while (isspace(*args)) {
+            args++;
+        }
+    }
+    char* sep = args ? strstr(args, ":::") : nullptr;
+    if (sep) {
+        *sep = 0;
+    }
+    std::string templ = args ? args : "";
+    while (!templ.empty() && isspace(templ.back())) {
+        templ.pop_back();
+    }
+    if (sep == nullptr || templ.empty() || max_tasks == 0) {
+        PrintToFD(*files_[2], "Usage: parallel [-j <n>] <command> ::: <arg>...\n");
+        PrintToFD(*files_[2], "  {} in <command> is replaced by each arg (appended if absent)\n");
+        return 1;
+    }
+
+    // 起動した順に終了を待つ。先頭が終わるまで次を起動しないので、同時に動くのは高々max_tasks個
+    std::deque<uint64_t> running;
+    int failed = 0;
+    auto wait_oldest = [&running, &failed]() {
+        auto [ec, err] = g_task_manager->WaitFinish(running.front());
+        running.pop_front();
+        if (err || ec != 0) {
+            failed++;
+        }
+    };
+
+    char* p = sep + 3;
+    while (true) {
+        while (isspace(*p)) {
+            p++;
+        }
+        if (*p == 0) {
+            break;
+        }
+        const char* arg = p;
+        while (*p && !isspace(*p)) {
+            p++;
+        }
+        if (*p) {
+            *p++ = 0;
+        }
+
+        std::string line = templ;
+        if (line.find("{}") == std::string::npos) {
+            line += ' ';
+            line += arg;
+        } else {
+            const size_t arg_len = strlen(arg);
+            for (size_t pos = line.find("{}"); pos != std::string::npos; pos = line.find("{}", pos + arg_len)) {
+                line.replace(pos, 2, arg);
+            }
+        }
+        if (running.size() >= max_tasks) {
+            wait_oldest();
+        }
+        running.push_back(StartHiddenTerminal(line.c_str()));
+    }
+    while (!running.empty()) {
+        wait_oldest();
+    }
+    return failed;
+}
+
+void Terminal::ExecuteApp(fat::DirectoryEntry& file_entry, const std::string& command_line) {
+    strncpy(&linebuf_[0], command_line.c_str(), kLineMax - 1);
+    linebuf_[kLineMax - 1] = 0;
+    char* command = &linebuf_[0];
+    char* first_arg = strchr(command, ' ');
+    if (first_arg) {
+        *first_arg++ = 0;
+    }
+
+    auto [ec, err] = ExecuteFile(file_entry, command, first_arg);
+    if (err) {
+        PrintToFD(*files_[2], "failed to exec file: %s\n", err.Name());
+        ec = -ec;
+    }
+    last_exit_code_ = ec;
+}
+
 WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry, char* command, char* first_arg) {
     // アプリ独自の仮想アドレスに実行可能ファイルをロードするため、事前にタスク固有の階層ページング構造を設定
-    __asm__("cli");
     auto& task = g_task_manager->CurrentTask();
-    __asm__("sti");
 
-    auto [app_load, err] = LoadApp(file_entry, task);
+    PageMapAllocCount alloc{};
+    auto [app_load, err] = LoadApp(file_entry, task, alloc);
     if (err) {
         return {0, err};
     }
@@ -579,7 +1556,7 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry, char* comm
     // コマンドライン引数を取得
     // アプリ用のページにargvを構築
     LinearAddress4Level args_frame_addr{0xfffffffffffff000};
-    if (auto err = SetupPageMaps(args_frame_addr, 1)) {
+    if (auto err = SetupPageMaps(args_frame_addr, 1, alloc)) {
         return {0, err};
     }
     // new演算子はsbrk()（OS用のアドレス空間に存在するメモリ領域を使う）を呼び出してしまうので、使用しない
@@ -597,10 +1574,27 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry, char* comm
     // アプリ用スタック領域
     const int stack_size = 16 * 4096; // 64KiB
     LinearAddress4Level stack_frame_addr{0xfffffffffffff000 - stack_size};
-    if (auto err = SetupPageMaps(stack_frame_addr, stack_size / 4096)) {
+    if (auto err = SetupPageMaps(stack_frame_addr, stack_size / 4096, alloc)) {
         return {0, err};
     }
 
+    // 時刻をシステムコールなしで読めるよう、時刻のページをスタックのすぐ下に置く
+    static_assert(kTimePageAddr == 0xfffffffffffff000 - stack_size - 4096);
+    if (auto frame = TimePageFrame()) {
+        if (auto err = MapReadOnlyPage(kTimePageAddr, frame, alloc)) {
+            return {0, err};
+        }
+    }
+
+    // 起動時に割り当てたフレームをタスクに計上
+    task.FrameUsage() = {};
+    task.FrameUsage().image_pages = alloc.pages;
+    task.FrameUsage().page_tables = alloc.tables;
+    task.FaultStat() = {};
+    if (auto stats = task.SyscallStats()) {
+        *stats = {};
+    }
+
     // fd=0,1,2に標準入力、標準出力、標準エラー出力を設定
     for (int i = 0; i < 3; i++) {
         task.Files().push_back(files_[i]);
@@ -610,15 +1604,17 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry, char* comm
     // アプリに関連する仮想アドレス範囲は以下のようになる
     // [0xffff 8000 0000 0000, elf_last_addr] : アプリのELF
     // [elf_next_page (dpaging_begin_), dpaging_end_) : アプリのデマンドページング範囲
-    // [dpaging_end_, 0xffff ffff ffff f000) : メモリマップドファイル範囲。メモリを拡大するときは前方に進める。
+    // [dpaging_end_, kTimePageAddr) : メモリマップドファイル範囲。メモリを拡大するときは前方に進める。
+    // [kTimePageAddr, kTimePageAddr + 4KiB) : 時刻のページ（読み込み専用）
     // [0xffff ffff ffff f000, 0xffff ffff ffff ffff] : スタック領域 + コマンドライン引数
     const uint64_t elf_next_page = (app_load.vaddr_end + 4095) & 0xfffffffffffff000; // 4KiB単位のアドレスに切り上げ
     task.SetDPagingBegin(elf_next_page);
     task.SetDPagingEnd(elf_next_page);
 
-    task.SetFileMapEnd(stack_frame_addr.value);
+    task.SetFileMapEnd(kTimePageAddr);
 
     // エントリポイントのアドレスを取得し、実行
+    task.SetAppEntry(&file_entry);
     int ret = CallApp(argc.value,
                       argv,
                       3 << 3 | 3,
@@ -626,16 +1622,59 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry& file_entry, char* comm
                       stack_frame_addr.value + stack_size - 8,
                       &task.OSStackPointer()); // アプリ終了時に復帰するスタックポインタ
 
+    // 残ったスレッドは、眠っていても回り続けていても強制終了させ、アドレス空間を片付ける前に終わるのを待つ
+    // 1つずつ列から外してから待つので、ほかのスレッドがJoinThreadで同じスレッドを待つことはない
+    // 待っている間に残りのスレッドが作ったスレッドも止めるよう、待つたびに求め直す
+    auto& space = task.Space();
+    while (true) {
+        g_task_manager->RequestExitThreads(task);
+        uint64_t thread_id;
+        {
+            InterruptGuard guard;
+            if (space.threads.empty()) {
+                break;
+            }
+            thread_id = space.threads.back();
+            space.threads.pop_back();
+        }
+        g_task_manager->WaitFinish(thread_id);
+    }
+    space.free_thread_stacks.clear();
+    space.futexes.clear();
+    space.children.clear();
+    // 以降のキー入力はターミナルのキューに戻す
+    task.SetEventRing(nullptr);
+
+    // アプリが残したタイマ（値が負）は、ターミナルに通知され続けないよう止める
+    g_timer_manager->CancelTimersIf([task_id = task.ID()](const Timer& t) {
+        return t.TaskID() == task_id && t.Value() < 0;
+    });
+
     task.Files().clear();
+    for (auto& [vaddr, m] : task.FileMaps()) {
+        if (m.shm) {
+            DetachSharedMemory(m.shm);
+        }
+    }
     task.FileMaps().clear();
+    task.ImageFile().reset();
+    task.LoadSegments().clear();
+    task.SetAppEntry(nullptr);
 
-    // アプリ終了後、使用したメモリ領域を解放
-    const uint64_t addr_first = 0xffff800000000000;
-    if (auto err = CleanPageMaps(LinearAddress4Level{addr_first})) {
-        return {ret, err};
-    }
+    // アプリ終了後、使用したメモリ領域を解放する
+    // 大きなアドレス空間の破棄を待たずにプロンプトに戻れるよう、破棄は裏のタスクで行う
+    FreePML4(task);
 
-    return {ret, FreePML4(task)};
+    return {ret, MAKE_ERROR(Error::kSuccess)};
+}
+
+void Terminal::NewLine() {
+    cursor_.x = 0;
+    if (cursor_.y < kRows - 1) {
+        cursor_.y++;
+    } else {
+        Scroll1();
+    }
 }
 
 void Terminal::Print(char32_t c) {
@@ -643,66 +1682,109 @@ void Terminal::Print(char32_t c) {
         return;
     }
 
-    auto newline = [this]() {
-        cursor_.x = 0;
-        if (cursor_.y < kRows - 1) {
-            cursor_.y++;
-        } else {
-            Scroll1();
-        }
-    };
-
     if (c == U'\n') { // UTF-32の改行文字
-        newline();
+        NewLine();
     } else if (IsHankaku(c)) {
         if (cursor_.x == kColumns) {
-            newline();
+            NewLine();
         }
-        WriteUnicode(*window_->Writer(), CalcCursorPos(), c, {255, 255, 255});
+        RowAt(cursor_.y)[cursor_.x] = c;
         cursor_.x++;
     } else { // 全角
         // 画面右端に到達したら改行
         if (cursor_.x >= kColumns - 1) {
-            newline();
+            NewLine();
         }
-        WriteUnicode(*window_->Writer(), CalcCursorPos(), c, {255, 255, 255});
+        RowAt(cursor_.y)[cursor_.x] = c;
+        RowAt(cursor_.y)[cursor_.x + 1] = kWideTail;
         cursor_.x += 2;
     }
 }
 
 void Terminal::Print(const char* s, std::optional<size_t> len) {
-    const auto cursor_before = CalcCursorPos();
-    DrawCursor(false);
+    if (!show_window_) {
+        return;
+    }
+    if (!output_pending_) {
+        DrawCursor(false);
+        pending_area_ = {CalcCursorPos(), {7, 15}};
+        output_pending_ = true;
+    }
+    // 出力があれば最新の画面に戻る
+    view_offset_ = 0;
 
     size_t i = 0;
-    const size_t len_ = len ? *len : std::numeric_limits<size_t>::max();
+    const size_t len_ = len ? *len : strlen(s);
 
-    while (s[i] && i < len_) {
+    while (i < len_) {
+        // ログなどはほとんどASCII文字なので、まとめて桁に書き込み、多バイト文字と改行だけを1文字ずつ処理する
+        if (const size_t run = CountPrintableAscii(&s[i], len_ - i); run > 0) {
+            PrintAscii(&s[i], run);
+            i += run;
+            continue;
+        }
+        if (s[i] == '\0') {
+            break;
+        }
         const auto [u32, bytes] = ConvertUTF8to32(&s[i]);
         Print(u32);
-        i += bytes;
+        // UTF-8の先頭にならないバイトは読み飛ばす
+        i += bytes > 0 ? bytes : 1;
     }
 
+    const auto now = g_timer_manager->CurrentTick();
+    if (now - last_flush_tick_ >= kOutputFlushTicks) {
+        FlushOutput();
+    } else if (!flush_timer_armed_) {
+        // 立て続けの出力は、タイマがタイムアウトするまでためてから1回で描く
+        g_timer_manager->AddTimer(Timer{last_flush_tick_ + kOutputFlushTicks, kOutputFlushTimer, task_.ID()});
+        flush_timer_armed_ = true;
+    }
+}
+
+void Terminal::PrintAscii(const char* s, size_t len) {
+    while (len > 0) {
+        if (cursor_.x == kColumns) {
+            NewLine();
+        }
+        const size_t n = std::min<size_t>(len, kColumns - cursor_.x);
+        std::copy_n(reinterpret_cast<const uint8_t*>(s), n, &RowAt(cursor_.y)[cursor_.x]);
+        cursor_.x += n;
+        s += n;
+        len -= n;
+    }
+}
+
+Rectangle<int> Terminal::RenderOutput() {
+    // 途中で何度スクロールしても、描き直すのは最後に描いた画面と違う桁だけ
+    auto draw_area = MergeDrawArea(pending_area_, FlushCells());
     DrawCursor(true);
-    const auto cursor_after = CalcCursorPos();
+    draw_area = MergeDrawArea(draw_area, {CalcCursorPos(), {7, 15}});
 
-    Vector2D<int> draw_pos{TopLevelWindow::kTopLeftMargin.x, cursor_before.y};
-    Vector2D<int> draw_size{window_->InnerSize().x, cursor_after.y - cursor_before.y + 16};
-    Rectangle<int> draw_area{draw_pos, draw_size};
+    output_pending_ = false;
+    pending_area_ = {};
+    last_flush_tick_ = g_timer_manager->CurrentTick();
+    return draw_area;
+}
 
-    // 画面を再描画
+void Terminal::FlushOutput() {
+    if (!output_pending_) {
+        return;
+    }
+    const auto draw_area = RenderOutput();
     Message msg = MakeLayerMessage(task_.ID(), LayerID(), LayerOperation::DrawArea, draw_area);
-    __asm__("cli");
-    g_task_manager->SendMessage(kMainTaskID, msg);
-    __asm__("sti");
+    SendLayerMessage(msg);
+}
+
+void Terminal::OnOutputFlushTimer() {
+    flush_timer_armed_ = false;
+    FlushOutput();
 }
 
 void Terminal::Redraw() {
     Rectangle<int> draw_area{TopLevelWindow::kTopLeftMargin, window_->InnerSize()};
     Message msg = MakeLayerMessage(task_.ID(), LayerID(), LayerOperation::DrawArea, draw_area);
-    __asm__("cli");
-    g_task_manager->SendMessage(kMainTaskID, msg);
-    __asm__("sti");
+    SendLayerMessage(msg);
 }
 
 Rectangle<int> Terminal::HistoryUpDown(int direction) {
@@ -716,7 +1798,6 @@ Rectangle<int> Terminal::HistoryUpDown(int direction) {
     const auto first_pos = CalcCursorPos();
 
     Rectangle<int> draw_area{first_pos, {8 * (kColumns - 1), 16}};
-    FillRectangle(*window_->Writer(), draw_area.pos, draw_area.size, {0, 0, 0});
 
     const char* history = "";
     if (cmd_history_index_ >= 0) {
@@ -726,7 +1807,14 @@ Rectangle<int> Terminal::HistoryUpDown(int direction) {
     strcpy(&linebuf_[0], history);
     linebuf_index_ = strlen(history);
 
-    WriteString(*window_->Writer(), first_pos, history, {255, 255, 255});
+    // 描くのはInputKey()の最後のRenderOutput()
+    if (show_window_) {
+        auto& line = RowAt(cursor_.y);
+        std::fill(line.begin() + 1, line.end(), 0);
+        for (int i = 0; i < linebuf_index_ && 1 + i < kColumns; i++) {
+            line[1 + i] = history[i];
+        }
+    }
     cursor_.x = linebuf_index_ + 1;
     return draw_area;
 }
@@ -738,18 +1826,22 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
         show_window = term_desc->show_window;
     }
 
-    // グローバル変数を扱う際は割り込みを禁止しておくのが無難
-    __asm__("cli");
     Task& task = g_task_manager->CurrentTask();
-    Terminal* terminal = new Terminal{task, term_desc};
-    if (show_window) {
-        g_layer_manager->Move(terminal->LayerID(), {100, 200});
-        g_layer_task_map->insert(std::make_pair(terminal->LayerID(), task_id));
-        g_active_layer->Activate(terminal->LayerID());
+    Terminal* terminal;
+    {
+        // ウィンドウのレイヤを作ってから前面に出すまでを、他のタスクのレイヤ操作と混ぜない
+        MutexGuard lock{g_layer_mutex};
+        terminal = new Terminal{task, term_desc};
+        if (show_window) {
+            g_layer_manager->Move(terminal->LayerID(), {100, 200});
+            g_layer_task_map->insert(std::make_pair(terminal->LayerID(), task_id));
+            g_active_layer->Activate(terminal->LayerID());
+        }
     }
-    __asm__("sti");
 
-    if (term_desc && !term_desc->command_line.empty()) {
+    if (term_desc && term_desc->app) {
+        terminal->ExecuteApp(*term_desc->app, term_desc->command_line);
+    } else if (term_desc && !term_desc->command_line.empty()) {
         // 非表示ターミナルにコマンドラインを自動入力
         for (int i = 0; i < term_desc->command_line.length(); i++) {
             terminal->InputKey(0, 0, term_desc->command_line[i]);
@@ -758,10 +1850,16 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
     }
 
     if (term_desc && term_desc->exit_after_command) { // タスクを終了させる
+        if (term_desc->stdin_pipe) {
+            // 送信元がバッファの空きを待ち続けないように
+            term_desc->stdin_pipe->FinishRead();
+        }
+        if (term_desc->stdout_pipe) {
+            // データ送信の終了を次の段に伝える
+            term_desc->stdout_pipe->FinishWrite();
+        }
         delete term_desc;
-        __asm__("cli");
         g_task_manager->Finish(terminal->LastExitCode());
-        __asm__("sti");
     }
 
     auto add_blink_timer = [task_id](unsigned long t) {
@@ -772,51 +1870,46 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
     bool window_isactive = false;
 
     while (true) {
-        __asm__("cli");
-        auto msg = task.ReceiveMessage();
-        if (!msg) {
-            task.Sleep();
-            __asm__("sti");
-            continue;
-        }
-        __asm__("sti");
+        const auto msg = task.WaitMessage();
 
-        switch (msg->type) {
+        switch (msg.type) {
         case Message::kTimerTimeout: {
-            add_blink_timer(msg->arg.timer.timeout);
+            if (msg.arg.timer.value == Terminal::kOutputFlushTimer) {
+                terminal->OnOutputFlushTimer();
+                break;
+            }
+            if (msg.arg.timer.value != 1) {
+                // アプリが待ち合わせの期限に使ったタイマの残り
+                break;
+            }
+            add_blink_timer(msg.arg.timer.timeout);
             if (show_window && window_isactive) {
                 // 一定時間ごとにカーゾルを点滅させる
                 const auto area = terminal->BlinkCursor();
                 Message msg = MakeLayerMessage(task_id, terminal->LayerID(), LayerOperation::DrawArea, area);
-                // メインタスクに描画処理を要求
-                __asm__("cli");
-                g_task_manager->SendMessage(kMainTaskID, msg);
-                __asm__("sti");
+                // 合成タスクに描画処理を要求
+                SendLayerMessage(msg);
             }
         } break;
         case Message::kKeyPush:
             // キーの二重入力を防ぐ
-            if (msg->arg.keyboard.press) {
-                const auto area = terminal->InputKey(msg->arg.keyboard.modifier,
-                                                     msg->arg.keyboard.keycode,
-                                                     msg->arg.keyboard.ascii);
+            if (msg.arg.keyboard.press) {
+                const auto area = terminal->InputKey(msg.arg.keyboard.modifier,
+                                                     msg.arg.keyboard.keycode,
+                                                     msg.arg.keyboard.ascii);
                 if (show_window) {
                     Message msg = MakeLayerMessage(task_id, terminal->LayerID(), LayerOperation::DrawArea, area);
-                    // メインタスクに描画処理を要求
-                    __asm__("cli");
-                    g_task_manager->SendMessage(kMainTaskID, msg);
-                    __asm__("sti");
+                    // 合成タスクに描画処理を要求
+                    SendLayerMessage(msg);
                 }
             }
             break;
         case Message::kWindowActive:
-            window_isactive = msg->arg.window_active.activate;
+            window_isactive = msg.arg.window_active.activate;
             break;
         case Message::kWindowClose:
-            CloseLayer(msg->arg.window_close.layer_id);
-            __asm__("cli");
+            CloseLayer(msg.arg.window_close.layer_id);
             g_task_manager->Finish(terminal->LastExitCode());
-            __asm__("sti");
             break;
         default:
             break;
@@ -829,45 +1922,46 @@ TerminalFileDescriptor::TerminalFileDescriptor(Terminal& term) : term_{term} {
 
 size_t TerminalFileDescriptor::Read(void* buf, size_t len) {
     char* bufc = reinterpret_cast<char*>(buf);
+    // 入力を待つ前に、たまっている出力（プロンプトなど）を見せる
+    term_.FlushOutput();
 
     while (true) {
-        __asm__("cli");
-        auto msg = term_.UnderlyingTask().ReceiveMessage();
-        if (!msg) {
-            term_.UnderlyingTask().Sleep();
+        const auto msg = term_.UnderlyingTask().WaitMessage();
+        if (msg.type == Message::kTimerTimeout && msg.arg.timer.value == Terminal::kOutputFlushTimer) {
+            term_.OnOutputFlushTimer();
             continue;
         }
-        __asm__("sti");
 
-        if (msg->type != Message::kKeyPush || !msg->arg.keyboard.press) {
+        if (msg.type != Message::kKeyPush || !msg.arg.keyboard.press) {
             continue;
         }
 
         // Ctrl + D でEOTを入力する
         // EOT, End of Transaction : 標準入力やネットワーク通信などのデータ転送における終端
-        if (msg->arg.keyboard.modifier & (kLControlBitMask | kRControlBitMask)) {
+        if (msg.arg.keyboard.modifier & (kLControlBitMask | kRControlBitMask)) {
             char s[3] = "^ ";
-            s[1] = toupper(msg->arg.keyboard.ascii);
+            s[1] = toupper(msg.arg.keyboard.ascii);
             term_.Print(s);
-            if (msg->arg.keyboard.keycode == 7 /* D */) {
+            term_.FlushOutput();
+            if (msg.arg.keyboard.keycode == 7 /* D */) {
                 return 0; // EOT
             }
 
             continue;
         }
 
-        bufc[0] = msg->arg.keyboard.ascii;
+        bufc[0] = msg.arg.keyboard.ascii;
         // エコーバック:
         // キー入力結果を即座にターミナルに印字
         term_.Print(bufc, 1);
-        term_.Redraw();
+        term_.FlushOutput();
         return 1;
     }
 }
 
 size_t TerminalFileDescriptor::Write(const void* buf, size_t len) {
+    // 描画はまとめて行うので、ここでは再描画を要求しない
     term_.Print(reinterpret_cast<const char*>(buf), len);
-    term_.Redraw(); // 文字列を表示するたびにターミナル画面全体を再描画
     return len;
 }
 
@@ -875,67 +1969,205 @@ size_t TerminalFileDescriptor::Load(void* buf, size_t len, size_t offset) {
     return 0;
 }
 
-PipeDescriptor::PipeDescriptor(Task& task) : task_{task} {}
+bool TerminalFileDescriptor::PollRead(uint64_t task_id) {
+    const auto msg = term_.UnderlyingTask().PeekMessage();
+    return msg && msg->type == Message::kKeyPush && msg->arg.keyboard.press;
+}
 
-size_t PipeDescriptor::Read(void* buf, size_t len) {
-    if (len_ > 0) {
-        const size_t copy_bytes = std::min(len_, len);
-        memcpy(buf, data_, copy_bytes);
-        len_ -= copy_bytes;
-        memmove(data_, &data_[copy_bytes], len_);
-        return copy_bytes;
-    }
+PipeDescriptor::PipeDescriptor(Task& task, bool remap)
+    : task_{task}, remap_{remap}, buf_{new uint8_t[kBufferSize]} {}
 
-    if (closed_) {
-        return 0;
+PipeDescriptor::~PipeDescriptor() {
+    // 読み出されなかったフレームを手放す
+    for (; frame_read_ != frame_write_; frame_read_++) {
+        ReleaseSharedFrame(frames_[frame_read_ % kMaxFrames].frame);
     }
+}
 
-    while (true) {
-        __asm__("cli");
-        auto msg = task_.ReceiveMessage();
-        if (!msg) {
-            task_.Sleep();
-            continue;
-        }
-        __asm__("sti");
+size_t PipeDescriptor::Read(void* buf, size_t len) {
+    return ReadUser(buf, len).value;
+}
 
-        if (msg->type != Message::kPipe) {
-            continue;
+WithError<size_t> PipeDescriptor::ReadUser(void* buf, size_t len) {
+    auto bufc = reinterpret_cast<uint8_t*>(buf);
+    size_t read_bytes = 0;
+    // 読み出し先のアプリのメモリを準備できなかった
+    Error prepare_err = MAKE_ERROR(Error::kSuccess);
+
+    // 書き込まれた範囲をロックの中で確かめ、コピーはロックを外してから行う
+    size_t write_pos, frame_write, buf_write;
+    {
+        SpinLockGuard lock{lock_};
+        while (read_pos_ == write_pos_) {
+            // 強制終了を求められたスレッドは、読まずにシステムコールの出口で終わる
+            if (closed_ || g_task_manager->CurrentTask().ExitRequested()) {
+                return {0, MAKE_ERROR(Error::kSuccess)};
+            }
+            // 書き込まれるまで眠る
+            readers_.Wait(lock_);
         }
+        write_pos = write_pos_;
+        frame_write = frame_write_;
+        buf_write = buf_write_;
+    }
 
-        if (msg->arg.pipe.len == 0) { // 終了
-            closed_ = true;
-            return 0;
+    // 読み出し位置を書き換えるのは受信側だけなので、手元で進めてから最後に公開する
+    size_t read_pos = read_pos_, frame_read = frame_read_, buf_read = buf_read_;
+    // 待たずに読めるだけ読む
+    while (read_bytes < len && read_pos < write_pos) {
+        const auto dst = reinterpret_cast<uint64_t>(&bufc[read_bytes]);
+        size_t n;
+        if (frame_read != frame_write && frames_[frame_read % kMaxFrames].pos <= read_pos) {
+            // 先頭はフレームで受け取ったページ
+            const auto& f = frames_[frame_read % kMaxFrames];
+            const size_t offset = read_pos - f.pos;
+            n = std::min(len - read_bytes, 4096 - offset);
+            if (offset == 0 && n == 4096 && !MapSharedUserPage(dst, f.frame)) {
+                // フレームを付け替えたので、参照は読み出し先のページに移った
+            } else {
+                if ((prepare_err = PrepareUserWrite(dst, n))) {
+                    break;
+                }
+                memcpy(&bufc[read_bytes], reinterpret_cast<const uint8_t*>(f.frame) + offset, n);
+                if (offset + n == 4096) {
+                    ReleaseSharedFrame(f.frame);
+                }
+            }
+            if (offset + n == 4096) {
+                frame_read++;
+            }
+        } else {
+            // 次のフレームの手前までをリングバッファから読む
+            n = std::min(len - read_bytes, buf_write - buf_read);
+            if (frame_read != frame_write) {
+                n = std::min(n, frames_[frame_read % kMaxFrames].pos - read_pos);
+            }
+            if ((prepare_err = PrepareUserWrite(dst, n))) {
+                break;
+            }
+            const size_t offset = buf_read % kBufferSize;
+            const size_t first = std::min(n, kBufferSize - offset);
+            memcpy(&bufc[read_bytes], &buf_[offset], first);
+            memcpy(&bufc[read_bytes + first], &buf_[0], n - first);
+            buf_read += n;
         }
+        read_pos += n;
+        read_bytes += n;
+    }
 
-        const size_t copy_bytes = std::min<size_t>(msg->arg.pipe.len, len);
-        memcpy(buf, msg->arg.pipe.data, copy_bytes);
-        len_ = msg->arg.pipe.len - copy_bytes;
-        memcpy(data_, &msg->arg.pipe.data[copy_bytes], len_);
-        return copy_bytes;
+    SpinLockGuard lock{lock_};
+    read_pos_ = read_pos;
+    frame_read_ = frame_read;
+    buf_read_ = buf_read;
+    // 空きができたので送信元を起こす
+    writers_.WakeAll();
+    if (read_bytes == 0 && prepare_err) {
+        return {0, prepare_err};
     }
+    return {read_bytes, MAKE_ERROR(Error::kSuccess)};
 }
 
 size_t PipeDescriptor::Write(const void* buf, size_t len) {
-    auto bufc = reinterpret_cast<const char*>(buf);
-    Message msg{Message::kPipe};
+    auto bufc = reinterpret_cast<const uint8_t*>(buf);
     size_t sent_bytes = 0;
+    // フレームを渡せなかったページは、ここまでリングバッファでコピーする
+    uint64_t copy_until = 0;
     while (sent_bytes < len) {
-        msg.arg.pipe.len = std::min(len - sent_bytes, sizeof(msg.arg.pipe.data));
-        memcpy(msg.arg.pipe.data, &bufc[sent_bytes], msg.arg.pipe.len);
-        sent_bytes += msg.arg.pipe.len;
-        __asm__("cli");
-        // データ送信先に割り込み通知
-        task_.SendMessage(msg);
-        __asm__("sti");
+        const auto src = reinterpret_cast<uint64_t>(&bufc[sent_bytes]);
+        bool send_frame = false;
+        size_t n = len - sent_bytes;
+        {
+            SpinLockGuard lock{lock_};
+            while (true) {
+                if (reader_closed_) {
+                    // 送信先が終了していたら残りは捨てる
+                    return len;
+                }
+                n = len - sent_bytes;
+                const bool frame_full = frame_write_ - frame_read_ == kMaxFrames;
+                if (remap_ && src >= copy_until && src % 4096 == 0 && n >= 4096) {
+                    // ページをまるごと書き込むなら、コピーせずにフレームを渡す
+                    if (!frame_full) {
+                        send_frame = true;
+                        break;
+                    }
+                    // フレームの受け渡しが詰まっているので、読み出されるまで待つ
+                    n = 0;
+                } else {
+                    if (remap_) {
+                        // 後続のページ境界からはフレームを渡せるよう、コピーはページ境界で区切る
+                        n = std::min(n, 4096 - src % 4096);
+                    }
+                    n = std::min(n, kBufferSize - (buf_write_ - buf_read_));
+                }
+                if (n > 0) {
+                    break;
+                }
+                if (g_task_manager->CurrentTask().ExitRequested()) {
+                    return sent_bytes;
+                }
+                // 満杯なので送信先が読み出すまで眠る
+                writers_.Wait(lock_);
+            }
+        }
+
+        // 書き込み位置を書き換えるのは送信元だけなので、空きを確かめた範囲にはロックなしで書ける
+        if (send_frame) {
+            auto [frame, err] = ShareUserPage(src);
+            if (err) {
+                copy_until = src + 4096;
+                continue;
+            }
+            frames_[frame_write_ % kMaxFrames] = {write_pos_, frame};
+            SpinLockGuard lock{lock_};
+            frame_write_++;
+            write_pos_ += 4096;
+            sent_bytes += 4096;
+            readers_.WakeAll();
+            NotifyPollerLocked();
+            continue;
+        }
+
+        const size_t offset = buf_write_ % kBufferSize;
+        const size_t first = std::min(n, kBufferSize - offset);
+        memcpy(&buf_[offset], &bufc[sent_bytes], first);
+        memcpy(&buf_[0], &bufc[sent_bytes + first], n - first);
+        SpinLockGuard lock{lock_};
+        buf_write_ += n;
+        write_pos_ += n;
+        sent_bytes += n;
+        readers_.WakeAll();
+        NotifyPollerLocked();
     }
     return len;
 }
 
 void PipeDescriptor::FinishWrite() {
-    Message msg{Message::kPipe};
-    msg.arg.pipe.len = 0;
-    __asm__("cli");
-    task_.SendMessage(msg);
-    __asm__("sti");
+    SpinLockGuard lock{lock_};
+    closed_ = true;
+    readers_.WakeAll();
+    NotifyPollerLocked();
+}
+
+void PipeDescriptor::FinishRead() {
+    SpinLockGuard lock{lock_};
+    reader_closed_ = true;
+    writers_.WakeAll();
+}
+
+bool PipeDescriptor::PollRead(uint64_t task_id) {
+    SpinLockGuard lock{lock_};
+    if (read_pos_ != write_pos_ || closed_) {
+        return true;
+    }
+    poller_ = task_id;
+    return false;
+}
+
+void PipeDescriptor::NotifyPollerLocked() {
+    if (poller_ != 0) {
+        // メッセージなら、送ってから相手が眠っても取りこぼさない
+        g_task_manager->SendMessage(poller_, Message{Message::kFileReady});
+        poller_ = 0;
+    }
 }
@@ -7,6 +7,7 @@
 #include <map>
 #include <memory>
 #include <optional>
+#include <vector>
 
 #include "fat.hpp"
 #include "layer.hpp"
@@ -23,8 +24,14 @@ struct AppLoadInfo {
     uint64_t entry;
     /// アプリ固有の階層ページング構造
     PageMapEntry* pml4;
+    /// LOADセグメントをページフォルト時に読み込むアプリのELFファイルと、解析済みのLOADセグメント
+    /// 全体をメモリに読み込んだアプリでは空
+    std::shared_ptr<IFileDescriptor> image;
+    std::vector<LoadSegment> segments;
 };
 
+class PipeDescriptor;
+
 struct TerminalDescriptor {
     /// コマンドライン引数
     std::string command_line;
@@ -34,15 +41,29 @@ struct TerminalDescriptor {
     bool show_window;
     /// 標準入出力
     std::array<std::shared_ptr<IFileDescriptor>, 3> files;
+    /// 標準入力がパイプなら、終了時に送信元へ伝えるためのそのパイプ
+    std::shared_ptr<PipeDescriptor> stdin_pipe;
+    /// 標準出力がパイプ（パイプラインの途中の段）なら、終了時に受信側へ伝えるためのそのパイプ
+    std::shared_ptr<PipeDescriptor> stdout_pipe;
+    /// 指定されていれば、command_lineをコマンドとして解釈せず、このアプリにそのまま渡して実行する（Spawnシステムコール）
+    fat::DirectoryEntry* app;
 };
 
+/// アプリを探す。パスに/がなく見つからなければappsディレクトリも探す（擬似的に /apps にパスを通す）
+fat::DirectoryEntry* FindCommand(const char* command, unsigned long dir_cluster = 0);
+
 /// ロード済みアプリの一覧
+/// 遅延読み込みするアプリはELFのヘッダを解析した結果を、そうでないアプリは読み込んだページング構造を持つ
 extern std::map<fat::DirectoryEntry*, AppLoadInfo>* g_app_loads;
+/// g_app_loadsを用意し、ファイルが書き込まれたらそのアプリを一覧から外すようにする
+void InitializeAppLoads();
 
 class Terminal {
 public:
     static const int kRows = 15, kColumns = 60;
     static const int kLineMax = 128;
+    /// 画面から流れた行を遡って見られる既定の行数
+    static const int kDefaultScrollback = 200;
 
     Terminal(Task& task, const TerminalDescriptor* term_desc);
     unsigned int LayerID() const { return layer_id_; }
@@ -50,11 +71,25 @@ public:
     Rectangle<int> BlinkCursor();
     // キー入力を受付け、再描画すべき範囲を返す
     Rectangle<int> InputKey(uint8_t modifier, uint8_t keycode, char ascii);
+    /// 文字列を文字のセルに書き込む。描画はまとめて行い、前回の描画からkOutputFlushTicks経っていればすぐ、
+    /// そうでなければタイマ（値kOutputFlushTimer）がタイムアウトしたときか、次に入力を待つときに行う
     void Print(const char* s, std::optional<size_t> len = std::nullopt);
+    /// 出力をまとめて描くタイマの値と、まとめる最長の時間（tick）
+    static const int kOutputFlushTimer = 2;
+    static const unsigned long kOutputFlushTicks = 10000;
+    /// たまっている出力を描いて、レイヤの再描画を要求する
+    void FlushOutput();
+    /// kOutputFlushTimerのタイマがタイムアウトした
+    void OnOutputFlushTimer();
     Task& UnderlyingTask() const { return task_; }
     int LastExitCode() const { return last_exit_code_; }
+    /// リダイレクトやパイプ、組み込みコマンドを解釈せずに、command_line（先頭はアプリの名前）でアプリを実行する
+    void ExecuteApp(fat::DirectoryEntry& file_entry, const std::string& command_line);
     // ターミナル画面全体を再描画
     void Redraw();
+    /// 遡って見られる行数を変える（それまでのスクロールバックは消える）
+    void SetScrollback(int lines);
+    int Scrollback() const { return lines_.empty() ? 0 : static_cast<int>(lines_.size()) - kRows; }
 
 private:
     std::shared_ptr<TopLevelWindow> window_;
@@ -78,16 +113,70 @@ private:
     /// 直前のアプリの終了コード
     int last_exit_code_{0};
 
+    /// 1行分の文字。0は空白、全角文字は2桁を使い右側にはkWideTailを入れる
+    using Line = std::array<char32_t, kColumns>;
+    static constexpr char32_t kWideTail = 0xffffffff;
+    /// 画面の行とスクロールバックをまとめたリングバッファ（ウィンドウがなければ空）
+    std::vector<Line> lines_{};
+    /// 画面の最上行が入っているlines_の添字
+    size_t top_{0};
+    /// 画面より上に残っている行数
+    int history_lines_{0};
+    /// 遡って表示している行数（0なら最新の画面）
+    int view_offset_{0};
+    /// 最後にウィンドウに描いた内容。これと違う桁だけを描き直す
+    std::array<Line, kRows> displayed_{};
+    /// まだ描いていない出力がある
+    bool output_pending_{false};
+    /// 出力を待つ間に消したカーソルの範囲（次の描画で再描画する）
+    Rectangle<int> pending_area_{};
+    /// 最後に出力を描いた時刻
+    unsigned long last_flush_tick_{0};
+    /// kOutputFlushTimerのタイマを登録済み
+    bool flush_timer_armed_{false};
+
+    /// 末尾に&を付けて起動したバックグラウンドジョブ
+    struct Job {
+        int number;
+        uint64_t task_id;
+        std::string command_line;
+    };
+    /// 起動順に並ぶ
+    std::deque<Job> jobs_{};
+    int next_job_number_{1};
+
     void DrawCursor(bool visible);
     Vector2D<int> CalcCursorPos() const;
-    /// 1行だけスクロール
+    /// 最新の画面のrow行目
+    Line& RowAt(int row);
+    /// 表示中（遡っていればその位置）の画面のrow行目
+    const Line& ViewRowAt(int row) const;
+    /// 1行だけスクロール。リングバッファの先頭を進めるだけで、描画はFlushCells()に任せる
     void Scroll1();
+    /// 表示中の画面のうち、前回描いた内容と違う桁だけをウィンドウに描き、描いた範囲を返す
+    /// 何度スクロールしていても、描くのはこの1回にまとまる
+    Rectangle<int> FlushCells();
+    /// 遡る行数を変え、描き直した範囲を返す
+    Rectangle<int> ScrollView(int delta);
+    /// たまっている出力をセルからウィンドウに描いてカーソルを表示し、描いた範囲を返す
+    Rectangle<int> RenderOutput();
     /// コマンド実行
     void ExecuteLine();
     /// 実行可能ファイル（カーネル本体に組み込まれていないアプリ）を読み込んで実行
     /// return : アプリの終了コード
     WithError<int> ExecuteFile(fat::DirectoryEntry& file_entry, char* command, char* first_arg);
+    /// コマンドラインを画面非表示の新規ターミナルで実行するタスクを起動し、そのIDを返す
+    /// 標準入力は空（キー入力はこのターミナルに残す）、標準出力と標準エラー出力はこのターミナルと同じ
+    uint64_t StartHiddenTerminal(const char* command_line);
+    /// 終わったジョブを報告して一覧から外す
+    void ReportFinishedJobs();
+    /// parallel [-j <n>] <command> ::: <arg>... を実行し、失敗したコマンドの数を返す
+    int RunParallel(char* args);
     void Print(char32_t c);
+    /// 表示できるASCII文字（CountPrintableAscii()で調べた範囲）だけの文字列を、1文字ずつ変換せずに桁へ書き込む
+    void PrintAscii(const char* s, size_t len);
+    /// カーソルを次の行の先頭に移す（最終行ならスクロールする）
+    void NewLine();
     /// コマンド履歴を辿る
     Rectangle<int> HistoryUpDown(int direction);
 };
@@ -104,30 +193,73 @@ public:
     size_t Write(const void* buf, size_t len) override;
     size_t Size() const override { return 0; }
     size_t Load(void* buf, size_t len, size_t offset) override;
+    /// キーが押されていれば true。キー入力はメッセージで届くので、通知の登録はしない
+    bool PollRead(uint64_t task_id) override;
 
 private:
     Terminal& term_;
 };
 
 /// パイプそのもの
+/// 送信元と送信先で共有するリングバッファを介してデータを受け渡す
+/// remapが有効なら、ページ境界からページ単位で書き込まれたデータはコピーせず、フレームごと送信先に渡す
 class PipeDescriptor : public IFileDescriptor {
 public:
-    explicit PipeDescriptor(Task& task);
-    /// 送信先にメッセージキューからデータを受信させる
+    /// リングバッファの大きさ（2の冪）
+    static const size_t kBufferSize = 64 * 1024;
+    /// 受け渡し途中にしておけるフレームの最大数
+    static const size_t kMaxFrames = 256;
+
+    PipeDescriptor(Task& task, bool remap = false);
+    ~PipeDescriptor() override;
+    /// バッファからデータを受信する。空なら書き込まれるまで待つ
+    /// フレームで受け取ったページは、読み出し先がページ境界ならそこへマップし直す
     size_t Read(void* buf, size_t len) override;
-    /// 送信先にデータ送信
+    WithError<size_t> ReadUser(void* buf, size_t len) override;
+    /// バッファにデータを書き込む。満杯なら読み出されるまで待つ
     size_t Write(const void* buf, size_t len) override;
     size_t Size() const override { return 0; }
     size_t Load(void* buf, size_t len, size_t offset) override { return 0; }
+    /// 読み出し先のページをマップし直すことがあるので、コピーする部分だけを自分で準備する
+    bool PreparesUserWrite() const override { return true; }
+    bool PollRead(uint64_t task_id) override;
 
     /// パイプは普通のファイルと違って末尾がないため、データがこれ以上存在しないことを伝える別の方法がこれ
     void FinishWrite();
+    /// 送信先がもう読み出さないことを伝え、待っている送信元を起こす
+    void FinishRead();
 
 private:
+    /// 送信元から受け取ったフレーム
+    struct Frame {
+        /// フレームの先頭が何バイト目のデータか
+        size_t pos;
+        void* frame;
+    };
+
+    /// 読めるようになるのを待っているタスクがいれば知らせる（lock_を取って呼ぶ）
+    void NotifyPollerLocked();
+
     /// データ送信先のタスク（パイプ右側のコマンド）
     Task& task_;
-    char data_[16];
-    size_t len_{0};
+    const bool remap_;
+    std::unique_ptr<uint8_t[]> buf_;
+    /// リングバッファから読み出した / 書き込んだ総バイト数（差がバッファ内のデータ量）
+    size_t buf_read_{0}, buf_write_{0};
+    std::array<Frame, kMaxFrames> frames_;
+    /// 読み出した / 受け取ったフレームの総数
+    size_t frame_read_{0}, frame_write_{0};
+    /// これまでに読み出した / 書き込んだ総バイト数（リングバッファとフレームの合計）
+    size_t read_pos_{0}, write_pos_{0};
+    /// 以下の位置とフラグ、待ち行列を保護する
+    /// 送信元と送信先はそれぞれ1タスクだけなので、データのコピーはロックの外で行い、位置の更新だけをロックの中で公開する
+    SpinLock lock_{};
+    /// バッファが空 / 満杯で待っているタスク
+    WaitQueue readers_{}, writers_{};
+    /// 読めるようになったらkFileReadyを送るタスク（0 : なし）
+    uint64_t poller_{0};
     /// 送信するデータがもうない -> true
     bool closed_{false};
+    /// 送信先が終了した -> true
+    bool reader_closed_{false};
 };
@@ -0,0 +1,210 @@
+/// カーネルの部品をホストで動かして、処理1回あたりの時間とメモリ確保の回数を測る
+/// Usage: ./bench.run [<FATのディスクイメージ>]
+/// 結果は1行に1つずつ「bench 名前 ops=回数 ns_per_op=... ops_per_sec=... allocs_per_op=...」の形で書く
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "fat.hpp"
+#include "frame_buffer.hpp"
+#include "graphics.hpp"
+#include "layer.hpp"
+#include "memory_manager.hpp"
+#include "timer.hpp"
+#include "window.hpp"
+
+namespace {
+  /// operator newが呼ばれた回数
+  size_t g_num_allocs = 0;
+}
+
+void* operator new(size_t size) {
+  ++g_num_allocs;
+  if (void* p = malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc{};
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+namespace {
+  /// func(i)をiterations回呼び、1回あたりops_per_call個の処理をしたとして結果を書く
+  template <class F>
+  void Run(const char* name, int iterations, int ops_per_call, F func) {
+    // 最初の数回は遅いので測らない
+    for (int i = 0; i < iterations / 100 + 1; ++i) {
+      func(i);
+    }
+
+    const size_t allocs_start = g_num_allocs;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+      func(i);
+    }
+    const auto end = std::chrono::steady_clock::now();
+    const size_t allocs = g_num_allocs - allocs_start;
+
+    const double ops = static_cast<double>(iterations) * ops_per_call;
+    const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    printf("bench %s ops=%.0f ns_per_op=%.1f ops_per_sec=%.0f allocs_per_op=%.3f\n",
+           name, ops, ns / ops, ops * 1e9 / ns, allocs / ops);
+  }
+
+  void BenchMemoryManager() {
+    // 大きいのでスタックには置かない
+    auto bitmap = std::make_unique<BitmapMemoryManager>();
+    bitmap->SetMemoryRange(FrameID{1}, FrameID{BitmapMemoryManager::kFrameCount});
+    Run("bitmap_alloc_free_1", 100000, 1, [&](int) {
+      auto [frame, err] = bitmap->Allocate(1);
+      bitmap->Free(frame, 1);
+    });
+    Run("bitmap_alloc_free_64", 100000, 1, [&](int) {
+      auto [frame, err] = bitmap->Allocate(64);
+      bitmap->Free(frame, 64);
+    });
+
+    // 空きが散らばっているときに、後ろの方まで探す
+    std::vector<FrameID> frames;
+    for (int i = 0; i < 4096; ++i) {
+      frames.push_back(bitmap->Allocate(1).value);
+    }
+    for (size_t i = 0; i < frames.size(); i += 2) {
+      bitmap->Free(frames[i], 1);
+    }
+    Run("bitmap_alloc_free_fragmented", 100000, 1, [&](int) {
+      auto [frame, err] = bitmap->Allocate(2);
+      bitmap->Free(frame, 2);
+    });
+
+    auto buddy = std::make_unique<BuddyMemoryManager>();
+    buddy->SetMemoryRange(FrameID{1}, FrameID{BuddyMemoryManager::kFrameCount});
+    Run("buddy_alloc_free_1", 100000, 1, [&](int) {
+      auto [frame, err] = buddy->Allocate(1);
+      buddy->Free(frame, 1);
+    });
+    Run("buddy_alloc_free_64", 100000, 1, [&](int) {
+      auto [frame, err] = buddy->Allocate(64);
+      buddy->Free(frame, 64);
+    });
+  }
+
+  void BenchTimerManager() {
+    // タイムアウトの通知にはタスクが要るので、登録と取り消しだけを測る
+    auto timers = std::make_unique<TimerManager>();
+    std::vector<uint64_t> ids(TimerManager::kMaxTimers / 2);
+    Run("timer_add_cancel", 1000, ids.size(), [&](int i) {
+      for (size_t j = 0; j < ids.size(); ++j) {
+        // 近いものから遠いものまで、ホイールのいろいろな段に入るようにする
+        const unsigned long timeout = 1ul << (j % 40);
+        ids[j] = timers->AddTimer(Timer{timeout, 1, 0}).value;
+      }
+      for (auto id : ids) {
+        timers->CancelTimer(id);
+      }
+    });
+  }
+
+  void BenchFAT(const char* image_path) {
+    FILE* fp = fopen(image_path, "rb");
+    if (fp == nullptr) {
+      printf("skip fat: failed to open %s\n", image_path);
+      return;
+    }
+    fseek(fp, 0, SEEK_END);
+    std::vector<uint8_t> image(ftell(fp));
+    fseek(fp, 0, SEEK_SET);
+    if (fread(image.data(), 1, image.size(), fp) != image.size()) {
+      printf("skip fat: failed to read %s\n", image_path);
+      fclose(fp);
+      return;
+    }
+    fclose(fp);
+    fat::Initialize(image.data());
+
+    // ルートディレクトリのファイルを探し、読み込む
+    std::vector<std::string> paths;
+    size_t max_size = 0;
+    const auto entries_per_cluster = fat::g_bytes_per_cluster / sizeof(fat::DirectoryEntry);
+    for (unsigned long cluster = fat::g_boot_volume_image->root_cluster;
+         !fat::IsEndOfClusterchain(cluster); cluster = fat::NextCluster(cluster)) {
+      auto dir = fat::GetSectorByCluster<fat::DirectoryEntry>(cluster);
+      for (size_t i = 0; i < entries_per_cluster && dir[i].name[0] != 0; ++i) {
+        if (dir[i].name[0] == 0xe5 || dir[i].attr == fat::Attribute::kLongName ||
+            (static_cast<uint8_t>(dir[i].attr) & static_cast<uint8_t>(fat::Attribute::kDirectory))) {
+          continue;
+        }
+        char name[13];
+        fat::FormatName(dir[i], name);
+        paths.push_back(std::string{"/"} + name);
+        max_size = std::max<size_t>(max_size, dir[i].file_size);
+      }
+    }
+    if (paths.empty()) {
+      printf("skip fat: no files in %s\n", image_path);
+      return;
+    }
+
+    Run("fat_find_file", 10000, paths.size(), [&](int) {
+      for (const auto& path : paths) {
+        fat::FindFile(path.c_str());
+      }
+    });
+    std::vector<uint8_t> buf(max_size);
+    Run("fat_load_file", 100, paths.size(), [&](int) {
+      for (const auto& path : paths) {
+        auto [entry, post_slash] = fat::FindFile(path.c_str());
+        fat::LoadFile(buf.data(), buf.size(), *entry);
+      }
+    });
+  }
+
+  void BenchLayerManager() {
+    // frame_bufferがnullptrなら、FrameBufferが自分でメモリを持つ（画面のない合成先）
+    FrameBufferConfig config{nullptr, 1024, 1024, 768, kPixelBGRResv8BitPerColor};
+    FrameBuffer screen;
+    screen.Initailize(config);
+
+    LayerManager layers;
+    layers.SetScreen(&screen);
+
+    std::vector<unsigned int> ids;
+    for (int i = 0; i < 8; ++i) {
+      auto window = std::make_shared<Window>(400, 300, config.pixel_format);
+      FillRectangle(*window->Writer(), {0, 0}, {400, 300}, {static_cast<uint8_t>(i * 30), 0x80, 0x40});
+      const auto id = layers.NewLayer().SetWindow(window).Move({i * 60, i * 40}).ID();
+      layers.UpDown(id, i);
+      ids.push_back(id);
+    }
+
+    Run("layer_draw_full", 200, 1, [&](int) {
+      layers.Draw({{0, 0}, {1024, 768}});
+    });
+    Run("layer_draw_window", 1000, 1, [&](int i) {
+      layers.Draw(ids[i % ids.size()]);
+    });
+    Run("layer_move_window", 1000, 1, [&](int i) {
+      layers.Move(ids.back(), {i % 600, i % 400});
+    });
+  }
+}
+
+int main(int argc, char** argv) {
+  BenchMemoryManager();
+  BenchTimerManager();
+  BenchFAT(argc >= 2 ? argv[1] : "../../disk.img");
+  BenchLayerManager();
+  return 0;
+}
@@ -11,7 +11,7 @@ void SetLogLevel(LogLevel level) {
   log_level = level;
 }
 
-int Log(LogLevel level, const char* format, ...) {
+int LogPrint(LogLevel level, const char* format, ...) {
   if (level > log_level) {
     return 0;
   }
@@ -25,3 +25,17 @@ int Log(LogLevel level, const char* format, ...) {
 
   return result;
 }
+
+bool ReadLog(uint64_t& seq, LogEntry& entry, uint64_t* num_lost) {
+  return false;
+}
+
+uint64_t NumLogs() {
+  return 0;
+}
+
+void StartLogRenderer() {
+}
+
+void FlushLog() {
+}
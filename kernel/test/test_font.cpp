@@ -0,0 +1,93 @@
+#include <CppUTest/CommandLineTestRunner.h>
+
+#include <cstring>
+
+#include "font.hpp"
+
+namespace {
+  /// CountPrintableAscii()と同じ結果になるはずの、1バイトずつ調べる版
+  size_t CountPrintableAsciiScalar(const char* s, size_t len) {
+    size_t i = 0;
+    while (i < len && 0x20 <= static_cast<uint8_t>(s[i]) && static_cast<uint8_t>(s[i]) <= 0x7f) {
+      i++;
+    }
+    return i;
+  }
+
+  /// ASCII文字の範囲で止まる文字の代表（制御文字、DELの次、UTF-8の先頭と継続バイト）
+  const char kStopBytes[] = {0x00, 0x0a, 0x1b, 0x1f, '\x80', '\xbf', '\xe3', '\xff'};
+  /// 16バイトの塊を2つまたいで、端数も調べる
+  const size_t kMaxTestLen = 16 * 3 + 5;
+} // namespace
+
+TEST_GROUP(CountPrintableAscii) {
+  /// 先頭をずらして、16バイト境界に揃っていない読み出しも調べる
+  char buf[kMaxTestLen + 16 + 1];
+
+  TEST_SETUP() {
+    memset(buf, 'a', sizeof(buf));
+  }
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(CountPrintableAscii, AllPrintable) {
+  for (size_t len = 0; len <= kMaxTestLen; len++) {
+    UNSIGNED_LONGS_EQUAL(len, CountPrintableAscii(buf, len));
+  }
+}
+
+TEST(CountPrintableAscii, PrintableBounds) {
+  // 0x20（空白）と0x7f（DEL）はそのまま描けるので数える
+  buf[5] = 0x20;
+  buf[21] = 0x7f;
+  UNSIGNED_LONGS_EQUAL(32, CountPrintableAscii(buf, 32));
+  buf[40] = 0x1f;
+  UNSIGNED_LONGS_EQUAL(40, CountPrintableAscii(buf, 48));
+}
+
+TEST(CountPrintableAscii, StopAtEveryPosition) {
+  for (char stop : kStopBytes) {
+    for (size_t len = 1; len <= kMaxTestLen; len++) {
+      for (size_t pos = 0; pos < len; pos++) {
+        memset(buf, 'a', sizeof(buf));
+        buf[pos] = stop;
+        UNSIGNED_LONGS_EQUAL(CountPrintableAsciiScalar(buf, len), CountPrintableAscii(buf, len));
+      }
+    }
+  }
+}
+
+TEST(CountPrintableAscii, StopAtTail) {
+  // 16バイトちょうどの倍数では、最後の1バイトもSSE2の比較で見つける
+  for (size_t len = 16; len <= kMaxTestLen; len += 16) {
+    buf[len - 1] = '\n';
+    UNSIGNED_LONGS_EQUAL(len - 1, CountPrintableAscii(buf, len));
+    buf[len - 1] = 'a';
+  }
+  // 端数の最後の1バイトは、1バイトずつのループで見つける
+  for (size_t len = 17; len <= kMaxTestLen; len += 16) {
+    buf[len - 1] = '\xe3';
+    UNSIGNED_LONGS_EQUAL(len - 1, CountPrintableAscii(buf, len));
+    buf[len - 1] = 'a';
+  }
+}
+
+TEST(CountPrintableAscii, IgnoreBytesAfterLen) {
+  for (size_t len = 0; len <= kMaxTestLen; len++) {
+    buf[len] = 0;
+    UNSIGNED_LONGS_EQUAL(len, CountPrintableAscii(buf, len));
+    buf[len] = 'a';
+  }
+}
+
+TEST(CountPrintableAscii, Unaligned) {
+  for (size_t offset = 1; offset < 16; offset++) {
+    for (size_t pos = 0; pos < kMaxTestLen; pos++) {
+      memset(buf, 'a', sizeof(buf));
+      buf[offset + pos] = '\x80';
+      UNSIGNED_LONGS_EQUAL(CountPrintableAsciiScalar(buf + offset, kMaxTestLen),
+                           CountPrintableAscii(buf + offset, kMaxTestLen));
+    }
+  }
+}
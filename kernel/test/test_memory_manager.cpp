@@ -65,3 +65,216 @@ TEST(MemoryManager, SetMemoryRange) {
   CHECK_EQUAL(0, frame1.value.ID());
   CHECK_EQUAL(10, frame2.value.ID());
 }
+
+TEST(MemoryManager, AllocateSkipFullLines) {
+  mgr.MarkAllocated(FrameID{0}, 3 * BitmapMemoryManager::kBitsPerMapLine + 5);
+  const auto frame1 = mgr.Allocate(1);
+  const auto frame2 = mgr.Allocate(2);
+
+  CHECK_EQUAL(3 * BitmapMemoryManager::kBitsPerMapLine + 5, frame1.value.ID());
+  CHECK_EQUAL(3 * BitmapMemoryManager::kBitsPerMapLine + 6, frame2.value.ID());
+}
+
+TEST(MemoryManager, AllocateNextFit) {
+  mgr.SetMemoryRange(FrameID{0}, FrameID{4});
+  const auto frame1 = mgr.Allocate(1);
+  const auto frame2 = mgr.Allocate(1);
+  mgr.Free(frame1.value, 1);
+  const auto frame3 = mgr.Allocate(1);
+  const auto frame4 = mgr.Allocate(1);
+  const auto frame5 = mgr.Allocate(1);
+  const auto frame6 = mgr.Allocate(1);
+
+  CHECK_EQUAL(0, frame1.value.ID());
+  CHECK_EQUAL(1, frame2.value.ID());
+  CHECK_EQUAL(2, frame3.value.ID());
+  CHECK_EQUAL(3, frame4.value.ID());
+  CHECK_EQUAL(0, frame5.value.ID());
+  CHECK_EQUAL(Error::kNoEnoughMemory, frame6.error.Cause());
+}
+
+TEST_GROUP(BuddyMemoryManager) {
+  BuddyMemoryManager mgr;
+
+  TEST_SETUP() {}
+
+  TEST_TEARDOWN() {}
+};
+
+TEST(BuddyMemoryManager, Allocate) {
+  const auto frame1 = mgr.Allocate(3);
+  const auto frame2 = mgr.Allocate(1);
+
+  CHECK_EQUAL(0, frame1.value.ID());
+  CHECK_EQUAL(3, frame2.value.ID());
+}
+
+TEST(BuddyMemoryManager, AllocateNoEnoughMemory) {
+  const auto frame1 = mgr.Allocate(BuddyMemoryManager::kFrameCount + 1);
+
+  CHECK_EQUAL(Error::kNoEnoughMemory, frame1.error.Cause());
+  CHECK_EQUAL(kNullFrame.ID(), frame1.value.ID());
+}
+
+TEST(BuddyMemoryManager, FreeCoalesce) {
+  const auto frame1 = mgr.Allocate(1);
+  const auto frame2 = mgr.Allocate(1);
+  mgr.Free(frame1.value, 1);
+  mgr.Free(frame2.value, 1);
+  const auto frame3 = mgr.Allocate(2);
+
+  CHECK_EQUAL(0, frame3.value.ID());
+  CHECK_EQUAL(2, mgr.Stat().allocated_frames);
+}
+
+TEST(BuddyMemoryManager, MarkAllocated) {
+  mgr.MarkAllocated(FrameID{61}, 3);
+  const auto frame1 = mgr.Allocate(64);
+  const auto frame2 = mgr.Allocate(1);
+
+  CHECK_EQUAL(64, frame1.value.ID());
+  CHECK_EQUAL(60, frame2.value.ID());
+}
+
+TEST(BuddyMemoryManager, SetMemoryRange) {
+  mgr.SetMemoryRange(FrameID{10}, FrameID{64});
+  const auto frame1 = mgr.Allocate(1);
+  const auto frame2 = mgr.Allocate(64);
+
+  CHECK_EQUAL(10, frame1.value.ID());
+  CHECK_EQUAL(Error::kNoEnoughMemory, frame2.error.Cause());
+  CHECK_EQUAL(54, mgr.Stat().total_frames);
+}
+
+TEST(BuddyMemoryManager, Fragmentation) {
+  mgr.SetMemoryRange(FrameID{0}, FrameID{16});
+  mgr.MarkAllocated(FrameID{4}, 1);
+  const auto stat = mgr.Fragmentation();
+
+  CHECK_EQUAL(15, stat.free_frames);
+  CHECK_EQUAL(8, stat.largest_free_frames);
+  CHECK_EQUAL(1, stat.free_blocks[0]);
+  CHECK_EQUAL(1, stat.free_blocks[1]);
+  CHECK_EQUAL(1, stat.free_blocks[2]);
+  CHECK_EQUAL(1, stat.free_blocks[3]);
+}
+
+namespace {
+  // 4GiBをまたぐ範囲 : kDMA32に128フレーム、kNormalに64フレーム
+  const size_t kZoneTestDMA32Frames = 128;
+  const size_t kZoneTestNormalFrames = 64;
+
+  template <class M>
+  void SetZoneTestRange(M& mgr) {
+    mgr.SetMemoryRange(FrameID{kDMA32EndFrame - kZoneTestDMA32Frames},
+                       FrameID{kDMA32EndFrame + kZoneTestNormalFrames});
+  }
+
+  /// 確保できなくなるまで1フレームずつ確保し、確保できたフレーム数を返す
+  template <class M>
+  size_t AllocateAll(M& mgr, MemoryZone zone) {
+    size_t n = 0;
+    while (!mgr.Allocate(1, zone).error) {
+      n++;
+    }
+    return n;
+  }
+}
+
+TEST(MemoryManager, ZonePreferNormal) {
+  SetZoneTestRange(mgr);
+  const auto frame1 = mgr.Allocate(1);
+  const auto frame2 = mgr.Allocate(4, MemoryZone::kDMA32);
+
+  CHECK_EQUAL(kDMA32EndFrame, frame1.value.ID());
+  CHECK_EQUAL(kDMA32EndFrame - kZoneTestDMA32Frames, frame2.value.ID());
+  CHECK_EQUAL(1, mgr.ZoneStat(MemoryZone::kNormal).allocated_frames);
+  CHECK_EQUAL(4, mgr.ZoneStat(MemoryZone::kDMA32).allocated_frames);
+}
+
+TEST(MemoryManager, ZoneFallbackKeepsReserve) {
+  SetZoneTestRange(mgr);
+  const auto frame1 = mgr.Allocate(kZoneTestNormalFrames);
+  const auto frame2 = mgr.Allocate(1);
+  const size_t reserve = DMA32ReserveFrames(kZoneTestDMA32Frames);
+  const size_t fallback = AllocateAll(mgr, MemoryZone::kNormal);
+  const auto frame3 = mgr.Allocate(1, MemoryZone::kDMA32);
+
+  CHECK_EQUAL(kDMA32EndFrame, frame1.value.ID());
+  CHECK_TRUE(frame2.value.ID() < kDMA32EndFrame);
+  CHECK_TRUE(reserve > 0);
+  CHECK_EQUAL(kZoneTestDMA32Frames - reserve - 1, fallback);
+  // 残しておいたフレームはkDMA32の確保には使える
+  CHECK_FALSE(frame3.error);
+  CHECK_EQUAL(reserve - 1, AllocateAll(mgr, MemoryZone::kDMA32));
+}
+
+TEST(MemoryManager, ZoneFree) {
+  SetZoneTestRange(mgr);
+  const auto frame1 = mgr.Allocate(kZoneTestNormalFrames);
+  const auto frame2 = mgr.Allocate(2);
+  mgr.Free(frame1.value, kZoneTestNormalFrames);
+  mgr.Free(frame2.value, 2);
+  const auto frame3 = mgr.Allocate(1);
+
+  CHECK_TRUE(frame2.value.ID() < kDMA32EndFrame);
+  CHECK_EQUAL(0, mgr.ZoneStat(MemoryZone::kDMA32).allocated_frames);
+  CHECK_EQUAL(1, mgr.ZoneStat(MemoryZone::kNormal).allocated_frames);
+  CHECK_TRUE(kDMA32EndFrame <= frame3.value.ID());
+}
+
+TEST(MemoryManager, ZoneNoNormalAllocatesLowFirst) {
+  mgr.SetMemoryRange(FrameID{0}, FrameID{4});
+  const auto frame1 = mgr.Allocate(4);
+
+  CHECK_EQUAL(0, frame1.value.ID());
+  CHECK_EQUAL(0, mgr.ZoneStat(MemoryZone::kNormal).total_frames);
+}
+
+TEST(BuddyMemoryManager, ZonePreferNormal) {
+  SetZoneTestRange(mgr);
+  const auto frame1 = mgr.Allocate(1);
+  const auto frame2 = mgr.Allocate(4, MemoryZone::kDMA32);
+
+  CHECK_EQUAL(kDMA32EndFrame, frame1.value.ID());
+  CHECK_TRUE(frame2.value.ID() < kDMA32EndFrame);
+  CHECK_EQUAL(1, mgr.ZoneStat(MemoryZone::kNormal).allocated_frames);
+  CHECK_EQUAL(4, mgr.ZoneStat(MemoryZone::kDMA32).allocated_frames);
+}
+
+TEST(BuddyMemoryManager, ZoneFallbackKeepsReserve) {
+  SetZoneTestRange(mgr);
+  const auto frame1 = mgr.Allocate(kZoneTestNormalFrames);
+  const auto frame2 = mgr.Allocate(1);
+  const size_t reserve = DMA32ReserveFrames(kZoneTestDMA32Frames);
+  const size_t fallback = AllocateAll(mgr, MemoryZone::kNormal);
+  const auto frame3 = mgr.Allocate(1, MemoryZone::kDMA32);
+
+  CHECK_EQUAL(kDMA32EndFrame, frame1.value.ID());
+  CHECK_TRUE(frame2.value.ID() < kDMA32EndFrame);
+  CHECK_EQUAL(kZoneTestDMA32Frames - reserve - 1, fallback);
+  CHECK_FALSE(frame3.error);
+  CHECK_EQUAL(reserve - 1, AllocateAll(mgr, MemoryZone::kDMA32));
+}
+
+TEST(BuddyMemoryManager, ZoneFree) {
+  SetZoneTestRange(mgr);
+  const auto frame1 = mgr.Allocate(kZoneTestNormalFrames);
+  const auto frame2 = mgr.Allocate(2);
+  mgr.Free(frame1.value, kZoneTestNormalFrames);
+  mgr.Free(frame2.value, 2);
+  const auto frame3 = mgr.Allocate(1);
+
+  CHECK_TRUE(frame2.value.ID() < kDMA32EndFrame);
+  CHECK_EQUAL(0, mgr.ZoneStat(MemoryZone::kDMA32).allocated_frames);
+  CHECK_EQUAL(1, mgr.ZoneStat(MemoryZone::kNormal).allocated_frames);
+  CHECK_EQUAL(kDMA32EndFrame, frame3.value.ID());
+}
+
+TEST(BuddyMemoryManager, ZoneNoNormalAllocatesLowFirst) {
+  mgr.SetMemoryRange(FrameID{0}, FrameID{4});
+  const auto frame1 = mgr.Allocate(4);
+
+  CHECK_EQUAL(0, frame1.value.ID());
+  CHECK_EQUAL(0, mgr.ZoneStat(MemoryZone::kNormal).total_frames);
+}
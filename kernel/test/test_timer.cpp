@@ -0,0 +1,244 @@
+#include <CppUTest/CommandLineTestRunner.h>
+
+#include <memory>
+#include <vector>
+
+#include "timer.hpp"
+
+namespace {
+  /// このタスクIDへの通知は、タスクが終了していたことにする
+  const uint64_t kExitedTask = 99;
+
+  struct Notified {
+    unsigned long timeout;
+    int value;
+  };
+  std::vector<Notified> notified;
+
+  Error RecordTimeout(const Timer& timer) {
+    notified.push_back({timer.Timeout(), timer.Value()});
+    if (timer.TaskID() == kExitedTask) {
+      return MAKE_ERROR(Error::kNoSuchTask);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  /// 段ごとのスロットの幅（kSlotBits = 6）
+  const unsigned long kLevel1 = 1ul << 6;
+  const unsigned long kLevel2 = 1ul << 12;
+  const unsigned long kLevel3 = 1ul << 18;
+  /// ホイールで扱える範囲（これより先はoverflow_につなぐ）
+  const unsigned long kWheelRange = 1ul << 24;
+} // namespace
+
+TEST_GROUP(TimerManager) {
+  std::unique_ptr<TimerManager> timers;
+
+  TEST_SETUP() {
+    timers = std::make_unique<TimerManager>(RecordTimeout);
+    notified.clear();
+  }
+
+  TEST_TEARDOWN() {}
+
+  void TickTo(unsigned long now) {
+    timers->Tick(now);
+  }
+
+  uint64_t Add(const Timer& timer) {
+    auto [id, err] = timers->AddTimer(timer);
+    CHECK_FALSE(err);
+    return id;
+  }
+
+  /// timeoutの直前までは通知されず、timeoutちょうどで1回だけ通知されることを調べる
+  void CheckExpiresAt(unsigned long timeout, int value) {
+    TickTo(timeout - 1);
+    UNSIGNED_LONGS_EQUAL(0, notified.size());
+    CHECK(timers->NextTimeout() <= timeout);
+    TickTo(timeout);
+    UNSIGNED_LONGS_EQUAL(1, notified.size());
+    UNSIGNED_LONGS_EQUAL(timeout, notified[0].timeout);
+    LONGS_EQUAL(value, notified[0].value);
+    notified.clear();
+  }
+
+  /// 上位の段のスロットの先頭で下位の段へ振り分け直され、ちょうどタイムアウト時刻に通知されることを調べる
+  void CheckCascade(unsigned long timeout) {
+    Add(Timer{timeout, 2, 1});
+    // 最下段へ振り分け直す時刻に止めてから、タイムアウトの直前まで進める
+    TickTo(timeout & ~(kLevel1 - 1));
+    UNSIGNED_LONGS_EQUAL(0, notified.size());
+    CheckExpiresAt(timeout, 2);
+  }
+};
+
+TEST(TimerManager, ExpireAtLevel0) {
+  const auto id = Add(Timer{10, 1, 1});
+  CheckExpiresAt(10, 1);
+  CHECK_FALSE(timers->FindTimer(id));
+  UNSIGNED_LONGS_EQUAL(std::numeric_limits<unsigned long>::max(), timers->NextTimeout());
+}
+
+TEST(TimerManager, CascadeFromLevel1) {
+  CheckCascade(kLevel1 * 3 + 7);
+}
+
+TEST(TimerManager, CascadeFromLevel2) {
+  CheckCascade(kLevel2 * 2 + kLevel1 * 5 + 9);
+}
+
+TEST(TimerManager, CascadeFromLevel3) {
+  CheckCascade(kLevel3 * 1 + kLevel2 * 4 + kLevel1 * 6 + 11);
+}
+
+TEST(TimerManager, ExpireInOrderAcrossLevels) {
+  // 段の違うタイマを1回のTick()でまとめて処理しても、タイムアウト時刻の順に通知する
+  const unsigned long timeouts[] = {
+    kLevel3 * 2 + 1, 5, kLevel2 + 3, kLevel1 + 1, kLevel3 + kLevel2 * 63 + kLevel1 * 63 + 63,
+  };
+  for (int i = 0; i < 5; i++) {
+    Add(Timer{timeouts[i], i, 1});
+  }
+  TickTo(kLevel3 * 3);
+  UNSIGNED_LONGS_EQUAL(5, notified.size());
+  for (size_t i = 1; i < notified.size(); i++) {
+    CHECK(notified[i - 1].timeout < notified[i].timeout);
+  }
+  UNSIGNED_LONGS_EQUAL(std::numeric_limits<unsigned long>::max(), timers->NextTimeout());
+}
+
+TEST(TimerManager, OverflowIsPlacedAgain) {
+  // ホイールの範囲を超えるタイマは、範囲の次の周の先頭で振り分け直される
+  const unsigned long timeout = kWheelRange * 2 + kLevel3 * 5 + kLevel1 * 3 + 1;
+  Add(Timer{timeout, 3, 1});
+  UNSIGNED_LONGS_EQUAL(kWheelRange, timers->NextTimeout());
+  TickTo(kWheelRange);
+  UNSIGNED_LONGS_EQUAL(0, notified.size());
+  CHECK(timers->NextTimeout() <= timeout);
+  TickTo(kWheelRange * 2);
+  UNSIGNED_LONGS_EQUAL(0, notified.size());
+  CheckExpiresAt(timeout, 3);
+}
+
+TEST(TimerManager, AddAfterTickStartsFromCurrentTick) {
+  // 時刻が進んだ後に登録したタイマは、処理済みの時刻を基準に振り分ける
+  TickTo(kLevel2 * 7 + 30);
+  const unsigned long timeout = kLevel2 * 8 + 2;
+  Add(Timer{timeout, 4, 1});
+  CheckExpiresAt(timeout, 4);
+}
+
+TEST(TimerManager, DueTimerExpiresOnNextTick) {
+  TickTo(100);
+  Add(Timer{50, 5, 1});
+  UNSIGNED_LONGS_EQUAL(100, timers->NextTimeout());
+  TickTo(100);
+  UNSIGNED_LONGS_EQUAL(1, notified.size());
+  UNSIGNED_LONGS_EQUAL(50, notified[0].timeout);
+}
+
+TEST(TimerManager, Cancel) {
+  // 同じスロットのリストの途中からも外せる
+  const auto id1 = Add(Timer{kLevel1 + 5, 1, 1});
+  const auto id2 = Add(Timer{kLevel1 + 5, 2, 1});
+  const auto id3 = Add(Timer{kLevel1 + 5, 3, 1});
+  const auto id4 = Add(Timer{kWheelRange + 1, 4, 1});
+  CHECK_FALSE(timers->CancelTimer(id2));
+  CHECK_FALSE(timers->FindTimer(id2));
+  CHECK_FALSE(timers->CancelTimer(id4));
+  UNSIGNED_LONGS_EQUAL(Error::kNoSuchTimer, timers->CancelTimer(id2).Cause());
+
+  TickTo(kWheelRange * 2);
+  UNSIGNED_LONGS_EQUAL(2, notified.size());
+  LONGS_EQUAL(1 + 3, notified[0].value + notified[1].value);
+  // タイムアウト済みのタイマは取り消せない
+  UNSIGNED_LONGS_EQUAL(Error::kNoSuchTimer, timers->CancelTimer(id1).Cause());
+  UNSIGNED_LONGS_EQUAL(Error::kNoSuchTimer, timers->CancelTimer(id3).Cause());
+}
+
+TEST(TimerManager, CancelLastTimerInSlot) {
+  // スロットが空になったら、次の処理時刻から外れる
+  const auto id = Add(Timer{kLevel2 + 1, 1, 1});
+  Add(Timer{kLevel3 + 1, 2, 1});
+  UNSIGNED_LONGS_EQUAL(kLevel2, timers->NextTimeout());
+  CHECK_FALSE(timers->CancelTimer(id));
+  UNSIGNED_LONGS_EQUAL(kLevel3, timers->NextTimeout());
+  CheckExpiresAt(kLevel3 + 1, 2);
+}
+
+TEST(TimerManager, StaleIDDoesNotCancelReusedNode) {
+  const auto old_id = Add(Timer{10, 1, 1});
+  CHECK_FALSE(timers->CancelTimer(old_id));
+  // 解放したノードを使い回しても、古いIDでは取り消せない
+  const auto new_id = Add(Timer{20, 2, 1});
+  CHECK(old_id != new_id);
+  UNSIGNED_LONGS_EQUAL(old_id & 0xffff, new_id & 0xffff);
+  UNSIGNED_LONGS_EQUAL(Error::kNoSuchTimer, timers->CancelTimer(old_id).Cause());
+  CHECK_TRUE(timers->FindTimer(new_id));
+  CheckExpiresAt(20, 2);
+}
+
+TEST(TimerManager, CancelTimersIf) {
+  Add(Timer{10, 1, 1});
+  Add(Timer{kLevel2, 2, 2});
+  Add(Timer{kWheelRange * 3, 3, 1});
+  timers->CancelTimersIf([](const Timer& timer) { return timer.TaskID() == 1; });
+  TickTo(kWheelRange * 4);
+  UNSIGNED_LONGS_EQUAL(1, notified.size());
+  LONGS_EQUAL(2, notified[0].value);
+}
+
+TEST(TimerManager, PeriodicRearm) {
+  const auto id = Add(Timer{100, 6, 1, 50});
+  CheckExpiresAt(100, 6);
+  auto timer = timers->FindTimer(id);
+  CHECK_TRUE(timer);
+  UNSIGNED_LONGS_EQUAL(150, timer->Timeout());
+  CheckExpiresAt(150, 6);
+  // 登録し直した周期タイマも、同じIDで取り消せる
+  CHECK_FALSE(timers->CancelTimer(id));
+  TickTo(1000);
+  UNSIGNED_LONGS_EQUAL(0, notified.size());
+}
+
+TEST(TimerManager, PeriodicSkipsMissedPeriods) {
+  const auto id = Add(Timer{100, 7, 1, 50});
+  TickTo(100);
+  notified.clear();
+  // 6周期分遅れても、通知は1回だけ。次のタイムアウトは周期に揃えたまま、処理した時刻より後にする
+  TickTo(420);
+  UNSIGNED_LONGS_EQUAL(1, notified.size());
+  UNSIGNED_LONGS_EQUAL(150, notified[0].timeout);
+  UNSIGNED_LONGS_EQUAL(450, timers->FindTimer(id)->Timeout());
+  notified.clear();
+  // ちょうど周期の境目まで遅れた場合も、その時刻は過ぎたものとして次の周期にする
+  TickTo(600);
+  UNSIGNED_LONGS_EQUAL(1, notified.size());
+  UNSIGNED_LONGS_EQUAL(450, notified[0].timeout);
+  UNSIGNED_LONGS_EQUAL(650, timers->FindTimer(id)->Timeout());
+}
+
+TEST(TimerManager, PeriodicStopsWhenTaskExited) {
+  const auto id = Add(Timer{100, 8, kExitedTask, 50});
+  TickTo(1000);
+  UNSIGNED_LONGS_EQUAL(1, notified.size());
+  CHECK_FALSE(timers->FindTimer(id));
+}
+
+TEST(TimerManager, WakeupTimerIsOneShot) {
+  const auto id = Add(Timer::WakeupTimer(30, 1));
+  TickTo(30);
+  UNSIGNED_LONGS_EQUAL(1, notified.size());
+  CHECK_FALSE(timers->FindTimer(id));
+}
+
+TEST(TimerManager, Full) {
+  for (int i = 0; i < TimerManager::kMaxTimers; i++) {
+    Add(Timer{static_cast<unsigned long>(i + 1), i, 1});
+  }
+  UNSIGNED_LONGS_EQUAL(Error::kFull, timers->AddTimer(Timer{1, 0, 1}).error.Cause());
+  TickTo(TimerManager::kMaxTimers);
+  UNSIGNED_LONGS_EQUAL(TimerManager::kMaxTimers, notified.size());
+  Add(Timer{TimerManager::kMaxTimers + 1, 0, 1});
+}
@@ -1,7 +1,19 @@
 #include "timer.hpp"
 
+#include <algorithm>
+#include <array>
+#include <csignal>
+#include <optional>
+
 #include "acpi.hpp"
+#include "asmfunc.h"
+#include "fpu.hpp"
 #include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "msr.hpp"
+#include "profiler.hpp"
+#include "smp.hpp"
 #include "task.hpp"
 
 namespace {
@@ -15,6 +27,153 @@ namespace {
     volatile uint32_t& g_current_count = *reinterpret_cast<uint32_t*>(0xfee00390);
     /// 分周比の設定（クロックをn分の1にする）。分周比を大きくするほどカウンタの減り方がゆっくりになる
     volatile uint32_t& g_divide_config = *reinterpret_cast<uint32_t*>(0xfee003e0);
+
+    /// 1tickあたりのTSCのカウント数と、tick 0のときのTSCの値
+    uint64_t g_tsc_per_tick = 0;
+    uint64_t g_tsc_base = 0;
+    /// 1秒あたりのTSCのカウント数（g_tsc_per_tickは整数に丸めてあるので、細かい時刻はこちらで求める）
+    uint64_t g_tsc_freq = 0;
+    /// TSC-deadlineモード（TSCが指定値に達したら割り込む）を使えるか
+    bool g_tsc_deadline_supported = false;
+    TimePage* g_time_page = nullptr;
+    /// 割り込みの間隔の下限と上限（割り込みが立て続けに来たり、カウンタがあふれたりしないように）
+    const unsigned long kMinTimerInterruptTicks = kTimerFreq / 20000; // 50マイクロ秒
+    const unsigned long kMaxTimerInterruptTicks = kTimerFreq;         // 1秒
+
+    /// CPUコアごとのタイマ割り込みの状態
+    /// slice_end : 実行中タスクのタイムスライスが終わる時刻
+    /// idle_end : ティックレスアイドルを抜ける時刻（idleがtrueの間だけ有効）
+    struct CPUTimer {
+        unsigned long slice_end;
+        unsigned long idle_end;
+        bool idle;
+    };
+    std::array<CPUTimer, kMaxCPUs> g_cpu_timers{};
+
+    /// deadlineに1回だけタイマ割り込みを発生させる
+    void StartOneShotLAPICTimer(unsigned long deadline, unsigned long now) {
+        g_initial_count = 0;
+        if (g_tsc_deadline_supported) {
+            g_lvt_timer = (0b100 << 16) | InterruptVector::kLAPICTimer;
+            WriteMSR(kIA32_TSC_DEADLINE, g_tsc_base + deadline * g_tsc_per_tick);
+            return;
+        }
+        g_divide_config = 0b1011; // divide 1:1
+        g_lvt_timer = InterruptVector::kLAPICTimer; // ワンショット
+        const auto count = (deadline - now) * g_lapic_timer_freq / kTimerFreq;
+        g_initial_count = std::clamp<unsigned long>(count, 1, kCountMax);
+    }
+
+    /// このCPUコアの次のタイマ割り込みを予約する
+    void ProgramNextTimerInterrupt(int cpu, unsigned long now) {
+        const auto& t = g_cpu_timers[cpu];
+        unsigned long deadline = t.idle ? t.idle_end : t.slice_end;
+        if (cpu == 0) { // 論理タイマはBSPだけが扱う
+            deadline = std::min(deadline, g_timer_manager->NextTimeout());
+        }
+        // プロファイル中は、実行している間の割り込みを一定の間隔より空けない
+        if (const auto period = ProfilePeriodTicks(); period && !t.idle) {
+            deadline = std::min(deadline, now + period);
+        }
+        deadline = std::clamp(deadline, now + kMinTimerInterruptTicks, now + kMaxTimerInterruptTicks);
+        StartOneShotLAPICTimer(deadline, now);
+    }
+    /// 1秒あたりのTSCとLocal APICタイマのカウント数
+    struct Frequencies {
+        uint64_t tsc;
+        unsigned long lapic;
+    };
+
+    /// 測定1回の長さと回数。揃わなければ従来どおり長く1回測る
+    const unsigned long kCalibrationMsec = 10;
+    const int kCalibrationSamples = 3;
+    const unsigned long kLongCalibrationMsec = 100;
+
+    /// msecミリ秒の間に進んだTSCとLocal APICタイマのカウントを測る
+    Frequencies MeasureFrequencies(unsigned long msec) {
+        StartLAPICTimer();
+        const uint64_t tsc_start = ReadTSC();
+        acpi::WaitMillisecondes(msec);
+        const auto elapsed = LAPICTimerElapsed();
+        const uint64_t tsc_elapsed = ReadTSC() - tsc_start;
+        StopLAPICTimer();
+        return {tsc_elapsed * 1000 / msec, static_cast<unsigned long>(elapsed) * 1000 / msec};
+    }
+
+    /// aとbの差がbのpermille/1000以内なら true
+    bool IsClose(uint64_t a, uint64_t b, uint64_t permille) {
+        return (a > b ? a - b : b - a) * 1000 <= b * permille;
+    }
+
+    /// CPUID 0x15（TSCとコアクリスタルの周波数比）と0x16（基本周波数）から周波数を求める
+    /// Local APICタイマは、0x15が載っているCPUではコアクリスタルの周波数で進む
+    std::optional<Frequencies> FrequenciesFromCPUID() {
+        std::array<uint32_t, 4> regs; // eax, ebx, ecx, edx
+        ReadCPUID(0, 0, regs.data());
+        const uint32_t max_leaf = regs[0];
+        if (max_leaf < 0x15) {
+            return std::nullopt;
+        }
+        ReadCPUID(0x15, 0, regs.data());
+        const uint64_t denominator = regs[0], numerator = regs[1];
+        uint64_t crystal = regs[2];
+        if (denominator == 0 || numerator == 0) {
+            return std::nullopt;
+        }
+        if (crystal == 0 && max_leaf >= 0x16) {
+            // クリスタルの周波数が載っていなければ、基本周波数（MHz）をTSCの周波数と見做して逆算する
+            ReadCPUID(0x16, 0, regs.data());
+            crystal = static_cast<uint64_t>(regs[0] & 0xffff) * 1000000 * denominator / numerator;
+        }
+        if (crystal == 0) {
+            return std::nullopt;
+        }
+        return Frequencies{crystal * numerator / denominator, static_cast<unsigned long>(crystal)};
+    }
+
+    /// TSCとLocal APICタイマの周波数を求める
+    /// CPUIDの値は、仮想マシンなどで実際と食い違うことがあるので、短く1回測って確かめてから使う
+    Frequencies CalibrateFrequencies() {
+        std::array<Frequencies, kCalibrationSamples> samples;
+        samples[0] = MeasureFrequencies(kCalibrationMsec);
+        if (auto cpuid = FrequenciesFromCPUID()) {
+            if (IsClose(cpuid->tsc, samples[0].tsc, 10) && IsClose(cpuid->lapic, samples[0].lapic, 10)) {
+                return *cpuid;
+            }
+            Log(kWarn, "CPUID frequencies do not match the measurement\n");
+        }
+
+        // 何回か測って中央値を取り、ばらつきが0.5%以内なら採用する
+        for (int i = 1; i < kCalibrationSamples; i++) {
+            samples[i] = MeasureFrequencies(kCalibrationMsec);
+        }
+        std::array<uint64_t, kCalibrationSamples> tsc;
+        std::array<unsigned long, kCalibrationSamples> lapic;
+        for (int i = 0; i < kCalibrationSamples; i++) {
+            tsc[i] = samples[i].tsc;
+            lapic[i] = samples[i].lapic;
+        }
+        std::sort(tsc.begin(), tsc.end());
+        std::sort(lapic.begin(), lapic.end());
+        const Frequencies median{tsc[kCalibrationSamples / 2], lapic[kCalibrationSamples / 2]};
+        if (IsClose(tsc.back(), tsc.front(), 5) && IsClose(lapic.back(), lapic.front(), 5)) {
+            return median;
+        }
+
+        Log(kWarn, "timer calibration is unstable. measuring for %lu msec\n", kLongCalibrationMsec);
+        return MeasureFrequencies(kLongCalibrationMsec);
+    }
+
+    Error NotifyTask(const Timer& timer) {
+        if (timer.WakeupOnly()) {
+            // 眠っているタスクを直接起こす。メッセージキューには何も積まない
+            return g_task_manager->Wakeup(timer.TaskID());
+        }
+        Message msg{Message::kTimerTimeout};
+        msg.arg.timer.timeout = timer.Timeout();
+        msg.arg.timer.value = timer.Value();
+        return g_task_manager->SendMessage(timer.TaskID(), msg);
+    }
 } // namespace
 
 void InitializeLAPICTimer() {
@@ -24,21 +183,44 @@ void InitializeLAPICTimer() {
     // 割り込み不許可
     g_lvt_timer = (0b010 << 16);
 
-    StartLAPICTimer();
-    // 100msec(0.1sec)待機
-    acpi::WaitMillisecondes(100);
-    const auto elapsed = LAPICTimerElapsed();
-    StopLAPICTimer();
-
+    const auto freqs = CalibrateFrequencies();
     // 1000msec(1sec)当たりのカウント数
-    g_lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+    g_lapic_timer_freq = freqs.lapic;
+    // 時刻はTSCで測る（タイマ割り込みの回数を数えるのではないので、割り込みを止めても狂わない）
+    g_tsc_freq = freqs.tsc;
+    g_tsc_per_tick = g_tsc_freq / kTimerFreq;
+    g_tsc_base = ReadTSC();
 
-    g_divide_config = 0b1011; // divide 1:1
-    // 割り込み許可
-    // Current Counter レジスタの値が0になるたびに割り込み発生
-    g_lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer;
-    // 約10msecごとに割り込みが発生するはず
-    g_initial_count = g_lapic_timer_freq / kTimerFreq;
+    if (auto [frame, err] = g_memory_manager->Allocate(1); err) {
+        Log(kError, "failed to allocate time page: %s\n", err.Name());
+    } else {
+        g_time_page = reinterpret_cast<TimePage*>(frame.Frame());
+        *g_time_page = {g_tsc_base, g_tsc_per_tick, kTimerFreq, 0, g_tsc_freq};
+    }
+
+    std::array<uint32_t, 4> regs; // eax, ebx, ecx, edx
+    ReadCPUID(1, 0, regs.data());
+    g_tsc_deadline_supported = (regs[2] >> 24) & 1;
+    // CPUID 0x80000007 EDX bit8 : invariant TSC（省電力で周波数が変わってもTSCの進む速さは変わらない）
+    ReadCPUID(0x80000007, 0, regs.data());
+    if (((regs[3] >> 8) & 1) == 0) {
+        Log(kWarn, "invariant TSC is not supported. time may drift\n");
+    }
+
+    StartLAPICTimerInterrupt();
+}
+
+void StartLAPICTimerInterrupt() {
+    StartTimeSlice(kTaskTimerPeriod);
+}
+
+void StartTimeSlice(unsigned long ticks) {
+    const int cpu = CurrentCPU();
+    const auto now = g_timer_manager->CurrentTick();
+    g_cpu_timers[cpu].slice_end = now + ticks;
+    if (!g_cpu_timers[cpu].idle) {
+        ProgramNextTimerInterrupt(cpu, now);
+    }
 }
 
 void StartLAPICTimer() {
@@ -53,47 +235,278 @@ void StopLAPICTimer() {
     g_initial_count = 0;
 }
 
-Timer::Timer(unsigned long timeout, int value, uint64_t task_id) : timeout_{timeout}, value_{value}, task_id_{task_id} {
+Timer::Timer(unsigned long timeout, int value, uint64_t task_id, unsigned long period)
+    : timeout_{timeout}, value_{value}, task_id_{task_id}, period_{period} {
+}
+
+Timer Timer::WakeupTimer(unsigned long timeout, uint64_t task_id) {
+    Timer timer{timeout, 0, task_id};
+    timer.wakeup_only_ = true;
+    return timer;
+}
+
+TimerManager::TimerManager() : TimerManager(NotifyTask) {
+}
+
+TimerManager::TimerManager(Notifier notify) : notify_{notify} {
+    for (int i = kMaxTimers - 1; i >= 0; i--) {
+        nodes_[i].generation = 1;
+        nodes_[i].next = free_nodes_;
+        free_nodes_ = &nodes_[i];
+    }
+}
+
+unsigned long TimerManager::CurrentTick() const {
+    if (g_tsc_per_tick == 0) { // 周波数の測定前
+        return 0;
+    }
+    return (ReadTSC() - g_tsc_base) / g_tsc_per_tick;
+}
+
+const void* TimePageFrame() {
+    return g_time_page;
 }
 
-TimerManager::TimerManager() {
-    // 番兵
-    timers_.push(Timer{std::numeric_limits<unsigned long>::max(), 0, 0});
+uint64_t CurrentTimeNs() {
+    // 64bitで掛け算すると、TSCが数GHzなら数秒であふれてしまう
+    const unsigned __int128 elapsed = ReadTSC() - g_tsc_base;
+    return static_cast<uint64_t>(elapsed * 1000000000 / g_tsc_freq);
 }
 
-bool TimerManager::Tick() {
-    tick_++;
+uint64_t TSCFrequency() {
+    return g_tsc_freq;
+}
+
+void TimerManager::Tick() {
+    const auto now = CurrentTick();
+    Tick(now);
+    if (g_time_page) {
+        __atomic_store_n(&g_time_page->tick, now, __ATOMIC_RELAXED);
+    }
+}
 
-    bool task_timer_timeout = false;
-    // タイムアウト処理
-    while (true) {
-        const auto& t = timers_.top();
-        // 先頭がまだタイムアウトしていない場合にループから抜ける
-        if (t.Timeout() > tick_) {
+void TimerManager::Tick(unsigned long now) {
+    SpinLockGuard lock{lock_};
+    while (due_) {
+        Node* node = due_;
+        due_ = node->next;
+        Expire(node, now);
+    }
+
+    // タイマがつながっている次のスロットへ順に飛び、空のスロットは1つずつ調べない
+    while (tick_ < now) {
+        int level, slot;
+        const auto next = NextSlotTime(level, slot);
+        if (next > now) {
+            // スロットの先頭より前までなら、振り分け直さずに現在時刻を進めてよい
+            tick_ = now;
             break;
         }
+        tick_ = next;
+
+        Node* node;
+        if (level < kLevels) {
+            node = wheel_[level][slot];
+            wheel_[level][slot] = nullptr;
+            occupied_[level] &= ~(1ul << slot);
+        } else {
+            node = overflow_;
+            overflow_ = nullptr;
+        }
+        // 最下段ならすべてタイムアウトしている。上位の段なら残りを下位の段へ振り分け直す
+        while (node) {
+            Node* next_node = node->next;
+            if (node->timer.Timeout() <= tick_) {
+                Expire(node, now);
+            } else {
+                Place(node);
+            }
+            node = next_node;
+        }
+    }
+    UpdateNextTimeout();
+}
+
+WithError<uint64_t> TimerManager::AddTimer(const Timer& timer) {
+    SpinLockGuard lock{lock_};
+    Node* node = free_nodes_;
+    if (node == nullptr) {
+        return {0, MAKE_ERROR(Error::kFull)};
+    }
+    free_nodes_ = node->next;
+
+    const bool earliest = timer.Timeout() < next_timeout_;
+    node->timer = timer;
+    node->used = true;
+    Place(node);
+    UpdateNextTimeout();
+
+    // 予約済みの割り込みでは間に合わないかもしれないので、予約し直す
+    // Local APICタイマで割り込みを受けるのはg_timer_managerだけ
+    if (earliest && this == g_timer_manager && CurrentCPU() == 0) {
+        ProgramNextTimerInterrupt(0, CurrentTick());
+    }
+    const uint64_t id = (static_cast<uint64_t>(node->generation) << 16) | (node - &nodes_[0]);
+    return {id, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error TimerManager::CancelTimer(uint64_t id) {
+    SpinLockGuard lock{lock_};
+    const size_t index = id & 0xffff;
+    if (index >= nodes_.size()) {
+        return MAKE_ERROR(Error::kNoSuchTimer);
+    }
+    Node* node = &nodes_[index];
+    if (!node->used || node->generation != (id >> 16)) { // タイムアウト済みか、取り消し済み
+        return MAKE_ERROR(Error::kNoSuchTimer);
+    }
+    Unlink(node);
+    FreeNode(node);
+    UpdateNextTimeout();
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+std::optional<Timer> TimerManager::FindTimer(uint64_t id) const {
+    SpinLockGuard lock{lock_};
+    const size_t index = id & 0xffff;
+    if (index >= nodes_.size()) {
+        return std::nullopt;
+    }
+    const Node& node = nodes_[index];
+    if (!node.used || node.generation != (id >> 16)) {
+        return std::nullopt;
+    }
+    return node.timer;
+}
+
+unsigned long TimerManager::NextTimeout() const {
+    return __atomic_load_n(&next_timeout_, __ATOMIC_RELAXED);
+}
+
+void TimerManager::UpdateNextTimeout() {
+    unsigned long next = tick_;
+    if (due_ == nullptr) {
+        int level, slot;
+        next = NextSlotTime(level, slot);
+    }
+    __atomic_store_n(&next_timeout_, next, __ATOMIC_RELAXED);
+}
 
-        if (t.Value() == kTaskTimerValue) {
-            task_timer_timeout = true;
-            timers_.pop();
-            timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue, kMainTaskID});
+unsigned long TimerManager::NextSlotTime(int& level, int& slot) const {
+    // 下位の段のスロットほど早い（上位の段のタイマは、いまの下位の桁が一巡した後にタイムアウトする）
+    for (level = 0; level < kLevels; level++) {
+        if (occupied_[level] == 0) {
             continue;
         }
+        // つながっているスロットは、どれもtick_のその段の桁より大きい
+        slot = __builtin_ctzl(occupied_[level]);
+        const int shift = kSlotBits * level;
+        const unsigned long upper = tick_ & ~((1ul << (shift + kSlotBits)) - 1);
+        return upper | (static_cast<unsigned long>(slot) << shift);
+    }
+    slot = 0;
+    if (overflow_) {
+        // ホイールで扱える範囲の次の周の先頭で振り分け直す
+        const int shift = kSlotBits * kLevels;
+        return ((tick_ >> shift) + 1) << shift;
+    }
+    return std::numeric_limits<unsigned long>::max();
+}
 
-        Message msg{Message::kTimerTimeout};
-        msg.arg.timer.timeout = t.Timeout();
-        msg.arg.timer.value = t.Value();
-        // タイマに記録されているタスクへタイムアウトを通知
-        g_task_manager->SendMessage(t.TaskID(), msg);
+void TimerManager::Place(Node* node) {
+    const auto timeout = node->timer.Timeout();
+    // タイムアウトとtick_が食い違う最上位のビットで段を決める
+    const unsigned long diff = timeout ^ tick_;
+    Node** head;
+    if (timeout <= tick_) {
+        node->level = kLevels + 1;
+        node->slot = 0;
+        head = &due_;
+    } else if (diff >> (kSlotBits * kLevels)) {
+        node->level = kLevels;
+        node->slot = 0;
+        head = &overflow_;
+    } else {
+        const int level = (63 - __builtin_clzl(diff)) / kSlotBits;
+        const int slot = (timeout >> (kSlotBits * level)) & (kSlots - 1);
+        node->level = level;
+        node->slot = slot;
+        head = &wheel_[level][slot];
+        occupied_[level] |= 1ul << slot;
+    }
+    node->prev = nullptr;
+    node->next = *head;
+    if (*head) {
+        (*head)->prev = node;
+    }
+    *head = node;
+}
+
+TimerManager::Node** TimerManager::ListHead(const Node* node) {
+    if (node->level == kLevels) {
+        return &overflow_;
+    } else if (node->level == kLevels + 1) {
+        return &due_;
+    }
+    return &wheel_[node->level][node->slot];
+}
+
+void TimerManager::Unlink(Node* node) {
+    Node** head = ListHead(node);
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        *head = node->next;
+    }
+    if (node->next) {
+        node->next->prev = node->prev;
+    }
+    if (*head == nullptr && node->level < kLevels) {
+        occupied_[node->level] &= ~(1ul << node->slot);
+    }
+}
+
+void TimerManager::Expire(Node* node, unsigned long now) {
+    // タイマに記録されているタスクへタイムアウトを通知
+    const auto err = notify_(node->timer);
 
-        timers_.pop();
+    auto& timer = node->timer;
+    // 通知先のタスクが終了していたら、周期タイマも止める
+    if (timer.wakeup_only_ || timer.period_ == 0 || err.Cause() == Error::kNoSuchTask) {
+        FreeNode(node);
+        return;
     }
+    // 処理が遅れて何周期分も過ぎていたら、過ぎた分はまとめて飛ばす（溜まった分を立て続けに通知しない）
+    // tick_は処理中のスロットの時刻なので、処理を終える時刻nowと比べる
+    timer.timeout_ += timer.period_;
+    if (timer.timeout_ <= now) {
+        timer.timeout_ += (now - timer.timeout_) / timer.period_ * timer.period_ + timer.period_;
+    }
+    Place(node);
+}
+
+void TimerManager::FreeNode(Node* node) {
+    node->used = false;
+    node->generation++;
+    node->next = free_nodes_;
+    free_nodes_ = node;
+}
 
-    return task_timer_timeout;
+void EnterTicklessIdle(unsigned long max_ticks) {
+    const int cpu = CurrentCPU();
+    const auto now = g_timer_manager->CurrentTick();
+    g_cpu_timers[cpu].idle = true;
+    g_cpu_timers[cpu].idle_end = now + max_ticks;
+    ProgramNextTimerInterrupt(cpu, now);
 }
 
-void TimerManager::AddTimer(const Timer& timer) {
-    timers_.push(timer);
+void ExitTicklessIdle() {
+    const int cpu = CurrentCPU();
+    if (!g_cpu_timers[cpu].idle) {
+        return;
+    }
+    g_cpu_timers[cpu].idle = false;
+    ProgramNextTimerInterrupt(cpu, g_timer_manager->CurrentTick());
 }
 
 TimerManager* g_timer_manager;
@@ -101,11 +514,44 @@ unsigned long g_lapic_timer_freq;
 
 /// ctx_stack : 割り込みフレームの情報を使って構築したコンテキスト構造体）
 extern "C" void LAPICTimerOnInterrupt(const TaskContext& ctx_stack) {
-    const bool task_timer_timeout = g_timer_manager->Tick();
+    // タスクを切り替えると戻ってこないので、出口の記録はそれぞれの経路で行う
+    const uint64_t irq_entry = RecordIRQEntry(InterruptVector::kLAPICTimer);
+    // FPUのレジスタは割り込まれたタスクのものかもしれないので、使う前に保存させる
+    ProtectFPUFromInterrupt();
+    const int cpu = CurrentCPU();
+    const bool woke_from_idle = g_cpu_timers[cpu].idle;
+    g_cpu_timers[cpu].idle = false;
+    if (!woke_from_idle) {
+        RecordProfileSample(ctx_stack);
+    }
+
+    // 論理タイマはBSPだけが進める
+    if (cpu == 0) {
+        g_timer_manager->Tick();
+    }
     // タスク切り替えの前にコールしておかないと、タスク切り替え後にタイマ割り込みがこなくなる
     NotifyEndOfInterrupt();
 
-    if (task_timer_timeout) {
+    // アイドルから起きたときは、タイムアウトで起きたタスクに（APなら他のCPUコアから奪ったタスクに）すぐ切り替える
+    // 切り替え先のタイムスライスを始めるときに次の割り込みが予約される
+    const auto now = g_timer_manager->CurrentTick();
+    // 強制終了を求められたスレッドがアプリを実行していたら、アプリに戻らずに終わる（システムコールを呼ばずに回り続けるもの）
+    if ((ctx_stack.cs & 3) == 3) {
+        auto& task = g_task_manager->CurrentTask();
+        if (task.ExitRequested()) {
+            ProgramNextTimerInterrupt(cpu, now);
+            ResumeFPUTask();
+            RecordIRQExit(InterruptVector::kLAPICTimer, irq_entry);
+            __asm__("sti");
+            ExitApp(task.OSStackPointer(), 128 + SIGKILL);
+        }
+    }
+    if (woke_from_idle || now >= g_cpu_timers[cpu].slice_end) {
+        RecordIRQExit(InterruptVector::kLAPICTimer, irq_entry);
         g_task_manager->SwitchTask(ctx_stack);
+        return;
     }
+    ProgramNextTimerInterrupt(cpu, now);
+    ResumeFPUTask();
+    RecordIRQExit(InterruptVector::kLAPICTimer, irq_entry);
 }
@@ -4,13 +4,27 @@
 /// Local APICタイマ : Local APICのタイマ。CPUコア1つにつき1つのみ搭載。
 #pragma once
 
+#include "error.hpp"
 #include "message.hpp"
+#include "spinlock.hpp"
+#include <array>
 #include <cstdint>
 #include <limits>
-#include <queue>
-#include <vector>
+#include <optional>
 
 void InitializeLAPICTimer();
+/// このCPUコアのタイマ割り込みを開始する（InitializeLAPICTimer()で測った周波数を使う。APからも呼ぶ）
+/// タイマ割り込みは周期的には起こさず、毎回次に必要な時刻を予約し直す
+/// （タイムスライスの終わりか、次のタイマのタイムアウトの早い方）
+void StartLAPICTimerInterrupt();
+/// 現在のCPUコアで、今からticksの間を実行中タスクのタイムスライスとし、次のタイマ割り込みを予約し直す
+void StartTimeSlice(unsigned long ticks);
+/// ティックレスアイドル : 実行するタスクがない間はタイムスライスの区切りの割り込みも止め、
+/// 次のタイマのタイムアウト（最大max_ticks後）まで割り込みが来ないようにする
+/// アイドルタスクが割り込みを禁止した状態で呼び、直後にsti; hltする
+void EnterTicklessIdle(unsigned long max_ticks);
+/// ティックレスアイドルを抜け、通常のタイマ割り込みの予約に戻す。ティックレスアイドル中でなければ何もしない
+void ExitTicklessIdle();
 void StartLAPICTimer();
 uint32_t LAPICTimerElapsed();
 void StopLAPICTimer();
@@ -18,10 +32,15 @@ void StopLAPICTimer();
 /// Local APICタイマの1カウントを基準とした、論理的なタイマ
 class Timer {
 public:
-    Timer(unsigned long timeout, int value, uint64_t task_id);
+    /// periodが0でなければ、タイムアウトするたびにperiod後のタイムアウトを登録し直す（周期タイマ）
+    Timer(unsigned long timeout, int value, uint64_t task_id, unsigned long period = 0);
+    /// タイムアウトしたらメッセージを送らずに、タスクを起こすだけのワンショットタイマ（SleepIfBefore()で眠ったタスク用）
+    static Timer WakeupTimer(unsigned long timeout, uint64_t task_id);
     unsigned long Timeout() const { return timeout_; }
     int Value() const { return value_; }
     uint64_t TaskID() const { return task_id_; }
+    unsigned long Period() const { return period_; }
+    bool WakeupOnly() const { return wakeup_only_; }
 
 private:
     /// タイムアウト時刻
@@ -31,37 +50,143 @@ private:
     int value_;
     /// タイムアウトメッセージの通知先
     uint64_t task_id_;
-};
+    /// 周期タイマの周期（ワンショットタイマなら0）
+    unsigned long period_;
+    bool wakeup_only_{false};
 
-/// タイマー優先度を比較。タイムアウトが遠いほど優先度低
-inline bool operator<(const Timer& lhs, const Timer& rhs) {
-    return lhs.Timeout() > rhs.Timeout();
-}
+    friend class TimerManager;
+};
 
 /// タイマの割り込み回数を管理
+/// タイマは階層型タイマホイールで管理する
+/// タイムアウト時刻をkSlotBitsビットずつの桁に分け、現在時刻と食い違う最上位の桁の段の、その桁の値のスロットにつなぐ
+/// 時刻が進んで上位の段のスロットの先頭に達したら、そのスロットのタイマを下位の段へ振り分け直す
+/// 追加・取り消しはO(1)、タイムアウト処理はならしO(1)。ノードは固定長の配列から取り出すので、追加でメモリ確保をしない
+/// 管理情報はlock_で保護するので、どのタスクや割り込みハンドラから呼んでもよい
+/// タイムアウトの通知（タスクのロック）はlock_を持ったまま行うので、タスクのロックを持ったままlock_を取ってはならない
 class TimerManager {
 public:
+    /// 同時に登録できるタイマの最大数
+    static const int kMaxTimers = 1024;
+    /// タイムアウトを通知する関数。通知先のタスクが終了していたらkNoSuchTaskを返す
+    using Notifier = Error (*)(const Timer& timer);
+
+    /// タイムアウトをタスクへ通知する（WakeupOnly()ならタスクを起こし、それ以外はメッセージを送る）
     TimerManager();
-    void AddTimer(const Timer& timer);
-    /// タスク切り替え用タイマがタイムアウト : true
-    bool Tick();
-    unsigned long CurrentTick() const { return tick_; }
+    /// タイムアウトをnotifyで通知する（テストで通知を記録するため）
+    explicit TimerManager(Notifier notify);
+    /// タイマを登録し、取り消しに使うIDを返す
+    /// g_timer_managerにBSPで登録し、予約済みの割り込みより早くタイムアウトするなら予約し直す
+    WithError<uint64_t> AddTimer(const Timer& timer);
+    /// タイムアウトする前のタイマを取り消す
+    Error CancelTimer(uint64_t id);
+    /// タイムアウトする前のタイマの複製を返す（タイムアウト済みか取り消し済みならnullopt）
+    std::optional<Timer> FindTimer(uint64_t id) const;
+    /// pred(timer)がtrueを返すタイマをすべて取り消す（アプリの終了時など。全ノードを調べるので頻繁には呼ばない）
+    template <class F>
+    void CancelTimersIf(F pred) {
+        SpinLockGuard lock{lock_};
+        for (auto& node : nodes_) {
+            if (node.used && pred(node.timer)) {
+                Unlink(&node);
+                FreeNode(&node);
+            }
+        }
+        UpdateNextTimeout();
+    }
+    /// タイマ割り込みごとに呼び、経過時間までのタイムアウト処理を行う
+    void Tick();
+    /// 時刻nowまでのタイムアウト処理を行う（nowが処理済みの時刻以前なら、登録済みで期限を過ぎたタイマだけ処理する）
+    void Tick(unsigned long now);
+    /// 起動してからのtick数（1tick = 1 / kTimerFreq 秒）
+    /// TSCから求めるので、タイマ割り込みを止めている間も進む
+    unsigned long CurrentTick() const;
+    /// 次にタイマを処理すべき時刻（なければunsigned longの最大値）
+    /// 上位の段のタイマはスロットの先頭の時刻を返すので、実際のタイムアウトより早いことがある
+    /// タイマ割り込みの予約（タスクのロックを持っていることがある）から呼ぶので、lock_は取らずに控えの値を返す
+    unsigned long NextTimeout() const;
 
 private:
-    // タイマ割り込み回数
-    volatile unsigned long tick_{0};
-    std::priority_queue<Timer> timers_{};
+    static const int kSlotBits = 6;
+    static const int kSlots = 1 << kSlotBits;
+    /// 段の数。kSlotBits * kLevelsビット（約16秒）より先のタイマはoverflow_につなぐ
+    static const int kLevels = 4;
+
+    struct Node {
+        Timer timer{0, 0, 0};
+        Node* prev;
+        Node* next;
+        /// 使い回しても古いIDで取り消せないよう、解放するたびに増やす
+        uint32_t generation;
+        /// つながっている段（kLevelsならoverflow_、kLevels + 1ならdue_）とスロット
+        uint8_t level, slot;
+        bool used;
+    };
+
+    Notifier notify_;
+    mutable SpinLock lock_{};
+    /// 最後にTick()でタイムアウト処理をした時刻
+    unsigned long tick_{0};
+    /// NextTimeout()が返す値。lock_を取って更新する
+    unsigned long next_timeout_{std::numeric_limits<unsigned long>::max()};
+    std::array<Node, kMaxTimers> nodes_{};
+    Node* free_nodes_{nullptr};
+    std::array<std::array<Node*, kSlots>, kLevels> wheel_{};
+    /// 段ごとの、タイマがつながっているスロットのビットマップ
+    std::array<uint64_t, kLevels> occupied_{};
+    Node* overflow_{nullptr};
+    /// 登録した時点で処理済みの時刻以前だったタイマ。次のTick()ですぐにタイムアウトさせる
+    Node* due_{nullptr};
+
+    /// tick_を基準に、nodeをスロットにつなぐ
+    void Place(Node* node);
+    Node** ListHead(const Node* node);
+    /// nodeをつながっているスロットから外す
+    void Unlink(Node* node);
+    /// タイムアウトを通知し、ワンショットタイマならnodeを解放、周期タイマならnowより後の次のタイムアウトを登録する
+    void Expire(Node* node, unsigned long now);
+    void FreeNode(Node* node);
+    /// タイマがつながっている最も早いスロットの先頭の時刻
+    unsigned long NextSlotTime(int& level, int& slot) const;
+    /// タイマをつなぎ替えた後に呼び、next_timeout_を求め直す
+    void UpdateNextTimeout();
 };
 
 extern TimerManager* g_timer_manager;
 /// Local APICタイマの周波数（1秒あたりのカウント数）
 extern unsigned long g_lapic_timer_freq;
-/// 1秒間にTimerManager::Tick()をコールする回数
-const int kTimerFreq = 100;
+/// 1秒あたりのtick数（1tick = 1マイクロ秒）
+/// 時刻はTSCから求め、タイマ割り込みはタイムアウトの時刻に合わせて予約するので、tickを細かくしても割り込みは増えない
+const int kTimerFreq = 1000000;
 
-/// タスク切り替え用タイマの周期
+/// タスク切り替えの既定の周期（タイムスライス）
 /// 0.02secでタイムアウト
 const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
 /// タスク切り替え用タイマの値（他のタイマとの識別用）
+/// タスク切り替えはTimerManagerが直接管理するので、アプリのタイマがこの値を使わないようにするためだけに残している
 /// 正の数値に修正（syscall.cpp::CreateTimer()を参照）
 const int kTaskTimerValue = std::numeric_limits<int>::max();
+
+/// アプリに読み込み専用でマップする時刻のページ（apps/syscall.hのTimePageと同じ並び）
+/// TSCを読めば、システムコールを呼ばずに tick = (TSC - tsc_base) / tsc_per_tick で現在時刻が分かる
+struct TimePage {
+    uint64_t tsc_base;
+    uint64_t tsc_per_tick;
+    /// 1秒あたりのtick数
+    uint64_t timer_freq;
+    /// 最後にタイマ割り込みを処理したときのtick
+    uint64_t tick;
+    /// 1秒あたりのTSCのカウント数（ナノ秒単位の時刻を求めるのに使う）
+    uint64_t tsc_freq;
+};
+/// 時刻のページをマップするアドレス（アプリのスタックのすぐ下）
+const uint64_t kTimePageAddr = 0xfffffffffffee000;
+/// 時刻のページの物理フレーム。用意できなかったら nullptr
+const void* TimePageFrame();
+
+/// 起動してからのナノ秒数（単調増加）
+/// tickより細かく測れるので、処理時間の計測に使う
+/// TSCがCPUの周波数によらず一定の速さで進む（invariant TSC）ことを前提にしている
+uint64_t CurrentTimeNs();
+/// 1秒あたりのTSCのカウント数
+uint64_t TSCFrequency();
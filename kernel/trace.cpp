@@ -0,0 +1,102 @@
+#include "trace.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "asmfunc.h"
+#include "smp.hpp"
+#include "syscall.hpp"
+#include "timer.hpp"
+
+namespace {
+    /// CPUコア1つあたりに残せる記録の数（2の冪）
+    const uint64_t kRecordsPerCPU = 16384;
+    const uint32_t kTraceFileVersion = 1;
+
+    struct TraceRing {
+        std::unique_ptr<TraceRecord[]> records;
+        /// これまでに書き込んだ数。records[head % kRecordsPerCPU] が次に書き込む場所
+        uint64_t head;
+    };
+
+    std::array<TraceRing, kMaxCPUs> g_rings{};
+} // namespace
+
+bool g_trace_enabled = false;
+
+void RecordTrace(TraceEvent event, uint32_t arg0, uint64_t arg1) {
+    const int cpu = CurrentCPU();
+    TraceRing& ring = g_rings[cpu];
+    if (!ring.records) { // トレースを始めた後に起動したCPUコア
+        return;
+    }
+    // 書き込むのはこのCPUコアだけなので、割り込みが入れ子になっても場所が重ならなければよい
+    const uint64_t pos = __atomic_fetch_add(&ring.head, 1, __ATOMIC_RELAXED);
+    ring.records[pos % kRecordsPerCPU] = {
+        ReadTSC(), static_cast<uint8_t>(event), static_cast<uint8_t>(cpu), 0, arg0, arg1};
+}
+
+void EnableTrace(bool enable) {
+    if (enable) {
+        __atomic_store_n(&g_trace_enabled, false, __ATOMIC_RELEASE);
+        for (int cpu = 0; cpu < NumCPUs(); ++cpu) {
+            if (!g_rings[cpu].records) {
+                g_rings[cpu].records = std::make_unique<TraceRecord[]>(kRecordsPerCPU);
+            }
+            g_rings[cpu].head = 0;
+        }
+    }
+    EnableSyscallTrace(enable);
+    __atomic_store_n(&g_trace_enabled, enable, __ATOMIC_RELEASE);
+}
+
+bool TraceEnabled() {
+    return __atomic_load_n(&g_trace_enabled, __ATOMIC_ACQUIRE);
+}
+
+WithError<uint64_t> DumpTrace(IFileDescriptor& out) {
+    const bool was_enabled = TraceEnabled();
+    if (was_enabled) {
+        EnableTrace(false);
+    }
+
+    std::vector<TraceRecord> records;
+    int num_cpus = 0;
+    for (const auto& ring : g_rings) {
+        if (!ring.records) {
+            continue;
+        }
+        ++num_cpus;
+        // 一周していれば、最も古い記録は次に書き込む場所にある
+        const uint64_t head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+        for (uint64_t i = head - std::min(head, kRecordsPerCPU); i < head; ++i) {
+            records.push_back(ring.records[i % kRecordsPerCPU]);
+        }
+    }
+    std::stable_sort(records.begin(), records.end(),
+                     [](const TraceRecord& a, const TraceRecord& b) { return a.tsc < b.tsc; });
+
+    TraceFileHeader header{};
+    memcpy(header.magic, "MKTRACE", 8);
+    header.version = kTraceFileVersion;
+    header.record_size = sizeof(TraceRecord);
+    header.tsc_freq = TSCFrequency();
+    header.num_cpus = num_cpus;
+    header.num_records = records.size();
+
+    const size_t bytes = records.size() * sizeof(TraceRecord);
+    const bool written = out.Write(&header, sizeof(header)) == sizeof(header) &&
+                         out.Write(records.data(), bytes) == bytes;
+    // 書き出した記録は捨てずに、続きから記録する
+    if (was_enabled) {
+        EnableSyscallTrace(true);
+        __atomic_store_n(&g_trace_enabled, true, __ATOMIC_RELEASE);
+    }
+    if (!written) {
+        return {0, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+    return {records.size(), MAKE_ERROR(Error::kSuccess)};
+}
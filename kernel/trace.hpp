@@ -0,0 +1,59 @@
+/// イベントトレース : タスク切り替えや割り込みなどの順序を、CPUコアごとのリングバッファに小さな固定長の記録で残す
+/// 記録は実行中のCPUコアのリングにだけ書き、書き込み位置をアトミックに進めるのでロックを取らない（割り込みが入れ子になってもよい）
+/// リングが一周したら古い記録から上書きする。トレースを止めている間は、記録の場所でフラグを1つ調べるだけ
+/// DumpTrace()で書き出すファイルの形式 : TraceFileHeader の後ろに TraceRecord が時刻順に num_records 個並ぶ
+
+#pragma once
+
+#include <cstdint>
+
+#include "error.hpp"
+#include "file.hpp"
+
+enum class TraceEvent : uint8_t {
+    kSwitch = 1,   // arg0 : 切り替え先のタスクID、arg1 : 切り替え元のタスクID
+    kWakeup,       // arg0 : 起こしたタスクID、arg1 : 優先度（-1なら変えない）
+    kSleep,        // arg0 : 眠らせたタスクID
+    kSyscallEnter, // arg0 : システムコールの番号、arg1 : 第1引数
+    kSyscallExit,  // arg0 : システムコールの番号、arg1 : 上位32ビットがエラー番号、下位32ビットが戻り値
+    kPageFault,    // arg0 : エラーコード、arg1 : フォルトしたアドレス
+    kIRQ,          // arg0 : 割り込みベクタ
+    kLayer,        // arg0 : レイヤの操作（LayerOperation）、arg1 : レイヤID
+};
+
+struct TraceRecord {
+    uint64_t tsc;
+    uint8_t event; // TraceEvent
+    uint8_t cpu;
+    uint16_t reserved;
+    uint32_t arg0;
+    uint64_t arg1;
+} __attribute__((packed));
+static_assert(sizeof(TraceRecord) == 24);
+
+struct TraceFileHeader {
+    char magic[8]; // "MKTRACE\0"
+    uint32_t version;
+    uint32_t record_size;
+    /// 1秒あたりのTSCのカウント数
+    uint64_t tsc_freq;
+    uint32_t num_cpus;
+    uint32_t reserved;
+    uint64_t num_records;
+} __attribute__((packed));
+
+/// トレースを始める（リングがなければ作り、前の記録は捨てる）、または止める
+void EnableTrace(bool enable);
+bool TraceEnabled();
+/// リングに残っている記録を時刻順にoutへ書き出し、書き出した数を返す（書き出す間はトレースを止める）
+WithError<uint64_t> DumpTrace(IFileDescriptor& out);
+
+extern bool g_trace_enabled;
+void RecordTrace(TraceEvent event, uint32_t arg0, uint64_t arg1);
+
+/// トレース中なら記録を1つ残す
+inline void Trace(TraceEvent event, uint32_t arg0, uint64_t arg1 = 0) {
+    if (__builtin_expect(__atomic_load_n(&g_trace_enabled, __ATOMIC_RELAXED), 0)) {
+        RecordTrace(event, arg0, arg1);
+    }
+}
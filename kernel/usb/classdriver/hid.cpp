@@ -44,7 +44,15 @@ namespace usb {
         this, initialize_phase_, len);
     if (initialize_phase_ == 1) {
       initialize_phase_ = 2;
-      return ParentDevice()->InterruptIn(ep_interrupt_in_, buf_.data(), in_packet_size_);
+      ParentDevice()->BeginTransferBatch();
+      for (auto& in_buf : in_bufs_) {
+        if (auto err = ParentDevice()->InterruptIn(ep_interrupt_in_, in_buf.data(), in_packet_size_)) {
+          ParentDevice()->EndTransferBatch();
+          return err;
+        }
+      }
+      ParentDevice()->EndTransferBatch();
+      return MAKE_ERROR(Error::kSuccess);
     }
 
     return MAKE_ERROR(Error::kNotImplemented);
@@ -52,9 +60,17 @@ namespace usb {
 
   Error HIDBaseDriver::OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) {
     if (ep_id.IsIn()) {
+      // 転送は積んだ順に完了するので，レポートの順序は保たれる
+      auto in_buf = std::find_if(in_bufs_.begin(), in_bufs_.end(), [buf](const auto& b) {
+        return b.data() == buf;
+      });
+      if (in_buf == in_bufs_.end()) {
+        return MAKE_ERROR(Error::kInvalidPhase);
+      }
+      std::copy_n(in_buf->begin(), std::min<size_t>(len, kInBufferSize), buf_.begin());
       OnDataReceived();
       std::copy_n(buf_.begin(), len, previous_buf_.begin());
-      return ParentDevice()->InterruptIn(ep_interrupt_in_, buf_.data(), in_packet_size_);
+      return ParentDevice()->InterruptIn(ep_interrupt_in_, in_buf->data(), in_packet_size_);
     }
 
     return MAKE_ERROR(Error::kNotImplemented);
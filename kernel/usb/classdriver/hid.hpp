@@ -21,6 +21,10 @@ namespace usb {
 
     virtual Error OnDataReceived() = 0;
     const static size_t kBufferSize = 1024;
+    /** 同時に積んでおく割り込み IN 転送の数．1 つの完了を処理している間も次の周期の転送が待っている */
+    const static int kNumInFlightTransfers = 4;
+    /** 1 つの転送で受け取る最大のバイト数（boot protocol のレポートは 8 バイト以下） */
+    const static size_t kInBufferSize = 64;
     const std::array<uint8_t, kBufferSize>& Buffer() const { return buf_; }
     const std::array<uint8_t, kBufferSize>& PreviousBuffer() const { return previous_buf_; }
 
@@ -32,5 +36,7 @@ namespace usb {
     int initialize_phase_{0};
 
     std::array<uint8_t, kBufferSize> buf_{}, previous_buf_{};
+    /** 割り込み IN 転送のデータを xHC が書き込む先．受け取ったら buf_ に写してから積み直す */
+    std::array<std::array<uint8_t, kInBufferSize>, kNumInFlightTransfers> in_bufs_{};
   };
 }
@@ -0,0 +1,291 @@
+#include "usb/classdriver/mass_storage.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "logger.hpp"
+#include "timer.hpp"
+#include "usb/device.hpp"
+#include "usb/memory.hpp"
+#include "usb/xhci/device.hpp"
+#include "usb/xhci/xhci.hpp"
+
+namespace {
+  const uint32_t kCBWSignature = 0x43425355; // "USBC"
+  const uint32_t kCSWSignature = 0x53425355; // "USBS"
+  const uint8_t kCBWFlagIn = 0x80;
+
+  // SCSI コマンドの操作コード
+  const uint8_t kSCSIRequestSense = 0x03;
+  const uint8_t kSCSIInquiry = 0x12;
+  const uint8_t kSCSIReadCapacity10 = 0x25;
+  const uint8_t kSCSIRead10 = 0x28;
+  const uint8_t kSCSIWrite10 = 0x2a;
+
+  // 初期化の段階
+  const int kPhaseFailed = -1;
+  const int kPhaseInquiry = 1;
+  const int kPhaseReadCapacity = 2;
+  const int kPhaseRequestSense = 3;
+  const int kPhaseReady = 4;
+
+  /** 電源投入直後の UNIT ATTENTION などで READ CAPACITY が失敗したときに再試行する回数 */
+  const int kMaxReadCapacityRetries = 4;
+
+  /** 1 つのコマンドの完了を待つ時間（5 秒） */
+  const unsigned long kCommandTimeoutTicks = kTimerFreq * 5ul;
+
+  /** 連続したバッファを読み書きするとき，1 つのコマンドで扱う最大のバイト数
+   *
+   * 64KiB 境界ごとに TRB が分かれるので，TRB の数は 1MiB / 64KiB + 1 = 17 個に収まる．
+   */
+  const size_t kMaxContiguousBytes = 1024 * 1024;
+
+  /** READ(10) / WRITE(10) の転送ブロック数は 16 ビット */
+  const size_t kMaxBlocksPerCommand = 0xffff;
+
+  uint32_t ReadBE32(const uint8_t* p) {
+    return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 |
+           static_cast<uint32_t>(p[2]) << 8 | p[3];
+  }
+
+  void WriteBE32(uint8_t* p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+  }
+}
+
+namespace usb {
+  MassStorageDriver::MassStorageDriver(Device* dev, int interface_index)
+      : ClassDriver{dev}, interface_index_{interface_index} {
+  }
+
+  void* MassStorageDriver::operator new(size_t size) {
+    // CBW や CSW をそのまま DMA に使うので，物理アドレスと一致する USB 用のメモリに置く
+    return AllocMem(sizeof(MassStorageDriver), 64, 4096);
+  }
+
+  void MassStorageDriver::operator delete(void* ptr) noexcept {
+    FreeMem(ptr);
+  }
+
+  Error MassStorageDriver::Initialize() {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error MassStorageDriver::SetEndpoint(const EndpointConfig& config) {
+    if (config.ep_type == EndpointType::kBulk && config.ep_id.IsIn()) {
+      ep_bulk_in_ = config.ep_id;
+    } else if (config.ep_type == EndpointType::kBulk && !config.ep_id.IsIn()) {
+      ep_bulk_out_ = config.ep_id;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error MassStorageDriver::OnEndpointsConfigured() {
+    if (ep_bulk_in_.Address() == 0 || ep_bulk_out_.Address() == 0) {
+      initialize_phase_ = kPhaseFailed;
+      return MAKE_ERROR(Error::kInvalidDescriptor);
+    }
+
+    const uint8_t inquiry[6] = {kSCSIInquiry, 0, 0, 0, 36, 0};
+    const void* buf = init_buf_.data();
+    initialize_phase_ = kPhaseInquiry;
+    return Submit(inquiry, sizeof(inquiry), true, &buf, 1, 36);
+  }
+
+  Error MassStorageDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                                              const void* buf, int len) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error MassStorageDriver::OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) {
+    if (buf != &csw_) {
+      // CBW やデータの TD の完了．コマンド全体の結果は CSW で分かる
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    command_failed_ = len != sizeof(csw_) || csw_.signature != kCSWSignature ||
+                      csw_.tag != tag_ || csw_.status != 0;
+    __atomic_store_n(&command_done_, true, __ATOMIC_RELEASE);
+
+    if (initialize_phase_ != kPhaseReady && initialize_phase_ != kPhaseFailed) {
+      return OnInitCommandCompleted();
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error MassStorageDriver::OnInitCommandCompleted() {
+    const void* buf = init_buf_.data();
+
+    if (initialize_phase_ == kPhaseInquiry) {
+      if (command_failed_) {
+        initialize_phase_ = kPhaseFailed;
+        return MAKE_ERROR(Error::kTransferFailed);
+      }
+      // ベンダ名（8..15）と製品名（16..31）
+      char vendor[9]{}, product[17]{};
+      memcpy(vendor, &init_buf_[8], 8);
+      memcpy(product, &init_buf_[16], 16);
+      Log(kInfo, "usb-storage: %s %s\n", vendor, product);
+      read_capacity_retries_ = 0;
+    } else if (initialize_phase_ == kPhaseReadCapacity) {
+      if (!command_failed_) {
+        const uint32_t last_lba = ReadBE32(&init_buf_[0]);
+        block_size_ = ReadBE32(&init_buf_[4]);
+        num_blocks_ = static_cast<uint64_t>(last_lba) + 1;
+        if (block_size_ == 0 || block_size_ > 4096) {
+          initialize_phase_ = kPhaseFailed;
+          return MAKE_ERROR(Error::kInvalidFormat);
+        }
+        initialize_phase_ = kPhaseReady;
+        RegisterBlockDevice(this, "usb-storage");
+        return MAKE_ERROR(Error::kSuccess);
+      }
+      if (++read_capacity_retries_ > kMaxReadCapacityRetries) {
+        initialize_phase_ = kPhaseFailed;
+        return MAKE_ERROR(Error::kTransferFailed);
+      }
+      // センスデータを読み出して CHECK CONDITION を解除してから再試行する
+      const uint8_t request_sense[6] = {kSCSIRequestSense, 0, 0, 0, 18, 0};
+      initialize_phase_ = kPhaseRequestSense;
+      return Submit(request_sense, sizeof(request_sense), true, &buf, 1, 18);
+    }
+
+    // INQUIRY か REQUEST SENSE が終わったら READ CAPACITY(10)
+    const uint8_t read_capacity[10] = {kSCSIReadCapacity10};
+    initialize_phase_ = kPhaseReadCapacity;
+    return Submit(read_capacity, sizeof(read_capacity), true, &buf, 1, 8);
+  }
+
+  Error MassStorageDriver::Submit(const uint8_t* cb, int cb_length, bool dir_in,
+                                  const void* const* bufs, int num_bufs, int len_per_buf) {
+    const uint32_t data_length = num_bufs * len_per_buf;
+    cbw_ = {kCBWSignature, ++tag_, data_length,
+            static_cast<uint8_t>(dir_in ? kCBWFlagIn : 0), 0,
+            static_cast<uint8_t>(cb_length), {}};
+    memcpy(cbw_.cb, cb, cb_length);
+    __atomic_store_n(&command_done_, false, __ATOMIC_RELEASE);
+
+    // CBW，データ，CSW の TD を一度に積んでしまい，デバイスとのやり取りを待たずに進めさせる
+    // ドアベルはエンドポイントごとに最後に 1 度だけ鳴らす
+    ParentDevice()->BeginTransferBatch();
+    const void* cbw = &cbw_;
+    auto err = ParentDevice()->BulkOut(ep_bulk_out_, &cbw, 1, sizeof(cbw_));
+    if (!err && data_length > 0) {
+      err = dir_in
+          ? ParentDevice()->BulkIn(ep_bulk_in_, const_cast<void* const*>(bufs),
+                                   num_bufs, len_per_buf)
+          : ParentDevice()->BulkOut(ep_bulk_out_, bufs, num_bufs, len_per_buf);
+    }
+    if (!err) {
+      void* csw = &csw_;
+      err = ParentDevice()->BulkIn(ep_bulk_in_, &csw, 1, sizeof(csw_));
+    }
+    ParentDevice()->EndTransferBatch();
+    return err;
+  }
+
+  Error MassStorageDriver::WaitCommand() {
+    const auto deadline = g_timer_manager->CurrentTick() + kCommandTimeoutTicks;
+    while (!__atomic_load_n(&command_done_, __ATOMIC_ACQUIRE)) {
+      if (g_timer_manager->CurrentTick() >= deadline) {
+        // 積んだ TD が残ったままなので，以降のコマンドは受け付けない
+        Log(kWarn, "usb-storage: command %u timed out\n", tag_);
+        initialize_phase_ = kPhaseFailed;
+        return MAKE_ERROR(Error::kTransferFailed);
+      }
+      // xHCI の割り込みはワーカタスクが処理するが，それを待たずに自分で処理する
+      xhci::ProcessEvents();
+      __builtin_ia32_pause();
+    }
+    if (command_failed_) {
+      Log(kWarn, "usb-storage: command %u failed (status %u)\n", tag_, csw_.status);
+      return MAKE_ERROR(Error::kTransferFailed);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error MassStorageDriver::Transfer(bool dir_in, uint64_t lba, const void* const* bufs,
+                                    size_t num_bufs, size_t blocks_per_buf) {
+    const size_t num_blocks = num_bufs * blocks_per_buf;
+    if (num_blocks == 0 || num_blocks > kMaxBlocksPerCommand ||
+        lba + num_blocks > num_blocks_ || lba + num_blocks > 0x100000000ul) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    uint8_t cb[10]{};
+    cb[0] = dir_in ? kSCSIRead10 : kSCSIWrite10;
+    WriteBE32(&cb[2], lba);
+    cb[7] = num_blocks >> 8;
+    cb[8] = num_blocks;
+
+    SpinLockGuard lock{lock_};
+    if (initialize_phase_ != kPhaseReady) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+    if (auto err = Submit(cb, sizeof(cb), dir_in, bufs, num_bufs,
+                          blocks_per_buf * block_size_)) {
+      // CBW だけが積まれている可能性があるので，以降のコマンドは受け付けない
+      initialize_phase_ = kPhaseFailed;
+      return err;
+    }
+    return WaitCommand();
+  }
+
+  Error MassStorageDriver::Read(uint64_t lba, void* buf, size_t num_blocks) {
+    if (initialize_phase_ != kPhaseReady) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+    // 大きな読み込みは，1 つのコマンドに収まる大きさに区切る
+    const size_t blocks_per_command =
+        std::min(kMaxContiguousBytes / block_size_, kMaxBlocksPerCommand);
+    auto p = reinterpret_cast<uint8_t*>(buf);
+    while (num_blocks > 0) {
+      const size_t n = std::min(num_blocks, blocks_per_command);
+      const void* chunk = p;
+      if (auto err = Transfer(true, lba, &chunk, 1, n)) {
+        return err;
+      }
+      lba += n;
+      p += n * block_size_;
+      num_blocks -= n;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error MassStorageDriver::Write(uint64_t lba, const void* buf, size_t num_blocks) {
+    if (initialize_phase_ != kPhaseReady) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+    const size_t blocks_per_command =
+        std::min(kMaxContiguousBytes / block_size_, kMaxBlocksPerCommand);
+    auto p = reinterpret_cast<const uint8_t*>(buf);
+    while (num_blocks > 0) {
+      const size_t n = std::min(num_blocks, blocks_per_command);
+      const void* chunk = p;
+      if (auto err = Transfer(false, lba, &chunk, 1, n)) {
+        return err;
+      }
+      lba += n;
+      p += n * block_size_;
+      num_blocks -= n;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error MassStorageDriver::WriteScatter(uint64_t lba, const void* const* bufs, size_t num_bufs,
+                                        size_t blocks_per_buf) {
+    if (num_bufs == 0 || num_bufs > MaxScatter()) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    return Transfer(false, lba, bufs, num_bufs, blocks_per_buf);
+  }
+
+  size_t MassStorageDriver::MaxScatter() const {
+    // 64KiB 以下のバッファは 64KiB 境界を跨いでも TRB 2 つで済む
+    return xhci::Device::kMaxTRBsPerTransfer / 2;
+  }
+}
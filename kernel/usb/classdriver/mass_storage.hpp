@@ -0,0 +1,95 @@
+/**
+ * @file usb/classdriver/mass_storage.hpp
+ *
+ * USB mass storage class driver (Bulk-Only Transport, SCSI transparent command set).
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "block.hpp"
+#include "spinlock.hpp"
+#include "usb/classdriver/base.hpp"
+
+namespace usb {
+  /** @brief USB メモリなどをブロックデバイスとして見せるクラスドライバ．
+   *
+   * 初期化（INQUIRY と READ CAPACITY）はイベント処理の中で非同期に進め，終わると
+   * RegisterBlockDevice() で登録する．Read / Write は CBW，データ，CSW の TD を
+   * まとめて転送リングに積み，CSW が返るまで自分で xHCI のイベントを処理しながら待つ．
+   * エンドポイントが STALL したときの回復（Reset Recovery）には対応していない．
+   */
+  class MassStorageDriver : public ClassDriver, public ::BlockDevice {
+   public:
+    MassStorageDriver(Device* dev, int interface_index);
+
+    void* operator new(size_t size);
+    void operator delete(void* ptr) noexcept;
+
+    Error Initialize() override;
+    Error SetEndpoint(const EndpointConfig& config) override;
+    Error OnEndpointsConfigured() override;
+    Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                             const void* buf, int len) override;
+    Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) override;
+
+    Error Read(uint64_t lba, void* buf, size_t num_blocks) override;
+    Error Write(uint64_t lba, const void* buf, size_t num_blocks) override;
+    Error WriteScatter(uint64_t lba, const void* const* bufs, size_t num_bufs,
+                       size_t blocks_per_buf) override;
+    /** 1 回の WriteScatter で渡せるバッファの数（それぞれ 64KiB 以下であること） */
+    size_t MaxScatter() const override;
+    size_t BlockSize() const override { return block_size_; }
+    uint64_t NumBlocks() const override { return num_blocks_; }
+
+   private:
+    struct CommandBlockWrapper {
+      uint32_t signature;
+      uint32_t tag;
+      uint32_t data_transfer_length;
+      uint8_t flags;
+      uint8_t lun;
+      uint8_t cb_length;
+      uint8_t cb[16];
+    } __attribute__((packed));
+
+    struct CommandStatusWrapper {
+      uint32_t signature;
+      uint32_t tag;
+      uint32_t data_residue;
+      uint8_t status;
+    } __attribute__((packed));
+
+    /** コマンドを 1 つ転送リングに積む．bufs はデータ（それぞれ len_per_buf バイト） */
+    Error Submit(const uint8_t* cb, int cb_length, bool dir_in,
+                 const void* const* bufs, int num_bufs, int len_per_buf);
+    /** Submit したコマンドの CSW が返るまで待つ */
+    Error WaitCommand();
+    /** READ(10) / WRITE(10) を発行して完了を待つ */
+    Error Transfer(bool dir_in, uint64_t lba, const void* const* bufs, size_t num_bufs,
+                   size_t blocks_per_buf);
+    /** 初期化中のコマンドが完了したら次のコマンドを発行する */
+    Error OnInitCommandCompleted();
+
+    const int interface_index_;
+    EndpointID ep_bulk_in_;
+    EndpointID ep_bulk_out_;
+    int initialize_phase_{0};
+    int read_capacity_retries_{0};
+
+    uint32_t block_size_{0};
+    uint64_t num_blocks_{0};
+
+    /** Read / Write を 1 つずつ処理する */
+    SpinLock lock_;
+    uint32_t tag_{0};
+    bool command_done_{false};
+    bool command_failed_{false};
+
+    alignas(64) CommandBlockWrapper cbw_{};
+    alignas(64) CommandStatusWrapper csw_{};
+    alignas(64) std::array<uint8_t, 64> init_buf_{};
+  };
+}
@@ -2,6 +2,7 @@
 
 #include "usb/classdriver/base.hpp"
 #include "usb/classdriver/keyboard.hpp"
+#include "usb/classdriver/mass_storage.hpp"
 #include "usb/classdriver/mouse.hpp"
 #include "usb/descriptor.hpp"
 #include "usb/setupdata.hpp"
@@ -69,6 +70,11 @@ namespace {
                 return mouse_driver;
             }
         }
+        if (if_desc.interface_class == 8 &&         // mass storage
+            if_desc.interface_sub_class == 6 &&     // SCSI transparent command set
+            if_desc.interface_protocol == 0x50) {   // bulk-only transport
+            return new usb::MassStorageDriver{dev, if_desc.interface_number};
+        }
         return nullptr;
     }
 
@@ -127,6 +133,15 @@ namespace usb {
         return MAKE_ERROR(Error::kSuccess);
     }
 
+    Error Device::BulkIn(EndpointID ep_id, void* const* bufs, int num_bufs, int len_per_buf) {
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    Error Device::BulkOut(EndpointID ep_id, const void* const* bufs, int num_bufs,
+                          int len_per_buf) {
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
     Error Device::StartInitialize() {
         is_initialized_ = false;
         initialize_phase_ = 1;
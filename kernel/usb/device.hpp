@@ -11,7 +11,7 @@
 #include "error.hpp"
 #include "usb/setupdata.hpp"
 #include "usb/endpoint.hpp"
-#include "usb/arraymap.hpp"
+#include "usb/hashmap.hpp"
 
 namespace usb {
   class ClassDriver;
@@ -25,6 +25,21 @@ namespace usb {
                              const void* buf, int len, ClassDriver* issuer);
     virtual Error InterruptIn(EndpointID ep_id, void* buf, int len);
     virtual Error InterruptOut(EndpointID ep_id, void* buf, int len);
+    /** @brief バルク転送を 1 つ発行する．
+     *
+     * bufs に並べた num_bufs 個のバッファ（それぞれ len_per_buf バイト）を
+     * 1 つの転送として順に送受信する．完了は OnInterruptCompleted で通知される．
+     */
+    virtual Error BulkIn(EndpointID ep_id, void* const* bufs, int num_bufs, int len_per_buf);
+    virtual Error BulkOut(EndpointID ep_id, const void* const* bufs, int num_bufs,
+                          int len_per_buf);
+    /** @brief EndTransferBatch() までに発行したバルク・インタラプト転送をまとめて開始させる．
+     *
+     * その間の転送はリングに積むだけにしておき，EndTransferBatch() でエンドポイントごとに
+     * 1 度だけホストコントローラに知らせる．
+     */
+    virtual void BeginTransferBatch() {}
+    virtual void EndTransferBatch() {}
 
     Error StartInitialize();
     bool IsInitialized() { return is_initialized_; }
@@ -69,7 +84,7 @@ namespace usb {
     /** OnControlCompleted の中で要求の発行元を特定するためのマップ構造．
      * ControlOut または ControlIn を発行したときに発行元が登録される．
      */
-    ArrayMap<SetupData, ClassDriver*, 4> event_waiters_{};
+    HashMap<SetupData, ClassDriver*, 4> event_waiters_{};
   };
 
   Error GetDescriptor(Device& dev, EndpointID ep_id,
@@ -0,0 +1,101 @@
+/**
+ * @file usb/hashmap.hpp
+ *
+ * 固定長配列を用いたオープンアドレス法のハッシュマップ．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+namespace usb {
+  /** ポインタのハッシュ値．下位ビットはアラインメントでほぼ 0 なので捨てる */
+  template <class T>
+  inline uint64_t HashValue(T* p) {
+    return reinterpret_cast<uintptr_t>(p) >> 4;
+  }
+
+  /** @brief 線形探査のハッシュマップ．ヒープは使わない．
+   *
+   * キーのハッシュ値は HashValue(key) で求める（キーの型と同じ名前空間に定義しておく）．
+   * 削除は後ろの要素を詰める方式なので墓石は残らず，探索は空きスロットで止まる．
+   * 満杯のときの Put は何もしない（スロット数は同時に登録する数以上にしておく）．
+   *
+   * @tparam N  スロット数．2 のべき乗であること
+   */
+  template <class K, class V, size_t N = 16>
+  class HashMap {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of two");
+
+   public:
+    std::optional<V> Get(const K& key) const {
+      if (size_t i; Find(key, i)) {
+        return values_[i];
+      }
+      return std::nullopt;
+    }
+
+    void Put(const K& key, const V& value) {
+      size_t i = Home(key);
+      for (size_t n = 0; n < N; ++n, i = (i + 1) & kMask) {
+        if (!used_[i]) {
+          used_[i] = true;
+          keys_[i] = key;
+          ++size_;
+        }
+        if (keys_[i] == key) {
+          values_[i] = value;
+          return;
+        }
+      }
+    }
+
+    void Delete(const K& key) {
+      size_t i;
+      if (!Find(key, i)) {
+        return;
+      }
+
+      // i を空けたので，そこを越えて置かれている要素を本来の位置に近づける
+      for (size_t j = (i + 1) & kMask; used_[j] && j != i; j = (j + 1) & kMask) {
+        const size_t home = Home(keys_[j]);
+        if (((j - home) & kMask) >= ((j - i) & kMask)) {
+          keys_[i] = keys_[j];
+          values_[i] = values_[j];
+          i = j;
+        }
+      }
+      used_[i] = false;
+      --size_;
+    }
+
+    size_t Size() const { return size_; }
+
+   private:
+    static constexpr size_t kMask = N - 1;
+
+    static size_t Home(const K& key) {
+      uint64_t h = HashValue(key) * 0x9e3779b97f4a7c15u;
+      return (h ^ (h >> 32)) & kMask;
+    }
+
+    bool Find(const K& key, size_t& index) const {
+      size_t i = Home(key);
+      for (size_t n = 0; n < N && used_[i]; ++n, i = (i + 1) & kMask) {
+        if (keys_[i] == key) {
+          index = i;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    std::array<K, N> keys_{};
+    std::array<V, N> values_{};
+    std::array<bool, N> used_{};
+    size_t size_{0};
+  };
+}
@@ -1,43 +1,257 @@
 #include "usb/memory.hpp"
 
+#include <array>
 #include <cstdint>
+#include <cstring>
+
+#include "memory_manager.hpp"
+#include "spinlock.hpp"
 
 namespace {
-  template <class T>
-  T Ceil(T value, unsigned int alignment) {
-    return (value + alignment - 1) & ~static_cast<T>(alignment - 1);
+  const size_t kPageSize = 4096;
+  const size_t kNumPages = usb::kMemoryPoolSize / kPageSize;
+  const size_t kChunkPages = usb::kMemoryChunkSize / kPageSize;
+  const size_t kMaxChunks = usb::kMemoryPoolSize / usb::kMemoryChunkSize;
+  /** 小さいブロックの大きさは 2^kMinOrder から 2^kMaxSmallOrder バイト．それより大きいものはページ単位 */
+  const int kMinOrder = 6;
+  const int kMaxSmallOrder = 11;
+  const int kNumSmallOrders = kMaxSmallOrder - kMinOrder + 1;
+
+  /** @brief プールの各ページの用途 */
+  struct PageInfo {
+    enum Kind : uint8_t {
+      kFree,
+      /** 2^order バイトのブロックに分けたページ */
+      kSmall,
+      /** ページ単位で確保した領域の先頭ページ */
+      kLargeHead,
+      /** ページ単位で確保した領域の 2 ページ目以降 */
+      kLargeTail,
+    } kind;
+    uint8_t order;
+    /** kSmall なら使用中のブロック数，kLargeHead ならページ数 */
+    uint16_t count;
+  };
+
+  /** @brief 空きブロックの先頭に置く，同じ大きさの次の空きブロックへのリンク */
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  /** プールに加えたチャンクの先頭アドレス．ページ番号 n はチャンク n / kChunkPages の中にある */
+  std::array<uintptr_t, kMaxChunks> chunks{};
+  size_t num_chunks = 0;
+  std::array<PageInfo, kNumPages> page_info{};
+  std::array<FreeBlock*, kNumSmallOrders> free_lists{};
+  usb::MemoryStat stat{0, 0, 0, 0, 0, 0};
+  /** 複数のタスクから確保や解放をするので，スピンロックで守る */
+  SpinLock pool_lock;
+
+  uintptr_t PageAddr(size_t page) {
+    return chunks[page / kChunkPages] + (page % kChunkPages) * kPageSize;
+  }
+
+  /** @brief addr を含むページの番号．プールの外なら kNumPages */
+  size_t PageOf(uintptr_t addr) {
+    for (size_t c = 0; c < num_chunks; ++c) {
+      if (chunks[c] <= addr && addr < chunks[c] + usb::kMemoryChunkSize) {
+        return c * kChunkPages + (addr - chunks[c]) / kPageSize;
+      }
+    }
+    return kNumPages;
+  }
+
+  /** @brief 4GiB 未満の物理フレームからチャンクを 1 つ確保してプールに加える
+   *
+   * 一部の xHCI は 64 ビットのアドレスを扱えないので，コンテキストやリングは DMA32 ゾーンに置く．
+   * 加えたチャンクはメモリマネージャーに返さない．
+   */
+  bool AddChunk() {
+    if (num_chunks == kMaxChunks) {
+      return false;
+    }
+    auto [frame, err] = g_memory_manager->Allocate(kChunkPages, MemoryZone::kDMA32);
+    if (err) {
+      return false;
+    }
+    chunks[num_chunks++] = reinterpret_cast<uintptr_t>(frame.Frame());
+    stat.pool_bytes += usb::kMemoryChunkSize;
+    stat.free_pages += kChunkPages;
+    return true;
+  }
+
+  /** @brief value 以上の最小の 2 のべき乗の指数 */
+  int CeilOrder(size_t value) {
+    int order = 0;
+    while ((size_t{1} << order) < value) {
+      ++order;
+    }
+    return order;
+  }
+
+  /** @brief 連続する num_pages 個の空きページを探して確保する．
+   *
+   * num_pages ページ分が boundary 以下なら boundary を跨がない位置から選ぶ．
+   * チャンクは連続していないので，チャンクを跨ぐ領域は選ばない．
+   * @return 先頭ページの番号．見つからなければ kNumPages
+   */
+  size_t AllocPagesInChunk(size_t chunk, size_t num_pages, unsigned int boundary) {
+    const size_t end = (chunk + 1) * kChunkPages;
+    for (size_t first = chunk * kChunkPages; first + num_pages <= end; ++first) {
+      if (boundary > 0 && num_pages * kPageSize <= boundary &&
+          PageAddr(first) / boundary != (PageAddr(first) + num_pages * kPageSize - 1) / boundary) {
+        continue;
+      }
+      size_t n = 0;
+      while (n < num_pages && page_info[first + n].kind == PageInfo::kFree) {
+        ++n;
+      }
+      if (n == num_pages) {
+        for (size_t i = 0; i < num_pages; ++i) {
+          page_info[first + i] = {PageInfo::kLargeTail, 0, 0};
+        }
+        stat.free_pages -= num_pages;
+        return first;
+      }
+      first += n;  // ここまでのどこから始めても使用中のページにぶつかる
+    }
+    return kNumPages;
+  }
+
+  /** @brief 連続する num_pages 個の空きページを探して確保する．足りなければチャンクを加える */
+  size_t AllocPages(size_t num_pages, unsigned int boundary) {
+    if (num_pages > kChunkPages) {
+      return kNumPages;
+    }
+    for (size_t c = 0; c < num_chunks; ++c) {
+      if (const size_t page = AllocPagesInChunk(c, num_pages, boundary); page != kNumPages) {
+        return page;
+      }
+    }
+    if (!AddChunk()) {
+      return kNumPages;
+    }
+    return AllocPagesInChunk(num_chunks - 1, num_pages, boundary);
   }
 
-  template <class T, class U>
-  T MaskBits(T value, U mask) {
-    return value & ~static_cast<T>(mask - 1);
+  void FreePages(size_t first, size_t num_pages) {
+    for (size_t i = 0; i < num_pages; ++i) {
+      page_info[first + i] = {PageInfo::kFree, 0, 0};
+    }
+    stat.free_pages += num_pages;
+  }
+
+  /** @brief 2^order バイトのブロックを 1 つ確保する．空きがなければ 1 ページを分けて補充する */
+  void* AllocBlock(int order) {
+    auto& list = free_lists[order - kMinOrder];
+    if (list == nullptr) {
+      const size_t page = AllocPages(1, 0);
+      if (page == kNumPages) {
+        return nullptr;
+      }
+      page_info[page] = {PageInfo::kSmall, static_cast<uint8_t>(order), 0};
+      for (size_t offset = kPageSize; offset > 0; offset -= size_t{1} << order) {
+        auto block = reinterpret_cast<FreeBlock*>(PageAddr(page) + offset - (size_t{1} << order));
+        block->next = list;
+        list = block;
+      }
+    }
+    auto block = list;
+    list = block->next;
+    ++page_info[PageOf(reinterpret_cast<uintptr_t>(block))].count;
+    return block;
+  }
+
+  void ReleaseBlock(void* p, size_t page) {
+    auto& info = page_info[page];
+    auto& list = free_lists[info.order - kMinOrder];
+    auto block = reinterpret_cast<FreeBlock*>(p);
+    block->next = list;
+    list = block;
+    if (--info.count > 0) {
+      return;
+    }
+
+    // ページ内のブロックがすべて空いたので，リストから外してページごと返す
+    for (auto link = &list; *link != nullptr;) {
+      const auto addr = reinterpret_cast<uintptr_t>(*link);
+      if (PageAddr(page) <= addr && addr < PageAddr(page) + kPageSize) {
+        *link = (*link)->next;
+      } else {
+        link = &(*link)->next;
+      }
+    }
+    FreePages(page, 1);
   }
 }
 
 namespace usb {
-  alignas(64) uint8_t memory_pool[kMemoryPoolSize];
-  uintptr_t alloc_ptr = reinterpret_cast<uintptr_t>(memory_pool);
-
   void* AllocMem(size_t size, unsigned int alignment, unsigned int boundary) {
-    if (alignment > 0) {
-      alloc_ptr = Ceil(alloc_ptr, alignment);
+    SpinLockGuard lock{pool_lock};
+    if (size == 0 || alignment > kPageSize) {
+      ++stat.failures;
+      return nullptr;
+    }
+
+    // 2^order バイトのブロックは 2^order に揃っているので，アライメントと
+    // boundary（2 のべき乗で size 以上）はどちらも満たされる
+    int order = CeilOrder(size);
+    if (order < kMinOrder) {
+      order = kMinOrder;
     }
-    if (boundary > 0) {
-      auto next_boundary = Ceil(alloc_ptr, boundary);
-      if (next_boundary < alloc_ptr + size) {
-        alloc_ptr = next_boundary;
+    if (alignment > 0 && order < CeilOrder(alignment)) {
+      order = CeilOrder(alignment);
+    }
+
+    void* p = nullptr;
+    size_t used_bytes = 0;
+    if (order <= kMaxSmallOrder) {
+      p = AllocBlock(order);
+      used_bytes = size_t{1} << order;
+    } else {
+      const size_t num_pages = (size + kPageSize - 1) / kPageSize;
+      const size_t page = AllocPages(num_pages, boundary);
+      if (page != kNumPages) {
+        page_info[page] = {PageInfo::kLargeHead, 0, static_cast<uint16_t>(num_pages)};
+        p = reinterpret_cast<void*>(PageAddr(page));
+        used_bytes = num_pages * kPageSize;
       }
     }
 
-    if (reinterpret_cast<uintptr_t>(memory_pool) + kMemoryPoolSize
-        < alloc_ptr + size) {
+    if (p == nullptr) {
+      ++stat.failures;
       return nullptr;
     }
+    stat.used_bytes += used_bytes;
+    ++stat.allocs;
+    // 以前は未使用の静的領域だけを返していたので，呼び出し側には 0 で埋まっている前提のものがある
+    // （AllocArray<Ring> で確保してコンストラクタを通さずに使うなど）
+    memset(p, 0, used_bytes);
+    return p;
+  }
 
-    auto p = alloc_ptr;
-    alloc_ptr += size;
-    return reinterpret_cast<void*>(p);
+  void FreeMem(void* p) {
+    const auto addr = reinterpret_cast<uintptr_t>(p);
+    SpinLockGuard lock{pool_lock};
+    const size_t page = PageOf(addr);
+    if (page == kNumPages) {
+      return;
+    }
+    const auto& info = page_info[page];
+    if (info.kind == PageInfo::kSmall) {
+      stat.used_bytes -= size_t{1} << info.order;
+      ReleaseBlock(p, page);
+    } else if (info.kind == PageInfo::kLargeHead && addr == PageAddr(page)) {
+      stat.used_bytes -= info.count * kPageSize;
+      FreePages(page, info.count);
+    } else {
+      return;  // 確保していない領域
+    }
+    ++stat.frees;
   }
 
-  void FreeMem(void* p) {}
+  MemoryStat GetMemoryStat() {
+    SpinLockGuard lock{pool_lock};
+    return stat;
+  }
 }
@@ -9,11 +9,15 @@
 #include <cstddef>
 
 namespace usb {
-  /** @brief 動的メモリ確保のためのメモリプールの最大容量（バイト） */
-  static const size_t kMemoryPoolSize = 4096 * 32;
+  /** @brief メモリプールを伸ばす単位（バイト）．4GiB 未満（DMA32 ゾーン）の物理フレームから必要になるたびに確保する */
+  static const size_t kMemoryChunkSize = 4096 * 32;
+  /** @brief メモリプールの最大容量（バイト） */
+  static const size_t kMemoryPoolSize = kMemoryChunkSize * 8;
 
   /** @brief 指定されたバイト数のメモリ領域を確保して先頭ポインタを返す．
    *
+   * 2048 バイトまでは 2 のべき乗の大きさの区分ごとの空きリストから，それより大きいものは
+   * 連続するページから確保する（kMemoryChunkSize まで）．alignment は 4096 まで．確保した領域は 0 で埋めて返す．
    * 先頭アドレスが alignment に揃ったメモリ領域を確保する．
    * size <= boundary ならメモリ領域が boundary を跨がないことを保証する．
    * boundary は典型的にはページ境界を跨がないように 4096 を指定する．
@@ -31,9 +35,24 @@ namespace usb {
         AllocMem(sizeof(T) * num_obj, alignment, boundary));
   }
 
-  /** @brief 指定されたメモリ領域を解放する．本当に解放することは保証されない． */
+  /** @brief AllocMem で確保したメモリ領域を解放する．nullptr なら何もしない． */
   void FreeMem(void* p);
 
+  /** @brief メモリプールの使用状況 */
+  struct MemoryStat {
+    size_t pool_bytes;
+    /** 確保中の領域の合計（大きさの区分に切り上げたバイト数） */
+    size_t used_bytes;
+    /** どの大きさの区分にも使っていないページの数 */
+    size_t free_pages;
+    size_t allocs;
+    size_t frees;
+    /** 確保できなかった回数 */
+    size_t failures;
+  };
+
+  MemoryStat GetMemoryStat();
+
   /** @brief 標準コンテナ用のメモリアロケータ */
   template <class T, unsigned int Alignment = 64, unsigned int Boundary = 4096>
   class Allocator {
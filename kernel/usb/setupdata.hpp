@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 namespace usb {
   namespace request_type {
     // bmRequestType recipient
@@ -89,5 +91,15 @@ namespace usb {
       lhs.index == rhs.index &&
       lhs.length == rhs.length;
   }
+
+  /** HashMap のキーにするためのハッシュ値 */
+  inline uint64_t HashValue(SetupData s) {
+    return
+      static_cast<uint64_t>(s.request_type.data) |
+      static_cast<uint64_t>(s.request) << 8 |
+      static_cast<uint64_t>(s.value) << 16 |
+      static_cast<uint64_t>(s.index) << 32 |
+      static_cast<uint64_t>(s.length) << 48;
+  }
 }
 
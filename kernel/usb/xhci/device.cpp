@@ -1,8 +1,11 @@
 #include "usb/xhci/device.hpp"
 
+#include <algorithm>
+
 #include "logger.hpp"
 #include "usb/memory.hpp"
 #include "usb/xhci/ring.hpp"
+#include "usb/xhci/xhci.hpp"
 
 namespace {
   using namespace usb::xhci;
@@ -96,6 +99,11 @@ namespace usb::xhci {
 
   Ring* Device::AllocTransferRing(DeviceContextIndex index, size_t buf_size) {
     int i = index.value - 1;
+    if (auto old_tr = transfer_rings_[i]) {
+      // エンドポイントを設定し直すときは前のリングを返す
+      old_tr->~Ring();
+      FreeMem(old_tr);
+    }
     auto tr = AllocArray<Ring>(1, 64, 4096);
     if (tr) {
       tr->Initialize(buf_size);
@@ -211,6 +219,10 @@ namespace usb::xhci {
       return MAKE_ERROR(Error::kTransferRingNotSet);
     }
 
+    if (auto err = tr->Reserve(1)) {
+      return err;
+    }
+
     NormalTRB normal{};
     normal.SetPointer(buf);
     normal.bits.trb_transfer_length = len;
@@ -218,7 +230,7 @@ namespace usb::xhci {
     normal.bits.interrupt_on_completion = true;
 
     tr->Push(normal);
-    dbreg_->Ring(dci.value);
+    RingDoorbell(dci);
     return MAKE_ERROR(Error::kSuccess);
   }
 
@@ -232,9 +244,113 @@ namespace usb::xhci {
     return MAKE_ERROR(Error::kNotImplemented);
   }
 
+  Error Device::BulkIn(EndpointID ep_id, void* const* bufs, int num_bufs, int len_per_buf) {
+    if (auto err = usb::Device::BulkIn(ep_id, bufs, num_bufs, len_per_buf)) {
+      return err;
+    }
+    return PushNormalTD(ep_id, bufs, num_bufs, len_per_buf);
+  }
+
+  Error Device::BulkOut(EndpointID ep_id, const void* const* bufs, int num_bufs,
+                        int len_per_buf) {
+    if (auto err = usb::Device::BulkOut(ep_id, bufs, num_bufs, len_per_buf)) {
+      return err;
+    }
+    return PushNormalTD(ep_id, bufs, num_bufs, len_per_buf);
+  }
+
+  Error Device::PushNormalTD(EndpointID ep_id, const void* const* bufs, int num_bufs,
+                             int len_per_buf) {
+    const DeviceContextIndex dci{ep_id};
+
+    Ring* tr = transfer_rings_[dci.value - 1];
+
+    if (tr == nullptr) {
+      return MAKE_ERROR(Error::kTransferRingNotSet);
+    }
+
+    // 1 つの TRB が指すバッファは 64KiB 境界を跨いではいけない
+    const uintptr_t kBoundary = 64 * 1024;
+    auto chunk_length = [kBoundary](uintptr_t addr, uintptr_t remain) {
+      return std::min(remain, kBoundary - (addr & (kBoundary - 1)));
+    };
+
+    int num_trbs = 0;
+    for (int i = 0; i < num_bufs; ++i) {
+      auto addr = reinterpret_cast<uintptr_t>(bufs[i]);
+      for (uintptr_t remain = len_per_buf; remain > 0;) {
+        const auto n = chunk_length(addr, remain);
+        addr += n;
+        remain -= n;
+        ++num_trbs;
+      }
+    }
+    if (num_trbs == 0 || num_trbs > kMaxTRBsPerTransfer) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    if (auto err = tr->Reserve(num_trbs)) {
+      return err;
+    }
+
+    // 最後の TRB 以外は chain_bit でつなぎ，完了イベントは最後（か short packet の TRB）だけが出す
+    int trb_index = 0;
+    for (int i = 0; i < num_bufs; ++i) {
+      auto addr = reinterpret_cast<uintptr_t>(bufs[i]);
+      for (uintptr_t remain = len_per_buf; remain > 0;) {
+        const auto n = chunk_length(addr, remain);
+        const bool last = ++trb_index == num_trbs;
+
+        NormalTRB normal{};
+        normal.SetPointer(reinterpret_cast<const void*>(addr));
+        normal.bits.trb_transfer_length = n;
+        normal.bits.interrupt_on_short_packet = true;
+        normal.bits.chain_bit = !last;
+        normal.bits.interrupt_on_completion = last;
+        normal.bits.interrupter_target = g_controller->BulkInterrupter();
+        tr->Push(normal);
+
+        addr += n;
+        remain -= n;
+      }
+    }
+
+    RingDoorbell(dci);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  void Device::BeginTransferBatch() {
+    ++batch_depth_;
+  }
+
+  void Device::EndTransferBatch() {
+    if (batch_depth_ == 0 || --batch_depth_ > 0) {
+      return;
+    }
+    for (int i = 1; i < 32; ++i) {
+      if (pending_doorbells_ & (1u << i)) {
+        dbreg_->Ring(i);
+      }
+    }
+    pending_doorbells_ = 0;
+  }
+
+  void Device::RingDoorbell(DeviceContextIndex dci) {
+    if (batch_depth_ > 0) {
+      pending_doorbells_ |= 1u << dci.value;
+      return;
+    }
+    dbreg_->Ring(dci.value);
+  }
+
   Error Device::OnTransferEventReceived(const TransferEventTRB& trb) {
     const auto residual_length = trb.bits.trb_transfer_length;
 
+    // イベントが指す TRB までは xHC が処理し終えたので，転送リングの空きに戻す
+    const DeviceContextIndex dci{trb.EndpointID()};
+    if (auto tr = transfer_rings_[dci.value - 1]) {
+      tr->OnTransferEvent(trb.Pointer());
+    }
+
     if (trb.bits.completion_code != 1 /* Success */ &&
         trb.bits.completion_code != 13 /* Short Packet */) {
       Log(kDebug, trb);
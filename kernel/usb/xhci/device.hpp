@@ -11,7 +11,7 @@
 
 #include "error.hpp"
 #include "usb/device.hpp"
-#include "usb/arraymap.hpp"
+#include "usb/hashmap.hpp"
 #include "usb/xhci/context.hpp"
 #include "usb/xhci/trb.hpp"
 #include "usb/xhci/registers.hpp"
@@ -54,10 +54,23 @@ namespace usb::xhci {
                      const void* buf, int len, ClassDriver* issuer) override;
     Error InterruptIn(EndpointID ep_id, void* buf, int len) override;
     Error InterruptOut(EndpointID ep_id, void* buf, int len) override;
+    Error BulkIn(EndpointID ep_id, void* const* bufs, int num_bufs, int len_per_buf) override;
+    Error BulkOut(EndpointID ep_id, const void* const* bufs, int num_bufs,
+                  int len_per_buf) override;
+    void BeginTransferBatch() override;
+    void EndTransferBatch() override;
+
+    /** 1 回の BulkIn / BulkOut で積める TRB の最大数（足りなければ転送リングを広げる） */
+    static const int kMaxTRBsPerTransfer = 64;
 
     Error OnTransferEventReceived(const TransferEventTRB& trb);
 
    private:
+    /** バッファを 64KiB 境界で区切った NormalTRB の列を 1 つの TD として積み，ドアベルを鳴らす． */
+    Error PushNormalTD(EndpointID ep_id, const void* const* bufs, int num_bufs, int len_per_buf);
+    /** ドアベルを鳴らす．BeginTransferBatch() の後なら EndTransferBatch() まで遅らせる． */
+    void RingDoorbell(DeviceContextIndex dci);
+
     alignas(64) struct DeviceContext ctx_;
     alignas(64) struct InputContext input_ctx_;
 
@@ -67,10 +80,14 @@ namespace usb::xhci {
     enum State state_;
     std::array<Ring*, 31> transfer_rings_; // index = dci - 1
 
+    int batch_depth_{0};
+    /** EndTransferBatch() で鳴らすドアベル．ビット i が DCI i に対応する */
+    uint32_t pending_doorbells_{0};
+
     /** コントロール転送が完了した際に DataStageTRB や StatusStageTRB
      * から対応する SetupStageTRB を検索するためのマップ．
      */
-    ArrayMap<const void*, const SetupStageTRB*, 16> setup_stage_map_{};
+    HashMap<const void*, const SetupStageTRB*, 16> setup_stage_map_{};
 
     //usb::Device* usb_device_;
   };
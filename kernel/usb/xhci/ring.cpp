@@ -9,15 +9,23 @@ namespace usb::xhci {
         if (buf_ != nullptr) {
             FreeMem(buf_);
         }
+        if (retired_buf_ != nullptr) {
+            FreeMem(retired_buf_);
+        }
     }
 
     Error Ring::Initialize(size_t buf_size) {
         if (buf_ != nullptr) {
             FreeMem(buf_);
         }
+        if (retired_buf_ != nullptr) {
+            FreeMem(retired_buf_);
+            retired_buf_ = nullptr;
+        }
 
         cycle_bit_ = true;
         write_index_ = 0;
+        dequeue_index_ = 0;
         buf_size_ = buf_size;
 
         buf_ = AllocArray<TRB>(buf_size_, 64, 64 * 1024);
@@ -45,6 +53,8 @@ namespace usb::xhci {
         if (write_index_ == buf_size_ - 1) {
             LinkTRB link{buf_};
             link.bits.toggle_cycle = true;
+            // 複数の TRB からなる TD がリングの末尾を跨ぐときは，Link TRB もその TD の一部として扱わせる
+            link.bits.chain_bit = (data[3] >> 4) & 1u;
             CopyToLast(link.data);
 
             write_index_ = 0;
@@ -54,6 +64,66 @@ namespace usb::xhci {
         return trb_ptr;
     }
 
+    size_t Ring::FreeSpace() const {
+        // 末尾は Link TRB．満杯と空を区別するため，さらに 1 つは常に空けておく
+        const size_t usable = buf_size_ - 1;
+        if (retired_buf_ != nullptr) {
+            // xHC はまだ古いセグメントにいるので，新しいセグメントは書いた分だけ埋まっている
+            return usable - 1 - write_index_;
+        }
+        const size_t used = (write_index_ + usable - dequeue_index_) % usable;
+        return usable - 1 - used;
+    }
+
+    Error Ring::Reserve(size_t num_trbs) {
+        if (num_trbs <= FreeSpace()) {
+            return MAKE_ERROR(Error::kSuccess);
+        }
+        if (retired_buf_ != nullptr) {
+            // 前に広げたセグメントがまだ使われている
+            return MAKE_ERROR(Error::kFull);
+        }
+
+        size_t new_size = buf_size_ * 2;
+        while (new_size < num_trbs + 2) {
+            new_size *= 2;
+        }
+        if (new_size > kMaxSize) {
+            return MAKE_ERROR(Error::kFull);
+        }
+        auto new_buf = AllocArray<TRB>(new_size, 64, 64 * 1024);
+        if (new_buf == nullptr) {
+            return MAKE_ERROR(Error::kNoEnoughMemory);
+        }
+        // xHC が読み進めても，まだ書いていない TRB だと分かるように cycle bit を逆にしておく
+        for (size_t i = 0; i < new_size; ++i) {
+            new_buf[i].data[3] = static_cast<uint32_t>(!cycle_bit_);
+        }
+
+        // 書き込み位置は常に空いているので，そこに新しいセグメントへの Link TRB を置く
+        LinkTRB link{new_buf};
+        CopyToLast(link.data);
+
+        retired_buf_ = buf_;
+        buf_ = new_buf;
+        buf_size_ = new_size;
+        write_index_ = 0;
+        dequeue_index_ = 0;
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    void Ring::OnTransferEvent(const TRB* trb) {
+        if (trb < buf_ || buf_ + buf_size_ - 1 <= trb) {
+            // 古いセグメントの TRB
+            return;
+        }
+        if (retired_buf_ != nullptr) {
+            FreeMem(retired_buf_);
+            retired_buf_ = nullptr;
+        }
+        dequeue_index_ = (trb - buf_ + 1) % (buf_size_ - 1);
+    }
+
     Error EventRing::Initialize(size_t buf_size,
                                 InterrupterRegisterSet* interrupter) {
         if (buf_ != nullptr) {
@@ -84,7 +154,8 @@ namespace usb::xhci {
         erstsz.SetSize(1);
         interrupter_->ERSTSZ.Write(erstsz);
 
-        WriteDequeuePointer(&buf_[0]);
+        dequeue_ = &buf_[0];
+        WriteDequeuePointer(dequeue_);
 
         ERSTBA_Bitmap erstba = interrupter_->ERSTBA.Read();
         erstba.SetPointer(reinterpret_cast<uint64_t>(erst_));
@@ -96,20 +167,20 @@ namespace usb::xhci {
     void EventRing::WriteDequeuePointer(TRB* p) {
         auto erdp = interrupter_->ERDP.Read();
         erdp.SetPointer(reinterpret_cast<uint64_t>(p));
+        // 1 を書くとクリアされる
+        erdp.bits.event_handler_busy = true;
         interrupter_->ERDP.Write(erdp);
     }
 
     void EventRing::Pop() {
-        auto p = ReadDequeuePointer() + 1;
-
-        TRB* segment_begin = reinterpret_cast<TRB*>(erst_[0].bits.ring_segment_base_address);
-        TRB* segment_end = segment_begin + erst_[0].bits.ring_segment_size;
-
-        if (p == segment_end) {
-            p = segment_begin;
+        ++dequeue_;
+        if (dequeue_ == buf_ + buf_size_) {
+            dequeue_ = buf_;
             cycle_bit_ = !cycle_bit_;
         }
+    }
 
-        WriteDequeuePointer(p);
+    void EventRing::UpdateDequeuePointer() {
+        WriteDequeuePointer(dequeue_);
     }
 } // namespace usb::xhci
@@ -37,9 +37,30 @@ namespace usb::xhci {
 
     TRB* Buffer() const { return buf_; }
 
+    /** @brief xHC がまだ処理していない TRB を上書きせずに積める TRB の数． */
+    size_t FreeSpace() const;
+
+    /** @brief num_trbs 個の TRB を続けて積めるようにする．
+     *
+     * 空きが足りなければ大きなセグメントを確保し，今の書き込み位置に Link TRB を置いて
+     * そちらへ移る．古いセグメントは xHC が新しいセグメントに進んだところで解放する．
+     * TD の途中では呼ばないこと．
+     */
+    Error Reserve(size_t num_trbs);
+
+    /** @brief 転送イベントが指す TRB までを xHC が処理したものとして，空きに戻す． */
+    void OnTransferEvent(const TRB* trb);
+
+    /** @brief Reserve() で広げられるリングの大きさの上限（TRB の数，1 ページ分） */
+    static const size_t kMaxSize = 256;
+
    private:
     TRB* buf_ = nullptr;
     size_t buf_size_ = 0;
+    /** @brief 広げる前のセグメント．xHC がまだ読んでいる間は解放しない */
+    TRB* retired_buf_ = nullptr;
+    /** @brief xHC が次に処理する（と分かっている）位置 */
+    size_t dequeue_index_ = 0;
 
     /** @brief プロデューサ・サイクル・ステートを表すビット */
     bool cycle_bit_;
@@ -86,17 +107,28 @@ namespace usb::xhci {
     void WriteDequeuePointer(TRB* p);
 
     bool HasFront() const {
-      return Front()->bits.cycle_bit == cycle_bit_;
+      // xHC が書き込む TRB なので，cycle bit を確かめてから残りを読む
+      const uint32_t control = __atomic_load_n(&dequeue_->data[3], __ATOMIC_ACQUIRE);
+      return (control & 1u) == cycle_bit_;
     }
 
     TRB* Front() const {
-      return ReadDequeuePointer();
+      return dequeue_;
     }
 
+    /** @brief 先頭のイベントを取り除く．
+     *
+     * ERDP には書かないので，いくつか取り除いたら UpdateDequeuePointer() で xHC に知らせる．
+     */
     void Pop();
 
+    /** @brief 取り除いたところまでを ERDP に書き込む（Event Handler Busy も解除する）． */
+    void UpdateDequeuePointer();
+
    private:
-    TRB* buf_;
+    TRB* buf_ = nullptr;
+    /** @brief 次に処理するイベント．ERDP の値より先に進んでいることがある */
+    TRB* dequeue_ = nullptr;
     size_t buf_size_;
 
     bool cycle_bit_;
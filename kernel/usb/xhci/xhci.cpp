@@ -1,10 +1,12 @@
 #include "usb/xhci/xhci.hpp"
 
+#include <algorithm>
 #include <cstring>
 
 #include "interrupt.hpp"
 #include "logger.hpp"
 #include "pci.hpp"
+#include "spinlock.hpp"
 #include "usb/descriptor.hpp"
 #include "usb/device.hpp"
 #include "usb/setupdata.hpp"
@@ -13,6 +15,26 @@
 namespace {
     using namespace usb::xhci;
 
+    /// ワーカタスク（deferred.hpp）の他に、完了を待つクラスドライバからもイベントを処理するので、同時に処理しないようにする
+    SpinLock g_event_lock;
+    /// 処理の要求を出してから、まだProcessEvents()が始まっていなければtrue
+    bool g_events_requested{false};
+
+    /// erのイベントを最大kEventBatchSize個処理してERDPを書く。1つも無ければfalse
+    bool ProcessEventBatch(Controller& xhc, EventRing& er) {
+        if (!er.HasFront()) {
+            return false;
+        }
+        for (int i = 0; i < kEventBatchSize && er.HasFront(); i++) {
+            if (auto err = ProcessEvent(xhc, er)) {
+                Log(kError, "Error while ProcessEvent: %s at %s:%d\n",
+                    err.Name(), err.File(), err.Line());
+            }
+        }
+        er.UpdateDequeuePointer();
+        return true;
+    }
+
     Error RegisterCommandRing(Ring* ring, MemMapRegister<CRCR_Bitmap>* crcr) {
         CRCR_Bitmap value = crcr->Read();
         value.bits.ring_cycle_state = true;
@@ -409,15 +431,32 @@ namespace usb::xhci {
         if (auto err = RegisterCommandRing(&cr_, &op_->CRCR)) {
             return err;
         }
-        if (auto err = er_.Initialize(32, primary_interrupter)) {
+        if (auto err = ers_[kPrimaryInterrupter].Initialize(32, primary_interrupter)) {
             return err;
         }
+        // インタラプタとそのベクタが2つ以上あれば、バルク転送の完了は別のイベントリングに入れる
+        num_event_rings_ = 1;
+        const int max_interrupters = cap_->HCSPARAMS1.Read().bits.max_interrupters;
+        if (max_interrupters > kBulkInterrupter && num_interrupt_vectors_ > kBulkInterrupter) {
+            auto interrupter = &InterrupterRegisterSets()[kBulkInterrupter];
+            if (auto err = ers_[kBulkInterrupter].Initialize(32, interrupter)) {
+                Log(kWarn, "failed to initialize the bulk event ring: %s\n", err.Name());
+            } else {
+                num_event_rings_ = kBulkInterrupter + 1;
+            }
+        }
+        Log(kInfo, "xHC interrupters: %d (using %d event rings)\n", max_interrupters, num_event_rings_);
 
-        // Enable interrupt for the primary interrupter
-        auto iman = primary_interrupter->IMAN.Read();
-        iman.bits.interrupt_pending = true;
-        iman.bits.interrupt_enable = true;
-        primary_interrupter->IMAN.Write(iman);
+        SetInterruptModeration(kDefaultInterruptModerationNs);
+
+        // Enable interrupt for the interrupters
+        for (int i = 0; i < num_event_rings_; i++) {
+            auto interrupter = &InterrupterRegisterSets()[i];
+            auto iman = interrupter->IMAN.Read();
+            iman.bits.interrupt_pending = true;
+            iman.bits.interrupt_enable = true;
+            interrupter->IMAN.Write(iman);
+        }
 
         // Enable interrupt for the controller
         usbcmd = op_->USBCMD.Read();
@@ -497,7 +536,10 @@ namespace usb::xhci {
                 break;
             }
             ep_ctx->bits.max_packet_size = configs[i].max_packet_size;
-            ep_ctx->bits.interval = convert_interval(configs[i].ep_type, configs[i].interval);
+            // バルク転送のエンドポイントは周期を持たない
+            ep_ctx->bits.interval = configs[i].ep_type == EndpointType::kBulk
+                                        ? 0
+                                        : convert_interval(configs[i].ep_type, configs[i].interval);
             ep_ctx->bits.average_trb_length = 1;
 
             auto tr = dev.AllocTransferRing(ep_dci, 32);
@@ -519,12 +561,16 @@ namespace usb::xhci {
     }
 
     Error ProcessEvent(Controller& xhc) {
-        if (!xhc.PrimaryEventRing()->HasFront()) {
+        return ProcessEvent(xhc, *xhc.PrimaryEventRing());
+    }
+
+    Error ProcessEvent(Controller& xhc, EventRing& er) {
+        if (!er.HasFront()) {
             return MAKE_ERROR(Error::kSuccess);
         }
 
         Error err = MAKE_ERROR(Error::kNotImplemented);
-        auto event_trb = xhc.PrimaryEventRing()->Front();
+        auto event_trb = er.Front();
         if (auto trb = TRBDynamicCast<TransferEventTRB>(event_trb)) {
             err = OnEvent(xhc, *trb);
         } else if (auto trb = TRBDynamicCast<PortStatusChangeEventTRB>(event_trb)) {
@@ -532,11 +578,23 @@ namespace usb::xhci {
         } else if (auto trb = TRBDynamicCast<CommandCompletionEventTRB>(event_trb)) {
             err = OnEvent(xhc, *trb);
         }
-        xhc.PrimaryEventRing()->Pop();
+        er.Pop();
 
         return err;
     }
 
+    void Controller::SetInterruptModeration(uint32_t interval_ns) {
+        const uint32_t interval = std::min<uint32_t>(interval_ns / 250, 0xffff);
+        imod_interval_ns_ = interval * 250;
+        for (int i = 0; i < num_event_rings_; i++) {
+            auto interrupter = &InterrupterRegisterSets()[i];
+            auto imod = interrupter->IMOD.Read();
+            imod.bits.interrupt_moderation_interval = interval;
+            imod.bits.interrupt_moderation_counter = 0;
+            interrupter->IMOD.Write(imod);
+        }
+    }
+
     Controller* g_controller;
 
     void Initialize() {
@@ -559,13 +617,16 @@ namespace usb::xhci {
                 xhc_device->bus, xhc_device->device, xhc_device->function);
         }
 
-        // MSI割り込みを有効化
-        // このプログラムが動作しているCPUコア（Bootstrap Processor）の固有番号
-        const uint8_t bsp_local_apic_id = *reinterpret_cast<const uint32_t*>(0xfee00020) >> 24;
-        pci::ConfigureMSIFixedDestination(
-            *xhc_device, bsp_local_apic_id,
-            pci::MSITriggerMode::kLevel, pci::MSIDeliveryMode::kFixed,
-            InterruptVector::kXHCI, 0);
+        // 割り込みはBSPで受ける
+        // MSI-Xが使えればインタラプタごとに別のベクタにする。MSIならプライマリのインタラプタだけを使う
+        const auto irqs = pci::AssignInterrupts(
+            *xhc_device, "xhci", OnXHCIInterrupt, Controller::kMaxEventRings);
+        if (irqs.error) {
+            Log(kError, "failed to assign xHC interrupts: %s\n", irqs.error.Name());
+        } else {
+            Log(kInfo, "xHC uses %s with %u vectors\n",
+                irqs.value.msix ? "MSI-X" : "MSI", irqs.value.num_vectors);
+        }
 
         // xHCを制御するレジスタ群はメモリマップドIOなので、そのアドレスを取得
         const WithError<uint64_t> xhc_bar = pci::ReadBar(*xhc_device, 0);
@@ -576,6 +637,9 @@ namespace usb::xhci {
         // xHC初期化
         usb::xhci::g_controller = new Controller{xhc_mmio_base};
         Controller& xhc = *usb::xhci::g_controller;
+        if (!irqs.error && irqs.value.msix) {
+            xhc.SetNumInterruptVectors(irqs.value.num_vectors);
+        }
 
         if (pci::ReadVendorId(*xhc_device) == 0x8086) {
             Log(kDebug, "%s, %d\n", __FILE__, __LINE__);
@@ -608,11 +672,30 @@ namespace usb::xhci {
     }
 
     void ProcessEvents() {
-        while (g_controller->PrimaryEventRing()->HasFront()) {
-            if (auto err = ProcessEvent(*g_controller)) {
-                Log(kError, "Error while ProcessEvent: %s at %s:%d\n",
-                    err.Name(), err.File(), err.Line());
+        // これ以降に来た割り込みは、改めて処理を要求する
+        __atomic_store_n(&g_events_requested, false, __ATOMIC_RELEASE);
+
+        SpinLockGuard lock{g_event_lock};
+        auto& xhc = *g_controller;
+        bool processed = true;
+        while (processed) {
+            processed = false;
+            // HID の報告などが大量のバルク転送の完了の後ろで待たないよう、プライマリを先に空にする
+            while (ProcessEventBatch(xhc, *xhc.PrimaryEventRing())) {
+                processed = true;
+            }
+            for (int i = 1; i < xhc.NumEventRings(); i++) {
+                processed |= ProcessEventBatch(xhc, *xhc.EventRingAt(i));
             }
         }
+        if (g_events_processed_observer) {
+            g_events_processed_observer();
+        }
+    }
+
+    std::function<void()> g_events_processed_observer;
+
+    bool RequestProcessEvents() {
+        return !__atomic_exchange_n(&g_events_requested, true, __ATOMIC_ACQ_REL);
     }
 } // namespace usb::xhci
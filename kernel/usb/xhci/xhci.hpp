@@ -6,9 +6,12 @@
 
 #pragma once
 
+#include <array>
+#include <functional>
 #include <memory>
 
 #include "error.hpp"
+#include "interrupt.hpp"
 #include "usb/xhci/context.hpp"
 #include "usb/xhci/devmgr.hpp"
 #include "usb/xhci/port.hpp"
@@ -19,16 +22,33 @@ namespace usb::xhci {
     class Controller {
     public:
         Controller(uintptr_t mmio_base);
+        /// 割り込みを別々のベクタに届けられるインタラプタの数（MSI-Xのベクタ数）。Initialize()の前に設定する
+        void SetNumInterruptVectors(int num_vectors) { num_interrupt_vectors_ = num_vectors; }
         Error Initialize();
         Error Run();
+        /// インタラプタ0のイベントリング。コマンドの完了、ポートの状態変化、コントロール転送と割り込み転送
+        static const int kPrimaryInterrupter = 0;
+        /// インタラプタ1のイベントリング。バルク転送の完了を、HIDの報告と別の列にする
+        static const int kBulkInterrupter = 1;
+        static const int kMaxEventRings = 2;
+
         Ring* CommandRing() { return &cr_; }
-        EventRing* PrimaryEventRing() { return &er_; }
+        EventRing* PrimaryEventRing() { return &ers_[kPrimaryInterrupter]; }
+        /// index番目のインタラプタのイベントリング（0 <= index < NumEventRings()）
+        EventRing* EventRingAt(int index) { return &ers_[index]; }
+        /// 使っているイベントリングの数。xHCのインタラプタが1つならバルク転送もプライマリに入る
+        int NumEventRings() const { return num_event_rings_; }
+        /// バルク転送のTRBのInterrupter Targetに入れる値
+        uint16_t BulkInterrupter() const { return num_event_rings_ > kBulkInterrupter ? kBulkInterrupter : kPrimaryInterrupter; }
         DoorbellRegister* DoorbellRegisterAt(uint8_t index);
         Port PortAt(uint8_t port_num) {
             return Port{port_num, PortRegisterSets()[port_num - 1]};
         }
         uint8_t MaxPorts() const { return max_ports_; }
         DeviceManager* DeviceManager() { return &devmgr_; }
+        /// 割り込みの最小間隔（IMOD）を設定する。間隔は250ns単位に切り捨てる。0なら間引かない
+        void SetInterruptModeration(uint32_t interval_ns);
+        uint32_t InterruptModeration() const { return imod_interval_ns_; }
 
     private:
         static const size_t kDeviceSize = 8;
@@ -40,7 +60,10 @@ namespace usb::xhci {
 
         class DeviceManager devmgr_;
         Ring cr_;
-        EventRing er_;
+        std::array<EventRing, kMaxEventRings> ers_;
+        int num_event_rings_{1};
+        int num_interrupt_vectors_{1};
+        uint32_t imod_interval_ns_{0};
 
         InterrupterRegisterSetArray InterrupterRegisterSets() const {
             return {mmio_base_ + cap_->RTSOFF.Read().Offset() + 0x20u, 1024};
@@ -62,14 +85,27 @@ namespace usb::xhci {
    *
    * xhc のプライマリイベントリングの先頭のイベントを処理する．
    * イベントが無ければ即座に Error::kSuccess を返す．
+   * ERDP は更新しないので，呼び出し側で EventRing::UpdateDequeuePointer() を呼ぶこと．
    *
    * @return イベントを正常に処理できたら Error::kSuccess
    */
     Error ProcessEvent(Controller& xhc);
+    /** @brief ProcessEvent と同じだが，er の先頭のイベントを処理する． */
+    Error ProcessEvent(Controller& xhc, EventRing& er);
 
     /// xHCIホストコントローラ
     extern Controller* g_controller;
 
+    /// 割り込みの間隔の既定値。HIDの1msごとの報告を遅らせない程度に、大量の転送の割り込みを間引く
+    const uint32_t kDefaultInterruptModerationNs = 250000;
+    /// ProcessEvents()でERDPを書くまでに処理するイベントの最大数（イベントリングの半分）
+    const int kEventBatchSize = 16;
     void Initialize();
+    /// イベントリングに溜まったイベントをすべて処理する（どのタスクから呼んでもよい）
+    /// kEventBatchSize個ごとにまとめてERDPを書く。プライマリのリングを空にしてから、バルク転送のリングを1回分処理する
     void ProcessEvents();
+    /// 割り込みハンドラから呼ぶ。前の要求がまだ処理されていなければfalseを返すので、改めて処理を積まなくてよい
+    bool RequestProcessEvents();
+    /// ProcessEvents()がイベントを処理し終えるたびに呼ぶ。1回で届いたHIDの報告をまとめて通知するのに使う
+    extern std::function<void()> g_events_processed_observer;
 } // namespace usb::xhci
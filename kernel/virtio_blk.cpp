@@ -0,0 +1,158 @@
+#include "virtio_blk.hpp"
+
+#include <cstring>
+
+#include "asmfunc.h"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+
+namespace {
+    /// レガシーインタフェースのレジスタ（BAR0のIOポートからのオフセット）
+    const uint16_t kRegDeviceFeatures = 0x00;
+    const uint16_t kRegGuestFeatures = 0x04;
+    const uint16_t kRegQueueAddress = 0x08;
+    const uint16_t kRegQueueSize = 0x0c;
+    const uint16_t kRegQueueSelect = 0x0e;
+    const uint16_t kRegQueueNotify = 0x10;
+    const uint16_t kRegDeviceStatus = 0x12;
+    /// ブロックデバイス固有の設定 : 容量（512バイトのセクタ数）
+    const uint16_t kRegCapacity = 0x14;
+
+    const uint8_t kStatusAcknowledge = 1;
+    const uint8_t kStatusDriver = 2;
+    const uint8_t kStatusDriverOK = 4;
+
+    const uint32_t kBlkTypeIn = 0;
+    const uint32_t kBlkTypeOut = 1;
+
+    /// 要求の先頭に置くヘッダ
+    struct BlkRequestHeader {
+        uint32_t type;
+        uint32_t reserved;
+        uint64_t sector;
+    };
+
+    /// ヘッダとステータスはusedリングの後ろのページに置く
+    size_t HeaderOffset(uint16_t queue_size) {
+        return virtio::VirtqBytes(queue_size);
+    }
+} // namespace
+
+namespace virtio {
+    WithError<BlockDevice*> BlockDevice::Create(pci::Device& pci_dev) {
+        auto [bar, bar_err] = pci::ReadBar(pci_dev, 0);
+        if (bar_err || (bar & 1) == 0) { // レガシーインタフェースはIOポートのBAR0
+            return {nullptr, MAKE_ERROR(Error::kUnknownDevice)};
+        }
+        const uint16_t io_base = bar & ~0x3u;
+
+        // IO空間へのアクセスとバスマスタ（DMA）を有効にする
+        pci::WriteConfReg(pci_dev, 0x04, pci::ReadConfReg(pci_dev, 0x04) | 0x5);
+
+        IoOut8(io_base + kRegDeviceStatus, 0); // リセット
+        IoOut8(io_base + kRegDeviceStatus, kStatusAcknowledge | kStatusDriver);
+        // 追加機能は使わない
+        IoIn32(io_base + kRegDeviceFeatures);
+        IoOut32(io_base + kRegGuestFeatures, 0);
+
+        IoOut16(io_base + kRegQueueSelect, 0);
+        const uint16_t queue_size = IoIn16(io_base + kRegQueueSize);
+        if (queue_size < 3) {
+            return {nullptr, MAKE_ERROR(Error::kUnknownDevice)};
+        }
+
+        const size_t queue_frames = HeaderOffset(queue_size) / kBytesPerFrame + 1;
+        auto [frame, alloc_err] = g_memory_manager->Allocate(queue_frames);
+        if (alloc_err) {
+            return {nullptr, alloc_err};
+        }
+        auto queue = reinterpret_cast<uint8_t*>(frame.Frame());
+        memset(queue, 0, queue_frames * kBytesPerFrame);
+        IoOut32(io_base + kRegQueueAddress, reinterpret_cast<uintptr_t>(queue) >> 12);
+
+        IoOut8(io_base + kRegDeviceStatus, kStatusAcknowledge | kStatusDriver | kStatusDriverOK);
+
+        const uint64_t capacity = IoIn32(io_base + kRegCapacity) |
+                                  static_cast<uint64_t>(IoIn32(io_base + kRegCapacity + 4)) << 32;
+        Log(kInfo, "virtio-blk at %d.%d.%d: %lu sectors\n",
+            pci_dev.bus, pci_dev.device, pci_dev.function, capacity);
+        return {new BlockDevice{io_base, queue, queue_frames, queue_size, capacity},
+                MAKE_ERROR(Error::kSuccess)};
+    }
+
+    BlockDevice::BlockDevice(uint16_t io_base, uint8_t* queue, size_t queue_frames,
+                             uint16_t queue_size, uint64_t capacity)
+        : io_base_{io_base}, queue_{queue}, queue_frames_{queue_frames},
+          queue_size_{queue_size}, capacity_{capacity} {
+    }
+
+    BlockDevice::~BlockDevice() {
+        IoOut8(io_base_ + kRegDeviceStatus, 0);
+        g_memory_manager->Free(FrameID{reinterpret_cast<uintptr_t>(queue_) / kBytesPerFrame},
+                               queue_frames_);
+    }
+
+    Error BlockDevice::Read(uint64_t lba, void* buf, size_t num_blocks) {
+        return Request(kBlkTypeIn, lba, &buf, 1, num_blocks);
+    }
+
+    Error BlockDevice::Write(uint64_t lba, const void* buf, size_t num_blocks) {
+        void* p = const_cast<void*>(buf);
+        return Request(kBlkTypeOut, lba, &p, 1, num_blocks);
+    }
+
+    Error BlockDevice::WriteScatter(uint64_t lba, const void* const* bufs, size_t num_bufs,
+                                    size_t blocks_per_buf) {
+        return Request(kBlkTypeOut, lba, const_cast<void* const*>(bufs), num_bufs, blocks_per_buf);
+    }
+
+    Error BlockDevice::Request(uint32_t type, uint64_t lba, void* const* bufs, size_t num_bufs,
+                               size_t blocks_per_buf) {
+        if (num_bufs == 0 || num_bufs > MaxScatter() ||
+            lba + num_bufs * blocks_per_buf > capacity_) {
+            return MAKE_ERROR(Error::kIndexOutOfRange);
+        }
+
+        SpinLockGuard lock{lock_};
+        auto desc = reinterpret_cast<VirtqDesc*>(queue_);
+        auto avail = reinterpret_cast<volatile uint16_t*>(queue_ + VirtqAvailOffset(queue_size_));
+        auto used = reinterpret_cast<volatile uint16_t*>(queue_ + VirtqUsedOffset(queue_size_));
+        auto header = reinterpret_cast<BlkRequestHeader*>(queue_ + HeaderOffset(queue_size_));
+        auto status = reinterpret_cast<volatile uint8_t*>(header + 1);
+
+        // 同時に送る要求は1つだけなので、ディスクリプタは先頭から使い回す
+        // 0 : ヘッダ、1〜num_bufs : データ、num_bufs + 1 : ステータス
+        *header = {type, 0, lba};
+        *status = 0xff;
+        desc[0] = {reinterpret_cast<uintptr_t>(header), sizeof(BlkRequestHeader), kVirtqDescNext, 1};
+        const uint16_t data_flags = kVirtqDescNext | (type == kBlkTypeIn ? kVirtqDescWrite : 0);
+        for (size_t i = 0; i < num_bufs; i++) {
+            desc[1 + i] = {reinterpret_cast<uintptr_t>(bufs[i]),
+                           static_cast<uint32_t>(blocks_per_buf * 512),
+                           data_flags, static_cast<uint16_t>(2 + i)};
+        }
+        desc[1 + num_bufs] = {reinterpret_cast<uintptr_t>(status), 1, kVirtqDescWrite, 0};
+
+        // avail : flags, idx, ring[queue_size]
+        avail[2 + avail_idx_ % queue_size_] = 0;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        avail_idx_++;
+        avail[1] = avail_idx_;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        IoOut16(io_base_ + kRegQueueNotify, 0);
+
+        // used : flags, idx, ring[queue_size]
+        while (used[1] == used_idx_) {
+            __builtin_ia32_pause();
+        }
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        used_idx_++;
+
+        if (*status != 0) {
+            Log(kWarn, "virtio-blk: request failed (type %u, lba %lu, status %u)\n",
+                type, lba, *status);
+            return MAKE_ERROR(Error::kTransferFailed);
+        }
+        return MAKE_ERROR(Error::kSuccess);
+    }
+} // namespace virtio
@@ -0,0 +1,103 @@
+/// virtio-blk : 仮想マシン（QEMUなど）が提供するブロックデバイス
+/// レガシー（virtio 0.9.5）のPCIインタフェースを使い、割り込みは使わずに完了をポーリングする
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "block.hpp"
+#include "error.hpp"
+#include "pci.hpp"
+#include "spinlock.hpp"
+
+namespace virtio {
+    /// 仮想キューのディスクリプタ
+    struct VirtqDesc {
+        uint64_t addr;
+        uint32_t len;
+        uint16_t flags;
+        uint16_t next;
+    };
+
+    /// usedリングの要素
+    struct VirtqUsedElem {
+        uint32_t id;
+        uint32_t len;
+    };
+
+    const uint16_t kVirtqDescNext = 1;
+    const uint16_t kVirtqDescWrite = 2;
+
+    inline size_t VirtqAlignPage(size_t bytes) {
+        return (bytes + 4095) & ~size_t{4095};
+    }
+    /// キューの各部分の位置（レガシーインタフェースの配置規則に従う）
+    inline size_t VirtqAvailOffset(uint16_t queue_size) {
+        return sizeof(VirtqDesc) * queue_size;
+    }
+    inline size_t VirtqUsedOffset(uint16_t queue_size) {
+        return VirtqAlignPage(VirtqAvailOffset(queue_size) + sizeof(uint16_t) * (3 + queue_size));
+    }
+    /// usedリングまで含めたキュー全体のバイト数（ページ単位）
+    inline size_t VirtqBytes(uint16_t queue_size) {
+        return VirtqUsedOffset(queue_size) +
+               VirtqAlignPage(sizeof(uint16_t) * 3 + sizeof(VirtqUsedElem) * queue_size);
+    }
+
+    class BlockDevice : public ::BlockDevice {
+    public:
+        /// デバイスを初期化する。使えなければ kUnknownDevice など
+        static WithError<BlockDevice*> Create(pci::Device& pci_dev);
+        /// デバイスをリセットし、キューのフレームを解放する
+        ~BlockDevice() override;
+
+        Error Read(uint64_t lba, void* buf, size_t num_blocks) override;
+        Error Write(uint64_t lba, const void* buf, size_t num_blocks) override;
+        Error WriteScatter(uint64_t lba, const void* const* bufs, size_t num_bufs,
+                           size_t blocks_per_buf) override;
+        /// ヘッダとステータスの分を除いたディスクリプタの数
+        size_t MaxScatter() const override { return queue_size_ - 2; }
+        size_t BlockSize() const override { return 512; }
+        uint64_t NumBlocks() const override { return capacity_; }
+
+    private:
+        BlockDevice(uint16_t io_base, uint8_t* queue, size_t queue_frames,
+                    uint16_t queue_size, uint64_t capacity);
+        /// 要求を1つ送り、完了するまで待つ
+        /// bufs : データのバッファ（それぞれ blocks_per_buf ブロック）を並べたもの
+        Error Request(uint32_t type, uint64_t lba, void* const* bufs, size_t num_bufs,
+                      size_t blocks_per_buf);
+
+        SpinLock lock_;
+        const uint16_t io_base_;
+        /// ディスクリプタテーブル、availリング、usedリング、要求のヘッダを収めた連続フレーム
+        uint8_t* const queue_;
+        const size_t queue_frames_;
+        const uint16_t queue_size_;
+        const uint64_t capacity_;
+        uint16_t avail_idx_{0}, used_idx_{0};
+    };
+
+    /// PCIデバイスの一覧にあるvirtio-blkを順に初期化し、fが true を返したものを返す（なければ nullptr）
+    template <class F>
+    BlockDevice* FindBlockDevice(F f) {
+        for (int i = 0; i < pci::g_num_device; i++) {
+            auto& dev = pci::g_devices[i];
+            // ベンダID 0x1af4、レガシーのブロックデバイスはデバイスID 0x1001
+            if (pci::ReadVendorId(dev) != 0x1af4 ||
+                pci::ReadDeviceId(dev.bus, dev.device, dev.function) != 0x1001) {
+                continue;
+            }
+            auto [blk, err] = BlockDevice::Create(dev);
+            if (err) {
+                continue;
+            }
+            if (f(*blk)) {
+                return blk;
+            }
+            delete blk;
+        }
+        return nullptr;
+    }
+} // namespace virtio
@@ -0,0 +1,443 @@
+#include "virtio_net.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "asmfunc.h"
+#include "deferred.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "task.hpp"
+
+namespace {
+    /// レガシーインタフェースのレジスタ（BAR0のIOポートからのオフセット）
+    const uint16_t kRegDeviceFeatures = 0x00;
+    const uint16_t kRegGuestFeatures = 0x04;
+    const uint16_t kRegQueueAddress = 0x08;
+    const uint16_t kRegQueueSize = 0x0c;
+    const uint16_t kRegQueueSelect = 0x0e;
+    const uint16_t kRegQueueNotify = 0x10;
+    const uint16_t kRegDeviceStatus = 0x12;
+    const uint16_t kRegISRStatus = 0x13;
+    /// MSI-Xを有効にしたときだけあるレジスタ。デバイス固有の設定はその後ろにずれる
+    const uint16_t kRegConfigVector = 0x14;
+    const uint16_t kRegQueueVector = 0x16;
+    const uint16_t kRegDeviceConfig = 0x14;
+    const uint16_t kRegDeviceConfigMSIX = 0x18;
+    /// 割り込みを割り当てない
+    const uint16_t kNoVector = 0xffff;
+
+    const uint8_t kStatusAcknowledge = 1;
+    const uint8_t kStatusDriver = 2;
+    const uint8_t kStatusDriverOK = 4;
+
+    /// デバイス固有の設定にMACアドレスがある
+    const uint32_t kNetFeatureMAC = 1u << 5;
+
+    /// availのflags : 使い終えても割り込まなくてよい
+    const uint16_t kAvailNoInterrupt = 1;
+    /// usedのflags : availに積んでも通知しなくてよい
+    const uint16_t kUsedNoNotify = 1;
+
+    const uint16_t kRxQueue = 0;
+    const uint16_t kTxQueue = 1;
+
+    /// レガシーのvirtio-netのヘッダ（追加機能を使わなければ10バイト）
+    /// パケットバッファの先頭に置き、フレームはkFrameOffsetから置く
+    const uint32_t kNetHeaderSize = 10;
+    const size_t kFrameOffset = 16;
+    const size_t kMaxFrameSize = virtio::kPacketBufferSize - kFrameOffset;
+
+    /// 受信バッファを積み直したとき、これだけ溜まるまで通知をまとめる
+    const uint16_t kRxKickBatch = 16;
+
+    void ProcessNetReceived(uint64_t) {
+        virtio::g_net_device->ProcessReceived();
+    }
+
+    void FlushNetSend(uint64_t) {
+        virtio::g_net_device->FlushSend();
+    }
+
+    DeferredWork g_net_rx_work{"virtio-net rx", ProcessNetReceived, 0, WorkPriority::kHigh};
+    DeferredWork g_net_tx_work{"virtio-net tx", FlushNetSend, 0, WorkPriority::kHigh};
+
+    void OnNetInterrupt(uint64_t) {
+        if (auto dev = virtio::g_net_device) {
+            dev->OnInterrupt();
+        }
+    }
+} // namespace
+
+namespace virtio {
+    NetDevice* g_net_device = nullptr;
+
+    WithError<NetDevice::Queue> NetDevice::SetUpQueue(uint16_t io_base, uint16_t index, bool device_writes) {
+        Queue q{};
+        q.index = index;
+        IoOut16(io_base + kRegQueueSelect, index);
+        q.size = IoIn16(io_base + kRegQueueSize);
+        if (q.size < 2) {
+            return {q, MAKE_ERROR(Error::kUnknownDevice)};
+        }
+        q.num_slots = std::min<uint16_t>(q.size / 2, kMaxNetSlots);
+
+        q.ring_frames = VirtqBytes(q.size) / kBytesPerFrame;
+        auto [ring, ring_err] = g_memory_manager->Allocate(q.ring_frames);
+        if (ring_err) {
+            return {q, ring_err};
+        }
+        q.ring = reinterpret_cast<uint8_t*>(ring.Frame());
+        memset(q.ring, 0, q.ring_frames * kBytesPerFrame);
+
+        q.buffer_frames = (kPacketBufferSize * q.num_slots + kBytesPerFrame - 1) / kBytesPerFrame;
+        auto [buffers, buf_err] = g_memory_manager->Allocate(q.buffer_frames);
+        if (buf_err) {
+            g_memory_manager->Free(ring, q.ring_frames);
+            return {q, buf_err};
+        }
+        q.buffers = reinterpret_cast<uint8_t*>(buffers.Frame());
+        memset(q.buffers, 0, q.buffer_frames * kBytesPerFrame);
+
+        // ディスクリプタはスロットに固定で、毎回組み直さない（送信ではフレームの長さだけを書き換える）
+        const uint16_t write = device_writes ? kVirtqDescWrite : 0;
+        auto desc = q.Desc();
+        for (uint16_t s = 0; s < q.num_slots; s++) {
+            const auto buf = reinterpret_cast<uintptr_t>(q.Buffer(s));
+            desc[2 * s] = {buf, kNetHeaderSize, static_cast<uint16_t>(kVirtqDescNext | write),
+                           static_cast<uint16_t>(2 * s + 1)};
+            desc[2 * s + 1] = {buf + kFrameOffset, static_cast<uint32_t>(kMaxFrameSize), write, 0};
+        }
+        IoOut32(io_base + kRegQueueAddress, reinterpret_cast<uintptr_t>(q.ring) >> 12);
+        return {q, MAKE_ERROR(Error::kSuccess)};
+    }
+    WithError<NetDevice*> NetDevice::Create(pci::Device& pci_dev) {
+        auto [bar, bar_err] = pci::ReadBar(pci_dev, 0);
+        if (bar_err || (bar & 1) == 0) { // レガシーインタフェースはIOポートのBAR0
+            return {nullptr, MAKE_ERROR(Error::kUnknownDevice)};
+        }
+        const uint16_t io_base = bar & ~0x3u;
+
+        // IO空間へのアクセスとバスマスタ（DMA）を有効にする
+        pci::WriteConfReg(pci_dev, 0x04, pci::ReadConfReg(pci_dev, 0x04) | 0x5);
+
+        IoOut8(io_base + kRegDeviceStatus, 0); // リセット
+        IoOut8(io_base + kRegDeviceStatus, kStatusAcknowledge | kStatusDriver);
+        // MACアドレスだけを使い、オフロードや受信バッファの連結は使わない
+        const uint32_t features = IoIn32(io_base + kRegDeviceFeatures) & kNetFeatureMAC;
+        IoOut32(io_base + kRegGuestFeatures, features);
+
+        auto [rx, rx_err] = SetUpQueue(io_base, kRxQueue, true);
+        if (rx_err) {
+            return {nullptr, rx_err};
+        }
+        auto [tx, tx_err] = SetUpQueue(io_base, kTxQueue, false);
+        if (tx_err) {
+            return {nullptr, tx_err};
+        }
+        // 送信の完了は次の送信時にまとめて刈り取るので、割り込みは要らない
+        tx.Avail()[0] = kAvailNoInterrupt;
+
+        // 割り込みハンドラより先にg_net_deviceを置けるよう、MSI-Xのベクタとデバイス固有の設定はStart()で扱う
+        auto dev = new NetDevice{io_base, rx, tx};
+        dev->has_mac_ = (features & kNetFeatureMAC) != 0;
+        return {dev, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    NetDevice::NetDevice(uint16_t io_base, const Queue& rx, const Queue& tx)
+        : io_base_{io_base}, rx_{rx}, tx_{tx} {
+        tx_free_.reserve(tx_.num_slots);
+        for (uint16_t s = tx_.num_slots; s > 0; s--) {
+            tx_free_.push_back(s - 1);
+        }
+    }
+
+    Error NetDevice::Start(pci::Device& pci_dev) {
+        // 割り込みはBSPで受ける。受信のキューだけにMSI-Xのテーブルの0番を割り当てる
+        const auto irqs = pci::AssignInterrupts(pci_dev, "virtio-net", OnNetInterrupt, 1);
+        if (irqs.error) {
+            IoOut8(io_base_ + kRegDeviceStatus, 0);
+            return irqs.error;
+        }
+        msix_ = irqs.value.msix;
+        if (msix_) {
+            IoOut16(io_base_ + kRegConfigVector, kNoVector);
+            IoOut16(io_base_ + kRegQueueSelect, kRxQueue);
+            IoOut16(io_base_ + kRegQueueVector, 0);
+            IoOut16(io_base_ + kRegQueueSelect, kTxQueue);
+            IoOut16(io_base_ + kRegQueueVector, kNoVector);
+            IoOut16(io_base_ + kRegQueueSelect, kRxQueue);
+            if (IoIn16(io_base_ + kRegQueueVector) != 0) {
+                Log(kWarn, "virtio-net: the device rejected the MSI-X vector\n");
+            }
+        }
+
+        if (has_mac_) {
+            const uint16_t config = msix_ ? kRegDeviceConfigMSIX : kRegDeviceConfig;
+            for (size_t i = 0; i < mac_.size(); i++) {
+                mac_[i] = IoIn8(io_base_ + config + i);
+            }
+        }
+
+        {
+            SpinLockGuard lock{lock_};
+            for (uint16_t s = 0; s < rx_.num_slots; s++) {
+                PostLocked(rx_, s);
+            }
+            IoOut8(io_base_ + kRegDeviceStatus, kStatusAcknowledge | kStatusDriver | kStatusDriverOK);
+            KickLocked(rx_);
+        }
+
+        Log(kInfo, "virtio-net at %d.%d.%d: %02x:%02x:%02x:%02x:%02x:%02x, %u/%u slots, %s\n",
+            pci_dev.bus, pci_dev.device, pci_dev.function,
+            mac_[0], mac_[1], mac_[2], mac_[3], mac_[4], mac_[5],
+            rx_.num_slots, tx_.num_slots, msix_ ? "MSI-X" : "MSI");
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    NetStat NetDevice::Stat() {
+        SpinLockGuard lock{lock_};
+        auto stat = stat_;
+        stat.interrupts = __atomic_load_n(&interrupts_, __ATOMIC_RELAXED);
+        return stat;
+    }
+
+    void NetDevice::PostLocked(Queue& q, uint16_t slot) {
+        auto avail = q.Avail();
+        avail[2 + q.avail_idx % q.size] = 2 * slot;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        q.avail_idx++;
+        avail[1] = q.avail_idx;
+        q.unnotified++;
+    }
+
+    void NetDevice::KickLocked(Queue& q) {
+        if (q.unnotified == 0) {
+            return;
+        }
+        q.unnotified = 0;
+        // idxの更新を見せてから、デバイスが通知を求めているかを確かめる
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if ((q.Used()[0] & kUsedNoNotify) == 0) {
+            IoOut16(io_base_ + kRegQueueNotify, q.index);
+            (&q == &rx_ ? stat_.rx_kicks : stat_.tx_kicks)++;
+        }
+    }
+
+    Error NetDevice::Send(const void* frame, size_t len) {
+        if (len == 0 || len > kMaxFrameSize) {
+            return MAKE_ERROR(Error::kIndexOutOfRange);
+        }
+
+        SpinLockGuard lock{lock_};
+        ReclaimSentLocked();
+        if (tx_free_.empty()) {
+            // 積んである分を送ってもらい、空くまで待つ
+            stat_.tx_waits++;
+            KickLocked(tx_);
+            while (tx_free_.empty()) {
+                __builtin_ia32_pause();
+                ReclaimSentLocked();
+            }
+        }
+        const uint16_t slot = tx_free_.back();
+        tx_free_.pop_back();
+
+        auto buf = tx_.Buffer(slot);
+        memset(buf, 0, kNetHeaderSize);
+        memcpy(buf + kFrameOffset, frame, len);
+        tx_.Desc()[2 * slot + 1].len = len;
+        PostLocked(tx_, slot);
+        stat_.tx_packets++;
+        stat_.tx_bytes += len;
+
+        // 立て続けの送信は1回の通知にまとめる。半分まで溜まったら待たずに通知する
+        if (tx_.unnotified >= tx_.num_slots / 2) {
+            KickLocked(tx_);
+        } else {
+            ScheduleWork(g_net_tx_work);
+        }
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    void NetDevice::FlushSend() {
+        SpinLockGuard lock{lock_};
+        KickLocked(tx_);
+    }
+
+    void NetDevice::ReclaimSentLocked() {
+        auto used = tx_.Used();
+        auto elems = reinterpret_cast<volatile VirtqUsedElem*>(used + 2);
+        while (tx_.used_idx != used[1]) {
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            tx_free_.push_back(elems[tx_.used_idx % tx_.size].id / 2);
+            tx_.used_idx++;
+        }
+    }
+
+    void NetDevice::OnInterrupt() {
+        if (!msix_) {
+            // MSI-Xでなければ、ISRを読んで割り込みの要因を下ろす
+            IoIn8(io_base_ + kRegISRStatus);
+        }
+        __atomic_fetch_add(&interrupts_, 1, __ATOMIC_RELAXED);
+        // 処理し終えるまで次の割り込みは要らない
+        rx_.Avail()[0] = kAvailNoInterrupt;
+        ScheduleWork(g_net_rx_work);
+    }
+
+    void NetDevice::ProcessReceived() {
+        SpinLockGuard lock{lock_};
+        auto used = rx_.Used();
+        auto elems = reinterpret_cast<volatile VirtqUsedElem*>(used + 2);
+        while (true) {
+            while (rx_.used_idx != used[1]) {
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                const VirtqUsedElem elem{elems[rx_.used_idx % rx_.size].id,
+                                         elems[rx_.used_idx % rx_.size].len};
+                rx_.used_idx++;
+                const uint16_t slot = elem.id / 2;
+                const uint16_t len = elem.len > kNetHeaderSize ? elem.len - kNetHeaderSize : 0;
+
+                // バッファはコピーせずにそのままソケットに渡し、すべてが読み終えたら積み直す
+                uint8_t refs = 0;
+                for (auto socket : sockets_) {
+                    if (socket->Deliver(slot, len)) {
+                        refs++;
+                    }
+                }
+                if (refs == 0) {
+                    stat_.rx_dropped++;
+                    PostLocked(rx_, slot);
+                    continue;
+                }
+                rx_refs_[slot] = refs;
+                stat_.rx_packets++;
+                stat_.rx_bytes += len;
+            }
+
+            // 割り込みを戻してから確かめ直し、その間に届いたものを取りこぼさない
+            rx_.Avail()[0] = 0;
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (rx_.used_idx == used[1]) {
+                break;
+            }
+            rx_.Avail()[0] = kAvailNoInterrupt;
+        }
+        KickLocked(rx_);
+    }
+
+    void NetDevice::ReleaseReceivedLocked(uint16_t slot) {
+        if (--rx_refs_[slot] > 0) {
+            return;
+        }
+        PostLocked(rx_, slot);
+        // デバイスの手元の受信バッファが少なくなっていれば、まとめずにすぐ通知する
+        const uint16_t posted = rx_.avail_idx - rx_.used_idx - rx_.unnotified;
+        if (rx_.unnotified >= kRxKickBatch || posted < rx_.num_slots / 4) {
+            KickLocked(rx_);
+        }
+    }
+
+    void NetDevice::ReleaseReceived(uint16_t slot) {
+        SpinLockGuard lock{lock_};
+        ReleaseReceivedLocked(slot);
+    }
+
+    void NetDevice::AddSocket(NetSocket* socket) {
+        SpinLockGuard lock{lock_};
+        sockets_.push_back(socket);
+    }
+
+    void NetDevice::RemoveSocket(NetSocket* socket) {
+        SpinLockGuard lock{lock_};
+        sockets_.erase(std::remove(sockets_.begin(), sockets_.end(), socket), sockets_.end());
+        // 読まれなかったフレームのバッファを手放す
+        SpinLockGuard socket_lock{socket->lock_};
+        for (; socket->head_ != socket->tail_; socket->head_++) {
+            ReleaseReceivedLocked(socket->queue_[socket->head_ % NetSocket::kMaxQueued].slot);
+        }
+        KickLocked(rx_);
+    }
+
+    void InitializeNet() {
+        for (int i = 0; i < pci::g_num_device; i++) {
+            auto& dev = pci::g_devices[i];
+            // ベンダID 0x1af4、レガシーのネットワークカードはデバイスID 0x1000
+            if (pci::ReadVendorId(dev) != 0x1af4 ||
+                pci::ReadDeviceId(dev.bus, dev.device, dev.function) != 0x1000) {
+                continue;
+            }
+            auto [net, err] = NetDevice::Create(dev);
+            if (err) {
+                Log(kWarn, "virtio-net at %d.%d.%d: %s\n", dev.bus, dev.device, dev.function, err.Name());
+                continue;
+            }
+            g_net_device = net;
+            if (auto err = net->Start(dev)) {
+                // 初期化の途中の割り込みが触らないよう、デバイスは止めたまま残しておく
+                g_net_device = nullptr;
+                Log(kWarn, "virtio-net at %d.%d.%d: %s\n", dev.bus, dev.device, dev.function, err.Name());
+                continue;
+            }
+            return;
+        }
+        Log(kInfo, "virtio-net: no device\n");
+    }
+
+    NetSocket::NetSocket(NetDevice& dev) : dev_{dev} {
+        dev_.AddSocket(this);
+    }
+
+    NetSocket::~NetSocket() {
+        dev_.RemoveSocket(this);
+    }
+
+    bool NetSocket::Deliver(uint16_t slot, uint16_t len) {
+        SpinLockGuard lock{lock_};
+        if (tail_ - head_ == kMaxQueued) {
+            return false;
+        }
+        queue_[tail_ % kMaxQueued] = {slot, len};
+        tail_++;
+        readers_.WakeAll();
+        if (poller_ != 0) {
+            g_task_manager->SendMessage(poller_, Message{Message::kFileReady});
+            poller_ = 0;
+        }
+        return true;
+    }
+
+    size_t NetSocket::Read(void* buf, size_t len) {
+        Packet packet;
+        {
+            SpinLockGuard lock{lock_};
+            while (head_ == tail_) {
+                readers_.Wait(lock_);
+            }
+            packet = queue_[head_ % kMaxQueued];
+            head_++;
+        }
+        // 受信バッファからアプリのバッファへの1回だけのコピー
+        const size_t n = std::min<size_t>(len, packet.len);
+        memcpy(buf, dev_.rx_.Buffer(packet.slot) + kFrameOffset, n);
+        dev_.ReleaseReceived(packet.slot);
+        return n;
+    }
+
+    size_t NetSocket::Write(const void* buf, size_t len) {
+        if (dev_.Send(buf, len)) {
+            return 0;
+        }
+        return len;
+    }
+
+    bool NetSocket::PollRead(uint64_t task_id) {
+        SpinLockGuard lock{lock_};
+        if (head_ != tail_) {
+            return true;
+        }
+        poller_ = task_id;
+        return false;
+    }
+} // namespace virtio
@@ -0,0 +1,155 @@
+/// virtio-net : 仮想マシン（QEMUなど）が提供するネットワークカード
+/// レガシー（virtio 0.9.5）のPCIインタフェースを使う。受信はMSI-X（なければMSI）の割り込みで知り、送信の完了は次の送信時に刈り取る
+/// パケットバッファは初期化時にまとめて確保してディスクリプタに結び付けておき、受信したフレームはコピーせずにソケットへ渡す
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "error.hpp"
+#include "file.hpp"
+#include "pci.hpp"
+#include "spinlock.hpp"
+#include "sync.hpp"
+#include "virtio_blk.hpp"
+
+namespace virtio {
+    /// パケットバッファ1つの大きさ（virtio-netのヘッダとイーサネットフレーム1つが収まる）
+    const size_t kPacketBufferSize = 2048;
+    /// 1つのキューで使うパケットバッファの最大数
+    const uint16_t kMaxNetSlots = 128;
+
+    struct NetStat {
+        uint64_t rx_packets, rx_bytes;
+        /// 受け取るソケットがない、またはどのソケットも溢れていて捨てた数
+        uint64_t rx_dropped;
+        uint64_t tx_packets, tx_bytes;
+        /// 送信キューが空くのを待った回数
+        uint64_t tx_waits;
+        uint64_t interrupts;
+        /// デバイスへの通知（キューごとのレジスタへの書き込み）の回数
+        uint64_t rx_kicks, tx_kicks;
+    };
+
+    class NetSocket;
+
+    class NetDevice {
+    public:
+        /// デバイスをリセットしてキューとパケットバッファを用意する。使えなければ kUnknownDevice など
+        static WithError<NetDevice*> Create(pci::Device& pci_dev);
+        /// 割り込みを割り当て、受信バッファを積んで動かし始める（g_net_deviceに置いてから呼ぶ）
+        Error Start(pci::Device& pci_dev);
+
+        const std::array<uint8_t, 6>& MacAddress() const { return mac_; }
+        NetStat Stat();
+
+        /// frameを送信キューに積む（送信キューが満杯なら、デバイスが送り終えるまで待つ）
+        /// デバイスへの通知は、続けて積まれる分とまとめてワーカタスクが行う
+        Error Send(const void* frame, size_t len);
+
+        /// 割り込みハンドラから呼ぶ。以降の受信の割り込みを止め、受信の処理をワーカタスクに積む
+        void OnInterrupt();
+        /// usedリングに返ってきた受信バッファをソケットに配り、割り込みを再び有効にする（ワーカタスクから呼ぶ）
+        void ProcessReceived();
+        /// 積んだまま通知していない送信を通知する（ワーカタスクから呼ぶ）
+        void FlushSend();
+
+    private:
+        friend class NetSocket;
+
+        /// 仮想キュー1本と、そのスロットに結び付けたパケットバッファ
+        /// スロットsはディスクリプタ2s（virtio-netのヘッダ）と2s + 1（フレーム）を使う
+        struct Queue {
+            uint16_t index;
+            uint16_t size;
+            uint8_t* ring;
+            size_t ring_frames;
+            uint16_t num_slots;
+            uint8_t* buffers;
+            size_t buffer_frames;
+            uint16_t avail_idx, used_idx;
+            /// availに積んだがデバイスに通知していない数
+            uint16_t unnotified;
+
+            VirtqDesc* Desc() { return reinterpret_cast<VirtqDesc*>(ring); }
+            /// flags, idx, ring[size]
+            volatile uint16_t* Avail() { return reinterpret_cast<volatile uint16_t*>(ring + VirtqAvailOffset(size)); }
+            /// flags, idx, ring[size]（ringはVirtqUsedElem）
+            volatile uint16_t* Used() { return reinterpret_cast<volatile uint16_t*>(ring + VirtqUsedOffset(size)); }
+            uint8_t* Buffer(uint16_t slot) { return buffers + kPacketBufferSize * slot; }
+        };
+
+        /// キューを1本用意し、スロットごとにヘッダとフレームのディスクリプタを結び付けておく
+        static WithError<Queue> SetUpQueue(uint16_t io_base, uint16_t index, bool device_writes);
+
+        NetDevice(uint16_t io_base, const Queue& rx, const Queue& tx);
+        /// スロットをavailリングに積む（lock_を取って呼ぶ）
+        void PostLocked(Queue& q, uint16_t slot);
+        /// 積んだ分をデバイスに通知する。デバイスが通知不要としていれば書き込まない（lock_を取って呼ぶ）
+        void KickLocked(Queue& q);
+        /// 送り終えた送信バッファを空きに戻す（lock_を取って呼ぶ）
+        void ReclaimSentLocked();
+        /// ソケットが読み終えた受信バッファを手放す。どのソケットも持っていなければデバイスに積み直す
+        void ReleaseReceived(uint16_t slot);
+        void ReleaseReceivedLocked(uint16_t slot);
+        void AddSocket(NetSocket* socket);
+        void RemoveSocket(NetSocket* socket);
+
+        SpinLock lock_;
+        const uint16_t io_base_;
+        std::array<uint8_t, 6> mac_{};
+        bool has_mac_{false}, msix_{false};
+        Queue rx_, tx_;
+        /// 受信バッファを持っているソケットの数
+        std::array<uint8_t, kMaxNetSlots> rx_refs_{};
+        /// 空いている送信スロット
+        std::vector<uint16_t> tx_free_;
+        std::vector<NetSocket*> sockets_;
+        NetStat stat_{};
+        /// 割り込みハンドラがロックを取らずに数える
+        uint64_t interrupts_{0};
+    };
+
+    /// 見つかったvirtio-net（なければ nullptr）
+    extern NetDevice* g_net_device;
+    /// PCIデバイスの一覧から最初のvirtio-netを探して初期化する（タスクと割り込みの初期化の後に呼ぶ）
+    void InitializeNet();
+
+    /// アプリが"@net"を開くと得るソケット。生のイーサネットフレームを1回の読み書きで1つずつ受け渡す
+    /// 受信したフレームはすべてのソケットに配る。読むまではパケットバッファを指したまま持っておく
+    class NetSocket : public IFileDescriptor {
+    public:
+        /// 読まれずに溜めておける受信フレームの数（溢れた分は捨てる）
+        static const size_t kMaxQueued = 32;
+
+        explicit NetSocket(NetDevice& dev);
+        ~NetSocket() override;
+        /// 受信したフレームを1つ読む（lenより長い部分は捨てる）。なければ届くまで待つ
+        size_t Read(void* buf, size_t len) override;
+        /// bufをイーサネットフレーム1つとして送る。送れなければ0
+        size_t Write(const void* buf, size_t len) override;
+        size_t Size() const override { return 0; }
+        size_t Load(void* buf, size_t len, size_t offset) override { return 0; }
+        bool PollRead(uint64_t task_id) override;
+
+    private:
+        friend class NetDevice;
+        /// 受信バッファのスロットを受け取る。溢れていればfalse（デバイスのlock_を取って呼ぶ）
+        bool Deliver(uint16_t slot, uint16_t len);
+
+        struct Packet {
+            uint16_t slot, len;
+        };
+
+        NetDevice& dev_;
+        SpinLock lock_;
+        std::array<Packet, kMaxQueued> queue_;
+        size_t head_{0}, tail_{0};
+        WaitQueue readers_;
+        /// 読めるようになったらkFileReadyを送るタスク（0 : なし）
+        uint64_t poller_{0};
+    };
+} // namespace virtio
@@ -1,5 +1,7 @@
 #include "window.hpp"
 
+#include <cstdlib>
+
 #include "font.hpp"
 #include "logger.hpp"
 
@@ -43,11 +45,6 @@ namespace {
 } // namespace
 
 Window::Window(int width, int height, PixelFormat shadow_format) : width_{width}, height_{height} {
-    data_.resize(height);
-    for (int y = 0; y < height; y++) {
-        data_[y].resize(width);
-    }
-
     FrameBufferConfig fb_config{};
     fb_config.frame_buffer = nullptr;
     fb_config.horizontal_resolution = width;
@@ -61,26 +58,58 @@ Window::Window(int width, int height, PixelFormat shadow_format) : width_{width}
 }
 
 void Window::DrawTo(FrameBuffer& dst, Vector2D<int> position, const Rectangle<int>& area) {
+    Rectangle<int> window_area{position, Size()};
+    // 重なり部分
+    Rectangle<int> intersection = area & window_area;
     if (!transparent_color_) {
-        Rectangle<int> window_area{position, Size()};
-        // 重なり部分
-        Rectangle<int> intersection = area & window_area;
-        dst.Copy(intersection.pos, shadow_buffer_, {intersection.pos - position, intersection.size});
+        const Rectangle<int> src_area{intersection.pos - position, intersection.size};
+        if (IsOpaque()) {
+            dst.Copy(intersection.pos, *front_, src_area);
+            return;
+        }
+        if (alpha_ == 0) {
+            return;
+        }
+        // 画面と形式が違って重ねられなければ、不透明なものとして描く
+        if (dst.Blend(intersection.pos, *front_, src_area, alpha_, per_pixel_alpha_)) {
+            dst.Copy(intersection.pos, *front_, src_area);
+        }
         return;
     }
 
     const auto tc = transparent_color_.value();
+    // 影バッファと画面の形式が同じなら、影バッファから透過色を除いて行ごとにコピーする
+    if (!dst.CopyTransparent(intersection.pos, *front_,
+                            {intersection.pos - position, intersection.size}, tc)) {
+        return;
+    }
     auto& writer = dst.Writer();
     // 条件式は、描画領域が画面端を超えた際に反対側から飛び出るのを防ぐのを意味する
-    for (int y = std::max(0, 0 - position.y);
-         y < std::min(Height(), writer.Height() - position.y);
-         y++) {
-        for (int x = std::max(0, 0 - position.x);
-             x < std::min(Width(), writer.Width() - position.x);
-             x++) {
-            const auto color = At(Vector2D<int>{x, y});
-            if (color != tc) {
-                writer.Write(position + Vector2D<int>{x, y}, color);
+    const int x_begin = std::max(intersection.pos.x, 0) - position.x;
+    const int x_end = std::min(intersection.pos.x + intersection.size.x, writer.Width()) - position.x;
+    const int y_begin = std::max(intersection.pos.y, 0) - position.y;
+    const int y_end = std::min(intersection.pos.y + intersection.size.y, writer.Height()) - position.y;
+    // 形式が違うときは、影バッファから色に戻しながら区切って処理する
+    const int kChunk = 128;
+    PixelColor row[kChunk];
+    for (int y = y_begin; y < y_end; y++) {
+        for (int chunk_begin = x_begin; chunk_begin < x_end; chunk_begin += kChunk) {
+            const int chunk_len = std::min(kChunk, x_end - chunk_begin);
+            for (int i = 0; i < chunk_len; i++) {
+                row[i] = front_->At({chunk_begin + i, y});
+            }
+            // 透過色でないピクセルが続く区間ごとにまとめて書く
+            int i = 0;
+            while (i < chunk_len) {
+                if (row[i] == tc) {
+                    i++;
+                    continue;
+                }
+                const int run_start = i;
+                while (i < chunk_len && row[i] != tc) {
+                    i++;
+                }
+                writer.WriteSpan(position + Vector2D<int>{chunk_begin + run_start, y}, &row[run_start], i - run_start);
             }
         }
     }
@@ -94,14 +123,79 @@ Window::WindowWriter* Window::Writer() {
     return &writer_;
 }
 
+Error Window::EnableDoubleBuffer() {
+    if (back_) {
+        return MAKE_ERROR(Error::kSuccess);
+    }
+    auto config = shadow_buffer_.Config();
+    config.frame_buffer = nullptr;
+    if (auto err = back_surface_.Initailize(config)) {
+        return err;
+    }
+    back_surface_.Copy({0, 0}, shadow_buffer_, {{0, 0}, Size()});
+    back_ = &back_surface_;
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void Window::Present(bool preserve) {
+    if (!back_) {
+        return;
+    }
+    std::swap(front_, back_);
+    if (preserve) {
+        back_->Copy({0, 0}, *front_, {{0, 0}, Size()});
+    }
+}
+
+void Window::PresentArea(const Rectangle<int>& area) {
+    if (back_) {
+        front_->Copy(area.pos, *back_, area);
+    }
+}
+
 /// 指定した位置のピクセルを返す
-const PixelColor& Window::At(Vector2D<int> pos) const {
-    return data_[pos.y][pos.x];
+PixelColor Window::At(Vector2D<int> pos) const {
+    return Surface().At(pos);
 }
 
 void Window::Write(Vector2D<int> pos, PixelColor color) {
-    data_[pos.y][pos.x] = color;
-    shadow_buffer_.Writer().Write(pos, color);
+    Surface().Writer().Write(pos, color);
+}
+
+void Window::FillRectangle(Vector2D<int> pos, Vector2D<int> size, PixelColor color) {
+    const auto start = ElementMax(pos, {0, 0});
+    const auto end = ElementMin(pos + size, Size());
+    if (start.x >= end.x || start.y >= end.y) {
+        return;
+    }
+    // シャドウバッファはフレームバッファの形式なので、行ごとにまとめて塗れる
+    Surface().Writer().FillRectangle(start, end - start, color);
+}
+
+void Window::WriteSpan(Vector2D<int> pos, const PixelColor* colors, int len) {
+    if (pos.y < 0 || pos.y >= height_) {
+        return;
+    }
+    const int x_begin = std::max(pos.x, 0), x_end = std::min(pos.x + len, width_);
+    if (x_begin >= x_end) {
+        return;
+    }
+    Surface().Writer().WriteSpan({x_begin, pos.y}, colors + (x_begin - pos.x), x_end - x_begin);
+}
+
+void Window::WriteARGBSpan(Vector2D<int> pos, const uint32_t* pixels, int len) {
+    Surface().WriteARGBSpan(pos, pixels, len);
+}
+
+void Window::WriteImage(Vector2D<int> pos, Vector2D<int> size, const void* image, size_t stride,
+                        ImageFormat format) {
+    Surface().WriteImage(pos, size, image, stride, format, per_pixel_alpha_);
+}
+
+void Window::WriteGlyphMask(Vector2D<int> pos, const uint8_t* mask, int mask_pitch,
+                            Vector2D<int> size, const PixelColor& color) {
+    // シャドウバッファはマスクを広げてまとめて書ける（はみ出す部分はFrameBufferWriterが切り取る）
+    Surface().Writer().WriteGlyphMask(pos, mask, mask_pitch, size, color);
 }
 
 int Window::Width() const {
@@ -117,7 +211,36 @@ Vector2D<int> Window::Size() const {
 }
 
 void Window::Move(Vector2D<int> dst_pos, const Rectangle<int>& src) {
-    shadow_buffer_.Move(dst_pos, src);
+    Surface().Move(dst_pos, src);
+}
+
+int Window::Scroll(Rectangle<int> area, Vector2D<int> delta, Rectangle<int>* exposed) {
+    area = area & Rectangle<int>{{0, 0}, Size()};
+    if (area.size.x <= 0 || area.size.y <= 0 || (delta.x == 0 && delta.y == 0)) {
+        return 0;
+    }
+    const int adx = std::abs(delta.x), ady = std::abs(delta.y);
+    if (adx >= area.size.x || ady >= area.size.y) { // 全部はみ出すので、ずらすものがない
+        exposed[0] = area;
+        return 1;
+    }
+
+    // 残る部分を移動する。行が重なる向きはFrameBuffer::Move()が考える
+    const Rectangle<int> src{area.pos + Vector2D<int>{std::max(-delta.x, 0), std::max(-delta.y, 0)},
+                             area.size - Vector2D<int>{adx, ady}};
+    Surface().Move(src.pos + delta, src);
+
+    // 空いた部分は、上下の帯（幅いっぱい）と、残りの高さの左右の帯に分ける
+    int n = 0;
+    if (ady > 0) {
+        const int y = delta.y > 0 ? area.pos.y : area.pos.y + area.size.y - ady;
+        exposed[n++] = {{area.pos.x, y}, {area.size.x, ady}};
+    }
+    if (adx > 0) {
+        const int x = delta.x > 0 ? area.pos.x : area.pos.x + area.size.x - adx;
+        exposed[n++] = {{x, area.pos.y + std::max(delta.y, 0)}, {adx, area.size.y - ady}};
+    }
+    return n;
 }
 
 WindowRegion Window::GetWindowRegion(Vector2D<int> pos) {
@@ -132,11 +255,14 @@ TopLevelWindow::TopLevelWindow(int width, int height, PixelFormat shadow_format,
 void TopLevelWindow::Activate() {
     Window::Activate();
     DrawWindowTitle(*Writer(), title_.c_str(), true);
+    // 2面のときも、タイトルバーはアプリが入れ替えるのを待たずに見せる
+    PresentArea({{0, 0}, {Width(), kTopLeftMargin.y}});
 }
 
 void TopLevelWindow::Deactivate() {
     Window::Deactivate();
     DrawWindowTitle(*Writer(), title_.c_str(), false);
+    PresentArea({{0, 0}, {Width(), kTopLeftMargin.y}});
 }
 
 WindowRegion TopLevelWindow::GetWindowRegion(Vector2D<int> pos) {
@@ -198,6 +324,7 @@ void DrawWindowTitle(PixelWriter& writer, const char* title, bool active) {
 
     // 右上に閉じるボタンを描画
     for (int y = 0; y < kCloseButtonHeight; y++) {
+        PixelColor row[kCloseButtonWidth];
         for (int x = 0; x < kCloseButtonWidth; x++) {
             PixelColor color = ToColor(0xffffff);
 
@@ -208,7 +335,8 @@ void DrawWindowTitle(PixelWriter& writer, const char* title, bool active) {
             } else if (k_close_button[y][x] == ':') {
                 color = ToColor(0x6c6c6c);
             }
-            writer.Write({win_w - 5 - kCloseButtonWidth + x, 5 + y}, color);
+            row[x] = color;
         }
+        writer.WriteSpan({win_w - 5 - kCloseButtonWidth, 5 + y}, row, kCloseButtonWidth);
     }
 }
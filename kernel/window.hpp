@@ -29,6 +29,19 @@ public:
         }
         virtual int Width() const override { return window_.Width(); }
         virtual int Height() const override { return window_.Height(); }
+        virtual void FillSpan(Vector2D<int> pos, int len, const PixelColor& color) override {
+            window_.FillRectangle(pos, {len, 1}, color);
+        }
+        virtual void WriteSpan(Vector2D<int> pos, const PixelColor* colors, int len) override {
+            window_.WriteSpan(pos, colors, len);
+        }
+        virtual void FillRectangle(const Vector2D<int>& pos, const Vector2D<int>& size, const PixelColor& color) override {
+            window_.FillRectangle(pos, size, color);
+        }
+        virtual void WriteGlyphMask(Vector2D<int> pos, const uint8_t* mask, int mask_pitch,
+                                    Vector2D<int> size, const PixelColor& color) override {
+            window_.WriteGlyphMask(pos, mask, mask_pitch, size, color);
+        }
 
     private:
         Window& window_;
@@ -46,13 +59,45 @@ public:
     /// area : dstの左上の基準とた描画対象範囲
     void DrawTo(FrameBuffer& dst, Vector2D<int> position, const Rectangle<int>& area);
     void SetTransparentColor(std::optional<PixelColor> color);
+    /// ウィンドウ全体の不透明度（255で不透明、0で見えない）。透過色があるときは透過色を優先する
+    void SetAlpha(uint8_t alpha) { alpha_ = alpha; }
+    uint8_t Alpha() const { return alpha_; }
+    /// trueなら、ピクセルごとの透明度（シャドウバッファの上位8ビット。WriteARGBSpan()で書く）も使って重ねる
+    void SetPerPixelAlpha(bool enable) { per_pixel_alpha_ = enable; }
+    bool PerPixelAlpha() const { return per_pixel_alpha_; }
+    /// 透過色も透明度もなく、下にあるものを完全に隠すならtrue
+    bool IsOpaque() const { return !transparent_color_ && alpha_ == 255 && !per_pixel_alpha_; }
     /// このインスタンスに紐付いたWindowWriterを取得
     WindowWriter* Writer();
 
-    /// 指定した位置のピクセルを返す
-    const PixelColor& At(Vector2D<int> pos) const;
+    /// 裏の面を用意して表の面の内容を写し、以降の描画はすべて裏の面に行う
+    /// 合成で読むのは表の面だけなので、描きかけの絵が画面に出ることがない
+    Error EnableDoubleBuffer();
+    bool DoubleBuffered() const { return back_ != nullptr; }
+    /// 表の面と裏の面を入れ替える。g_layer_mutexを持って呼ぶので、合成からは入れ替えの前後どちらかの絵が見える
+    /// preserveなら、新しい裏の面に新しい表の面を写し、続けて前の絵に描き足せるようにする
+    void Present(bool preserve);
+    /// 裏の面のarea（ウィンドウの左上を基準）だけを表の面に写す（タイトルバーなど、カーネルが描く部分を見せる）
+    void PresentArea(const Rectangle<int>& area);
+
+    /// 指定した位置のピクセルを返す（シャドウバッファから読み戻す）
+    PixelColor At(Vector2D<int> pos) const;
 
     void Write(Vector2D<int> pos, PixelColor color);
+    /// 矩形領域を塗りつぶす（ウィンドウからはみ出す部分は無視する）
+    void FillRectangle(Vector2D<int> pos, Vector2D<int> size, PixelColor color);
+    /// posから右へcolors[0]〜colors[len - 1]を書く（ウィンドウからはみ出す部分は無視する）
+    void WriteSpan(Vector2D<int> pos, const PixelColor* colors, int len);
+    /// posから右へ0xTTRRGGBB（TTは透明度。0で不透明、0xffで透明）の色をlen個書く（はみ出す部分は無視する）
+    /// PixelWriterを通した書き込みは不透明なピクセルになる
+    void WriteARGBSpan(Vector2D<int> pos, const uint32_t* pixels, int len);
+    /// posを左上に、アプリの画像を変換しながら書く（FrameBuffer::WriteImage()を参照）
+    /// PerPixelAlpha()のときだけ画像の透明度を残す
+    void WriteImage(Vector2D<int> pos, Vector2D<int> size, const void* image, size_t stride,
+                    ImageFormat format);
+    /// 1ピクセル1ビットのマスクの立っているピクセルをcolorで書く（ウィンドウからはみ出す部分は無視する）
+    void WriteGlyphMask(Vector2D<int> pos, const uint8_t* mask, int mask_pitch,
+                        Vector2D<int> size, const PixelColor& color);
 
     int Width() const;
     int Height() const;
@@ -60,6 +105,9 @@ public:
 
     /// このウィンドウの平面領域内で、矩形領域を移動する
     void Move(Vector2D<int> dst_pos, const Rectangle<int>& src);
+    /// areaの中身をその場でdeltaだけずらす。area（ウィンドウに収まる部分）から出た分は捨てる
+    /// 空いて描き直しが必要になった部分（最大2つの矩形）をexposedに入れ、その数を返す
+    int Scroll(Rectangle<int> area, Vector2D<int> delta, Rectangle<int>* exposed);
 
     /// タイトルバーをもたない描画領域ならなにもしない
     virtual void Activate() {}
@@ -70,13 +118,23 @@ public:
 
 private:
     int width_, height_;
-    std::vector<std::vector<PixelColor>> data_{};
     WindowWriter writer_{*this};
     /// 透過色
     std::optional<PixelColor> transparent_color_{std::nullopt};
+    uint8_t alpha_{255};
+    bool per_pixel_alpha_{false};
 
     /// 本命のメモリ領域には最適化されたmemcpyで後で一気に書き込む
+    /// ピクセルはここにだけ持ち、色が必要なときはここから読み戻す
     FrameBuffer shadow_buffer_{};
+    /// EnableDoubleBuffer()で用意する2つ目の面
+    FrameBuffer back_surface_{};
+    /// 合成で読む面と、描画する面（1面のときはnullptrで、front_に描く）
+    FrameBuffer* front_{&shadow_buffer_};
+    FrameBuffer* back_{nullptr};
+
+    FrameBuffer& Surface() { return back_ ? *back_ : *front_; }
+    const FrameBuffer& Surface() const { return back_ ? *back_ : *front_; }
 };
 
 /// タイトルバー付きのウィンドウ
@@ -95,6 +153,19 @@ public:
         virtual void Write(Vector2D<int> pos, const PixelColor& color) override {
             window_.Write(pos + kTopLeftMargin, color);
         }
+        virtual void FillSpan(Vector2D<int> pos, int len, const PixelColor& color) override {
+            window_.FillRectangle(pos + kTopLeftMargin, {len, 1}, color);
+        }
+        virtual void WriteSpan(Vector2D<int> pos, const PixelColor* colors, int len) override {
+            window_.WriteSpan(pos + kTopLeftMargin, colors, len);
+        }
+        virtual void FillRectangle(const Vector2D<int>& pos, const Vector2D<int>& size, const PixelColor& color) override {
+            window_.FillRectangle(pos + kTopLeftMargin, size, color);
+        }
+        virtual void WriteGlyphMask(Vector2D<int> pos, const uint8_t* mask, int mask_pitch,
+                                    Vector2D<int> size, const PixelColor& color) override {
+            window_.WriteGlyphMask(pos + kTopLeftMargin, mask, mask_pitch, size, color);
+        }
         virtual int Width() const override {
             return window_.Width() - kTopLeftMargin.x - kBottomRightMargin.x;
         }